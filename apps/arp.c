@@ -0,0 +1,349 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki-net.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arp.h"
+
+#if ARP_WAYS > ARP_ENTRIES
+#error "ARP_WAYS can't be more than ARP_ENTRIES"
+#endif
+
+// Ethernet header plus an ARP packet for IPv4
+struct arp_hdr {
+	struct uip_eth_hdr ethhdr;
+	uint16_t hwtype;
+	uint16_t protocol;
+	uint8_t hwlen;
+	uint8_t protolen;
+	uint16_t opcode;
+	struct uip_eth_addr shwaddr;
+	uip_ipaddr_t sipaddr;
+	struct uip_eth_addr dhwaddr;
+	uip_ipaddr_t dipaddr;
+} __attribute__((packed));
+
+struct ethip_hdr {
+	struct uip_eth_hdr ethhdr;
+	uint8_t vhl, tos, len[2], ipid[2], ipoffset[2], ttl, proto;
+	uint16_t ipchksum;
+	uip_ipaddr_t srcipaddr, destipaddr;
+} __attribute__((packed));
+
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+#define ARP_HWTYPE_ETH 1
+
+#define UNSET(addr) ((addr)->u16[0] == 0 && (addr)->u16[1] == 0)
+
+#define BUF ((struct arp_hdr *)&uip_buf[0])
+#define IPBUF ((struct ethip_hdr *)&uip_buf[0])
+
+struct arp_entry {
+	uip_ipaddr_t ipaddr; // all zeroes when free
+	struct uip_eth_addr ethaddr;
+	uint8_t time; // arptime when last confirmed
+};
+
+static struct arp_entry table[ARP_ENTRIES];
+static uint8_t arptime;
+
+// The last slot is the default router, filled in by arp_refresh()
+static uip_ipaddr_t pins[ARP_PINS + 1];
+static uint8_t asked[ARP_PINS + 1]; // arptime of the last request
+
+arp_stats_t arp_stats;
+
+static uint8_t hash(const uip_ipaddr_t *addr) {
+	return (addr->u8[2] ^ addr->u8[3]) % ARP_ENTRIES;
+}
+
+static struct arp_entry *slot(uint8_t h, uint8_t way) {
+	h += way;
+	return &table[h < ARP_ENTRIES ? h : h - ARP_ENTRIES];
+}
+
+static struct arp_entry *find(const uip_ipaddr_t *addr) {
+	uint8_t h = hash(addr);
+
+	for (uint8_t w = 0; w < ARP_WAYS; w++) {
+		struct arp_entry *e = slot(h, w);
+
+		if (uip_ipaddr_cmp(&e->ipaddr, addr)) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static uint8_t pinned(const uip_ipaddr_t *addr) {
+	if (uip_ipaddr_cmp(addr, &uip_draddr)) {
+		return 1;
+	}
+
+	for (uint8_t i = 0; i < ARP_PINS; i++) {
+		if (uip_ipaddr_cmp(addr, &pins[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void update(const uip_ipaddr_t *addr, const struct uip_eth_addr *eth,
+	uint8_t create)
+{
+	struct arp_entry *e = find(addr);
+	struct arp_entry *victim = NULL;
+	uint8_t h, age = 0;
+
+	if (!e) {
+		if (!create) {
+			return;
+		}
+
+		// A free slot, or else the oldest one that isn't pinned
+		h = hash(addr);
+		for (uint8_t w = 0; w < ARP_WAYS; w++) {
+			e = slot(h, w);
+
+			if (UNSET(&e->ipaddr)) {
+				victim = e;
+				break;
+			}
+			if (!pinned(&e->ipaddr) &&
+				(!victim || (uint8_t)(arptime - e->time) > age))
+			{
+				victim = e;
+				age = arptime - e->time;
+			}
+		}
+
+		if (!victim) {
+			return;
+		}
+		if (!UNSET(&victim->ipaddr)) {
+			arp_stats.evictions++;
+		}
+
+		e = victim;
+		uip_ipaddr_copy(&e->ipaddr, addr);
+	}
+
+	memcpy(&e->ethaddr, eth, sizeof(e->ethaddr));
+	e->time = arptime;
+}
+
+// Replace whatever is in uip_buf with a request for addr
+static void request(const uip_ipaddr_t *addr) {
+	memset(BUF->ethhdr.dest.addr, 0xff, 6);
+	memset(BUF->dhwaddr.addr, 0x00, 6);
+	memcpy(BUF->ethhdr.src.addr, uip_ethaddr.addr, 6);
+	memcpy(BUF->shwaddr.addr, uip_ethaddr.addr, 6);
+
+	uip_ipaddr_copy(&BUF->dipaddr, addr);
+	uip_ipaddr_copy(&BUF->sipaddr, &uip_hostaddr);
+	BUF->opcode = UIP_HTONS(ARP_REQUEST);
+	BUF->hwtype = UIP_HTONS(ARP_HWTYPE_ETH);
+	BUF->protocol = UIP_HTONS(UIP_ETHTYPE_IP);
+	BUF->hwlen = 6;
+	BUF->protolen = 4;
+	BUF->ethhdr.type = UIP_HTONS(UIP_ETHTYPE_ARP);
+
+	uip_appdata = &uip_buf[UIP_TCPIP_HLEN + UIP_LLH_LEN];
+	uip_len = sizeof(struct arp_hdr);
+}
+
+void uip_arp_init(void) {
+	memset(table, 0, sizeof(table));
+}
+
+void uip_arp_timer(void) {
+	arptime++;
+
+	for (uint8_t i = 0; i < ARP_ENTRIES; i++) {
+		struct arp_entry *e = &table[i];
+
+		if (!UNSET(&e->ipaddr) &&
+			(uint8_t)(arptime - e->time) >= ARP_MAXAGE &&
+			!pinned(&e->ipaddr))
+		{
+			memset(&e->ipaddr, 0, sizeof(e->ipaddr));
+		}
+	}
+}
+
+void uip_arp_arpin(void) {
+	if (uip_len < sizeof(struct arp_hdr)) {
+		uip_len = 0;
+		return;
+	}
+	uip_len = 0;
+
+	if (!uip_ipaddr_cmp(&BUF->dipaddr, &uip_hostaddr)) {
+		// Not for us, but keep what we know up to date (RFC 826)
+		update(&BUF->sipaddr, &BUF->shwaddr, 0);
+		return;
+	}
+
+	switch (BUF->opcode) {
+	case UIP_HTONS(ARP_REQUEST):
+		// They're about to talk to us, so they go in the table
+		update(&BUF->sipaddr, &BUF->shwaddr, 1);
+
+		BUF->opcode = UIP_HTONS(ARP_REPLY);
+		memcpy(BUF->dhwaddr.addr, BUF->shwaddr.addr, 6);
+		memcpy(BUF->shwaddr.addr, uip_ethaddr.addr, 6);
+		memcpy(BUF->ethhdr.src.addr, uip_ethaddr.addr, 6);
+		memcpy(BUF->ethhdr.dest.addr, BUF->dhwaddr.addr, 6);
+
+		uip_ipaddr_copy(&BUF->dipaddr, &BUF->sipaddr);
+		uip_ipaddr_copy(&BUF->sipaddr, &uip_hostaddr);
+
+		BUF->ethhdr.type = UIP_HTONS(UIP_ETHTYPE_ARP);
+		uip_len = sizeof(struct arp_hdr);
+		break;
+
+	case UIP_HTONS(ARP_REPLY):
+		update(&BUF->sipaddr, &BUF->shwaddr, 1);
+		break;
+	}
+}
+
+void uip_arp_out(void) {
+	const uip_ipaddr_t *next;
+	struct arp_entry *e;
+
+	if (IPBUF->destipaddr.u16[0] == 0xffff &&
+		IPBUF->destipaddr.u16[1] == 0xffff)
+	{
+		memset(IPBUF->ethhdr.dest.addr, 0xff, 6);
+	}
+	else if (IPBUF->destipaddr.u8[0] == 224) {
+		// Multicast
+		IPBUF->ethhdr.dest.addr[0] = 0x01;
+		IPBUF->ethhdr.dest.addr[1] = 0x00;
+		IPBUF->ethhdr.dest.addr[2] = 0x5e;
+		IPBUF->ethhdr.dest.addr[3] = IPBUF->destipaddr.u8[1];
+		IPBUF->ethhdr.dest.addr[4] = IPBUF->destipaddr.u8[2];
+		IPBUF->ethhdr.dest.addr[5] = IPBUF->destipaddr.u8[3];
+	}
+	else {
+		// Off the local network it goes via the default router
+		if (uip_ipaddr_maskcmp(&IPBUF->destipaddr, &uip_hostaddr,
+			&uip_netmask))
+		{
+			next = &IPBUF->destipaddr;
+		}
+		else {
+			next = &uip_draddr;
+		}
+
+		e = find(next);
+		if (!e) {
+			// The packet is lost; ask so the retransmission gets through
+			arp_stats.misses++;
+			request(next);
+			return;
+		}
+
+		arp_stats.hits++;
+		memcpy(IPBUF->ethhdr.dest.addr, e->ethaddr.addr, 6);
+	}
+
+	memcpy(IPBUF->ethhdr.src.addr, uip_ethaddr.addr, 6);
+	IPBUF->ethhdr.type = UIP_HTONS(UIP_ETHTYPE_IP);
+	uip_len += sizeof(struct uip_eth_hdr);
+}
+
+int arp_pin(const uip_ipaddr_t *addr) {
+	uint8_t i;
+
+	if (pinned(addr)) {
+		return 0;
+	}
+
+	for (i = 0; i < ARP_PINS; i++) {
+		if (UNSET(&pins[i])) {
+			uip_ipaddr_copy(&pins[i], addr);
+			asked[i] = arptime - ARP_RETRY;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void arp_unpin(const uip_ipaddr_t *addr) {
+	for (uint8_t i = 0; i < ARP_PINS; i++) {
+		if (uip_ipaddr_cmp(&pins[i], addr)) {
+			memset(&pins[i], 0, sizeof(pins[i]));
+		}
+	}
+}
+
+uint8_t arp_count(void) {
+	uint8_t n = 0;
+
+	for (uint8_t i = 0; i < ARP_ENTRIES; i++) {
+		if (!UNSET(&table[i].ipaddr)) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+uint8_t arp_refresh(void) {
+	if (!uip_ipaddr_cmp(&pins[ARP_PINS], &uip_draddr)) {
+		uip_ipaddr_copy(&pins[ARP_PINS], &uip_draddr);
+		asked[ARP_PINS] = arptime - ARP_RETRY;
+	}
+
+	for (uint8_t i = 0; i <= ARP_PINS; i++) {
+		struct arp_entry *e;
+
+		// Only what's on the local network has an entry of its own
+		if (UNSET(&pins[i]) ||
+			!uip_ipaddr_maskcmp(&pins[i], &uip_hostaddr, &uip_netmask))
+		{
+			continue;
+		}
+
+		// Ask again once it has gone unconfirmed for a while, and then every
+		// ARP_RETRY ticks until it answers
+		e = find(&pins[i]);
+		if ((e && (uint8_t)(arptime - e->time) < ARP_REFRESH) ||
+			(uint8_t)(arptime - asked[i]) < ARP_RETRY)
+		{
+			continue;
+		}
+
+		asked[i] = arptime;
+		arp_stats.refreshes++;
+		request(&pins[i]);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef ARP_H
+#define ARP_H
+
+#include <contiki-net.h>
+
+/*
+ * ARP cache, in place of uIP's uip_arp.c.
+ *
+ * Entries are found by hashing the low bytes of the address and looking at
+ * ARP_WAYS slots from there, so a lookup costs the same however big the
+ * table is made. A new entry takes a free slot in its window, or else the
+ * one that was confirmed longest ago.
+ *
+ * The default router and up to ARP_PINS other addresses are pinned: their
+ * entries never age out or get pushed out, and arp_refresh() asks for them
+ * again in the background before they go stale, so traffic to them never
+ * has to wait for an ARP round trip.
+ */
+
+// Slots in the table
+#ifndef CONFIG_APPS_ARP_ENTRIES
+#define ARP_ENTRIES 16
+#else
+#define ARP_ENTRIES CONFIG_APPS_ARP_ENTRIES
+#endif
+
+// Slots an address can live in
+#ifndef CONFIG_APPS_ARP_WAYS
+#define ARP_WAYS 4
+#else
+#define ARP_WAYS CONFIG_APPS_ARP_WAYS
+#endif
+
+// Addresses that can be pinned, besides the default router
+#ifndef CONFIG_APPS_ARP_PINS
+#define ARP_PINS 2
+#else
+#define ARP_PINS CONFIG_APPS_ARP_PINS
+#endif
+
+// In uip_arp_timer() ticks (10 s): entries are dropped after ARP_MAXAGE,
+// pinned ones are asked for again after ARP_REFRESH and then every
+// ARP_RETRY until they answer
+#define ARP_MAXAGE 120
+#define ARP_REFRESH 30
+#define ARP_RETRY 6
+
+typedef struct {
+	uint32_t hits; // frames sent to a cached address
+	uint16_t misses; // frames replaced by an ARP request
+	uint16_t evictions; // entries pushed out by a new one
+	uint16_t refreshes; // requests sent for pinned addresses
+} arp_stats_t;
+
+extern arp_stats_t arp_stats;
+
+// Keep addr (on the local network) in the cache; returns -1 if there's no
+// room for another pin
+int arp_pin(const uip_ipaddr_t *addr);
+void arp_unpin(const uip_ipaddr_t *addr);
+
+// Entries in use
+uint8_t arp_count(void);
+
+// Call after uip_arp_timer() and send what it leaves in uip_buf for as
+// long as it returns 1: an ARP request for a pinned address going stale
+uint8_t arp_refresh(void);
+
+#endif // ARP_H
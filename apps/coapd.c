@@ -0,0 +1,697 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <contiki-net.h>
+#include <init.h>
+
+#if CONFIG_LIB_OWTEMP
+#include <notify.h>
+#include <owtemp.h>
+#endif
+
+#include "coapd.h"
+
+PROCESS(coapd_process, "CoAP server");
+INIT_PROCESS(coapd_process);
+
+#define UDPIPBUF ((struct uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN])
+
+// Messages are built where uIP sends UDP data from (and where requests
+// arrive), so uip_udp_packet_sendto() copies them onto themselves
+#define COAPD_BUF ((uint8_t *)&uip_buf[UIP_LLH_LEN + UIP_IPUDPH_LEN])
+
+// The message size RFC 7252 suggests when the path MTU isn't known, or as
+// much as uip_buf holds
+#define COAPD_ROOM (UIP_BUFSIZE - UIP_LLH_LEN - UIP_IPUDPH_LEN)
+#define COAPD_MSG_MAX (COAPD_ROOM < 1152 ? COAPD_ROOM : 1152)
+
+// Longest Uri-Path we need to recognise, "temps/" and a ROM
+#define COAPD_PATHLEN 24
+
+#define COAP_VERSION 1
+
+#define COAP_CON 0
+#define COAP_NON 1
+#define COAP_ACK 2
+#define COAP_RST 3
+
+#define COAP_EMPTY 0x00
+#define COAP_GET 0x01
+#define COAP_CONTENT 0x45 // 2.05
+#define COAP_BAD_OPTION 0x82 // 4.02
+#define COAP_NOT_FOUND 0x84 // 4.04
+#define COAP_METHOD_NOT_ALLOWED 0x85 // 4.05
+
+#define COAP_OPT_URI_HOST 3
+#define COAP_OPT_OBSERVE 6
+#define COAP_OPT_URI_PORT 7
+#define COAP_OPT_URI_PATH 11
+#define COAP_OPT_CONTENT_FORMAT 12
+#define COAP_OPT_URI_QUERY 15
+#define COAP_OPT_ACCEPT 17
+
+#define COAP_TEXT_PLAIN 0
+#define COAP_LINK_FORMAT 40
+
+#define COAP_PAYLOAD_MARKER 0xff
+
+#define RES_NONE 0
+#define RES_CORE 1
+#define RES_UPTIME 2
+#define RES_TEMPS 3
+#define RES_TEMP 4
+
+// A message, as it was parsed or is to be built
+struct coap_msg {
+	uint8_t type;
+	uint8_t code;
+	uint16_t mid;
+	uint8_t tkl;
+	uint8_t token[8];
+	int32_t observe; // -1 if there's no Observe option
+	uint8_t res; // RES_* the Uri-Path names
+	uint8_t sensor; // owtemp_readings[] index for RES_TEMP
+	uint8_t bad_option : 1; // a critical option we don't know
+};
+
+struct observer {
+	uip_ipaddr_t addr;
+	uint16_t port; // network byte order
+	uint8_t token[8];
+	uint8_t tkl;
+	uint8_t res; // RES_NONE if the slot is free
+	uint8_t sensor;
+	uint16_t mid; // of the last notification
+	uint8_t count; // notifications since the last confirmable one
+	uint8_t unacked : 1; // the last confirmable one hasn't been acknowledged
+#if CONFIG_LIB_OWTEMP
+	uint8_t valid : 1; // the last reading sent for RES_TEMP
+	int16_t temp;
+#endif
+};
+
+// Its appstate is &conn, which tells its events apart
+static struct uip_udp_conn *conn;
+
+static struct observer observers[COAPD_OBSERVERS];
+static uint16_t next_mid;
+static uint32_t observe_seq; // only the bottom 24 bits are sent
+
+#if CONFIG_LIB_OWTEMP
+static struct notify_sub owtemp_sub;
+#endif
+
+/*
+ * Read an option delta or length nibble's extended bytes. Returns -1 for the
+ * reserved value 15, or if the message ends first.
+ */
+static int option_ext(const uint8_t **p, const uint8_t *end, uint16_t *v) {
+	if (*v == 13) {
+		if (end - *p < 1) {
+			return -1;
+		}
+		*v = 13 + *(*p)++;
+	}
+	else if (*v == 14) {
+		if (end - *p < 2) {
+			return -1;
+		}
+		*v = 269 + ((*p)[0] << 8) + (*p)[1];
+		*p += 2;
+	}
+	else if (*v == 15) {
+		return -1;
+	}
+
+	return 0;
+}
+
+#if CONFIG_LIB_OWTEMP
+// Find the sensor a ROM in hex belongs to, -1 if there isn't one
+static int find_sensor(const char *rom) {
+	char hex[17];
+
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		const owtemp_reading_t *r = &owtemp_readings[i];
+
+		if (!r->used) {
+			continue;
+		}
+
+		sprintf_P(hex, PSTR("%02x%02x%02x%02x%02x%02x%02x%02x"),
+			r->addr.u[0], r->addr.u[1], r->addr.u[2], r->addr.u[3],
+			r->addr.u[4], r->addr.u[5], r->addr.u[6], r->addr.u[7]);
+		if (strcasecmp(rom, hex) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+#endif
+
+static uint8_t find_resource(const char *path, uint8_t *sensor) {
+	if (strcmp_P(path, PSTR(".well-known/core")) == 0) {
+		return RES_CORE;
+	}
+	else if (strcmp_P(path, PSTR("uptime")) == 0) {
+		return RES_UPTIME;
+	}
+#if CONFIG_LIB_OWTEMP
+	else if (strcmp_P(path, PSTR("temps")) == 0) {
+		return RES_TEMPS;
+	}
+	else if (strncmp_P(path, PSTR("temps/"), 6) == 0) {
+		int i = find_sensor(&path[6]);
+
+		if (i >= 0) {
+			*sensor = i;
+			return RES_TEMP;
+		}
+	}
+#endif
+
+	return RES_NONE;
+}
+
+/*
+ * Parse the message in buf into m. Returns -1 if it isn't well formed; as
+ * much of the header as was there is filled in regardless.
+ */
+static int parse(const uint8_t *buf, uint16_t len, struct coap_msg *m) {
+	const uint8_t *p = &buf[4];
+	const uint8_t *end = &buf[len];
+	char path[COAPD_PATHLEN + 1];
+	uint8_t pathlen = 0;
+	uint16_t opt = 0;
+	uint16_t delta, olen;
+
+	memset(m, 0, sizeof(*m));
+	m->type = COAP_NON;
+	m->observe = -1;
+
+	if (len < 4 || (buf[0] >> 6) != COAP_VERSION) {
+		return -1;
+	}
+
+	m->type = (buf[0] >> 4) & 3;
+	m->tkl = buf[0] & 15;
+	m->code = buf[1];
+	m->mid = (buf[2] << 8) | buf[3];
+
+	if (m->tkl > sizeof(m->token) || end - p < m->tkl) {
+		return -1;
+	}
+	memcpy(m->token, p, m->tkl);
+	p += m->tkl;
+
+	while (p < end && *p != COAP_PAYLOAD_MARKER) {
+		delta = *p >> 4;
+		olen = *p & 15;
+		p++;
+
+		if (option_ext(&p, end, &delta) || option_ext(&p, end, &olen) ||
+			end - p < olen)
+		{
+			return -1;
+		}
+		opt += delta;
+
+		switch (opt) {
+		case COAP_OPT_URI_PATH:
+			// Segments are joined up with slashes; a path too long to
+			// fit can't be one of ours, so just mark it as such
+			if (pathlen && pathlen < sizeof(path)) {
+				path[pathlen++] = '/';
+			}
+			if (pathlen + olen < sizeof(path)) {
+				memcpy(&path[pathlen], p, olen);
+				pathlen += olen;
+			}
+			else {
+				pathlen = sizeof(path);
+			}
+			break;
+
+		case COAP_OPT_OBSERVE:
+			if (olen > 3) {
+				return -1;
+			}
+			m->observe = 0;
+			for (uint8_t i = 0; i < olen; i++) {
+				m->observe = (m->observe << 8) | p[i];
+			}
+			break;
+
+		// Critical, but they only say what's being asked for, which can
+		// only be us and text
+		case COAP_OPT_URI_HOST:
+		case COAP_OPT_URI_PORT:
+		case COAP_OPT_URI_QUERY:
+		case COAP_OPT_ACCEPT:
+			break;
+
+		default:
+			// Elective options (even numbers) can be ignored
+			if (opt & 1) {
+				m->bad_option = 1;
+			}
+			break;
+		}
+
+		p += olen;
+	}
+
+	// A payload marker has to have a payload after it; the payload itself
+	// isn't wanted for a GET
+	if (p < end && end - p == 1) {
+		return -1;
+	}
+
+	if (pathlen < sizeof(path)) {
+		path[pathlen] = '\0';
+		m->res = find_resource(path, &m->sensor);
+	}
+
+	return 0;
+}
+
+// Add an option with an unsigned value, in as few bytes as will hold it.
+// Everything we send has deltas and lengths that fit in the first byte.
+static uint8_t *put_option(uint8_t *p, uint16_t *last, uint8_t opt,
+	uint32_t value)
+{
+	uint8_t len = value > 0xffff ? 3 : value > 0xff ? 2 : value ? 1 : 0;
+
+	*p++ = ((opt - *last) << 4) | len;
+	*last = opt;
+
+	while (len--) {
+		*p++ = value >> (8 * len);
+	}
+
+	return p;
+}
+
+// Write out the body of a resource, returning its length or -1 if it has
+// gone away
+static int payload(const struct coap_msg *m, char *buf, int len,
+	uint8_t *format)
+{
+	int ret = 0;
+	int n;
+
+	*format = COAP_TEXT_PLAIN;
+
+	switch (m->res) {
+	case RES_CORE:
+		*format = COAP_LINK_FORMAT;
+		ret = snprintf_P(buf, len, PSTR("</uptime>"));
+#if CONFIG_LIB_OWTEMP
+		ret += snprintf_P(&buf[ret], len - ret, PSTR(",</temps>;obs"));
+		for (uint8_t i = 0; i < OWTEMP_SENSORS && ret < len; i++) {
+			const owtemp_reading_t *r = &owtemp_readings[i];
+
+			if (!r->used) {
+				continue;
+			}
+
+			n = snprintf_P(&buf[ret], len - ret,
+				PSTR(",</temps/%02x%02x%02x%02x%02x%02x%02x%02x>;obs"),
+				r->addr.u[0], r->addr.u[1], r->addr.u[2], r->addr.u[3],
+				r->addr.u[4], r->addr.u[5], r->addr.u[6], r->addr.u[7]);
+			if (n >= len - ret) {
+				break;
+			}
+			ret += n;
+		}
+#endif
+		return ret;
+
+	case RES_UPTIME:
+		return snprintf_P(buf, len, PSTR("%lu"),
+			(unsigned long)clock_seconds());
+
+#if CONFIG_LIB_OWTEMP
+	case RES_TEMPS:
+		// As many whole lines as fit
+		for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+			const owtemp_reading_t *r = &owtemp_readings[i];
+
+			if (!r->used) {
+				continue;
+			}
+
+			n = snprintf_P(&buf[ret], len - ret,
+				PSTR("%02x%02x%02x%02x%02x%02x%02x%02x,%u,"),
+				r->addr.u[0], r->addr.u[1], r->addr.u[2], r->addr.u[3],
+				r->addr.u[4], r->addr.u[5], r->addr.u[6], r->addr.u[7],
+				r->channel);
+			if (n < len - ret) {
+				n += snprintf_P(&buf[ret + n], len - ret - n,
+					r->valid ? PSTR("%d\n") : PSTR("\n"), r->temp);
+			}
+			if (n >= len - ret) {
+				break;
+			}
+			ret += n;
+		}
+		return ret;
+
+	case RES_TEMP: {
+		const owtemp_reading_t *r = &owtemp_readings[m->sensor];
+
+		if (!r->used) {
+			return -1;
+		}
+		if (!r->valid) {
+			return 0;
+		}
+		return snprintf_P(buf, len, PSTR("%d"), r->temp);
+	}
+#endif
+	}
+
+	return 0;
+}
+
+/*
+ * Build a message into COAPD_BUF and return its length. A 2.05 comes with
+ * the resource m names (or turns into a 4.04 if that has gone away), and
+ * anything else is sent without a payload.
+ */
+static uint16_t build(struct coap_msg *m) {
+	uint8_t *buf = COAPD_BUF;
+	uint8_t *p = &buf[4];
+	uint16_t last = 0;
+	uint8_t format = COAP_TEXT_PLAIN;
+	int len = 0;
+
+	if (m->code == COAP_CONTENT) {
+		// Leave room for the options in front of it: Observe, Content-Format
+		// and the payload marker
+		uint8_t *body = &buf[4 + m->tkl + 4 + 2 + 1];
+
+		len = payload(m, (char *)body, COAPD_MSG_MAX - (body - buf), &format);
+		if (len < 0) {
+			m->code = COAP_NOT_FOUND;
+			m->observe = -1;
+			len = 0;
+		}
+		else if (len >= COAPD_MSG_MAX - (body - buf)) {
+			len = COAPD_MSG_MAX - (body - buf) - 1;
+		}
+	}
+
+	buf[0] = (COAP_VERSION << 6) | (m->type << 4) | m->tkl;
+	buf[1] = m->code;
+	buf[2] = m->mid >> 8;
+	buf[3] = m->mid;
+	memcpy(p, m->token, m->tkl);
+	p += m->tkl;
+
+	if (m->observe >= 0) {
+		p = put_option(p, &last, COAP_OPT_OBSERVE, m->observe & 0xffffff);
+	}
+	if (m->code == COAP_CONTENT) {
+		p = put_option(p, &last, COAP_OPT_CONTENT_FORMAT, format);
+	}
+
+	// The options may have come up short of the room left for them
+	if (len) {
+		*p++ = COAP_PAYLOAD_MARKER;
+		memmove(p, &buf[4 + m->tkl + 4 + 2 + 1], len);
+		p += len;
+	}
+
+	return p - buf;
+}
+
+static void send_empty(uint8_t type, uint16_t mid, const uip_ipaddr_t *addr,
+	uint16_t port)
+{
+	struct coap_msg m;
+
+	memset(&m, 0, sizeof(m));
+	m.type = type;
+	m.code = COAP_EMPTY;
+	m.mid = mid;
+	m.observe = -1;
+
+	uip_udp_packet_sendto(conn, COAPD_BUF, build(&m), addr, port);
+}
+
+static struct observer *find_observer(const uip_ipaddr_t *addr,
+	uint16_t port, const struct coap_msg *m)
+{
+	for (uint8_t i = 0; i < COAPD_OBSERVERS; i++) {
+		struct observer *o = &observers[i];
+
+		if (o->res != RES_NONE && o->port == port &&
+			uip_ipaddr_cmp(&o->addr, addr) && o->tkl == m->tkl &&
+			memcmp(o->token, m->token, m->tkl) == 0)
+		{
+			return o;
+		}
+	}
+
+	return NULL;
+}
+
+// Register (or refresh) an observation, returns NULL if there's no room
+static struct observer *observe(const uip_ipaddr_t *addr, uint16_t port,
+	const struct coap_msg *m)
+{
+	struct observer *o = find_observer(addr, port, m);
+
+	for (uint8_t i = 0; o == NULL && i < COAPD_OBSERVERS; i++) {
+		if (observers[i].res == RES_NONE) {
+			o = &observers[i];
+		}
+	}
+	if (o == NULL) {
+		return NULL;
+	}
+
+	memset(o, 0, sizeof(*o));
+	uip_ipaddr_copy(&o->addr, addr);
+	o->port = port;
+	o->tkl = m->tkl;
+	memcpy(o->token, m->token, m->tkl);
+	o->res = m->res;
+	o->sensor = m->sensor;
+	o->mid = m->mid;
+#if CONFIG_LIB_OWTEMP
+	if (m->res == RES_TEMP) {
+		o->valid = owtemp_readings[m->sensor].valid;
+		o->temp = owtemp_readings[m->sensor].temp;
+	}
+#endif
+
+	return o;
+}
+
+// An ACK or RST from an observer, for one of its notifications
+static void observer_reply(const uip_ipaddr_t *addr, uint16_t port,
+	const struct coap_msg *m)
+{
+	for (uint8_t i = 0; i < COAPD_OBSERVERS; i++) {
+		struct observer *o = &observers[i];
+
+		if (o->res == RES_NONE || o->mid != m->mid || o->port != port ||
+			!uip_ipaddr_cmp(&o->addr, addr))
+		{
+			continue;
+		}
+
+		if (m->type == COAP_RST) {
+			o->res = RES_NONE;
+		}
+		else {
+			o->unacked = 0;
+		}
+	}
+}
+
+static void handle_request(void) {
+	struct coap_msg m;
+	struct observer *o;
+	uip_ipaddr_t addr;
+	uint16_t port;
+	uint8_t type;
+
+	if (!uip_newdata()) {
+		return;
+	}
+
+	// The reply goes out over the top of the request, headers and all
+	uip_ipaddr_copy(&addr, &UDPIPBUF->srcipaddr);
+	port = UDPIPBUF->srcport;
+
+	if (parse(uip_appdata, uip_datalen(), &m)) {
+		// Confirmable messages we can't make sense of are rejected, the
+		// rest are just ignored
+		if (m.type == COAP_CON) {
+			send_empty(COAP_RST, m.mid, &addr, port);
+		}
+		return;
+	}
+
+	if (m.type == COAP_ACK || m.type == COAP_RST) {
+		observer_reply(&addr, port, &m);
+		return;
+	}
+
+	// An empty confirmable message is a ping; anything that isn't a
+	// request is nothing we asked for
+	if (m.code == COAP_EMPTY || (m.code >> 5) != 0) {
+		if (m.type == COAP_CON) {
+			send_empty(COAP_RST, m.mid, &addr, port);
+		}
+		return;
+	}
+
+	type = m.type;
+	m.type = (type == COAP_CON) ? COAP_ACK : COAP_NON;
+	if (type != COAP_CON) {
+		m.mid = next_mid++;
+	}
+
+	if (m.bad_option) {
+		m.code = COAP_BAD_OPTION;
+	}
+	else if (m.code != COAP_GET) {
+		m.code = COAP_METHOD_NOT_ALLOWED;
+	}
+	else if (m.res == RES_NONE) {
+		m.code = COAP_NOT_FOUND;
+	}
+	else {
+		m.code = COAP_CONTENT;
+	}
+
+	// Anything but a successful registration ends an observation with the
+	// same token; a full table just means the client doesn't get one
+	o = NULL;
+	if (m.code == COAP_CONTENT && m.observe == 0 &&
+		(m.res == RES_TEMPS || m.res == RES_TEMP))
+	{
+		o = observe(&addr, port, &m);
+	}
+	else if ((o = find_observer(&addr, port, &m)) != NULL) {
+		o->res = RES_NONE;
+		o = NULL;
+	}
+	m.observe = o ? (int32_t)(observe_seq & 0xffffff) : -1;
+
+	uip_udp_packet_sendto(conn, COAPD_BUF, build(&m), &addr, port);
+}
+
+#if CONFIG_LIB_OWTEMP
+// Tell the observers about a finished conversion
+static void notify_observers(void) {
+	struct coap_msg m;
+
+	observe_seq++;
+
+	for (uint8_t i = 0; i < COAPD_OBSERVERS; i++) {
+		struct observer *o = &observers[i];
+		const owtemp_reading_t *r = &owtemp_readings[o->sensor];
+
+		if (o->res == RES_NONE) {
+			continue;
+		}
+
+		// Single sensors are only worth a datagram when they've changed
+		if (o->res == RES_TEMP && r->used && r->valid == o->valid &&
+			(!r->valid || r->temp == o->temp))
+		{
+			continue;
+		}
+
+		memset(&m, 0, sizeof(m));
+		m.type = COAP_NON;
+		if (++o->count >= COAPD_CON_INTERVAL) {
+			if (o->unacked) {
+				o->res = RES_NONE;
+				continue;
+			}
+			m.type = COAP_CON;
+			o->count = 0;
+			o->unacked = 1;
+		}
+
+		m.code = COAP_CONTENT;
+		m.mid = o->mid = next_mid++;
+		m.tkl = o->tkl;
+		memcpy(m.token, o->token, o->tkl);
+		m.observe = observe_seq & 0xffffff;
+		m.res = o->res;
+		m.sensor = o->sensor;
+
+		o->valid = r->valid;
+		o->temp = r->temp;
+
+		uip_udp_packet_sendto(conn, COAPD_BUF, build(&m), &o->addr, o->port);
+
+		// The sensor has gone, and the 4.04 says so
+		if (m.code != COAP_CONTENT) {
+			o->res = RES_NONE;
+		}
+	}
+}
+#endif
+
+PROCESS_THREAD(coapd_process, ev, data) {
+	PROCESS_BEGIN();
+
+	next_mid = clock_time();
+
+	conn = udp_new(NULL, 0, &conn);
+	if (conn == NULL) {
+		PROCESS_EXIT();
+	}
+	udp_bind(conn, UIP_HTONS(COAPD_PORT));
+
+#if CONFIG_LIB_OWTEMP
+	notify_subscribe(&owtemp_notify, &owtemp_sub);
+#endif
+
+	while (1) {
+		PROCESS_WAIT_EVENT();
+
+		if (ev == tcpip_event && data == &conn) {
+			handle_request();
+		}
+#if CONFIG_LIB_OWTEMP
+		else if (ev == owtemp_event) {
+			notify_observers();
+		}
+#endif
+		else if (ev == PROCESS_EVENT_EXIT) {
+			PROCESS_EXIT();
+		}
+	}
+
+	PROCESS_END();
+}
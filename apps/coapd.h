@@ -0,0 +1,58 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef __COAPD_H__
+#define __COAPD_H__
+
+/*
+ * A small CoAP (RFC 7252) server, for reading sensors with a datagram each
+ * way instead of a TCP connection per poll. Only GET is supported, on these
+ * resources, all text/plain apart from the first:
+ *
+ *   /.well-known/core  the resources below, in the CoRE link format
+ *   /uptime            seconds since boot
+ *   /temps             rom,channel,temp for every sensor, a line each
+ *   /temps/<rom>       temp for one sensor
+ *
+ * Temperatures are in 1/16 degrees C, left empty if the last read failed.
+ * Both /temps resources can be observed (RFC 7641), and observers get a
+ * notification after each conversion: the whole table every time, or a
+ * single sensor when its reading has changed.
+ */
+
+#define COAPD_PORT 5683
+
+// Clients that can observe a resource at once
+#ifndef CONFIG_APPS_COAPD_OBSERVERS
+#define COAPD_OBSERVERS 4
+#else /* CONFIG_APPS_COAPD_OBSERVERS */
+#define COAPD_OBSERVERS CONFIG_APPS_COAPD_OBSERVERS
+#endif /* CONFIG_APPS_COAPD_OBSERVERS */
+
+// Every this many notifications one is sent confirmable, to find out if the
+// observer is still there; it's dropped if it hasn't acknowledged the last
+// one by the time the next is due
+#ifndef CONFIG_APPS_COAPD_CON_INTERVAL
+#define COAPD_CON_INTERVAL 16
+#else /* CONFIG_APPS_COAPD_CON_INTERVAL */
+#define COAPD_CON_INTERVAL CONFIG_APPS_COAPD_CON_INTERVAL
+#endif /* CONFIG_APPS_COAPD_CON_INTERVAL */
+
+#endif
@@ -22,6 +22,9 @@
 #include "network.h"
 #include "dhcp.h"
 #include <init.h>
+#if CONFIG_APPS_RESOLV
+#include "resolv.h"
+#endif
 
 #if CONFIG_APPS_SYSLOG
 #include "apps/syslog.h"
@@ -33,12 +36,16 @@ PROCESS(dhcp_process, "DHCP");
 INIT_PROCESS(dhcp_process);
 
 process_event_t dhcp_event;
+struct notify dhcp_notify;
 dhcp_status_t dhcp_status;
 
+static struct notify_sub net_sub;
+
 PROCESS_THREAD(dhcp_process, ev, data) {
 	PROCESS_BEGIN();
 
 	dhcp_event = process_alloc_event();
+	notify_subscribe(&net_notify, &net_sub);
 	dhcp_status.state = NULL;
 	dhcp_status.running = 0;
 	dhcp_status.configured = 0;
@@ -63,7 +70,7 @@ PROCESS_THREAD(dhcp_process, ev, data) {
 				dhcp_status.configured = 0;
 
 				// Post an event
-				process_post(PROCESS_BROADCAST, dhcp_event, &dhcp_status);
+				notify_post(&dhcp_notify, dhcp_event, &dhcp_status);
 #if CONFIG_APPS_SYSLOG
 				syslog_P(LOG_DAEMON | LOG_INFO, PSTR("Starting"));
 #endif
@@ -85,7 +92,7 @@ PROCESS_THREAD(dhcp_process, ev, data) {
 				dhcp_status.configured = 0;
 
 				// Post an event
-				process_post(PROCESS_BROADCAST, dhcp_event, &dhcp_status);
+				notify_post(&dhcp_notify, dhcp_event, &dhcp_status);
 #if CONFIG_APPS_SYSLOG
 				syslog_P(LOG_DAEMON | LOG_INFO, PSTR("Stopped"));
 #endif
@@ -106,7 +113,10 @@ void dhcpc_configured(const struct dhcpc_state *s) {
 	uip_setnetmask(&s->netmask);
 	uip_setdraddr(&s->default_router);
 #if CONFIG_APPS_RESOLV
-	resolv_conf(&s->dnsaddr);
+	const uip_ipaddr_t *dnsaddrs;
+	uint8_t dnscount = dhcpc_dnsaddrs(&dnsaddrs);
+
+	resolv_conf_servers(dnsaddrs, dnscount);
 #endif
 
 	// Update our internal status
@@ -114,7 +124,7 @@ void dhcpc_configured(const struct dhcpc_state *s) {
 	dhcp_status.configured = 1;
 
 	// Post an event
-	process_post(PROCESS_BROADCAST, dhcp_event, &dhcp_status);
+	notify_post(&dhcp_notify, dhcp_event, &dhcp_status);
 
 #if CONFIG_APPS_SYSLOG
 	syslog_P(
@@ -141,7 +151,7 @@ void dhcpc_unconfigured(const struct dhcpc_state *s) {
 	dhcp_status.configured = 0;
 
 	// Post an event
-	process_post(PROCESS_BROADCAST, dhcp_event, &dhcp_status);
+	notify_post(&dhcp_notify, dhcp_event, &dhcp_status);
 #if CONFIG_APPS_SYSLOG
 	syslog_P(LOG_DAEMON | LOG_INFO, PSTR("Unconfigured (lease expired)"));
 #endif
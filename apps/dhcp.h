@@ -22,6 +22,7 @@
 #define __DHCP_H__
 
 #include "net/dhcpc.h"
+#include <notify.h>
 
 typedef struct {
 	const struct dhcpc_state *	state;
@@ -30,6 +31,13 @@ typedef struct {
 } dhcp_status_t;
 
 extern process_event_t dhcp_event;
+extern struct notify dhcp_notify;
 extern dhcp_status_t dhcp_status;
 
+#if CONFIG_APPS_RESOLV
+// All the DNS servers in the lease (the state's dnsaddr is only the first);
+// returns how many
+uint8_t dhcpc_dnsaddrs(const uip_ipaddr_t **addrs);
+#endif
+
 #endif
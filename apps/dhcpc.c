@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2005, Swedish Institute of Computer Science.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * This file is part of the Contiki operating system.
+ *
+ * Based on Contiki's core/net/dhcpc.c, with INIT-REBOOT added so a lease
+ * kept in the settings store can be picked up again straight after a reset.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <contiki.h>
+#include <contiki-net.h>
+#include <net/dhcpc.h>
+#if CONFIG_APPS_RESOLV
+#include "resolv.h"
+#include "dhcp.h"
+#endif
+#if CONFIG_LIB_NVRAM
+#include <nvram.h>
+#include <verify.h>
+#include "drivers/wallclock.h"
+#elif CONFIG_LIB_SETTINGS
+#include <settings.h>
+#include "drivers/wallclock.h"
+#endif
+
+#define STATE_INITIAL         0
+#define STATE_SENDING         1
+#define STATE_OFFER_RECEIVED  2
+#define STATE_CONFIG_RECEIVED 3
+
+static struct dhcpc_state s;
+
+#if CONFIG_APPS_RESOLV
+// Every DNS server offered, s.dnsaddr being the first
+static uip_ipaddr_t dnsaddrs[RESOLV_SERVERS];
+static uint8_t dnscount;
+#endif
+
+struct dhcp_msg {
+	uint8_t op, htype, hlen, hops;
+	uint8_t xid[4];
+	uint16_t secs, flags;
+	uint8_t ciaddr[4];
+	uint8_t yiaddr[4];
+	uint8_t siaddr[4];
+	uint8_t giaddr[4];
+	uint8_t chaddr[16];
+	uint8_t sname[64];
+	uint8_t file[128];
+	uint8_t options[312];
+};
+
+#define BOOTP_BROADCAST 0x8000
+
+#define DHCP_REQUEST        1
+#define DHCP_REPLY          2
+#define DHCP_HTYPE_ETHERNET 1
+#define DHCP_HLEN_ETHERNET  6
+#define DHCP_MSG_LEN      236
+
+#define DHCPC_SERVER_PORT  67
+#define DHCPC_CLIENT_PORT  68
+
+#define DHCPDISCOVER  1
+#define DHCPOFFER     2
+#define DHCPREQUEST   3
+#define DHCPDECLINE   4
+#define DHCPACK       5
+#define DHCPNAK       6
+#define DHCPRELEASE   7
+
+#define DHCP_OPTION_SUBNET_MASK   1
+#define DHCP_OPTION_ROUTER        3
+#define DHCP_OPTION_DNS_SERVER    6
+#define DHCP_OPTION_REQ_IPADDR   50
+#define DHCP_OPTION_LEASE_TIME   51
+#define DHCP_OPTION_MSG_TYPE     53
+#define DHCP_OPTION_SERVER_ID    54
+#define DHCP_OPTION_REQ_LIST     55
+#define DHCP_OPTION_END         255
+
+// REQUESTs sent for a saved lease before giving up and DISCOVERing
+#define REBOOT_TRIES 3
+
+// The last lease we were given, as kept in the RTC RAM or settings store
+struct saved_lease {
+	uip_ipaddr_t ipaddr;
+	uip_ipaddr_t netmask;
+	uip_ipaddr_t dnsaddr;
+	uip_ipaddr_t default_router;
+	uint8_t serverid[4];
+	uint32_t expires; // wallclock_seconds()
+};
+
+static uint32_t xid;
+static const uint8_t magic_cookie[4] = {99, 130, 83, 99};
+
+/*---------------------------------------------------------------------------*/
+#if CONFIG_APPS_RESOLV
+uint8_t dhcpc_dnsaddrs(const uip_ipaddr_t **addrs) {
+	*addrs = dnsaddrs;
+	return dnscount;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+static uint32_t lease_seconds(void) {
+	return uip_ntohs(s.lease_time[0]) * 65536ul + uip_ntohs(s.lease_time[1]);
+}
+/*---------------------------------------------------------------------------*/
+#if CONFIG_LIB_NVRAM || CONFIG_LIB_SETTINGS
+#if CONFIG_LIB_NVRAM
+// The expiry time is only any use while the RTC keeps going, so the lease
+// may as well be kept in its RAM
+verify(sizeof(struct saved_lease) <= NVRAM_LEASE_SIZE);
+#endif
+
+static void lease_save(void) {
+	struct saved_lease l;
+
+	uip_ipaddr_copy(&l.ipaddr, &s.ipaddr);
+	uip_ipaddr_copy(&l.netmask, &s.netmask);
+	uip_ipaddr_copy(&l.dnsaddr, &s.dnsaddr);
+	uip_ipaddr_copy(&l.default_router, &s.default_router);
+	memcpy(l.serverid, s.serverid, sizeof(l.serverid));
+	l.expires = wallclock_seconds() + lease_seconds();
+
+#if CONFIG_LIB_NVRAM
+	memcpy(nvram.dhcp_lease, &l, sizeof(l));
+	nvram.dhcp_have_lease = 1;
+	nvram_commit();
+#else
+	settings_set_hot(SETTINGS_KEY_DHCP_LEASE, &l, sizeof(l));
+#endif
+}
+/*---------------------------------------------------------------------------*/
+// Load a saved lease that hasn't run out yet into s
+static int lease_load(void) {
+	struct saved_lease l;
+	uint32_t now = wallclock_seconds();
+
+#if CONFIG_LIB_NVRAM
+	if (!nvram.dhcp_have_lease) {
+		return -1;
+	}
+	memcpy(&l, nvram.dhcp_lease, sizeof(l));
+	if (l.expires <= now) {
+		return -1;
+	}
+#else
+	size_t size = sizeof(l);
+
+	if (settings_get(SETTINGS_KEY_DHCP_LEASE, 0, &l, &size) !=
+		SETTINGS_STATUS_OK || size != sizeof(l) || l.expires <= now)
+	{
+		return -1;
+	}
+#endif
+
+	uip_ipaddr_copy(&s.ipaddr, &l.ipaddr);
+	uip_ipaddr_copy(&s.netmask, &l.netmask);
+	uip_ipaddr_copy(&s.dnsaddr, &l.dnsaddr);
+	uip_ipaddr_copy(&s.default_router, &l.default_router);
+	memcpy(s.serverid, l.serverid, sizeof(s.serverid));
+#if CONFIG_APPS_RESOLV
+	// Only the first is saved, the rest come with the next renewal
+	uip_ipaddr_copy(&dnsaddrs[0], &l.dnsaddr);
+	dnscount = 1;
+#endif
+
+	return 0;
+}
+
+static void lease_forget(void) {
+#if CONFIG_LIB_NVRAM
+	if (nvram.dhcp_have_lease) {
+		nvram.dhcp_have_lease = 0;
+		nvram_commit();
+	}
+#else
+	settings_delete(SETTINGS_KEY_DHCP_LEASE, 0);
+#endif
+}
+#else
+#define lease_save()
+#define lease_load() (-1)
+#define lease_forget()
+#endif
+/*---------------------------------------------------------------------------*/
+static uint8_t *add_msg_type(uint8_t *optptr, uint8_t type) {
+	*optptr++ = DHCP_OPTION_MSG_TYPE;
+	*optptr++ = 1;
+	*optptr++ = type;
+	return optptr;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *add_server_id(uint8_t *optptr) {
+	*optptr++ = DHCP_OPTION_SERVER_ID;
+	*optptr++ = 4;
+	memcpy(optptr, s.serverid, 4);
+	return optptr + 4;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *add_req_ipaddr(uint8_t *optptr) {
+	*optptr++ = DHCP_OPTION_REQ_IPADDR;
+	*optptr++ = 4;
+	memcpy(optptr, &s.ipaddr, 4);
+	return optptr + 4;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *add_req_options(uint8_t *optptr) {
+	*optptr++ = DHCP_OPTION_REQ_LIST;
+	*optptr++ = 3;
+	*optptr++ = DHCP_OPTION_SUBNET_MASK;
+	*optptr++ = DHCP_OPTION_ROUTER;
+	*optptr++ = DHCP_OPTION_DNS_SERVER;
+	return optptr;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *add_end(uint8_t *optptr) {
+	*optptr++ = DHCP_OPTION_END;
+	return optptr;
+}
+/*---------------------------------------------------------------------------*/
+// ciaddr is only filled in when renewing a lease we're already using
+static void create_msg(struct dhcp_msg *m, uint8_t bound) {
+	m->op = DHCP_REQUEST;
+	m->htype = DHCP_HTYPE_ETHERNET;
+	m->hlen = s.mac_len;
+	m->hops = 0;
+	memcpy(m->xid, &xid, sizeof(m->xid));
+	m->secs = 0;
+	m->flags = UIP_HTONS(BOOTP_BROADCAST); /*  Broadcast bit. */
+	if (bound) {
+		memcpy(m->ciaddr, &uip_hostaddr, sizeof(m->ciaddr));
+	}
+	else {
+		memset(m->ciaddr, 0, sizeof(m->ciaddr));
+	}
+	memset(m->yiaddr, 0, sizeof(m->yiaddr));
+	memset(m->siaddr, 0, sizeof(m->siaddr));
+	memset(m->giaddr, 0, sizeof(m->giaddr));
+	memcpy(m->chaddr, s.mac_addr, s.mac_len);
+	memset(&m->chaddr[s.mac_len], 0, sizeof(m->chaddr) - s.mac_len);
+	memset(m->sname, 0, sizeof(m->sname));
+	memset(m->file, 0, sizeof(m->file));
+
+	memcpy(m->options, magic_cookie, sizeof(magic_cookie));
+}
+/*---------------------------------------------------------------------------*/
+static void send_discover(void) {
+	uint8_t *end;
+	struct dhcp_msg *m = (struct dhcp_msg *)uip_appdata;
+
+	create_msg(m, 0);
+
+	end = add_msg_type(&m->options[4], DHCPDISCOVER);
+	end = add_req_options(end);
+	end = add_end(end);
+
+	uip_send(uip_appdata, end - (uint8_t *)uip_appdata);
+}
+/*---------------------------------------------------------------------------*/
+// A REQUEST while selecting an offer or renewing names the server; one
+// for a saved lease (INIT-REBOOT) must not
+static void send_request(uint8_t bound, uint8_t server) {
+	uint8_t *end;
+	struct dhcp_msg *m = (struct dhcp_msg *)uip_appdata;
+
+	create_msg(m, bound);
+
+	end = add_msg_type(&m->options[4], DHCPREQUEST);
+	if (server) {
+		end = add_server_id(end);
+	}
+	if (!bound) {
+		end = add_req_ipaddr(end);
+	}
+	end = add_req_options(end);
+	end = add_end(end);
+
+	uip_send(uip_appdata, end - (uint8_t *)uip_appdata);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t parse_options(uint8_t *optptr, int len) {
+	uint8_t *end = optptr + len;
+	uint8_t type = 0;
+
+	while (optptr < end) {
+		switch (*optptr) {
+		case DHCP_OPTION_SUBNET_MASK:
+			memcpy(&s.netmask, optptr + 2, 4);
+			break;
+		case DHCP_OPTION_ROUTER:
+			memcpy(&s.default_router, optptr + 2, 4);
+			break;
+		case DHCP_OPTION_DNS_SERVER:
+			memcpy(&s.dnsaddr, optptr + 2, 4);
+#if CONFIG_APPS_RESOLV
+			for (dnscount = 0; dnscount < RESOLV_SERVERS &&
+				dnscount < optptr[1] / 4; dnscount++)
+			{
+				memcpy(&dnsaddrs[dnscount], optptr + 2 + 4 * dnscount, 4);
+			}
+#endif
+			break;
+		case DHCP_OPTION_MSG_TYPE:
+			type = *(optptr + 2);
+			break;
+		case DHCP_OPTION_SERVER_ID:
+			memcpy(s.serverid, optptr + 2, 4);
+			break;
+		case DHCP_OPTION_LEASE_TIME:
+			memcpy(s.lease_time, optptr + 2, 4);
+			break;
+		case DHCP_OPTION_END:
+			return type;
+		}
+
+		optptr += optptr[1] + 2;
+	}
+
+	return type;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t parse_msg(void) {
+	struct dhcp_msg *m = (struct dhcp_msg *)uip_appdata;
+
+	if (m->op == DHCP_REPLY &&
+		memcmp(m->xid, &xid, sizeof(xid)) == 0 &&
+		memcmp(m->chaddr, s.mac_addr, s.mac_len) == 0)
+	{
+		uint8_t type;
+		uip_ipaddr_t yiaddr;
+
+		memcpy(&yiaddr, m->yiaddr, 4);
+		type = parse_options(&m->options[4], uip_datalen() - DHCP_MSG_LEN - 4);
+
+		// A NAK carries no address, so keep the one we asked for
+		if (type != DHCPNAK) {
+			uip_ipaddr_copy(&s.ipaddr, &yiaddr);
+		}
+
+		return type;
+	}
+
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+// Wait until uIP lets us send on our connection
+#define WAIT_TO_SEND() \
+	while (ev != tcpip_event) { \
+		tcpip_poll_udp(s.conn); \
+		PT_YIELD(&s.pt); \
+	}
+
+// Wait for a reply of the given type until the timer runs out, or jump
+// to nak on a NAK
+#define WAIT_REPLY(type, got, nak) \
+	do { \
+		PT_YIELD(&s.pt); \
+		if (ev == tcpip_event && uip_newdata()) { \
+			uint8_t t = parse_msg(); \
+			if (t == (type)) { \
+				uip_flags &= ~UIP_NEWDATA; \
+				goto got; \
+			} \
+			else if (t == DHCPNAK) { \
+				uip_flags &= ~UIP_NEWDATA; \
+				goto nak; \
+			} \
+		} \
+	} while (!etimer_expired(&s.etimer))
+
+#define MAX_TICKS (~((clock_time_t)0) / 2)
+#define MAX_TICKS32 (~((uint32_t)0))
+#define IMIN(a, b) ((a) < (b) ? (a) : (b))
+
+static uint32_t half_lease_ticks(void) {
+	if (lease_seconds() * CLOCK_SECOND / 2 <= MAX_TICKS32) {
+		return lease_seconds() * CLOCK_SECOND / 2;
+	}
+	else {
+		return MAX_TICKS32;
+	}
+}
+/*---------------------------------------------------------------------------*/
+static PT_THREAD(handle_dhcp(process_event_t ev, void *data)) {
+	clock_time_t ticks;
+	PT_BEGIN(&s.pt);
+
+	// Ask for the saved lease back if it's still good
+	if (lease_load() == 0) {
+		xid++;
+		s.state = STATE_SENDING;
+		s.ticks = CLOCK_SECOND;
+		do {
+			WAIT_TO_SEND();
+			send_request(0, 0);
+			etimer_set(&s.etimer, s.ticks);
+			WAIT_REPLY(DHCPACK, bound, nak);
+			s.ticks *= 2;
+		} while (s.ticks < CLOCK_SECOND << REBOOT_TRIES);
+	}
+	goto init;
+
+nak:
+	// The lease is no good (any more), start again
+	lease_forget();
+
+init:
+	xid++;
+	s.state = STATE_SENDING;
+	s.ticks = CLOCK_SECOND;
+	while (1) {
+		WAIT_TO_SEND();
+		send_discover();
+		etimer_set(&s.etimer, s.ticks);
+		do {
+			PT_YIELD(&s.pt);
+			if (ev == tcpip_event && uip_newdata() &&
+				parse_msg() == DHCPOFFER)
+			{
+				uip_flags &= ~UIP_NEWDATA;
+				s.state = STATE_OFFER_RECEIVED;
+				goto selecting;
+			}
+		} while (!etimer_expired(&s.etimer));
+
+		if (s.ticks < CLOCK_SECOND * 60) {
+			s.ticks *= 2;
+		}
+	}
+
+selecting:
+	xid++;
+	s.ticks = CLOCK_SECOND;
+	do {
+		WAIT_TO_SEND();
+		send_request(0, 1);
+		etimer_set(&s.etimer, s.ticks);
+		WAIT_REPLY(DHCPACK, bound, init);
+
+		if (s.ticks <= CLOCK_SECOND * 10) {
+			s.ticks += CLOCK_SECOND;
+		}
+		else {
+			goto init;
+		}
+	} while (s.state != STATE_CONFIG_RECEIVED);
+
+bound:
+	s.state = STATE_CONFIG_RECEIVED;
+	lease_save();
+	dhcpc_configured(&s);
+
+	s.ticks = half_lease_ticks();
+	while (s.ticks > 0) {
+		ticks = IMIN(s.ticks, MAX_TICKS);
+		s.ticks -= ticks;
+		etimer_set(&s.etimer, ticks);
+		PT_YIELD_UNTIL(&s.pt, etimer_expired(&s.etimer));
+	}
+
+	// Renewing
+	s.ticks = half_lease_ticks();
+	xid++;
+	do {
+		WAIT_TO_SEND();
+		send_request(1, 1);
+		ticks = IMIN(s.ticks / 2, MAX_TICKS);
+		s.ticks -= ticks;
+		etimer_set(&s.etimer, ticks);
+		WAIT_REPLY(DHCPACK, bound, expired);
+	} while (s.ticks >= CLOCK_SECOND * 3);
+
+expired:
+	dhcpc_unconfigured(&s);
+	lease_forget();
+	goto init;
+
+	PT_END(&s.pt);
+}
+/*---------------------------------------------------------------------------*/
+void dhcpc_init(const void *mac_addr, int mac_len) {
+	uip_ipaddr_t addr;
+
+	s.mac_addr = mac_addr;
+	s.mac_len = mac_len;
+
+	s.state = STATE_INITIAL;
+	uip_ipaddr(&addr, 255,255,255,255);
+	s.conn = udp_new(&addr, UIP_HTONS(DHCPC_SERVER_PORT), NULL);
+	if (s.conn != NULL) {
+		udp_bind(s.conn, UIP_HTONS(DHCPC_CLIENT_PORT));
+	}
+	PT_INIT(&s.pt);
+
+	// Get going straight away
+	uip_ipaddr(&addr, 0,0,0,0);
+	uip_sethostaddr(&addr);
+	handle_dhcp(PROCESS_EVENT_NONE, NULL);
+}
+/*---------------------------------------------------------------------------*/
+void dhcpc_appcall(process_event_t ev, void *data) {
+	if (ev == tcpip_event || ev == PROCESS_EVENT_TIMER) {
+		handle_dhcp(ev, data);
+	}
+}
+/*---------------------------------------------------------------------------*/
+void dhcpc_request(void) {
+	if (s.state == STATE_INITIAL) {
+		handle_dhcp(PROCESS_EVENT_NONE, NULL);
+	}
+}
+/*---------------------------------------------------------------------------*/
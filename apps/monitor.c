@@ -33,12 +33,18 @@ PROCESS(monitor_process, "Monitor");
 INIT_PROCESS(monitor_process);
 
 static struct etimer heartbeat;
+#if CONFIG_APPS_NETWORK
+static struct notify_sub net_sub;
+#endif
 
 PROCESS_THREAD(monitor_process, ev, data) {
 	PROCESS_BEGIN();
 
 	// Initialise timer
 	etimer_set(&heartbeat, CLOCK_SECOND / 2);
+#if CONFIG_APPS_NETWORK
+	notify_subscribe(&net_notify, &net_sub);
+#endif
 
 	while (1) {
 		PROCESS_WAIT_EVENT();
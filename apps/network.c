@@ -26,20 +26,17 @@
 #include <init.h>
 
 #include "network.h"
+#include "drivers/nic.h"
 
-#if CONFIG_DRIVERS_ENC28J60
-#include "drivers/enc28j60.h"
-#elif CONFIG_DRIVERS_ENC424J600
-#include "drivers/enc424j600.h"
-#else
-#error No network interface defined!
-#endif
-
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <util/delay.h>
 
+#if CONFIG_APPS_ARP
+#include "apps/arp.h"
+#endif
 #if CONFIG_APPS_DHCP
 #include "apps/dhcp.h"
 #endif
@@ -55,17 +52,218 @@
 #define IPBUF ((struct uip_tcpip_hdr *)&uip_buf[UIP_LLH_LEN])
 
 process_event_t net_event;
+struct notify net_notify;
 network_status_t net_status;
+network_stats_t net_stats;
+
+#if CONFIG_APPS_DHCP
+static struct notify_sub dhcp_sub;
+#endif
+
+// How often to check the PHY for link changes
+#define NETWORK_STATUS_INTERVAL CLOCK_SECOND
+
+// Most frames to handle per poll
+#ifndef CONFIG_APPS_NETWORK_RX_BUDGET
+#define NETWORK_RX_BUDGET 4
+#else
+#define NETWORK_RX_BUDGET CONFIG_APPS_NETWORK_RX_BUDGET
+#endif
+
+// Most frames to handle per poll once the NIC's RX buffer is half full
+#ifndef CONFIG_APPS_NETWORK_RX_BURST
+#define NETWORK_RX_BURST 16
+#else
+#define NETWORK_RX_BURST CONFIG_APPS_NETWORK_RX_BURST
+#endif
 
-#if CONFIG_DRIVERS_ENC28J60
-static struct uip_eth_addr mac PROGMEM =
-	{{ 0x52, 0x54, 0x00, 0x01, 0x02, 0x03 }};
+// Full-size TCP segments network_tcp_widen() lets a connection have in flight
+#ifndef CONFIG_APPS_NETWORK_TCP_SEGMENTS
+#define NETWORK_TCP_SEGMENTS 2
+#else
+#define NETWORK_TCP_SEGMENTS CONFIG_APPS_NETWORK_TCP_SEGMENTS
 #endif
 
+// Largest TCP payload in one Ethernet frame
+#define NETWORK_ETH_MSS (1500 - UIP_TCPIP_HLEN)
+
+// Not exported by uip.h
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+
+static struct etimer status_timer;
+static uint8_t mcast_hash[8];
 #if !CONFIG_LIB_CONTIKI_IPV6
 static struct timer arp_timer;
 #endif
 
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+#if CONFIG_LIB_CONTIKI_IPV6
+#error NIC checksum offload is only supported for IPv4
+#endif
+
+/*
+ * uIP checksum functions, used because UIP_ARCH_CHKSUM is set. The IP header
+ * checksum is still done in software but TCP and UDP checksums are left to
+ * the NIC: network_read() drops segments that fail the
+ * check before uIP sees them and network_send() fills in the checksum in the
+ * transmit buffer. uIP is told every checksum it asks for is good, which
+ * conveniently also makes it leave zero in outgoing checksum fields.
+ */
+#define UDPIPBUF ((struct uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN])
+#define IPLEN (((uint16_t)IPBUF->len[0] << 8) | IPBUF->len[1])
+
+#if UIP_CONF_TCP_SPLIT
+// Where the payload of the TCP segment in uip_buf really is, if it isn't
+// straight after the headers (see uip_split_output())
+static uint8_t *tx_payload;
+#endif
+
+#if NIC_CAPS & NIC_CAP_TX_SRAM
+// Payload waiting in NIC SRAM for the segment network_send_sram() was called
+// for, moved on past each piece that is sent
+static struct {
+	uint16_t addr;
+	uint16_t len; // 0 if there isn't any
+	uint16_t lport;
+	uint16_t rport;
+	uint8_t seqno[4];
+} tx_sram;
+#endif
+
+static uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len) {
+	const uint8_t *last = data + len - 1;
+	uint16_t t;
+
+	while (data < last) {
+		t = (data[0] << 8) | data[1];
+		sum += t;
+		if (sum < t) {
+			sum++;
+		}
+		data += 2;
+	}
+
+	if (data == last) {
+		t = data[0] << 8;
+		sum += t;
+		if (sum < t) {
+			sum++;
+		}
+	}
+
+	return sum;
+}
+
+uint16_t uip_chksum(uint16_t *data, uint16_t len) {
+	return uip_htons(chksum(0, (uint8_t *)data, len));
+}
+
+uint16_t uip_ipchksum(void) {
+	uint16_t sum;
+
+	sum = chksum(0, &uip_buf[UIP_LLH_LEN], UIP_IPH_LEN);
+	return (sum == 0) ? 0xffff : uip_htons(sum);
+}
+
+uint16_t uip_tcpchksum(void) {
+	return 0xffff;
+}
+
+#if UIP_UDP_CHECKSUMS
+uint16_t uip_udpchksum(void) {
+	return 0xffff;
+}
+#endif
+
+// Find the TCP or UDP checksum in the frame in uip_buf. Returns its offset
+// from the start of the frame, or 0 if there isn't one uIP would look at.
+static uint16_t chksum_field(uint16_t len) {
+	if (len < UIP_LLH_LEN + UIP_IPH_LEN ||
+		BUF->type != UIP_HTONS(UIP_ETHTYPE_IP) ||
+		IPBUF->vhl != 0x45 ||
+		(IPBUF->ipoffset[0] & 0x3f) || IPBUF->ipoffset[1] ||
+		IPLEN > len - UIP_LLH_LEN)
+	{
+		return 0;
+	}
+
+	if (IPBUF->proto == UIP_PROTO_TCP && IPLEN >= UIP_IPTCPH_LEN) {
+		return UIP_LLH_LEN + offsetof(struct uip_tcpip_hdr, tcpchksum);
+	}
+#if UIP_UDP && UIP_UDP_CHECKSUMS
+	if (IPBUF->proto == UIP_PROTO_UDP && IPLEN >= UIP_IPUDPH_LEN) {
+		return UIP_LLH_LEN + offsetof(struct uip_udpip_hdr, udpchksum);
+	}
+#endif
+
+	return 0;
+}
+
+#if NIC_CAPS & NIC_CAP_TX_SRAM
+void network_send_sram(uint16_t addr, uint16_t len) {
+	tx_sram.addr = addr;
+	tx_sram.len = len;
+	tx_sram.lport = uip_conn->lport;
+	tx_sram.rport = uip_conn->rport;
+	memcpy(tx_sram.seqno, uip_conn->snd_nxt, sizeof(tx_sram.seqno));
+}
+
+// Is the frame in uip_buf (known to have a checksum field) the segment, or
+// the next piece of the segment, that network_send_sram() was called for?
+static uint8_t sram_match(void) {
+	uint16_t dlen = uip_len - UIP_LLH_LEN - UIP_TCPIP_HLEN;
+
+	return tx_sram.len &&
+		IPBUF->proto == UIP_PROTO_TCP &&
+		(IPBUF->tcpoffset >> 4) == UIP_TCPH_LEN / 4 &&
+		uip_len > UIP_LLH_LEN + UIP_TCPIP_HLEN && dlen <= tx_sram.len &&
+		IPBUF->srcport == tx_sram.lport && IPBUF->destport == tx_sram.rport &&
+		memcmp(IPBUF->seqno, tx_sram.seqno, sizeof(tx_sram.seqno)) == 0;
+}
+#endif
+
+// Sum of the pseudo-header for the TCP or UDP segment in uip_buf
+static uint16_t pseudo_sum(void) {
+	return chksum(IPLEN - UIP_IPH_LEN + IPBUF->proto,
+		(uint8_t *)&IPBUF->srcipaddr, 2 * sizeof(uip_ipaddr_t));
+}
+
+// Check the TCP or UDP checksum of the packet the NIC is holding
+static uint8_t chksum_ok(uint16_t len) {
+	uint16_t field = chksum_field(len);
+
+	if (!field) {
+		return 1;
+	}
+#if UIP_UDP && UIP_UDP_CHECKSUMS
+	// Sender didn't calculate a checksum
+	if (IPBUF->proto == UIP_PROTO_UDP && UDPIPBUF->udpchksum == 0) {
+		return 1;
+	}
+#endif
+
+	if (nic_rx_chksum(UIP_LLH_LEN + UIP_IPH_LEN, IPLEN - UIP_IPH_LEN,
+		pseudo_sum()) == 0xffff)
+	{
+		return 1;
+	}
+
+	net_stats.rx_chkerr++;
+
+	if (IPBUF->proto == UIP_PROTO_TCP) {
+		UIP_STAT(++uip_stat.tcp.chkerr);
+	}
+#if UIP_UDP
+	else {
+		UIP_STAT(++uip_stat.udp.chkerr);
+	}
+#endif
+
+	return 0;
+}
+#endif
+
 PROCESS(network_process, "Network");
 INIT_PROCESS(network_process);
 INIT_PROCESS(tcpip_process);
@@ -103,25 +301,65 @@ static void tcpdump(uint8_t *pkt, uint16_t len) {
 #endif
 
 void network_get_macaddr(struct uip_eth_addr *addr) {
-#if CONFIG_DRIVERS_ENC28J60
-	// Set our MAC address
-	memcpy_P(addr, &mac, sizeof(mac));
-#endif
-#if CONFIG_DRIVERS_ENC424J600
-	// Get the MAC address
-	enc424j600GetMACAddr(addr->addr);
-#endif
+	nic_get_macaddr(addr);
+}
+
+// The NICs' multicast hash table is indexed by bits 28:23 of the CRC-32 of
+// the destination address
+static uint8_t mcast_hash_bit(const struct uip_eth_addr *addr) {
+	uint32_t crc = 0xffffffff;
+
+	for (uint8_t i = 0; i < sizeof(addr->addr); i++) {
+		uint8_t b = addr->addr[i];
+
+		for (uint8_t j = 0; j < 8; j++) {
+			uint8_t next = ((crc >> 31) ^ b) & 1;
+
+			crc <<= 1;
+			if (next) {
+				crc ^= 0x04c11db7;
+			}
+			b >>= 1;
+		}
+	}
+
+	return (crc >> 23) & 0x3f;
+}
+
+static void mcast_hash_update(void) {
+	nic_set_hash(mcast_hash);
+}
+
+void network_multicast_add(const struct uip_eth_addr *addr) {
+	uint8_t bit = mcast_hash_bit(addr);
+
+	mcast_hash[bit >> 3] |= _BV(bit & 7);
+	mcast_hash_update();
+}
+
+void network_multicast_clear(void) {
+	memset(mcast_hash, 0, sizeof(mcast_hash));
+	mcast_hash_update();
 }
 
 static uint16_t network_read(void) {
 	uint16_t len;
 
-#if CONFIG_DRIVERS_ENC28J60
-	len = enc28j60PacketReceive(UIP_BUFSIZE, (uint8_t *)uip_buf);
-#endif
-#if CONFIG_DRIVERS_ENC424J600
-	len = enc424j600PacketReceive(UIP_BUFSIZE, (uint8_t *)uip_buf);
+	len = nic_rx_hold(UIP_BUFSIZE, (uint8_t *)uip_buf);
+	if (len == 0 && nic_rx_oversize()) {
+		net_stats.rx_oversize++;
+	}
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+	else if (len > 0 && !chksum_ok(len)) {
+		len = 0;
+	}
 #endif
+	nic_rx_release();
+
+	if (len > 0) {
+		net_stats.rx_frames++;
+		net_stats.rx_bytes += len;
+	}
 
 #if TCPDUMP
 	if (len > 0) {
@@ -134,30 +372,74 @@ static uint16_t network_read(void) {
 }
 
 static uint8_t network_send(void) {
+	int err;
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+	uint16_t field;
+#endif
+
 #if TCPDUMP
 	printf_P(PSTR("OUT: "));
 	tcpdump(uip_buf, uip_len);
 #endif
 
-#if CONFIG_DRIVERS_ENC28J60
-	if (uip_len <= UIP_LLH_LEN + 40) {
-		enc28j60PacketSend(
-			uip_len,
-			(uint8_t *)uip_buf,
-			0,
-			0);
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+	field = chksum_field(uip_len);
+#if NIC_CAPS & NIC_CAP_TX_SRAM
+	if (field && sram_match()) {
+		uint16_t dlen = uip_len - UIP_LLH_LEN - UIP_TCPIP_HLEN;
+
+		uip_buf[field] = 0;
+		uip_buf[field + 1] = 0;
+		err = nic_send_chksum_sram(UIP_LLH_LEN + UIP_TCPIP_HLEN,
+			(uint8_t *)uip_buf, tx_sram.addr, dlen,
+			UIP_LLH_LEN + UIP_IPH_LEN, field, pseudo_sum());
+
+		// The next piece of a split segment carries on from here
+		tx_sram.addr += dlen;
+		tx_sram.len -= dlen;
+		uip_add32(tx_sram.seqno, dlen);
+		memcpy(tx_sram.seqno, uip_acc32, sizeof(tx_sram.seqno));
 	}
-	else {
-		enc28j60PacketSend(
-			54,
-			(uint8_t *)uip_buf,
-			uip_len - UIP_LLH_LEN - 40,
-			(uint8_t*)uip_appdata);
+	else
+#endif
+#if UIP_CONF_TCP_SPLIT
+	// Send the headers and payload from where each of them is; uip_arp_out()
+	// may have swapped the segment for an ARP request, which has no field
+	if (field && tx_payload && IPBUF->proto == UIP_PROTO_TCP &&
+		uip_len > UIP_LLH_LEN + UIP_TCPIP_HLEN)
+	{
+		uip_buf[field] = 0;
+		uip_buf[field + 1] = 0;
+		err = nic_send_chksum(UIP_LLH_LEN + UIP_TCPIP_HLEN,
+			(uint8_t *)uip_buf, uip_len - UIP_LLH_LEN - UIP_TCPIP_HLEN,
+			tx_payload, UIP_LLH_LEN + UIP_IPH_LEN, field, pseudo_sum());
+	}
+	else
+#endif
+	if (field) {
+		uip_buf[field] = 0;
+		uip_buf[field + 1] = 0;
+		err = nic_send_chksum(uip_len, (uint8_t *)uip_buf, 0, NULL,
+			UIP_LLH_LEN + UIP_IPH_LEN, field, pseudo_sum());
 	}
+	else
 #endif
-#if CONFIG_DRIVERS_ENC424J600
-	enc424j600PacketSend(uip_len, (uint8_t *)uip_buf);
+	{
+		err = nic_send(uip_len, (uint8_t *)uip_buf, 0, NULL);
+	}
+
+	if (err) {
+		net_stats.tx_errors++;
+	}
+	else {
+		net_stats.tx_frames++;
+		net_stats.tx_bytes += uip_len;
+#if !CONFIG_LIB_CONTIKI_IPV6
+		if (BUF->type == UIP_HTONS(UIP_ETHTYPE_ARP)) {
+			net_stats.arp_out++;
+		}
 #endif
+	}
 
 	uip_len = 0;
 
@@ -193,46 +475,101 @@ static uint8_t network_send_tcpip(void) {
 }
 #endif
 
-static void network_init(void) {
-	struct uip_eth_addr macaddr;
+#if !CONFIG_LIB_CONTIKI_IPV6
+void network_tcp_widen(struct uip_conn *conn) {
+	uint32_t mss = (uint32_t)conn->initialmss * NETWORK_TCP_SEGMENTS;
 
-	net_event = process_alloc_event();
+	conn->mss = (mss > UIP_TCP_MSS) ? UIP_TCP_MSS : mss;
+}
+
+#if UIP_CONF_TCP_SPLIT
+/*
+ * Replaces Contiki's uip-split.c. That sends every TCP segment as two halves
+ * so the peer's delayed ACK doesn't stall us; this does the same for small
+ * segments, but also cuts segments from network_tcp_widen() connections into
+ * as many pieces as the peer's MSS needs. A retransmit regenerates the whole
+ * segment, so the pieces all go again.
+ *
+ * With the NIC doing checksums the payload doesn't have to follow the headers
+ * in memory, so each piece is sent from where it already is in uip_buf; a
+ * software checksum needs it moved up behind the headers first.
+ */
+void uip_split_output(void) {
+	uint8_t *data = &uip_buf[UIP_LLH_LEN + UIP_TCPIP_HLEN];
+	uint16_t wire_mss = uip_conn->initialmss;
+	uint16_t tcplen;
+	uint8_t pieces;
+	uint8_t flags;
+
+	if (IPBUF->proto != UIP_PROTO_TCP ||
+		(IPBUF->tcpoffset >> 4) != UIP_TCPH_LEN / 4 ||
+		uip_len < UIP_TCPIP_HLEN + 2)
+	{
+		tcpip_output();
+		return;
+	}
 
-#if CONFIG_DRIVERS_ENC28J60
-	// Set our MAC address
-	memcpy_P(&macaddr, &mac, sizeof(mac));
+	if (wire_mss == 0 || wire_mss > NETWORK_ETH_MSS) {
+		wire_mss = NETWORK_ETH_MSS;
+	}
 
-	// Set up ethernet
-	enc28j60Init(&macaddr);
-	enc28j60Write(ECOCON, 0 & 0x7); // Disable clock output
-	_delay_ms(10);
+	tcplen = uip_len - UIP_TCPIP_HLEN;
+	pieces = (tcplen + wire_mss - 1) / wire_mss;
+	if (pieces < 2) {
+		pieces = 2;
+	}
 
-	/* Magjack leds configuration, see enc28j60 datasheet, page 11 */
-	// LEDA=green LEDB=yellow
-	//
-	// 0x476 is PHLCON LEDA=links status, LEDB=receive/transmit
-	enc28j60PhyWrite(PHLCON, 0x476);
-	_delay_ms(100);
-#endif
-#if CONFIG_DRIVERS_ENC424J600
-	// Initialise the hardware
-	enc424j600Init();
+	// Only the last piece gets to close the connection
+	flags = IPBUF->flags;
+	IPBUF->flags &= ~(TCP_FIN | TCP_PSH);
 
-	// Disable clock output and set up LED stretch
-	uint16_t econ2 = enc424j600ReadReg(ECON2);
-	econ2 |= ECON2_STRCH; // stretch LED duration
-	econ2 &= ~(ECON2_COCON3 | ECON2_COCON2 | ECON2_COCON1 | ECON2_COCON0);
-	enc424j600WriteReg(ECON2, econ2);
+	while (pieces) {
+		uint16_t len = tcplen / pieces;
 
-	// Set up LEDs
-	uint16_t eidled = enc424j600ReadReg(EIDLED);
-	eidled &= 0x00ff; // and-out the high byte (LED config)
-	eidled |= EIDLED_LACFG1 | EIDLED_LBCFG2 | EIDLED_LBCFG1;
-	enc424j600WriteReg(EIDLED, eidled);
+		if (pieces == 1) {
+			IPBUF->flags = flags;
+		}
 
-	// Get the MAC address
-	enc424j600GetMACAddr(macaddr.addr);
+		uip_len = len + UIP_TCPIP_HLEN;
+		IPBUF->len[0] = uip_len >> 8;
+		IPBUF->len[1] = uip_len & 0xff;
+
+		IPBUF->tcpchksum = 0;
+		IPBUF->tcpchksum = ~(uip_tcpchksum());
+		IPBUF->ipchksum = 0;
+		IPBUF->ipchksum = ~(uip_ipchksum());
+
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+		tx_payload = data;
+#endif
+		tcpip_output();
+
+		tcplen -= len;
+		if (--pieces) {
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+			data += len;
+#else
+			// Bring the rest of the data up behind the headers
+			memmove(data, data + len, tcplen);
+#endif
+			uip_add32(IPBUF->seqno, len);
+			memcpy(IPBUF->seqno, uip_acc32, sizeof(IPBUF->seqno));
+		}
+	}
+
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+	tx_payload = NULL;
+#endif
+}
 #endif
+#endif
+
+static void network_init(void) {
+	struct uip_eth_addr macaddr;
+
+	net_event = process_alloc_event();
+
+	nic_init(&macaddr);
 
 #if !CONFIG_LIB_CONTIKI_IPV6
 	// Set up timers
@@ -240,28 +577,36 @@ static void network_init(void) {
 #endif
 
 	uip_setethaddr(macaddr);
+
+#if CONFIG_LIB_CONTIKI_IPV6
+	{
+		// All-nodes, and the solicited-node group for our addresses (which
+		// all have interface IDs made from our MAC)
+		struct uip_eth_addr mcast = {{ 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 }};
+
+		network_multicast_add(&mcast);
+
+		mcast.addr[2] = 0xff;
+		mcast.addr[3] = macaddr.addr[3];
+		mcast.addr[4] = macaddr.addr[4];
+		mcast.addr[5] = macaddr.addr[5];
+		network_multicast_add(&mcast);
+	}
+#endif
 }
 
 static void update_status(void) {
 	network_status_t new = net_status;
 
-#if CONFIG_DRIVERS_ENC28J60
-	uint16_t phstat1 = enc28j60PhyRead(PHSTAT1);
-	uint16_t phstat2 = enc28j60PhyRead(PHSTAT2);
-
-	new.link = (phstat1 & PHSTAT1_LLSTAT) ? 1 : 0;
-	new.speed_100m = 0; // this chip only does 10M
-	new.full_duplex = (phstat2 & PHSTAT2_DPXSTAT) ? 1 : 0;
-#endif
+	uint8_t link = nic_link();
 
-#if CONFIG_DRIVERS_ENC424J600
-	uint16_t phstat1 = enc424j600ReadPHYReg(PHSTAT1);
-	uint16_t phstat3 = enc424j600ReadPHYReg(PHSTAT3);
+	new.link = (link & NIC_LINK_UP) ? 1 : 0;
+	new.speed_100m = (link & NIC_LINK_100M) ? 1 : 0;
+	new.full_duplex = (link & NIC_LINK_FDX) ? 1 : 0;
 
-	new.link = (phstat1 & PHSTAT1_LLSTAT) ? 1 : 0;
-	new.speed_100m = (phstat3 & PHSTAT3_SPDDPX1) ? 1 : 0;
-	new.full_duplex = (phstat3 & PHSTAT3_SPDDPX2) ? 1 : 0;
-#endif
+	if (nic_rx_aborted()) {
+		net_stats.rx_overruns++;
+	}
 
 	if (!new.link) {
 		new.configured = 0;
@@ -269,10 +614,11 @@ static void update_status(void) {
 
 	// Check if the flags have changed
 	if (memcmp(&new, &net_status, sizeof(net_status)) != 0) {
+		nic_link_update();
 		net_status = new;
 
 		// Send link change event
-		process_post(PROCESS_BROADCAST, net_event, &net_status);
+		notify_post(&net_notify, net_event, &net_status);
 
 #if CONFIG_APPS_SYSLOG
 		if (net_status.link) {
@@ -291,13 +637,54 @@ static void update_status(void) {
 	}
 }
 
+#if NIC_CAPS & NIC_CAP_RX_INT
+ISR(NIC_RX_VECT) {
+	process_poll(&network_process);
+}
+#endif
+
 static void pollhandler(void) {
+	uint8_t budget = NETWORK_RX_BUDGET;
+#if NIC_CAPS & NIC_CAP_RX_COUNT
+	uint16_t used;
+#endif
+
+	net_stats.polls++;
+
+#if NIC_CAPS & NIC_CAP_RX_COUNT
+	// The NIC's RX buffer is the frame queue: frames wait there in order
+	// until read, so reading them into a second queue in our RAM would only
+	// add a copy. What matters is that it never fills, so when it's backing
+	// up faster than a batch a poll clears it, drain it in one go.
+	used = nic_rx_used();
+	if (used > net_stats.rx_peak) {
+		net_stats.rx_peak = used;
+	}
+	if (used > NIC_RX_SIZE / 2) {
+		budget = NETWORK_RX_BURST;
+		net_stats.rx_bursts++;
+	}
+#endif
+
+#if !(NIC_CAPS & NIC_CAP_RX_INT)
 	process_poll(&network_process);
+#endif
 
-	update_status();
-	uip_len = network_read();
+	// Take a few frames at a time so bursts don't overflow the NIC's buffer,
+	// but give other processes a turn between batches
+	while (budget--) {
+#if NIC_CAPS & NIC_CAP_RX_INT
+		// Save asking the NIC when INT already says there's nothing there
+		if (!nic_rx_pending()) {
+			break;
+		}
+#endif
+
+		uip_len = network_read();
+		if (uip_len == 0) {
+			break;
+		}
 
-	if (uip_len > 0) {
 #if CONFIG_LIB_CONTIKI_IPV6
 		// Handle IP packets
 		if (BUF->type == UIP_HTONS(UIP_ETHTYPE_IPV6)) {
@@ -310,6 +697,7 @@ static void pollhandler(void) {
 		}
 		// Handle ARP packets
 		else if (BUF->type == UIP_HTONS(UIP_ETHTYPE_ARP)) {
+			net_stats.arp_in++;
 			uip_arp_arpin();
 			if (uip_len > 0) {
 				network_send();
@@ -317,13 +705,16 @@ static void pollhandler(void) {
 		}
 #endif
 		else {
+			net_stats.rx_unknown++;
 			uip_len = 0;
 		}
 	}
-#if !CONFIG_LIB_CONTIKI_IPV6
-	else if (timer_expired(&arp_timer)) {
-		timer_reset(&arp_timer);
-		uip_arp_timer();
+
+#if NIC_CAPS & NIC_CAP_RX_INT
+	// The pin change only fires on edges, so keep going while the NIC still
+	// has packets waiting
+	if (nic_rx_pending()) {
+		process_poll(&network_process);
 	}
 #endif
 }
@@ -334,16 +725,40 @@ PROCESS_THREAD(network_process, ev, data) {
 
 	network_init();
 	tcpip_set_outputfunc(network_send_tcpip);
+#if CONFIG_APPS_DHCP
+	notify_subscribe(&dhcp_notify, &dhcp_sub);
+#endif
 	process_poll(&network_process);
 
+	update_status();
+	etimer_set(&status_timer, NETWORK_STATUS_INTERVAL);
+
 	while (1) {
 		PROCESS_WAIT_EVENT();
 
+		if (ev == PROCESS_EVENT_TIMER && data == &status_timer) {
+			etimer_reset(&status_timer);
+			update_status();
+
+#if !CONFIG_LIB_CONTIKI_IPV6
+			if (timer_expired(&arp_timer)) {
+				timer_reset(&arp_timer);
+				uip_arp_timer();
+#if CONFIG_APPS_ARP
+				while (arp_refresh()) {
+					network_send();
+				}
+#endif
+			}
+#endif
+			continue;
+		}
+
 #if CONFIG_APPS_DHCP
 		if (ev == dhcp_event) {
 			if (dhcp_status.configured != net_status.configured) {
 				net_status.configured = dhcp_status.configured;
-				process_post(PROCESS_BROADCAST, net_event, &net_status);
+				notify_post(&net_notify, net_event, &net_status);
 
 #if CONFIG_APPS_SYSLOG
 				syslog_P(
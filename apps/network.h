@@ -21,6 +21,8 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
+#include <notify.h>
+
 typedef struct {
 	int link : 1;
 	int speed_100m : 1;
@@ -28,9 +30,50 @@ typedef struct {
 	int configured : 1;
 } network_status_t;
 
+// Interface counters, for netstat -i and the web API
+typedef struct {
+	uint32_t polls; // network process poll handler runs
+	uint32_t rx_frames;
+	uint32_t rx_bytes;
+	uint16_t rx_oversize; // too big for uip_buf
+	uint16_t rx_overruns; // status checks that found the NIC had lost frames
+	uint16_t rx_chkerr; // TCP/UDP checksum failures (offloaded checks only)
+	uint16_t rx_unknown; // neither IP nor ARP
+	uint16_t rx_peak; // most bytes waiting in the NIC's RX buffer
+	uint16_t rx_bursts; // polls that drained a backed-up RX buffer
+	uint32_t tx_frames;
+	uint32_t tx_bytes;
+	uint16_t tx_errors; // frames the NIC wouldn't send (no link)
+	uint16_t arp_in;
+	uint16_t arp_out;
+} network_stats_t;
+
+// net_event goes to the processes subscribed here
 extern process_event_t net_event;
+extern struct notify net_notify;
 extern network_status_t net_status;
+extern network_stats_t net_stats;
 
 void network_get_macaddr(struct uip_eth_addr *addr);
 
+// Receive frames sent to a multicast MAC address. The NIC filters on a
+// 64-entry hash, so a few others may get through too.
+void network_multicast_add(const struct uip_eth_addr *addr);
+// Stop receiving all multicasts
+void network_multicast_clear(void);
+
+// Let conn (from uip_connected()) have several full-size segments in flight.
+// uIP only ever has one segment outstanding, so this makes it bigger than the
+// peer's MSS and uip_split_output() cuts it up on the way out.
+void network_tcp_widen(struct uip_conn *conn);
+
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM && CONFIG_DRIVERS_ENC424J600_CACHE
+// Send the len bytes of payload being generated for uip_conn from the NIC's
+// SRAM at addr, leaving uip_appdata alone. Call from the uIP callback, in
+// place of filling uip_appdata; the frame is matched up by sequence number,
+// so a retransmit needs to call this again. The data must stay put until
+// it has been acknowledged.
+void network_send_sram(uint16_t addr, uint16_t len);
+#endif
+
 #endif
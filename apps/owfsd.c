@@ -22,12 +22,26 @@
 #include <string.h>
 #include <contiki-net.h>
 #include <init.h>
-#include <util/delay.h>
 #include <onewire.h>
+#include <memstat.h>
+#include "network.h"
+#include "owfsd.h"
 #if CONFIG_APPS_SYSLOG
 #include "syslog.h"
 #endif
 #include "drivers/ds2482.h"
+#if CONFIG_APPS_OWSCAN
+#include "owscan.h"
+#endif
+#if CONFIG_LIB_OWTEMP
+#include <owtemp.h>
+#endif
+#if CONFIG_LIB_SENSORLOG
+#include <sensorlog.h>
+#endif
+#if OWFSD_WEBSOCKET
+#include <sha1.h>
+#endif
 
 #define OWFSD_PORT 15862
 
@@ -36,7 +50,18 @@
 #define CMD_BITS 'b'
 #define CMD_SEARCH 'A'
 #define CMD_BYTE_SPU 'P'
+#define CMD_COMPOUND 'C'
+#define CMD_LIST 'L'
+#define CMD_TEMPS 'T'
+#define CMD_HISTORY 'S'
+#define CMD_THRESHOLD 'W'
+#define CMD_CHANNEL 'H'
+#define CMD_SPEED 'O'
+#define CMD_INQUIRY 'I'
+#define CMD_MEMORY 'M'
+#define CMD_SUBSCRIBE 'N'
 #define CMD_RET_ERROR 'E' // only used to send back to client
+#define CMD_RET_NOTIFY 'n' // only sent to subscribed clients, unasked
 
 #define ERR_OK 0
 #define ERR_INVALID 1 // invalid command or request size
@@ -44,6 +69,41 @@
 #define ERR_OWSD 3 // bus short detected
 #define ERR_OWERR 4 // general bus fault
 #define ERR_NOLOCK 5 // bus access without a lock
+#define ERR_NODEV 6 // no presence pulse after reset
+#define ERR_CRC 7 // CRC check of data read failed
+
+// CMD_COMPOUND flags
+#define COMPOUND_RESET 0x01 // reset the bus first
+#define COMPOUND_MATCH 0x02 // then MATCH ROM with the first 8 data bytes
+#define COMPOUND_SPU 0x04 // strong pullup after the last byte written
+#define COMPOUND_OVERDRIVE 0x08 // reset and OVERDRIVE SKIP (or MATCH) ROM instead
+
+// CMD_LIST flags
+#define LIST_ALARM 0x80 // only devices found by the last alarm search
+#define LIST_OVERDRIVE 0x80 // response channel flag: device can do overdrive
+#define LIST_END 0xff // response index when there are no more devices (or sensors)
+
+// CMD_MEMORY flags
+#define MEMORY_CRC 0x01 // EXTENDED READ MEMORY, checking each page's CRC16
+
+// CMD_SUBSCRIBE flags: what to send a CMD_RET_NOTIFY packet for, 0 to stop.
+// Notifications go out between responses, never in the middle of one, and
+// say what changed and how many devices there now are; CMD_LIST has the rest.
+#define SUBSCRIBE_INVENTORY OWSCAN_CHANGED_INVENTORY // devices come or gone
+#define SUBSCRIBE_ALARM OWSCAN_CHANGED_ALARM // alarm search found some
+
+#define OW_MATCH_ROM 0x55
+#define OW_READ_MEMORY 0xf0
+#define OW_EXT_READ_MEMORY 0xa5
+#define OW_MEMORY_PAGE 32 // EXTENDED READ MEMORY sends a CRC16 after each
+
+// CMD_INQUIRY protocol version, bumped whenever commands change
+#define OWFSD_PROTOCOL 4
+#ifndef CONFIG_VERSION
+#define FIRMWARE_VERSION ""
+#else
+#define FIRMWARE_VERSION CONFIG_VERSION
+#endif
 
 #ifndef CONFIG_APPS_OWFSD_MAX_CONNS
 #define MAX_CONNS (UIP_CONNS / 2)
@@ -51,22 +111,107 @@
 #define MAX_CONNS CONFIG_APPS_OWFSD_MAX_CONNS
 #endif /* CONFIG_APPS_OWFSD_MAX_CONNS */
 
+// Largest packet (clients find out with CMD_INQUIRY). Each connection needs
+// about five times this, so boards with RAM to spare can raise it to make
+// big transfers such as memory dumps take fewer round trips.
 #ifndef CONFIG_APPS_OWFSD_BUFFER_SIZE
 #define OW_BUFLEN 64
 #else /* CONFIG_APPS_OWFSD_BUFFER_SIZE */
 #define OW_BUFLEN CONFIG_APPS_OWFSD_BUFFER_SIZE
 #endif /* CONFIG_APPS_OWFSD_BUFFER_SIZE */
 
+#if OW_BUFLEN > 255
+#error "owfsd packet lengths are one byte, APPS_OWFSD_BUFFER_SIZE must be 255 or less"
+#endif
+#if OW_BUFLEN < OW_MEMORY_PAGE + 2
+#error "APPS_OWFSD_BUFFER_SIZE must hold a memory page and its CRC"
+#endif
+
+// Pipelined requests and batched responses are buffered per connection; a
+// single TCP segment of requests must fit in this
+#ifndef CONFIG_APPS_OWFSD_IO_BUFFER_SIZE
+#define IO_BUFLEN (2 * (OW_BUFLEN + 2))
+#else /* CONFIG_APPS_OWFSD_IO_BUFFER_SIZE */
+#define IO_BUFLEN CONFIG_APPS_OWFSD_IO_BUFFER_SIZE
+#endif /* CONFIG_APPS_OWFSD_IO_BUFFER_SIZE */
+
+// Also answer the commands that only read cached data over UDP on the same
+// port, so clients that just poll sensors don't need a TCP connection each.
+// Every datagram carries one packet behind a two-byte sequence number of
+// the client's choosing, which comes back untouched in the reply; those
+// commands change nothing, so a client can simply ask again after a loss.
+#ifndef CONFIG_APPS_OWFSD_UDP
+#define OWFSD_UDP 0
+#else /* CONFIG_APPS_OWFSD_UDP */
+#define OWFSD_UDP CONFIG_APPS_OWFSD_UDP
+#endif /* CONFIG_APPS_OWFSD_UDP */
+
+#define UDP_SEQ_LEN 2
+
+#if OWFSD_WEBSOCKET && !CONFIG_LIB_SHA1
+#error "APPS_OWFSD_WEBSOCKET needs LIB_SHA1 for the handshake"
+#endif
+
+#define WS_FIN 0x80
+#define WS_MASK 0x80
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+
+#define WS_IN_HDR 14 // longest client header: 2 bytes, 8 of length, 4 of mask
+#define WS_OUT_HDR 4 // ours never need more than 2 bytes of length
+
+// Room a response needs in the output buffer, framing and all
+#if OWFSD_WEBSOCKET
+#define RESPONSE_MAX (sizeof(struct owfs_packet) + WS_OUT_HDR)
+#else
+#define RESPONSE_MAX sizeof(struct owfs_packet)
+#endif
+
+// And a notification (its type, devices and devices in alarm)
+#define NOTIFY_LEN 3
+#if OWFSD_WEBSOCKET
+#define NOTIFY_MAX (2 + NOTIFY_LEN + 2)
+#else
+#define NOTIFY_MAX (2 + NOTIFY_LEN)
+#endif
+
 #define LOCK_TIMER_INTERVAL (3 * CLOCK_SECOND)
 
+// Run a 1-Wire operation from a command thread, asking uIP to call back as
+// soon as possible whenever the DS2482 is busy rather than waiting for it
+#define OW_WAIT(s, thread) \
+	do { \
+		PT_INIT(&(s)->op.pt); \
+		while (PT_SCHEDULE(thread)) { \
+			tcpip_poll_tcp(uip_conn); \
+			PT_YIELD(&(s)->cmd_pt); \
+		} \
+	} while (0)
+
+// Hold the strong pullup for delay * 10ms. The connection is parked on an
+// etimer and polled again by owfsd_process when it fires.
+#define SPU_WAIT(s, delay) \
+	do { \
+		(s)->spu.conn = uip_conn; \
+		PROCESS_CONTEXT_BEGIN(&owfsd_process); \
+		etimer_set(&(s)->spu.timer, ((delay) * CLOCK_SECOND + 99) / 100); \
+		PROCESS_CONTEXT_END(&owfsd_process); \
+		PT_WAIT_UNTIL(&(s)->cmd_pt, etimer_expired(&(s)->spu.timer)); \
+	} while (0)
+
 struct owfsd_state;
 
 struct owfs_command {
 	uint8_t cmd;
-	int (* fn)(struct owfsd_state *s);
+	char (* fn)(struct owfsd_state *s); // protothread, sets status
 	struct {
 		uint8_t bus_op : 1; // Bus operation; requires lock
 		uint8_t lock_auto : 1; // Causes bus reset; auto-acquires lock
+		uint8_t udp : 1; // Also over UDP; must not touch the bus or yield
 	} flags;
 };
 
@@ -83,28 +228,163 @@ struct owfs_packet {
 			uint8_t delay;
 			uint8_t byte;
 		} spu;
+		struct {
+			uint8_t flags;
+			uint8_t rlen; // bytes to read after writing
+			uint8_t delay; // strong pullup time (10ms units)
+			uint8_t data[OW_BUFLEN - 3]; // ROM address, bytes to write
+		} compound;
+		struct {
+			uint8_t index; // first table slot; in the response, the next one
+			uint8_t flags; // in the response, devices in the table
+			struct {
+				ow_addr_t addr;
+				uint16_t age; // seconds since last found
+				uint8_t channel;
+			} devs[(OW_BUFLEN - 2) / (sizeof(ow_addr_t) + 3)];
+		} list;
+		struct {
+			uint8_t index; // first table slot; in the response, the next one
+			uint8_t count; // in the response, sensors in the table
+			struct {
+				ow_addr_t addr;
+				int16_t temp; // 1/16 degrees C
+				uint16_t age; // seconds since read, 0xffff if the last read failed
+				uint8_t channel;
+			} sensors[(OW_BUFLEN - 2) / (sizeof(ow_addr_t) + 5)];
+		} temps;
+		struct {
+			ow_addr_t addr;
+			uint8_t channel;
+			int8_t tl; // alarm thresholds in degrees C
+			int8_t th;
+		} threshold;
+		struct {
+			uint8_t index; // first table slot; in the response, the next one
+			uint8_t count; // in the response, sensors in the table
+			struct {
+				ow_addr_t addr;
+				uint8_t channel;
+				uint8_t samples; // in the history
+				int16_t last; // 1/16 degrees C, as are the rest
+				int16_t avg;
+				int16_t min;
+				int16_t max;
+			} sensors[(OW_BUFLEN - 2) / (sizeof(ow_addr_t) + 10)];
+		} history;
+		struct {
+			ow_addr_t addr;
+			uint16_t address; // memory address to start at
+			uint16_t len; // bytes to read, sent back in as many packets as needed
+			uint8_t flags;
+		} memory;
+		struct {
+			uint8_t protocol; // OWFSD_PROTOCOL
+			uint8_t buflen; // largest packet, OW_BUFLEN
+			uint8_t channels; // DS2482 channels
+			uint8_t compound; // CMD_COMPOUND flags supported
+			uint8_t memory; // CMD_MEMORY flags supported
+			uint8_t ncmds; // commands supported
+			// ncmds command bytes, then the board model and firmware
+			// version, each NUL terminated (cut short if there's no room)
+			uint8_t data[OW_BUFLEN - 6];
+		} inquiry;
+		uint8_t subscribe; // SUBSCRIBE_* flags
 		uint8_t error;
 	} buf;
 };
 
+// The WebSocket frame coming in: its header is gathered a byte at a time,
+// then the payload is unmasked in place and taken in like plain TCP data
+struct owfsd_ws {
+	uint8_t hdr[WS_IN_HDR]; // header so far, kept for the mask
+	uint8_t hdrlen; // bytes of it in hdr (0 once the payload has started)
+	uint8_t mask; // offset of the mask in hdr
+	uint8_t pos; // payload bytes seen so far, for the mask
+	uint8_t data : 1; // the payload is part of the request stream
+	uint16_t left; // payload bytes still to come
+};
+
+// Strong pullup timer, and the connection to poll when it fires
+struct owfsd_spu {
+	struct etimer timer; // must be first, see owfsd_process
+	struct uip_conn *conn;
+};
+
 struct owfsd_state {
-	struct psock sock;
 	struct pt pt;
-	uint8_t buf_in[OW_BUFLEN];
+	uint8_t in[IO_BUFLEN]; // requests not yet handled
+	uint8_t out[IO_BUFLEN]; // responses, the first sendlen of them in flight
+	uint16_t inlen;
+	uint16_t outlen;
+	uint16_t sendlen;
+	uint8_t skip; // bytes of an oversized request still to throw away
 	uint8_t status;
 	struct owfs_packet pkt;
 	struct owfs_command cmd;
+	struct pt cmd_pt;
+	ow_async_t op;
+	union {
+		ow_search_t search;
+		uint8_t i;
+		struct {
+			uint8_t flags;
+			uint8_t wlen;
+			uint8_t rlen;
+			uint8_t delay;
+			uint8_t start; // first byte of bytes to transfer
+		} compound;
+		struct {
+			uint16_t address;
+			uint16_t left; // bytes still to send back
+			uint16_t crc;
+			uint8_t flags;
+			uint8_t n; // bytes read this time round
+		} memory;
+	} cmd_state;
+	struct owfsd_spu spu;
+	ow_waiter_t waiter;
 	struct timer lock_timer;
+#if OWFSD_WEBSOCKET
+	struct owfsd_ws ws;
+#endif
+#if CONFIG_APPS_OWSCAN
+	struct owfsd_state *sub_next; // on the subscribers list
+	struct uip_conn *conn; // to poll when there's something to tell it
+	uint8_t subscribed; // SUBSCRIBE_* flags
+	uint8_t changes; // OWSCAN_CHANGED_* still to be sent
+#endif
 	struct {
 		uint8_t locked : 1;
+		uint8_t busy : 1; // command in progress
+		uint8_t ws : 1; // a WebSocket, handed over by the web server
+		uint8_t ws_closing : 1; // the client has sent a close frame
+		uint8_t ws_closed : 1; // and been sent one back
 	} flags;
 };
 
-static int cmd_reset(struct owfsd_state *s);
-static int cmd_byte(struct owfsd_state *s);
-static int cmd_bit(struct owfsd_state *s);
-static int cmd_search(struct owfsd_state *s);
-static int cmd_byte_spu(struct owfsd_state *s);
+static PT_THREAD(cmd_reset(struct owfsd_state *s));
+static PT_THREAD(cmd_byte(struct owfsd_state *s));
+static PT_THREAD(cmd_bit(struct owfsd_state *s));
+static PT_THREAD(cmd_search(struct owfsd_state *s));
+static PT_THREAD(cmd_byte_spu(struct owfsd_state *s));
+static PT_THREAD(cmd_compound(struct owfsd_state *s));
+static PT_THREAD(cmd_channel(struct owfsd_state *s));
+static PT_THREAD(cmd_speed(struct owfsd_state *s));
+static PT_THREAD(cmd_inquiry(struct owfsd_state *s));
+static PT_THREAD(cmd_memory(struct owfsd_state *s));
+static void queue_response(struct owfsd_state *s);
+#if CONFIG_APPS_OWSCAN
+static PT_THREAD(cmd_list(struct owfsd_state *s));
+static PT_THREAD(cmd_subscribe(struct owfsd_state *s));
+#endif
+#if CONFIG_LIB_OWTEMP
+static PT_THREAD(cmd_temps(struct owfsd_state *s));
+static PT_THREAD(cmd_threshold(struct owfsd_state *s));
+#endif
+#if CONFIG_LIB_SENSORLOG
+static PT_THREAD(cmd_history(struct owfsd_state *s));
+#endif
 
 static const struct owfs_command commands[] PROGMEM = {
 	{ CMD_RESET,	cmd_reset,		{ .bus_op = 1, .lock_auto = 1, } },
@@ -112,259 +392,1024 @@ static const struct owfs_command commands[] PROGMEM = {
 	{ CMD_BITS,		cmd_bit,		{ .bus_op = 1, } },
 	{ CMD_SEARCH,	cmd_search,		{ .bus_op = 1, .lock_auto = 1, } },
 	{ CMD_BYTE_SPU,	cmd_byte_spu,	{ .bus_op = 1, } },
+	{ CMD_COMPOUND,	cmd_compound,	{ .bus_op = 1, .lock_auto = 1, } },
+	{ CMD_CHANNEL,	cmd_channel,	{} },
+	{ CMD_SPEED,	cmd_speed,		{} },
+	{ CMD_INQUIRY,	cmd_inquiry,	{ .udp = 1, } },
+	{ CMD_MEMORY,	cmd_memory,		{ .bus_op = 1, .lock_auto = 1, } },
+#if CONFIG_APPS_OWSCAN
+	{ CMD_LIST,		cmd_list,		{ .udp = 1, } }, // from the owscan cache, no bus access
+	{ CMD_SUBSCRIBE,	cmd_subscribe,	{} },
+#endif
+#if CONFIG_LIB_OWTEMP
+	{ CMD_TEMPS,	cmd_temps,		{ .udp = 1, } }, // from the owtemp readings, no bus access
+	{ CMD_THRESHOLD,	cmd_threshold,	{} }, // written by owtemp at its next conversion
+#endif
+#if CONFIG_LIB_SENSORLOG
+	{ CMD_HISTORY,	cmd_history,	{ .udp = 1, } }, // from the sensorlog history, no bus access
+#endif
 	{} // end-of-table marker
 };
 
 static uint8_t conns_free = MAX_CONNS;
 
-PROCESS(owfsd_process, "owfsd");
-INIT_PROCESS(owfsd_process);
-
-static PT_THREAD(read_bytes(struct owfsd_state *s, uint8_t len)) {
-	PSOCK_BEGIN(&s->sock);
-
-	// Check buffer length
-	if (len > OW_BUFLEN) {
-		s->status = ERR_BUFSZ;
-		PSOCK_EXIT(&s->sock);
-	}
-
-	// Read exactly len bytes
-	s->sock.bufsize = len;
-	PSOCK_READBUF(&s->sock);
-
-	// Check length
-	if (PSOCK_DATALEN(&s->sock) != len) {
-		s->status = ERR_BUFSZ;
-		PSOCK_EXIT(&s->sock);
-	}
-
-	// Read successful
-	s->status = ERR_OK;
-
-	PSOCK_END(&s->sock);
-}
-
-static PT_THREAD(send_response(struct owfsd_state *s)) {
-	PSOCK_BEGIN(&s->sock);
-
-	// Send the response
-	s->sock.bufsize = OW_BUFLEN;
-	PSOCK_SEND(&s->sock, (uint8_t *)&s->pkt, s->pkt.len + 2);
-
-	PSOCK_END(&s->sock);
-}
-
-static PT_THREAD(send_error(struct owfsd_state *s)) {
-	PSOCK_BEGIN(&s->sock);
+#if CONFIG_APPS_OWSCAN
+static struct notify_sub owscan_sub;
+static struct owfsd_state *subscribers;
+#endif
 
-	// Clobber response size & length
-	s->pkt.len = sizeof(s->pkt.buf.error);
-	s->pkt.cmd = CMD_RET_ERROR;
+#if OWFSD_UDP
+#define UDPIPBUF ((struct uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN])
 
-	// Copy over error code
-	s->pkt.buf.error = s->status;
+// Its appstate is &udp_conn, which tells its events apart from TCP ones
+static struct uip_udp_conn *udp_conn;
+#endif
 
-	// Send the error response
-	s->sock.bufsize = OW_BUFLEN;
-	PSOCK_SEND(&s->sock, (uint8_t *)&s->pkt, s->pkt.len + 2);
+PROCESS(owfsd_process, "owfsd");
+INIT_PROCESS(owfsd_process);
 
-	PSOCK_END(&s->sock);
-}
+static PT_THREAD(cmd_reset(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
 
-static int cmd_reset(struct owfsd_state *s) {
 	if (s->pkt.len != 0) {
-		return ERR_INVALID;
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
 	}
 
 	// Reset the bus
-	int ret = ow_reset();
-	if (ret == -2) {
+	OW_WAIT(s, ow_reset_async(&s->op));
+	if (s->op.ret == -2) {
 #if CONFIG_APPS_SYSLOG
 		// Log something
 		syslog_P(LOG_DAEMON | LOG_ERR,
 			PSTR("1-Wire bus short circuit detected"));
 #endif
 
-		return ERR_OWSD;
+		s->status = ERR_OWSD;
+		PT_EXIT(&s->cmd_pt);
 	}
-	else if (ret < 0) {
+	else if (s->op.ret < 0) {
 #if CONFIG_APPS_SYSLOG
 		// Log something
 		syslog_P(LOG_DAEMON | LOG_ERR,
 			PSTR("1-Wire bus reset failure"));
 #endif
 
-		return ERR_OWERR;
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
 	}
 
-	return ERR_OK;
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
 }
 
-static int cmd_byte(struct owfsd_state *s) {
+static PT_THREAD(cmd_byte(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
 	if (s->pkt.len == 0) {
-		return ERR_INVALID;
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
 	}
 
 	// Read/write bytes
-	int ret = ow_block(s->pkt.buf.bytes, s->pkt.len);
-	if (ret < 0) {
-		return ERR_OWERR;
+	OW_WAIT(s, ow_block_async(&s->op, s->pkt.buf.bytes, s->pkt.len));
+	if (s->op.ret < 0) {
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
 	}
 
-	return ERR_OK;
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
 }
 
-static int cmd_bit(struct owfsd_state *s) {
+static PT_THREAD(cmd_bit(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
 	if (s->pkt.len == 0) {
-		return ERR_INVALID;
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
 	}
 
 	// Loop through the data buffer touching bits
-	for (int i = 0; i < s->pkt.len; i++) {
-		int ret = ow_touch_bit(s->pkt.buf.bytes[i]);
-		if (ret < 0) {
-			return ERR_OWERR;
+	for (s->cmd_state.i = 0; s->cmd_state.i < s->pkt.len; s->cmd_state.i++) {
+		OW_WAIT(s, ow_touch_bit_async(&s->op,
+			s->pkt.buf.bytes[s->cmd_state.i]));
+		if (s->op.ret < 0) {
+			s->status = ERR_OWERR;
+			PT_EXIT(&s->cmd_pt);
 		}
 
-		s->pkt.buf.bytes[i] = ret ? 0xff : 0x00;
+		s->pkt.buf.bytes[s->cmd_state.i] = s->op.ret ? 0xff : 0x00;
 	}
 
-	return ERR_OK;
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
 }
 
-static int cmd_search(struct owfsd_state *s) {
+static PT_THREAD(cmd_search(struct owfsd_state *s)) {
+	ow_search_t *src = &s->cmd_state.search;
+
+	PT_BEGIN(&s->cmd_pt);
+
 	if (s->pkt.len != sizeof(s->pkt.buf.search)) {
-		return ERR_INVALID;
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
 	}
 
-	ow_search_t src;
-
 	// Set up the fields
-	memcpy(&src.rom_no, &s->pkt.buf.search.addr, sizeof(src.rom_no));
-	src.last_discrepancy = s->pkt.buf.search.flags & 0x7f;
-	src.last_family_discrepancy = 0;
-	src.last_device_flag = 0;
-	src.alarm = s->pkt.buf.search.flags & 0x80 ? 1 : 0;
-
-	int ret = ow_search_next(&src);
-	if (ret < 0) {
+	memcpy(&src->rom_no, &s->pkt.buf.search.addr, sizeof(src->rom_no));
+	src->last_discrepancy = s->pkt.buf.search.flags & 0x7f;
+	src->last_family_discrepancy = 0;
+	src->last_device_flag = 0;
+	src->alarm = s->pkt.buf.search.flags & 0x80 ? 1 : 0;
+
+	OW_WAIT(s, ow_search_async(&s->op, src));
+	if (s->op.ret < 0) {
 #if CONFIG_APPS_SYSLOG
 		// Log something
 		syslog_P(LOG_DAEMON | LOG_ERR,
 			PSTR("1-Wire bus search failed"));
 #endif
 
-		return ERR_OWERR;
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
 	}
-	else if (ret == 0) {
+	else if (s->op.ret == 0) {
 		memset(&s->pkt.buf.search.addr, 0, sizeof(ow_addr_t));
 		s->pkt.buf.search.flags = 0xff; // no devices on bus
 
-		return ERR_OK;
+		s->status = ERR_OK;
+		PT_EXIT(&s->cmd_pt);
 	}
 
 	// Copy back the found 1-Wire address
-	memcpy(&s->pkt.buf.search.addr, &src.rom_no, sizeof(src.rom_no));
+	memcpy(&s->pkt.buf.search.addr, &src->rom_no, sizeof(src->rom_no));
 
 	// Found last device?
-	if (src.last_device_flag) {
+	if (src->last_device_flag) {
 		s->pkt.buf.search.flags = 0xfe;
 	}
 	else {
-		s->pkt.buf.search.flags = src.last_discrepancy;
+		s->pkt.buf.search.flags = src->last_discrepancy;
 	}
 
-	return ERR_OK;
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
 }
 
-static int cmd_byte_spu(struct owfsd_state *s) {
+static PT_THREAD(cmd_byte_spu(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
 	if (s->pkt.len != sizeof(s->pkt.buf.spu)) {
-		return ERR_INVALID;
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
 	}
 
 	// Send power byte command
-	int ret = ow_write_byte_power(s->pkt.buf.spu.byte);
-	if (ret) {
-		return ERR_OWERR;
+	OW_WAIT(s, ow_write_byte_power_async(&s->op, s->pkt.buf.spu.byte));
+	if (s->op.ret) {
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
 	}
 
 	// Wait for delay * 10ms
-	while (s->pkt.buf.spu.delay--) {
-		// FIXME: find a better way of doing this!
-		_delay_ms(10);
+	SPU_WAIT(s, s->pkt.buf.spu.delay);
+
+	if (ow_level_std()) {
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
 	}
 
-	ret = ow_level_std();
-	if (ret) {
-		return ERR_OWERR;
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+static PT_THREAD(cmd_compound(struct owfsd_state *s)) {
+	uint8_t *bytes = s->pkt.buf.bytes;
+
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len < 3) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	s->cmd_state.compound.flags = s->pkt.buf.compound.flags;
+	s->cmd_state.compound.rlen = s->pkt.buf.compound.rlen;
+	s->cmd_state.compound.wlen = s->pkt.len - 3;
+	s->cmd_state.compound.delay = s->pkt.buf.compound.delay;
+
+	if (s->cmd_state.compound.flags & COMPOUND_MATCH) {
+		if (s->cmd_state.compound.wlen < sizeof(ow_addr_t)) {
+			s->status = ERR_INVALID;
+			PT_EXIT(&s->cmd_pt);
+		}
+
+		// MATCH ROM command byte
+		s->cmd_state.compound.wlen++;
+	}
+
+	if (s->cmd_state.compound.wlen + s->cmd_state.compound.rlen > OW_BUFLEN) {
+		s->status = ERR_BUFSZ;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// Lay out the whole transfer in the packet buffer: MATCH ROM and the
+	// address, the bytes to write, then 0xff for each byte to read
+	memmove(&bytes[s->cmd_state.compound.flags & COMPOUND_MATCH ? 1 : 0],
+		s->pkt.buf.compound.data, s->pkt.len - 3);
+	if (s->cmd_state.compound.flags & COMPOUND_MATCH) {
+		bytes[0] = 0x55;
+	}
+	memset(&bytes[s->cmd_state.compound.wlen], 0xff,
+		s->cmd_state.compound.rlen);
+
+	s->cmd_state.compound.start = 0;
+
+	if (s->cmd_state.compound.flags & COMPOUND_OVERDRIVE) {
+		// OVERDRIVE MATCH ROM sends the address itself, and leaves the
+		// connection at overdrive speed
+		OW_WAIT(s, ow_overdrive_async(&s->op,
+			(s->cmd_state.compound.flags & COMPOUND_MATCH) ?
+			(const ow_addr_t *)&bytes[1] : NULL));
+		if (s->cmd_state.compound.flags & COMPOUND_MATCH) {
+			s->cmd_state.compound.start = 1 + sizeof(ow_addr_t);
+		}
+	}
+	else if (s->cmd_state.compound.flags & COMPOUND_RESET) {
+		OW_WAIT(s, ow_reset_async(&s->op));
+	}
+
+	if (s->cmd_state.compound.flags & (COMPOUND_OVERDRIVE | COMPOUND_RESET)) {
+		if (s->op.ret == -2) {
+			s->status = ERR_OWSD;
+			PT_EXIT(&s->cmd_pt);
+		}
+		else if (s->op.ret < 0) {
+			s->status = ERR_OWERR;
+			PT_EXIT(&s->cmd_pt);
+		}
+		else if (s->op.ret == 0) {
+			s->status = ERR_NODEV;
+			PT_EXIT(&s->cmd_pt);
+		}
+	}
+
+	if ((s->cmd_state.compound.flags & COMPOUND_SPU) &&
+		s->cmd_state.compound.wlen > s->cmd_state.compound.start)
+	{
+		// Everything but the last byte written...
+		OW_WAIT(s, ow_block_async(&s->op,
+			&bytes[s->cmd_state.compound.start],
+			s->cmd_state.compound.wlen - 1 - s->cmd_state.compound.start));
+		if (s->op.ret < 0) {
+			s->status = ERR_OWERR;
+			PT_EXIT(&s->cmd_pt);
+		}
+
+		// ...then the last one with the strong pullup on after it
+		OW_WAIT(s, ow_write_byte_power_async(&s->op,
+			bytes[s->cmd_state.compound.wlen - 1]));
+		if (s->op.ret < 0) {
+			s->status = ERR_OWERR;
+			PT_EXIT(&s->cmd_pt);
+		}
+
+		SPU_WAIT(s, s->cmd_state.compound.delay);
+
+		if (ow_level_std()) {
+			s->status = ERR_OWERR;
+			PT_EXIT(&s->cmd_pt);
+		}
+
+		OW_WAIT(s, ow_block_async(&s->op, &bytes[s->cmd_state.compound.wlen],
+			s->cmd_state.compound.rlen));
+	}
+	else {
+		OW_WAIT(s, ow_block_async(&s->op,
+			&bytes[s->cmd_state.compound.start],
+			s->cmd_state.compound.wlen + s->cmd_state.compound.rlen -
+			s->cmd_state.compound.start));
 	}
 
-	return ERR_OK;
+	if (s->op.ret < 0) {
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// Only send back what was read
+	memmove(bytes, &bytes[s->cmd_state.compound.wlen],
+		s->cmd_state.compound.rlen);
+	s->pkt.len = s->cmd_state.compound.rlen;
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
 }
 
-static PT_THREAD(handle_connection(struct owfsd_state *s)) {
-	PT_BEGIN(&s->pt);
+static PT_THREAD(cmd_channel(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 1 || s->pkt.buf.bytes[0] >= OW_CHANNELS) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// The lock only covers the old channel
+	if (s->flags.locked && s->pkt.buf.bytes[0] != s->op.channel) {
+		ow_unlock(s->op.channel);
+		s->flags.locked = 0;
+	}
+
+	// Bus operations from now on are on this channel
+	s->op.channel = s->pkt.buf.bytes[0];
+	s->pkt.len = 0;
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+static PT_THREAD(cmd_speed(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 1 || (s->pkt.buf.bytes[0] != DS2482_MODE_STANDARD &&
+		s->pkt.buf.bytes[0] != DS2482_MODE_OVERDRIVE))
+	{
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// Bus operations from now on are at this speed; only a standard speed
+	// reset takes devices back out of overdrive
+	s->op.speed = s->pkt.buf.bytes[0];
+	s->pkt.len = 0;
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+// Queue one of several responses to a command, waiting for room
+#define SEND_PART(s) \
+	do { \
+		PT_WAIT_UNTIL(&(s)->cmd_pt, \
+			IO_BUFLEN - (s)->outlen >= RESPONSE_MAX); \
+		(s)->status = ERR_OK; \
+		queue_response(s); \
+	} while (0)
+
+static PT_THREAD(cmd_memory(struct owfsd_state *s)) {
+	uint8_t *bytes = s->pkt.buf.bytes;
+
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != sizeof(s->pkt.buf.memory) || !s->pkt.buf.memory.len) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	s->cmd_state.memory.address = s->pkt.buf.memory.address;
+	s->cmd_state.memory.left = s->pkt.buf.memory.len;
+	s->cmd_state.memory.flags = s->pkt.buf.memory.flags;
+
+	OW_WAIT(s, ow_reset_async(&s->op));
+	if (s->op.ret == -2) {
+		s->status = ERR_OWSD;
+		PT_EXIT(&s->cmd_pt);
+	}
+	else if (s->op.ret < 0) {
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
+	}
+	else if (s->op.ret == 0) {
+		s->status = ERR_NODEV;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// MATCH ROM and the address, then the read command and where to start
+	memmove(&bytes[1], &s->pkt.buf.memory.addr, sizeof(ow_addr_t));
+	bytes[0] = OW_MATCH_ROM;
+	bytes[9] = (s->cmd_state.memory.flags & MEMORY_CRC) ?
+		OW_EXT_READ_MEMORY : OW_READ_MEMORY;
+	bytes[10] = s->cmd_state.memory.address & 0xff;
+	bytes[11] = s->cmd_state.memory.address >> 8;
+	OW_WAIT(s, ow_block_async(&s->op, bytes, 12));
+	if (s->op.ret < 0) {
+		s->status = ERR_OWERR;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// The first page's CRC covers the command and address too
+	s->cmd_state.memory.crc = ow_crc16(0, &bytes[9], 3);
 
 	while (1) {
-		// Read length byte and command
-		PT_WAIT_THREAD(&s->pt, read_bytes(s, 2));
-		if (s->status) {
-			PT_WAIT_THREAD(&s->pt, send_error(s));
+		if (s->cmd_state.memory.flags & MEMORY_CRC) {
+			// The rest of the page and its (inverted) CRC
+			s->cmd_state.memory.n = OW_MEMORY_PAGE -
+				s->cmd_state.memory.address % OW_MEMORY_PAGE;
+			memset(bytes, 0xff, s->cmd_state.memory.n + 2);
+			OW_WAIT(s, ow_block_async(&s->op, bytes,
+				s->cmd_state.memory.n + 2));
+			if (s->op.ret < 0) {
+				s->status = ERR_OWERR;
+				PT_EXIT(&s->cmd_pt);
+			}
+
+			s->cmd_state.memory.crc = ow_crc16(s->cmd_state.memory.crc,
+				bytes, s->cmd_state.memory.n);
+			if ((uint16_t)~s->cmd_state.memory.crc !=
+				(bytes[s->cmd_state.memory.n] |
+				 (bytes[s->cmd_state.memory.n + 1] << 8)))
+			{
+				s->status = ERR_CRC;
+				PT_EXIT(&s->cmd_pt);
+			}
+
+			// Later pages' CRCs only cover their data
+			s->cmd_state.memory.crc = 0;
+		}
+		else {
+			s->cmd_state.memory.n = s->cmd_state.memory.left < OW_BUFLEN ?
+				s->cmd_state.memory.left : OW_BUFLEN;
+			memset(bytes, 0xff, s->cmd_state.memory.n);
+			OW_WAIT(s, ow_block_async(&s->op, bytes,
+				s->cmd_state.memory.n));
+			if (s->op.ret < 0) {
+				s->status = ERR_OWERR;
+				PT_EXIT(&s->cmd_pt);
+			}
+		}
+
+		s->cmd_state.memory.address += s->cmd_state.memory.n;
+
+		// Don't send back more than was asked for
+		if (s->cmd_state.memory.n > s->cmd_state.memory.left) {
+			s->cmd_state.memory.n = s->cmd_state.memory.left;
+		}
+		s->cmd_state.memory.left -= s->cmd_state.memory.n;
+		s->pkt.len = s->cmd_state.memory.n;
+
+		if (!s->cmd_state.memory.left) {
+			break;
+		}
+
+		// Every part but the last gone out before reading on
+		SEND_PART(s);
+	}
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+// Copy a string from program memory into the inquiry data, returns the new
+// length (which never goes past the end)
+static uint8_t inquiry_str(struct owfsd_state *s, uint8_t len, PGM_P str) {
+	uint8_t *data = s->pkt.buf.inquiry.data;
+
+	while (len < sizeof(s->pkt.buf.inquiry.data)) {
+		data[len] = pgm_read_byte(str++);
+		if (!data[len++]) {
+			break;
+		}
+	}
+
+	return len;
+}
+
+static PT_THREAD(cmd_inquiry(struct owfsd_state *s)) {
+	uint8_t len = 0;
+
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 0) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	s->pkt.buf.inquiry.protocol = OWFSD_PROTOCOL;
+	s->pkt.buf.inquiry.buflen = OW_BUFLEN;
+	s->pkt.buf.inquiry.channels = OW_CHANNELS;
+	s->pkt.buf.inquiry.compound = COMPOUND_RESET | COMPOUND_MATCH |
+		COMPOUND_SPU | COMPOUND_OVERDRIVE;
+	s->pkt.buf.inquiry.memory = MEMORY_CRC;
+
+	// Every command in the table
+	for (const struct owfs_command *cmd = commands;
+		pgm_read_byte(&cmd->cmd) &&
+		len < sizeof(s->pkt.buf.inquiry.data); cmd++)
+	{
+		s->pkt.buf.inquiry.data[len++] = pgm_read_byte(&cmd->cmd);
+	}
+	s->pkt.buf.inquiry.ncmds = len;
+
+	len = inquiry_str(s, len, PSTR(CONFIG_BOARD));
+	len = inquiry_str(s, len, PSTR(FIRMWARE_VERSION));
+	s->pkt.len = 6 + len;
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+#if CONFIG_APPS_OWSCAN
+static PT_THREAD(cmd_list(struct owfsd_state *s)) {
+	uint8_t index = s->pkt.buf.list.index;
+	uint8_t flags = s->pkt.buf.list.flags;
+	uint32_t now = clock_seconds();
+	uint8_t n = 0;
+
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 2) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	// Fill the response with as many devices as will fit
+	for (; index < OWSCAN_DEVICES; index++) {
+		const owscan_dev_t *dev = &owscan_devs[index];
+		uint32_t age = now - dev->seen;
+
+		if (!dev->used || ((flags & LIST_ALARM) && !dev->alarm)) {
 			continue;
 		}
+		else if (n == sizeof(s->pkt.buf.list.devs) /
+			sizeof(s->pkt.buf.list.devs[0]))
+		{
+			break;
+		}
+
+		memcpy(&s->pkt.buf.list.devs[n].addr, &dev->addr, sizeof(ow_addr_t));
+		s->pkt.buf.list.devs[n].age = age > 0xffff ? 0xffff : age;
+		s->pkt.buf.list.devs[n].channel = dev->channel |
+			(dev->overdrive ? LIST_OVERDRIVE : 0);
+		n++;
+	}
+
+	s->pkt.buf.list.index = index < OWSCAN_DEVICES ? index : LIST_END;
+	s->pkt.buf.list.flags = owscan_count();
+	s->pkt.len = 2 + n * sizeof(s->pkt.buf.list.devs[0]);
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+// Take a connection off the subscribers list, if it's there
+static void unsubscribe(struct owfsd_state *s) {
+	for (struct owfsd_state **p = &subscribers; *p; p = &(*p)->sub_next) {
+		if (*p == s) {
+			*p = s->sub_next;
+			break;
+		}
+	}
+
+	s->subscribed = 0;
+	s->changes = 0;
+}
+
+static PT_THREAD(cmd_subscribe(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 1 ||
+		(s->pkt.buf.subscribe & ~(SUBSCRIBE_INVENTORY | SUBSCRIBE_ALARM)))
+	{
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	unsubscribe(s);
+	if (s->pkt.buf.subscribe) {
+		s->subscribed = s->pkt.buf.subscribe;
+		s->conn = uip_conn;
+		s->sub_next = subscribers;
+		subscribers = s;
+	}
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+
+// Tell the subscribers that want to know about a search's changes
+static void owscan_changed(uint8_t changes) {
+	for (struct owfsd_state *s = subscribers; s; s = s->sub_next) {
+		if (changes & s->subscribed) {
+			s->changes |= changes & s->subscribed;
+			tcpip_poll_tcp(s->conn);
+		}
+	}
+}
+#endif
+
+#if CONFIG_LIB_OWTEMP
+static PT_THREAD(cmd_temps(struct owfsd_state *s)) {
+	uint8_t index = s->pkt.buf.temps.index;
+	uint32_t now = clock_seconds();
+	uint8_t n = 0, count = 0;
+
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 1) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		if (owtemp_readings[i].used) {
+			count++;
+		}
+	}
+
+	// Fill the response with as many readings as will fit
+	for (; index < OWTEMP_SENSORS; index++) {
+		const owtemp_reading_t *r = &owtemp_readings[index];
+		uint32_t age = now - r->time;
+
+		if (!r->used) {
+			continue;
+		}
+		else if (n == sizeof(s->pkt.buf.temps.sensors) /
+			sizeof(s->pkt.buf.temps.sensors[0]))
+		{
+			break;
+		}
+
+		memcpy(&s->pkt.buf.temps.sensors[n].addr, &r->addr, sizeof(ow_addr_t));
+		s->pkt.buf.temps.sensors[n].temp = r->temp;
+		s->pkt.buf.temps.sensors[n].age =
+			(!r->valid || age > 0xfffe) ? 0xffff : age;
+		s->pkt.buf.temps.sensors[n].channel = r->channel;
+		n++;
+	}
+
+	s->pkt.buf.temps.index = index < OWTEMP_SENSORS ? index : LIST_END;
+	s->pkt.buf.temps.count = count;
+	s->pkt.len = 2 + n * sizeof(s->pkt.buf.temps.sensors[0]);
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+#endif
+
+#if CONFIG_LIB_OWTEMP
+static PT_THREAD(cmd_threshold(struct owfsd_state *s)) {
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != sizeof(s->pkt.buf.threshold)) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	if (owtemp_set_alarm(&s->pkt.buf.threshold.addr,
+		s->pkt.buf.threshold.channel,
+		s->pkt.buf.threshold.tl, s->pkt.buf.threshold.th))
+	{
+		s->status = ERR_NODEV;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	s->pkt.len = 0;
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+#endif
+
+#if CONFIG_LIB_SENSORLOG
+static PT_THREAD(cmd_history(struct owfsd_state *s)) {
+	uint8_t index = s->pkt.buf.history.index;
+	uint8_t n = 0, count = 0;
+
+	PT_BEGIN(&s->cmd_pt);
+
+	if (s->pkt.len != 1) {
+		s->status = ERR_INVALID;
+		PT_EXIT(&s->cmd_pt);
+	}
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		if (sensorlog[i].used && sensorlog[i].count) {
+			count++;
+		}
+	}
+
+	// Fill the response with as many sensors as will fit
+	for (; index < SENSORLOG_SENSORS; index++) {
+		const sensorlog_t *l = &sensorlog[index];
+
+		if (!l->used || !l->count) {
+			continue;
+		}
+		else if (n == sizeof(s->pkt.buf.history.sensors) /
+			sizeof(s->pkt.buf.history.sensors[0]))
+		{
+			break;
+		}
+
+		memcpy(&s->pkt.buf.history.sensors[n].addr, &l->addr,
+			sizeof(ow_addr_t));
+		s->pkt.buf.history.sensors[n].channel = l->channel;
+		s->pkt.buf.history.sensors[n].samples = l->count;
+		s->pkt.buf.history.sensors[n].last = sensorlog_sample(l, 0);
+		s->pkt.buf.history.sensors[n].avg = sensorlog_avg(l);
+		s->pkt.buf.history.sensors[n].min = l->min;
+		s->pkt.buf.history.sensors[n].max = l->max;
+		n++;
+	}
+
+	s->pkt.buf.history.index = index < SENSORLOG_SENSORS ? index : LIST_END;
+	s->pkt.buf.history.count = count;
+	s->pkt.len = 2 + n * sizeof(s->pkt.buf.history.sensors[0]);
+
+	s->status = ERR_OK;
+
+	PT_END(&s->cmd_pt);
+}
+#endif
+
+// Is there a whole request (or the header of an oversized one) to handle?
+#define REQUEST_READY(s) \
+	((s)->inlen >= 2 && \
+	 ((s)->in[0] > OW_BUFLEN || (s)->inlen >= 2 + (s)->in[0]))
+
+// Queue the response, or the error in status, behind any others
+#define SEND_RESPONSE(s) \
+	do { \
+		PT_WAIT_UNTIL(&(s)->pt, IO_BUFLEN - (s)->outlen >= RESPONSE_MAX); \
+		queue_response(s); \
+	} while (0)
+
+#if OWFSD_WEBSOCKET
+// Write the header of an unmasked frame, returning its length
+static uint8_t ws_header(uint8_t *buf, uint8_t opcode, uint16_t len) {
+	buf[0] = WS_FIN | opcode;
+	if (len < 126) {
+		buf[1] = len;
+		return 2;
+	}
+
+	buf[1] = 126;
+	buf[2] = len >> 8;
+	buf[3] = len;
+	return 4;
+}
+#endif
+
+static void queue_response(struct owfsd_state *s) {
+	if (s->status) {
+		// Clobber response size & length
+		s->pkt.len = sizeof(s->pkt.buf.error);
+		s->pkt.cmd = CMD_RET_ERROR;
+
+		// Copy over error code
+		s->pkt.buf.error = s->status;
+	}
+
+#if OWFSD_WEBSOCKET
+	// A frame per response (the UDP reply never has this set)
+	if (s->flags.ws) {
+		s->outlen += ws_header(&s->out[s->outlen], WS_OP_BINARY,
+			s->pkt.len + 2);
+	}
+#endif
+
+	memcpy(&s->out[s->outlen], &s->pkt, s->pkt.len + 2);
+	s->outlen += s->pkt.len + 2;
+}
+
+#if CONFIG_APPS_OWSCAN
+// Queue a notification of the changes not yet sent, if there's room
+static void queue_notify(struct owfsd_state *s) {
+	uint8_t *p = &s->out[s->outlen];
+	uint8_t alarms = 0;
+
+	if (IO_BUFLEN - s->outlen < NOTIFY_MAX) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+		if (owscan_devs[i].used && owscan_devs[i].alarm) {
+			alarms++;
+		}
+	}
+
+#if OWFSD_WEBSOCKET
+	if (s->flags.ws) {
+		p += ws_header(p, WS_OP_BINARY, 2 + NOTIFY_LEN);
+	}
+#endif
+
+	p[0] = NOTIFY_LEN;
+	p[1] = CMD_RET_NOTIFY;
+	p[2] = s->changes;
+	p[3] = owscan_count();
+	p[4] = alarms;
+	s->outlen = p + 2 + NOTIFY_LEN - s->out;
+	s->changes = 0;
+}
+#endif
+
+// Take in newly received data, returns -1 if there is no room for it
+static int input_add(struct owfsd_state *s, const uint8_t *data,
+	uint16_t len)
+{
+	uint16_t skip = s->skip < len ? s->skip : len;
+
+	// Throw away the rest of an oversized request
+	data += skip;
+	len -= skip;
+	s->skip -= skip;
+
+	if (len > IO_BUFLEN - s->inlen) {
+		return -1;
+	}
+
+	memcpy(&s->in[s->inlen], data, len);
+	s->inlen += len;
+
+	return 0;
+}
+
+// Remove len bytes of handled requests from the input buffer
+static void input_consume(struct owfsd_state *s, uint16_t len) {
+	uint16_t skip;
+
+	s->inlen -= len;
+	skip = s->skip < s->inlen ? s->skip : s->inlen;
+	s->inlen -= skip;
+	s->skip -= skip;
+
+	memmove(s->in, &s->in[len + skip], s->inlen);
+}
+
+#if OWFSD_WEBSOCKET
+// Deal with a client frame header now it's all in, returning -1 if it's
+// not something we can take
+static int ws_frame(struct owfsd_state *s) {
+	struct owfsd_ws *ws = &s->ws;
+	const uint8_t *hdr = ws->hdr;
+	uint8_t len = hdr[1] & 0x7f;
+
+	ws->mask = ws->hdrlen - 4;
+	ws->hdrlen = 0;
+	ws->pos = 0;
+	ws->data = 0;
+
+	// Clients have to mask everything they send
+	if (!(hdr[1] & WS_MASK)) {
+		return -1;
+	}
+
+	// Nothing anywhere near 64 KiB is going to fit, but those buffered
+	// here can still be frames that big
+	if (len == 127) {
+		if (hdr[2] | hdr[3] | hdr[4] | hdr[5] | hdr[6] | hdr[7]) {
+			return -1;
+		}
+		ws->left = ((uint16_t)hdr[8] << 8) | hdr[9];
+	}
+	else if (len == 126) {
+		ws->left = ((uint16_t)hdr[2] << 8) | hdr[3];
+	}
+	else {
+		ws->left = len;
+	}
+
+	switch (hdr[0] & 0x0f) {
+	case WS_OP_CONT:
+	case WS_OP_BINARY:
+		ws->data = 1;
+		break;
+
+	case WS_OP_CLOSE:
+		// Answered once the requests so far have been
+		s->flags.ws_closing = 1;
+		break;
+
+	case WS_OP_PING:
+		// The pong should echo the ping's payload, but nothing this talks
+		// to looks: browsers only ever answer pings
+		if (IO_BUFLEN - s->outlen >= 2) {
+			s->outlen += ws_header(&s->out[s->outlen], WS_OP_PONG, 0);
+		}
+		break;
+
+	case WS_OP_PONG:
+		break;
+
+	default:
+		// Text frames, or something newer than RFC 6455
+		return -1;
+	}
+
+	return 0;
+}
+
+// Take in newly received frames, returns -1 if they're bad or there is no
+// room for their payload
+static int ws_input(struct owfsd_state *s) {
+	struct owfsd_ws *ws = &s->ws;
+	uint8_t *data = uip_appdata;
+	uint16_t len = uip_datalen();
+	uint16_t n;
+
+	// Anything after a close frame is of no interest
+	while (len && !s->flags.ws_closing) {
+		if (!ws->left) {
+			ws->hdr[ws->hdrlen++] = *data++;
+			len--;
+
+			// The second byte says how long the header is
+			if (ws->hdrlen >= 2 &&
+				ws->hdrlen == 6 + ((ws->hdr[1] & 0x7f) == 126 ? 2 :
+					(ws->hdr[1] & 0x7f) == 127 ? 8 : 0) &&
+				ws_frame(s))
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		n = len < ws->left ? len : ws->left;
+		if (ws->data) {
+			for (uint16_t i = 0; i < n; i++) {
+				data[i] ^= ws->hdr[ws->mask + ((ws->pos + i) & 3)];
+			}
+			if (input_add(s, data, n)) {
+				return -1;
+			}
+		}
+
+		ws->pos += n;
+		ws->left -= n;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+#endif
+
+// Look up the command in s->pkt, leaving s->cmd zeroed if there's no such
+// command
+static void find_command(struct owfsd_state *s) {
+	const struct owfs_command *cmd = commands;
+	uint8_t c;
+
+	while ((c = pgm_read_byte(&cmd->cmd))) {
+		if (c == s->pkt.cmd) {
+			memcpy_P(&s->cmd, cmd, sizeof(s->cmd));
+			return;
+		}
+		cmd++;
+	}
+
+	memset(&s->cmd, 0, sizeof(s->cmd));
+}
+
+static PT_THREAD(handle_connection(struct owfsd_state *s)) {
+	PT_BEGIN(&s->pt);
+
+	while (1) {
+		// Wait for a whole request
+		PT_WAIT_UNTIL(&s->pt, REQUEST_READY(s));
 
 		// Read in the length and command bytes
-		s->pkt.len = s->buf_in[0];
-		s->pkt.cmd = s->buf_in[1];
+		s->pkt.len = s->in[0];
+		s->pkt.cmd = s->in[1];
 
 		// Make sure the length isn't too long
 		if (s->pkt.len > OW_BUFLEN) {
-			// Weed to consume the sent bytes anyway
-			while (s->pkt.len) {
-				PT_WAIT_THREAD(&s->pt, read_bytes(s,
-					s->pkt.len < OW_BUFLEN ? s->pkt.len : OW_BUFLEN));
-				s->pkt.len -= s->pkt.len < OW_BUFLEN ? s->pkt.len : OW_BUFLEN;
-			}
+			// Need to consume the sent bytes anyway
+			s->skip = s->pkt.len;
+			input_consume(s, 2);
 
 			// Send error
 			s->status = ERR_BUFSZ;
-			PT_WAIT_THREAD(&s->pt, send_error(s));
+			SEND_RESPONSE(s);
 			continue;
 		}
-		else if (s->pkt.len) {
-			// Read in the data packet
-			PT_WAIT_THREAD(&s->pt, read_bytes(s, s->pkt.len));
-			if (s->status) {
-				PT_WAIT_THREAD(&s->pt, send_error(s));
-				continue;
-			}
 
-			// Copy the packet contents
-			memcpy(s->pkt.buf.bytes, s->buf_in, s->pkt.len);
-		}
+		// Copy the packet contents
+		memcpy(s->pkt.buf.bytes, &s->in[2], s->pkt.len);
+		input_consume(s, 2 + s->pkt.len);
 
 		// Get the command info
-		const struct owfs_command *cmd = commands;
-		do {
-			uint8_t c = pgm_read_byte(&cmd->cmd);
-			if (!c) {
-				memset(&s->cmd, 0, sizeof(s->cmd));
-				break;
-			}
-			else if (c == s->pkt.cmd) {
-				memcpy_P(&s->cmd, cmd, sizeof(s->cmd));
-				break;
-			}
-			else {
-				cmd++;
-			}
-		} while (1);
+		find_command(s);
 
 		// Sanity check command
 		if (!s->cmd.cmd) {
 			s->status = ERR_INVALID;
-			PT_WAIT_THREAD(&s->pt, send_error(s));
+			SEND_RESPONSE(s);
 			continue;
 		}
 
@@ -375,10 +1420,12 @@ static PT_THREAD(handle_connection(struct owfsd_state *s)) {
 				timer_restart(&s->lock_timer);
 			}
 			else if (s->cmd.flags.lock_auto) {
-				// Acquire a lock
-				while (!ow_lock()) {
-					uip_poll_conn(uip_conn);
-					PT_YIELD(&s->pt);
+				// Acquire a lock, queueing for it if need be (owfsd_process
+				// polls the connection when it is handed over)
+				if (!ow_lock_queue(&s->waiter, s->op.channel,
+					&owfsd_process, uip_conn))
+				{
+					PT_WAIT_UNTIL(&s->pt, s->waiter.granted);
 				}
 
 				s->flags.locked = 1;
@@ -386,52 +1433,184 @@ static PT_THREAD(handle_connection(struct owfsd_state *s)) {
 			}
 			else {
 				s->status = ERR_NOLOCK;
-				PT_WAIT_THREAD(&s->pt, send_error(s));
+				SEND_RESPONSE(s);
 				continue;
 			}
 		}
 
-		// Run command
-		s->status = s->cmd.fn(s);
+		// Run command, which yields whenever the bus is busy
+		s->flags.busy = 1;
+		PT_SPAWN(&s->pt, &s->cmd_pt, s->cmd.fn(s));
+		s->flags.busy = 0;
+
+		// Send the response (or error)
+		SEND_RESPONSE(s);
+	}
+
+	PT_END(&s->pt);
+}
+
+static void owfsd_free(struct owfsd_state *s) {
+	// The I2C driver may still be using the operation state
+	while (i2c_xfer_busy(&s->op.xfer));
+
+	// Make sure we release the lock (and the DS2482 if a command was cut
+	// short), or stop waiting for it
+	if (s->waiter.granted) {
+		ow_async_abort(&s->op);
+		ow_unlock(s->op.channel);
+	}
+	else {
+		ow_lock_cancel(&s->waiter);
+	}
+
+	// Don't leave a strong pullup timer running
+	etimer_stop(&s->spu.timer);
+
+#if CONFIG_APPS_OWSCAN
+	unsubscribe(s);
+#endif
+
+	// Free state data
+	memstat_free(MEMSTAT_OWFSD, s);
+	tcp_markconn(uip_conn, NULL);
+	conns_free++;
+}
+
+// Allocate a connection's state, if there's a slot and memory for it
+static struct owfsd_state *owfsd_alloc(void) {
+	struct owfsd_state *s;
+
+	if (!conns_free) {
+		return NULL;
+	}
 
-		// Check command result
-		if (s->status) {
-			PT_WAIT_THREAD(&s->pt, send_error(s));
+	s = memstat_calloc(MEMSTAT_OWFSD, 1, sizeof(*s));
+	if (s) {
+		conns_free--;
+	}
+
+	return s;
+}
+
+// Take on uip_conn and start handling it
+static void owfsd_start(struct owfsd_state *s) {
+	tcp_markconn(uip_conn, s);
+#if !CONFIG_LIB_CONTIKI_IPV6
+	network_tcp_widen(uip_conn);
+#endif
+	PT_INIT(&s->pt);
+
+#if CONFIG_APPS_SYSLOG
+	// Log something
+	syslog_P(LOG_DAEMON | LOG_INFO,
+		PSTR("%d.%d.%d.%d: Connected"),
+		uip_ipaddr_to_quad(&uip_conn->ripaddr));
+#endif
+
+	// Handle the connection
+	handle_connection(s);
+}
+
+#if OWFSD_WEBSOCKET
+static const char ws_response[] PROGMEM =
+	"HTTP/1.1 101 Switching Protocols\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Accept: ";
+static const char ws_guid[] PROGMEM = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char base64_chars[] PROGMEM =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
+
+// The accept key is base64 of 20 bytes
+#define WS_ACCEPT_LEN 28
+
+static uint8_t base64_encode(char *out, const uint8_t *in, uint8_t len) {
+	char *p = out;
+
+	while (len) {
+		uint32_t v = (uint32_t)in[0] << 16;
+		uint8_t n = len < 3 ? len : 3;
+
+		if (n > 1) {
+			v |= (uint16_t)in[1] << 8;
 		}
-		else {
-			// Send response
-			PT_WAIT_THREAD(&s->pt, send_response(s));
+		if (n > 2) {
+			v |= in[2];
+		}
+
+		// n bytes make n + 1 characters, padded out to 4
+		for (uint8_t i = 0; i < 4; i++) {
+			*p++ = (i <= n) ?
+				pgm_read_byte(&base64_chars[(v >> (18 - 6 * i)) & 63]) : '=';
 		}
+
+		in += n;
+		len -= n;
 	}
 
-	PT_END(&s->pt);
+	return p - out;
 }
 
+int owfsd_websocket(const char *key) {
+	struct owfsd_state *s;
+	sha1_ctx_t sha;
+	uint8_t digest[SHA1_DIGEST_SIZE];
+
+	BUILD_BUG_ON(sizeof(ws_response) - 1 + WS_ACCEPT_LEN + 4 > IO_BUFLEN);
+	BUILD_BUG_ON(sizeof(ws_guid) > IO_BUFLEN);
+
+	s = owfsd_alloc();
+	if (!s) {
+		return -1;
+	}
+	s->flags.ws = 1;
+
+	// The accept key is a hash of the client's key and a fixed GUID, which
+	// the input buffer has room for while it's not in use
+	sha1_init(&sha);
+	sha1_update(&sha, key, OWFSD_WS_KEYLEN);
+	memcpy_P(s->in, ws_guid, sizeof(ws_guid) - 1);
+	sha1_update(&sha, s->in, sizeof(ws_guid) - 1);
+	sha1_final(&sha, digest);
+
+	// The answer goes at the front of the output buffer, to be sent (and
+	// resent if need be) like any response
+	memcpy_P(s->out, ws_response, sizeof(ws_response) - 1);
+	s->outlen = sizeof(ws_response) - 1;
+	s->outlen += base64_encode((char *)&s->out[s->outlen], digest,
+		sizeof(digest));
+	memcpy_P(&s->out[s->outlen], PSTR("\r\n\r\n"), 4);
+	s->outlen += 4;
+
+	// The connection's events come to owfsd from now on
+	PROCESS_CONTEXT_BEGIN(&owfsd_process);
+	owfsd_start(s);
+	PROCESS_CONTEXT_END(&owfsd_process);
+
+	// This is still the web server's turn on the connection, which is
+	// the one chance to send the answer without waiting for a poll
+	s->sendlen = s->outlen;
+	uip_send(s->out, s->sendlen);
+
+	return 0;
+}
+#endif
+
 static void owfsd_appcall(void *state) {
 	struct owfsd_state *s = (struct owfsd_state *)state;
+	int err;
 
 	if (uip_closed() || uip_aborted() || uip_timedout()) {
 		if (s != NULL) {
-			// Make sure we release the lock
-			if (s->flags.locked) {
-				ow_unlock();
-			}
-
-			// Free state data
-			free(s);
-			tcp_markconn(uip_conn, NULL);
-			conns_free++;
+			owfsd_free(s);
 		}
 	}
 	else if (uip_connected()) {
 		// Allocate a connection if we can
-		if (conns_free) {
-			s = calloc(1, sizeof(*s));
-			conns_free--;
-		}
-		else {
-			s = NULL;
-		}
+		s = owfsd_alloc();
 
 		// Make sure we got some memory
 		if (s == NULL) {
@@ -448,27 +1627,95 @@ static void owfsd_appcall(void *state) {
 			return;
 		}
 
-		// Set up the connection
-		tcp_markconn(uip_conn, s);
-		PSOCK_INIT(&s->sock, s->buf_in, OW_BUFLEN);
-		PT_INIT(&s->pt);
+		owfsd_start(s);
+	}
+	else if (s != NULL) {
+		if (uip_acked()) {
+			// Drop the responses the remote end now has
+			s->outlen -= s->sendlen;
+			memmove(s->out, &s->out[s->sendlen], s->outlen);
+			s->sendlen = 0;
+		}
+
+		err = 0;
+		if (uip_newdata()) {
+#if OWFSD_WEBSOCKET
+			if (s->flags.ws) {
+				err = ws_input(s);
+			}
+			else
+#endif
+			err = input_add(s, uip_appdata, uip_datalen());
+		}
 
+		if (err) {
 #if CONFIG_APPS_SYSLOG
-		// Log something
-		syslog_P(LOG_DAEMON | LOG_INFO,
-			PSTR("%d.%d.%d.%d: Connected"),
-			uip_ipaddr_to_quad(&uip_conn->ripaddr));
+			// Log something
+			syslog_P(LOG_DAEMON | LOG_WARNING,
+				PSTR("%d.%d.%d.%d: request buffer overflow"),
+				uip_ipaddr_to_quad(&uip_conn->ripaddr));
 #endif
 
-		// Handle the connection
-		handle_connection(s);
-	}
-	else if (s != NULL) {
+			uip_abort();
+			owfsd_free(s);
+			return;
+		}
+
+		// Handle as many requests as we can
 		handle_connection(s);
 
-		// Check for expired locks
-		if (s->flags.locked && timer_expired(&s->lock_timer)) {
-			ow_unlock();
+#if OWFSD_WEBSOCKET
+		// Answer a close frame once every request before it has been
+		// answered and sent, then close once that has gone too
+		if (s->flags.ws_closing && !s->flags.busy && !REQUEST_READY(s) &&
+			!s->outlen)
+		{
+			if (s->flags.ws_closed) {
+				uip_close();
+				return;
+			}
+
+			s->outlen = ws_header(s->out, WS_OP_CLOSE, 0);
+			s->flags.ws_closed = 1;
+		}
+#endif
+
+#if CONFIG_APPS_OWSCAN
+		// Fit in whatever a subscriber hasn't been told yet (nothing goes
+		// after a WebSocket close)
+		if (s->flags.ws_closing) {
+			s->changes = 0;
+		}
+		if (s->changes) {
+			queue_notify(s);
+		}
+#endif
+
+		if (uip_rexmit()) {
+			uip_send(s->out, s->sendlen);
+		}
+		else if (!s->sendlen && s->outlen &&
+			((!s->flags.busy && !REQUEST_READY(s)) ||
+			 IO_BUFLEN - s->outlen < RESPONSE_MAX))
+		{
+			// Send all the responses batched up so far in one go
+			s->sendlen = s->outlen < uip_mss() ? s->outlen : uip_mss();
+			uip_send(s->out, s->sendlen);
+		}
+
+		// Hold off the remote end while whole requests are still waiting
+		if (REQUEST_READY(s)) {
+			uip_stop();
+		}
+		else if (uip_stopped(uip_conn)) {
+			uip_restart();
+		}
+
+		// Check for expired locks (but not in the middle of a command)
+		if (s->flags.locked && !s->flags.busy &&
+			timer_expired(&s->lock_timer))
+		{
+			ow_unlock(s->op.channel);
 			s->flags.locked = 0;
 		}
 	}
@@ -477,17 +1724,97 @@ static void owfsd_appcall(void *state) {
 	}
 }
 
+#if OWFSD_UDP
+static void owfsd_udp_appcall(void) {
+	const uint8_t *data = uip_appdata;
+	uint16_t len = uip_datalen();
+	struct owfsd_state *s;
+	uip_ipaddr_t addr;
+	uint16_t port;
+
+	if (!uip_newdata() || len < UDP_SEQ_LEN + 2) {
+		return;
+	}
+
+	// Only for as long as it takes to answer; if there's no memory right
+	// now, dropping the request is no worse than losing it on the wire
+	s = memstat_calloc(MEMSTAT_OWFSD, 1, sizeof(*s));
+	if (s == NULL) {
+		return;
+	}
+
+	s->pkt.len = data[UDP_SEQ_LEN];
+	s->pkt.cmd = data[UDP_SEQ_LEN + 1];
+	find_command(s);
+
+	if (s->pkt.len > OW_BUFLEN || len != UDP_SEQ_LEN + 2 + s->pkt.len) {
+		s->status = ERR_BUFSZ;
+	}
+	else if (!s->cmd.flags.udp) {
+		// Unknown, or anything that needs the bus: that's what TCP is for
+		s->status = ERR_INVALID;
+	}
+	else {
+		memcpy(s->pkt.buf.bytes, &data[UDP_SEQ_LEN + 2], s->pkt.len);
+
+		PT_INIT(&s->cmd_pt);
+		if (PT_SCHEDULE(s->cmd.fn(s))) {
+			s->status = ERR_INVALID;
+		}
+	}
+
+	// The reply goes out of uip_buf, over the top of the request
+	memcpy(s->out, data, UDP_SEQ_LEN);
+	s->outlen = UDP_SEQ_LEN;
+	queue_response(s);
+
+	uip_ipaddr_copy(&addr, &UDPIPBUF->srcipaddr);
+	port = UDPIPBUF->srcport;
+	uip_udp_packet_sendto(udp_conn, s->out, s->outlen, &addr, port);
+
+	memstat_free(MEMSTAT_OWFSD, s);
+}
+#endif
+
 PROCESS_THREAD(owfsd_process, ev, data) {
 	PROCESS_BEGIN();
 
 	tcp_listen(UIP_HTONS(OWFSD_PORT));
+#if CONFIG_APPS_OWSCAN
+	notify_subscribe(&owscan_notify, &owscan_sub);
+#endif
+#if OWFSD_UDP
+	udp_conn = udp_new(NULL, 0, &udp_conn);
+	if (udp_conn) {
+		udp_bind(udp_conn, UIP_HTONS(OWFSD_PORT));
+	}
+#endif
 
 	while (1) {
 		PROCESS_WAIT_EVENT();
 
+#if OWFSD_UDP
+		if (ev == tcpip_event && data == &udp_conn) {
+			owfsd_udp_appcall();
+		}
+		else
+#endif
 		if (ev == tcpip_event) {
 			owfsd_appcall(data);
 		}
+		else if (ev == ow_lock_event) {
+			// Bus lock handed over, carry on with the connection
+			tcpip_poll_tcp(data);
+		}
+		else if (ev == PROCESS_EVENT_TIMER) {
+			// Strong pullup time is up, carry on with the connection
+			tcpip_poll_tcp(((struct owfsd_spu *)data)->conn);
+		}
+#if CONFIG_APPS_OWSCAN
+		else if (ev == owscan_event) {
+			owscan_changed(*(uint8_t *)data);
+		}
+#endif
 		else if (ev == PROCESS_EVENT_EXIT) {
 			PROCESS_EXIT();
 		}
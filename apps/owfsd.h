@@ -0,0 +1,47 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef __OWFSD_H__
+#define __OWFSD_H__
+
+// Also carry owfsd packets over WebSockets, upgraded from web server
+// requests for /api/owfs, so browsers can use the bus without a request
+// per transaction. Each binary frame the client sends holds part of the
+// request stream, and each response comes back in a frame of its own.
+#ifndef CONFIG_APPS_OWFSD_WEBSOCKET
+#define OWFSD_WEBSOCKET 0
+#else /* CONFIG_APPS_OWFSD_WEBSOCKET */
+#define OWFSD_WEBSOCKET CONFIG_APPS_OWFSD_WEBSOCKET
+#endif /* CONFIG_APPS_OWFSD_WEBSOCKET */
+
+// A Sec-WebSocket-Key, 16 bytes in base64
+#define OWFSD_WS_KEYLEN 24
+
+#if OWFSD_WEBSOCKET
+/*
+ * Take over uip_conn, an HTTP connection whose request asked to upgrade to
+ * a WebSocket with key, and answer it. Call it from the connection's own
+ * callback, and then forget about the connection. Returns -1 (leaving the
+ * connection alone) if owfsd has no room for it.
+ */
+int owfsd_websocket(const char *key);
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <contiki.h>
+#include <init.h>
+#include <onewire.h>
+#include "owscan.h"
+#if CONFIG_APPS_SYSLOG
+#include "syslog.h"
+#endif
+#include "drivers/ds2482.h"
+
+// Run a 1-Wire operation, polling the process to get back to it whenever the
+// DS2482 is busy
+#define OW_WAIT(thread) \
+	do { \
+		PT_INIT(&op.pt); \
+		while (PT_SCHEDULE(thread)) { \
+			process_poll(&owscan_process); \
+			PROCESS_PAUSE(); \
+		} \
+	} while (0)
+
+PROCESS(owscan_process, "owscan");
+INIT_PROCESS(owscan_process);
+
+owscan_dev_t owscan_devs[OWSCAN_DEVICES];
+process_event_t owscan_event;
+struct notify owscan_notify;
+uint8_t owscan_changes;
+
+static ow_waiter_t waiter;
+static ow_async_t op;
+static ow_search_t search;
+static struct etimer tmr_full;
+#if OWSCAN_ALARM_INTERVAL
+static struct etimer tmr_alarm;
+#endif
+
+uint8_t owscan_count(void) {
+	uint8_t count = 0;
+
+	for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+		if (owscan_devs[i].used) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+void owscan_refresh(void) {
+	// Make the full search timer due now
+	PROCESS_CONTEXT_BEGIN(&owscan_process);
+	etimer_set(&tmr_full, 0);
+	PROCESS_CONTEXT_END(&owscan_process);
+}
+
+// Find a device in the table, or a slot for it
+static owscan_dev_t *lookup(uint8_t channel, const ow_addr_t *addr) {
+	owscan_dev_t *slot = NULL;
+
+	for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+		owscan_dev_t *dev = &owscan_devs[i];
+
+		if (!dev->used) {
+			if (!slot || slot->used) {
+				slot = dev;
+			}
+		}
+		else if (dev->channel == channel &&
+			!memcmp(&dev->addr, addr, sizeof(*addr)))
+		{
+			return dev;
+		}
+		else if (!slot || (slot->used && dev->seen < slot->seen)) {
+			// Table full: replace the device seen longest ago
+			slot = dev;
+		}
+	}
+
+	memcpy(&slot->addr, addr, sizeof(*addr));
+	owscan_changes |= OWSCAN_CHANGED_INVENTORY;
+	slot->channel = channel;
+	slot->used = 1;
+	slot->alarm = 0;
+	slot->overdrive = 0;
+	slot->mark = 0;
+	slot->probed = 0;
+
+	return slot;
+}
+
+// Forget devices that haven't been seen for a while, except on channels
+// that couldn't be searched
+static void expire(uint32_t now, uint8_t failed) {
+	for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+		owscan_dev_t *dev = &owscan_devs[i];
+
+		if (dev->used && !(failed & (1 << dev->channel)) &&
+			now - dev->seen >= OWSCAN_EXPIRE_SEARCHES * OWSCAN_INTERVAL)
+		{
+			dev->used = 0;
+			owscan_changes |= OWSCAN_CHANGED_INVENTORY;
+		}
+	}
+}
+
+#if OWSCAN_ALARM_INTERVAL
+#define ALARM_DUE() etimer_expired(&tmr_alarm)
+#else
+#define ALARM_DUE() 0
+#endif
+
+PROCESS_THREAD(owscan_process, ev, data) {
+	static uint8_t alarm;
+	static uint8_t failed; // channels whose search failed
+	static uint32_t now;
+	static owscan_dev_t *dev;
+
+	PROCESS_BEGIN();
+
+	owscan_event = process_alloc_event();
+
+	// The DS2482 is only set up once the deferred initialisers have run
+	PROCESS_WAIT_UNTIL(init_deferred_done);
+
+	etimer_set(&tmr_full, 0);
+#if OWSCAN_ALARM_INTERVAL
+	etimer_set(&tmr_alarm, OWSCAN_ALARM_INTERVAL * CLOCK_SECOND);
+#endif
+
+	while (1) {
+		// Timers may have gone off during the last search, so only wait if
+		// neither is due yet
+		PROCESS_WAIT_UNTIL(etimer_expired(&tmr_full) || ALARM_DUE());
+		alarm = !etimer_expired(&tmr_full);
+
+		for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+			owscan_devs[i].mark = 0;
+		}
+
+		now = clock_seconds();
+		failed = 0;
+		owscan_changes = 0;
+
+		// Search each channel in turn
+		for (op.channel = 0; op.channel < OW_CHANNELS; op.channel++) {
+			// Wait our turn for the bus
+			if (!ow_lock_queue(&waiter, op.channel, &owscan_process, NULL)) {
+				PROCESS_WAIT_EVENT_UNTIL(waiter.granted);
+			}
+
+			ow_search_init(&search, alarm);
+
+			do {
+				OW_WAIT(ow_search_async(&op, &search));
+				if (op.ret <= 0) {
+					break;
+				}
+
+				// A device in alarm is also a device on the bus
+				dev = lookup(op.channel, &search.rom_no);
+				dev->seen = now;
+				dev->mark = 1;
+			} while (!search.last_device_flag);
+
+			// Find out which new devices can do overdrive: match each one at
+			// overdrive, see if it answers an overdrive speed reset, then
+			// put it back with a standard speed reset
+			for (dev = owscan_devs; op.ret >= 0 &&
+				dev < &owscan_devs[OWSCAN_DEVICES]; dev++)
+			{
+				if (!dev->used || !dev->mark || dev->probed ||
+					dev->channel != op.channel)
+				{
+					continue;
+				}
+
+				OW_WAIT(ow_overdrive_async(&op, &dev->addr));
+				if (op.ret > 0) {
+					OW_WAIT(ow_reset_async(&op));
+					dev->overdrive = (op.ret > 0);
+				}
+
+				op.speed = DS2482_MODE_STANDARD;
+				if (op.ret >= 0) {
+					OW_WAIT(ow_reset_async(&op));
+				}
+				if (op.ret >= 0) {
+					dev->probed = 1;
+				}
+			}
+
+			ow_unlock(op.channel);
+
+			if (op.ret < 0) {
+#if CONFIG_APPS_SYSLOG
+				syslog_P(LOG_DAEMON | LOG_ERR,
+					PSTR("1-Wire bus inventory search failed on channel %d"),
+					op.channel);
+#endif
+				failed |= 1 << op.channel;
+			}
+		}
+
+		if (alarm) {
+			for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+				dev = &owscan_devs[i];
+
+				if (failed & (1 << dev->channel)) {
+					continue;
+				}
+
+				// Every alarm search that finds devices is worth telling
+				// about, as is one that finds the last of them gone quiet
+				if (dev->used && (dev->mark || dev->alarm)) {
+					owscan_changes |= OWSCAN_CHANGED_ALARM;
+				}
+				dev->alarm = dev->mark;
+			}
+		}
+		else {
+			expire(now, failed);
+		}
+
+		notify_post(&owscan_notify, owscan_event, &owscan_changes);
+
+		// Schedule the next search of this kind
+		if (alarm) {
+#if OWSCAN_ALARM_INTERVAL
+			etimer_set(&tmr_alarm, OWSCAN_ALARM_INTERVAL * CLOCK_SECOND);
+#endif
+		}
+		else {
+			etimer_set(&tmr_full, OWSCAN_INTERVAL * CLOCK_SECOND);
+		}
+	}
+
+	PROCESS_END();
+}
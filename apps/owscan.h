@@ -0,0 +1,81 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef __OWSCAN_H__
+#define __OWSCAN_H__
+
+#include <notify.h>
+#include <onewire.h>
+
+// Maximum number of devices remembered
+#ifndef CONFIG_APPS_OWSCAN_DEVICES
+#define OWSCAN_DEVICES 32
+#else
+#define OWSCAN_DEVICES CONFIG_APPS_OWSCAN_DEVICES
+#endif
+
+// Seconds between full bus searches
+#ifndef CONFIG_APPS_OWSCAN_INTERVAL
+#define OWSCAN_INTERVAL 60
+#else
+#define OWSCAN_INTERVAL CONFIG_APPS_OWSCAN_INTERVAL
+#endif
+
+// Seconds between alarm searches (0 to never do them)
+#ifndef CONFIG_APPS_OWSCAN_ALARM_INTERVAL
+#define OWSCAN_ALARM_INTERVAL 10
+#else
+#define OWSCAN_ALARM_INTERVAL CONFIG_APPS_OWSCAN_ALARM_INTERVAL
+#endif
+
+// Devices missing from this many full searches in a row are forgotten
+#define OWSCAN_EXPIRE_SEARCHES 3
+
+typedef struct {
+	ow_addr_t addr;
+	uint8_t channel; // DS2482-800 channel it is on
+	uint32_t seen; // clock_seconds() when last found
+	uint8_t used : 1;
+	uint8_t alarm : 1; // found by the last alarm search
+	uint8_t overdrive : 1; // answers at overdrive speed
+	uint8_t mark : 1; // private: found by the search in progress
+	uint8_t probed : 1; // private: overdrive has been tried
+} owscan_dev_t;
+
+// Device table, with gaps where devices have been forgotten
+extern owscan_dev_t owscan_devs[OWSCAN_DEVICES];
+
+// Posted to owscan_notify's subscribers after a search has updated the table,
+// with a pointer to owscan_changes
+extern process_event_t owscan_event;
+extern struct notify owscan_notify;
+
+// What the last search changed
+#define OWSCAN_CHANGED_INVENTORY 0x01 // devices found, replaced or forgotten
+#define OWSCAN_CHANGED_ALARM 0x02 // devices in alarm (or no longer in alarm)
+extern uint8_t owscan_changes;
+
+// Number of devices in the table
+uint8_t owscan_count(void);
+
+// Run a full search as soon as the bus is free
+void owscan_refresh(void);
+
+#endif
@@ -55,6 +55,7 @@
 
 #include <contiki-net.h>
 #include <net/resolv.h>
+#include "resolv.h"
 #if UIP_UDP
 
 #include <init.h>
@@ -73,8 +74,11 @@ process_event_t resolv_event_found;
 PROCESS(resolv_process, "DNS resolver");
 
 void resolv_conf(const uip_ipaddr_t *dnsserver) { }
+void resolv_conf_servers(const uip_ipaddr_t *dnsservers, uint8_t n) { }
 uip_ipaddr_t *resolv_getserver(void) { return NULL; }
 uip_ipaddr_t *resolv_lookup(const char *name) { return NULL; }
+uip_ipaddr_t *resolv_lookup_ttl(const char *name, uint32_t *ttl)
+{ return NULL; }
 void resolv_query(const char *name) { }
 
 PROCESS_THREAD(resolv_process, ev, data)
@@ -132,8 +136,11 @@ struct namemap {
 	uint8_t retries;
 	uint8_t seqno;
 	uint8_t err;
+	uint8_t asked; /* servers the question went to, a bit each */
+	clock_time_t sent; /* when it went */
 	char name[32];
 	uip_ipaddr_t ipaddr;
+	uint32_t expires; /* clock_seconds() when the answer runs out */
 };
 
 #ifndef UIP_CONF_RESOLV_ENTRIES
@@ -142,9 +149,46 @@ struct namemap {
 #define RESOLV_ENTRIES UIP_CONF_RESOLV_ENTRIES
 #endif /* UIP_CONF_RESOLV_ENTRIES */
 
+/* Answers are kept for their TTL, but within these limits (seconds) */
+#ifndef CONFIG_APPS_RESOLV_MIN_TTL
+#define RESOLV_MIN_TTL 30
+#else
+#define RESOLV_MIN_TTL CONFIG_APPS_RESOLV_MIN_TTL
+#endif
+#ifndef CONFIG_APPS_RESOLV_MAX_TTL
+#define RESOLV_MAX_TTL 86400
+#else
+#define RESOLV_MAX_TTL CONFIG_APPS_RESOLV_MAX_TTL
+#endif
+
+
+#if RESOLV_SERVERS > 8
+#error "APPS_RESOLV_SERVERS must be 8 or less"
+#endif
+
+/* Unanswered questions in a row before a server is passed over */
+#define SERVER_FAILS 2
+
+#define RTT_UNKNOWN 0xffff
+#define NO_SERVER 0xff
+
+#define UDPBUF ((struct uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN])
+
+struct server {
+	uip_ipaddr_t addr;
+	uint16_t rtt; /* smoothed answer time in clock ticks, or RTT_UNKNOWN */
+	uint8_t fails; /* questions in a row it hasn't answered */
+};
 
 static struct namemap names[RESOLV_ENTRIES];
 
+static struct server servers[RESOLV_SERVERS];
+static uint8_t nservers;
+
+/* resolv_conf_servers()'s list, until the process takes it on */
+static uip_ipaddr_t new_servers[RESOLV_SERVERS];
+static uint8_t new_nservers;
+
 static uint8_t seqno;
 
 static struct uip_udp_conn *resolv_conn = NULL;
@@ -188,6 +232,40 @@ parse_name(unsigned char *query)
 	return query + 1;
 }
 /*-----------------------------------------------------------------------------------*/
+/** \internal
+ * The quickest server that is still answering, or NO_SERVER if none has
+ * answered yet (or they've all stopped).
+ */
+static uint8_t best_server(void) {
+	uint8_t best = NO_SERVER;
+
+	for (uint8_t i = 0; i < nservers; i++) {
+		if (servers[i].fails < SERVER_FAILS &&
+			servers[i].rtt != RTT_UNKNOWN &&
+			(best == NO_SERVER || servers[i].rtt < servers[best].rtt))
+		{
+			best = i;
+		}
+	}
+
+	return best;
+}
+/*-----------------------------------------------------------------------------------*/
+/** \internal
+ * Which servers to ask: the best one, or with nothing to go on, all of
+ * them at once, taking whichever answer comes first. An unanswered
+ * question counts against its server, so a dead one soon gets passed over.
+ */
+static uint8_t pick_servers(void) {
+	uint8_t best = best_server();
+
+	if (best != NO_SERVER) {
+		return 1 << best;
+	}
+
+	return (1 << nservers) - 1;
+}
+/*-----------------------------------------------------------------------------------*/
 /** \internal
  * Runs through the list of names to see if there are any that have
  * not yet been queried and, if so, sends out a query.
@@ -196,6 +274,7 @@ parse_name(unsigned char *query)
 	static void
 check_entries(void)
 {
+	uint8_t buf[sizeof(struct dns_hdr) + sizeof(names[0].name) + 2 + 4];
 	register struct dns_hdr *hdr;
 	char *query, *nptr, *nameptr;
 	uint8_t i;
@@ -209,6 +288,13 @@ check_entries(void)
 			etimer_set(&retry, CLOCK_SECOND);
 			if(namemapptr->state == STATE_ASKING) {
 				if(--namemapptr->tmr == 0) {
+					/* Nobody asked has answered */
+					for(n = 0; n < nservers; n++) {
+						if((namemapptr->asked & (1 << n)) &&
+							servers[n].fails < 0xff) {
+							servers[n].fails++;
+						}
+					}
 					if(++namemapptr->retries == MAX_RETRIES) {
 						namemapptr->state = STATE_ERROR;
 						resolv_found(namemapptr->name, NULL);
@@ -226,12 +312,12 @@ check_entries(void)
 				namemapptr->tmr = 1;
 				namemapptr->retries = 0;
 			}
-			hdr = (struct dns_hdr *)uip_appdata;
+			hdr = (struct dns_hdr *)buf;
 			memset(hdr, 0, sizeof(struct dns_hdr));
 			hdr->id = uip_htons(i);
 			hdr->flags1 = DNS_FLAG1_RD;
 			hdr->numquestions = UIP_HTONS(1);
-			query = (char *)uip_appdata + 12;
+			query = (char *)buf + 12;
 			nameptr = namemapptr->name;
 			--nameptr;
 			/* Convert hostname into suitable query format. */
@@ -251,7 +337,17 @@ check_entries(void)
 				{0,0,1,0,1};
 				memcpy(query, endquery, 5);
 			}
-			uip_udp_send((unsigned char)(query + 5 - (char *)uip_appdata));
+			/* Sent from buf, as each send goes out of uip_buf (and an ARP
+			   request may take its place) */
+			namemapptr->asked = pick_servers();
+			namemapptr->sent = clock_time();
+			for(n = 0; n < nservers; n++) {
+				if(namemapptr->asked & (1 << n)) {
+					uip_udp_packet_sendto(resolv_conn, buf,
+						query + 5 - (char *)buf, &servers[n].addr,
+						UIP_HTONS(53));
+				}
+			}
 			break;
 		}
 	}
@@ -267,6 +363,7 @@ static void newdata(void) {
 	static uint8_t nanswers;
 	static uint8_t i;
 	register struct namemap *namemapptr;
+	uint8_t server;
 
 	hdr = (struct dns_hdr *)uip_appdata;
 	/*  printf("ID %d\n", uip_htons(hdr->id));
@@ -289,6 +386,30 @@ static void newdata(void) {
 
 	namemapptr = &names[i];
 
+	/* Only our servers' answers count */
+	for (server = 0; server < nservers; server++) {
+		if (uip_ipaddr_cmp(&UDPBUF->srcipaddr, &servers[server].addr)) {
+			break;
+		}
+	}
+	if (server == nservers) {
+		return;
+	}
+
+	/* Time the answer, even a slower server's that has lost the race */
+	if (namemapptr->asked & (1 << server)) {
+		struct server *srv = &servers[server];
+		clock_time_t rtt = clock_time() - namemapptr->sent;
+
+		if (rtt >= RTT_UNKNOWN) {
+			rtt = RTT_UNKNOWN - 1;
+		}
+		srv->rtt = srv->rtt == RTT_UNKNOWN ? rtt :
+			((uint32_t)srv->rtt * 7 + rtt) / 8;
+		srv->fails = 0;
+		namemapptr->asked &= ~(1 << server);
+	}
+
 	if (namemapptr->state != STATE_ASKING) {
 		return;
 	}
@@ -343,6 +464,17 @@ static void newdata(void) {
 				ans->ipaddr[3]);*/
 			/* XXX: we should really check that this IP address is the one
 			   we want. */
+			uint32_t ttl = (uint32_t)uip_htons(ans->ttl[0]) << 16 |
+				uip_htons(ans->ttl[1]);
+
+			if (ttl < RESOLV_MIN_TTL) {
+				ttl = RESOLV_MIN_TTL;
+			}
+			else if (ttl > RESOLV_MAX_TTL) {
+				ttl = RESOLV_MAX_TTL;
+			}
+			namemapptr->expires = clock_seconds() + ttl;
+
 			for (i = 0; i < 4; i++) {
 				namemapptr->ipaddr.u8[i] = ans->ipaddr[i];
 			}
@@ -356,6 +488,10 @@ static void newdata(void) {
 
 		--nanswers;
 	}
+
+	/* No address in the answer */
+	namemapptr->state = STATE_ERROR;
+	resolv_found(namemapptr->name, NULL);
 }
 
 /*
@@ -382,11 +518,21 @@ PROCESS_THREAD(resolv_process, ev, data) {
 			}
 		}
 		else if (ev == EVENT_NEW_SERVER) {
-			if (resolv_conn != NULL) {
-				uip_udp_remove(resolv_conn);
+			/* Start afresh with the new servers */
+			nservers = new_nservers;
+			for (i = 0; i < nservers; i++) {
+				uip_ipaddr_copy(&servers[i].addr, &new_servers[i]);
+				servers[i].rtt = RTT_UNKNOWN;
+				servers[i].fails = 0;
+			}
+			for (i = 0; i < RESOLV_ENTRIES; i++) {
+				names[i].asked = 0;
 			}
 
-			resolv_conn = udp_new((uip_ipaddr_t *)data, UIP_HTONS(53), NULL);
+			/* Not tied to one server, each question says where it goes */
+			if (resolv_conn == NULL) {
+				resolv_conn = udp_new(NULL, UIP_HTONS(53), NULL);
+			}
 		}
 		else if (ev == tcpip_event) {
 			if (uip_udp_conn->rport == UIP_HTONS(53)) {
@@ -403,9 +549,18 @@ PROCESS_THREAD(resolv_process, ev, data) {
 	PROCESS_END();
 }
 
+/* Has an answer run out? */
+static uint8_t expired(const struct namemap *nameptr) {
+	return (int32_t)(clock_seconds() - nameptr->expires) >= 0;
+}
+
 /**
  * Queues a name so that a question for the name will be sent out.
  *
+ * A name which is already being asked for isn't asked again, and one
+ * with an answer that hasn't run out is answered straight away (with
+ * resolv_event_found, as usual).
+ *
  * \param name The hostname that is to be queried.
  */
 void resolv_query(const char *name) {
@@ -424,6 +579,22 @@ void resolv_query(const char *name) {
 			break;
 		}
 
+		if (strncmp(nameptr->name, name, sizeof(nameptr->name)) == 0) {
+			if (nameptr->state == STATE_NEW ||
+				nameptr->state == STATE_ASKING)
+			{
+				/* Everyone gets the answer when it comes */
+				return;
+			}
+			else if (nameptr->state == STATE_DONE && !expired(nameptr)) {
+				resolv_found(nameptr->name, &nameptr->ipaddr);
+				return;
+			}
+
+			/* Ask again in the same entry */
+			break;
+		}
+
 		if (seqno - nameptr->seqno > lseq) {
 			lseq = seqno - nameptr->seqno;
 			lseqi = i;
@@ -458,6 +629,14 @@ void resolv_query(const char *name) {
  * hostnames.
  */
 uip_ipaddr_t *resolv_lookup(const char *name) {
+	return resolv_lookup_ttl(name, NULL);
+}
+
+/**
+ * Same as resolv_lookup(), and also finds how many more seconds the answer
+ * is good for. Answers that have run out aren't returned.
+ */
+uip_ipaddr_t *resolv_lookup_ttl(const char *name, uint32_t *ttl) {
 	uint8_t i;
 	struct namemap *nameptr;
 
@@ -467,8 +646,12 @@ uip_ipaddr_t *resolv_lookup(const char *name) {
 		nameptr = &names[i];
 
 		if (nameptr->state == STATE_DONE &&
-			strcmp(name, nameptr->name) == 0)
+			strcmp(name, nameptr->name) == 0 &&
+			!expired(nameptr))
 		{
+			if (ttl) {
+				*ttl = nameptr->expires - clock_seconds();
+			}
 			return &nameptr->ipaddr;
 		}
 	}
@@ -480,15 +663,17 @@ uip_ipaddr_t *resolv_lookup(const char *name) {
  * Obtain the currently configured DNS server.
  *
  * \return A pointer to a 4-byte representation of the IP address of
- * the currently configured DNS server or NULL if no DNS server has
- * been configured.
+ * the DNS server questions go to now (the first one, if they're all
+ * being asked) or NULL if no DNS server has been configured.
  */
 uip_ipaddr_t *resolv_getserver(void) {
-	if (resolv_conn == NULL) {
+	uint8_t best = best_server();
+
+	if (resolv_conn == NULL || !nservers) {
 		return NULL;
 	}
 
-	return &resolv_conn->ripaddr;
+	return &servers[best == NO_SERVER ? 0 : best].addr;
 }
 
 /**
@@ -498,15 +683,24 @@ uip_ipaddr_t *resolv_getserver(void) {
  * address of the DNS server to be configured.
  */
 void resolv_conf(const uip_ipaddr_t *dnsserver) {
-	static uip_ipaddr_t server;
-	uip_ipaddr_copy(&server, dnsserver);
-	process_post(&resolv_process, EVENT_NEW_SERVER, &server);
+	resolv_conf_servers(dnsserver, 1);
+}
 
-	/*  if(resolv_conn != NULL) {
-		uip_udp_remove(resolv_conn);
-		}
+/**
+ * Configure several DNS servers, in the order they were given to us.
+ * Beyond the first RESOLV_SERVERS they're ignored.
+ */
+void resolv_conf_servers(const uip_ipaddr_t *dnsservers, uint8_t n) {
+	if (n > RESOLV_SERVERS) {
+		n = RESOLV_SERVERS;
+	}
+
+	for (uint8_t i = 0; i < n; i++) {
+		uip_ipaddr_copy(&new_servers[i], &dnsservers[i]);
+	}
+	new_nservers = n;
 
-		resolv_conn = udp_new(dnsserver, 53, NULL);*/
+	process_post(&resolv_process, EVENT_NEW_SERVER, NULL);
 }
 
 /** \internal
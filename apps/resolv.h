@@ -0,0 +1,45 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef APPS_RESOLV_H
+#define APPS_RESOLV_H
+
+#include <stdint.h>
+#include <contiki-net.h>
+
+// Additions to Contiki's net/resolv.h in this resolver
+
+// DNS servers kept at once. The first question goes to all of them, and
+// after that each goes to the quickest that is still answering.
+#ifndef CONFIG_APPS_RESOLV_SERVERS
+#define RESOLV_SERVERS 3
+#else
+#define RESOLV_SERVERS CONFIG_APPS_RESOLV_SERVERS
+#endif
+
+// Use these servers (as many as RESOLV_SERVERS) instead of resolv_conf()'s
+// single one
+void resolv_conf_servers(const uip_ipaddr_t *dnsservers, uint8_t n);
+
+// Same as resolv_lookup(), and also gives the seconds left before the
+// answer runs out (if ttl isn't NULL)
+uip_ipaddr_t *resolv_lookup_ttl(const char *name, uint32_t *ttl);
+
+#endif
@@ -51,15 +51,26 @@
 PROCESS(serial_shell_process, "Serial Shell");
 INIT_PROCESS(serial_shell_process);
 
+// Output goes to stdout
+static struct shell_session session;
+
 void shell_default_output(PGM_P fmt, va_list args) {
-	vfprintf_P(stdout, fmt, args);
+	shell_vprintf_P(fmt, args);
+}
+
+static void prompt_printf_P(PGM_P fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	shell_vprintf_P(fmt, args);
+	va_end(args);
 }
 
 void shell_prompt_P(PGM_P str) {
 #if CONFIG_LIB_CONTIKI_IPV6
-	printf_P(PSTR("\r\x1b[2K\x1b[01;34m%S\x1b[00m"), str);
+	prompt_printf_P(PSTR("\r\x1b[2K\x1b[01;34m%S\x1b[00m"), str);
 #else
-	printf_P(PSTR("\r\x1b[2K\x1b[01;34m%d.%d: %S\x1b[00m"),
+	prompt_printf_P(PSTR("\r\x1b[2K\x1b[01;34m%d.%d: %S\x1b[00m"),
 		uip_hostaddr.u8[2], uip_hostaddr.u8[3], str);
 #endif
 }
@@ -69,10 +80,14 @@ PROCESS_THREAD(serial_shell_process, ev, data) {
 
 	shell_init();
 
+	/* Let the system start up before showing the prompt. */
+	PROCESS_PAUSE();
+	shell_session_start(&session);
+
 	while(1) {
 		PROCESS_WAIT_EVENT_UNTIL(
 			ev == serial_line_event_message && data != NULL);
-		shell_input(data, strlen(data));
+		shell_session_input(&session, data, strlen(data));
 	}
 
 	PROCESS_END();
@@ -22,11 +22,13 @@
 #include <dev/serial-line.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <avr/io.h>
 #include <init.h>
 
 #include "serial.h"
 #include "drivers/uart.h"
+#include "shell/shell.h"
 
 
 PROCESS(serial_process, "Serial");
@@ -42,6 +44,41 @@ static int serial_putc(char c, FILE *stream) {
 	return 0;
 }
 
+// Queue all of data, waiting for room only if the caller didn't check
+// serial_output_space() first
+static void write_all(const char *data, uint16_t len) {
+	while (len) {
+		uint16_t n = uart_write(data, len);
+
+		data += n;
+		len -= n;
+	}
+}
+
+// Whole lines at a time for the shell
+static void serial_write(const char *data, uint16_t len) {
+	const char *nl;
+
+	while (len && (nl = memchr(data, '\n', len)) != NULL) {
+		write_all(data, nl - data);
+		write_all("\r\n", 2);
+		len -= nl - data + 1;
+		data = nl + 1;
+	}
+
+	write_all(data, len);
+}
+
+uint16_t serial_output_space(uint16_t want) {
+	uint16_t space = uart_tx_space();
+
+	if (space < want) {
+		uart_tx_notify(PROCESS_CURRENT(), want);
+	}
+
+	return space;
+}
+
 static FILE uart_stream =
     FDEV_SETUP_STREAM(serial_putc, NULL, _FDEV_SETUP_WRITE);
 
@@ -63,12 +100,12 @@ void serial_init(void) {
 		(USE_2X ? 0x8000 : 0));
 #endif
 
+    fdev_set_udata(&uart_stream, serial_write);
     stdout = &uart_stream;
 }
 
+// Polled by the UART's RX interrupt, so only runs when there is input
 static void pollhandler(void) {
-	process_poll(&serial_process);
-
 	while (1) {
 		// Read a character
 		uint16_t c = uart_getc();
@@ -97,10 +134,12 @@ PROCESS_THREAD(serial_process, ev, data) {
 
 	serial_line_init();
 
-	process_poll(&serial_process);
+	uart_rx_notify(&serial_process);
 
 	PROCESS_WAIT_UNTIL(ev == PROCESS_EVENT_EXIT);
 
+	uart_rx_notify(NULL);
+
 	PROCESS_END();
 }
 
@@ -23,4 +23,8 @@
 
 void serial_init(void);
 
+// Room left in the UART transmit buffer. If it's less than want, the
+// calling process is polled once there is.
+uint16_t serial_output_space(uint16_t want);
+
 #endif
@@ -0,0 +1,312 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki-net.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shell.h"
+
+#include <avr/pgmspace.h>
+#include <board.h>
+
+#if CONFIG_DRIVERS_DATAFLASH
+#include "drivers/dataflash.h"
+#endif
+#if CONFIG_DRIVERS_DS2482
+#include <onewire.h>
+#include "drivers/ds2482.h"
+#endif
+#if CONFIG_DRIVERS_DS1307
+#include "drivers/ds1307.h"
+#include "drivers/i2c.h"
+#endif
+#if CONFIG_DRIVERS_ENC424J600
+#include "drivers/enc424j600.h"
+#endif
+
+PROCESS(shell_bench_process, "bench");
+SHELL_COMMAND(bench_command,
+	"bench", "bench [--write <addr>]: time flash, 1-Wire, I2C and NIC access",
+	&shell_bench_process);
+INIT_SHELL_COMMAND(bench_command);
+
+/*
+ * Each test is a single operation run a fixed number of times back to back
+ * and timed with clock_us(), which only ticks every 256 CPU cycles; enough
+ * iterations are run to make that rounding negligible. The shell process
+ * doesn't yield while a test runs, so uip_buf is free to use as the data
+ * buffer: the network process only looks at it while handling a frame.
+ */
+
+// A full Ethernet frame, or as much of one as uip_buf holds
+#define BENCH_FRAME_LEN (UIP_BUFSIZE < 1514 ? UIP_BUFSIZE : 1514)
+#define BENCH_BUF ((uint8_t *)uip_buf)
+
+#if CONFIG_DRIVERS_DATAFLASH
+#define BENCH_READ_CHUNK 1024
+#define BENCH_READ_LEN 4096
+#endif
+
+struct bench_test {
+	PGM_P name;
+	int (*run)(uint8_t i); // returns < 0 on failure
+	uint16_t bytes; // moved per run, for the throughput figure
+	uint8_t iters;
+	uint8_t flags;
+};
+
+#define BENCH_WRITE 0x01 // only with --write
+#define BENCH_OW 0x02 // needs the 1-Wire lock
+
+static uint32_t write_addr;
+
+#if CONFIG_DRIVERS_DATAFLASH
+static int flash_read(uint8_t i) {
+	dataflash_iovec_t iov[BENCH_READ_LEN / BENCH_READ_CHUNK];
+	uint8_t n;
+
+	// One 4 KiB read command, landing on the same buffer in chunks
+	for (n = 0; n < sizeof(iov) / sizeof(iov[0]); n++) {
+		iov[n].buf = BENCH_BUF;
+		iov[n].len = BENCH_READ_CHUNK;
+	}
+
+	return dataflash_read_data_multi(iov, n, (uint32_t)i * BENCH_READ_LEN);
+}
+
+static int flash_erase(uint8_t i) {
+	if (dataflash_write_enable() || dataflash_erase_4k(write_addr)) {
+		return -1;
+	}
+
+	return dataflash_wait_ready();
+}
+
+static int flash_program(uint8_t i) {
+	uint32_t addr = write_addr + (uint32_t)i * DATAFLASH_WR_PAGE_SIZE;
+
+	if (dataflash_write_enable() ||
+		dataflash_write_data(BENCH_BUF, addr, DATAFLASH_WR_PAGE_SIZE) !=
+			DATAFLASH_WR_PAGE_SIZE)
+	{
+		return -1;
+	}
+
+	return dataflash_wait_ready();
+}
+
+// Make the sector being written to writable, the same way flashlog does
+static int flash_unprotect(void) {
+	uint8_t prot;
+
+	if (dataflash_read_protection(write_addr, &prot)) {
+		return -1;
+	}
+	else if (!prot) {
+		return 0;
+	}
+
+	if (dataflash_write_enable() || dataflash_write_status(0x24) ||
+		dataflash_write_enable() || dataflash_unprotect_sector(write_addr))
+	{
+		dataflash_write_enable();
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24);
+		return -1;
+	}
+
+	if (dataflash_write_enable() ||
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+#if CONFIG_DRIVERS_DS2482
+static int onewire_reset(uint8_t i) {
+	return ow_reset();
+}
+
+static int onewire_block(uint8_t i) {
+	// All ones, so every slot is a read and nothing on the bus is addressed
+	memset(BENCH_BUF, 0xff, 64);
+	return ow_block(BENCH_BUF, 64);
+}
+#endif
+
+#if CONFIG_DRIVERS_DS1307
+static int i2c_read(uint8_t i) {
+	uint8_t reg = 0;
+
+	return i2c_transfer(DS1307_ADDR | I2C_READ, &reg, sizeof(reg),
+		BENCH_BUF, 1);
+}
+#endif
+
+#if CONFIG_DRIVERS_ENC424J600
+static int nic_tx(uint8_t i) {
+	// Address the frames to a locally administered address nobody has, with
+	// the local experimental EtherType, so they go nowhere
+	if (i == 0) {
+		memset(BENCH_BUF, 0, BENCH_FRAME_LEN);
+		BENCH_BUF[0] = 0x02;
+		enc424j600GetMACAddr(&BENCH_BUF[6]);
+		BENCH_BUF[12] = 0x88;
+		BENCH_BUF[13] = 0xb5;
+	}
+
+	return enc424j600PacketSend(BENCH_FRAME_LEN, BENCH_BUF);
+}
+
+// There's no way to make a frame arrive on demand, so read a full frame's
+// worth out of the RX buffer instead: the same SPI transfer PacketReceive
+// does, without the status vector or giving anything back to the chip
+static int nic_rx(uint8_t i) {
+	enc424j600ReadSRAM(ENC424J600_RXSTART, BENCH_BUF, BENCH_FRAME_LEN);
+	return 0;
+}
+#endif
+
+#if CONFIG_DRIVERS_DATAFLASH
+static const char name_flash_read[] PROGMEM = "flash-read";
+static const char name_flash_erase[] PROGMEM = "flash-erase";
+static const char name_flash_program[] PROGMEM = "flash-program";
+#endif
+#if CONFIG_DRIVERS_DS2482
+static const char name_ow_reset[] PROGMEM = "ow-reset";
+static const char name_ow_block[] PROGMEM = "ow-block";
+#endif
+#if CONFIG_DRIVERS_DS1307
+static const char name_i2c_read[] PROGMEM = "i2c-read";
+#endif
+#if CONFIG_DRIVERS_ENC424J600
+static const char name_nic_tx[] PROGMEM = "nic-tx";
+static const char name_nic_rx[] PROGMEM = "nic-rx";
+#endif
+
+static const struct bench_test tests[] PROGMEM = {
+#if CONFIG_DRIVERS_DATAFLASH
+	{ name_flash_read, flash_read, BENCH_READ_LEN, 16, 0 },
+	{ name_flash_erase, flash_erase, 0, 1, BENCH_WRITE },
+	{ name_flash_program, flash_program, DATAFLASH_WR_PAGE_SIZE,
+		DATAFLASH_SECTOR_4K_SIZE / DATAFLASH_WR_PAGE_SIZE, BENCH_WRITE },
+#endif
+#if CONFIG_DRIVERS_DS2482
+	{ name_ow_reset, onewire_reset, 0, 16, BENCH_OW },
+	{ name_ow_block, onewire_block, 64, 4, BENCH_OW },
+#endif
+#if CONFIG_DRIVERS_DS1307
+	{ name_i2c_read, i2c_read, 1, 64, 0 },
+#endif
+#if CONFIG_DRIVERS_ENC424J600
+	{ name_nic_tx, nic_tx, BENCH_FRAME_LEN, 16, 0 },
+	{ name_nic_rx, nic_rx, BENCH_FRAME_LEN, 16, 0 },
+#endif
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+static void run_test(const struct bench_test *t) {
+	uint32_t start, us, per, rate;
+	uint8_t i;
+
+	start = clock_us();
+	for (i = 0; i < t->iters; i++) {
+		if (t->run(i) < 0) {
+			shell_output_P(&bench_command, PSTR("%-14S failed\n"), t->name);
+			return;
+		}
+	}
+	us = clock_us() - start;
+	per = us / t->iters;
+
+	if (!t->bytes || !us) {
+		shell_output_P(&bench_command, PSTR("%-14S %8lu us/op\n"),
+			t->name, per);
+		return;
+	}
+
+	// Bytes per microsecond is MB/s; keep three decimal places
+	rate = (uint32_t)t->bytes * t->iters * 1000 / us;
+	shell_output_P(&bench_command, PSTR("%-14S %8lu us/op %4lu.%03lu MB/s\n"),
+		t->name, per, rate / 1000, rate % 1000);
+}
+
+PROCESS_THREAD(shell_bench_process, ev, data) {
+	struct bench_test t;
+	uint8_t flags = 0;
+	uint8_t n;
+
+	PROCESS_BEGIN();
+
+	if (data && strncmp_P(data, PSTR("--write "), 8) == 0) {
+#if CONFIG_DRIVERS_DATAFLASH
+		// Nothing on the flash is spare, so the user has to name a 4 KiB
+		// sector they don't mind losing
+		write_addr = strtoul((char *)data + 8, NULL, 0) &
+			DATAFLASH_SECTOR_4K_MASK;
+		if (flash_unprotect()) {
+			shell_output_P(&bench_command,
+				PSTR("Can't unprotect 0x%05lx.\n"), write_addr);
+			PROCESS_EXIT();
+		}
+		flags |= BENCH_WRITE;
+#endif
+	}
+	else if (data && strlen(data) > 0) {
+		shell_output_P(&bench_command,
+			PSTR("Usage: bench [--write <addr>]\n"));
+		PROCESS_EXIT();
+	}
+
+#if CONFIG_DRIVERS_DS2482
+	// Only take the bus if it's free right now; a sensor read in the middle
+	// of a test would spoil both
+	if (ow_lock(0)) {
+		if (ds2482_channel_select(0)) {
+			ow_unlock(0);
+		}
+		else {
+			flags |= BENCH_OW;
+		}
+	}
+#endif
+
+	for (n = 0; n < NUM_TESTS; n++) {
+		memcpy_P(&t, &tests[n], sizeof(t));
+
+		if (t.flags & ~flags) {
+			shell_output_P(&bench_command, PSTR("%-14S skipped\n"), t.name);
+			continue;
+		}
+
+		run_test(&t);
+	}
+
+#if CONFIG_DRIVERS_DS2482
+	if (flags & BENCH_OW) {
+		ow_unlock(0);
+	}
+#endif
+
+	PROCESS_END();
+}
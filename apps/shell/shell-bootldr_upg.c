@@ -28,6 +28,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <memstat.h>
 #include "shell.h"
 
 // This was hacked up very quickly and needs some serious review. I just wanted
@@ -65,7 +66,7 @@ PROCESS_THREAD(shell_bootldr_upg_process, ev, data) {
 	bufsz = pages * SPM_PAGESIZE;
 
 	// Allocate a buffer large enough for the file
-	buf = malloc(bufsz);
+	buf = memstat_malloc(MEMSTAT_SHELL, bufsz);
 	if (!buf) {
 		shell_output_P(&bootldr_upg_command,
 			PSTR("Could not allocate a buffer large enough. Aborting.\n"));
@@ -84,7 +85,7 @@ PROCESS_THREAD(shell_bootldr_upg_process, ev, data) {
 			offset += ret;
 		}
 		else {
-			free(buf);
+			memstat_free(MEMSTAT_SHELL, buf);
 			shell_output_P(&bootldr_upg_command,
 				PSTR("Could not read bootloader update file: %d.\n"), ret);
 			PROCESS_EXIT();
@@ -108,7 +109,7 @@ PROCESS_THREAD(shell_bootldr_upg_process, ev, data) {
 		shell_output_P(&bootldr_upg_command,
 			PSTR("Upgrade failed: %d\n"),
 			ret);
-		free(buf);
+		memstat_free(MEMSTAT_SHELL, buf);
 		PROCESS_EXIT();
 	}
 	else if (ret > 0) {
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stdarg.h>
+#include "shell.h"
+
+#include <avr/pgmspace.h>
+#include <init.h>
+
+PROCESS(shell_boottime_process, "boottime");
+SHELL_COMMAND(boottime_command,
+	"boottime", "boottime: show how long each part of startup took",
+	&shell_boottime_process);
+INIT_SHELL_COMMAND(boottime_command);
+
+static const char type_driver[] PROGMEM = "driver";
+static const char type_library[] PROGMEM = "library";
+static const char type_process[] PROGMEM = "process";
+static const char type_component[] PROGMEM = "component";
+static const char type_deferred[] PROGMEM = "deferred";
+
+static PGM_P const types[] PROGMEM = {
+	[INIT_TYPE_DRIVER] = type_driver,
+	[INIT_TYPE_LIBRARY] = type_library,
+	[INIT_TYPE_PROCESS] = type_process,
+	[INIT_TYPE_COMPONENT] = type_component,
+	[INIT_TYPE_DEFERRED] = type_deferred,
+};
+
+PROCESS_THREAD(shell_boottime_process, ev, data) {
+	static uint8_t i;
+	PROCESS_BEGIN();
+
+	shell_output_P(&boottime_command,
+		PSTR("Init started at %lu us, took %lu us\n"),
+		init_profile_start, init_profile_end - init_profile_start);
+
+	for (i = 0; i < init_profile_count; i++) {
+		const struct init_profile *p = &init_profile[i];
+
+		SHELL_OUTPUT_WAIT();
+		shell_output_P(&boottime_command, PSTR("%-9S %-16S %9lu%S\n"),
+			(PGM_P)pgm_read_word(&types[p->type]), p->name, p->us,
+			p->err ? PSTR(" FAIL") : PSTR(""));
+	}
+
+	PROCESS_END();
+}
@@ -22,6 +22,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <memstat.h>
 #include "shell.h"
 #include "drivers/wallclock.h"
 #if CONFIG_APPS_TIMESYNC
@@ -39,30 +40,34 @@ INIT_SHELL_COMMAND(date_command);
 
 #define DATE_MAXLEN 32
 
-PROCESS_THREAD(shell_date_process, ev, data) {
-	struct tm tm;
+#if CONFIG_APPS_TIMESYNC
+static struct notify_sub timesync_sub;
+#endif
 
+PROCESS_THREAD(shell_date_process, ev, data) {
 	PROCESS_BEGIN();
 
 	if ((data == NULL) || (strlen(data) == 0)) {
-		char *date = malloc(DATE_MAXLEN);
+		char *date = memstat_malloc(MEMSTAT_SHELL, DATE_MAXLEN);
 		if (!date) {
 			PROCESS_EXIT();
 		}
 
-		gmtime(wallclock_seconds(), &tm);
-		strftime_P(date, DATE_MAXLEN, PSTR("%c"), &tm);
+		strftime_P(date, DATE_MAXLEN, PSTR("%c"),
+			gmtime_cached(wallclock_seconds()));
 		
 		shell_output_P(&date_command,
 			PSTR("%s\n"), date);
 
-		free(date);
+		memstat_free(MEMSTAT_SHELL, date);
 	}
 #if CONFIG_APPS_TIMESYNC
 	else if (strcmp_P(data, PSTR("--sync")) == 0) {
 		if (timesync_status.running) {
+			notify_subscribe(&timesync_notify, &timesync_sub);
 			timesync_schedule_resync();
 			PROCESS_WAIT_EVENT_UNTIL(ev == timesync_event);
+			notify_unsubscribe(&timesync_notify, &timesync_sub);
 			shell_output_P(&date_command,
 				PSTR("Time was adjusted.\n"));
 		}
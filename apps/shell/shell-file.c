@@ -46,11 +46,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <memstat.h>
 
 #include "shell.h"
 
 #define MAX_FILENAME_LEN POLYFS_MAXPATHLEN
-#define MAX_BLOCKSIZE 40
+#define MAX_BLOCKSIZE 40 // at worst every byte a newline, which become CRLFs
+#define HEXDUMP_WIDTH 16 // bytes per line
 
 PROCESS(shell_ls_process, "ls");
 SHELL_COMMAND(ls_command,
@@ -66,6 +68,31 @@ SHELL_COMMAND(cat_command,
 	&shell_cat_process);
 INIT_SHELL_COMMAND(cat_command);
 
+PROCESS(shell_hexdump_process, "hexdump");
+SHELL_COMMAND(hexdump_command,
+	"hexdump",
+	"hexdump <file>: print the contents of <file> in hex",
+	&shell_hexdump_process);
+INIT_SHELL_COMMAND(hexdump_command);
+
+/*
+ * Let everything else run, then carry on once the session has room for
+ * another line, so a file streams out as fast as the telnet client or
+ * serial port takes it instead of overflowing the output buffer. Stops
+ * with an empty line of input, leaving the loop it's in.
+ */
+#define FILE_OUTPUT_NEXT() \
+	process_post(PROCESS_CURRENT(), PROCESS_EVENT_CONTINUE, NULL); \
+	PROCESS_WAIT_EVENT_UNTIL(ev == shell_event_input || \
+		((ev == PROCESS_EVENT_CONTINUE || ev == PROCESS_EVENT_POLL) && \
+		 shell_output_space() >= SHELL_OUTPUT_LINE)); \
+	if (ev == shell_event_input && \
+		((struct shell_input *)data)->len1 + \
+		((struct shell_input *)data)->len2 == 0) \
+	{ \
+		break; \
+	}
+
 static void print_inode(const char *name, const struct polyfs_inode *ino) {
 	// Get a char that describes the file type
 	char type =
@@ -88,16 +115,17 @@ struct shell_ls_process_data {
 	struct polyfs_inode dir;
 	polyfs_readdir_t rd;
 	char name[POLYFS_MAXPATHLEN + 1];
+	uint8_t batch[POLYFS_READDIR_BATCH];
 };
 
 PROCESS_THREAD(shell_ls_process, ev, data) {
 	int err;
 	static struct shell_ls_process_data *d = NULL;
-	PROCESS_EXITHANDLER(if (d) { free(d); d = NULL; });
+	PROCESS_EXITHANDLER(if (d) { memstat_free(MEMSTAT_SHELL, d); d = NULL; });
 	PROCESS_BEGIN();
 
 	if (d == NULL) {
-		d = malloc(sizeof(*d));
+		d = memstat_malloc(MEMSTAT_SHELL, sizeof(*d));
 	}
 
 	// List root directory if no path provided
@@ -122,6 +150,7 @@ PROCESS_THREAD(shell_ls_process, ev, data) {
 				PSTR("Cannot read directory\n"));
 			PROCESS_EXIT();
 		}
+		polyfs_readdir_batch(&d->rd, d->batch, sizeof(d->batch));
 
 		// Loop through reading all files
 		while (d->rd.next) {
@@ -147,7 +176,7 @@ PROCESS_THREAD(shell_ls_process, ev, data) {
 	}
 
 	// Clean up
-	free(d);
+	memstat_free(MEMSTAT_SHELL, d);
 	d = NULL;
 
 	PROCESS_END();
@@ -168,36 +197,95 @@ PROCESS_THREAD(shell_cat_process, ev, data) {
 	if (fd < 0) {
 		shell_output_P(&cat_command,
 			PSTR("cat: could not open file for reading: %s\n"), data);
+		PROCESS_EXIT();
 	}
 
 	while(1) {
 		char buf[MAX_BLOCKSIZE + 1];
 		int len;
-		struct shell_input *input;
 
 		len = cfs_read(fd, buf, MAX_BLOCKSIZE);
 		if (len <= 0) {
-			cfs_close(fd);
-			PROCESS_EXIT();
+			break;
 		}
 
 		buf[len] = '\0';
 		shell_output_P(&cat_command,
 			PSTR("%s"), buf);
 
-		process_post(&shell_cat_process, PROCESS_EVENT_CONTINUE, NULL);
-		PROCESS_WAIT_EVENT_UNTIL(
-			ev == PROCESS_EVENT_CONTINUE ||
-			ev == shell_event_input);
+		FILE_OUTPUT_NEXT();
+	}
 
-		if (ev == shell_event_input) {
-			input = data;
-			if (input->len1 + input->len2 == 0) {
-				cfs_close(fd);
-				PROCESS_EXIT();
+	cfs_close(fd);
+
+	PROCESS_END();
+}
+
+PROCESS_THREAD(shell_hexdump_process, ev, data) {
+	static int fd;
+	static uint32_t offset;
+	PROCESS_EXITHANDLER(cfs_close(fd));
+	PROCESS_BEGIN();
+
+	if (data == NULL || !strlen(data)) {
+		shell_output_P(&hexdump_command,
+			PSTR("Usage: hexdump <file>\n"));
+		PROCESS_EXIT();
+	}
+
+	fd = cfs_open(data, CFS_READ);
+	if (fd < 0) {
+		shell_output_P(&hexdump_command,
+			PSTR("hexdump: could not open file for reading: %s\n"), data);
+		PROCESS_EXIT();
+	}
+
+	offset = 0;
+	while(1) {
+		uint8_t buf[HEXDUMP_WIDTH];
+		// Offset, the bytes in hex and then as text: "%08lx  " plus
+		// "xx " for each (with a gap halfway) and "|...|"
+		char line[10 + HEXDUMP_WIDTH * 3 + 1 + HEXDUMP_WIDTH + 3];
+		char *p = line;
+		int len;
+
+		len = cfs_read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+
+		p += sprintf_P(p, PSTR("%08lx  "), (unsigned long)offset);
+		for (uint8_t i = 0; i < HEXDUMP_WIDTH; i++) {
+			if (i == HEXDUMP_WIDTH / 2) {
+				*p++ = ' ';
+			}
+			if (i < len) {
+				p += sprintf_P(p, PSTR("%02x "), buf[i]);
 			}
+			else {
+				memset(p, ' ', 3);
+				p += 3;
+			}
+		}
+
+		*p++ = '|';
+		for (uint8_t i = 0; i < len; i++) {
+			*p++ = (buf[i] >= ' ' && buf[i] < 0x7f) ? buf[i] : '.';
 		}
+		*p++ = '|';
+		*p = '\0';
+
+		shell_output_P(&hexdump_command, PSTR("%s\n"), line);
+		offset += len;
+
+		FILE_OUTPUT_NEXT();
+	}
+
+	if (offset) {
+		shell_output_P(&hexdump_command,
+			PSTR("%08lx\n"), (unsigned long)offset);
 	}
+	cfs_close(fd);
 
 	PROCESS_END();
 }
@@ -23,6 +23,12 @@
 #include "shell.h"
 
 #include <stack.h>
+#if CONFIG_LIB_MEMSTAT
+#include <memstat.h>
+#endif
+#if CONFIG_LIB_SALLOC
+#include <salloc.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <avr/pgmspace.h>
@@ -84,6 +90,9 @@ static uint16_t malloc_free(void) {
 }
 
 PROCESS_THREAD(shell_free_process, ev, data) {
+#if CONFIG_LIB_MEMSTAT || CONFIG_LIB_SALLOC
+	static uint8_t i;
+#endif
 	PROCESS_BEGIN();
 
 	// Static memory sections (.data + .bss + .noinit)
@@ -126,6 +135,43 @@ PROCESS_THREAD(shell_free_process, ev, data) {
 		stack_size - stack_free,
 		stack_free);
 
+#if CONFIG_LIB_MEMSTAT
+	// Low-water marks and allocations by site
+	memstat_check();
+	shell_output_P(&free_command, PSTR("\n"));
+	shell_output_P(&free_command,
+		PSTR("Heap largest free %u, least free %u; stack least free %u\n"),
+		memstat.heap_largest, memstat.heap_min, memstat.stack_min);
+	shell_output_P(&free_command,
+		PSTR("Site          allocs   frees   fails\n"));
+	for (i = 0; i < MEMSTAT_SITES; i++) {
+		SHELL_OUTPUT_WAIT();
+		shell_output_P(&free_command, PSTR("%-10S %9u %7u %7u\n"),
+			(PGM_P)pgm_read_word(&memstat_site_names[i]),
+			memstat.sites[i].allocs, memstat.sites[i].frees,
+			memstat.sites[i].fails);
+	}
+#endif
+
+#if CONFIG_LIB_SALLOC
+	// Size classes, and what didn't fit in any of them
+	shell_output_P(&free_command, PSTR("\n"));
+	shell_output_P(&free_command,
+		PSTR("Class  blocks    used    peak   fails\n"));
+	for (i = 0; i < SALLOC_CLASSES; i++) {
+		if (!salloc_classes[i].count) {
+			continue;
+		}
+
+		SHELL_OUTPUT_WAIT();
+		shell_output_P(&free_command, PSTR("%5u %7u %7u %7u %7u\n"),
+			SALLOC_SIZE(i), salloc_classes[i].count, salloc_classes[i].used,
+			salloc_classes[i].peak, salloc_classes[i].fails);
+	}
+	shell_output_P(&free_command, PSTR("Sent to the heap: %u\n"),
+		salloc_heap);
+#endif
+
 #if PROCESS_CONF_STATS
 	// Process event stats
 	shell_output_P(&free_command, PSTR("\n"));
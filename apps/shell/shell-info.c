@@ -24,6 +24,9 @@
 #include <polyfs.h>
 #include <flashmgt.h>
 #include <stubboot.h>
+#if CONFIG_LIB_NVRAM
+#include <nvram.h>
+#endif
 #include "shell.h"
 #include "apps/network.h"
 
@@ -56,6 +59,13 @@ PROCESS_THREAD(shell_info_process, ev, data) {
 	shell_output_P(&info_command,
 		PSTR("  VCS Rev:   " VCS_REV "\n"));
 
+#if CONFIG_LIB_NVRAM
+	// Counted since the RTC battery was last flat
+	shell_output_P(&info_command,
+		PSTR("  Boots:     %u\n"),
+		nvram.boots);
+#endif
+
 	// Filesystem CRC
 	if (flashmgt_pfs) {
 		shell_output_P(&info_command,
@@ -22,30 +22,145 @@
 #include <stdarg.h>
 #include "shell.h"
 #include "apps/syslog.h"
+#if CONFIG_LIB_FLASHLOG
+#include <flashlog.h>
+#include <time.h>
+#endif
 
 #include <string.h>
 #include <avr/pgmspace.h>
 
+// Records shown without --all
+#define LOG_SHOW 20
+
+#if SYSLOG_HISTORY
+// Longest line dmesg shows
+#define DMESG_LINE_MAX (SHELL_OUTPUT_LINE - 1)
+#endif
+
 PROCESS(shell_log_process, "log");
 SHELL_COMMAND(log_command,
+#if CONFIG_LIB_FLASHLOG
+	"log", "log [--all|<message>]: show the flash log or send to syslog",
+#else
 	"log", "log: send something to syslog",
+#endif
 	&shell_log_process);
 INIT_SHELL_COMMAND(log_command);
 
+#if CONFIG_LIB_FLASHLOG
+static flashlog_reader_t reader;
+static uint16_t left;
+#endif
+
+#if SYSLOG_HISTORY
+PROCESS(shell_dmesg_process, "dmesg");
+SHELL_COMMAND(dmesg_command,
+	"dmesg", "dmesg [-n <count>] [-p <prio>]: show recent syslog messages",
+	&shell_dmesg_process);
+INIT_SHELL_COMMAND(dmesg_command);
+
+static syslog_history_reader_t hist;
+#endif
+
 PROCESS_THREAD(shell_log_process, ev, data) {
 	char *msg;
 
 	PROCESS_BEGIN();
 
 	msg = data;
+#if CONFIG_LIB_FLASHLOG
+	if (msg == NULL || strlen(msg) == 0 ||
+		strcmp_P(msg, PSTR("--all")) == 0)
+	{
+		left = (msg && *msg) ? 0xffff : LOG_SHOW;
+
+		// Newest first, so there's no need to find the oldest
+		flashlog_reader_init(&reader);
+		while (left--) {
+			flashlog_rec_t rec;
+			char text[FLASHLOG_TEXT_MAX];
+
+			SHELL_OUTPUT_WAIT();
+			if (flashlog_read(&reader, &rec, text, sizeof(text)) < 0) {
+				break;
+			}
+
+			shell_output_P(&log_command, PSTR("%s <%u> %s\n"),
+				time_stamp(rec.time), rec.pri, text);
+
+			PROCESS_PAUSE();
+		}
+
+		PROCESS_EXIT();
+	}
+#else
 	if (msg == NULL || strlen(msg) == 0) {
 		shell_output_P(&log_command,
 			PSTR("Usage: log <message>\n"));
 		PROCESS_EXIT();
 	}
+#endif
 
 	syslog_P(LOG_MAKEPRI(LOG_USER, LOG_INFO), PSTR("%s"), msg);
 
 	PROCESS_END();
 }
 
+#if SYSLOG_HISTORY
+PROCESS_THREAD(shell_dmesg_process, ev, data) {
+	const char *args = data;
+	const char *next;
+	uint16_t count = 0;
+	uint8_t maxpri = LOG_DEBUG;
+
+	PROCESS_BEGIN();
+
+	// Options, in any order
+	while (args && *args) {
+		while (*args == ' ') {
+			args++;
+		}
+		if (!*args) {
+			break;
+		}
+
+		if (args[0] == '-' && (args[1] == 'n' || args[1] == 'p')) {
+			char opt = args[1];
+			unsigned long val = shell_strtolong(args + 2, &next);
+
+			if (next != args + 2 &&
+				(opt == 'n' ? val <= 0xffff : val <= LOG_DEBUG))
+			{
+				if (opt == 'n') {
+					count = val;
+				}
+				else {
+					maxpri = val;
+				}
+				args = next;
+				continue;
+			}
+		}
+
+		shell_output_P(&dmesg_command,
+			PSTR("Usage: dmesg [-n <count>] [-p <prio>]\n"));
+		PROCESS_EXIT();
+	}
+
+	syslog_history_reader_init(&hist, maxpri, count);
+	for (;;) {
+		char line[DMESG_LINE_MAX];
+
+		SHELL_OUTPUT_WAIT();
+		if (syslog_history_read(&hist, line, sizeof(line)) < 0) {
+			break;
+		}
+		shell_output_P(&dmesg_command, PSTR("%s\n"), line);
+
+		PROCESS_PAUSE();
+	}
+
+	PROCESS_END();
+}
+#endif
@@ -40,6 +40,10 @@
 #include "contiki.h"
 #include "shell.h"
 #include "contiki-net.h"
+#include "apps/network.h"
+#if CONFIG_APPS_ARP
+#include "apps/arp.h"
+#endif
 
 static const char closed[] PROGMEM =   /*  "CLOSED",*/
 {0x43, 0x4c, 0x4f, 0x53, 0x45, 0x44, 0};
@@ -94,16 +98,46 @@ extern u16_t uip_listenports[UIP_LISTENPORTS];
 PROCESS(shell_netstat_process, "netstat");
 SHELL_COMMAND(netstat_command,
 		"netstat",
-		"netstat: show UDP and TCP connections",
+		"netstat [-i]: show UDP and TCP connections (or interface counters)",
 		&shell_netstat_process);
 INIT_SHELL_COMMAND(netstat_command);
 
+static void netstat_interface(void) {
+	shell_output_P(&netstat_command,
+		PSTR("RX %lu frames, %lu bytes\n"
+			"RX dropped: %u oversize, %u overruns, %u checksum, %u unknown\n"
+			"RX backlog: %u bytes peak, %u bursts\n"
+			"TX %lu frames, %lu bytes, %u errors\n"
+			"ARP %u in, %u out\n"
+			"Polls %lu\n"),
+		net_stats.rx_frames, net_stats.rx_bytes,
+		net_stats.rx_oversize, net_stats.rx_overruns,
+		net_stats.rx_chkerr, net_stats.rx_unknown,
+		net_stats.rx_peak, net_stats.rx_bursts,
+		net_stats.tx_frames, net_stats.tx_bytes, net_stats.tx_errors,
+		net_stats.arp_in, net_stats.arp_out,
+		net_stats.polls);
+#if CONFIG_APPS_ARP
+	shell_output_P(&netstat_command,
+		PSTR("ARP cache %u/%u entries, %lu hits, %u misses, %u evicted, "
+			"%u refreshed\n"),
+		arp_count(), ARP_ENTRIES, arp_stats.hits, arp_stats.misses,
+		arp_stats.evictions, arp_stats.refreshes);
+#endif
+}
+
 PROCESS_THREAD(shell_netstat_process, ev, data) {
-	int i;
+	static int i;
 	struct uip_conn *conn;
 	PROCESS_BEGIN();
 
+	if (data != NULL && strcmp_P(data, PSTR("-i")) == 0) {
+		netstat_interface();
+		PROCESS_EXIT();
+	}
+
 	for(i = 0; i < UIP_CONNS; ++i) {
+		SHELL_OUTPUT_WAIT();
 		conn = &uip_conns[i];
 		shell_output_P(&netstat_command,
 			PSTR("TCP %u, %u.%u.%u.%u:%u, %S, %u, %u, %c %c\n"),
@@ -121,7 +155,10 @@ PROCESS_THREAD(shell_netstat_process, ev, data) {
 	}
 
 	for (i = 0; i < UIP_UDP_CONNS; i++) {
-		struct uip_udp_conn *udp = &uip_udp_conns[i];
+		struct uip_udp_conn *udp;
+
+		SHELL_OUTPUT_WAIT();
+		udp = &uip_udp_conns[i];
 		shell_output_P(&netstat_command,
 			PSTR("UDP %u, %u.%u.%u.%u:%u\n"),
 			uip_htons(udp->lport),
@@ -134,6 +171,7 @@ PROCESS_THREAD(shell_netstat_process, ev, data) {
 
 	shell_output_P(&netstat_command, PSTR("Listen ports:\n"));
 	for (i = 0; i < UIP_LISTENPORTS; i++) {
+		SHELL_OUTPUT_WAIT();
 		shell_output_P(&netstat_command, PSTR("%d\n"),
 			UIP_HTONS(uip_listenports[i]));
 	}
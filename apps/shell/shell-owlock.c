@@ -0,0 +1,64 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include <onewire.h>
+
+#include "shell.h"
+
+PROCESS(shell_owlock_process, "owlock");
+SHELL_COMMAND(owlock_command,
+	"owlock", "owlock: show 1-wire bus lock statistics",
+	&shell_owlock_process);
+INIT_SHELL_COMMAND(owlock_command);
+
+// Clock ticks to milliseconds
+#define TICKS_MS(t) ((uint32_t)(t) * 1000 / CLOCK_SECOND)
+
+PROCESS_THREAD(shell_owlock_process, ev, data) {
+	int queued = 0;
+
+	PROCESS_BEGIN();
+
+	for (uint8_t i = 0; i < OW_CHANNELS; i++) {
+		queued += ow_lock_queued(i);
+	}
+
+	shell_output_P(&owlock_command,
+		PSTR("Taken %u times, queued %u times, %d waiting\n"),
+		ow_lock_stats.locks, ow_lock_stats.waits, queued);
+
+	shell_output_P(&owlock_command,
+		PSTR("Hold: avg %lu ms, max %lu ms\n"),
+		ow_lock_stats.locks ?
+			TICKS_MS(ow_lock_stats.hold_total / ow_lock_stats.locks) : 0,
+		TICKS_MS(ow_lock_stats.hold_max));
+
+	shell_output_P(&owlock_command,
+		PSTR("Wait: avg %lu ms, max %lu ms\n"),
+		ow_lock_stats.waits ?
+			TICKS_MS(ow_lock_stats.wait_total / ow_lock_stats.waits) : 0,
+		TICKS_MS(ow_lock_stats.wait_max));
+
+	PROCESS_END();
+}
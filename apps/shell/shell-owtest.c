@@ -21,8 +21,6 @@
 #include <contiki-net.h>
 #include <stdio.h>
 #include <string.h>
-#include <util/crc16.h>
-#include <util/delay.h>
 
 #include <onewire.h>
 
@@ -33,45 +31,53 @@
 
 PROCESS(shell_owtest_process, "owtest");
 SHELL_COMMAND(owtest_command,
-	"owtest", "owtest: test 1-wire bus",
+	"owtest", "owtest [channel]: test 1-wire bus",
 	&shell_owtest_process);
 INIT_SHELL_COMMAND(owtest_command);
 
+// Run a 1-Wire operation within protothread parent, polling the process to
+// get back to it whenever the DS2482 is busy
+#define OW_WAIT(parent, thread) \
+	do { \
+		PT_INIT(&op.pt); \
+		while (PT_SCHEDULE(thread)) { \
+			process_poll(&shell_owtest_process); \
+			PT_YIELD(parent); \
+		} \
+	} while (0)
+
 static struct pt ow_pt;
+static ow_waiter_t waiter;
+static ow_async_t op;
 static ow_search_t search;
 static struct timer timeout;
+static struct etimer poll_timer;
+static uint8_t buf[9];
 
 static PT_THREAD(read_temp(struct pt *pt, const ow_addr_t *addr)) {
-	int err;
-	uint8_t scratch[9];
 	uint8_t crc = 0;
 
 	PT_BEGIN(pt);
 
 	// Reset the bus
-	err = ow_reset();
-	if (err != 1) {
+	OW_WAIT(pt, ow_reset_async(&op));
+	if (op.ret != 1) {
 		shell_output_P(&owtest_command, PSTR("Reset failed.\n"));
 		PT_EXIT(pt);
 	}
 
 	// Match ROM
-	err = ow_write_byte(0x55);
-	if (err) {
+	buf[0] = 0x55;
+	memcpy(&buf[1], addr, sizeof(*addr));
+	OW_WAIT(pt, ow_block_async(&op, buf, 1 + sizeof(*addr)));
+	if (op.ret) {
 		shell_output_P(&owtest_command, PSTR("Match ROM failed\n"));
 		PT_EXIT(pt);
 	}
-	for (int i = 0; i < sizeof(*addr); i++) {
-		err = ow_write_byte(addr->u[i]);
-		if (err) {
-			shell_output_P(&owtest_command, PSTR("Match ROM failed\n"));
-			PT_EXIT(pt);
-		}
-	}
 
 	// Start temperature conversion
-	err = ow_write_byte(0x44);
-	if (err) {
+	OW_WAIT(pt, ow_touch_byte_async(&op, 0x44));
+	if (op.ret < 0) {
 		shell_output_P(&owtest_command, PSTR("Convert T failed\n"));
 		PT_EXIT(pt);
 	}
@@ -79,16 +85,18 @@ static PT_THREAD(read_temp(struct pt *pt, const ow_addr_t *addr)) {
 	// Conversion timeout
 	timer_set(&timeout, DS18B20_CONV_TIMEOUT);
 	while (1) {
-		_delay_ms(10); // for good measure
+		// Wait a bit between status reads
+		etimer_set(&poll_timer, CLOCK_SECOND / 100);
+		PT_WAIT_UNTIL(pt, etimer_expired(&poll_timer));
 
 		// Read a bit from the bus
-		int ret = ow_read_bit();
+		OW_WAIT(pt, ow_touch_bit_async(&op, 1));
 
 		// Check for stop conditions
-		if (ret == 1) {
+		if (op.ret == 1) {
 			break;
 		}
-		else if (ret == -1) {
+		else if (op.ret == -1) {
 			shell_output_P(&owtest_command, PSTR("Read status failed.\n"));
 			PT_EXIT(pt);
 		}
@@ -96,103 +104,110 @@ static PT_THREAD(read_temp(struct pt *pt, const ow_addr_t *addr)) {
 			shell_output_P(&owtest_command, PSTR("Conversion has taken too long. Giving up.\n"));
 			PT_EXIT(pt);
 		}
-
-		// Poll the process and yield the thread
-		process_poll(&shell_owtest_process);
-		PT_YIELD(pt);
 	}
 
 	// Reset and MATCH ROM again
-	err = ow_reset();
-	if (err != 1) {
+	OW_WAIT(pt, ow_reset_async(&op));
+	if (op.ret != 1) {
 		shell_output_P(&owtest_command, PSTR("Reset failed.\n"));
 		PT_EXIT(pt);
 	}
 
 	// Match ROM
-	err = ow_write_byte(0x55);
-	if (err) {
+	buf[0] = 0x55;
+	memcpy(&buf[1], addr, sizeof(*addr));
+	OW_WAIT(pt, ow_block_async(&op, buf, 1 + sizeof(*addr)));
+	if (op.ret) {
 		shell_output_P(&owtest_command, PSTR("Match ROM failed\n"));
 		PT_EXIT(pt);
 	}
-	for (int i = 0; i < sizeof(*addr); i++) {
-		err = ow_write_byte(addr->u[i]);
-		if (err) {
-			shell_output_P(&owtest_command, PSTR("Match ROM failed\n"));
-			PT_EXIT(pt);
-		}
-	}
 
 	// Read the scratch pad
-	err = ow_write_byte(0xBE);
-	if (err) {
+	OW_WAIT(pt, ow_touch_byte_async(&op, 0xBE));
+	if (op.ret < 0) {
 		shell_output_P(&owtest_command, PSTR("Read scratch pad failed\n"));
 		PT_EXIT(pt);
 	}
 
-	for (int i = 0; i < sizeof(scratch); i++) {
-		err = ow_read_byte();
-		if (err < 0) {
-			shell_output_P(&owtest_command, PSTR("Read byte failed\n"));
-			PT_EXIT(pt);
-		}
-
-		scratch[i] = err;
-		crc = _crc_ibutton_update(crc, scratch[i]);
+	memset(buf, 0xff, sizeof(buf));
+	OW_WAIT(pt, ow_block_async(&op, buf, sizeof(buf)));
+	if (op.ret) {
+		shell_output_P(&owtest_command, PSTR("Read byte failed\n"));
+		PT_EXIT(pt);
 	}
 
 	// Make sure the CRC is valid
+	crc = ow_crc8(0, buf, sizeof(buf));
 	if (crc) {
 		shell_output_P(&owtest_command, PSTR("CRC check failed!\n"));
 		PT_EXIT(pt);
 	}
 
 	// Convert temperature to floating point
-	int16_t rawtemp = scratch[0] | (scratch[1] << 8);
+	int16_t rawtemp = buf[0] | (buf[1] << 8);
 	float temp = (float)rawtemp * 0.0625;
 
 	shell_output_P(&owtest_command, 
 		PSTR("Scratchpad: %02x%02x %02x%02x %02x %02x%02x%02x %02x\n"),
-		scratch[0], scratch[1], // temperature
-		scratch[2], scratch[3], // TH,TL alarm thresholds
-		scratch[4], // config
-		scratch[5], scratch[6], scratch[7], // reserved
-		scratch[8]); // CRC
+		buf[0], buf[1], // temperature
+		buf[2], buf[3], // TH,TL alarm thresholds
+		buf[4], // config
+		buf[5], buf[6], buf[7], // reserved
+		buf[8]); // CRC
 
 	shell_output_P(&owtest_command, PSTR("Reading: %0.2fC\n"), temp);
 
 	PT_END(pt);
 }
 
-PROCESS_THREAD(shell_owtest_process, ev, data) {
-	int err;
+static void release_lock(void) {
+	if (waiter.granted) {
+		ow_async_abort(&op);
+		ow_unlock(waiter.channel);
+	}
+	else {
+		ow_lock_cancel(&waiter);
+	}
+}
 
+PROCESS_THREAD(shell_owtest_process, ev, data) {
+	PROCESS_EXITHANDLER(release_lock());
 	PROCESS_BEGIN();
 
-	// Attempt to acquire 1-Wire lock
-	while (!ow_lock()) {
-		PROCESS_PAUSE();
+	op.channel = shell_strtolong(data, NULL);
+	if (op.channel >= OW_CHANNELS) {
+		shell_output_P(&owtest_command, PSTR("No such channel.\n"));
+		PROCESS_EXIT();
+	}
+
+	// Acquire the 1-Wire lock, waiting our turn if need be
+	if (!ow_lock_queue(&waiter, op.channel, &shell_owtest_process, NULL)) {
+		PROCESS_WAIT_EVENT_UNTIL(waiter.granted);
 	}
 
 	// Reset the bus
-	err = ow_reset();
-	if (err < 0) {
+	OW_WAIT(process_pt, ow_reset_async(&op));
+	if (op.ret < 0) {
 		shell_output_P(&owtest_command, PSTR("Bus reset failed.\n"));
+		release_lock();
 		PROCESS_EXIT();
 	}
-	else if (err == 0) {
+	else if (op.ret == 0) {
 		shell_output_P(&owtest_command, PSTR("No presence detected.\n"));
+		release_lock();
 		PROCESS_EXIT();
 	}
 
 	// Start the search
-	err = ow_search_first(&search, 0);
+	ow_search_init(&search, 0);
 	do {
-		if (err < 0) {
-			shell_output_P(&owtest_command, PSTR("Search error: %d\n"), err);
+		OW_WAIT(process_pt, ow_search_async(&op, &search));
+		if (op.ret < 0) {
+			shell_output_P(&owtest_command, PSTR("Search error: %d\n"), op.ret);
+			release_lock();
 			PROCESS_EXIT();
 		}
-		else if (err == 0) {
+		else if (op.ret == 0) {
 			shell_output_P(&owtest_command, PSTR("No devices found.\n"));
 			break;
 		}
@@ -211,19 +226,12 @@ PROCESS_THREAD(shell_owtest_process, ev, data) {
 		}
 
 		// If we found the last device on the bus, break out of the loop
-		if (search.last_device_flag) {
-			break;
-		}
-
-		// Find the next device on the bus
-		err = ow_search_next(&search);
-	} while (1);
+	} while (!search.last_device_flag);
 
 	// Relinquish bus lock
-	ow_unlock();
+	release_lock();
 
 	shell_output_P(&owtest_command, PSTR("Search complete.\n"));
 
 	PROCESS_END();
 }
-
@@ -0,0 +1,107 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <contiki.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include <pidloop.h>
+
+#include "shell.h"
+
+PROCESS(shell_pid_process, "pid");
+SHELL_COMMAND(pid_command,
+	"pid", "pid [tune <n> [tl]|cancel]: show or autotune PID loops",
+	&shell_pid_process);
+INIT_SHELL_COMMAND(pid_command);
+
+// 1/16 degrees C to floating point
+#define TEMP(t) ((float)(t) * 0.0625)
+
+static const char tune_none[] PROGMEM = "";
+static const char tune_running[] PROGMEM = ", tuning";
+static const char tune_done[] PROGMEM = ", tuned";
+static const char tune_failed[] PROGMEM = ", tune failed";
+
+static PGM_P const tune_names[] PROGMEM = {
+	[PIDLOOP_TUNE_NONE] = tune_none,
+	[PIDLOOP_TUNE_RUNNING] = tune_running,
+	[PIDLOOP_TUNE_DONE] = tune_done,
+	[PIDLOOP_TUNE_FAILED] = tune_failed,
+};
+
+PROCESS_THREAD(shell_pid_process, ev, data) {
+	char *args = data;
+
+	PROCESS_BEGIN();
+
+	if (args && strncmp_P(args, PSTR("tune "), 5) == 0) {
+		char *end;
+		uint8_t n = strtoul(args + 5, &end, 10);
+		uint8_t rule = PIDLOOP_RULE_ZN;
+
+		if (strcmp_P(end, PSTR(" tl")) == 0) {
+			rule = PIDLOOP_RULE_TL;
+		}
+		else if (*end) {
+			shell_output_P(&pid_command, PSTR("Unknown tuning rule.\n"));
+			PROCESS_EXIT();
+		}
+
+		if (pidloop_autotune(n, rule, PIDLOOP_TUNE_HYST)) {
+			shell_output_P(&pid_command,
+				PSTR("Can't tune loop %u.\n"), n);
+		}
+		PROCESS_EXIT();
+	}
+	else if (args && strcmp_P(args, PSTR("cancel")) == 0) {
+		pidloop_autotune_cancel();
+		PROCESS_EXIT();
+	}
+	else if (args && strlen(args) > 0) {
+		shell_output_P(&pid_command,
+			PSTR("Usage: pid [tune <n> [tl]|cancel]\n"));
+		PROCESS_EXIT();
+	}
+
+	for (uint8_t i = 0; i < PIDLOOP_LOOPS; i++) {
+		const pidloop_cfg_t *c = &pidloop_cfg[i];
+		const pidloop_stats_t *st = &pidloop_stats[i];
+
+		if (!c->period) {
+			continue;
+		}
+
+		shell_output_P(&pid_command,
+			PSTR("%u: %02x.%02x%02x%02x%02x%02x%02x/%d -> %0.2fC "
+				"out %u%% p/i/d %d/%d/%d "
+				"(%lu runs, %u stale, %u/%u us, %lu late%S)\n"),
+			i, c->addr.u[0], c->addr.u[1], c->addr.u[2], c->addr.u[3],
+			c->addr.u[4], c->addr.u[5], c->addr.u[6], c->channel,
+			TEMP(c->setpoint),
+			(uint16_t)((uint32_t)pidloop_output(i) * 100 / PIDLOOP_OUT_MAX),
+			c->p, c->i, c->d, st->runs, st->stale, st->us_last, st->us_max,
+			(unsigned long)st->late_max,
+			(PGM_P)pgm_read_word(&tune_names[st->tune]));
+	}
+
+	PROCESS_END();
+}
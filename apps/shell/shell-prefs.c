@@ -0,0 +1,92 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <prefs.h>
+#include "shell.h"
+
+PROCESS(shell_prefs_process, "prefs");
+SHELL_COMMAND(prefs_command,
+	"prefs", "prefs [<name> [<value>]|commit]: show or change preferences",
+	&shell_prefs_process);
+INIT_SHELL_COMMAND(prefs_command);
+
+static void show(uint8_t n) {
+	struct prefs_item item;
+	PGM_P type;
+
+	memcpy_P(&item, prefs_item(n), sizeof(item));
+	type = (PGM_P)pgm_read_word(&item.type->name);
+
+	shell_output_P(&prefs_command, PSTR("%-20S %-6S %10lu (default %lu)\n"),
+		item.name, type, prefs_get(n), item.def);
+}
+
+PROCESS_THREAD(shell_prefs_process, ev, data) {
+	static uint8_t n;
+	char *args = data;
+	char *value;
+	char *end;
+	int i;
+
+	PROCESS_BEGIN();
+
+	if (!args || strlen(args) == 0) {
+		for (n = 0; prefs_item(n); n++) {
+			SHELL_OUTPUT_WAIT();
+			show(n);
+		}
+		PROCESS_EXIT();
+	}
+
+	if (strcmp_P(args, PSTR("commit")) == 0) {
+		if (prefs_commit()) {
+			shell_output_P(&prefs_command, PSTR("Can't save preferences.\n"));
+		}
+		PROCESS_EXIT();
+	}
+
+	value = strchr(args, ' ');
+	if (value) {
+		*value++ = '\0';
+	}
+
+	i = prefs_find(args);
+	if (i < 0) {
+		shell_output_P(&prefs_command, PSTR("No such preference.\n"));
+		PROCESS_EXIT();
+	}
+
+	if (value) {
+		uint32_t v = strtoul(value, &end, 0);
+
+		if (end == value || *end || prefs_set(i, v)) {
+			shell_output_P(&prefs_command, PSTR("Bad value.\n"));
+			PROCESS_EXIT();
+		}
+	}
+
+	show(i);
+
+	PROCESS_END();
+}
@@ -43,6 +43,10 @@
 
 #include "shell.h"
 
+#if CONFIG_LIB_JOB
+#include <job.h>
+#endif
+
 PROCESS(shell_ps_process, "ps");
 SHELL_COMMAND(ps_command,
 	"ps",
@@ -51,14 +55,32 @@ SHELL_COMMAND(ps_command,
 INIT_SHELL_COMMAND(ps_command);
 
 PROCESS_THREAD(shell_ps_process, ev, data) {
-	struct process *p;
+	// Processes are all static, so p->next still leads on through the list
+	// if p exits while waiting for output room
+	static struct process *p;
 	PROCESS_BEGIN();
 
 	shell_output_P(&ps_command, PSTR("Processes:\n"));
 	for (p = PROCESS_LIST(); p != NULL; p = p->next) {
+		SHELL_OUTPUT_WAIT();
 		shell_output_P(&ps_command, PSTR("%S\n"), p->name);
 	}
 
+#if CONFIG_LIB_JOB
+	// Jobs come and go, so list them all in one go rather than keeping hold
+	// of one across a wait
+	if (job_queue) {
+		struct job *j;
+
+		SHELL_OUTPUT_WAIT();
+		shell_output_P(&ps_command, PSTR("Jobs:\n"));
+		for (j = job_queue; j != NULL; j = j->next) {
+			shell_output_P(&ps_command, PSTR("%S %u%%\n"),
+				j->name, j->progress);
+		}
+	}
+#endif
+
 	PROCESS_END();
 }
 
@@ -42,6 +42,9 @@
 #include <stdarg.h>
 #include <avr/wdt.h>
 #include "shell.h"
+#if CONFIG_LIB_FLASHLOG
+#include <flashlog.h>
+#endif
 
 PROCESS(shell_reboot_process, "reboot");
 SHELL_COMMAND(reboot_command,
@@ -55,6 +58,11 @@ PROCESS_THREAD(shell_reboot_process, ev, data) {
 
 	shell_output_P(&reboot_command, PSTR("Rebooting...\n"));
 
+#if CONFIG_LIB_FLASHLOG
+	// Don't lose what's still in RAM
+	flashlog_flush();
+#endif
+
 	wdt_enable(WDTO_15MS);
 	while (1);
 
@@ -58,7 +58,7 @@ PROCESS_THREAD(shell_rlytest_process, ev, data) {
 		}
 	}
 
-	port_ext_update();
+	port_ext_commit();
 
 	PROCESS_END();
 }
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include <sensorlog.h>
+
+#include "shell.h"
+
+PROCESS(shell_sensors_process, "sensors");
+SHELL_COMMAND(sensors_command,
+	"sensors", "sensors: show sensor history",
+	&shell_sensors_process);
+INIT_SHELL_COMMAND(sensors_command);
+
+// 1/16 degrees C to floating point
+#define TEMP(t) ((float)(t) * 0.0625)
+
+PROCESS_THREAD(shell_sensors_process, ev, data) {
+	uint32_t now = clock_seconds();
+
+	PROCESS_BEGIN();
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		const sensorlog_t *l = &sensorlog[i];
+
+		if (!l->used || !l->count) {
+			continue;
+		}
+
+		shell_output_P(&sensors_command,
+			PSTR("%02x.%02x%02x%02x%02x%02x%02x/%d: %0.2fC "
+				"avg %0.2fC min %0.2fC max %0.2fC (%u samples, %lus ago)\n"),
+			l->addr.u[0], l->addr.u[1], l->addr.u[2], l->addr.u[3],
+			l->addr.u[4], l->addr.u[5], l->addr.u[6], l->channel,
+			TEMP(sensorlog_sample(l, 0)), TEMP(sensorlog_avg(l)),
+			TEMP(l->min), TEMP(l->max), l->count, now - l->time);
+	}
+
+	PROCESS_END();
+}
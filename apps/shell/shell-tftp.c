@@ -23,10 +23,15 @@
 #include <resolv_helper.h>
 #include <polyfs.h>
 #include <flashmgt.h>
+#include <polyfs_cfs.h>
+#if CONFIG_LIB_JOB
+#include <job.h>
+#endif
 
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <memstat.h>
 #include "shell.h"
 
 static const char progress[] PROGMEM = {
@@ -39,6 +44,12 @@ SHELL_COMMAND(tftpupdate_command,
 	&shell_tftpupdate_process);
 INIT_SHELL_COMMAND(tftpupdate_command);
 
+PROCESS(shell_webfs_process, "webfs");
+SHELL_COMMAND(webfs_command,
+	"webfs", "webfs [primary|secondary]: pick the flash image web pages come from",
+	&shell_webfs_process);
+INIT_SHELL_COMMAND(webfs_command);
+
 struct tftpupdate_params {
 	struct resolv_helper_status res;
 	char filename[32];
@@ -59,7 +70,7 @@ static void tftpupdate_cleanup(void) {
 			tftpupdate->s.conn = NULL;
 		}
 
-		free(tftpupdate);
+		memstat_free(MEMSTAT_SHELL, tftpupdate);
 		tftpupdate = NULL;
 	}
 }
@@ -114,7 +125,7 @@ PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 	}
 
 	// Allocate our memory block if necessary
-	tftpupdate = malloc(sizeof(*tftpupdate));
+	tftpupdate = memstat_malloc(MEMSTAT_SHELL, sizeof(*tftpupdate));
 	if (tftpupdate == NULL) {
 		shell_output_P(&tftpupdate_command,
 			PSTR("Out of memory!\n"));
@@ -261,3 +272,47 @@ PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 	PROCESS_END();
 }
 
+
+PROCESS_THREAD(shell_webfs_process, ev, data) {
+	int err = 0;
+
+	PROCESS_BEGIN();
+
+	if (data && strcmp_P(data, PSTR("secondary")) == 0) {
+#if CONFIG_LIB_JOB
+		// Check the image in the background first, so the check doesn't
+		// hold everything else up
+		err = flashmgt_sec_check();
+		if (err > 0) {
+			shell_output_P(&webfs_command,
+				PSTR("Checking the secondary image...\n"));
+			PROCESS_WAIT_EVENT_UNTIL(ev == job_event);
+			err = ((struct job *)data)->result;
+		}
+		if (err == 0)
+#endif
+		err = flashmgt_cfs_select(true);
+	}
+	else if (data && strcmp_P(data, PSTR("primary")) == 0) {
+		err = flashmgt_cfs_select(false);
+	}
+	else if (data && strlen(data) > 0) {
+		shell_output_P(&webfs_command,
+			PSTR("Usage: webfs [primary|secondary]\n"));
+		PROCESS_EXIT();
+	}
+
+	if (err) {
+		shell_output_P(&webfs_command,
+			PSTR("Could not switch images (%d).\n"), err);
+	}
+
+	if (polyfs_cfs_fs) {
+		shell_output_P(&webfs_command,
+			PSTR("Serving %S image %08lx.\n"),
+			polyfs_cfs_fs == flashmgt_pfs ? PSTR("primary") : PSTR("secondary"),
+			polyfs_cfs_fs->sb.fsid.crc);
+	}
+
+	PROCESS_END();
+}
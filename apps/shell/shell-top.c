@@ -0,0 +1,59 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stdarg.h>
+#include "shell.h"
+
+#include <avr/pgmspace.h>
+#include <procstat.h>
+
+PROCESS(shell_top_process, "top");
+SHELL_COMMAND(top_command,
+	"top", "top: show CPU time used by each process",
+	&shell_top_process);
+INIT_SHELL_COMMAND(top_command);
+
+PROCESS_THREAD(shell_top_process, ev, data) {
+	static uint8_t i;
+	PROCESS_BEGIN();
+
+#if PROCESS_CONF_STATS
+	shell_output_P(&top_command, PSTR("Max events: %u\n"),
+		process_maxevents);
+#endif
+	shell_output_P(&top_command,
+		PSTR("Process            CPU%%  Total(ms)   Max(us)  Events   Polls\n"));
+
+	for (i = 0; i < procstat_count; i++) {
+		const struct procstat *s = &procstat_stats[i];
+		uint16_t permille = s->last * 1000 / PROCSTAT_PERIOD_TICKS;
+
+		SHELL_OUTPUT_WAIT();
+		shell_output_P(&top_command,
+			PSTR("%-16S %3u.%u %10lu %9lu %7u %7u\n"),
+			s->p->name, permille / 10, permille % 10,
+			PROCSTAT_TICKS_MS(s->ticks),
+			PROCSTAT_TICKS_US(s->max),
+			s->events, s->polls);
+	}
+
+	PROCESS_END();
+}
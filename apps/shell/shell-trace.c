@@ -0,0 +1,84 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <trace.h>
+#include "shell.h"
+
+PROCESS(shell_trace_process, "trace");
+SHELL_COMMAND(trace_command,
+	"trace", "trace [dump|clear]: show or forget the event trace",
+	&shell_trace_process);
+INIT_SHELL_COMMAND(trace_command);
+
+static uint8_t held;
+static uint16_t n;
+static uint32_t first, last;
+
+PROCESS_THREAD(shell_trace_process, ev, data) {
+	PROCESS_EXITHANDLER(if (held) { trace_release(); held = 0; });
+	PROCESS_BEGIN();
+
+	if (data && strcmp_P(data, PSTR("clear")) == 0) {
+		trace_clear();
+		PROCESS_EXIT();
+	}
+	else if (data && strlen(data) > 0 && strcmp_P(data, PSTR("dump")) != 0) {
+		shell_output_P(&trace_command,
+			PSTR("Usage: trace [dump|clear]\n"));
+		PROCESS_EXIT();
+	}
+
+	// Hold still while we print it (the shell's own output would soon push
+	// out what came before)
+	trace_hold();
+	held = 1;
+
+	shell_output_P(&trace_command,
+		PSTR("      time    delta event      arg\n"));
+	for (n = 0; n < trace_count(); n++) {
+		struct trace_entry e;
+
+		SHELL_OUTPUT_WAIT();
+		if (trace_get(n, &e)) {
+			break;
+		}
+		if (n == 0) {
+			first = last = e.time;
+		}
+
+		// Microseconds since the first entry, and since the one before
+		shell_output_P(&trace_command, PSTR("%10lu %8lu %-10S %u\n"),
+			TRACE_CYCLES_US(e.time - first), TRACE_CYCLES_US(e.time - last),
+			e.id < TRACE_IDS ?
+				(PGM_P)pgm_read_word(&trace_names[e.id]) : PSTR("?"),
+			e.arg);
+		last = e.time;
+
+		PROCESS_PAUSE();
+	}
+
+	trace_release();
+	held = 0;
+
+	PROCESS_END();
+}
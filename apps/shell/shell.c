@@ -54,16 +54,20 @@
 #include <stdio.h>
 
 #include "shell.h"
+#if CONFIG_APPS_SERIAL
+#include "apps/serial.h"
+#endif
 
 LIST(commands);
 
 int shell_event_input;
 
-static struct process *front_process;
+/* The session whose input the shell itself is handling, which takes any
+   output until it returns */
+static struct shell_session *current;
 
 static unsigned long time_offset;
 
-PROCESS(shell_process, "Shell");
 PROCESS(shell_server_process, "Shell server");
 /*---------------------------------------------------------------------------*/
 PROCESS(help_command_process, "help");
@@ -97,6 +101,66 @@ PROCESS_THREAD(shell_null_process, ev, data)
 	}
 	PROCESS_END();
 }
+/*---------------------------------------------------------------------------*/
+	static uint8_t
+name_hash(const char *name, int len)
+{
+	uint8_t hash = 0;
+
+	while(len-- > 0) {
+		hash = (hash << 3) + (hash >> 5) + (uint8_t)*name++;
+	}
+
+	return hash;
+}
+/*---------------------------------------------------------------------------*/
+/* Look up a registered command by name; only those with a matching hash get
+   their (PROGMEM) names compared. */
+	static struct shell_command *
+find_command(const char *name, int len)
+{
+	struct shell_command *c;
+	uint8_t hash = name_hash(name, len);
+
+	for(c = list_head(commands); c != NULL; c = c->next) {
+		if(c->hash == hash &&
+				strncmp_P(name, c->command, len) == 0 &&
+				pgm_read_byte(&c->command[len]) == 0) {
+			return c;
+		}
+	}
+
+	return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* The session output from process p goes to */
+	static struct shell_session *
+session_of(struct process *p)
+{
+	struct shell_command *c;
+
+	if(current != NULL) {
+		return current;
+	}
+
+	for(c = list_head(commands); c != NULL; c = c->next) {
+		if(c->process == p) {
+			return c->session;
+		}
+	}
+
+	return NULL;
+}
+/*---------------------------------------------------------------------------*/
+	static void
+prompt(struct shell_session *s)
+{
+	struct shell_session *old = current;
+
+	current = s;
+	shell_prompt_P(PSTR("Contiki> "));
+	current = old;
+}
 /*---------------------------------------------------------------------------*/
 	static void
 command_kill(struct shell_command *c)
@@ -108,14 +172,16 @@ command_kill(struct shell_command *c)
 	}
 }
 /*---------------------------------------------------------------------------*/
+/* Stop the commands started from session s, or all of them if it's NULL */
 	static void
-killall(void)
+killall(struct shell_session *s)
 {
 	struct shell_command *c;
 	for(c = list_head(commands);
 			c != NULL;
 			c = c->next) {
-		if(c != &killall_command && process_is_running(c->process)) {
+		if(c != &killall_command && process_is_running(c->process) &&
+				(s == NULL || c->session == s)) {
 			command_kill(c);
 		}
 	}
@@ -124,7 +190,7 @@ killall(void)
 PROCESS_THREAD(shell_killall_process, ev, data) {
 	PROCESS_BEGIN();
 
-	killall();
+	killall(killall_command.session);
 
 	PROCESS_END();
 }
@@ -140,17 +206,10 @@ PROCESS_THREAD(shell_kill_process, ev, data) {
 			PSTR("kill <command>: command name must be given\n"));
 	}
 
-	for(c = list_head(commands);
-		c != NULL;
-		c = c->next)
-	{
-		if (strcmp_P(name, c->command) == 0 &&
-			c != &kill_command &&
-			process_is_running(c->process))
-		{
-			command_kill(c);
-			PROCESS_EXIT();
-		}
+	c = find_command(name, strlen(name));
+	if (c != NULL && c != &kill_command && process_is_running(c->process)) {
+		command_kill(c);
+		PROCESS_EXIT();
 	}
 
 	shell_output_P(&kill_command,
@@ -255,13 +314,8 @@ start_command(char *commandline, struct shell_command *child)
 
 
 
-	/* Go through list of commands to find a match for the first word in
-	   the command line. */
-	for(c = list_head(commands);
-			c != NULL &&
-			!(strncmp_P(commandline, c->command, command_len) == 0 &&
-				pgm_read_byte(&c->command[command_len]) == 0);
-			c = c->next);
+	/* Find a match for the first word in the command line. */
+	c = find_command(commandline, command_len);
 
 	if(c == NULL) {
 		shell_output_P(NULL, PSTR("%s: command not found (try 'help')\n"), commandline);
@@ -273,6 +327,7 @@ start_command(char *commandline, struct shell_command *child)
 		c = NULL;
 	} else {
 		c->child = child;
+		c->session = session_of(PROCESS_CURRENT());
 		/*    printf("shell: start_command starting '%s'\n", c->process->name);*/
 		/* Start a new process for the command. */
 		process_start(c->process, args);
@@ -333,25 +388,65 @@ input_to_child_command(struct shell_command *c,
 }
 /*---------------------------------------------------------------------------*/
 	void
-shell_input(char *commandline, int commandline_len)
+shell_session_start(struct shell_session *s)
 {
+	s->front = NULL;
+	prompt(s);
+}
+/*---------------------------------------------------------------------------*/
+	void
+shell_session_input(struct shell_session *s,
+		char *commandline, int commandline_len)
+{
+	struct shell_session *old = current;
+	struct process *started_process;
 	struct shell_input input;
+	int ret;
 
-	/*  printf("shell_input front_process '%s'\n", front_process->name);*/
+	current = s;
 
 	if(commandline[0] == '~' &&
 			commandline[1] == 'K') {
-		/*    process_start(&shell_killall_process, commandline);*/
-		if(front_process != &shell_process) {
-			process_exit(front_process);
+		if(s->front != NULL) {
+			process_exit(s->front);
 		}
+	} else if(s->front != NULL && process_is_running(s->front)) {
+		input.data1 = commandline;
+		input.len1 = commandline_len;
+		input.data2 = "";
+		input.len2 = 0;
+		process_post_synch(s->front, shell_event_input, &input);
 	} else {
-		if(process_is_running(front_process)) {
-			input.data1 = commandline;
-			input.len1 = commandline_len;
-			input.data2 = "";
-			input.len2 = 0;
-			process_post_synch(front_process, shell_event_input, &input);
+		ret = shell_start_command(commandline, commandline_len, NULL,
+				&started_process);
+
+		if(started_process != NULL &&
+				ret == SHELL_FOREGROUND &&
+				process_is_running(started_process)) {
+			/* The prompt comes back when it exits */
+			s->front = started_process;
+		} else {
+			prompt(s);
+		}
+	}
+
+	current = old;
+}
+/*---------------------------------------------------------------------------*/
+	void
+shell_session_end(struct shell_session *s)
+{
+	struct shell_command *c;
+
+	s->front = NULL;
+
+	for(c = list_head(commands); c != NULL; c = c->next) {
+		if(c->session == s) {
+			/* Nowhere for anything it says on the way out to go */
+			c->session = NULL;
+			if(process_is_running(c->process)) {
+				process_exit(c->process);
+			}
 		}
 	}
 }
@@ -381,6 +476,69 @@ void shell_output_P(struct shell_command * c, PGM_P fmt, ...) {
 		va_end(argp);
 	}
 }
+/*---------------------------------------------------------------------------*/
+void shell_vprintf_P(PGM_P fmt, va_list args) {
+	struct shell_session *s = session_of(PROCESS_CURRENT());
+	shell_write_fn write = (shell_write_fn)fdev_get_udata(stdout);
+	char buf[SHELL_OUTPUT_LINE];
+	va_list copy;
+	int len;
+
+	if (s != NULL && s->write != NULL) {
+		va_copy(copy, args);
+		len = vsnprintf_P(buf, sizeof(buf), fmt, copy);
+		va_end(copy);
+
+		if (len < 0) {
+			return;
+		}
+		else if (len < sizeof(buf)) {
+			s->write(s, buf, len);
+		}
+		else {
+			// Too long for the line buffer, so make one that fits
+			char *big = alloca(len + 1);
+
+			vsnprintf_P(big, len + 1, fmt, args);
+			s->write(s, big, len);
+		}
+		return;
+	}
+
+	if (write == NULL) {
+		vfprintf_P(stdout, fmt, args);
+		return;
+	}
+
+	va_copy(copy, args);
+	len = vsnprintf_P(buf, sizeof(buf), fmt, copy);
+	va_end(copy);
+
+	if (len < 0) {
+		return;
+	}
+	else if (len >= sizeof(buf)) {
+		// Too long for the line buffer, go through the stream after all
+		vfprintf_P(stdout, fmt, args);
+		return;
+	}
+
+	write(buf, len);
+}
+/*---------------------------------------------------------------------------*/
+uint16_t shell_output_space(void) {
+	struct shell_session *s = session_of(PROCESS_CURRENT());
+
+	if (s != NULL && s->space != NULL) {
+		return s->space(s);
+	}
+
+#if CONFIG_APPS_SERIAL
+	return serial_output_space(SHELL_OUTPUT_LINE);
+#else
+	return 0xffff;
+#endif
+}
 /*---------------------------------------------------------------------------*/
 	void
 shell_unregister_command(struct shell_command *c)
@@ -394,6 +552,7 @@ shell_register_command(struct shell_command *c)
 	struct shell_command *i, *p;
 	char name[32];
 	strcpy_P(name, c->command);
+	c->hash = name_hash(name, strlen(name));
 
 	p = NULL;
 	for(i = list_head(commands);
@@ -411,43 +570,11 @@ shell_register_command(struct shell_command *c)
 	}
 }
 /*---------------------------------------------------------------------------*/
-PROCESS_THREAD(shell_process, ev, data)
-{
-	static struct process *started_process;
-	PROCESS_BEGIN();
-
-	/* Let the system start up before showing the prompt. */
-	PROCESS_PAUSE();
-
-	while(1) {
-		shell_prompt_P(PSTR("Contiki> "));
-
-		PROCESS_WAIT_EVENT_UNTIL(ev == shell_event_input);
-		{
-			struct shell_input *input = data;
-			int ret;
-
-			ret = shell_start_command(input->data1, input->len1, NULL,
-					&started_process);
-
-			if(started_process != NULL &&
-					ret == SHELL_FOREGROUND &&
-					process_is_running(started_process)) {
-				front_process = started_process;
-				PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_EXITED &&
-						data == started_process);
-			}
-			front_process = &shell_process;
-		}
-	}
-
-	PROCESS_END();
-}
-/*---------------------------------------------------------------------------*/
 PROCESS_THREAD(shell_server_process, ev, data)
 {
 	struct process *p;
 	struct shell_command *c;
+	struct shell_session *s;
 	static struct etimer etimer;
 	PROCESS_BEGIN();
 
@@ -461,6 +588,14 @@ PROCESS_THREAD(shell_server_process, ev, data)
 			for(c = list_head(commands);
 					c != NULL && c->process != p;
 					c = c->next);
+
+			/* Give the prompt back if it was in the foreground */
+			s = (c != NULL) ? c->session : NULL;
+			if(s != NULL && s->front == p) {
+				s->front = NULL;
+				prompt(s);
+			}
+
 			while(c != NULL) {
 				if(c->child != NULL && c->child->process != NULL) {
 					/*	  printf("Killing '%s'\n", c->process->name);*/
@@ -490,10 +625,7 @@ shell_init(void)
 
 	shell_event_input = process_alloc_event();
 
-	process_start(&shell_process, NULL);
 	process_start(&shell_server_process, NULL);
-
-	front_process = &shell_process;
 }
 /*---------------------------------------------------------------------------*/
 	unsigned long
@@ -536,20 +668,11 @@ shell_set_time(unsigned long seconds)
 {
 	time_offset = seconds - clock_seconds();
 }
-/*---------------------------------------------------------------------------*/
-	void
-shell_start(void)
-{
-	shell_output_P(NULL, PSTR("Contiki command shell\n"));
-	shell_output_P(NULL, PSTR("Type '?' and return for help\n"));
-	shell_prompt_P(PSTR("Contiki> "));
-}
 /*---------------------------------------------------------------------------*/
 	void
 shell_quit(void)
 {
-	killall();
-	process_exit(&shell_process);
+	killall(NULL);
 	process_exit(&shell_server_process);
 }
 /*---------------------------------------------------------------------------*/
@@ -80,6 +80,25 @@ struct shell_command {
   PGM_P description;
   struct process *process;
   struct shell_command *child;
+  uint8_t hash; /* of the command name, set on registration */
+  struct shell_session *session; /* that started it, for its output */
+};
+
+/**
+ * \brief      A shell back end's connection to the shell
+ *
+ *             Each back end (the serial port, every telnet connection)
+ *             has one of these. Commands started from its input belong
+ *             to it and their output goes to its write function; with
+ *             none, output goes to stdout. Each command is a single
+ *             process, so a command can only be running in one session
+ *             at a time.
+ */
+struct shell_session {
+  struct process *front; /* foreground command, NULL at the prompt */
+  void (*write)(struct shell_session *s, const char *data, uint16_t len);
+  /* Room for output; polls PROCESS_CURRENT() once there is more */
+  uint16_t (*space)(struct shell_session *s);
 };
 
 /**
@@ -100,27 +119,39 @@ struct shell_command {
 void shell_init(void);
 
 /**
- * \brief      Start the shell.
+ * \brief      Start a shell session
+ * \param s    The back end's session, with its output functions set
  *
- *             This function starts the shell and prints out the shell
- *             prompt. It typically is called by the shell back-end to
- *             start a new shell session.
+ *             This function prints out the shell prompt to a new
+ *             session. It typically is called by the shell back-end
+ *             when a user connects.
  *
  */
-void shell_start(void);
+void shell_session_start(struct shell_session *s);
 
 /**
  * \brief      Send a line of input to the shell
+ * \param s    The session the input came from
  * \param commandline A pointer to a string that contains the command line
  * \param commandline_len Length of the command line, in bytes
  *
  *             This function is called by a shell back-end to send an
  *             incoming command line to the shell. The shell parses
  *             the command line and starts any commands found in the
- *             command line.
+ *             command line, or passes it to the session's foreground
+ *             command if there is one.
  *
  */
-void shell_input(char *commandline, int commandline_len);
+void shell_session_input(struct shell_session *s,
+	char *commandline, int commandline_len);
+
+/**
+ * \brief      End a shell session
+ * \param s    The session that has gone away
+ *
+ *             Stops every command the session started.
+ */
+void shell_session_end(struct shell_session *s);
 
 /**
  * \brief      Quit the shell
@@ -229,6 +260,41 @@ void shell_output_P(struct shell_command * c,
 	PGM_P fmt, ...)
 	__attribute__((format(printf,2,3)));
 
+/**
+ * \brief      Room left for output before some of it would be lost
+ *
+ *             Commands that output a lot should use SHELL_OUTPUT_WAIT()
+ *             before each line, so a slow telnet client holds them up
+ *             instead of missing output. This is the room in the
+ *             calling command's own session.
+ */
+uint16_t shell_output_space(void);
+
+/**
+ * \brief      Format output into a line buffer and write it out
+ *
+ *             Goes to the calling command's session if it has a write
+ *             function. Otherwise it goes to stdout, using the stream's
+ *             shell_write_fn if it has one, or writing through the
+ *             stream.
+ */
+void shell_vprintf_P(PGM_P fmt, va_list args);
+
+/**
+ * \brief      Write a block of shell output, turning "\n" into "\r\n"
+ *
+ *             Shell back ends set one of these as the udata of the stdout
+ *             stream they install, so formatted output can be handed over
+ *             in one go rather than a character at a time.
+ */
+typedef void (*shell_write_fn)(const char *data, uint16_t len);
+
+// Longest line (with CRLF) waited for by SHELL_OUTPUT_WAIT()
+#define SHELL_OUTPUT_LINE 82
+
+#define SHELL_OUTPUT_WAIT() \
+	PROCESS_WAIT_UNTIL(shell_output_space() >= SHELL_OUTPUT_LINE)
+
 /**
  * \brief      Register a command with the shell
  * \param c    A pointer to a shell command structure, defined with SHELL_COMMAND()
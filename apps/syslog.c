@@ -26,7 +26,18 @@
 #include <string.h>
 #include <avr/pgmspace.h>
 #include <contiki-net.h>
+#include <lib/memb.h>
+#include <memstat.h>
+#if CONFIG_LIB_PREFS
+#include <prefs.h>
+#endif
+#if CONFIG_APPS_ARP
+#include "apps/arp.h"
+#endif
 #include <resolv_helper.h>
+#if CONFIG_LIB_FLASHLOG
+#include <flashlog.h>
+#endif
 
 #include <drivers/wallclock.h>
 #include <init.h>
@@ -48,6 +59,56 @@
 #define SYSLOG_MSG_MAX_LEN 64
 #endif
 
+// Keep syslog_P() arguments and format them when the message is sent,
+// rather than formatting every message as it is logged
+#ifndef CONFIG_APPS_SYSLOG_DEFER
+#define SYSLOG_DEFER 1
+#else
+#define SYSLOG_DEFER CONFIG_APPS_SYSLOG_DEFER
+#endif
+
+// Messages allowed per second for each facility, with bursts of up to
+// SYSLOG_BURST (0 for no limit)
+#ifndef CONFIG_APPS_SYSLOG_RATE
+#define SYSLOG_RATE 2
+#else
+#define SYSLOG_RATE CONFIG_APPS_SYSLOG_RATE
+#endif
+
+#ifndef CONFIG_APPS_SYSLOG_BURST
+#define SYSLOG_BURST 10
+#else
+#define SYSLOG_BURST CONFIG_APPS_SYSLOG_BURST
+#endif
+
+// Seconds a run of identical messages is held back for before the
+// "last message repeated" count goes out
+#define SYSLOG_REPEAT_TIME 30
+
+// Pack as many queued messages into each datagram as fit, each framed with
+// its length (RFC 6587 octet counting). Only for a relay that understands
+// the framing; plain syslog servers want one message per datagram.
+#ifndef CONFIG_APPS_SYSLOG_BATCH
+#define SYSLOG_BATCH 0
+#else
+#define SYSLOG_BATCH CONFIG_APPS_SYSLOG_BATCH
+#endif
+
+// Messages at this priority or more urgent are also kept in the dataflash
+// log, and from LOG_CRIT up they are written out straight away
+#ifndef CONFIG_APPS_SYSLOG_FLASH_LEVEL
+#define SYSLOG_FLASH_LEVEL LOG_INFO
+#else
+#define SYSLOG_FLASH_LEVEL CONFIG_APPS_SYSLOG_FLASH_LEVEL
+#endif
+
+#if SYSLOG_HISTORY && SYSLOG_HISTORY < 2 * (SYSLOG_MSG_MAX_LEN + 16)
+#error CONFIG_APPS_SYSLOG_HISTORY must have room for two messages at least
+#endif
+
+// Room kept in front of each batched message for its length ("NNNN ")
+#define SYSLOG_FRAME_LEN 5
+
 #define UIP_UDP_MAXLEN (UIP_BUFSIZE - UIP_LLH_LEN - UIP_IPUDPH_LEN)
 
 const char syslog_server_name[] PROGMEM = "tarquin.bootc.net";
@@ -59,17 +120,69 @@ LIST(msgq);
 static struct uip_udp_conn *conn;
 static struct resolv_helper_status res;
 
-// Log everything by default (!!! mask is inverted !!!)
-static uint8_t log_mask = 0x00;
+#if CONFIG_LIB_PREFS
+// Kept with the preferences so it survives a reboot
+#define log_mask prefs.syslog_mask
+#else
+// Log everything by default
+static uint8_t log_mask = LOG_UPTO(LOG_DEBUG);
+#endif
 
 struct msg_hdr {
 	struct msg_hdr *next;
 	uint32_t pri;
 	time_t time;
 	struct process *process;
+#if SYSLOG_DEFER
+	PGM_P fmt; // if set, msg holds the arguments for it rather than text
+#endif
+	uint8_t len; // bytes of msg in use
 	char msg[SYSLOG_MSG_MAX_LEN];
 };
 
+// Messages live in a fixed pool; when it runs out the oldest queued message
+// makes way for the new one
+MEMB(msgs, struct msg_hdr, SYSLOG_MAX_QUEUE_SIZE);
+
+// Messages thrown away since the last one was sent, and since boot
+static uint16_t dropped;
+uint32_t syslog_dropped;
+
+// The last message queued, and how many times it has come up again since
+static struct msg_hdr last;
+static uint16_t repeats;
+static struct etimer repeat_timer;
+
+#if SYSLOG_HISTORY
+// A message in the history, its text or deferred arguments straight after
+struct hist_rec {
+	uint8_t size; // bytes in the record, or 0 to say the rest is unused
+	uint16_t pri;
+	time_t time;
+	struct process *process;
+#if SYSLOG_DEFER
+	PGM_P fmt;
+#endif
+	char msg[];
+};
+
+// Records go in one after the other, starting again at the beginning when
+// one won't fit before the end, and the oldest make way for the newest
+static uint8_t history[SYSLOG_HISTORY];
+static uint16_t hist_first; // offset of the oldest record
+static uint16_t hist_end; // offset the next record goes at
+static uint16_t hist_records;
+static uint16_t hist_seq; // sequence number of the oldest record
+#endif
+
+#if SYSLOG_RATE
+// Token bucket for each facility
+static struct {
+	uint8_t used; // tokens taken out of SYSLOG_BURST
+	uint16_t stamp; // clock_seconds() when last topped up
+} buckets[LOG_NFACILITIES];
+#endif
+
 /*
  * Set the log mask level.
  *
@@ -78,8 +191,16 @@ struct msg_hdr {
  * priority normally. If it is off, syslog discards messages of that priority
  */
 uint32_t setlogmask(uint32_t mask) {
-	uint32_t temp = ~log_mask;
-	log_mask = ~mask;
+	uint32_t temp = log_mask;
+
+	// Zero only asks for the current mask
+	if (mask) {
+		log_mask = mask;
+#if CONFIG_LIB_PREFS
+		prefs_changed();
+#endif
+	}
+
 	return temp;
 }
 
@@ -128,60 +249,447 @@ static void append(char *msg, uint16_t *offset, PGM_P format, ...) {
 }
 
 static void append_time(char *msg, uint16_t *offset, time_t time) {
-	struct tm tm;
-	int ret;
+	uint16_t len = TIME_STAMP_LEN;
 
 	// Check offset
 	if (*offset >= UIP_UDP_MAXLEN) {
 		return;
 	}
 
-	// Get the current time
-	gmtime(time, &tm);
+	// Clip to the space left
+	if (*offset + len > UIP_UDP_MAXLEN) {
+		len = UIP_UDP_MAXLEN - *offset;
+	}
 
-	// Append formatted string
-	ret = strftime_P(
-		msg + *offset,
-		UIP_UDP_MAXLEN - *offset,
-		PSTR("%b %e %H:%M:%S"), &tm);
+	// Append the (cached) formatted time
+	memcpy(msg + *offset, time_stamp(time), len);
+	*offset += len;
+}
 
-	// Check length
-	if (*offset + ret > UIP_UDP_MAXLEN) {
-		*offset = UIP_UDP_MAXLEN;
+#if SYSLOG_DEFER
+// What a conversion takes from the argument list
+#define ARG_NONE	0 // %%
+#define ARG_INT		1
+#define ARG_LONG	2
+#define ARG_DOUBLE	3
+#define ARG_PGM		4 // %S
+#define ARG_BAD		5 // can't be deferred: %s (RAM may change), '*', ...
+
+// Longest conversion spec handled, including the '%'
+#define SPEC_MAX 12
+
+// Find the end of the conversion spec at fmt (just past the '%')
+static PGM_P conversion(PGM_P fmt, uint8_t *type) {
+	uint8_t is_long = 0;
+	char c;
+
+	while ((c = pgm_read_byte(fmt++))) {
+		if (strchr_P(PSTR("-+ #.0123456789h"), c)) {
+			continue;
+		}
+		else if (c == 'l') {
+			is_long = 1;
+			continue;
+		}
+
+		if (c == '%') {
+			*type = ARG_NONE;
+		}
+		else if (strchr_P(PSTR("cdiuxXop"), c)) {
+			*type = is_long ? ARG_LONG : ARG_INT;
+		}
+		else if (strchr_P(PSTR("eEfFgG"), c)) {
+			*type = ARG_DOUBLE;
+		}
+		else if (c == 'S') {
+			*type = ARG_PGM;
+		}
+		else {
+			*type = ARG_BAD;
+		}
+
+		return fmt;
 	}
-	else {
-		*offset += ret;
+
+	*type = ARG_BAD;
+	return fmt - 1;
+}
+
+#define ARG_PUT(p, end, t, ap) \
+	do { \
+		t v = va_arg(ap, t); \
+		if ((p) + sizeof(v) > (end)) { \
+			return -1; \
+		} \
+		memcpy(p, &v, sizeof(v)); \
+		(p) += sizeof(v); \
+	} while (0)
+
+// Store the arguments fmt takes in the message, returns the bytes used or -1
+// if that can't be done (and the message has to be formatted straight away)
+static int defer(struct msg_hdr *msg, PGM_P fmt, va_list ap) {
+	uint8_t *p = (uint8_t *)msg->msg;
+	uint8_t *end = p + sizeof(msg->msg);
+	PGM_P start;
+	uint8_t type;
+	char c;
+
+	while ((c = pgm_read_byte(fmt++))) {
+		if (c != '%') {
+			continue;
+		}
+
+		start = fmt - 1;
+		fmt = conversion(fmt, &type);
+		if (fmt - start >= SPEC_MAX) {
+			return -1;
+		}
+
+		switch (type) {
+		case ARG_NONE:
+			break;
+		case ARG_INT:
+			ARG_PUT(p, end, int, ap);
+			break;
+		case ARG_LONG:
+			ARG_PUT(p, end, long, ap);
+			break;
+		case ARG_DOUBLE:
+			ARG_PUT(p, end, double, ap);
+			break;
+		case ARG_PGM:
+			ARG_PUT(p, end, PGM_P, ap);
+			break;
+		default:
+			return -1;
+		}
 	}
+
+	return p - (uint8_t *)msg->msg;
 }
 
+// Format a deferred message from the arguments stored at p, one conversion
+// at a time, into out up to max bytes
+static void append_deferred(char *out, uint16_t *offset, uint16_t max,
+	PGM_P fmt, const uint8_t *p)
+{
+	char spec[SPEC_MAX];
+	uint8_t type;
+	char c;
+	int ret;
+	union {
+		int i;
+		long l;
+		double d;
+		PGM_P s;
+	} v;
+
+	while ((c = pgm_read_byte(fmt)) && *offset < max) {
+		if (c != '%') {
+			out[(*offset)++] = c;
+			fmt++;
+			continue;
+		}
+
+		PGM_P end = conversion(fmt + 1, &type);
+		memcpy_P(spec, fmt, end - fmt);
+		spec[end - fmt] = '\0';
+		fmt = end;
+
+		switch (type) {
+		case ARG_INT:
+			memcpy(&v.i, p, sizeof(v.i));
+			p += sizeof(v.i);
+			ret = snprintf(out + *offset, max - *offset, spec, v.i);
+			break;
+		case ARG_LONG:
+			memcpy(&v.l, p, sizeof(v.l));
+			p += sizeof(v.l);
+			ret = snprintf(out + *offset, max - *offset, spec, v.l);
+			break;
+		case ARG_DOUBLE:
+			memcpy(&v.d, p, sizeof(v.d));
+			p += sizeof(v.d);
+			ret = snprintf(out + *offset, max - *offset, spec, v.d);
+			break;
+		case ARG_PGM:
+			memcpy(&v.s, p, sizeof(v.s));
+			p += sizeof(v.s);
+			ret = snprintf(out + *offset, max - *offset, spec, v.s);
+			break;
+		default:
+			ret = snprintf(out + *offset, max - *offset, spec);
+			break;
+		}
+
+		// Check length
+		if (*offset + ret > max) {
+			*offset = max;
+		}
+		else {
+			*offset += ret;
+		}
+	}
+}
+#endif
+
 static struct msg_hdr *init_msg(uint32_t pri) {
 	struct msg_hdr *msg;
 
 	// Check the priority against the log_mask
-	if (log_mask & LOG_MASK(LOG_PRI(pri))) {
+	if (!(log_mask & LOG_MASK(LOG_PRI(pri)))) {
 		return NULL;
 	}
 
-	// Trim queue if necessary
-	while (list_length(msgq) >= SYSLOG_MAX_QUEUE_SIZE) {
-		struct msg_hdr *tmp = list_pop(msgq);
-		free(tmp);
+#if SYSLOG_RATE
+	// Top up the facility's bucket, then take a token if there is one
+	if (LOG_FAC(pri) < LOG_NFACILITIES) {
+		uint16_t now = clock_seconds();
+		uint16_t refill = now - buckets[LOG_FAC(pri)].stamp;
+		uint8_t *used = &buckets[LOG_FAC(pri)].used;
+
+		buckets[LOG_FAC(pri)].stamp = now;
+		if (refill >= SYSLOG_BURST / SYSLOG_RATE + 1) {
+			*used = 0;
+		}
+		else {
+			refill *= SYSLOG_RATE;
+			*used = refill < *used ? *used - refill : 0;
+		}
+
+		if (*used >= SYSLOG_BURST) {
+			dropped++;
+			syslog_dropped++;
+			return NULL;
+		}
+		(*used)++;
 	}
+#endif
 
-	// Allocate memory for the log entry
-	msg = malloc(sizeof(struct msg_hdr));
+	// Take a free entry, or the oldest one in the queue
+	msg = memstat_memb_alloc(MEMSTAT_SYSLOG, &msgs);
 	if (msg == NULL) {
-		return NULL;
+		msg = list_pop(msgq);
+		dropped++;
+		syslog_dropped++;
+		if (msg == NULL) {
+			return NULL;
+		}
 	}
 
 	msg->pri = pri;
 	msg->time = wallclock_seconds();
 	msg->process = PROCESS_CURRENT();
+#if SYSLOG_DEFER
+	msg->fmt = NULL;
+#endif
 
 	return msg;
 }
 
+#if SYSLOG_HISTORY
+#define HIST_REC(off) ((struct hist_rec *)&history[off])
+
+// Offset of the record after the one at off
+static uint16_t history_next(uint16_t off) {
+	off += history[off];
+	if (off >= SYSLOG_HISTORY || !history[off]) {
+		off = 0;
+	}
+
+	return off;
+}
+
+static void history_drop(void) {
+	hist_first = history_next(hist_first);
+	hist_seq++;
+	if (!--hist_records) {
+		hist_first = hist_end;
+	}
+}
+
+// Keep a copy of a queued message in the history
+static void history_add(const struct msg_hdr *msg) {
+	uint8_t size = sizeof(struct hist_rec) + msg->len;
+	struct hist_rec *rec;
+
+	// Start again at the beginning if it won't fit before the end, losing
+	// whatever was still kept beyond this point
+	if (hist_end + size > SYSLOG_HISTORY) {
+		while (hist_records && hist_first >= hist_end) {
+			history_drop();
+		}
+		if (hist_end < SYSLOG_HISTORY) {
+			history[hist_end] = 0;
+		}
+		hist_end = 0;
+	}
+
+	// Make room
+	while (hist_records && hist_first >= hist_end &&
+		hist_first < hist_end + size)
+	{
+		history_drop();
+	}
+
+	rec = HIST_REC(hist_end);
+	rec->size = size;
+	rec->pri = msg->pri;
+	rec->time = msg->time;
+	rec->process = msg->process;
+#if SYSLOG_DEFER
+	rec->fmt = msg->fmt;
+#endif
+	memcpy(rec->msg, msg->msg, msg->len);
+
+	if (!hist_records++) {
+		hist_first = hist_end;
+	}
+	hist_end += size;
+}
+
+void syslog_history_reader_init(syslog_history_reader_t *r, uint8_t maxpri,
+	uint16_t last)
+{
+	uint16_t off, i;
+	uint16_t matched = 0;
+	uint16_t n = 0;
+
+	r->maxpri = maxpri;
+	r->end = hist_seq + hist_records;
+
+	// Count the matches, then skip all but the last of them
+	if (last) {
+		off = hist_first;
+		for (i = 0; i < hist_records; i++) {
+			if (LOG_PRI(HIST_REC(off)->pri) <= maxpri) {
+				matched++;
+			}
+			off = history_next(off);
+		}
+
+		off = hist_first;
+		for (; matched > last; n++) {
+			if (LOG_PRI(HIST_REC(off)->pri) <= maxpri) {
+				matched--;
+			}
+			off = history_next(off);
+		}
+	}
+
+	r->next = hist_seq + n;
+}
+
+int syslog_history_read(syslog_history_reader_t *r, char *buf, uint16_t size) {
+	struct hist_rec *rec;
+	uint16_t off, i;
+	int ret;
+
+	// Skip anything that's been pushed out since the last read
+	if ((int16_t)(r->next - hist_seq) < 0) {
+		r->next = hist_seq;
+	}
+
+	// Find the next record at the right priority, checking each in place
+	off = hist_first;
+	for (i = 0; i != (uint16_t)(r->next - hist_seq); i++) {
+		off = history_next(off);
+	}
+	for (;;) {
+		if (r->next == r->end ||
+			(uint16_t)(r->next - hist_seq) >= hist_records)
+		{
+			return -1;
+		}
+		r->next++;
+		if (LOG_PRI(HIST_REC(off)->pri) <= r->maxpri) {
+			break;
+		}
+		off = history_next(off);
+	}
+	rec = HIST_REC(off);
+
+	ret = snprintf_P(buf, size, PSTR("%s <%u> %S: "), time_stamp(rec->time),
+		rec->pri, PROCESS_NAME_STRING(rec->process));
+	off = ret < size ? ret : size - 1;
+
+#if SYSLOG_DEFER
+	if (rec->fmt) {
+		append_deferred(buf, &off, size - 1, rec->fmt,
+			(const uint8_t *)rec->msg);
+		buf[off] = '\0';
+		return off;
+	}
+#endif
+
+	ret = snprintf(buf + off, size - off, "%s", rec->msg);
+	off += ret < size - off ? ret : size - off - 1;
+	return off;
+}
+#endif
+
+static int same_as_last(const struct msg_hdr *msg) {
+	return msg->pri == last.pri && msg->process == last.process &&
+#if SYSLOG_DEFER
+		msg->fmt == last.fmt &&
+#endif
+		msg->len == last.len && !memcmp(msg->msg, last.msg, msg->len);
+}
+
+// Queue the count of repeats of the last message, if there were any
+static void flush_repeats(void) {
+	struct msg_hdr *msg;
+
+	if (!repeats) {
+		return;
+	}
+
+	msg = memstat_memb_alloc(MEMSTAT_SYSLOG, &msgs);
+	if (msg == NULL) {
+		msg = list_pop(msgq);
+		dropped++;
+		syslog_dropped++;
+		if (msg == NULL) {
+			return;
+		}
+	}
+
+	msg->pri = last.pri;
+	msg->time = wallclock_seconds();
+	msg->process = last.process;
+#if SYSLOG_DEFER
+	msg->fmt = NULL;
+#endif
+	snprintf_P(msg->msg, sizeof(msg->msg),
+		PSTR("last message repeated %u times"), repeats);
+	msg->len = strlen(msg->msg) + 1;
+	repeats = 0;
+
+	list_add(msgq, msg);
+#if SYSLOG_HISTORY
+	history_add(msg);
+#endif
+}
+
 static void msg_finish(struct msg_hdr *msg) {
+#if SYSLOG_DEFER
+	if (!msg->fmt)
+#endif
+	msg->len = strlen(msg->msg) + 1;
+
+	// Count repeats rather than sending them
+	if (same_as_last(msg)) {
+		memstat_memb_free(MEMSTAT_SYSLOG, &msgs, msg);
+		repeats++;
+		return;
+	}
+
+	flush_repeats();
+	memcpy(&last, msg, sizeof(last));
+#if SYSLOG_HISTORY
+	history_add(msg);
+#endif
+
 	// Add to the end of the queue
 	list_add(msgq, msg);
 
@@ -189,6 +697,40 @@ static void msg_finish(struct msg_hdr *msg) {
 	process_poll(&syslog_process);
 }
 
+#if CONFIG_LIB_FLASHLOG
+// Keep a copy of the message in the dataflash log, formatted now as it may
+// never be sent
+static void flash_copy(uint32_t pri, const char *fmt, va_list ap,
+	uint8_t pgm)
+{
+	char text[FLASHLOG_TEXT_MAX];
+	int len;
+	va_list args;
+
+	if (LOG_PRI(pri) > SYSLOG_FLASH_LEVEL) {
+		return;
+	}
+
+	len = snprintf_P(text, sizeof(text), PSTR("%S: "),
+		PROCESS_NAME_STRING(PROCESS_CURRENT()));
+	if (len < sizeof(text)) {
+		va_copy(args, ap);
+		if (pgm) {
+			vsnprintf_P(&text[len], sizeof(text) - len, fmt, args);
+		}
+		else {
+			vsnprintf(&text[len], sizeof(text) - len, fmt, args);
+		}
+		va_end(args);
+	}
+
+	flashlog_write(pri, wallclock_seconds(), text);
+	if (LOG_PRI(pri) <= LOG_CRIT) {
+		flashlog_flush();
+	}
+}
+#endif
+
 /* Generate a log message using FMT and using arguments pointed to by AP. */
 void vsyslog(uint32_t pri, const char *fmt, va_list ap) {
 	struct msg_hdr *msg;
@@ -199,6 +741,10 @@ void vsyslog(uint32_t pri, const char *fmt, va_list ap) {
 		return;
 	}
 
+#if CONFIG_LIB_FLASHLOG
+	flash_copy(pri, fmt, ap, 0);
+#endif
+
 	// Append the formatted string
 	vsnprintf(
 		msg->msg,
@@ -219,6 +765,25 @@ void vsyslog_P(uint32_t pri, PGM_P fmt, va_list ap) {
 		return;
 	}
 
+#if CONFIG_LIB_FLASHLOG
+	flash_copy(pri, fmt, ap, 1);
+#endif
+
+#if SYSLOG_DEFER
+	// Just keep the arguments if we can
+	va_list args;
+	int len;
+	va_copy(args, ap);
+	len = defer(msg, fmt, args);
+	va_end(args);
+	if (len >= 0) {
+		msg->fmt = fmt;
+		msg->len = len;
+		msg_finish(msg);
+		return;
+	}
+#endif
+
 	// Append the formatted string
 	vsnprintf_P(
 		msg->msg,
@@ -230,6 +795,7 @@ void vsyslog_P(uint32_t pri, PGM_P fmt, va_list ap) {
 }
 
 static void init(void) {
+	memb_init(&msgs);
 	list_init(msgq);
 
 	// Copy the host name into the resolv helper structure
@@ -261,6 +827,9 @@ static void check_connection(void) {
 		if (conn != NULL &&
 			!uip_ipaddr_cmp(&conn->ripaddr, &res.ipaddr))
 		{
+#if CONFIG_APPS_ARP
+			arp_unpin(&conn->ripaddr);
+#endif
 			uip_udp_remove(conn);
 			conn = NULL;
 		}
@@ -278,6 +847,12 @@ static void check_connection(void) {
 
 		// Bind to the correct source port
 		udp_bind(conn, UIP_HTONS(SYSLOG_PORT));
+
+#if CONFIG_APPS_ARP
+		// Keep the server's MAC to hand, so messages don't get lost waiting
+		// for ARP
+		arp_pin(&res.ipaddr);
+#endif
 	}
 	else if (res.state == RESOLV_HELPER_STATE_EXPIRED) {
 		// Refresh an expired lookup
@@ -286,6 +861,9 @@ static void check_connection(void) {
 	else if (res.state == RESOLV_HELPER_STATE_ERROR) {
 		// Clear the connection
 		if (conn) {
+#if CONFIG_APPS_ARP
+			arp_unpin(&conn->ripaddr);
+#endif
 			uip_udp_remove(conn);
 		}
 
@@ -293,31 +871,96 @@ static void check_connection(void) {
 	}
 }
 
-static void send_message(struct msg_hdr *msg) {
-	uint16_t off = 0;
+// Format a message into the outgoing packet at off
+static void format_message(struct msg_hdr *msg, uint16_t *off) {
 	uip_ipaddr_t addr;
 
 	// Insert syslog priority
-	append(uip_appdata, &off, PSTR("<%lu>"), msg->pri);
+	append(uip_appdata, off, PSTR("<%lu>"), msg->pri);
 
 	// Append time
-	append_time(uip_appdata, &off, msg->time);
+	append_time(uip_appdata, off, msg->time);
 
 	// Append hostname (IP address)
 	uip_gethostaddr(&addr);
-	append(uip_appdata, &off, PSTR(" %d.%d.%d.%d"),
+	append(uip_appdata, off, PSTR(" %d.%d.%d.%d"),
 		uip_ipaddr_to_quad(&addr));
 
 	// Append the process name
-	append(uip_appdata, &off, PSTR(" %S: "),
+	append(uip_appdata, off, PSTR(" %S: "),
 		PROCESS_NAME_STRING(msg->process));
 
+	// Say if any messages were lost before this one
+	if (dropped) {
+		append(uip_appdata, off, PSTR("[%u messages dropped] "), dropped);
+		dropped = 0;
+	}
+
 	// Finally, add the message
-	append(uip_appdata, &off, PSTR("%s"), msg->msg);
+#if SYSLOG_DEFER
+	if (msg->fmt) {
+		append_deferred(uip_appdata, off, UIP_UDP_MAXLEN, msg->fmt,
+			(const uint8_t *)msg->msg);
+	}
+	else {
+		append(uip_appdata, off, PSTR("%s"), msg->msg);
+	}
+#else
+	append(uip_appdata, off, PSTR("%s"), msg->msg);
+#endif
+}
+
+#if SYSLOG_BATCH
+// Fill the packet with framed messages from the queue and send it
+static void send_batch(void) {
+	char *out = uip_appdata;
+	uint16_t off = 0;
+	uint16_t start;
+	uint16_t was_dropped;
+	char frame[SYSLOG_FRAME_LEN + 1];
+	uint8_t flen;
+	struct msg_hdr *msg;
+
+	while ((msg = list_head(msgq)) != NULL &&
+		off + SYSLOG_FRAME_LEN < UIP_UDP_MAXLEN)
+	{
+		// Leave room for the frame length in front of the message
+		start = off + SYSLOG_FRAME_LEN;
+		was_dropped = dropped;
+		format_message(msg, &start);
+
+		// Leave a message that didn't fit whole for the next packet, unless
+		// it wouldn't fit in one on its own either
+		if (start >= UIP_UDP_MAXLEN && off) {
+			dropped = was_dropped;
+			break;
+		}
+
+		// Slide the message up against its actual frame length
+		flen = snprintf_P(frame, sizeof(frame), PSTR("%u "),
+			start - off - SYSLOG_FRAME_LEN);
+		memmove(&out[off + flen], &out[off + SYSLOG_FRAME_LEN],
+			start - off - SYSLOG_FRAME_LEN);
+		memcpy(&out[off], frame, flen);
+		off = start - SYSLOG_FRAME_LEN + flen;
+
+		list_pop(msgq);
+		memstat_memb_free(MEMSTAT_SYSLOG, &msgs, msg);
+	}
+
+	// Send the messages
+	uip_udp_send(off);
+}
+#else
+static void send_message(struct msg_hdr *msg) {
+	uint16_t off = 0;
+
+	format_message(msg, &off);
 
 	// Send the message
 	uip_udp_send(off);
 }
+#endif
 
 static void send_messages(void) {
 	// Don't do anything unless IP is working
@@ -338,13 +981,19 @@ static void send_messages(void) {
 		return;
 	}
 
+#if SYSLOG_BATCH
+	// Send as many messages as fit
+	send_batch();
+	poll_if_required();
+#else
 	// Send a message
 	struct msg_hdr *msg = list_pop(msgq);
 	if (msg) {
 		send_message(msg);
-		free(msg);
+		memstat_memb_free(MEMSTAT_SYSLOG, &msgs, msg);
 		poll_if_required();
 	}
+#endif
 }
 
 PROCESS_THREAD(syslog_process, ev, data) {
@@ -352,6 +1001,7 @@ PROCESS_THREAD(syslog_process, ev, data) {
 
 	// Set things up
 	init();
+	etimer_set(&repeat_timer, SYSLOG_REPEAT_TIME * CLOCK_SECOND);
 
 	while (1) {
 		PROCESS_WAIT_EVENT();
@@ -359,7 +1009,13 @@ PROCESS_THREAD(syslog_process, ev, data) {
 		// Call the resolver
 		resolv_helper_appcall(&res, ev, data);
 
-		if (ev == PROCESS_EVENT_POLL) {
+		if (ev == PROCESS_EVENT_TIMER && data == &repeat_timer) {
+			// Own up to any repeats being held back
+			flush_repeats();
+			poll_if_required();
+			etimer_reset(&repeat_timer);
+		}
+		else if (ev == PROCESS_EVENT_POLL) {
 			check_connection();
 			if (conn) {
 				tcpip_poll_udp(conn);
@@ -118,5 +118,38 @@ void vsyslog(uint32_t pri, const char *fmt, va_list ap)
 void vsyslog_P(uint32_t pri, PGM_P fmt, va_list ap)
      __attribute__ ((__format__ (__printf__, 2, 0)));
 
+/* Messages thrown away since boot, for lack of room or over the rate limit. */
+extern uint32_t syslog_dropped;
+
+/*
+ * Bytes of RAM kept for a history of recent messages, so they can still be
+ * read from the shell after they have gone out to the network (0 for none).
+ * Messages are kept as they are queued, deferred ones still as arguments,
+ * and are only formatted when read.
+ */
+#ifndef CONFIG_APPS_SYSLOG_HISTORY
+#define SYSLOG_HISTORY 0
+#else
+#define SYSLOG_HISTORY CONFIG_APPS_SYSLOG_HISTORY
+#endif
+
+#if SYSLOG_HISTORY
+typedef struct {
+	uint16_t next; /* sequence number of the next message to look at */
+	uint16_t end; /* sequence number of the message after the newest */
+	uint8_t maxpri; /* least urgent priority shown */
+} syslog_history_reader_t;
+
+/* Start reading at the oldest message at maxpri or more urgent, or at the
+ * last'th newest of them if last isn't 0. */
+void syslog_history_reader_init(syslog_history_reader_t *r, uint8_t maxpri,
+	uint16_t last);
+
+/* Format the next message, oldest first, as "time <pri> process: text" into
+ * buf. Returns the length, or -1 once the messages there were when the reader
+ * was set up have all been read. */
+int syslog_history_read(syslog_history_reader_t *r, char *buf, uint16_t size);
+#endif
+
 #endif /* sys/syslog.h */
 
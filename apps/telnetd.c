@@ -36,6 +36,7 @@
 #include <stdio.h>
 #include <contiki-net.h>
 #include "apps/shell/shell.h"
+#include "telnetd.h"
 
 #define ISO_nl       0x0a
 #define ISO_cr       0x0d
@@ -47,7 +48,44 @@ INIT_PROCESS(telnetd_process);
 #define TELNETD_CONF_LINELEN 80
 #endif
 
+#ifndef CONFIG_APPS_TELNETD_SESSIONS
+#define TELNETD_SESSIONS 2
+#else
+#define TELNETD_SESSIONS CONFIG_APPS_TELNETD_SESSIONS
+#endif
+
+// Output buffer per session
+#ifndef CONFIG_APPS_TELNETD_BUFSIZE
+#define TELNETD_BUFSIZE 512
+#else
+#define TELNETD_BUFSIZE CONFIG_APPS_TELNETD_BUFSIZE
+#endif
+
+// How long a part-filled segment waits for more output before it goes
+#ifndef CONFIG_APPS_TELNETD_FLUSH_MS
+#define TELNETD_FLUSH_MS 16
+#else
+#define TELNETD_FLUSH_MS CONFIG_APPS_TELNETD_FLUSH_MS
+#endif
+
+#define TELNETD_FLUSH_DELAY ((TELNETD_FLUSH_MS * CLOCK_SECOND + 999) / 1000)
+
+// Output ring buffer; data runs from start for len bytes, wrapping round
+struct telnetd_buf {
+	char bufmem[TELNETD_BUFSIZE];
+	uint16_t start;
+	uint16_t len;
+};
+
 struct telnetd_state {
+	// First, so the shell's callbacks can get back to the rest
+	struct shell_session session;
+	struct telnetd_buf out;
+	// Process to poll when output has been acked (waiting for room)
+	struct process *waiter;
+	struct uip_conn *conn;
+	// Running while a short segment is held back
+	struct etimer flush;
 	char buf[TELNETD_CONF_LINELEN + 1];
 	char bufptr;
 	uint16_t numsent;
@@ -60,8 +98,9 @@ struct telnetd_state {
 #define STATE_DONT   5
 
 #define STATE_CLOSE  6
+	uint8_t used;
 };
-static struct telnetd_state s;
+static struct telnetd_state sessions[TELNETD_SESSIONS];
 
 #define TELNET_IAC   255
 #define TELNET_WILL  251
@@ -77,54 +116,55 @@ static struct telnetd_state s;
 #define PRINTF(...)
 #endif
 
-struct telnetd_buf {
-	char bufmem[1024];
-	int ptr;
-	int size;
-};
-
-static struct telnetd_buf buf;
-
-static void telnetd_appcall(void *ts);
-static int telnet_putc(char c, FILE *stream);
-
-static FILE telnet_stream =
-    FDEV_SETUP_STREAM(telnet_putc, NULL, _FDEV_SETUP_WRITE);
-static FILE *stdout_old;
+static void telnetd_appcall(void *state);
 
 #define MIN(a, b) ((a) < (b)? (a): (b))
 
 static void buf_init(struct telnetd_buf *buf) {
-	buf->ptr = 0;
-	buf->size = sizeof(buf->bufmem);
+	buf->start = 0;
+	buf->len = 0;
 }
 
+// Returns how much of data fitted (commands wait on telnet_space() rather
+// than lose output)
 static int buf_append(struct telnetd_buf *buf, const char *data, int len) {
+	uint16_t end = (buf->start + buf->len) % sizeof(buf->bufmem);
 	int copylen;
+	int first;
+
+	PRINTF("buf_append len %d (%d) '%.*s'\n", len, buf->len, len, data);
+	copylen = MIN(len, sizeof(buf->bufmem) - buf->len);
 
-	PRINTF("buf_append len %d (%d) '%.*s'\n", len, buf->ptr, len, data);
-	copylen = MIN(len, buf->size - buf->ptr);
-	memcpy(&buf->bufmem[buf->ptr], data, copylen);
-	buf->ptr += copylen;
+	// Up to the end of the buffer, then the rest at the start
+	first = MIN(copylen, sizeof(buf->bufmem) - end);
+	memcpy(&buf->bufmem[end], data, first);
+	memcpy(buf->bufmem, &data[first], copylen - first);
+	buf->len += copylen;
 
 	return copylen;
 }
 
-static void buf_copyto(struct telnetd_buf *buf, char *to, int len) {
-	memcpy(to, &buf->bufmem[0], len);
+// The oldest data, up to len bytes of it that don't wrap
+static char *buf_span(struct telnetd_buf *buf, int *len) {
+	*len = MIN(*len, buf->len);
+	*len = MIN(*len, sizeof(buf->bufmem) - buf->start);
+	return &buf->bufmem[buf->start];
 }
-	
+
 static void buf_pop(struct telnetd_buf *buf, int len) {
 	int poplen;
 
-	PRINTF("buf_pop len %d (%d)\n", len, buf->ptr);
-	poplen = MIN(len, buf->ptr);
-	memcpy(&buf->bufmem[0], &buf->bufmem[poplen], buf->ptr - poplen);
-	buf->ptr -= poplen;
+	PRINTF("buf_pop len %d (%d)\n", len, buf->len);
+	poplen = MIN(len, buf->len);
+	buf->start = (buf->start + poplen) % sizeof(buf->bufmem);
+	buf->len -= poplen;
 }
 
-static int buf_len(struct telnetd_buf *buf) {
-	return buf->ptr;
+static void wake_waiter(struct telnetd_state *s) {
+	if (s->waiter) {
+		process_poll(s->waiter);
+		s->waiter = NULL;
+	}
 }
 
 void telnetd_quit(void) {
@@ -133,51 +173,70 @@ void telnetd_quit(void) {
 	LOADER_UNLOAD();
 }
 
-/*
-void shell_prompt(char *str) {
-	buf_append(&buf, str, (int)strlen(str));
-}
+// Like Nagle: with nothing in flight, send once a full segment is queued
+// or the flush timer runs out, whichever is first. Anything written while
+// a segment is in flight goes when it's acked.
+static void flush_check(struct telnetd_state *s) {
+	if (s->numsent) {
+		return;
+	}
 
-void shell_default_output(const char *str1, int len1, const char *str2, int len2) {
-	if(len1 > 0 && str1[len1 - 1] == '\n') {
-		--len1;
+	if (s->out.len >= s->conn->mss) {
+		etimer_stop(&s->flush);
+		tcpip_poll_tcp(s->conn);
 	}
-	if(len2 > 0 && str2[len2 - 1] == '\n') {
-		--len2;
+	else if (s->out.len && etimer_expired(&s->flush)) {
+		PROCESS_CONTEXT_BEGIN(&telnetd_process);
+		etimer_set(&s->flush, TELNETD_FLUSH_DELAY);
+		PROCESS_CONTEXT_END(&telnetd_process);
 	}
-
-	buf_append(&buf, str1, len1);
-	buf_append(&buf, str2, len2);
-	buf_append(&buf, "\r\n", 2);
 }
-*/
 
-static int telnet_putc(char c, FILE *stream) {
-	if (c == '\n') {
-		char r = '\r';
-		buf_append(&buf, &r, 1);
+// Whole lines at a time for the shell
+static void telnet_write(struct shell_session *session,
+	const char *data, uint16_t len)
+{
+	struct telnetd_state *s = (struct telnetd_state *)session;
+	const char *nl;
+
+	while (len && (nl = memchr(data, '\n', len)) != NULL) {
+		buf_append(&s->out, data, nl - data);
+		buf_append(&s->out, "\r\n", 2);
+		len -= nl - data + 1;
+		data = nl + 1;
 	}
 
-	buf_append(&buf, &c, 1);
+	buf_append(&s->out, data, len);
+	flush_check(s);
+}
+
+static uint16_t telnet_space(struct shell_session *session) {
+	struct telnetd_state *s = (struct telnetd_state *)session;
 
-	return 0;
+	s->waiter = PROCESS_CURRENT();
+	return sizeof(s->out.bufmem) - s->out.len;
 }
 
 PROCESS_THREAD(telnetd_process, ev, data) {
+	uint8_t i;
+
 	PROCESS_BEGIN();
 
 	tcp_listen(UIP_HTONS(23));
-	buf_init(&buf);
-
-	stdout_old = stdout;
-
-	//shell_init();
 
 	while(1) {
 		PROCESS_WAIT_EVENT();
 		if (ev == tcpip_event) {
 			telnetd_appcall(data);
 		}
+		else if (ev == PROCESS_EVENT_TIMER) {
+			// A held segment's time is up
+			for (i = 0; i < TELNETD_SESSIONS; i++) {
+				if (sessions[i].used && data == &sessions[i].flush) {
+					tcpip_poll_tcp(sessions[i].conn);
+				}
+			}
+		}
 		else if (ev == PROCESS_EVENT_EXIT) {
 			telnetd_quit();
 		}
@@ -186,64 +245,85 @@ PROCESS_THREAD(telnetd_process, ev, data) {
 	PROCESS_END();
 }
 
-static void acked(void) {
-	buf_pop(&buf, s.numsent);
+static void acked(struct telnetd_state *s) {
+	buf_pop(&s->out, s->numsent);
+	s->numsent = 0;
+	wake_waiter(s);
 }
 /*---------------------------------------------------------------------------*/
 	static void
-senddata(void)
+senddata(struct telnetd_state *s)
 {
 	int len;
-	len = MIN(buf_len(&buf), uip_mss());
+
+	// A retransmit has to send the same again
+	if (!uip_rexmit() && s->numsent) {
+		return;
+	}
+
+	// Hold back a short segment until the flush timer is done with it
+	if (!uip_rexmit() && s->out.len < uip_mss() &&
+			!etimer_expired(&s->flush)) {
+		return;
+	}
+
+	len = uip_rexmit() ? s->numsent : uip_mss();
+	char *data = buf_span(&s->out, &len);
 	PRINTF("senddata len %d\n", len);
-	buf_copyto(&buf, uip_appdata, len);
-	uip_send(uip_appdata, len);
-	s.numsent = len;
+
+	// uIP copies straight out of the ring, no need to go through appdata
+	uip_send(data, len);
+	s->numsent = len;
 }
 /*---------------------------------------------------------------------------*/
 	static void
-closed(void)
+closed(struct telnetd_state *s)
 {
-	stdout = stdout_old;
+	// Stops its commands, and anything waiting for room finds the session
+	// gone when it wakes
+	shell_session_end(&s->session);
+	etimer_stop(&s->flush);
+	wake_waiter(s);
+	s->used = 0;
 }
 /*---------------------------------------------------------------------------*/
 	static void
-get_char(u8_t c)
+get_char(struct telnetd_state *s, u8_t c)
 {
-	PRINTF("telnetd: get_char '%c' %d %d\n", c, c, s.bufptr);
+	PRINTF("telnetd: get_char '%c' %d %d\n", c, c, s->bufptr);
 
 	if(c == 0) {
 		return;
 	}
 
 	if(c != ISO_nl && c != ISO_cr) {
-		s.buf[(int)s.bufptr] = c;
-		++s.bufptr;
+		s->buf[(int)s->bufptr] = c;
+		++s->bufptr;
 	}
 	if((c == ISO_nl || c == ISO_cr) ||
-			s.bufptr == sizeof(s.buf)) {
-		if(s.bufptr < sizeof(s.buf)) {
-			s.buf[(int)s.bufptr] = 0;
+			s->bufptr == sizeof(s->buf)) {
+		if(s->bufptr < sizeof(s->buf)) {
+			s->buf[(int)s->bufptr] = 0;
 		}
-		PRINTF("telnetd: get_char '%.*s'\n", s.bufptr, s.buf);
-		shell_input(s.buf, s.bufptr);
-		s.bufptr = 0;
+		PRINTF("telnetd: get_char '%.*s'\n", s->bufptr, s->buf);
+		shell_session_input(&s->session, s->buf, s->bufptr);
+		s->bufptr = 0;
 	}
 }
 /*---------------------------------------------------------------------------*/
 	static void
-sendopt(u8_t option, u8_t value)
+sendopt(struct telnetd_state *s, u8_t option, u8_t value)
 {
 	char line[4];
 	line[0] = (char)TELNET_IAC;
 	line[1] = option;
 	line[2] = value;
 	line[3] = 0;
-	buf_append(&buf, line, 4);
+	buf_append(&s->out, line, 4);
 }
 /*---------------------------------------------------------------------------*/
 	static void
-newdata(void)
+newdata(struct telnetd_state *s)
 {
 	u16_t len;
 	u8_t c;
@@ -253,102 +333,122 @@ newdata(void)
 	PRINTF("newdata len %d '%.*s'\n", len, len, (char *)uip_appdata);
 
 	ptr = uip_appdata;
-	while(len > 0 && s.bufptr < sizeof(s.buf)) {
+	while(len > 0 && s->bufptr < sizeof(s->buf)) {
 		c = *ptr;
-		PRINTF("newdata char '%c' %d %d state %d\n", c, c, len, s.state);
+		PRINTF("newdata char '%c' %d %d state %d\n", c, c, len, s->state);
 		++ptr;
 		--len;
-		switch(s.state) {
+		switch(s->state) {
 			case STATE_IAC:
 				if(c == TELNET_IAC) {
-					get_char(c);
-					s.state = STATE_NORMAL;
+					get_char(s, c);
+					s->state = STATE_NORMAL;
 				} else {
 					switch(c) {
 						case TELNET_WILL:
-							s.state = STATE_WILL;
+							s->state = STATE_WILL;
 							break;
 						case TELNET_WONT:
-							s.state = STATE_WONT;
+							s->state = STATE_WONT;
 							break;
 						case TELNET_DO:
-							s.state = STATE_DO;
+							s->state = STATE_DO;
 							break;
 						case TELNET_DONT:
-							s.state = STATE_DONT;
+							s->state = STATE_DONT;
 							break;
 						default:
-							s.state = STATE_NORMAL;
+							s->state = STATE_NORMAL;
 							break;
 					}
 				}
 				break;
 			case STATE_WILL:
 				/* Reply with a DONT */
-				sendopt(TELNET_DONT, c);
-				s.state = STATE_NORMAL;
+				sendopt(s, TELNET_DONT, c);
+				s->state = STATE_NORMAL;
 				break;
 
 			case STATE_WONT:
 				/* Reply with a DONT */
-				sendopt(TELNET_DONT, c);
-				s.state = STATE_NORMAL;
+				sendopt(s, TELNET_DONT, c);
+				s->state = STATE_NORMAL;
 				break;
 			case STATE_DO:
 				/* Reply with a WONT */
-				sendopt(TELNET_WONT, c);
-				s.state = STATE_NORMAL;
+				sendopt(s, TELNET_WONT, c);
+				s->state = STATE_NORMAL;
 				break;
 			case STATE_DONT:
 				/* Reply with a WONT */
-				sendopt(TELNET_WONT, c);
-				s.state = STATE_NORMAL;
+				sendopt(s, TELNET_WONT, c);
+				s->state = STATE_NORMAL;
 				break;
 			case STATE_NORMAL:
 				if(c == TELNET_IAC) {
-					s.state = STATE_IAC;
+					s->state = STATE_IAC;
 				} else {
-					get_char(c);
+					get_char(s, c);
 				}
 				break;
 		}
 	}
 }
 
-void telnetd_appcall(void *ts) {
+void telnetd_appcall(void *state) {
+	struct telnetd_state *s = state;
+	uint8_t i;
+
 	if(uip_connected()) {
-		tcp_markconn(uip_conn, &s);
-		buf_init(&buf);
-		s.bufptr = 0;
-		s.state = STATE_NORMAL;
-
-		stdout = &telnet_stream;
-		shell_input("", 0);
-		//shell_start();
+		for(i = 0; i < TELNETD_SESSIONS && sessions[i].used; i++);
+		if(i == TELNETD_SESSIONS) {
+			// All in use; better to refuse than keep them hanging
+			uip_abort();
+			return;
+		}
+
+		s = &sessions[i];
+		tcp_markconn(uip_conn, s);
+		s->conn = uip_conn;
+		s->used = 1;
+		buf_init(&s->out);
+		s->waiter = NULL;
+		s->numsent = 0;
+		s->bufptr = 0;
+		s->state = STATE_NORMAL;
+
+		s->session.write = telnet_write;
+		s->session.space = telnet_space;
+		shell_session_start(&s->session);
+	}
+
+	if(s == NULL) {
+		return;
 	}
 
-	if(s.state == STATE_CLOSE) {
-		s.state = STATE_NORMAL;
+	if(s->state == STATE_CLOSE) {
+		s->state = STATE_NORMAL;
 		uip_close();
 		return;
 	}
 	if(uip_closed() ||
 			uip_aborted() ||
 			uip_timedout()) {
-		closed();
+		closed(s);
+		return;
 	}
 	if(uip_acked()) {
-		acked();
+		acked(s);
 	}
 	if(uip_newdata()) {
-		newdata();
+		newdata(s);
 	}
 	if(uip_rexmit() ||
 			uip_newdata() ||
 			uip_acked() ||
 			uip_connected() ||
 			uip_poll()) {
-		senddata();
+		senddata(s);
 	}
 }
 /*---------------------------------------------------------------------------*/
@@ -37,6 +37,11 @@
 #include "drivers/wallclock.h"
 
 #include "apps/network.h"
+#if CONFIG_LIB_NVRAM
+#include "lib/nvram.h"
+#elif CONFIG_LIB_SETTINGS
+#include "lib/settings.h"
+#endif
 #if CONFIG_APPS_SYSLOG
 #include "apps/syslog.h"
 #endif
@@ -48,10 +53,132 @@ INIT_PROCESS(timesync_process);
 
 timesync_status_t timesync_status;
 process_event_t timesync_event;
+struct notify timesync_notify;
 
 static struct resolv_helper_status res;
 static struct etimer tmr_periodic;
 static struct stimer tmr_resync;
+static struct notify_sub net_sub;
+
+// clock_seconds() at the last good sync, for the drift estimate
+static uint32_t last_sync;
+static uint8_t have_last_sync;
+
+static int32_t diff_ms(const wallclock_time_t *a, const wallclock_time_t *b) {
+	int32_t diffms;
+
+	diffms = ((int32_t)a->sec - (int32_t)b->sec) * 1000;
+	diffms += (((int32_t)a->frac - (int32_t)b->frac) * 1000) >> 12;
+
+	return diffms;
+}
+
+static void load_trim(void) {
+#if CONFIG_LIB_SETTINGS && !CONFIG_LIB_NVRAM
+	int16_t trim;
+	size_t size = sizeof(trim);
+#endif
+
+	timesync_status.interval = SNTP_MIN_INTERVAL;
+	timesync_status.trim = 0;
+
+#if CONFIG_LIB_NVRAM
+	// The RTC kept time with this drift; start with a longer interval
+	if (nvram.timesync_have_trim) {
+		timesync_status.trim = nvram.timesync_trim;
+		timesync_status.interval = SNTP_HOLDOVER_INTERVAL;
+	}
+#elif CONFIG_LIB_SETTINGS
+	if (settings_get(SETTINGS_KEY_TIMESYNC_TRIM, 0, &trim, &size) ==
+		SETTINGS_STATUS_OK && size == sizeof(trim))
+	{
+		// The RTC kept time with this drift; start with a longer interval
+		timesync_status.trim = trim;
+		timesync_status.interval = SNTP_HOLDOVER_INTERVAL;
+	}
+#endif
+
+	wallclock_trim(timesync_status.trim);
+}
+
+static void save_trim(void) {
+#if CONFIG_LIB_NVRAM
+	if (!nvram.timesync_have_trim ||
+		nvram.timesync_trim != timesync_status.trim)
+	{
+		nvram.timesync_trim = timesync_status.trim;
+		nvram.timesync_have_trim = 1;
+		nvram_commit();
+	}
+#elif CONFIG_LIB_SETTINGS
+	int16_t trim;
+	size_t size = sizeof(trim);
+
+	if (settings_get(SETTINGS_KEY_TIMESYNC_TRIM, 0, &trim, &size) !=
+		SETTINGS_STATUS_OK || size != sizeof(trim) ||
+		trim != timesync_status.trim)
+	{
+		settings_set_hot(SETTINGS_KEY_TIMESYNC_TRIM,
+			&timesync_status.trim, sizeof(timesync_status.trim));
+	}
+#endif
+}
+
+/*
+ * Update the drift estimate from the offset just measured and pick the next
+ * poll interval. Since every sync steps the clock back into phase, the offset
+ * seen at the next sync is down to the remaining frequency error alone.
+ */
+static void update_drift(int32_t offset) {
+	uint32_t now = clock_seconds();
+	uint32_t elapsed = now - last_sync;
+	int32_t error;
+	int32_t trim;
+
+	if (labs(offset) >= SNTP_STEP_MS) {
+		// Clock was stepped (or this is the first sync after boot)
+		if (have_last_sync) {
+			timesync_status.interval = SNTP_MIN_INTERVAL;
+		}
+	}
+	else if (have_last_sync && elapsed >= SNTP_MIN_INTERVAL / 2) {
+		// Frequency error in 2^-24 units; half of it to ride out jitter
+		error = offset * 16777L / (int32_t)elapsed;
+		trim = timesync_status.trim + error / 2;
+
+		if (trim > INT16_MAX) {
+			trim = INT16_MAX;
+		}
+		else if (trim < -INT16_MAX) {
+			trim = -INT16_MAX;
+		}
+
+		timesync_status.trim = trim;
+		wallclock_trim(timesync_status.trim);
+
+		if (labs(offset) <= SNTP_STABLE_MS) {
+			if (timesync_status.interval < SNTP_MAX_INTERVAL) {
+				timesync_status.interval <<= 1;
+			}
+
+			save_trim();
+		}
+		else if (labs(offset) > 2 * SNTP_STABLE_MS &&
+			timesync_status.interval > SNTP_MIN_INTERVAL)
+		{
+			timesync_status.interval >>= 1;
+		}
+
+		syslog_P(LOG_DAEMON | LOG_DEBUG,
+			PSTR("Drift trim %d, next sync in %lus"),
+			timesync_status.trim, timesync_status.interval);
+	}
+
+	last_sync = now;
+	have_last_sync = 1;
+
+	stimer_set(&tmr_resync, timesync_status.interval);
+}
 
 static int init(void) {
 #if CONFIG_DRIVERS_DS1307
@@ -62,6 +189,7 @@ static int init(void) {
 #endif
 
 	timesync_event = process_alloc_event();
+	notify_subscribe(&net_notify, &net_sub);
 	timesync_status.running = 0;
 	timesync_status.synchronised = 0;
 
@@ -74,6 +202,9 @@ static int init(void) {
 	// Start the wallclock timer
 	wallclock_init();
 
+	// Apply the drift measured before the last reboot
+	load_trim();
+
 #if CONFIG_DRIVERS_DS1307
 	// Get the time from the RTC
 	err = ds1307_clock_get(&tm);
@@ -131,8 +262,11 @@ PROCESS_THREAD(timesync_process, ev, data) {
 	while (1) {
 		PROCESS_WAIT_EVENT();
 
-		// Call the resolver
-		resolv_helper_appcall(&res, ev, data);
+		// Call the resolver, which has nothing to do with the SNTP
+		// connection's traffic
+		if (ev != tcpip_event) {
+			resolv_helper_appcall(&res, ev, data);
+		}
 
 		if (ev == PROCESS_EVENT_POLL) {
 			sntp_lookup_sync();
@@ -149,9 +283,9 @@ PROCESS_THREAD(timesync_process, ev, data) {
 				timesync_status.synchronised = 0;
 
 				etimer_set(&tmr_periodic, CLOCK_SECOND);
-				stimer_set(&tmr_resync, SNTP_RESYNC_INTERVAL);
+				stimer_set(&tmr_resync, timesync_status.interval);
 
-				process_post(PROCESS_BROADCAST, timesync_event,
+				notify_post(&timesync_notify, timesync_event,
 					&timesync_status);
 				syslog_P(LOG_DAEMON | LOG_INFO, PSTR("Starting"));
 
@@ -164,7 +298,7 @@ PROCESS_THREAD(timesync_process, ev, data) {
 
 				etimer_stop(&tmr_periodic);
 
-				process_post(PROCESS_BROADCAST, timesync_event,
+				notify_post(&timesync_notify, timesync_event,
 					&timesync_status);
 				syslog_P(LOG_DAEMON | LOG_INFO, PSTR("Stopped"));
 			}
@@ -225,11 +359,10 @@ int timesync_set_time(const wallclock_time_t *time) {
 	wallclock_set(time);
 
 	// Work out the time difference
-	diffms = ((int32_t)time->sec - (int32_t)oldtime.sec) * 1000;
-	diffms += (((int32_t)time->frac - (int32_t)oldtime.frac) * 1000) >> 12;
+	diffms = diff_ms(time, &oldtime);
 
 	// Tell folks about the change
-	process_post(PROCESS_BROADCAST, timesync_event, &timesync_status);
+	notify_post(&timesync_notify, timesync_event, &timesync_status);
 	syslog_P(LOG_DAEMON | LOG_INFO, PSTR("Clock adjusted by %ldms"),
 		diffms);
 
@@ -266,8 +399,11 @@ int timesync_set_time(const wallclock_time_t *time) {
 void sntp_synced(const struct sntp_hdr *message) {
 	if (!message) {
 		timesync_status.synchronised = 0;
-		process_post(PROCESS_BROADCAST, timesync_event, &timesync_status);
+		notify_post(&timesync_notify, timesync_event, &timesync_status);
 		syslog_P(LOG_DAEMON | LOG_WARNING, PSTR("SNTP timed out"));
+
+		// Try again soon, without giving up the current interval
+		stimer_set(&tmr_resync, SNTP_MIN_INTERVAL);
 		return;
 	}
 
@@ -277,7 +413,7 @@ void sntp_synced(const struct sntp_hdr *message) {
 		uip_ntohl(message->TxTimestamp[0]) == 0)
 	{
 		timesync_status.synchronised = 0;
-		process_post(PROCESS_BROADCAST, timesync_event, &timesync_status);
+		notify_post(&timesync_notify, timesync_event, &timesync_status);
 		syslog_P(LOG_DAEMON | LOG_WARNING, PSTR("Invalid SNTP message"));
 		return;
 	}
@@ -288,9 +424,15 @@ void sntp_synced(const struct sntp_hdr *message) {
 		.frac = uip_ntohl(message->TxTimestamp[1]) >> 20, // 32 to 12 bit fixed
 	};
 
+	wallclock_time_t cur;
+
 	// Set our status flags
 	timesync_status.synchronised = 1;
 
+	// Learn from the offset before it's corrected
+	wallclock_get(&cur);
+	update_drift(diff_ms(&new, &cur));
+
 	// Update the clock
 	timesync_set_time(&new);
 }
@@ -22,18 +22,43 @@
 #define __TIMESYNC_H__
 
 #include "drivers/wallclock.h"
+#include <notify.h>
 
-// How often to refresh the local time offset (in seconds)
-#define SNTP_RESYNC_INTERVAL	1024 // same as ntpd once in sync
+// How often to refresh the local time offset (in seconds). The interval starts
+// at the minimum and doubles each time the clock is found within
+// SNTP_STABLE_MS, up to the maximum.
+#ifndef CONFIG_APPS_TIMESYNC_MIN_INTERVAL
+#define SNTP_MIN_INTERVAL	64 // same as ntpd minpoll
+#else
+#define SNTP_MIN_INTERVAL	CONFIG_APPS_TIMESYNC_MIN_INTERVAL
+#endif
+
+#ifndef CONFIG_APPS_TIMESYNC_MAX_INTERVAL
+#define SNTP_MAX_INTERVAL	131072 // same as ntpd maxpoll
+#else
+#define SNTP_MAX_INTERVAL	CONFIG_APPS_TIMESYNC_MAX_INTERVAL
+#endif
+
+// Where to start when a drift estimate was saved before the last reboot
+#define SNTP_HOLDOVER_INTERVAL	1024
+
+// Offset below which the interval is lengthened, and above which it's cut
+#define SNTP_STABLE_MS		100
+
+// Offsets beyond this are treated as a step and say nothing about drift
+#define SNTP_STEP_MS		1000
 
 typedef struct {
 	int running : 1;
 	int sync_pending : 1;
 	int synchronised : 1;
+	uint32_t interval; // current poll interval in seconds
+	int16_t trim; // wallclock drift compensation, 2^-24 units
 } timesync_status_t;
 
 extern timesync_status_t timesync_status;
 extern process_event_t timesync_event;
+extern struct notify timesync_notify;
 
 void timesync_schedule_resync(void);
 int timesync_set_time(const wallclock_time_t *time);
@@ -1,4 +1,7 @@
 #include <avr/pgmspace.h>
+#include <polyfs/polyfs_fs.h>
+
+#include "http-strings.h"
 
 const char PROGMEM http_http[8] = 
 /* "http://" */
@@ -49,42 +52,42 @@ const char PROGMEM http_404_html[10] =
 const char PROGMEM http_referer[9] = 
 /* "Referer:" */
 {0x52, 0x65, 0x66, 0x65, 0x72, 0x65, 0x72, 0x3a, };
-const char PROGMEM http_header_200[86] = 
-/* "HTTP/1.0 200 OK\r\nServer: Contiki/2.4 http://www.sics.se/contiki/\r\nConnection: close\r\n" */
-{0x48, 0x54, 0x54, 0x50, 0x2f, 0x31, 0x2e, 0x30, 0x20, 0x32, 0x30, 0x30, 0x20, 0x4f, 0x4b, 0xd, 0xa, 0x53, 0x65, 0x72, 0x76, 0x65, 0x72, 0x3a, 0x20, 0x43, 0x6f, 0x6e, 0x74, 0x69, 0x6b, 0x69, 0x2f, 0x32, 0x2e, 0x34, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x77, 0x77, 0x77, 0x2e, 0x73, 0x69, 0x63, 0x73, 0x2e, 0x73, 0x65, 0x2f, 0x63, 0x6f, 0x6e, 0x74, 0x69, 0x6b, 0x69, 0x2f, 0xd, 0xa, 0x43, 0x6f, 0x6e, 0x6e, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x63, 0x6c, 0x6f, 0x73, 0x65, 0xd, 0xa, };
+const char PROGMEM http_header_200[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n";
 const char PROGMEM http_header_400[] =
 	"HTTP/1.0 400 Bad Request\r\n"
 	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n"
 	"Connection: close\r\n"
 	"\r\n"
 	"400 - Bad Request\r\n";
-const char PROGMEM http_header_404[93] = 
-/* "HTTP/1.0 404 Not found\r\nServer: Contiki/2.4 http://www.sics.se/contiki/\r\nConnection: close\r\n" */
-{0x48, 0x54, 0x54, 0x50, 0x2f, 0x31, 0x2e, 0x30, 0x20, 0x34, 0x30, 0x34, 0x20, 0x4e, 0x6f, 0x74, 0x20, 0x66, 0x6f, 0x75, 0x6e, 0x64, 0xd, 0xa, 0x53, 0x65, 0x72, 0x76, 0x65, 0x72, 0x3a, 0x20, 0x43, 0x6f, 0x6e, 0x74, 0x69, 0x6b, 0x69, 0x2f, 0x32, 0x2e, 0x34, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x77, 0x77, 0x77, 0x2e, 0x73, 0x69, 0x63, 0x73, 0x2e, 0x73, 0x65, 0x2f, 0x63, 0x6f, 0x6e, 0x74, 0x69, 0x6b, 0x69, 0x2f, 0xd, 0xa, 0x43, 0x6f, 0x6e, 0x6e, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x63, 0x6c, 0x6f, 0x73, 0x65, 0xd, 0xa, };
-const char PROGMEM http_content_type_plain[29] = 
-/* "Content-type: text/plain\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x74, 0x65, 0x78, 0x74, 0x2f, 0x70, 0x6c, 0x61, 0x69, 0x6e, 0xd, 0xa, 0xd, 0xa, };
-const char PROGMEM http_content_type_html[28] = 
-/* "Content-type: text/html\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x74, 0x65, 0x78, 0x74, 0x2f, 0x68, 0x74, 0x6d, 0x6c, 0xd, 0xa, 0xd, 0xa, };
-const char PROGMEM http_content_type_css [27] = 
-/* "Content-type: text/css\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x74, 0x65, 0x78, 0x74, 0x2f, 0x63, 0x73, 0x73, 0xd, 0xa, 0xd, 0xa, };
+const char PROGMEM http_header_404[] =
+	"HTTP/1.1 404 Not found\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n";
+const char PROGMEM http_content_type_plain[] =
+	"Content-type: text/plain\r\n"
+	"Cache-Control: no-cache\r\n\r\n";
+const char PROGMEM http_content_type_html[] =
+	"Content-type: text/html\r\n"
+	"Cache-Control: no-cache\r\n\r\n";
+const char PROGMEM http_content_type_css[] =
+	"Content-type: text/css\r\n"
+	"Cache-Control: max-age=3600\r\n\r\n";
 const char PROGMEM http_content_type_text[28] = 
 /* "Content-type: text/text\r\n\r\n" */
 {0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x74, 0x65, 0x78, 0x74, 0x2f, 0x74, 0x65, 0x78, 0x74, 0xd, 0xa, 0xd, 0xa, };
-const char PROGMEM http_content_type_png [28] = 
-/* "Content-type: image/png\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x2f, 0x70, 0x6e, 0x67, 0xd, 0xa, 0xd, 0xa, };
-const char PROGMEM http_content_type_gif [28] = 
-/* "Content-type: image/gif\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x2f, 0x67, 0x69, 0x66, 0xd, 0xa, 0xd, 0xa, };
-const char PROGMEM http_content_type_jpg [29] = 
-/* "Content-type: image/jpeg\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x2f, 0x6a, 0x70, 0x65, 0x67, 0xd, 0xa, 0xd, 0xa, };
-const char PROGMEM http_content_type_binary[43] = 
-/* "Content-type: application/octet-stream\r\n\r\n" */
-{0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x74, 0x79, 0x70, 0x65, 0x3a, 0x20, 0x61, 0x70, 0x70, 0x6c, 0x69, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2f, 0x6f, 0x63, 0x74, 0x65, 0x74, 0x2d, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0xd, 0xa, 0xd, 0xa, };
+const char PROGMEM http_content_type_png[] =
+	"Content-type: image/png\r\n"
+	"Cache-Control: max-age=3600\r\n\r\n";
+const char PROGMEM http_content_type_gif[] =
+	"Content-type: image/gif\r\n"
+	"Cache-Control: max-age=3600\r\n\r\n";
+const char PROGMEM http_content_type_jpg[] =
+	"Content-type: image/jpeg\r\n"
+	"Cache-Control: max-age=3600\r\n\r\n";
+const char PROGMEM http_content_type_binary[] =
+	"Content-type: application/octet-stream\r\n"
+	"Cache-Control: no-cache\r\n\r\n";
 const char PROGMEM http_html[6] = 
 /* ".html" */
 {0x2e, 0x68, 0x74, 0x6d, 0x6c, };
@@ -112,3 +115,83 @@ const char PROGMEM http_text[6] =
 const char PROGMEM http_txt[5] = 
 /* ".txt" */
 {0x2e, 0x74, 0x78, 0x74, };
+const char PROGMEM http_gz[] = ".gz";
+const char PROGMEM http_accept_encoding[] = "Accept-Encoding:";
+const char PROGMEM http_gzip[] = "gzip";
+const char PROGMEM http_content_encoding_gzip[] =
+	"Content-Encoding: gzip\r\n"
+	"Vary: Accept-Encoding\r\n";
+const char PROGMEM http_header_304[] =
+	"HTTP/1.1 304 Not Modified\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n";
+const char PROGMEM http_if_none_match[] = "If-None-Match:";
+const char PROGMEM http_etag_fmt[] = "ETag: \"%08lx-%lx\"\r\n";
+const char PROGMEM http_content_length_fmt[] = "Content-Length: %lu\r\n";
+const char PROGMEM http_connection[] = "Connection:";
+const char PROGMEM http_close[] = "close";
+const char PROGMEM http_keep_alive[] = "keep-alive";
+const char PROGMEM http_connection_close[] = "Connection: close\r\n";
+const char PROGMEM http_connection_keep_alive[] = "Connection: keep-alive\r\n";
+const char PROGMEM http_content_type_json[] =
+	"Content-type: application/json\r\n\r\n";
+const char PROGMEM http_header_503[] =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"503 - Service Unavailable\r\n";
+const char PROGMEM http_content_type_event_stream[] =
+	"Content-type: text/event-stream\r\n"
+	"Cache-Control: no-cache\r\n\r\n";
+const char PROGMEM http_api_events[] = "/www/api/events";
+const char PROGMEM http_api_history[] = "/www/api/history";
+const char PROGMEM http_history_txt[] = "/history.txt";
+const char PROGMEM http_api_trace[] = "/www/api/trace";
+const char PROGMEM http_api_owfs[] = "/www/api/owfs";
+const char PROGMEM http_metrics[] = "/www/metrics";
+const char PROGMEM http_content_type_metrics[] =
+	"Content-type: text/plain; version=0.0.4\r\n"
+	"Cache-Control: no-cache\r\n\r\n";
+const char PROGMEM http_sec_websocket_key[] = "Sec-WebSocket-Key:";
+const char PROGMEM http_header_206[] =
+	"HTTP/1.1 206 Partial Content\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n";
+const char PROGMEM http_header_416[] =
+	"HTTP/1.1 416 Range Not Satisfiable\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n";
+const char PROGMEM http_range[] = "Range:";
+const char PROGMEM http_bytes_eq[] = "bytes=";
+const char PROGMEM http_accept_ranges[] = "Accept-Ranges: bytes\r\n";
+const char PROGMEM http_content_range_fmt[] =
+	"Content-Range: bytes %lu-%lu/%lu\r\n";
+const char PROGMEM http_content_range_none_fmt[] =
+	"Content-Range: bytes */%lu\r\n";
+const char PROGMEM http_header_500[] =
+	"HTTP/1.0 500 Internal Server Error\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"500 - Internal Server Error\r\n";
+const char PROGMEM http_content_length[] = "Content-Length:";
+const char PROGMEM http_update[] = "/www/update";
+const char PROGMEM http_update_done[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Server: Contiki/2.4 http://www.sics.se/contiki/\r\n"
+	"Connection: close\r\n"
+	"Content-type: text/plain\r\n"
+	"\r\n"
+	"New firmware image is in flash. Please reboot to apply the upgrade.\r\n";
+
+#define TYPE_HEADER(str) { str, sizeof(str) - 1 }
+
+// The headers that end a file response, by PolyFS content type
+const struct http_type_header PROGMEM http_type_headers[POLYFS_MIME_COUNT] = {
+	[POLYFS_MIME_NONE] = TYPE_HEADER(http_content_type_plain),
+	[POLYFS_MIME_HTML] = TYPE_HEADER(http_content_type_html),
+	[POLYFS_MIME_CSS] = TYPE_HEADER(http_content_type_css),
+	[POLYFS_MIME_PNG] = TYPE_HEADER(http_content_type_png),
+	[POLYFS_MIME_GIF] = TYPE_HEADER(http_content_type_gif),
+	[POLYFS_MIME_JPEG] = TYPE_HEADER(http_content_type_jpg),
+	[POLYFS_MIME_PLAIN] = TYPE_HEADER(http_content_type_plain),
+	[POLYFS_MIME_BINARY] = TYPE_HEADER(http_content_type_binary),
+};
@@ -15,17 +15,17 @@ extern const char PROGMEM http_index_htm[11];
 extern const char PROGMEM http_index_html[12];
 extern const char PROGMEM http_404_html[10];
 extern const char PROGMEM http_referer[9];
-extern const char PROGMEM http_header_200[86];
+extern const char PROGMEM http_header_200[];
 extern const char PROGMEM http_header_400[];
-extern const char PROGMEM http_header_404[93];
-extern const char PROGMEM http_content_type_plain[29];
-extern const char PROGMEM http_content_type_html[28];
-extern const char PROGMEM http_content_type_css [27];
+extern const char PROGMEM http_header_404[];
+extern const char PROGMEM http_content_type_plain[];
+extern const char PROGMEM http_content_type_html[];
+extern const char PROGMEM http_content_type_css[];
 extern const char PROGMEM http_content_type_text[28];
-extern const char PROGMEM http_content_type_png [28];
-extern const char PROGMEM http_content_type_gif [28];
-extern const char PROGMEM http_content_type_jpg [29];
-extern const char PROGMEM http_content_type_binary[43];
+extern const char PROGMEM http_content_type_png[];
+extern const char PROGMEM http_content_type_gif[];
+extern const char PROGMEM http_content_type_jpg[];
+extern const char PROGMEM http_content_type_binary[];
 extern const char PROGMEM http_html[6];
 extern const char PROGMEM http_shtml[7];
 extern const char PROGMEM http_htm[5];
@@ -35,3 +35,45 @@ extern const char PROGMEM http_gif[5];
 extern const char PROGMEM http_jpg[5];
 extern const char PROGMEM http_text[6];
 extern const char PROGMEM http_txt[5];
+extern const char PROGMEM http_gz[4];
+extern const char PROGMEM http_accept_encoding[17];
+extern const char PROGMEM http_gzip[];
+extern const char PROGMEM http_content_encoding_gzip[];
+extern const char PROGMEM http_header_304[];
+extern const char PROGMEM http_if_none_match[15];
+extern const char PROGMEM http_etag_fmt[];
+extern const char PROGMEM http_content_length_fmt[];
+extern const char PROGMEM http_connection[12];
+extern const char PROGMEM http_close[];
+extern const char PROGMEM http_keep_alive[];
+extern const char PROGMEM http_connection_close[];
+extern const char PROGMEM http_connection_keep_alive[];
+extern const char PROGMEM http_content_type_json[];
+extern const char PROGMEM http_header_503[];
+extern const char PROGMEM http_content_type_event_stream[];
+extern const char PROGMEM http_api_events[];
+extern const char PROGMEM http_api_history[];
+extern const char PROGMEM http_history_txt[];
+extern const char PROGMEM http_api_trace[];
+extern const char PROGMEM http_api_owfs[];
+extern const char PROGMEM http_metrics[];
+extern const char PROGMEM http_content_type_metrics[];
+extern const char PROGMEM http_sec_websocket_key[19];
+extern const char PROGMEM http_header_206[];
+extern const char PROGMEM http_header_416[];
+extern const char PROGMEM http_range[7];
+extern const char PROGMEM http_bytes_eq[7];
+extern const char PROGMEM http_accept_ranges[];
+extern const char PROGMEM http_content_range_fmt[];
+extern const char PROGMEM http_content_range_none_fmt[];
+extern const char PROGMEM http_header_500[];
+extern const char PROGMEM http_content_length[16];
+extern const char PROGMEM http_update[];
+extern const char PROGMEM http_update_done[];
+
+struct http_type_header {
+	const char *str;
+	unsigned char len;
+};
+
+extern const struct http_type_header PROGMEM http_type_headers[];
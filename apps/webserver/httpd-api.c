@@ -0,0 +1,405 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <contiki-net.h>
+
+#include "apps/network.h"
+#if CONFIG_APPS_TIMESYNC
+#include "apps/timesync.h"
+#endif
+#if CONFIG_LIB_OWTEMP
+#include <owtemp.h>
+#endif
+#if CONFIG_LIB_SENSORLOG
+#include <sensorlog.h>
+#endif
+#if CONFIG_LIB_FLASHLOG
+#include <flashlog.h>
+#endif
+#if CONFIG_LIB_PROCSTAT
+#include <procstat.h>
+#endif
+#if CONFIG_LIB_INIT_PROFILE
+#include <init.h>
+#endif
+
+#include "httpd.h"
+#include "httpd-api.h"
+
+struct httpd_api_call {
+	PGM_P name;
+	httpd_api_fn fn;
+};
+
+static const char api_prefix[] PROGMEM = "/www/api/";
+
+int httpd_api_uptime(struct httpd_state *s, char *buf, int len) {
+	return snprintf_P(buf, len, PSTR("{\"uptime\":%lu}"),
+		(unsigned long)s->time);
+}
+
+int httpd_api_network(struct httpd_state *s, char *buf, int len) {
+	struct uip_eth_addr mac;
+	network_get_macaddr(&mac);
+
+	int ret = snprintf_P(buf, len,
+		PSTR("{\"link\":%S,\"speed\":%d,\"duplex\":\"%S\","
+			"\"configured\":%S,"
+			"\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\""),
+		net_status.link ? PSTR("true") : PSTR("false"),
+		net_status.speed_100m ? 100 : 10,
+		net_status.full_duplex ? PSTR("full") : PSTR("half"),
+		net_status.configured ? PSTR("true") : PSTR("false"),
+		mac.addr[0], mac.addr[1], mac.addr[2],
+		mac.addr[3], mac.addr[4], mac.addr[5]);
+	if (ret >= len) {
+		return ret;
+	}
+
+#if !CONFIG_LIB_CONTIKI_IPV6
+	ret += snprintf_P(&buf[ret], len - ret,
+		PSTR(",\"ip\":\"%d.%d.%d.%d\""),
+		uip_hostaddr.u8[0], uip_hostaddr.u8[1],
+		uip_hostaddr.u8[2], uip_hostaddr.u8[3]);
+	if (ret >= len) {
+		return ret;
+	}
+#endif
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("}"));
+	return ret;
+}
+
+// Counters move on between retransmits, so they are padded to a fixed width
+// to at least keep the length the same
+int httpd_api_netstats(struct httpd_state *s, char *buf, int len) {
+	return snprintf_P(buf, len,
+		PSTR("{\"rx_frames\":%10lu,\"rx_bytes\":%10lu,"
+			"\"rx_oversize\":%5u,\"rx_overruns\":%5u,"
+			"\"rx_chkerr\":%5u,\"rx_unknown\":%5u,"
+			"\"rx_peak\":%5u,\"rx_bursts\":%5u,"
+			"\"tx_frames\":%10lu,\"tx_bytes\":%10lu,\"tx_errors\":%5u,"
+			"\"arp_in\":%5u,\"arp_out\":%5u,\"polls\":%10lu}"),
+		net_stats.rx_frames, net_stats.rx_bytes,
+		net_stats.rx_oversize, net_stats.rx_overruns,
+		net_stats.rx_chkerr, net_stats.rx_unknown,
+		net_stats.rx_peak, net_stats.rx_bursts,
+		net_stats.tx_frames, net_stats.tx_bytes, net_stats.tx_errors,
+		net_stats.arp_in, net_stats.arp_out,
+		net_stats.polls);
+}
+
+#if CONFIG_APPS_TIMESYNC
+int httpd_api_time(struct httpd_state *s, char *buf, int len) {
+	return snprintf_P(buf, len,
+		PSTR("{\"time\":%lu,\"synchronised\":%S}"),
+		(unsigned long)wallclock_seconds(),
+		timesync_status.synchronised ? PSTR("true") : PSTR("false"));
+}
+#endif
+
+#if CONFIG_LIB_OWTEMP
+// Readings can change between retransmits, so numbers are padded as for
+// netstats; temperatures are in 1/16 degrees C
+int httpd_api_temperatures(struct httpd_state *s, char *buf, int len) {
+	int ret = snprintf_P(buf, len, PSTR("{\"sensors\":["));
+	uint8_t first = 1;
+
+	for (uint8_t i = 0; i < OWTEMP_SENSORS && ret < len; i++) {
+		const owtemp_reading_t *r = &owtemp_readings[i];
+
+		if (!r->used) {
+			continue;
+		}
+
+		ret += snprintf_P(&buf[ret], len - ret,
+			PSTR("%S{\"rom\":\"%02x%02x%02x%02x%02x%02x%02x%02x\","
+				"\"channel\":%d,"
+				"\"valid\":%S,\"temp\":%6d,\"age\":%10lu,"
+				"\"alarm\":%S,\"tl\":%4d,\"th\":%4d}"),
+			first ? PSTR("") : PSTR(","),
+			r->addr.u[0], r->addr.u[1], r->addr.u[2], r->addr.u[3],
+			r->addr.u[4], r->addr.u[5], r->addr.u[6], r->addr.u[7],
+			r->channel,
+			r->valid ? PSTR("true") : PSTR("false"),
+			r->temp,
+			(unsigned long)(s->time >= r->time ? s->time - r->time : 0),
+			r->alarm ? PSTR("true") : PSTR("false"), r->tl, r->th);
+		first = 0;
+	}
+
+	if (ret >= len) {
+		return ret;
+	}
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("]}"));
+	return ret;
+}
+#endif
+
+#if CONFIG_LIB_SENSORLOG
+// Consolidated sample history, padded as for temperatures
+int httpd_api_sensors(struct httpd_state *s, char *buf, int len) {
+	int ret = snprintf_P(buf, len, PSTR("{\"sensors\":["));
+	uint8_t first = 1;
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS && ret < len; i++) {
+		const sensorlog_t *l = &sensorlog[i];
+
+		if (!l->used || !l->count) {
+			continue;
+		}
+
+		ret += snprintf_P(&buf[ret], len - ret,
+			PSTR("%S{\"rom\":\"%02x%02x%02x%02x%02x%02x%02x%02x\","
+				"\"channel\":%d,\"samples\":%3u,\"last\":%6d,"
+				"\"avg\":%6d,\"min\":%6d,\"max\":%6d,\"age\":%10lu}"),
+			first ? PSTR("") : PSTR(","),
+			l->addr.u[0], l->addr.u[1], l->addr.u[2], l->addr.u[3],
+			l->addr.u[4], l->addr.u[5], l->addr.u[6], l->addr.u[7],
+			l->channel, l->count, sensorlog_sample(l, 0),
+			sensorlog_avg(l), l->min, l->max,
+			(unsigned long)(s->time >= l->time ? s->time - l->time : 0));
+		first = 0;
+	}
+
+	if (ret >= len) {
+		return ret;
+	}
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("]}"));
+	return ret;
+}
+#endif
+
+#if CONFIG_LIB_FLASHLOG
+// The newest flash log records, as many as fit whole in the response
+int httpd_api_log(struct httpd_state *s, char *buf, int len) {
+	flashlog_reader_t r;
+	flashlog_rec_t rec;
+	char text[FLASHLOG_TEXT_MAX];
+	int ret = snprintf_P(buf, len, PSTR("{\"log\":["));
+	int end;
+	uint8_t first = 1;
+
+	// Keep room to close the array
+	len -= 2;
+
+	flashlog_reader_init(&r);
+	while (ret < len && flashlog_read(&r, &rec, text, sizeof(text)) >= 0) {
+		end = ret + snprintf_P(&buf[ret], len - ret,
+			PSTR("%S{\"time\":%lu,\"pri\":%u,\"msg\":\""),
+			first ? PSTR("") : PSTR(","),
+			(unsigned long)rec.time, rec.pri);
+
+		// Escape the text for JSON
+		for (char *c = text; *c && end < len; c++) {
+			if (*c == '"' || *c == '\\') {
+				buf[end++] = '\\';
+				if (end < len) {
+					buf[end++] = *c;
+				}
+			}
+			else if ((uint8_t)*c < ' ') {
+				end += snprintf_P(&buf[end], len - end, PSTR("\\u%04x"), *c);
+			}
+			else {
+				buf[end++] = *c;
+			}
+		}
+
+		end += snprintf_P(&buf[end], end < len ? len - end : 0,
+			PSTR("\"}"));
+		if (end >= len) {
+			// Drop the record that didn't fit
+			break;
+		}
+		ret = end;
+		first = 0;
+	}
+
+	ret += snprintf_P(&buf[ret], len + 2 - ret, PSTR("]}"));
+	return ret;
+}
+#endif
+
+#if CONFIG_LIB_PROCSTAT
+// CPU time per process, as of the last procstat period
+int httpd_api_processes(struct httpd_state *s, char *buf, int len) {
+	int ret = snprintf_P(buf, len, PSTR("{\"period\":%u,"),
+		PROCSTAT_PERIOD);
+	if (ret >= len) {
+		return ret;
+	}
+
+#if PROCESS_CONF_STATS
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("\"maxevents\":%u,"),
+		process_maxevents);
+	if (ret >= len) {
+		return ret;
+	}
+#endif
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("\"processes\":["));
+	for (uint8_t i = 0; i < procstat_count && ret < len; i++) {
+		const struct procstat *p = &procstat_stats[i];
+
+		ret += snprintf_P(&buf[ret], len - ret,
+			PSTR("%S{\"name\":\"%S\",\"cpu\":%lu,\"total\":%lu,"
+				"\"max\":%lu,\"events\":%u,\"polls\":%u}"),
+			i ? PSTR(",") : PSTR(""), p->p->name,
+			p->last * 1000 / PROCSTAT_PERIOD_TICKS,
+			PROCSTAT_TICKS_MS(p->ticks), PROCSTAT_TICKS_US(p->max),
+			p->events, p->polls);
+	}
+	if (ret >= len) {
+		return ret;
+	}
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("]}"));
+	return ret;
+}
+#endif
+
+#if CONFIG_LIB_INIT_PROFILE
+// How long each initialiser took at boot, in microseconds
+int httpd_api_boot(struct httpd_state *s, char *buf, int len) {
+	int ret = snprintf_P(buf, len,
+		PSTR("{\"start\":%lu,\"total\":%lu,\"init\":["),
+		init_profile_start, init_profile_end - init_profile_start);
+
+	for (uint8_t i = 0; i < init_profile_count && ret < len; i++) {
+		const struct init_profile *p = &init_profile[i];
+
+		ret += snprintf_P(&buf[ret], len - ret,
+			PSTR("%S{\"type\":%u,\"name\":\"%S\",\"us\":%lu,\"err\":%d}"),
+			i ? PSTR(",") : PSTR(""), p->type, p->name, p->us, p->err);
+	}
+	if (ret >= len) {
+		return ret;
+	}
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("]}"));
+	return ret;
+}
+#endif
+
+static int api_status(struct httpd_state *s, char *buf, int len) {
+	int ret = snprintf_P(buf, len, PSTR("{\"uptime\":%lu,\"network\":"),
+		(unsigned long)s->time);
+	if (ret >= len) {
+		return ret;
+	}
+
+	ret += httpd_api_network(s, &buf[ret], len - ret);
+	if (ret >= len) {
+		return ret;
+	}
+
+	ret += snprintf_P(&buf[ret], len - ret, PSTR("}"));
+	return ret;
+}
+
+static const char api_status_name[] PROGMEM = "status";
+static const char api_network_name[] PROGMEM = "network";
+static const char api_netstats_name[] PROGMEM = "netstats";
+static const char api_uptime_name[] PROGMEM = "uptime";
+#if CONFIG_LIB_OWTEMP
+static const char api_temperatures_name[] PROGMEM = "temperatures";
+#endif
+#if CONFIG_LIB_SENSORLOG
+static const char api_sensors_name[] PROGMEM = "sensors";
+#endif
+#if CONFIG_LIB_FLASHLOG
+static const char api_log_name[] PROGMEM = "log";
+#endif
+#if CONFIG_LIB_PROCSTAT
+static const char api_processes_name[] PROGMEM = "processes";
+#endif
+#if CONFIG_LIB_INIT_PROFILE
+static const char api_boot_name[] PROGMEM = "boot";
+#endif
+#if CONFIG_APPS_TIMESYNC
+static const char api_time_name[] PROGMEM = "time";
+#endif
+
+static const struct httpd_api_call api_calls[] PROGMEM = {
+	{ api_status_name, api_status },
+	{ api_network_name, httpd_api_network },
+	{ api_netstats_name, httpd_api_netstats },
+	{ api_uptime_name, httpd_api_uptime },
+#if CONFIG_LIB_OWTEMP
+	{ api_temperatures_name, httpd_api_temperatures },
+#endif
+#if CONFIG_LIB_SENSORLOG
+	{ api_sensors_name, httpd_api_sensors },
+#endif
+#if CONFIG_LIB_FLASHLOG
+	{ api_log_name, httpd_api_log },
+#endif
+#if CONFIG_LIB_PROCSTAT
+	{ api_processes_name, httpd_api_processes },
+#endif
+#if CONFIG_LIB_INIT_PROFILE
+	{ api_boot_name, httpd_api_boot },
+#endif
+#if CONFIG_APPS_TIMESYNC
+	{ api_time_name, httpd_api_time },
+#endif
+};
+
+httpd_api_fn httpd_api(const char *filename) {
+	// Only paths under /api/ are ours
+	if (strncmp_P(filename, api_prefix, sizeof(api_prefix) - 1) != 0) {
+		return NULL;
+	}
+	filename += sizeof(api_prefix) - 1;
+
+	for (uint8_t i = 0; i < sizeof(api_calls) / sizeof(*api_calls); i++) {
+		struct httpd_api_call call;
+		memcpy_P(&call, &api_calls[i], sizeof(call));
+
+		if (strcmp_P(filename, call.name) == 0) {
+			return call.fn;
+		}
+	}
+
+	return NULL;
+}
+
+int httpd_api_generate(httpd_api_fn fn, struct httpd_state *s,
+	char *buf, int len)
+{
+	int ret = fn(s, buf, len);
+
+	// Don't let a truncated response claim more than it has
+	if (ret < 0) {
+		return 0;
+	}
+	else if (ret >= len) {
+		return len - 1;
+	}
+
+	return ret;
+}
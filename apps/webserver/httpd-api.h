@@ -0,0 +1,64 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+
+#ifndef HTTPD_API_H_
+#define HTTPD_API_H_
+
+#include "httpd.h"
+
+/*
+ * Native JSON API calls under /api/. These write straight into a buffer (which
+ * is normally uip_appdata) without touching the filesystem. They must give
+ * the same output every time they are called for one request so that
+ * retransmits work, which is why they use the time in s->time.
+ */
+
+// Individual API calls, also used for the event stream
+int httpd_api_uptime(struct httpd_state *s, char *buf, int len);
+int httpd_api_network(struct httpd_state *s, char *buf, int len);
+int httpd_api_netstats(struct httpd_state *s, char *buf, int len);
+#if CONFIG_APPS_TIMESYNC
+int httpd_api_time(struct httpd_state *s, char *buf, int len);
+#endif
+#if CONFIG_LIB_OWTEMP
+int httpd_api_temperatures(struct httpd_state *s, char *buf, int len);
+#endif
+#if CONFIG_LIB_SENSORLOG
+int httpd_api_sensors(struct httpd_state *s, char *buf, int len);
+#endif
+#if CONFIG_LIB_FLASHLOG
+int httpd_api_log(struct httpd_state *s, char *buf, int len);
+#endif
+#if CONFIG_LIB_PROCSTAT
+int httpd_api_processes(struct httpd_state *s, char *buf, int len);
+#endif
+#if CONFIG_LIB_INIT_PROFILE
+int httpd_api_boot(struct httpd_state *s, char *buf, int len);
+#endif
+
+// Find the API call for a path (NULL if it isn't one)
+httpd_api_fn httpd_api(const char *filename);
+
+// Run an API call into buf, returning the number of bytes written
+int httpd_api_generate(httpd_api_fn fn, struct httpd_state *s,
+	char *buf, int len);
+
+#endif
@@ -45,41 +45,111 @@
 #include <stdio.h>
 #include <string.h>
 #include <contiki-net.h>
+#include <compat.h>
 
 #include "httpd.h"
 #include "httpd-cgi.h"
 
-static struct httpd_cgi_call *calls = NULL;
+// Linker symbols
+extern struct httpd_cgi_call *__httpd_cgi_start;
+extern struct httpd_cgi_call *__httpd_cgi_end;
 
 static PT_THREAD(nullfunction(struct httpd_state *s, char *ptr)) {
 	PSOCK_BEGIN(&s->sock);
 	PSOCK_END(&s->sock);
 }
 
-httpd_cgifunction httpd_cgi(char *name) {
-	struct httpd_cgi_call *f;
+void httpd_cgi_find(char *name, struct httpd_cgi_call *call) {
+	uint_farptr_t start = pgm_get_far_address(__httpd_cgi_start);
+	uint16_t lo = 0;
+	uint16_t hi = (pgm_get_far_address(__httpd_cgi_end) - start) /
+		sizeof(struct httpd_cgi_call);
+
+	// The linker sorted the table by name, so binary search it
+	while (lo < hi) {
+		uint16_t mid = (lo + hi) / 2;
+		poly_memcpy_PF(call, start + mid * sizeof(*call), sizeof(*call));
 
-	/* Find the matching name in the table, return the function. */
-	for (f = calls; f != NULL; f = f->next) {
-		if (strncmp(f->name, name, strlen(f->name)) == 0) {
-			return f->function;
+		int cmp = strcmp_P(name, call->name);
+		if (cmp == 0) {
+			return;
+		}
+		else if (cmp < 0) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
 		}
 	}
 
-	return nullfunction;
+	memset(call, 0, sizeof(*call));
+	call->function = nullfunction;
+}
+
+httpd_cgifunction httpd_cgi(char *name) {
+	struct httpd_cgi_call call;
+
+	httpd_cgi_find(name, &call);
+	return call.function ? call.function : nullfunction;
 }
 
-void httpd_cgi_add(struct httpd_cgi_call *c) {
-	struct httpd_cgi_call *l;
+#if HTTPD_CGI_CACHE
+static struct httpd_cgi_fragment fragments[HTTPD_CGI_CACHE];
+
+struct httpd_cgi_fragment *httpd_cgi_fragment_get(
+	const struct httpd_cgi_call *call, const char *args)
+{
+	struct httpd_cgi_fragment *slot = NULL;
+	uint32_t now = clock_seconds();
+	uint8_t keep = strlen(args) < sizeof(slot->args);
+	int len;
+
+	for (uint8_t i = 0; i < HTTPD_CGI_CACHE; i++) {
+		struct httpd_cgi_fragment *f = &fragments[i];
+		uint8_t fresh = f->name && (int32_t)(f->expires - now) > 0;
 
-	c->next = NULL;
+		if (fresh && keep && f->name == call->name &&
+			!strcmp(f->args, args))
+		{
+			f->refs++;
+			return f;
+		}
+		else if (f->refs) {
+			continue;
+		}
+
+		// Take an empty or stale entry, or else the one closest to
+		// going stale
+		if (!slot || (!fresh && slot->name) ||
+			(slot->name && f->expires < slot->expires))
+		{
+			slot = f;
+		}
+	}
 
-	if (calls == NULL) {
-		calls = c;
+	if (!slot) {
+		return NULL;
 	}
-	else {
-		for (l = calls; l->next != NULL; l = l->next);
-		l->next = c;
+
+	len = call->render(slot->data, sizeof(slot->data), args);
+	if (len < 0) {
+		slot->name = NULL;
+		return NULL;
 	}
+
+	// Arguments too long to compare are good for this page only
+	slot->name = keep ? call->name : NULL;
+	strcpy(slot->args, keep ? args : "");
+	slot->expires = now + call->ttl;
+	slot->len = len;
+	slot->refs = 1;
+
+	return slot;
 }
 
+void httpd_cgi_fragment_put(struct httpd_cgi_fragment *f) {
+	if (f->refs) {
+		f->refs--;
+	}
+}
+#endif
@@ -35,22 +35,86 @@
 #ifndef __HTTPD_CGI_H__
 #define __HTTPD_CGI_H__
 
+#include <avr/pgmspace.h>
 #include <contiki.h>
 #include "httpd.h"
 
 typedef PT_THREAD((* httpd_cgifunction)(struct httpd_state *, char *));
 
+// Write a fragment into buf, which has room for size bytes, returning its
+// length or -1 if it doesn't fit. It must not yield or touch the connection.
+typedef int (* httpd_cgi_render)(char *buf, int size, const char *args);
+
 httpd_cgifunction httpd_cgi(char *name);
 
 struct httpd_cgi_call {
-  struct httpd_cgi_call *next;
-  const char *name;
-  httpd_cgifunction function;
+	PGM_P name;
+	httpd_cgifunction function;
+	httpd_cgi_render render; // used instead of function if set
+	uint8_t ttl; // seconds render's output is kept for
 };
 
-void httpd_cgi_add(struct httpd_cgi_call *c);
+// Find a CGI function by name, or the one that outputs nothing
+void httpd_cgi_find(char *name, struct httpd_cgi_call *call);
 
+/*
+ * Register a CGI function. Each call goes into its own section named after
+ * the CGI name so the linker can sort the table, which lets httpd_cgi() do a
+ * binary search. The name (str) must be a string literal.
+ */
 #define HTTPD_CGI_CALL(name, str, function) \
-static struct httpd_cgi_call name = {NULL, str, function}
+	static const char name##_str[] PROGMEM = str; \
+	static const struct httpd_cgi_call name \
+		__attribute__((used)) \
+		__attribute__((section("_httpd_cgi." str))) \
+		= {name##_str, function, NULL, 0}
+
+/*
+ * Fragments rendered by CGI functions registered with HTTPD_CGI_CACHED() are
+ * kept for ttl seconds, and pages that ask for the same CGI with the same
+ * arguments in that time are sent the copy rather than rendering it again.
+ * Each entry is held while it's being sent, so retransmits go out of it too.
+ */
+#ifndef CONFIG_APPS_WEBSERVER_CGI_CACHE
+#define HTTPD_CGI_CACHE 0
+#else /* CONFIG_APPS_WEBSERVER_CGI_CACHE */
+#define HTTPD_CGI_CACHE CONFIG_APPS_WEBSERVER_CGI_CACHE
+#endif /* CONFIG_APPS_WEBSERVER_CGI_CACHE */
+
+// Largest fragment
+#ifndef CONFIG_APPS_WEBSERVER_CGI_CACHE_SIZE
+#define HTTPD_CGI_CACHE_SIZE 128
+#else /* CONFIG_APPS_WEBSERVER_CGI_CACHE_SIZE */
+#define HTTPD_CGI_CACHE_SIZE CONFIG_APPS_WEBSERVER_CGI_CACHE_SIZE
+#endif /* CONFIG_APPS_WEBSERVER_CGI_CACHE_SIZE */
+
+// Arguments longer than this are rendered every time
+#define HTTPD_CGI_CACHE_ARGS 16
+
+#if HTTPD_CGI_CACHE
+#define HTTPD_CGI_CACHED(name, str, render, ttl) \
+	static const char name##_str[] PROGMEM = str; \
+	static const struct httpd_cgi_call name \
+		__attribute__((used)) \
+		__attribute__((section("_httpd_cgi." str))) \
+		= {name##_str, NULL, render, ttl}
+
+struct httpd_cgi_fragment {
+	PGM_P name; // of the CGI, NULL while the entry is empty
+	char args[HTTPD_CGI_CACHE_ARGS];
+	uint32_t expires; // clock_seconds()
+	uint8_t refs;
+	uint16_t len;
+	char data[HTTPD_CGI_CACHE_SIZE];
+};
+
+// The fragment for a cached CGI's call with args, rendering it unless a copy
+// is still good. Returns it with a reference held, or NULL if every entry is
+// in use or it couldn't be rendered.
+struct httpd_cgi_fragment *httpd_cgi_fragment_get(
+	const struct httpd_cgi_call *call, const char *args);
+// Give up a reference from httpd_cgi_fragment_get()
+void httpd_cgi_fragment_put(struct httpd_cgi_fragment *f);
+#endif
 
 #endif /* __HTTPD_CGI_H__ */
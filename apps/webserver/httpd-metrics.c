@@ -0,0 +1,420 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <contiki-net.h>
+
+#include "apps/network.h"
+#if CONFIG_APPS_ARP
+#include "apps/arp.h"
+#endif
+#if CONFIG_APPS_SYSLOG
+#include "apps/syslog.h"
+#endif
+#if CONFIG_LIB_PROCSTAT
+#include <procstat.h>
+#endif
+#if CONFIG_LIB_MEMSTAT
+#include <memstat.h>
+#endif
+#if CONFIG_LIB_SALLOC
+#include <salloc.h>
+#endif
+#if CONFIG_LIB_ONEWIRE
+#include <onewire.h>
+#endif
+#if CONFIG_LIB_OWTEMP
+#include <owtemp.h>
+#endif
+#if CONFIG_LIB_POLYFS
+#include <polyfs.h>
+#endif
+
+#include "httpd-metrics.h"
+
+#define METRIC_GAUGE 0x01 // rather than a counter
+#define METRIC_U16 0x02 // value is a uint16_t rather than a uint32_t
+#define METRIC_TICKS 0x04 // value is in clock ticks, shown in seconds
+
+/*
+ * A metric is either a single value, or a sample function for one with
+ * labels. The sample function writes the labels and value of the first
+ * item at or after *item, leaving *item pointing at it, and returns -1 if
+ * there aren't any more.
+ */
+struct metric {
+	PGM_P name;
+	uint8_t flags;
+	const void *value;
+	int (*sample)(uint8_t *item, char *buf);
+};
+
+#define METRIC_VALUE(name, flags, var) \
+	{ name, (flags) | (sizeof(var) == 2 ? METRIC_U16 : 0), &(var), NULL }
+#define METRIC_SAMPLE(name, flags, fn) \
+	{ name, flags, NULL, fn }
+
+static uint32_t uptime;
+
+// Seconds with three decimal places, from a count of thousandths
+static int print_ms(char *buf, uint32_t ms) {
+	return sprintf_P(buf, PSTR("%6lu.%03lu\n"), ms / 1000, ms % 1000);
+}
+
+#if CONFIG_LIB_PROCSTAT
+static int process_label(uint8_t *item, char *buf) {
+	if (*item >= procstat_count) {
+		return -1;
+	}
+
+	return sprintf_P(buf, PSTR("{process=\"%.24S\"} "),
+		procstat_stats[*item].p->name);
+}
+
+static int process_cpu(uint8_t *item, char *buf) {
+	int len = process_label(item, buf);
+
+	if (len < 0) {
+		return len;
+	}
+
+	return len + print_ms(&buf[len],
+		PROCSTAT_TICKS_MS(procstat_stats[*item].ticks));
+}
+
+static int process_dispatch_max(uint8_t *item, char *buf) {
+	int len = process_label(item, buf);
+	uint32_t us;
+
+	if (len < 0) {
+		return len;
+	}
+
+	us = PROCSTAT_TICKS_US(procstat_stats[*item].max);
+	return len + sprintf_P(&buf[len], PSTR("%3lu.%06lu\n"),
+		us / 1000000, us % 1000000);
+}
+
+static int process_events(uint8_t *item, char *buf) {
+	int len = process_label(item, buf);
+
+	if (len < 0) {
+		return len;
+	}
+
+	return len + sprintf_P(&buf[len], PSTR("%5u\n"),
+		procstat_stats[*item].events);
+}
+
+static int process_polls(uint8_t *item, char *buf) {
+	int len = process_label(item, buf);
+
+	if (len < 0) {
+		return len;
+	}
+
+	return len + sprintf_P(&buf[len], PSTR("%5u\n"),
+		procstat_stats[*item].polls);
+}
+#endif
+
+#if CONFIG_LIB_MEMSTAT
+static int memstat_sample(uint8_t *item, char *buf, uint16_t value) {
+	return sprintf_P(buf, PSTR("{site=\"%S\"} %5u\n"),
+		(PGM_P)pgm_read_word(&memstat_site_names[*item]), value);
+}
+
+static int memstat_allocs(uint8_t *item, char *buf) {
+	if (*item >= MEMSTAT_SITES) {
+		return -1;
+	}
+
+	return memstat_sample(item, buf, memstat.sites[*item].allocs);
+}
+
+static int memstat_frees(uint8_t *item, char *buf) {
+	if (*item >= MEMSTAT_SITES) {
+		return -1;
+	}
+
+	return memstat_sample(item, buf, memstat.sites[*item].frees);
+}
+
+static int memstat_fails(uint8_t *item, char *buf) {
+	if (*item >= MEMSTAT_SITES) {
+		return -1;
+	}
+
+	return memstat_sample(item, buf, memstat.sites[*item].fails);
+}
+#endif
+
+#if CONFIG_LIB_SALLOC
+static int salloc_used(uint8_t *item, char *buf) {
+	if (*item >= SALLOC_CLASSES) {
+		return -1;
+	}
+
+	return sprintf_P(buf, PSTR("{size=\"%u\"} %3u\n"),
+		SALLOC_SIZE(*item), salloc_classes[*item].used);
+}
+
+static int salloc_peak(uint8_t *item, char *buf) {
+	if (*item >= SALLOC_CLASSES) {
+		return -1;
+	}
+
+	return sprintf_P(buf, PSTR("{size=\"%u\"} %3u\n"),
+		SALLOC_SIZE(*item), salloc_classes[*item].peak);
+}
+
+static int salloc_fails(uint8_t *item, char *buf) {
+	if (*item >= SALLOC_CLASSES) {
+		return -1;
+	}
+
+	return sprintf_P(buf, PSTR("{size=\"%u\"} %5u\n"),
+		SALLOC_SIZE(*item), salloc_classes[*item].fails);
+}
+#endif
+
+#if CONFIG_LIB_OWTEMP
+// A sensor whose last read failed is NaN, padded to the width of a reading
+static int owtemp_sample(uint8_t *item, char *buf) {
+	const owtemp_reading_t *r;
+	int16_t temp;
+	int len;
+
+	while (*item < OWTEMP_SENSORS && !owtemp_readings[*item].used) {
+		(*item)++;
+	}
+	if (*item >= OWTEMP_SENSORS) {
+		return -1;
+	}
+
+	r = &owtemp_readings[*item];
+	len = sprintf_P(buf,
+		PSTR("{rom=\"%02x%02x%02x%02x%02x%02x%02x%02x\",channel=\"%u\"} "),
+		r->addr.u[0], r->addr.u[1], r->addr.u[2], r->addr.u[3],
+		r->addr.u[4], r->addr.u[5], r->addr.u[6], r->addr.u[7],
+		r->channel);
+
+	if (!r->valid) {
+		return len + sprintf_P(&buf[len], PSTR("%9S\n"), PSTR("NaN"));
+	}
+
+	// 1/16 degrees come out exactly in four decimal places
+	temp = abs(r->temp);
+	return len + sprintf_P(&buf[len], PSTR("%c%3u.%04u\n"),
+		r->temp < 0 ? '-' : ' ', temp >> 4, (temp & 15) * 625);
+}
+#endif
+
+static const char m_uptime[] PROGMEM = "uptime_seconds";
+static const char m_polls[] PROGMEM = "net_polls_total";
+static const char m_rx_frames[] PROGMEM = "net_rx_frames_total";
+static const char m_rx_bytes[] PROGMEM = "net_rx_bytes_total";
+static const char m_rx_oversize[] PROGMEM = "net_rx_oversize_total";
+static const char m_rx_overruns[] PROGMEM = "net_rx_overruns_total";
+static const char m_rx_chkerr[] PROGMEM = "net_rx_checksum_errors_total";
+static const char m_rx_unknown[] PROGMEM = "net_rx_unknown_total";
+static const char m_rx_peak[] PROGMEM = "net_rx_buffer_peak_bytes";
+static const char m_rx_bursts[] PROGMEM = "net_rx_bursts_total";
+static const char m_tx_frames[] PROGMEM = "net_tx_frames_total";
+static const char m_tx_bytes[] PROGMEM = "net_tx_bytes_total";
+static const char m_tx_errors[] PROGMEM = "net_tx_errors_total";
+static const char m_arp_in[] PROGMEM = "net_arp_in_total";
+static const char m_arp_out[] PROGMEM = "net_arp_out_total";
+#if CONFIG_APPS_ARP
+static const char m_arp_hits[] PROGMEM = "arp_cache_hits_total";
+static const char m_arp_misses[] PROGMEM = "arp_cache_misses_total";
+static const char m_arp_evictions[] PROGMEM = "arp_cache_evictions_total";
+static const char m_arp_refreshes[] PROGMEM = "arp_refreshes_total";
+#endif
+#if CONFIG_LIB_PROCSTAT
+static const char m_proc_cpu[] PROGMEM = "process_cpu_seconds_total";
+static const char m_proc_max[] PROGMEM = "process_dispatch_max_seconds";
+static const char m_proc_events[] PROGMEM = "process_events_total";
+static const char m_proc_polls[] PROGMEM = "process_polls_total";
+#endif
+#if CONFIG_LIB_MEMSTAT
+static const char m_mem_allocs[] PROGMEM = "memory_allocs_total";
+static const char m_mem_frees[] PROGMEM = "memory_frees_total";
+static const char m_mem_fails[] PROGMEM = "memory_alloc_failures_total";
+static const char m_heap_free[] PROGMEM = "heap_free_bytes";
+static const char m_heap_largest[] PROGMEM = "heap_largest_free_bytes";
+static const char m_heap_min[] PROGMEM = "heap_free_min_bytes";
+static const char m_stack_min[] PROGMEM = "stack_free_min_bytes";
+#endif
+#if CONFIG_LIB_SALLOC
+static const char m_salloc_used[] PROGMEM = "salloc_blocks_used";
+static const char m_salloc_peak[] PROGMEM = "salloc_blocks_peak";
+static const char m_salloc_fails[] PROGMEM = "salloc_class_full_total";
+static const char m_salloc_heap[] PROGMEM = "salloc_heap_total";
+#endif
+#if CONFIG_APPS_SYSLOG
+static const char m_syslog_dropped[] PROGMEM = "syslog_dropped_total";
+#endif
+#if CONFIG_LIB_ONEWIRE
+static const char m_ow_locks[] PROGMEM = "onewire_locks_total";
+static const char m_ow_waits[] PROGMEM = "onewire_lock_waits_total";
+static const char m_ow_hold[] PROGMEM = "onewire_lock_held_seconds_total";
+static const char m_ow_hold_max[] PROGMEM = "onewire_lock_held_max_seconds";
+static const char m_ow_wait[] PROGMEM = "onewire_lock_wait_seconds_total";
+static const char m_ow_wait_max[] PROGMEM = "onewire_lock_wait_max_seconds";
+#endif
+#if CONFIG_LIB_POLYFS
+static const char m_fs_block_hits[] PROGMEM = "polyfs_block_hits_total";
+static const char m_fs_block_misses[] PROGMEM = "polyfs_block_misses_total";
+static const char m_fs_lookup_hits[] PROGMEM = "polyfs_lookup_hits_total";
+static const char m_fs_lookup_neg[] PROGMEM = "polyfs_lookup_negative_total";
+static const char m_fs_lookup_walks[] PROGMEM = "polyfs_lookup_walks_total";
+#endif
+#if CONFIG_LIB_OWTEMP
+static const char m_temperature[] PROGMEM = "temperature_celsius";
+#endif
+
+static const struct metric metrics[] PROGMEM = {
+	METRIC_VALUE(m_uptime, METRIC_GAUGE, uptime),
+	METRIC_VALUE(m_polls, 0, net_stats.polls),
+	METRIC_VALUE(m_rx_frames, 0, net_stats.rx_frames),
+	METRIC_VALUE(m_rx_bytes, 0, net_stats.rx_bytes),
+	METRIC_VALUE(m_rx_oversize, 0, net_stats.rx_oversize),
+	METRIC_VALUE(m_rx_overruns, 0, net_stats.rx_overruns),
+	METRIC_VALUE(m_rx_chkerr, 0, net_stats.rx_chkerr),
+	METRIC_VALUE(m_rx_unknown, 0, net_stats.rx_unknown),
+	METRIC_VALUE(m_rx_peak, METRIC_GAUGE, net_stats.rx_peak),
+	METRIC_VALUE(m_rx_bursts, 0, net_stats.rx_bursts),
+	METRIC_VALUE(m_tx_frames, 0, net_stats.tx_frames),
+	METRIC_VALUE(m_tx_bytes, 0, net_stats.tx_bytes),
+	METRIC_VALUE(m_tx_errors, 0, net_stats.tx_errors),
+	METRIC_VALUE(m_arp_in, 0, net_stats.arp_in),
+	METRIC_VALUE(m_arp_out, 0, net_stats.arp_out),
+#if CONFIG_APPS_ARP
+	METRIC_VALUE(m_arp_hits, 0, arp_stats.hits),
+	METRIC_VALUE(m_arp_misses, 0, arp_stats.misses),
+	METRIC_VALUE(m_arp_evictions, 0, arp_stats.evictions),
+	METRIC_VALUE(m_arp_refreshes, 0, arp_stats.refreshes),
+#endif
+#if CONFIG_LIB_PROCSTAT
+	METRIC_SAMPLE(m_proc_cpu, 0, process_cpu),
+	METRIC_SAMPLE(m_proc_max, METRIC_GAUGE, process_dispatch_max),
+	METRIC_SAMPLE(m_proc_events, 0, process_events),
+	METRIC_SAMPLE(m_proc_polls, 0, process_polls),
+#endif
+#if CONFIG_LIB_MEMSTAT
+	METRIC_SAMPLE(m_mem_allocs, 0, memstat_allocs),
+	METRIC_SAMPLE(m_mem_frees, 0, memstat_frees),
+	METRIC_SAMPLE(m_mem_fails, 0, memstat_fails),
+	METRIC_VALUE(m_heap_free, METRIC_GAUGE, memstat.heap_free),
+	METRIC_VALUE(m_heap_largest, METRIC_GAUGE, memstat.heap_largest),
+	METRIC_VALUE(m_heap_min, METRIC_GAUGE, memstat.heap_min),
+	METRIC_VALUE(m_stack_min, METRIC_GAUGE, memstat.stack_min),
+#endif
+#if CONFIG_LIB_SALLOC
+	METRIC_SAMPLE(m_salloc_used, METRIC_GAUGE, salloc_used),
+	METRIC_SAMPLE(m_salloc_peak, METRIC_GAUGE, salloc_peak),
+	METRIC_SAMPLE(m_salloc_fails, 0, salloc_fails),
+	METRIC_VALUE(m_salloc_heap, 0, salloc_heap),
+#endif
+#if CONFIG_APPS_SYSLOG
+	METRIC_VALUE(m_syslog_dropped, 0, syslog_dropped),
+#endif
+#if CONFIG_LIB_ONEWIRE
+	METRIC_VALUE(m_ow_locks, 0, ow_lock_stats.locks),
+	METRIC_VALUE(m_ow_waits, 0, ow_lock_stats.waits),
+	METRIC_VALUE(m_ow_hold, METRIC_TICKS, ow_lock_stats.hold_total),
+	METRIC_VALUE(m_ow_hold_max, METRIC_GAUGE | METRIC_TICKS,
+		ow_lock_stats.hold_max),
+	METRIC_VALUE(m_ow_wait, METRIC_TICKS, ow_lock_stats.wait_total),
+	METRIC_VALUE(m_ow_wait_max, METRIC_GAUGE | METRIC_TICKS,
+		ow_lock_stats.wait_max),
+#endif
+#if CONFIG_LIB_POLYFS
+	METRIC_VALUE(m_fs_block_hits, 0, polyfs_stats.block_hits),
+	METRIC_VALUE(m_fs_block_misses, 0, polyfs_stats.block_misses),
+	METRIC_VALUE(m_fs_lookup_hits, 0, polyfs_stats.lookup_hits),
+	METRIC_VALUE(m_fs_lookup_neg, 0, polyfs_stats.lookup_negative),
+	METRIC_VALUE(m_fs_lookup_walks, 0, polyfs_stats.lookup_walks),
+#endif
+#if CONFIG_LIB_OWTEMP
+	METRIC_SAMPLE(m_temperature, METRIC_GAUGE, owtemp_sample),
+#endif
+};
+
+#define METRICS (sizeof(metrics) / sizeof(*metrics))
+
+// A single value, as the only item of its metric
+static int value_sample(const struct metric *mt, uint8_t item, char *buf) {
+	uint32_t v;
+
+	if (item) {
+		return -1;
+	}
+
+	if (mt->flags & METRIC_U16) {
+		v = *(const uint16_t *)mt->value;
+	}
+	else {
+		v = *(const uint32_t *)mt->value;
+	}
+
+	if (mt->flags & METRIC_TICKS) {
+		buf[0] = ' ';
+		return 1 + print_ms(&buf[1],
+			v / CLOCK_SECOND * 1000 + v % CLOCK_SECOND * 1000 / CLOCK_SECOND);
+	}
+
+	return sprintf_P(buf, PSTR(" %10lu\n"), v);
+}
+
+int httpd_metrics_line(struct httpd_metrics *m, char *buf) {
+	struct metric mt;
+	uint8_t item;
+	int len, ret;
+
+	uptime = clock_seconds();
+
+	for (; m->metric < METRICS; m->metric++, m->item = 0) {
+		memcpy_P(&mt, &metrics[m->metric], sizeof(mt));
+
+		// Each metric starts with its type, which is thrown away again if
+		// it turns out to have no samples
+		len = 0;
+		if (m->item == 0) {
+			len = sprintf_P(buf, PSTR("# TYPE polyctl_%S %S\n"), mt.name,
+				(mt.flags & METRIC_GAUGE) ? PSTR("gauge") : PSTR("counter"));
+		}
+		len += sprintf_P(&buf[len], PSTR("polyctl_%S"), mt.name);
+
+		item = m->item;
+		ret = mt.sample ? mt.sample(&item, &buf[len]) :
+			value_sample(&mt, item, &buf[len]);
+		if (ret >= 0) {
+			m->item = item + 1;
+			return len + ret;
+		}
+	}
+
+	return -1;
+}
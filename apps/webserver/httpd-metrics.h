@@ -0,0 +1,48 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef HTTPD_METRICS_H_
+#define HTTPD_METRICS_H_
+
+#include <stdint.h>
+
+/*
+ * The counters kept around the firmware, in the Prometheus text format for
+ * /metrics. Everything comes straight from RAM, nothing from the
+ * filesystem, a line at a time so the response can be spread over as many
+ * segments as it needs. Values are padded to a fixed width, so a
+ * retransmit is the same length even though the counters have moved on.
+ */
+
+// Longest line, including the # TYPE line that starts each metric
+#define HTTPD_METRICS_LINE_MAX 160
+
+// Where the output has got to; zero it to start from the beginning
+struct httpd_metrics {
+	uint8_t metric;
+	uint8_t item;
+};
+
+// Write the next line (or two) into buf, which must have room for
+// HTTPD_METRICS_LINE_MAX bytes, and move m on past it. Returns the number of
+// bytes written, or -1 at the end.
+int httpd_metrics_line(struct httpd_metrics *m, char *buf);
+
+#endif
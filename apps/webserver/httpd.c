@@ -40,23 +40,145 @@
 #include <ctype.h>
 
 #include "contiki-net.h"
+#include "lib/memb.h"
+#include <memstat.h>
 
 #include "webserver.h"
 #include "http-strings.h"
 #include "urlconv.h"
 
 #include "httpd.h"
+#include "httpd-api.h"
+#include "apps/network.h"
+#if CONFIG_APPS_TIMESYNC
+#include "apps/timesync.h"
+#endif
+#if CONFIG_APPS_WEBSERVER_UPDATE
+#include <polyfs.h>
+#include <flashmgt.h>
+#endif
 
-#ifndef CONFIG_APPS_WEBSERVER_CONNS
-#define CONNS UIP_CONNS
-#else /* CONFIG_APPS_WEBSERVER_CONNS */
-#define CONNS CONFIG_APPS_WEBSERVER_CONNS
-#endif /* CONFIG_APPS_WEBSERVER_CONNS */
+#include <polyfs/polyfs_fs.h>
+#ifdef CONFIG_LIB_POLYFS_CFS
+#include <polyfs_cfs.h>
+#endif
+#if CONFIG_LIB_SENSORSTORE
+#include <sensorstore.h>
+#endif
+#include <trace.h>
+
+
+// Space left for the headers in front of an API response
+#define HTTPD_API_HEADROOM 160
 
 #define SEND_PSTR(sock, str) \
 	PSOCK_GENERATOR_SEND(sock, send_pstr_gen, (void *)str)
 
-static uint8_t conns_free = CONNS;
+// Slots for normal requests, some of which files can't have
+#define HTTPD_SLOTS (HTTPD_CONNS + HTTPD_RESERVED_CONNS)
+
+// Fixed pool of connection state so we never fragment the heap, with some
+// slots kept back for event streams so they can't starve normal requests
+MEMB(conns, struct httpd_state, HTTPD_SLOTS + HTTPD_EVENT_CONNS);
+static uint8_t conns_used;
+
+// Slots sending files, and answering API or metrics requests
+static uint8_t files_used;
+static uint8_t priority_used;
+
+// Connections waiting for a slot, stopped so the client holds on to its
+// request until there's somewhere to read it into. The entry is the
+// connection's appstate meanwhile.
+static struct httpd_queued {
+	struct uip_conn *conn; // NULL if the entry is free
+	clock_time_t since;
+} queue[HTTPD_QUEUE];
+
+// Connections streaming events
+static struct {
+	struct httpd_state *s;
+	struct uip_conn *conn;
+} event_conns[HTTPD_EVENT_CONNS];
+
+#if CONFIG_LIB_SENSORSTORE
+// The one connection streaming sensor history, and where it's got to: r is
+// the start of the segment being sent, next the end of it
+static struct {
+	struct httpd_state *s;
+	sensorstore_reader_t r;
+	sensorstore_reader_t next;
+} history;
+
+// Longest line of history: time, ROM, channel and a 16-bit value
+#define HISTORY_LINE_MAX (10 + 1 + 16 + 1 + 3 + 1 + 6 + 1)
+#endif
+
+#if CONFIG_LIB_TRACE
+// The one connection downloading the trace: sent is the offset of the
+// segment being sent, next the end of it. Recording is held meanwhile.
+static struct {
+	struct httpd_state *s;
+	uint16_t sent;
+	uint16_t next;
+} tracedl;
+#endif
+
+/*
+ * Paths handled natively, matched against the URL before it goes through
+ * urlconv. The paths are the filenames they'd convert to, /www and all.
+ * Earlier entries win, so longer prefixes must come first.
+ */
+struct httpd_route {
+	PGM_P path;
+	uint8_t route;
+	uint8_t prefix; // the path only has to start the URL
+};
+
+static const char route_api[] PROGMEM = "/www/api/";
+
+static const struct httpd_route routes[] PROGMEM = {
+	{ http_api_events, HTTPD_ROUTE_EVENTS, 0 },
+#if OWFSD_WEBSOCKET
+	{ http_api_owfs, HTTPD_ROUTE_OWFS, 0 },
+#endif
+#if CONFIG_LIB_TRACE
+	{ http_api_trace, HTTPD_ROUTE_TRACE, 0 },
+#endif
+#if CONFIG_LIB_SENSORSTORE
+	{ http_api_history, HTTPD_ROUTE_HISTORY, 1 },
+#endif
+#if CONFIG_APPS_WEBSERVER_METRICS
+	{ http_metrics, HTTPD_ROUTE_METRICS, 0 },
+#endif
+	{ route_api, HTTPD_ROUTE_API, 1 },
+#if CONFIG_APPS_WEBSERVER_UPDATE
+	{ http_update, HTTPD_ROUTE_UPDATE, 0 },
+#endif
+};
+
+#define ROUTES (sizeof(routes) / sizeof(*routes))
+
+/*
+ * Find the route for the first len bytes of a path (without the /www).
+ * Returns HTTPD_ROUTE_FILE if nothing else handles it.
+ */
+static uint8_t route_find(const char *path, uint8_t len) {
+	for (uint8_t i = 0; i < ROUTES; i++) {
+		struct httpd_route r;
+		uint8_t rlen;
+
+		memcpy_P(&r, &routes[i], sizeof(r));
+		rlen = strlen_P(r.path + 4);
+
+		if ((r.prefix ? len >= rlen : len == rlen) &&
+			strncmp_P(path, r.path + 4, rlen) == 0)
+		{
+			return r.route;
+		}
+	}
+
+	return HTTPD_ROUTE_FILE;
+}
 
 static unsigned short send_pstr_gen(void *string) {
 	PGM_P str = string;
@@ -75,49 +197,630 @@ static unsigned short send_pstr_gen(void *string) {
 	return len;
 }
 
+/*
+ * Work out the ETag for a file, which is the offset of its data in the
+ * filesystem. Together with the filesystem CRC this is unique to one version
+ * of one file. Returns 0 if the file has no usable ETag.
+ *
+ * The content type mkpolyfs recorded in the gid comes out of the same
+ * lookup, and is left alone if there isn't one.
+ */
+static uint32_t file_etag(const char *file, uint8_t *mime) {
+#ifdef CONFIG_LIB_POLYFS_CFS
+	struct polyfs_inode inode;
+
+	if (polyfs_cfs_fs == NULL ||
+		polyfs_lookup(polyfs_cfs_fs, file, &inode) < 0)
+	{
+		return 0;
+	}
+
+	*mime = inode.gid;
+	return inode.offset;
+#else
+	return 0;
+#endif
+}
+
+static uint32_t fs_crc(void) {
+#ifdef CONFIG_LIB_POLYFS_CFS
+	return polyfs_cfs_fs ? polyfs_cfs_fs->sb.fsid.crc : 0;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Parse a single byte range out of a Range header
+ */
+static void parse_range(struct httpd_state *s, const char *str) {
+	char *end;
+
+	// Skip to the range unit, which must be bytes
+	str += sizeof(http_range) - 1;
+	while (*str == ' ') {
+		str++;
+	}
+	if (strncasecmp_P(str, http_bytes_eq, sizeof(http_bytes_eq) - 1) != 0) {
+		return;
+	}
+	str += sizeof(http_bytes_eq) - 1;
+
+	if (*str == '-') {
+		// Suffix range (the last N bytes)
+		s->range_start = -1;
+		s->range_end = strtoul(str + 1, &end, 10);
+		if (end == str + 1) {
+			return;
+		}
+	}
+	else {
+		s->range_start = strtoul(str, &end, 10);
+		if (end == str || *end != '-') {
+			return;
+		}
+
+		// The end is optional
+		str = end + 1;
+		s->range_end = strtoul(str, &end, 10);
+		if (end == str) {
+			s->range_end = -1;
+		}
+	}
+
+	// We don't do multiple ranges, so just send the whole file for those
+	if (strchr(end, ',') != NULL) {
+		return;
+	}
+
+	s->flags |= HTTPD_FLAG_RANGE;
+}
+
+/*
+ * Work out which part of an opened file to send, returning the status line
+ * to use
+ */
+static PGM_P apply_range(struct httpd_state *s) {
+	int32_t start, end;
+
+	// Ranges only make sense for files we know the length of
+	if (!(s->flags & HTTPD_FLAG_RANGE) || s->length < 0) {
+		return http_header_200;
+	}
+	s->range_total = s->length;
+
+	if (s->range_start < 0) {
+		start = s->length - s->range_end;
+		if (start < 0) {
+			start = 0;
+		}
+		end = s->length - 1;
+	}
+	else {
+		start = s->range_start;
+		end = s->range_end;
+		if (end < 0 || end >= s->length) {
+			end = s->length - 1;
+		}
+	}
+
+	// Nothing we can send
+	if (start >= s->length || start > end) {
+		sendfile_finish(&s->sendfile);
+		s->length = 0;
+		return http_header_416;
+	}
+
+	sendfile_range(&s->sendfile, start, end + 1);
+	s->range_start = start;
+	s->range_end = end;
+	s->length = end - start + 1;
+
+	return http_header_206;
+}
+
+/*
+ * Parse the first entity tag out of an If-None-Match header value
+ */
+static void parse_if_none_match(struct httpd_state *s, const char *str) {
+	char *end;
+
+	// Find the opening quote
+	str = strchr(str, '"');
+	if (str == NULL) {
+		return;
+	}
+
+	// Our tags look like "<crc>-<offset>" in hex
+	s->inm_crc = strtoul(str + 1, &end, 16);
+	if (*end != '-') {
+		return;
+	}
+	s->inm_etag = strtoul(end + 1, &end, 16);
+	if (*end != '"') {
+		return;
+	}
+
+	s->flags |= HTTPD_FLAG_IF_NONE_MATCH;
+}
+
 static PT_THREAD(send_pstring(struct httpd_state *s, PGM_P str)) {
 	PSOCK_BEGIN(&s->sock);
+
+	// Unless headers went first, this is the whole response (status line
+	// and all)
+	if (!s->status) {
+		s->status = str;
+	}
+
 	SEND_PSTR(&s->sock, str);
 	PSOCK_END(&s->sock);
 }
 
-static PT_THREAD(send_headers(struct httpd_state *s, const PGM_P statushdr)) {
-	const char *ptr = NULL;
-	const PGM_P ptr2 = NULL;
-
-	PSOCK_BEGIN(&s->sock);
-	SEND_PSTR(&s->sock, statushdr);
+/*
+ * Guess the content type from the file name, for files the filesystem
+ * didn't record one for
+ */
+static uint8_t content_type(const char *filename) {
+	const char *ptr = strrchr(filename, '.');
 
-	ptr = strrchr(s->filename, '.');
 	if (ptr == NULL) {
-		ptr2 = http_content_type_binary;
+		return POLYFS_MIME_BINARY;
 	}
 	else if (strncmp_P(ptr, http_html, 5) == 0) {
-		ptr2 = http_content_type_html;
+		return POLYFS_MIME_HTML;
 	}
 	else if (strncmp_P(ptr, http_shtml, 6) == 0) {
-		ptr2 = http_content_type_html;
+		return POLYFS_MIME_HTML;
 	}
 	else if (strncmp_P(ptr, http_css, 4) == 0) {
-		ptr2 = http_content_type_css;
+		return POLYFS_MIME_CSS;
 	}
 	else if (strncmp_P(ptr, http_png, 4) == 0) {
-		ptr2 = http_content_type_png;
+		return POLYFS_MIME_PNG;
 	}
 	else if (strncmp_P(ptr, http_gif, 4) == 0) {
-		ptr2 = http_content_type_gif;
+		return POLYFS_MIME_GIF;
 	}
 	else if (strncmp_P(ptr, http_jpg, 4) == 0) {
-		ptr2 = http_content_type_jpg;
+		return POLYFS_MIME_JPEG;
+	}
+
+	return POLYFS_MIME_PLAIN;
+}
+
+/*
+ * Build the whole response header in one segment, and fill up the rest of
+ * the segment with the start of the file. This has to give the same result
+ * if it's called again for a retransmit.
+ */
+static unsigned short headers_gen(void *state) {
+	struct httpd_state *s = state;
+	struct http_type_header hdr;
+	char *buf = uip_appdata;
+	int len;
+
+	// API calls are generated before the headers so we know their length,
+	// and then moved down to follow them
+	if (s->api) {
+		s->length = httpd_api_generate(s->api, s,
+			&buf[HTTPD_API_HEADROOM], UIP_TCP_MSS - HTTPD_API_HEADROOM);
+	}
+
+	// Status line
+	len = strlen_P(s->status);
+	memcpy_P(buf, s->status, len);
+
+	// Pre-compressed files need to say so
+	if (s->flags & HTTPD_FLAG_GZIP) {
+		strcpy_P(&buf[len], http_content_encoding_gzip);
+		len += strlen(&buf[len]);
+	}
+
+	// Send a validator so the client can make conditional requests
+	if (s->etag) {
+		len += sprintf_P(&buf[len], http_etag_fmt, fs_crc(), s->etag);
+	}
+
+	// Tell the client which part of the file it's getting
+	if (s->status == http_header_206) {
+		len += sprintf_P(&buf[len], http_content_range_fmt,
+			(unsigned long)s->range_start, (unsigned long)s->range_end,
+			(unsigned long)s->range_total);
+	}
+	else if (s->status == http_header_416) {
+		len += sprintf_P(&buf[len], http_content_range_none_fmt,
+			(unsigned long)s->range_total);
+	}
+	else if (s->status == http_header_200 && s->sendfile.open &&
+		s->length >= 0)
+	{
+		strcpy_P(&buf[len], http_accept_ranges);
+		len += strlen(&buf[len]);
+	}
+
+	// The length lets the client know where the body ends without the
+	// connection closing
+	if (s->length >= 0) {
+		len += sprintf_P(&buf[len], http_content_length_fmt,
+			(unsigned long)s->length);
+	}
+
+	// We can only keep the connection open if the client can tell where
+	// the body ends
+	if (s->length < 0 && s->status != http_header_304) {
+		s->flags &= ~HTTPD_FLAG_KEEP_ALIVE;
+	}
+	if (s->flags & HTTPD_FLAG_KEEP_ALIVE) {
+		strcpy_P(&buf[len], http_connection_keep_alive);
 	}
 	else {
-		ptr2 = http_content_type_plain;
+		strcpy_P(&buf[len], http_connection_close);
+	}
+	len += strlen(&buf[len]);
+
+	// A 304 has no body, so no content type either
+	if (s->status == http_header_304) {
+		strcpy_P(&buf[len], http_crnl);
+		return len + 2;
+	}
+
+	if (s->api) {
+		strcpy_P(&buf[len], http_content_type_json);
+		len += strlen(&buf[len]);
+
+		memmove(&buf[len], &buf[HTTPD_API_HEADROOM], s->length);
+		return len + s->length;
+	}
+
+	if (s->flags & HTTPD_FLAG_EVENTS) {
+		strcpy_P(&buf[len], http_content_type_event_stream);
+		return len + strlen(&buf[len]);
+	}
+
+#if CONFIG_APPS_WEBSERVER_METRICS
+	if (s->route == HTTPD_ROUTE_METRICS) {
+		strcpy_P(&buf[len], http_content_type_metrics);
+		return len + strlen(&buf[len]);
 	}
+#endif
+
+	// The content type and caching headers end the headers, prebuilt for
+	// each type so they're a single copy
+	if (!s->mime || s->mime >= POLYFS_MIME_COUNT) {
+		s->mime = content_type(s->filename);
+	}
+	memcpy_P(&hdr, &http_type_headers[s->mime], sizeof(hdr));
+	memcpy_P(&buf[len], hdr.str, hdr.len);
+	len += hdr.len;
+
+	// Now fit in as much of the file as we can
+	s->body = sendfile_read(&s->sendfile, &buf[len], UIP_TCP_MSS - len);
+	if (s->body < 0) {
+		s->body = 0;
+	}
+
+	return len + s->body;
+}
+
+static PT_THREAD(send_headers(struct httpd_state *s, const PGM_P statushdr)) {
+	PSOCK_BEGIN(&s->sock);
+
+	s->status = statushdr;
+	s->body = 0;
+	PSOCK_GENERATOR_SEND(&s->sock, headers_gen, s);
+
+	// Don't send the part of the file that went with the headers again
+	sendfile_skip(&s->sendfile, s->body);
 
-	SEND_PSTR(&s->sock, ptr2);
 	PSOCK_END(&s->sock);
 }
 
+// The connection that has waited longest for a slot, NULL if none has
+static struct httpd_queued *queue_first(void) {
+	struct httpd_queued *first = NULL;
+	clock_time_t now = clock_time();
+
+	for (uint8_t i = 0; i < HTTPD_QUEUE; i++) {
+		if (queue[i].conn && (first == NULL ||
+			(clock_time_t)(now - queue[i].since) >
+				(clock_time_t)(now - first->since)))
+		{
+			first = &queue[i];
+		}
+	}
+
+	return first;
+}
+
+// A slot has come free, so let the connection next in line have it
+static void queue_kick(void) {
+	struct httpd_queued *q = queue_first();
+
+	if (q) {
+		tcpip_poll_tcp(q->conn);
+	}
+}
+
+// Stop counting a connection against whatever it was using its slot for
+static void slot_release(struct httpd_state *s) {
+	if (s->admit == HTTPD_ADMIT_FILE) {
+		files_used--;
+	}
+	else if (s->admit == HTTPD_ADMIT_PRIORITY) {
+		priority_used--;
+	}
+	s->admit = HTTPD_ADMIT_BUSY;
+}
+
+int httpd_priority_busy(void) {
+	return priority_used != 0;
+}
+
+/*
+ * Move a connection from the normal pool to an event stream slot
+ */
+static int events_subscribe(struct httpd_state *s) {
+	for (uint8_t i = 0; i < HTTPD_EVENT_CONNS; i++) {
+		if (event_conns[i].s == NULL) {
+			event_conns[i].s = s;
+			event_conns[i].conn = uip_conn;
+			s->flags |= HTTPD_FLAG_EVENTS;
+			conns_used--;
+			queue_kick();
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void events_unsubscribe(struct httpd_state *s) {
+	for (uint8_t i = 0; i < HTTPD_EVENT_CONNS; i++) {
+		if (event_conns[i].s == s) {
+			event_conns[i].s = NULL;
+			event_conns[i].conn = NULL;
+		}
+	}
+}
+
+void httpd_event(process_event_t ev, process_data_t data) {
+	uint8_t mask = 0;
+
+	if (ev == net_event) {
+		mask = HTTPD_EVENT_NETWORK;
+	}
+#if CONFIG_APPS_TIMESYNC
+	else if (ev == timesync_event) {
+		mask = HTTPD_EVENT_TIME;
+	}
+#endif
+
+	if (!mask) {
+		return;
+	}
+
+	// Mark the event pending and get uIP to poll the connection
+	for (uint8_t i = 0; i < HTTPD_EVENT_CONNS; i++) {
+		if (event_conns[i].s != NULL) {
+			event_conns[i].s->events |= mask;
+			tcpip_poll_tcp(event_conns[i].conn);
+		}
+	}
+}
+
+/*
+ * Write out one event in text/event-stream format. This has to give the same
+ * result if it's called again for a retransmit.
+ */
+static unsigned short event_gen(void *state) {
+	struct httpd_state *s = state;
+	char *buf = uip_appdata;
+	int len = 0;
+	httpd_api_fn fn = NULL;
+
+	switch (s->event) {
+	case HTTPD_EVENT_NETWORK:
+		len = sprintf_P(buf, PSTR("event: network\ndata: "));
+		fn = httpd_api_network;
+		break;
+#if CONFIG_APPS_TIMESYNC
+	case HTTPD_EVENT_TIME:
+		len = sprintf_P(buf, PSTR("event: time\ndata: "));
+		fn = httpd_api_time;
+		break;
+#endif
+	default:
+		// Just a comment to keep the connection alive
+		return sprintf_P(buf, PSTR(": %lu\n\n"), (unsigned long)s->time);
+	}
+
+	len += httpd_api_generate(fn, s, &buf[len], UIP_TCP_MSS - len - 2);
+	buf[len++] = '\n';
+	buf[len++] = '\n';
+
+	return len;
+}
+
+static PT_THREAD(send_event(struct httpd_state *s)) {
+	PSOCK_BEGIN(&s->sock);
+
+	// Send the lowest numbered event first
+	s->event = s->events & -s->events;
+	s->time = clock_seconds();
+	PSOCK_GENERATOR_SEND(&s->sock, event_gen, s);
+	s->events &= ~s->event;
+
+	PSOCK_END(&s->sock);
+}
+
+#if CONFIG_LIB_SENSORSTORE
+/*
+ * Set up a reader for /api/history[/<from>[-<to>]], with the times in
+ * wallclock seconds. Returns 0 if the path isn't one of these, or -1 if
+ * another connection has the reader.
+ */
+static int history_request(struct httpd_state *s) {
+	uint8_t len = strlen_P(http_api_history);
+	const char *ptr = &s->filename[len];
+	uint32_t from = 0;
+	uint32_t to = UINT32_MAX;
+	char *end;
+
+	if (strncmp_P(s->filename, http_api_history, len) != 0) {
+		return 0;
+	}
+
+	if (*ptr == '/') {
+		from = strtoul(ptr + 1, &end, 10);
+		if (*end == '-') {
+			to = strtoul(end + 1, &end, 10);
+		}
+		ptr = end;
+	}
+	if (*ptr) {
+		return 0;
+	}
+
+	if (history.s) {
+		return -1;
+	}
+
+	history.s = s;
+	sensorstore_reader_init(&history.r, from, to);
+	return 1;
+}
+
+// Write the next line of history, returns -1 if there isn't one
+static int history_line(sensorstore_reader_t *r, char *buf) {
+	uint32_t time;
+	ow_addr_t addr;
+	uint8_t channel;
+	int16_t value;
+
+	if (sensorstore_read(r, &time, &addr, &channel, &value)) {
+		return -1;
+	}
+
+	return sprintf_P(buf,
+		PSTR("%lu,%02x%02x%02x%02x%02x%02x%02x%02x,%u,%d\n"),
+		(unsigned long)time,
+		addr.u[0], addr.u[1], addr.u[2], addr.u[3],
+		addr.u[4], addr.u[5], addr.u[6], addr.u[7],
+		channel, value);
+}
+
+/*
+ * Fill a segment with whole lines of history. This always starts from
+ * history.r, so a retransmit gets the same lines; the reader only moves on
+ * once they've been acknowledged.
+ */
+static unsigned short history_gen(void *state) {
+	char *buf = uip_appdata;
+	int len = 0;
+	int ret;
+
+	history.next = history.r;
+	while (UIP_TCP_MSS - len >= HISTORY_LINE_MAX &&
+		(ret = history_line(&history.next, &buf[len])) >= 0)
+	{
+		len += ret;
+	}
+
+	return len;
+}
+
+static PT_THREAD(send_history(struct httpd_state *s)) {
+	PSOCK_BEGIN(&s->sock);
+
+	while (1) {
+		// Stop before a segment with nothing in it, which would never be
+		// acknowledged
+		history.next = history.r;
+		if (history_line(&history.next, uip_appdata) < 0) {
+			break;
+		}
+
+		PSOCK_GENERATOR_SEND(&s->sock, history_gen, s);
+		history.r = history.next;
+	}
+
+	history.s = NULL;
+
+	PSOCK_END(&s->sock);
+}
+#endif
+
+#if CONFIG_APPS_WEBSERVER_METRICS
+/*
+ * Fill a segment with whole lines of metrics, always starting from
+ * s->metrics so a retransmit gets the same lines (if not the same values).
+ */
+static unsigned short metrics_gen(void *state) {
+	struct httpd_state *s = state;
+	char *buf = uip_appdata;
+	int len = 0;
+	int ret;
+
+	s->metrics_next = s->metrics;
+	while (UIP_TCP_MSS - len >= HTTPD_METRICS_LINE_MAX &&
+		(ret = httpd_metrics_line(&s->metrics_next, &buf[len])) >= 0)
+	{
+		len += ret;
+	}
+
+	return len;
+}
+
+static PT_THREAD(send_metrics(struct httpd_state *s)) {
+	PSOCK_BEGIN(&s->sock);
+
+	while (1) {
+		// Stop before a segment with nothing in it
+		s->metrics_next = s->metrics;
+		if (httpd_metrics_line(&s->metrics_next, uip_appdata) < 0) {
+			break;
+		}
+
+		PSOCK_GENERATOR_SEND(&s->sock, metrics_gen, s);
+		s->metrics = s->metrics_next;
+	}
+
+	PSOCK_END(&s->sock);
+}
+#endif
+
+#if CONFIG_LIB_TRACE
+static void trace_done(struct httpd_state *s) {
+	if (tracedl.s == s) {
+		tracedl.s = NULL;
+		trace_release();
+	}
+}
+
+// The trace doesn't change while it's held, so a retransmit gets the same
+// bytes
+static unsigned short trace_gen(void *state) {
+	uint16_t len = trace_export(uip_appdata, tracedl.sent, UIP_TCP_MSS);
+
+	tracedl.next = tracedl.sent + len;
+	return len;
+}
+
+static PT_THREAD(send_trace(struct httpd_state *s)) {
+	PSOCK_BEGIN(&s->sock);
+
+	while (tracedl.sent < s->length) {
+		PSOCK_GENERATOR_SEND(&s->sock, trace_gen, s);
+		tracedl.sent = tracedl.next;
+	}
+
+	trace_done(s);
+
+	PSOCK_END(&s->sock);
+}
+#endif
+
 static PT_THREAD(handle_input(struct httpd_state *s)) {
 	PSOCK_BEGIN(&s->sock);
 
@@ -143,13 +846,34 @@ static PT_THREAD(handle_input(struct httpd_state *s)) {
 
 	// Make sure it starts with a '/'
 	if (s->inputbuf[0] == '/') {
+		char *path = (char *)s->inputbuf;
+		uint8_t len = strchrnul(path, '?') - path;
+
 		// prefix the path with '/www'
 		strcpy_P(s->filename, PSTR("/www"));
-
-		// Use urlconv to sanitise the path
 		int idx = strlen(s->filename);
-		urlconv_tofilename(&s->filename[idx], (char *)s->inputbuf,
-			sizeof(s->filename) - idx);
+
+		// Routed paths are used as they are, unless they need decoding or
+		// normalising; anything else goes through urlconv to sanitise it
+		s->route = route_find(path, len);
+		if (s->route != HTTPD_ROUTE_FILE &&
+			!memchr(path, '%', len) && !memchr(path, '.', len) &&
+			len < sizeof(s->filename) - idx)
+		{
+			memcpy(&s->filename[idx], path, len);
+			s->filename[idx + len] = '\0';
+		}
+		else if (len == 1) {
+			// The front page, which needs no conversion either
+			s->filename[idx++] = '/';
+			s->filename[idx] = '\0';
+		}
+		else {
+			urlconv_tofilename(&s->filename[idx], path,
+				sizeof(s->filename) - idx);
+			s->route = route_find(&s->filename[idx],
+				strlen(&s->filename[idx]));
+		}
 
 		// Append 'index.html' if necessary
 		idx = strlen(s->filename);
@@ -159,49 +883,393 @@ static PT_THREAD(handle_input(struct httpd_state *s)) {
 			strcpy_P(&s->filename[idx - 1], http_index_html);
 		}
 
-		webserver_log_file(&uip_conn->ripaddr, s->filename);
+		// Keep the path for the access log, as the name may be replaced
+		idx = sizeof(s->log.path) - 1;
+		strncpy(s->log.path, &s->filename[4], idx);
+		s->log.path[idx] = '\0';
 	}
 	else {
 		// Invalid path
 		s->filename[0] = 0;
+		s->route = HTTPD_ROUTE_FILE;
 	}
+	s->start = clock_time();
 
-	// Skip past the HTTP protocol version
+	// HTTP/1.1 connections are persistent unless the client says otherwise
 	PSOCK_READTO(&s->sock, '\n');
+	if (strncmp_P((char *)s->inputbuf, http_11, sizeof(http_11) - 1) == 0) {
+		s->flags |= HTTPD_FLAG_KEEP_ALIVE;
+	}
 
 	while (1) {
 		PSOCK_READTO(&s->sock, '\n');
 
 		int len = PSOCK_DATALEN(&s->sock);
+		uint8_t partial = (s->inputbuf[len - 1] != '\n');
+		s->inputbuf[len] = 0;
 
-		// Trim trailing whitespace
-		while (isspace(s->inputbuf[len - 1])) {
-			s->inputbuf[len - 1] = 0;
-			len--;
+		// The rest of a line too long for the buffer is never interesting
+		if (s->flags & HTTPD_FLAG_PARTIAL) {
+			if (!partial) {
+				s->flags &= ~HTTPD_FLAG_PARTIAL;
+			}
+			continue;
+		}
+		if (partial) {
+			s->flags |= HTTPD_FLAG_PARTIAL;
 		}
 
 		// Empty line means end of headers
-		if (len == 0) {
+		if (s->inputbuf[0] == '\r' || s->inputbuf[0] == '\n') {
+			break;
+		}
+
+		// Only look closer at headers starting with a letter we care about,
+		// which lets us skip most of them after a single test
+		switch (tolower(s->inputbuf[0])) {
+		case 'a':
+		case 'c':
+		case 'i':
+		case 'r':
+		case 's':
 			break;
+		default:
+			continue;
 		}
+
+		// See if the client will take gzipped files
+		if (strncasecmp_P((char *)s->inputbuf, http_accept_encoding,
+				sizeof(http_accept_encoding) - 1) == 0 &&
+			strcasestr_P((char *)s->inputbuf, http_gzip) != NULL)
+		{
+			s->flags |= HTTPD_FLAG_ACCEPT_GZIP;
+		}
+
+#if CONFIG_APPS_WEBSERVER_UPDATE
+		// Find out how long the request body is
+		if (strncasecmp_P((char *)s->inputbuf, http_content_length,
+				sizeof(http_content_length) - 1) == 0)
+		{
+			s->post_len = strtoul(
+				(char *)s->inputbuf + sizeof(http_content_length) - 1,
+				NULL, 10);
+		}
+#endif
+
+		// See if the client wants the connection kept open or not
+		if (strncasecmp_P((char *)s->inputbuf, http_connection,
+				sizeof(http_connection) - 1) == 0)
+		{
+			if (strcasestr_P((char *)s->inputbuf, http_close)) {
+				s->flags &= ~HTTPD_FLAG_KEEP_ALIVE;
+			}
+			else if (strcasestr_P((char *)s->inputbuf, http_keep_alive)) {
+				s->flags |= HTTPD_FLAG_KEEP_ALIVE;
+			}
+		}
+
+		// See if the client only wants part of the file
+		if (strncasecmp_P((char *)s->inputbuf, http_range,
+				sizeof(http_range) - 1) == 0)
+		{
+			parse_range(s, (char *)s->inputbuf);
+		}
+
+		// See if the client already has a copy of the file
+		if (strncasecmp_P((char *)s->inputbuf, http_if_none_match,
+				sizeof(http_if_none_match) - 1) == 0)
+		{
+			parse_if_none_match(s, (char *)s->inputbuf);
+		}
+
+#if OWFSD_WEBSOCKET
+		// Keep the key of a WebSocket upgrade, which only comes with one
+		if (strncasecmp_P((char *)s->inputbuf, http_sec_websocket_key,
+				sizeof(http_sec_websocket_key) - 1) == 0)
+		{
+			char *key = (char *)s->inputbuf +
+				sizeof(http_sec_websocket_key) - 1;
+
+			key += strspn(key, " \t");
+			if (strcspn(key, " \t\r\n") == OWFSD_WS_KEYLEN) {
+				memcpy(s->ws_key, key, OWFSD_WS_KEYLEN);
+			}
+		}
+#endif
 	}
 
 	PSOCK_END(&s->sock);
 }
 
+#if CONFIG_APPS_WEBSERVER_UPDATE
+/*
+ * Write part of a firmware update request body to flash
+ */
+static void update_write(struct httpd_state *s, const void *buf,
+	uint16_t len)
+{
+	// Ignore anything past the end of the body
+	if (len > s->post_len - s->post_offset) {
+		len = s->post_len - s->post_offset;
+	}
+
+	if (flashmgt_sec_write_block(buf, s->post_offset, len)) {
+		flashmgt_sec_write_abort();
+		s->flags &= ~HTTPD_FLAG_UPDATE;
+		return;
+	}
+
+	s->post_offset += len;
+}
+#endif
+
+/*
+ * Queue the access log record for the response sent, if there was one;
+ * otherwise status is logged, unless it's 0
+ */
+static void log_request(struct httpd_state *s, uint16_t status) {
+	if (s->status) {
+		// Status lines all start "HTTP/1.x "
+		status = (pgm_read_byte(&s->status[9]) - '0') * 100 +
+			(pgm_read_byte(&s->status[10]) - '0') * 10 +
+			(pgm_read_byte(&s->status[11]) - '0');
+	}
+	else if (!status) {
+		return;
+	}
+
+	TRACE(TRACE_HTTPD_DONE, status);
+
+	s->log.status = status;
+	s->log.bytes = s->length;
+	s->log.time = clock_time() - s->start;
+	webserver_log_access(&s->log);
+
+	s->status = NULL;
+}
+
 static PT_THREAD(handle_connection(struct httpd_state *s)) {
 	PT_BEGIN(&s->pt);
 
-	// Read the request
-	PT_WAIT_THREAD(&s->pt, handle_input(s));
+	do {
+		// Log the last request on the connection, now it's been answered
+		log_request(s, 0);
+
+		// An idle connection can be closed to make room for another
+		slot_release(s);
+		s->admit = ((s->flags & HTTPD_FLAG_KEEP_ALIVE) && !uip_newdata()) ?
+			HTTPD_ADMIT_KEPT : HTTPD_ADMIT_NEW;
+
+		// Wait for the next request on a kept-alive connection for a
+		// shorter time
+		if (s->flags & HTTPD_FLAG_KEEP_ALIVE) {
+			timer_set(&s->timer, CLOCK_SECOND * HTTPD_KEEPALIVE_TIMEOUT);
+		}
+
+		// Forget everything about the previous request
+		s->flags = 0;
+		s->etag = 0;
+		s->mime = 0;
+		s->length = -1;
+		s->api = NULL;
+		s->log.path[0] = '\0';
+		s->start = clock_time();
+#if CONFIG_APPS_WEBSERVER_UPDATE
+		s->post_len = 0;
+#endif
+#if OWFSD_WEBSOCKET
+		s->ws_key[0] = '\0';
+#endif
+
+		// Read the request
+		PT_WAIT_THREAD(&s->pt, handle_input(s));
+		TRACE(TRACE_HTTPD_REQ, conns_used);
+
+		// Go back to the normal timeout while we deal with it
+		timer_set(&s->timer, CLOCK_SECOND * HTTPD_TIMEOUT);
+
+		// Anything short-lived that isn't a file goes ahead of files
+		s->admit = HTTPD_ADMIT_BUSY;
+		if (s->route != HTTPD_ROUTE_FILE &&
+			s->route != HTTPD_ROUTE_EVENTS &&
+			s->route != HTTPD_ROUTE_OWFS &&
+			s->route != HTTPD_ROUTE_UPDATE)
+		{
+			s->admit = HTTPD_ADMIT_PRIORITY;
+			priority_used++;
+		}
+
+		if ((s->method == HTTPD_METHOD_INVALID) ||
+			(s->filename[0] == 0))
+		{
+			// Bad request
+			PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_400));
+			break;
+		}
+#if CONFIG_APPS_WEBSERVER_UPDATE
+		else if (s->method == HTTPD_METHOD_POST &&
+			s->route == HTTPD_ROUTE_UPDATE)
+		{
+			// We need to know how much we're going to write
+			if (s->post_len == 0) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_400));
+				break;
+			}
+
+			if (flashmgt_sec_write_start()) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_500));
+				break;
+			}
+			s->flags |= HTTPD_FLAG_UPDATE;
+			s->post_offset = 0;
+
+			// Some of the body probably came in with the headers
+			if (s->sock.readlen) {
+				update_write(s, s->sock.readptr, s->sock.readlen);
+				s->sock.readlen = 0;
+			}
+
+			// Write the rest straight out of each segment as it arrives
+			while (s->post_offset < s->post_len &&
+				(s->flags & HTTPD_FLAG_UPDATE))
+			{
+				PT_YIELD_UNTIL(&s->pt, uip_newdata());
+				update_write(s, uip_appdata, uip_datalen());
+			}
+
+			if (!(s->flags & HTTPD_FLAG_UPDATE)) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_500));
+				break;
+			}
+
+			// Check and apply the new image
+			s->flags &= ~HTTPD_FLAG_UPDATE;
+			if (flashmgt_sec_write_finish()) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_500));
+				break;
+			}
+
+			PT_WAIT_THREAD(&s->pt, send_pstring(s, http_update_done));
+			break;
+		}
+#endif
+		else if (s->method != HTTPD_METHOD_GET) {
+			// Bad request (we don't do any other POSTs)
+			PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_400));
+			break;
+		}
+
+		// Event streams hold the connection open and push events to it
+		if (s->route == HTTPD_ROUTE_EVENTS) {
+			if (events_subscribe(s) < 0) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_503));
+				break;
+			}
+
+			// Start off with the current state of everything; the stream
+			// is logged as soon as it starts, as it never finishes
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_200));
+			log_request(s, 0);
+			s->events = HTTPD_EVENT_NETWORK | HTTPD_EVENT_TIME;
+
+			while (1) {
+				PT_WAIT_UNTIL(&s->pt, s->events);
+				PT_WAIT_THREAD(&s->pt, send_event(s));
+			}
+		}
+
+#if OWFSD_WEBSOCKET
+		// owfsd answers the upgrade and takes the connection over, for
+		// conn_run() to let go of
+		if (s->route == HTTPD_ROUTE_OWFS) {
+			if (!s->ws_key[0]) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_400));
+				break;
+			}
+			if (owfsd_websocket(s->ws_key) < 0) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_503));
+				break;
+			}
+
+			log_request(s, 101);
+			PT_EXIT(&s->pt);
+		}
+#endif
+
+#if CONFIG_LIB_SENSORSTORE
+		// Sensor history is streamed straight out of the dataflash, however
+		// much there is of it, so the length isn't known and the connection
+		// closes at the end
+		int hist = (s->route == HTTPD_ROUTE_HISTORY) ?
+			history_request(s) : 0;
+		if (hist < 0) {
+			PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_503));
+			break;
+		}
+		else if (hist) {
+			// For the content type
+			strcpy_P(s->filename, http_history_txt);
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_200));
+			PT_WAIT_THREAD(&s->pt, send_history(s));
+			break;
+		}
+#endif
+
+#if CONFIG_LIB_TRACE
+		// The trace is a binary download, for looking at offline
+		if (s->route == HTTPD_ROUTE_TRACE) {
+			if (tracedl.s) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_503));
+				break;
+			}
+
+			tracedl.s = s;
+			tracedl.sent = 0;
+			trace_hold();
+
+			s->length = trace_export_size();
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_200));
+			PT_WAIT_THREAD(&s->pt, send_trace(s));
+			continue;
+		}
+#endif
+
+#if CONFIG_APPS_WEBSERVER_METRICS
+		// Metrics take however many segments they take, so the length isn't
+		// known and the connection closes at the end
+		if (s->route == HTTPD_ROUTE_METRICS) {
+			memset(&s->metrics, 0, sizeof(s->metrics));
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_200));
+			PT_WAIT_THREAD(&s->pt, send_metrics(s));
+			break;
+		}
+#endif
+
+		// API calls are generated rather than read from a file
+		if (s->route == HTTPD_ROUTE_API) {
+			s->api = httpd_api(s->filename);
+		}
+		if (s->api) {
+			s->time = clock_seconds();
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_200));
+			continue;
+		}
+
+		// Files only get HTTPD_CONNS slots between them, so there's always
+		// room for API calls; the rest wait their turn for a little while
+		if (s->admit != HTTPD_ADMIT_PRIORITY) {
+			s->queued = clock_time();
+			PT_WAIT_UNTIL(&s->pt, files_used < HTTPD_CONNS ||
+				(clock_time_t)(clock_time() - s->queued) >=
+					CLOCK_SECOND * HTTPD_QUEUE_TIMEOUT);
+			if (files_used >= HTTPD_CONNS) {
+				PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_503));
+				break;
+			}
+			s->admit = HTTPD_ADMIT_FILE;
+			files_used++;
+		}
 
-	if ((s->method == HTTPD_METHOD_INVALID) ||
-		(s->filename[0] == 0))
-	{
-		// Bad request
-		PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_400));
-	}
-	else if (s->method == HTTPD_METHOD_GET) {
 		// Default sendfile flags
 		uint8_t flags = SENDFILE_MODE_NORMAL;
 
@@ -211,105 +1279,264 @@ static PT_THREAD(handle_connection(struct httpd_state *s)) {
 			flags = SENDFILE_MODE_SCRIPT;
 		}
 
+		int ret = -1;
+
+		// Try a pre-compressed copy of the file first (never for scripts,
+		// which need to be parsed)
+		int idx = strlen(s->filename);
+		if ((s->flags & HTTPD_FLAG_ACCEPT_GZIP) &&
+			flags == SENDFILE_MODE_NORMAL &&
+			idx + sizeof(http_gz) <= sizeof(s->filename))
+		{
+			strcpy_P(&s->filename[idx], http_gz);
+			ret = sendfile_init(&s->sendfile, s->filename, flags);
+			if (ret == 0) {
+				s->flags |= HTTPD_FLAG_GZIP;
+				s->etag = file_etag(s->filename, &s->mime);
+			}
+
+			// Put the name back so send_headers sees the real extension
+			s->filename[idx] = '\0';
+		}
+
 		// Init sendfile
-		int ret = sendfile_init(&s->sendfile, s->filename, flags);
+		if (ret < 0) {
+			ret = sendfile_init(&s->sendfile, s->filename, flags);
+
+			// Scripts generate different output every time
+			if (ret == 0 && flags == SENDFILE_MODE_NORMAL) {
+				s->etag = file_etag(s->filename, &s->mime);
+			}
+		}
+
+		// Only the length of static files is known up front
+		if (ret == 0 && flags == SENDFILE_MODE_NORMAL) {
+			s->length = sendfile_length(&s->sendfile);
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+			// Files out of the image stay the same until it changes
+			if (s->etag) {
+				sendfile_cache(&s->sendfile, fs_crc(), s->etag);
+			}
+#endif
+		}
+
 		if (ret < 0) {
 			// Replace the filename as send_headers guesses the content type
 			strcpy_P(s->filename, PSTR("/notfound.html"));
 
-			// Open failed, so send a 404 header
-			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_404));
-
 			// Open the 404 notfound.html file
 			ret = sendfile_init(&s->sendfile, s->filename,
 				SENDFILE_MODE_NORMAL);
 			if (ret < 0) {
 				// We couldn't open the notfound.html file
-				webserver_log_file(&uip_conn->ripaddr,
-					"404 (no notfound.html)");
-
+				s->flags &= ~HTTPD_FLAG_KEEP_ALIVE;
+				PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_404));
 				PT_WAIT_THREAD(&s->pt,
 					send_pstring(s, PSTR("Error 404: resource not found")));
-
-				PSOCK_CLOSE(&s->sock);
-				PT_EXIT(&s->pt);
+				break;
 			}
+			s->length = sendfile_length(&s->sendfile);
 
-			webserver_log_file(&uip_conn->ripaddr, "404 /notfound.html");
+			// Send a 404 header
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_404));
+		}
+		else if (s->etag && (s->flags & HTTPD_FLAG_IF_NONE_MATCH) &&
+			s->inm_etag == s->etag && s->inm_crc == fs_crc())
+		{
+			// The client's copy is current, so just send the headers
+			sendfile_finish(&s->sendfile);
+			s->length = -1;
+			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_304));
 		}
 		else {
-			PT_WAIT_THREAD(&s->pt, send_headers(s, http_header_200));
+			// Work out the status first, as this can't be evaluated again
+			s->status = apply_range(s);
+			PT_WAIT_THREAD(&s->pt, send_headers(s, s->status));
 		}
 
 		// Do the work of sending the file (or script)
-		PT_WAIT_THREAD(&s->pt, sendfile(&s->sendfile, s));
+		if (s->sendfile.open) {
+			PT_WAIT_THREAD(&s->pt, sendfile(&s->sendfile, s));
 
-		// Free sendfile memory
-		sendfile_finish(&s->sendfile);
-	}
-	else {
-		// Bad request (we don't do POST yet)
-		PT_WAIT_THREAD(&s->pt, send_pstring(s, http_header_400));
-	}
+			// Free sendfile memory, and give up on the connection if we
+			// didn't manage to send as much as we said we would
+			if (sendfile_finish(&s->sendfile) < 0) {
+				break;
+			}
+		}
+	} while (s->flags & HTTPD_FLAG_KEEP_ALIVE);
 
 	// Close the socket & finish up
+	log_request(s, 0);
 	PSOCK_CLOSE(&s->sock);
 	PT_END(&s->pt);
 }
 
+/*
+ * Clean up and free a connection's state
+ */
+static void conn_free(struct httpd_state *s) {
+	// A response cut short still gets logged
+	log_request(s, 0);
+
+	// Make sure sendfile is cleaned up
+	sendfile_finish(&s->sendfile);
+
+#if CONFIG_APPS_WEBSERVER_UPDATE
+	// Don't leave a half-written update behind
+	if (s->flags & HTTPD_FLAG_UPDATE) {
+		flashmgt_sec_write_abort();
+	}
+#endif
+
+#if CONFIG_LIB_SENSORSTORE
+	if (history.s == s) {
+		history.s = NULL;
+	}
+#endif
+#if CONFIG_LIB_TRACE
+	trace_done(s);
+#endif
+
+	// Give back the slot, whichever pool it came out of
+	slot_release(s);
+	if (s->flags & HTTPD_FLAG_EVENTS) {
+		events_unsubscribe(s);
+	}
+	else {
+		conns_used--;
+		queue_kick();
+	}
+
+	// Let go of the connection, unless something else has taken it over
+	if (uip_conn->appstate.state == s) {
+		tcp_markconn(uip_conn, NULL);
+	}
+
+	// Free state data
+	memstat_memb_free(MEMSTAT_HTTPD, &conns, s);
+}
+
+/*
+ * Carry on with a connection, and clean up after one handed over
+ */
+static void conn_run(struct httpd_state *s) {
+	handle_connection(s);
+
+#if OWFSD_WEBSOCKET
+	if (uip_conn->appstate.state != s) {
+		conn_free(s);
+	}
+#endif
+}
+
+// Turn a connection away
+static void conn_refuse(void) {
+	struct webserver_log_rec rec = { .bytes = -1, .status = 503 };
+
+	uip_abort();
+	uip_ipaddr_copy(&rec.addr, &uip_conn->ripaddr);
+	webserver_log_access(&rec);
+}
+
+// Give uip_conn a slot and start reading its request
+static void conn_start(void) {
+	struct httpd_state *s = NULL;
+
+	if (conns_used < HTTPD_SLOTS) {
+		s = memstat_memb_alloc(MEMSTAT_HTTPD, &conns);
+	}
+	if (s == NULL) {
+		conn_refuse();
+		return;
+	}
+	memset(s, 0, sizeof(*s));
+	conns_used++;
+	uip_ipaddr_copy(&s->log.addr, &uip_conn->ripaddr);
+
+	// Set up the connection
+	tcp_markconn(uip_conn, s);
+#if !CONFIG_LIB_CONTIKI_IPV6
+	network_tcp_widen(uip_conn);
+#endif
+	PSOCK_INIT(&s->sock, (uint8_t *)s->inputbuf, sizeof(s->inputbuf) - 1);
+	PT_INIT(&s->pt);
+	timer_set(&s->timer, CLOCK_SECOND * HTTPD_TIMEOUT);
+	conn_run(s);
+}
+
+// Try to queue uip_conn for a slot, returns -1 if the queue is full
+static int queue_add(void) {
+	for (uint8_t i = 0; i < HTTPD_QUEUE; i++) {
+		if (queue[i].conn == NULL) {
+			queue[i].conn = uip_conn;
+			queue[i].since = clock_time();
+			tcp_markconn(uip_conn, &queue[i]);
+			uip_stop();
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+// A connection waiting for a slot; they get them in the order they came
+static void queue_appcall(struct httpd_queued *q) {
+	if (uip_closed() || uip_aborted() || uip_timedout()) {
+		q->conn = NULL;
+	}
+	else if (conns_used < HTTPD_SLOTS && queue_first() == q) {
+		q->conn = NULL;
+		uip_restart();
+		conn_start();
+	}
+	else if ((clock_time_t)(clock_time() - q->since) >=
+		CLOCK_SECOND * HTTPD_QUEUE_TIMEOUT)
+	{
+		q->conn = NULL;
+		conn_refuse();
+	}
+}
+
 void httpd_appcall(void *state) {
 	struct httpd_state *s = (struct httpd_state *)state;
 
-	if (uip_closed() || uip_aborted() || uip_timedout()) {
+	if (state >= (void *)queue && state < (void *)&queue[HTTPD_QUEUE]) {
+		queue_appcall(state);
+	}
+	else if (uip_closed() || uip_aborted() || uip_timedout()) {
 		if (s != NULL) {
-			// Make sure sendfile is cleaned up
-			sendfile_finish(&s->sendfile);
-
-			// Free state data
-			free(s);
-			conns_free++;
-			tcp_markconn(uip_conn, NULL);
+			conn_free(s);
 		}
 	}
 	else if (uip_connected()) {
-		// Allocate a connection if we can
-		if (conns_free) {
-			s = calloc(1, sizeof(*s));
-			conns_free--;
-		}
-		else {
-			s = NULL;
+		if (conns_used < HTTPD_SLOTS || queue_add() < 0) {
+			conn_start();
 		}
-
-		// Make sure we got some memory
-		if (s == NULL) {
-			uip_abort();
-			webserver_log_file(&uip_conn->ripaddr, "503 Out of memory");
-			return;
-		}
-
-		// Set up the connection
-		tcp_markconn(uip_conn, s);
-		PSOCK_INIT(&s->sock, (uint8_t *)s->inputbuf, sizeof(s->inputbuf) - 1);
-		PT_INIT(&s->pt);
-		timer_set(&s->timer, CLOCK_SECOND * 10);
-		handle_connection(s);
 	}
 	else if (s != NULL) {
+		// Once the next request starts coming in, it's too late to close
+		if (uip_newdata() && s->admit < HTTPD_ADMIT_BUSY) {
+			s->admit = HTTPD_ADMIT_BUSY;
+		}
+
 		if (uip_poll()) {
-			if (timer_expired(&s->timer)) {
+			if (s->admit == HTTPD_ADMIT_KEPT && queue_first()) {
+				// Someone else could use the slot it's idling in
 				uip_abort();
-
-				// Make sure sendfile is cleaned up
-				sendfile_finish(&s->sendfile);
-
-				// Free state data
-				free(s);
+				conn_free(s);
+				s = NULL;
+			}
+			else if (timer_expired(&s->timer) && (s->flags & HTTPD_FLAG_EVENTS)) {
+				// Idle event streams get a heartbeat instead of a timeout
+				s->events |= HTTPD_EVENT_HEARTBEAT;
+				timer_restart(&s->timer);
+			}
+			else if (timer_expired(&s->timer)) {
+				log_request(s, 408);
+				uip_abort();
+				conn_free(s);
 				s = NULL;
-				tcp_markconn(uip_conn, NULL);
-				conns_free++;
-
-				webserver_log_file(&uip_conn->ripaddr, "408 Connection reset");
 			}
 		}
 		else {
@@ -317,7 +1544,7 @@ void httpd_appcall(void *state) {
 		}
 
 		if (s) {
-			handle_connection(s);
+			conn_run(s);
 		}
 	}
 	else {
@@ -326,7 +1553,19 @@ void httpd_appcall(void *state) {
 }
 
 void httpd_init(void) {
+	static struct notify_sub net_sub;
+#if CONFIG_APPS_TIMESYNC
+	static struct notify_sub timesync_sub;
+#endif
+
+	memb_init(&conns);
 	tcp_listen(UIP_HTONS(80));
+
+	// For the event stream; httpd_event() gets them
+	notify_subscribe(&net_notify, &net_sub);
+#if CONFIG_APPS_TIMESYNC
+	notify_subscribe(&timesync_notify, &timesync_sub);
+#endif
 }
 
 #if UIP_CONF_IPV6
@@ -37,6 +37,38 @@
 
 #include <contiki-net.h>
 #include "sendfile.h"
+#include "webserver.h"
+#include "apps/owfsd.h"
+#if CONFIG_APPS_WEBSERVER_METRICS
+#include "httpd-metrics.h"
+#endif
+
+#ifndef CONFIG_APPS_WEBSERVER_CONNS
+#define HTTPD_CONNS UIP_CONNS
+#else /* CONFIG_APPS_WEBSERVER_CONNS */
+#define HTTPD_CONNS CONFIG_APPS_WEBSERVER_CONNS
+#endif /* CONFIG_APPS_WEBSERVER_CONNS */
+
+#ifndef CONFIG_APPS_WEBSERVER_EVENT_CONNS
+#define HTTPD_EVENT_CONNS 1
+#else /* CONFIG_APPS_WEBSERVER_EVENT_CONNS */
+#define HTTPD_EVENT_CONNS CONFIG_APPS_WEBSERVER_EVENT_CONNS
+#endif /* CONFIG_APPS_WEBSERVER_EVENT_CONNS */
+
+// Slots on top of HTTPD_CONNS for API and metrics requests: files are only
+// ever sent on HTTPD_CONNS connections at once
+#ifndef CONFIG_APPS_WEBSERVER_RESERVED_CONNS
+#define HTTPD_RESERVED_CONNS 1
+#else /* CONFIG_APPS_WEBSERVER_RESERVED_CONNS */
+#define HTTPD_RESERVED_CONNS CONFIG_APPS_WEBSERVER_RESERVED_CONNS
+#endif /* CONFIG_APPS_WEBSERVER_RESERVED_CONNS */
+
+// Connections that can wait for a slot, rather than being turned away
+#ifndef CONFIG_APPS_WEBSERVER_QUEUE
+#define HTTPD_QUEUE 4
+#else /* CONFIG_APPS_WEBSERVER_QUEUE */
+#define HTTPD_QUEUE CONFIG_APPS_WEBSERVER_QUEUE
+#endif /* CONFIG_APPS_WEBSERVER_QUEUE */
 
 #ifndef CONFIG_APPS_WEBSERVER_PATHLEN
 #define HTTPD_PATHLEN 80
@@ -44,22 +76,106 @@
 #define HTTPD_PATHLEN CONFIG_APPS_WEBSERVER_PATHLEN
 #endif /* CONFIG_APPS_WEBSERVER_PATHLEN */
 
+#ifndef CONFIG_APPS_WEBSERVER_KEEPALIVE_TIMEOUT
+#define HTTPD_KEEPALIVE_TIMEOUT 5
+#else /* CONFIG_APPS_WEBSERVER_KEEPALIVE_TIMEOUT */
+#define HTTPD_KEEPALIVE_TIMEOUT CONFIG_APPS_WEBSERVER_KEEPALIVE_TIMEOUT
+#endif /* CONFIG_APPS_WEBSERVER_KEEPALIVE_TIMEOUT */
+
+// Seconds to wait for a client before giving up on it
+#define HTTPD_TIMEOUT 10
+
+// Seconds a connection waits for a slot (or a file request for its turn)
+// before it gets a 503
+#define HTTPD_QUEUE_TIMEOUT 2
+
 #define HTTPD_METHOD_INVALID 0
 #define HTTPD_METHOD_GET 1
 #define HTTPD_METHOD_POST 2
 
+// What handles a request, from the route table in httpd.c
+#define HTTPD_ROUTE_FILE 0 // a file (or nothing)
+#define HTTPD_ROUTE_API 1 // an API call under /api/
+#define HTTPD_ROUTE_EVENTS 2 // the event stream
+#define HTTPD_ROUTE_HISTORY 3 // sensor history
+#define HTTPD_ROUTE_TRACE 4 // the event trace
+#define HTTPD_ROUTE_UPDATE 5 // firmware upload
+#define HTTPD_ROUTE_OWFS 6 // WebSocket to owfsd
+#define HTTPD_ROUTE_METRICS 7 // Prometheus metrics
+
+#define HTTPD_FLAG_ACCEPT_GZIP 0x01 // client accepts gzip encoding
+#define HTTPD_FLAG_GZIP 0x02 // sending a pre-compressed .gz file
+#define HTTPD_FLAG_IF_NONE_MATCH 0x04 // client sent an ETag we understand
+#define HTTPD_FLAG_KEEP_ALIVE 0x08 // keep the connection open after this
+#define HTTPD_FLAG_EVENTS 0x10 // connection is an event stream
+#define HTTPD_FLAG_PARTIAL 0x20 // skipping the rest of a long header line
+#define HTTPD_FLAG_RANGE 0x40 // client asked for a byte range
+#define HTTPD_FLAG_UPDATE 0x80 // writing a firmware update to flash
+
+// What a connection's slot is being used for
+#define HTTPD_ADMIT_NEW 0 // waiting for the first request
+#define HTTPD_ADMIT_KEPT 1 // kept alive, waiting for another request
+#define HTTPD_ADMIT_BUSY 2 // reading a request, or not counted
+#define HTTPD_ADMIT_FILE 3 // sending a file, one of HTTPD_CONNS
+#define HTTPD_ADMIT_PRIORITY 4 // answering an API or metrics request
+
+// Events pushed to event stream connections
+#define HTTPD_EVENT_NETWORK 0x01
+#define HTTPD_EVENT_TIME 0x02
+#define HTTPD_EVENT_HEARTBEAT 0x04
+
+struct httpd_state;
+
+// Native API call, which writes its response body into buf
+typedef int (*httpd_api_fn)(struct httpd_state *s, char *buf, int len);
+
 struct httpd_state {
 	struct timer timer;
 	struct psock sock;
 	struct pt pt;
 	uint8_t inputbuf[HTTPD_PATHLEN + 30];
 	uint8_t method;
+	uint8_t route; // HTTPD_ROUTE_* for the path
+	uint8_t flags;
+	uint8_t admit; // HTTPD_ADMIT_* for the slot
+	clock_time_t queued; // clock_time() a file request started waiting
+	httpd_api_fn api; // API call generating the response (NULL if none)
+	uint8_t events; // events waiting to be pushed (HTTPD_EVENT_*)
+	uint8_t event; // event being pushed
+	uint8_t mime; // POLYFS_MIME_* type of the file sent (0 if unknown)
+	uint32_t time; // clock_seconds() when the request was read
+	PGM_P status; // status line being sent
+	int body; // bytes of the file sent along with the headers
+	int32_t length; // length of the response body (-1 if unknown)
+	int32_t range_start; // first byte of the range (-1 for a suffix range)
+	int32_t range_end; // last byte of the range (-1 if open ended)
+	int32_t range_total; // length of the whole file a range came from
+	uint32_t etag; // ETag of the file being sent (0 if none)
+#if CONFIG_APPS_WEBSERVER_UPDATE
+	uint32_t post_len; // length of the request body (0 if not given)
+	uint32_t post_offset; // bytes of the request body written so far
+#endif
+	uint32_t inm_crc; // fs CRC from If-None-Match
+	uint32_t inm_etag; // file ETag from If-None-Match
+#if OWFSD_WEBSOCKET
+	char ws_key[OWFSD_WS_KEYLEN]; // Sec-WebSocket-Key (empty if none)
+#endif
+#if CONFIG_APPS_WEBSERVER_METRICS
+	struct httpd_metrics metrics; // start of the segment being sent
+	struct httpd_metrics metrics_next; // and the end of it
+#endif
 	char filename[HTTPD_PATHLEN];
 	struct sendfile_state sendfile;
+	clock_time_t start; // clock_time() when the request line came in
+	struct webserver_log_rec log; // filled in as the request goes along
 };
 
 void httpd_init(void);
 void httpd_appcall(void *state);
+// API or metrics requests are being answered, so files should hold back
+int httpd_priority_busy(void);
+// Pass on other process events to event stream connections
+void httpd_event(process_event_t ev, process_data_t data);
 
 #if UIP_CONF_IPV6
 uint8_t httpd_sprint_ip6(uip_ip6addr_t addr, char * result);
@@ -22,7 +22,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <contiki-net.h>
+#include <trace.h>
+#if CONFIG_APPS_SYSLOG
+#include "apps/syslog.h"
+#endif
 #include "sendfile.h"
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+#include "apps/network.h"
+#include "txcache.h"
+#endif
 
 #include <stdio.h>
 
@@ -34,25 +42,96 @@
 #define REASON_ERROR 2
 #define REASON_SCRIPT 3
 
+// The file being sent, the innermost include (NULL if none is open)
+#define TOP(s) ((s)->depth ? &(s)->stack[(s)->depth - 1] : NULL)
+
+// Suffix of the directive index files made by tools/shtmlindex.pl
+static const char PROGMEM sendfile_idx[] = ".idx";
+
+/*
+ * Load the position of the next directive from a file's index
+ */
+static void next_directive(struct sendfile_file_state *f) {
+	uint8_t rec[6];
+
+	// Once the index runs out there are no more directives
+	if (cfs_read(f->ifd, rec, sizeof(rec)) != sizeof(rec)) {
+		f->dpos = f->len;
+		f->dlen = 0;
+		return;
+	}
+
+	// Records are a little-endian uint32 offset and uint16 length
+	f->dpos = (uint32_t)rec[0] | ((uint32_t)rec[1] << 8) |
+		((uint32_t)rec[2] << 16) | ((uint32_t)rec[3] << 24);
+	f->dlen = rec[4] | (rec[5] << 8);
+}
+
+/*
+ * Read from the current send offset of a file
+ */
+static int read_at(struct sendfile_file_state *fs, void *buf, int want) {
+	// Seek to the offset to send from, but only if the fd isn't already
+	// there (which it is unless this is a retransmit)
+	if (fs->rpos != fs->fpos) {
+		if (cfs_seek(fs->fd, fs->fpos, CFS_SEEK_SET) != fs->fpos) {
+			return -1;
+		}
+		fs->rpos = fs->fpos;
+	}
+
+	int ret = cfs_read(fs->fd, buf, want);
+	if (ret > 0) {
+		fs->rpos += ret;
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+		if (fs->cache) {
+			txcache_fill(fs->cache, fs->fpos, buf, ret);
+		}
+#endif
+	}
+	TRACE(TRACE_SF_READ, ret);
+
+	return ret;
+}
+
 static unsigned short generator(void *state) {
 	struct sendfile_state *s = state;
-	struct sendfile_file_state *fs = list_head(s->stack);
+	struct sendfile_file_state *fs = TOP(s);
+	int want = UIP_TCP_MSS;
 
-	// Seek to the offset to send from (this could be different to the fd
-	// internal offset due to retransmits)
-	cfs_offset_t ret = cfs_seek(fs->fd, fs->fpos, CFS_SEEK_SET);
-	if (ret != fs->fpos) {
-		s->reason = REASON_ERROR;
+	// A retransmit must resend exactly what we sent last time, which is
+	// still in the read-ahead or block cache so only read that much again
+	if (uip_rexmit() && fs->ret > 0) {
+		want = fs->ret;
+	}
 
-		// Because we can't send nothing from this function, we send a single
-		// space character. This should be the most neutral when dealing with
-		// HTML
-		((char *)uip_appdata)[0] = ' ';
-		return 1;
+	// With an index we know where the next directive is, so stop there
+	if (s->mode == SENDFILE_MODE_SCRIPT && fs->ifd >= 0 &&
+		fs->dpos - fs->fpos < want)
+	{
+		want = fs->dpos - fs->fpos;
 	}
 
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+	// Have the NIC send what it already has a copy of
+	if (fs->cache && fs->fpos < txcache_filled(fs->cache)) {
+		uint16_t have = txcache_filled(fs->cache) - fs->fpos;
+
+		if (want > have) {
+			want = have;
+		}
+		if (want > fs->len - fs->fpos) {
+			want = fs->len - fs->fpos;
+		}
+
+		network_send_sram(txcache_addr(fs->cache, fs->fpos), want);
+		fs->ret = want;
+		return want;
+	}
+#endif
+
 	// Copy file data into uip_appdata
-	fs->ret = cfs_read(fs->fd, uip_appdata, UIP_TCP_MSS);
+	fs->ret = read_at(fs, uip_appdata, want);
 	if (fs->ret < 0) {
 		s->reason = REASON_ERROR;
 
@@ -63,8 +142,8 @@ static unsigned short generator(void *state) {
 		return 1;
 	}
 
-	// Extra processing for script mode
-	if (s->mode == SENDFILE_MODE_SCRIPT) {
+	// Extra processing for script mode (unless the index did it for us)
+	if (s->mode == SENDFILE_MODE_SCRIPT && fs->ifd < 0) {
 		// If the last char of the buffer is %, shorten the buffer by 1
 		if (((char *)uip_appdata)[fs->ret - 1] == '%') {
 			fs->ret--;
@@ -99,7 +178,7 @@ static unsigned short generator(void *state) {
 }
 
 static PT_THREAD(send_part(struct sendfile_state *s, struct psock *sock)) {
-	struct sendfile_file_state *fs = list_head(s->stack);
+	struct sendfile_file_state *fs = TOP(s);
 	PSOCK_BEGIN(sock);
 
 	// Clear the finish reason
@@ -107,12 +186,23 @@ static PT_THREAD(send_part(struct sendfile_state *s, struct psock *sock)) {
 
 	while (1) {
 		// Check if we've reached the end of file
-		cfs_offset_t len = cfs_seek(fs->fd, 0, CFS_SEEK_END);
-		if (fs->fpos >= len) {
+		if (fs->fpos >= fs->len) {
 			s->reason = REASON_EOF;
 			break;
 		}
 
+		// Check if we've reached an indexed directive
+		if (s->mode == SENDFILE_MODE_SCRIPT && fs->ifd >= 0 &&
+			fs->fpos >= fs->dpos)
+		{
+			s->reason = REASON_SCRIPT;
+			break;
+		}
+
+		// While API requests are being answered, only send a segment
+		// each time the connection is polled
+		PSOCK_WAIT_UNTIL(sock, !httpd_priority_busy() || uip_poll());
+
 		// Send some of the file
 		PSOCK_GENERATOR_SEND(sock, generator, s);
 
@@ -130,27 +220,65 @@ static PT_THREAD(send_part(struct sendfile_state *s, struct psock *sock)) {
 	PSOCK_END(sock);
 }
 
+#if HTTPD_CGI_CACHE
+static PT_THREAD(send_fragment(struct httpd_cgi_fragment *f,
+	struct psock *sock))
+{
+	PSOCK_BEGIN(sock);
+
+	if (f->len) {
+		PSOCK_SEND(sock, (uint8_t *)f->data, f->len);
+	}
+
+	PSOCK_END(sock);
+}
+#endif
+
 /*
  * Open a file and push it onto the stack
  */
 static int openfile(struct sendfile_state *s, const char *file) {
 	struct sendfile_file_state *f;
 
-	// First try to allocate enough memory to fit the state structure
-	f = calloc(1, sizeof(*f));
-	if (f == NULL) {
-		return -1;
+	if (s->depth >= SENDFILE_DEPTH) {
+		return SENDFILE_ERR_DEPTH;
 	}
 
+	f = &s->stack[s->depth];
+	memset(f, 0, sizeof(*f));
+
 	// Try to open the file
 	f->fd = cfs_open(file, CFS_READ);
 	if (f->fd < 0) {
-		free(f);
-		return f->fd;
+		return -1;
 	}
 
-	// Push it to the stack
-	list_push(s->stack, f);
+	// Find the file length once, then go back to the start
+	f->len = cfs_seek(f->fd, 0, CFS_SEEK_END);
+	if (f->len == (cfs_offset_t)-1 ||
+		cfs_seek(f->fd, 0, CFS_SEEK_SET) != 0)
+	{
+		cfs_close(f->fd);
+		return -1;
+	}
+
+	// Scripts may have a directive index alongside them
+	f->ifd = -1;
+	if (s->mode == SENDFILE_MODE_SCRIPT &&
+		strlen(file) + sizeof(sendfile_idx) <= HTTPD_PATHLEN)
+	{
+		char name[HTTPD_PATHLEN];
+
+		strcpy(name, file);
+		strcat_P(name, sendfile_idx);
+		f->ifd = cfs_open(name, CFS_READ);
+		if (f->ifd >= 0) {
+			next_directive(f);
+		}
+	}
+
+	// Push it on the stack
+	s->depth++;
 
 	return 0;
 }
@@ -161,20 +289,23 @@ static int openfile(struct sendfile_state *s, const char *file) {
 static int closefile(struct sendfile_state *s) {
 	struct sendfile_file_state *f;
 
-	// Grab the first file off the stack
-	f = list_pop(s->stack);
-	if (!f) {
+	// Take the top file off the stack
+	if (!s->depth) {
 		// Nothing left on the stack
 		return -1;
 	}
+	f = &s->stack[--s->depth];
 
 	// Close the file
 	if (f->fd) {
 		cfs_close(f->fd);
 	}
-
-	// Free up memory
-	free(f);
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+	txcache_put(f->cache);
+#endif
+	if (f->ifd >= 0) {
+		cfs_close(f->ifd);
+	}
 
 	return 0;
 }
@@ -185,8 +316,11 @@ int sendfile_init(struct sendfile_state *s, const char *file, uint8_t mode) {
 		return -1;
 	}
 
-	// Init our file stack list
-	LIST_STRUCT_INIT(s, stack);
+	// Start with an empty stack
+	s->depth = 0;
+
+	// Set the mode first as openfile() needs it
+	s->mode = mode;
 
 	// Try to open the first file
 	int ret = openfile(s, file);
@@ -195,7 +329,6 @@ int sendfile_init(struct sendfile_state *s, const char *file, uint8_t mode) {
 	}
 
 	// Set the flags
-	s->mode = mode;
 	s->open = 1;
 
 	// Set up the protothread
@@ -204,6 +337,52 @@ int sendfile_init(struct sendfile_state *s, const char *file, uint8_t mode) {
 	return 0;
 }
 
+int sendfile_read(struct sendfile_state *s, void *buf, int len) {
+	struct sendfile_file_state *fs = TOP(s);
+	if (!s->open || fs == NULL || s->mode != SENDFILE_MODE_NORMAL) {
+		return 0;
+	}
+
+	return read_at(fs, buf, len);
+}
+
+void sendfile_range(struct sendfile_state *s, cfs_offset_t start,
+	cfs_offset_t end)
+{
+	struct sendfile_file_state *fs = TOP(s);
+	if (s->open && fs != NULL) {
+		fs->fpos = start;
+		fs->len = end;
+	}
+}
+
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+void sendfile_cache(struct sendfile_state *s, uint32_t crc, uint32_t etag) {
+	struct sendfile_file_state *fs = TOP(s);
+	if (s->open && fs != NULL && s->mode == SENDFILE_MODE_NORMAL &&
+		!fs->cache)
+	{
+		fs->cache = txcache_get(crc, etag, fs->len);
+	}
+}
+#endif
+
+void sendfile_skip(struct sendfile_state *s, int len) {
+	struct sendfile_file_state *fs = TOP(s);
+	if (s->open && fs != NULL) {
+		fs->fpos += len;
+	}
+}
+
+cfs_offset_t sendfile_length(struct sendfile_state *s) {
+	struct sendfile_file_state *fs = TOP(s);
+	if (!s->open || fs == NULL) {
+		return -1;
+	}
+
+	return fs->len;
+}
+
 PT_THREAD(sendfile(struct sendfile_state *s, struct httpd_state *hs)) {
 	PT_BEGIN(&s->pt);
 
@@ -216,19 +395,19 @@ PT_THREAD(sendfile(struct sendfile_state *s, struct httpd_state *hs)) {
 			closefile(s);
 
 			// Break out the loop if there are no more files
-			if (!list_head(s->stack)) {
+			if (!s->depth) {
 				break;
 			}
 		}
 		if (s->reason == REASON_ERROR) {
 			// Go through and clear all the open files
-			while (list_head(s->stack)) {
+			while (s->depth) {
 				closefile(s);
 			}
 			break;
 		}
 		else if (s->reason == REASON_SCRIPT) {
-			struct sendfile_file_state *fs = list_head(s->stack);
+			struct sendfile_file_state *fs = TOP(s);
 			char *buf = uip_appdata;
 			size_t len = 0;
 			uint8_t include = 0;
@@ -238,9 +417,29 @@ PT_THREAD(sendfile(struct sendfile_state *s, struct httpd_state *hs)) {
 
 			// Seek to that offset
 			cfs_seek(fs->fd, fs->fpos, CFS_SEEK_SET);
+			fs->rpos = fs->fpos;
+
+			// The index tells us exactly how long the directive is
+			if (fs->ifd >= 0) {
+				len = fs->dlen;
+				if (len > UIP_TCP_MSS - 1) {
+					len = UIP_TCP_MSS - 1;
+				}
+
+				int err = cfs_read(fs->fd, buf, len);
+				if (err < 0 || (size_t)err != len) {
+					s->reason = REASON_ERROR;
+					break;
+				}
+				fs->rpos += err;
+
+				// Skip over the CGI call line (and trailing NL)
+				fs->fpos += fs->dlen + 1;
+				next_directive(fs);
+			}
 
 			// Read into the buffer until we hit a newline or EOF
-			while (len < UIP_TCP_MSS) {
+			while (fs->ifd < 0 && len < UIP_TCP_MSS) {
 				// Read as much as we can
 				int err = cfs_read(fs->fd, &buf[len], UIP_TCP_MSS - len);
 				if (err < 0) {
@@ -252,6 +451,7 @@ PT_THREAD(sendfile(struct sendfile_state *s, struct httpd_state *hs)) {
 				}
 
 				len += err;
+				fs->rpos += err;
 
 				// Check if there's a NL in the buffer
 				char *nl = memchr(buf, '\n', len);
@@ -288,20 +488,45 @@ PT_THREAD(sendfile(struct sendfile_state *s, struct httpd_state *hs)) {
 				// Push a file open on to the stack
 				int err = openfile(s, buf);
 				if (err) {
+#if CONFIG_APPS_SYSLOG
+					if (err == SENDFILE_ERR_DEPTH) {
+						syslog_P(LOG_LOCAL0 | LOG_WARNING,
+							PSTR("%s: includes nested over %u deep"),
+							buf, SENDFILE_DEPTH);
+					}
+#endif
 					s->reason = REASON_ERROR;
 					break;
 				}
 			}
 			else {
 				char *args = buf;
+				struct httpd_cgi_call call;
 
 				// Work out where the script arguments start
 				strsep_P(&args, PSTR(" \t"));
 
-				// Get a pointer to the CGI function
-				s->spare = httpd_cgi(buf);
+				// Look up the CGI function
+				httpd_cgi_find(buf, &call);
+
+#if HTTPD_CGI_CACHE
+				// Send its fragment, from the cache if there's a copy
+				if (call.render) {
+					s->spare = httpd_cgi_fragment_get(&call,
+						args ? args : "");
+					if (s->spare) {
+						s->fragment = 1;
+						PT_WAIT_THREAD(&s->pt, send_fragment(s->spare,
+							&hs->sock));
+						httpd_cgi_fragment_put(s->spare);
+						s->fragment = 0;
+					}
+					continue;
+				}
+#endif
 
 				// Run the script
+				s->spare = call.function;
 				PT_WAIT_THREAD(&s->pt, ((httpd_cgifunction)s->spare)(hs, args));
 			}
 		}
@@ -320,10 +545,18 @@ int sendfile_finish(struct sendfile_state *s) {
 	s->open = 0;
 
 	// Go through and clear all the open files
-	while (list_head(s->stack)) {
+	while (s->depth) {
 		closefile(s);
 	}
 
+#if HTTPD_CGI_CACHE
+	// Let go of a fragment cut short
+	if (s->fragment) {
+		httpd_cgi_fragment_put(s->spare);
+		s->fragment = 0;
+	}
+#endif
+
 	// Make sure our thread is exited
 	PT_EXIT(&s->pt);
 
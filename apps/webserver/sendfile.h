@@ -27,27 +27,61 @@
 #define SENDFILE_MODE_NORMAL 0x00
 #define SENDFILE_MODE_SCRIPT 0x01
 
+// How deep includes can nest, counting the file being sent
+#ifndef CONFIG_APPS_WEBSERVER_INCLUDE_DEPTH
+#define SENDFILE_DEPTH 3
+#else /* CONFIG_APPS_WEBSERVER_INCLUDE_DEPTH */
+#define SENDFILE_DEPTH CONFIG_APPS_WEBSERVER_INCLUDE_DEPTH
+#endif /* CONFIG_APPS_WEBSERVER_INCLUDE_DEPTH */
+
+// Error opening an include: they are already nested SENDFILE_DEPTH deep
+#define SENDFILE_ERR_DEPTH -2
+
 struct httpd_state;
 
+// State for each file in a sendfile stack
+struct sendfile_file_state {
+	int fd;
+	cfs_offset_t fpos; // offset of the data being sent
+	cfs_offset_t rpos; // offset the fd is at after the last read
+	cfs_offset_t len; // length of the file
+	int ret;
+	int ifd; // fd of the directive index (-1 if there isn't one)
+	cfs_offset_t dpos; // offset of the next directive (if indexed)
+	uint16_t dlen; // length of the next directive (if indexed)
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+	uint8_t cache; // txcache entry for the file, or 0
+#endif
+};
+
 // State for the entire sendfile machine
 struct sendfile_state {
 	uint8_t open : 1;
 	uint8_t mode : 2;
 	uint8_t reason : 4;
+	uint8_t fragment : 1; // spare is a CGI fragment being sent
+	uint8_t depth; // files open in stack, the last of them being sent
 	struct pt pt;
-	void *spare;
-	LIST_STRUCT(stack);
-};
-
-// State for each file in a sendfile stack
-struct sendfile_file_state {
-	struct sendfile_file_state *next;
-	int fd;
-	cfs_offset_t fpos;
-	int ret;
+	void *spare; // CGI function running, or fragment being sent
+	struct sendfile_file_state stack[SENDFILE_DEPTH];
 };
 
 int sendfile_init(struct sendfile_state *s, const char *file, uint8_t mode);
+// Length of the file sendfile_init() opened
+cfs_offset_t sendfile_length(struct sendfile_state *s);
+// Only send the part of the file from start up to (not including) end
+void sendfile_range(struct sendfile_state *s, cfs_offset_t start,
+	cfs_offset_t end);
+#if CONFIG_APPS_WEBSERVER_TXCACHE
+// Keep a copy of the file sendfile_init() opened (normal mode only) in the
+// NIC, known by the CRC of its image and its etag, and send from it
+void sendfile_cache(struct sendfile_state *s, uint32_t crc, uint32_t etag);
+#endif
+
+// Read from the current offset without sending (normal mode only), then
+// move the offset past what was sent some other way
+int sendfile_read(struct sendfile_state *s, void *buf, int len);
+void sendfile_skip(struct sendfile_state *s, int len);
 PT_THREAD(sendfile(struct sendfile_state *s, struct httpd_state *hs));
 int sendfile_finish(struct sendfile_state *s);
 
@@ -0,0 +1,188 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "drivers/enc424j600.h"
+
+#include "txcache.h"
+
+#if !CONFIG_DRIVERS_ENC424J600_CHKSUM || !ENC424J600_CACHESIZE
+#error APPS_WEBSERVER_TXCACHE needs DRIVERS_ENC424J600_CHKSUM and DRIVERS_ENC424J600_CACHE
+#endif
+
+#define CACHE_END (ENC424J600_CACHESTART + ENC424J600_CACHESIZE)
+
+struct txcache_entry {
+	uint32_t crc;
+	uint32_t etag;
+	uint16_t addr; // start of the copy in NIC SRAM
+	uint16_t len; // length of the file, 0 if the entry is free
+	uint16_t filled;
+	uint16_t used; // stamp of the last txcache_get()
+	uint8_t refs;
+};
+
+static struct txcache_entry entries[TXCACHE_ENTRIES];
+static uint16_t stamp;
+
+#define ENTRY(e) (&entries[(e) - 1])
+
+// Does [addr, addr + len) miss every entry?
+static uint8_t space_free(uint16_t addr, uint16_t len) {
+	for (uint8_t i = 0; i < TXCACHE_ENTRIES; i++) {
+		struct txcache_entry *c = &entries[i];
+
+		if (c->len && addr < c->addr + c->len && c->addr < addr + len) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Find len bytes of SRAM nothing is using: either the start of the cache
+// or straight after some entry. Returns 0 if there's no gap big enough.
+static uint16_t find_space(uint16_t len) {
+	uint16_t addr = ENC424J600_CACHESTART;
+	uint8_t i = 0;
+
+	do {
+		if (addr + len <= CACHE_END && space_free(addr, len)) {
+			return addr;
+		}
+
+		// Try after the next entry instead
+		while (i < TXCACHE_ENTRIES && !entries[i].len) {
+			i++;
+		}
+		if (i < TXCACHE_ENTRIES) {
+			addr = entries[i].addr + entries[i].len;
+		}
+	} while (i++ < TXCACHE_ENTRIES);
+
+	return 0;
+}
+
+// Free the least recently used entry nobody holds. Returns 0 if there isn't
+// one, otherwise the entry number.
+static uint8_t evict(void) {
+	struct txcache_entry *victim = NULL;
+
+	for (uint8_t i = 0; i < TXCACHE_ENTRIES; i++) {
+		struct txcache_entry *c = &entries[i];
+
+		if (c->len && !c->refs &&
+			(!victim || (uint16_t)(stamp - c->used) >
+				(uint16_t)(stamp - victim->used)))
+		{
+			victim = c;
+		}
+	}
+
+	if (!victim) {
+		return 0;
+	}
+
+	victim->len = 0;
+	return victim - entries + 1;
+}
+
+uint8_t txcache_get(uint32_t crc, uint32_t etag, uint32_t len) {
+	struct txcache_entry *c;
+	uint16_t addr;
+	uint8_t e = 0;
+
+	if (len == 0 || len > TXCACHE_MAX || len > ENC424J600_CACHESIZE) {
+		return 0;
+	}
+
+	stamp++;
+
+	for (uint8_t i = 0; i < TXCACHE_ENTRIES; i++) {
+		c = &entries[i];
+
+		if (c->len == len && c->crc == crc && c->etag == etag) {
+			c->used = stamp;
+			c->refs++;
+			return i + 1;
+		}
+		else if (!c->len && !e) {
+			e = i + 1;
+		}
+	}
+
+	// Make room, which may also free up an entry to use
+	while (!(addr = find_space(len)) || !e) {
+		uint8_t freed = evict();
+		if (!freed) {
+			return 0;
+		}
+		else if (!e) {
+			e = freed;
+		}
+	}
+
+	c = ENTRY(e);
+	c->crc = crc;
+	c->etag = etag;
+	c->addr = addr;
+	c->len = len;
+	c->filled = 0;
+	c->used = stamp;
+	c->refs = 1;
+
+	return e;
+}
+
+void txcache_put(uint8_t entry) {
+	if (entry && ENTRY(entry)->refs) {
+		ENTRY(entry)->refs--;
+	}
+}
+
+uint16_t txcache_filled(uint8_t entry) {
+	return ENTRY(entry)->filled;
+}
+
+uint16_t txcache_addr(uint8_t entry, uint16_t offset) {
+	return ENTRY(entry)->addr + offset;
+}
+
+void txcache_fill(uint8_t entry, uint32_t offset, const void *data,
+	uint16_t len)
+{
+	struct txcache_entry *c = ENTRY(entry);
+	uint16_t skip;
+
+	// Only carry on from the end of what's there
+	if (offset > c->filled || offset + len <= c->filled) {
+		return;
+	}
+	skip = c->filled - offset;
+	len -= skip;
+	if (len > c->len - c->filled) {
+		len = c->len - c->filled;
+	}
+
+	enc424j600WriteSRAM(c->addr + c->filled, (uint8_t *)data + skip, len);
+	c->filled += len;
+}
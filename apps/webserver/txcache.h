@@ -0,0 +1,68 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef TXCACHE_H_
+#define TXCACHE_H_
+
+#include <stdint.h>
+
+/*
+ * Copies of small static files kept in the ENC424J600's spare SRAM (see
+ * DRIVERS_ENC424J600_CACHE). Sending a file from there again needs no
+ * dataflash reads and no payload over SPI, as the NIC's DMA engine copies
+ * the data straight into each frame (see network_send_sram()).
+ *
+ * A file is known by the CRC of the image it's in and its etag. The copy is
+ * filled in as the file is first sent, in order, and can be sent from as
+ * far as it's been filled. Users hold a reference to an entry, so it isn't
+ * reused while segments sent out of it may still need retransmitting; the
+ * least recently used entry nobody holds gives up its space first.
+ */
+
+// Files kept at once
+#ifndef CONFIG_APPS_WEBSERVER_TXCACHE_ENTRIES
+#define TXCACHE_ENTRIES 8
+#else
+#define TXCACHE_ENTRIES CONFIG_APPS_WEBSERVER_TXCACHE_ENTRIES
+#endif
+
+// Largest file worth keeping
+#ifndef CONFIG_APPS_WEBSERVER_TXCACHE_MAX
+#define TXCACHE_MAX 4096
+#else
+#define TXCACHE_MAX CONFIG_APPS_WEBSERVER_TXCACHE_MAX
+#endif
+
+// Find the copy of a file len bytes long, or make room for one. Returns the
+// entry (with a reference held), or 0 if the file can't be kept.
+uint8_t txcache_get(uint32_t crc, uint32_t etag, uint32_t len);
+// Give up a reference from txcache_get()
+void txcache_put(uint8_t entry);
+
+// Bytes from the start of the file that are in the copy
+uint16_t txcache_filled(uint8_t entry);
+// NIC SRAM address of a file offset
+uint16_t txcache_addr(uint8_t entry, uint16_t offset);
+// Add data read from the file at offset; anything that doesn't carry on
+// from what's already there is ignored
+void txcache_fill(uint8_t entry, uint32_t offset, const void *data,
+	uint16_t len);
+
+#endif
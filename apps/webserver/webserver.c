@@ -47,37 +47,92 @@
 PROCESS(webserver_process, "Webserver");
 INIT_PROCESS(webserver_process);
 
-PROCESS_THREAD(webserver_process, ev, data) {
-	PROCESS_BEGIN();
-
-	process_start(&tcpip_process, NULL);
-	httpd_init();
+static struct webserver_log_rec log_ring[WEBSERVER_LOG_RECORDS];
+static uint8_t log_head; // oldest record
+static uint8_t log_count;
+static uint16_t log_dropped; // records overwritten before they went out
 
-	while(1) {
-		PROCESS_WAIT_EVENT_UNTIL(ev == tcpip_event);
-		httpd_appcall(data);
+void webserver_log_access(const struct webserver_log_rec *rec) {
+	if (log_count == WEBSERVER_LOG_RECORDS) {
+		log_head = (log_head + 1) % WEBSERVER_LOG_RECORDS;
+		log_count--;
+		log_dropped++;
 	}
 
-	PROCESS_END();
+	memcpy(&log_ring[(log_head + log_count) % WEBSERVER_LOG_RECORDS],
+		rec, sizeof(*rec));
+	log_count++;
+
+	process_poll(&webserver_process);
 }
 
-void webserver_log_file(uip_ipaddr_t *requester, char *file) {
+// Send out every queued record
+static void log_flush(void) {
 #if LOG_CONF_ENABLED
-	/* Print out IP address of requesting host. */
+#if UIP_CONF_IPV6
+	char addr[48];
+#else
+	char addr[16];
+#endif /* UIP_CONF_IPV6 */
+	char bytes[12];
+
+	if (log_dropped) {
+		syslog_P(LOG_LOCAL0 | LOG_WARNING,
+			PSTR("%u access log records lost"), log_dropped);
+		log_dropped = 0;
+	}
+
+	while (log_count) {
+		const struct webserver_log_rec *rec = &log_ring[log_head];
 
 #if UIP_CONF_IPV6
-	char buf[48];
-	httpd_sprint_ip6(*requester, buf);
+		httpd_sprint_ip6(rec->addr, addr);
 #else
-	char buf[20];
-	sprintf_P(buf, PSTR("%d.%d.%d.%d"), uip_ipaddr_to_quad(requester));
+		sprintf_P(addr, PSTR("%d.%d.%d.%d"), uip_ipaddr_to_quad(&rec->addr));
 #endif /* UIP_CONF_IPV6 */
 
-	syslog_P(LOG_LOCAL0 | LOG_INFO, PSTR("%s: %s"), buf, file);
+		if (rec->bytes < 0) {
+			strcpy_P(bytes, PSTR("-"));
+		}
+		else {
+			sprintf_P(bytes, PSTR("%ld"), (long)rec->bytes);
+		}
+
+		syslog_P(LOG_LOCAL0 | LOG_INFO, PSTR("%s: \"%s\" %u %s %lums"),
+			addr, rec->path, rec->status, bytes,
+			(uint32_t)rec->time * 1000 / CLOCK_SECOND);
+
+		log_head = (log_head + 1) % WEBSERVER_LOG_RECORDS;
+		log_count--;
+	}
+#else
+	log_count = 0;
+	log_dropped = 0;
 #endif /* LOG_CONF_ENABLED */
 }
 
+PROCESS_THREAD(webserver_process, ev, data) {
+	PROCESS_BEGIN();
+
+	process_start(&tcpip_process, NULL);
+	httpd_init();
+
+	while(1) {
+		PROCESS_WAIT_EVENT();
+		if (ev == tcpip_event) {
+			httpd_appcall(data);
+		}
+		else if (ev == PROCESS_EVENT_POLL) {
+			log_flush();
+		}
+		else {
+			httpd_event(ev, data);
+		}
+	}
+
+	PROCESS_END();
+}
+
 void webserver_log(char *msg) {
 	syslog_P(LOG_LOCAL0 | LOG_INFO, PSTR("%s"), msg);
 }
-
@@ -37,9 +37,38 @@
 
 #include "contiki-net.h"
 
+#ifndef CONFIG_APPS_WEBSERVER_LOG_RECORDS
+#define WEBSERVER_LOG_RECORDS 8
+#else /* CONFIG_APPS_WEBSERVER_LOG_RECORDS */
+#define WEBSERVER_LOG_RECORDS CONFIG_APPS_WEBSERVER_LOG_RECORDS
+#endif /* CONFIG_APPS_WEBSERVER_LOG_RECORDS */
+
+// Bytes of the request path kept in each record, the NUL included; longer
+// paths are cut short
+#ifndef CONFIG_APPS_WEBSERVER_LOG_PATH
+#define WEBSERVER_LOG_PATH 24
+#else /* CONFIG_APPS_WEBSERVER_LOG_PATH */
+#define WEBSERVER_LOG_PATH CONFIG_APPS_WEBSERVER_LOG_PATH
+#endif /* CONFIG_APPS_WEBSERVER_LOG_PATH */
+
+// One line of the access log
+struct webserver_log_rec {
+	uip_ipaddr_t addr; // client
+	int32_t bytes; // response body, -1 if not known
+	clock_time_t time; // from the request line to the end of the response
+	uint16_t status; // HTTP status code
+	char path[WEBSERVER_LOG_PATH]; // without the leading "/www"
+};
+
 PROCESS_NAME(webserver_process);
 
 void webserver_log(char *msg);
-void webserver_log_file(uip_ipaddr_t *requester, char *file);
+
+/*
+ * Queue an access log record. This only copies it into a ring buffer (the
+ * oldest record makes way when it is full); the webserver process formats
+ * and sends out everything queued the next time it runs.
+ */
+void webserver_log_access(const struct webserver_log_rec *rec);
 
 #endif /* __WEBSERVER_H__ */
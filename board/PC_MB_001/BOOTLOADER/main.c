@@ -267,12 +267,17 @@ int main(void) {
 		uart_puts("Applying code update. Please wait...\r\n");
 
 		// Run the flashmgmt bootloader code
-		int ret = flashmgt_bootload();
+		uint16_t written;
+		int ret = flashmgt_bootload(&written);
 		if (ret) {
 			uart_puts("Code update failed!\r\n");
 		}
 		else {
-			uart_puts("Code has been updated.\r\n");
+			char num[6];
+
+			uart_puts("Code has been updated (");
+			uart_puts(utoa(written, num, 10));
+			uart_puts(" pages changed).\r\n");
 		}
 
 		// Reboot
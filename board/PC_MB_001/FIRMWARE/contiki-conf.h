@@ -52,11 +52,17 @@
 #define UIP_CONF_MAX_LISTENPORTS	5
 #define UIP_CONF_TCP_SPLIT			1
 
-#define UIP_CONF_BUFFER_SIZE		1280
+// Room for two full-size TCP segments (see network_tcp_widen())
+#define UIP_CONF_BUFFER_SIZE		(14 + 40 + 2 * 1460)
 #define UIP_CONF_STATISTICS			1
 #define UIP_CONF_LOGGING			0
 #define UIP_CONF_BROADCAST			1
 
+// TCP/UDP checksums are done by the ENC424J600 (see apps/network.c)
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+#define UIP_ARCH_CHKSUM				1
+#endif
+
 typedef uint16_t uip_stats_t;
 typedef uint16_t clock_time_t;
 
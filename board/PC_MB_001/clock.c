@@ -24,6 +24,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
+#include <board.h>
 
 static volatile clock_time_t count;
 static volatile uint16_t scount;
@@ -77,8 +78,12 @@ ISR(TIMER0_COMPA_vect) {
 		seconds++;
 	}
 
-	// Call the etimer code if we need to
-	if (etimer_pending()) {
+	// Call the etimer code only once the next timer is due, otherwise the
+	// etimer process gets polled every tick and the CPU never idles
+	if (etimer_pending() &&
+		(clock_time_t)(etimer_next_expiration_time() - count - 1) >
+		(clock_time_t)~0 / 2)
+	{
 		etimer_request_poll();
 	}
 }
@@ -128,3 +133,41 @@ uint32_t clock_seconds(void) {
 	return tmp;
 }
 
+// Timer0 counts since the start of the current second, as of now
+static uint16_t clock_sub(uint32_t *sec) {
+	uint16_t sub;
+	uint8_t pending = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t t = TCNT0;
+
+		// The match may have cleared TCNT0 without the ISR running yet
+		if (TIFR0 & _BV(OCF0A)) {
+			t = TCNT0;
+			pending = 1;
+		}
+
+		*sec = seconds;
+		sub = scount * (OCRMATCHVAL + 1) + t;
+		if (pending) {
+			sub += OCRMATCHVAL + 1;
+		}
+	}
+
+	return sub;
+}
+
+uint32_t clock_cycles(void) {
+	uint32_t sec;
+	uint16_t sub = clock_sub(&sec);
+
+	return sec * F_CPU + (uint32_t)sub * PRESCALER;
+}
+
+uint32_t clock_us(void) {
+	uint32_t sec;
+	uint16_t sub = clock_sub(&sec);
+
+	return sec * 1000000 + (uint32_t)sub * PRESCALER / (F_CPU / 1000000);
+}
+
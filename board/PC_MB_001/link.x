@@ -109,6 +109,17 @@ SECTIONS
 	KEEP(*(_init_components))
 	 __init_components_end = . ;
 
+	/* Init functions run one at a time once everything else is going */
+	 __init_deferred_start = . ;
+	*(_init_deferred)
+	KEEP(*(_init_deferred))
+	 __init_deferred_end = . ;
+
+	/* Web server CGI calls, sorted by name for binary searching */
+	 __httpd_cgi_start = . ;
+	KEEP(*(SORT_BY_NAME(_httpd_cgi.*)))
+	 __httpd_cgi_end = . ;
+
      __trampolines_start = . ;
     /* The jump trampolines for the 16-bit limited relocs will reside here.  */
     *(.trampolines)
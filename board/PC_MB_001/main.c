@@ -26,11 +26,36 @@
 #if CONFIG_WATCHDOG
 #include <avr/wdt.h>
 #endif
+#if CONFIG_IDLE_SLEEP
+#include <avr/sleep.h>
+#endif
 
 #include <init.h>
 #include <board.h>
 #include <apps/serial.h>
 
+#if CONFIG_IDLE_SLEEP
+/*
+ * Idle sleep stops only the CPU clock, so every peripheral keeps running and
+ * any interrupt (NIC INT, UART, TWI, the clock tick) wakes us. Checking for
+ * events with interrupts off closes the window where an ISR polls a process
+ * just before we go to sleep: the instruction after sei() always runs before
+ * any pending interrupt, so sleep_cpu() is reached and woken straight away.
+ */
+static void idle(void) {
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	cli();
+	if (process_nevents() == 0) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+}
+#endif
+
 int main(void) {
 	// Basic board init
 	board_init();
@@ -67,7 +92,13 @@ int main(void) {
 #endif
 
 		// Run processes
+#if CONFIG_IDLE_SLEEP
+		if (process_run() == 0) {
+			idle();
+		}
+#else
 		process_run();
+#endif
 	}
 
 	return 0;
@@ -0,0 +1,365 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Benchmark image for simavr.
+ *
+ * Timer1 counts every CPU cycle, so under simavr the figures are exact and
+ * repeatable. Once the system is up the benchmark process runs each test
+ * below and prints one line per test on UART0:
+ *
+ *   BENCH <name> <iterations> <total cycles> <cycles per iteration>
+ *
+ * followed by "BENCH done". Run it with something like:
+ *
+ *   simavr -m atmega1284p -f 8000000 SIMAVR-BENCH.elf
+ *
+ * The file system tests read polyfs images linked into flash, so they
+ * measure the CPU side of polyfs and not dataflash transfer time.
+ */
+
+#include <contiki-net.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include <init.h>
+#include <polyfs.h>
+#include <polyfs_cfs.h>
+#include "minilzo/minilzo.h"
+#include "lzo_avr.h"
+#include "urlconv.h"
+
+#include "bench.h"
+
+// Images built by the Makefile and linked in with objcopy
+extern const uint8_t _binary_bench_pfs_start[] PROGMEM;
+extern const uint8_t _binary_bench_pfs_end[] PROGMEM;
+extern const uint8_t _binary_bench_lzo_pfs_start[] PROGMEM;
+extern const uint8_t _binary_bench_lzo_pfs_end[] PROGMEM;
+
+#define BIG_FILE "/www/big.html"
+#define SHTML_FILE "/www/index.shtml"
+
+// httpd sends files a segment at a time
+#define SEND_CHUNK UIP_TCP_MSS
+
+struct bench {
+	PGM_P name;
+	void (*setup)(void); // run before each iteration, not timed
+	void (*run)(void);
+	uint16_t iterations;
+};
+
+struct image {
+	const uint8_t *start;
+	uint32_t size;
+};
+
+static volatile uint16_t overflows;
+static uint32_t boot_cycles;
+
+static polyfs_fs_t raw_fs, lzo_fs;
+static struct image raw_image, lzo_image;
+
+static uint8_t buf[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+static uint8_t cbuf[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+static uint16_t cbuf_len;
+
+PROCESS(bench_process, "Benchmarks");
+INIT_PROCESS(bench_process);
+
+ISR(TIMER1_OVF_vect) {
+	overflows++;
+}
+
+void bench_start(void) {
+	TCCR1A = 0;
+	TCNT1 = 0;
+	TIFR1 = _BV(TOV1);
+	TIMSK1 = _BV(TOIE1);
+	TCCR1B = _BV(CS10); // clk/1
+}
+
+void bench_boot_done(void) {
+	boot_cycles = bench_cycles();
+}
+
+uint32_t bench_cycles(void) {
+	uint16_t hi, lo;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		lo = TCNT1;
+		hi = overflows;
+
+		// Account for an overflow that hasn't been serviced yet
+		if ((TIFR1 & _BV(TOV1)) && lo < 0x8000) {
+			hi++;
+		}
+	}
+
+	return ((uint32_t)hi << 16) | lo;
+}
+
+static int image_read(polyfs_fs_t *fs, void *ptr, uint32_t offset,
+	uint32_t bytes)
+{
+	const struct image *img = fs->userptr;
+
+	if (offset >= img->size) {
+		return 0;
+	}
+	if (bytes > img->size - offset) {
+		bytes = img->size - offset;
+	}
+
+	memcpy_P(ptr, img->start + offset, bytes);
+	return bytes;
+}
+
+static int image_open(polyfs_fs_t *fs, struct image *img,
+	const uint8_t *start, const uint8_t *end)
+{
+	img->start = start;
+	img->size = end - start;
+
+	fs->fn_read = image_read;
+	fs->userptr = img;
+
+	return polyfs_fs_open(fs);
+}
+
+static void report(PGM_P name, uint16_t iterations, uint32_t total) {
+	printf_P(PSTR("BENCH %S %u %lu %lu\n"), name, iterations, total,
+		total / iterations);
+}
+
+/*
+ * The benchmarks
+ */
+
+static void flush_caches(void) {
+	polyfs_cache_flush(NULL);
+}
+
+static void nothing(void) {
+}
+
+static void run_crc32(void) {
+	polyfs_crc32(0, buf, POLYFS_BLOCK_SIZE);
+}
+
+// Pull the first compressed block of the big file out of the LZO image
+static void setup_lzo(void) {
+	struct polyfs_inode inode;
+	uint32_t start, end;
+
+	if (cbuf_len || polyfs_lookup(&lzo_fs, BIG_FILE, &inode)) {
+		return;
+	}
+
+	// Block pointers, then the data (see polyfs_fs.h)
+	start = (uint32_t)inode.offset << 2;
+	image_read(&lzo_fs, &end, start, sizeof(end));
+	start += 4 * ((inode.size + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE);
+
+	if (end > start && end - start <= sizeof(cbuf)) {
+		cbuf_len = image_read(&lzo_fs, cbuf, start, end - start);
+	}
+}
+
+static void run_lzo(void) {
+	lzo_uint len = sizeof(buf);
+
+	lzo1x_decompress_safe(cbuf, cbuf_len, buf, &len, NULL);
+}
+
+static void run_lzo_avr(void) {
+	uint16_t len = sizeof(buf);
+
+	lzo1x_decompress_avr(cbuf, cbuf_len, buf, &len);
+}
+
+static void run_urlconv(void) {
+	char out[64];
+
+	urlconv_tofilename(out, "/", sizeof(out));
+	urlconv_tofilename(out, "/media/styles.css", sizeof(out));
+	urlconv_tofilename(out, "/a/./b/../../c%20d/index.shtml?x=1", sizeof(out));
+}
+
+static void run_lookup(void) {
+	struct polyfs_inode inode;
+
+	polyfs_lookup(&raw_fs, BIG_FILE, &inode);
+}
+
+static void read_file(polyfs_fs_t *fs, uint16_t chunk) {
+	struct polyfs_inode inode;
+	polyfs_blkptr_t bp;
+	uint32_t offset = 0;
+	int32_t ret;
+
+	if (polyfs_lookup(fs, BIG_FILE, &inode)) {
+		return;
+	}
+
+	bp.count = 0;
+	do {
+		ret = polyfs_fread_blkptr(fs, &inode, &bp, buf, offset, chunk);
+		offset += ret;
+	} while (ret > 0);
+}
+
+static void run_fread_raw(void) {
+	read_file(&raw_fs, POLYFS_BLOCK_SIZE);
+}
+
+static void run_fread_lzo(void) {
+	read_file(&lzo_fs, POLYFS_BLOCK_SIZE);
+}
+
+// What httpd does for a static file: open it and send it a segment at a time
+static void send_file(const char *name) {
+	int fd = cfs_open(name, CFS_READ);
+
+	if (fd < 0) {
+		return;
+	}
+	while (cfs_read(fd, buf, SEND_CHUNK) > 0) {}
+	cfs_close(fd);
+}
+
+static void run_serve(void) {
+	send_file(BIG_FILE);
+}
+
+/*
+ * A script: read it a line at a time and send each include, the same
+ * file work the webserver does for a page. Building the HTTP response
+ * itself needs a live connection, so that part is not covered.
+ */
+static void run_shtml(void) {
+	int fd = cfs_open(SHTML_FILE, CFS_READ);
+	uint16_t len = 0;
+	int ret;
+
+	if (fd < 0) {
+		return;
+	}
+
+	while ((ret = cfs_read(fd, &buf[len], 1)) > 0) {
+		if (buf[len] != '\n' && len < SEND_CHUNK - 1) {
+			len++;
+			continue;
+		}
+
+		buf[len] = '\0';
+		if (strncmp_P((char *)buf, PSTR("%!:"), 3) == 0) {
+			send_file((char *)&buf[3]);
+		}
+		len = 0;
+	}
+
+	cfs_close(fd);
+}
+
+static const char name_overhead[] PROGMEM = "overhead";
+static const char name_crc32[] PROGMEM = "crc32_1k";
+static const char name_lzo[] PROGMEM = "lzo1x_decompress_1k";
+static const char name_lzo_avr[] PROGMEM = "lzo1x_decompress_avr_1k";
+static const char name_urlconv[] PROGMEM = "urlconv_tofilename_x3";
+static const char name_lookup_cold[] PROGMEM = "polyfs_lookup_cold";
+static const char name_lookup_warm[] PROGMEM = "polyfs_lookup_warm";
+static const char name_fread_raw[] PROGMEM = "polyfs_fread_20k";
+static const char name_fread_lzo[] PROGMEM = "polyfs_fread_lzo_20k";
+static const char name_serve[] PROGMEM = "serve_20k";
+static const char name_shtml[] PROGMEM = "shtml_includes";
+
+static const struct bench benches[] PROGMEM = {
+	{ name_overhead, NULL, nothing, 100 },
+	{ name_crc32, NULL, run_crc32, 20 },
+	{ name_lzo, setup_lzo, run_lzo, 20 },
+	{ name_lzo_avr, setup_lzo, run_lzo_avr, 20 },
+	{ name_urlconv, NULL, run_urlconv, 100 },
+	{ name_lookup_cold, flush_caches, run_lookup, 20 },
+	{ name_lookup_warm, NULL, run_lookup, 20 },
+	{ name_fread_raw, flush_caches, run_fread_raw, 5 },
+	{ name_fread_lzo, flush_caches, run_fread_lzo, 5 },
+	{ name_serve, flush_caches, run_serve, 5 },
+	{ name_shtml, flush_caches, run_shtml, 5 },
+};
+
+static void run_bench(const struct bench *b) {
+	struct bench bench;
+	uint32_t total = 0;
+
+	memcpy_P(&bench, b, sizeof(bench));
+
+	for (uint16_t i = 0; i < bench.iterations; i++) {
+		if (bench.setup) {
+			bench.setup();
+		}
+
+		uint32_t start = bench_cycles();
+		bench.run();
+		total += bench_cycles() - start;
+	}
+
+	report(bench.name, bench.iterations, total);
+}
+
+PROCESS_THREAD(bench_process, ev, data) {
+	static struct etimer et;
+	static uint8_t i;
+
+	PROCESS_BEGIN();
+
+	memset(buf, 0x5a, sizeof(buf));
+
+	polyfs_init();
+	if (image_open(&raw_fs, &raw_image,
+			_binary_bench_pfs_start, _binary_bench_pfs_end) ||
+		image_open(&lzo_fs, &lzo_image,
+			_binary_bench_lzo_pfs_start, _binary_bench_lzo_pfs_end))
+	{
+		printf_P(PSTR("BENCH error opening images\n"));
+		PROCESS_EXIT();
+	}
+	polyfs_cfs_fs = &raw_fs;
+
+	report(PSTR("boot"), 1, boot_cycles);
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		run_bench(&benches[i]);
+
+		// Let the serial process drain what we printed so far
+		etimer_set(&et, CLOCK_SECOND / 10);
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+	}
+
+	printf_P(PSTR("BENCH done\n"));
+
+	PROCESS_END();
+}
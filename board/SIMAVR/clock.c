@@ -24,6 +24,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
+#include <board.h>
 
 static volatile clock_time_t count;
 static volatile uint16_t scount;
@@ -77,8 +78,12 @@ ISR(TIMER0_COMPA_vect) {
 		seconds++;
 	}
 
-	// Call the etimer code if we need to
-	if (etimer_pending()) {
+	// Call the etimer code only once the next timer is due, otherwise the
+	// etimer process gets polled every tick and the CPU never idles
+	if (etimer_pending() &&
+		(clock_time_t)(etimer_next_expiration_time() - count - 1) >
+		(clock_time_t)~0 / 2)
+	{
 		etimer_request_poll();
 	}
 
@@ -130,3 +135,33 @@ uint32_t clock_seconds(void) {
 	return tmp;
 }
 
+// Timer0 counts since the start of the current second, as of now
+static uint16_t clock_sub(uint32_t *sec) {
+	uint16_t sub;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		// TCNT0 is only cleared by the ISR, so it keeps counting up past
+		// a match that hasn't been handled yet
+		uint8_t t = TCNT0;
+
+		*sec = seconds;
+		sub = scount * (OCRMATCHVAL + 1) + t;
+	}
+
+	return sub;
+}
+
+uint32_t clock_cycles(void) {
+	uint32_t sec;
+	uint16_t sub = clock_sub(&sec);
+
+	return sec * F_CPU + (uint32_t)sub * PRESCALER;
+}
+
+uint32_t clock_us(void) {
+	uint32_t sec;
+	uint16_t sub = clock_sub(&sec);
+
+	return sec * 1000000 + (uint32_t)sub * PRESCALER / (F_CPU / 1000000);
+}
+
@@ -26,7 +26,16 @@
 #include <init.h>
 #include <board.h>
 
+#if CONFIG_BENCH
+#include "bench.h"
+#endif
+
 int main(void) {
+#if CONFIG_BENCH
+	// Count cycles from here on
+	bench_start();
+#endif
+
 	// Basic board init
 	board_init();
 
@@ -39,6 +48,10 @@ int main(void) {
 	// Initialise everything else
 	init_doinit();
 
+#if CONFIG_BENCH
+	bench_boot_done();
+#endif
+
 	while (1) {
 		// Run processes
 		process_run();
@@ -57,6 +57,11 @@
 #define UIP_CONF_LOGGING			0
 #define UIP_CONF_BROADCAST			1
 
+// TCP/UDP checksums are done by the ENC424J600 (see apps/network.c)
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+#define UIP_ARCH_CHKSUM				1
+#endif
+
 typedef uint16_t uip_stats_t;
 typedef uint16_t clock_time_t;
 
@@ -23,6 +23,7 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <init.h>
+#include <trace.h>
 
 #include "dataflash.h"
 #include "spi.h"
@@ -76,20 +77,43 @@ static const dataflash_sector_t sectors[] PROGMEM = {
 	{ 0xf8000, 0xfffff }, // 18: 32K
 };
 
+#define SECTORS (sizeof(sectors) / sizeof(dataflash_sector_t))
+
 static struct {
 	int inited : 1;
+	int busy : 1; // a program or erase may still be running
+	int wel : 1; // shadow of SREG WEL...
+	int wel_known : 1; // ...valid while this is set
 } status;
 
+/*
+ * Shadow of the per-sector protection, so that programs and erases don't need
+ * to ask the device before every command. A sector's bit in prot_known says
+ * whether its bit in prot can be trusted; unknown sectors are read from the
+ * device the first time they're needed.
+ */
+static uint32_t prot_known;
+static uint32_t prot;
+
+#ifndef CONFIG_DRIVERS_DATAFLASH_SPI_CLOCK
+#define DATAFLASH_SPI_CLOCK SPI_CLK_DIV2
+#else
+#define DATAFLASH_SPI_CLOCK CONFIG_DRIVERS_DATAFLASH_SPI_CLOCK
+#endif
+
+static const spi_device_t dataflash_spi = {
+	&CONFIG_DRIVERS_DATAFLASH_PORT, CONFIG_DRIVERS_DATAFLASH_CS,
+	DATAFLASH_SPI_CLOCK | SPI_MODE0,
+};
+
 // Set up SPI and assert CS
 static inline void dev_assert(void) {
-	spi_init();
-	CONFIG_DRIVERS_DATAFLASH_PORT &= ~_BV(CONFIG_DRIVERS_DATAFLASH_CS);
+	spi_acquire(&dataflash_spi);
 }
 
 // Release CS and release SPI
 static inline void dev_release(void) {
-	CONFIG_DRIVERS_DATAFLASH_PORT |= _BV(CONFIG_DRIVERS_DATAFLASH_CS);
-	spi_release();
+	spi_release(&dataflash_spi);
 }
 
 static inline void send_address(uint32_t addr) {
@@ -99,6 +123,88 @@ static inline void send_address(uint32_t addr) {
 	}
 }
 
+// Start a read at addr
+static inline void start_read(uint32_t addr) {
+	// Send command
+	spi_rw(CMD_RD_ARRAY); // fast read is good for the full SPI clock range
+
+	// Send address
+	send_address(addr);
+
+	// Fast read needs a dummy byte before the data
+	spi_rw(0x00);
+}
+
+// Index of the protection sector holding addr, or -1
+static int8_t sector_idx(uint32_t addr) {
+	dataflash_sector_t sector;
+
+	// Everything below the small sectors at the top is in 64K sectors
+	if (addr < 0xf0000) {
+		return addr >> 16;
+	}
+
+	for (uint8_t i = 15; i < SECTORS; i++) {
+		if (dataflash_sector_by_idx(i, &sector) == 0 &&
+			sector.start <= addr && sector.end >= addr)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Remember the protection state of a sector
+static void prot_update(int8_t idx, uint8_t protected) {
+	if (idx < 0) {
+		return;
+	}
+
+	prot_known |= (uint32_t)1 << idx;
+	if (protected) {
+		prot |= (uint32_t)1 << idx;
+	}
+	else {
+		prot &= ~((uint32_t)1 << idx);
+	}
+}
+
+// Is the sector at addr unprotected? Asks the device only if we don't know
+static int sector_writable(uint32_t addr) {
+	int8_t idx = sector_idx(addr);
+	uint8_t value;
+
+	if (idx < 0) {
+		return 0;
+	}
+
+	if (!(prot_known & ((uint32_t)1 << idx))) {
+		if (dataflash_read_protection(addr, &value)) {
+			return 0;
+		}
+	}
+
+	return !(prot & ((uint32_t)1 << idx));
+}
+
+// Is WEL set? Asks the device only if we don't know
+static int write_enabled(void) {
+	uint8_t sreg;
+
+	if (!status.wel_known && dataflash_read_status(&sreg)) {
+		return 0;
+	}
+
+	return status.wel;
+}
+
+// Any program, erase or register write clears WEL when it's accepted
+static inline void wel_clear(void) {
+	status.wel = 0;
+	status.wel_known = 1;
+}
+
 static int dataflash_init(void) {
 	// Make sure CS is pulled high (release device)
 	CONFIG_DRIVERS_DATAFLASH_DDR |= _BV(CONFIG_DRIVERS_DATAFLASH_CS);
@@ -123,7 +229,9 @@ static int dataflash_init(void) {
 	// save state
 	status.inited = 1;
 
-	return 0;
+	// find out if anything is still running from before a reset
+	uint8_t sreg;
+	return dataflash_read_status(&sreg);
 }
 
 int dataflash_read_id(dataflash_id_t *id, uint8_t *extinfo, uint8_t bufsz) {
@@ -234,6 +342,13 @@ int dataflash_read_status(uint8_t *sreg) {
 	// All done
 	dev_release();
 
+	// Keep track of whether the device is busy
+	status.busy = (*sreg & DATAFLASH_SREG_BUSY) ? 1 : 0;
+
+	// Refresh the WEL shadow while we're at it
+	status.wel = (*sreg & DATAFLASH_SREG_WEL) ? 1 : 0;
+	status.wel_known = 1;
+
 	return 0;
 }
 
@@ -255,9 +370,32 @@ int dataflash_write_status(uint8_t sreg) {
 	// All done
 	dev_release();
 
+	// Bits 5:2 all set or all clear globally protect or unprotect every
+	// sector (if SPRL allowed it); anything else leaves them alone
+	if ((sreg & 0x3c) == 0x3c || (sreg & 0x3c) == 0x00) {
+		prot_known = 0;
+	}
+	wel_clear();
+
 	return 0;
 }
 
+int dataflash_busy(void) {
+	uint8_t sreg;
+
+	// Nothing was started since the device was last seen idle
+	if (!status.busy) {
+		return 0;
+	}
+
+	// A single short status read, this never waits
+	if (dataflash_read_status(&sreg)) {
+		return 0;
+	}
+
+	return status.busy;
+}
+
 int dataflash_wait_ready(void) {
 	uint8_t sreg;
 
@@ -266,19 +404,15 @@ int dataflash_wait_ready(void) {
 		return -1;
 	}
 
-	// Start talking
-	dev_assert();
-
-	// Send command
-	spi_rw(CMD_RD_SREG);
-
-	// Read status
+	// Re-read the status each time rather than holding chip-select for the
+	// whole erase, so the bus is free between polls
+	TRACE(TRACE_DF_WAIT, 0);
+	uint16_t polls = 0;
 	do {
-		sreg = spi_rw(0x00);
+		dataflash_read_status(&sreg);
+		polls++;
 	} while (sreg & DATAFLASH_SREG_BUSY);
-
-	// All done
-	dev_release();
+	TRACE(TRACE_DF_READY, polls);
 
 	return 0;
 }
@@ -302,19 +436,21 @@ int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes) {
 		bytes = FLASH_SIZE - offset;
 	}
 
+	// Wait for any program or erase to finish
+	if (status.busy) {
+		dataflash_wait_ready();
+	}
+
+	TRACE(TRACE_DF_READ, bytes);
+
 	// Start talking
 	dev_assert();
 
-	// Send command
-	spi_rw(CMD_RD_ARRAY_LF); // "low frequency" is 33 MHz or less
-
-	// Send address
-	send_address(offset);
+	// Send command and address
+	start_read(offset);
 
 	// Read data
-	for (uint32_t i = 0; i < bytes; i++) {
-		*(cbuf++) = spi_rw(0x00);
-	}
+	spi_read_block(cbuf, bytes);
 
 	// All done
 	dev_release();
@@ -322,12 +458,66 @@ int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes) {
 	return bytes;
 }
 
+int dataflash_read_data_multi(const dataflash_iovec_t *iov, uint8_t count,
+	uint32_t offset)
+{
+	uint32_t total = 0;
+
+	// Make sure init has been called
+	if (!status.inited) {
+		return -1;
+	}
+
+	// Sanity-check the inputs
+	if (offset >= FLASH_SIZE) {
+		return -1;
+	}
+
+	// Wait for any program or erase to finish
+	if (status.busy) {
+		dataflash_wait_ready();
+	}
+
+	// Start talking
+	dev_assert();
+
+	// Send command and address
+	start_read(offset);
+
+	// Fill each buffer in turn from consecutive addresses
+	for (uint8_t i = 0; i < count; i++) {
+		uint32_t bytes = iov[i].len;
+
+		// Don't run off the end of the device
+		if (offset + total + bytes > FLASH_SIZE) {
+			bytes = FLASH_SIZE - (offset + total);
+		}
+
+		if (bytes == 0) {
+			break;
+		}
+
+		spi_read_block(iov[i].buf, bytes);
+		total += bytes;
+	}
+
+	// All done
+	dev_release();
+
+	return total;
+}
+
 int dataflash_write_enable(void) {
 	// Make sure init has been called
 	if (!status.inited) {
 		return -1;
 	}
 
+	// The device ignores WREN while a program or erase is running
+	if (status.busy) {
+		dataflash_wait_ready();
+	}
+
 	// Start talking
 	dev_assert();
 
@@ -337,6 +527,9 @@ int dataflash_write_enable(void) {
 	// All done
 	dev_release();
 
+	status.wel = 1;
+	status.wel_known = 1;
+
 	return 0;
 }
 
@@ -355,6 +548,8 @@ int dataflash_write_disable(void) {
 	// All done
 	dev_release();
 
+	wel_clear();
+
 	return 0;
 }
 
@@ -402,6 +597,9 @@ int dataflash_protect_sector(uint32_t addr) {
 	// All done
 	dev_release();
 
+	prot_update(sector_idx(addr), 1);
+	wel_clear();
+
 	return 0;
 }
 
@@ -449,6 +647,9 @@ int dataflash_unprotect_sector(uint32_t addr) {
 	// All done
 	dev_release();
 
+	prot_update(sector_idx(addr), 0);
+	wel_clear();
+
 	return 0;
 }
 
@@ -478,12 +679,12 @@ int dataflash_read_protection(uint32_t addr, uint8_t *value) {
 	// All done
 	dev_release();
 
+	prot_update(sector_idx(addr), *value);
+
 	return 0;
 }
 
 int dataflash_erase_4k(uint32_t addr) {
-	int err;
-	uint8_t temp;
 
 	// Make sure init has been called
 	if (!status.inited) {
@@ -495,32 +696,22 @@ int dataflash_erase_4k(uint32_t addr) {
 		return -1;
 	}
 
-	// Read sector protection information
-	err = dataflash_read_protection(addr, &temp);
-	if (err) {
-		return err;
-	}
-
 	// Check that the sector isn't protected
-	if (temp != 0x00) {
+	if (!sector_writable(addr)) {
 		dataflash_write_disable();
 		return -1;
 	}
 
-	// Get the current device status
-	err = dataflash_read_status(&temp);
-	if (err) {
-		return err;
-	}
-
 	// Check that WEL is set
-	if (!(temp & DATAFLASH_SREG_WEL)) {
+	if (!write_enabled()) {
 		return -1;
 	}
 
 	// Start talking
 	dev_assert();
 
+	TRACE(TRACE_DF_ERASE, addr >> 12);
+
 	// Send command
 	spi_rw(CMD_ERASE_BLK_4K);
 
@@ -530,12 +721,14 @@ int dataflash_erase_4k(uint32_t addr) {
 	// All done
 	dev_release();
 
+	// The device stays busy until the operation completes
+	status.busy = 1;
+	wel_clear();
+
 	return 0;
 }
 
 int dataflash_erase_32k(uint32_t addr) {
-	int err;
-	uint8_t temp;
 	uint32_t start = addr & DATAFLASH_SECTOR_32K_MASK;
 	uint32_t end = start + DATAFLASH_SECTOR_32K_SIZE;
 	dataflash_sector_t sector;
@@ -555,14 +748,8 @@ int dataflash_erase_32k(uint32_t addr) {
 
 	// Go through all the sectors in this erase block
 	do {
-		// Read sector protection information
-		err = dataflash_read_protection(sector.start, &temp);
-		if (err) {
-			return err;
-		}
-
 		// Check that the sector isn't protected
-		if (temp != 0x00) {
+		if (!sector_writable(sector.start)) {
 			dataflash_write_disable();
 			return -1;
 		}
@@ -573,20 +760,16 @@ int dataflash_erase_32k(uint32_t addr) {
 		}
 	} while (sector.end < end);
 
-	// Get the current device status
-	err = dataflash_read_status(&temp);
-	if (err) {
-		return err;
-	}
-
 	// Check that WEL is set
-	if (!(temp & DATAFLASH_SREG_WEL)) {
+	if (!write_enabled()) {
 		return -1;
 	}
 
 	// Start talking
 	dev_assert();
 
+	TRACE(TRACE_DF_ERASE, addr >> 12);
+
 	// Send command
 	spi_rw(CMD_ERASE_BLK_32K);
 
@@ -596,12 +779,14 @@ int dataflash_erase_32k(uint32_t addr) {
 	// All done
 	dev_release();
 
+	// The device stays busy until the operation completes
+	status.busy = 1;
+	wel_clear();
+
 	return 0;
 }
 
 int dataflash_erase_64k(uint32_t addr) {
-	int err;
-	uint8_t temp;
 	uint32_t start = addr & DATAFLASH_SECTOR_64K_MASK;
 	uint32_t end = start + DATAFLASH_SECTOR_64K_SIZE;
 	dataflash_sector_t sector;
@@ -621,14 +806,8 @@ int dataflash_erase_64k(uint32_t addr) {
 
 	// Go through all the sectors in this erase block
 	do {
-		// Read sector protection information
-		err = dataflash_read_protection(sector.start, &temp);
-		if (err) {
-			return err;
-		}
-
 		// Check that the sector isn't protected
-		if (temp != 0x00) {
+		if (!sector_writable(sector.start)) {
 			dataflash_write_disable();
 			return -1;
 		}
@@ -639,20 +818,16 @@ int dataflash_erase_64k(uint32_t addr) {
 		}
 	} while (sector.end < end);
 
-	// Get the current device status
-	err = dataflash_read_status(&temp);
-	if (err) {
-		return err;
-	}
-
 	// Check that WEL is set
-	if (!(temp & DATAFLASH_SREG_WEL)) {
+	if (!write_enabled()) {
 		return -1;
 	}
 
 	// Start talking
 	dev_assert();
 
+	TRACE(TRACE_DF_ERASE, addr >> 12);
+
 	// Send command
 	spi_rw(CMD_ERASE_BLK_64K);
 
@@ -662,6 +837,10 @@ int dataflash_erase_64k(uint32_t addr) {
 	// All done
 	dev_release();
 
+	// The device stays busy until the operation completes
+	status.busy = 1;
+	wel_clear();
+
 	return 0;
 }
 
@@ -694,12 +873,18 @@ int dataflash_erase_chip(void) {
 	// Start talking
 	dev_assert();
 
+	TRACE(TRACE_DF_ERASE, 0xffff);
+
 	// Send command
 	spi_rw(CMD_ERASE_CHIP);
 
 	// All done
 	dev_release();
 
+	// The device stays busy until the operation completes
+	status.busy = 1;
+	wel_clear();
+
 	return 0;
 }
 
@@ -707,8 +892,6 @@ int dataflash_write_data(const void *buf, uint32_t addr, uint16_t bytes) {
 	uint8_t *cbuf = (uint8_t *)buf;
 	uint32_t page_start = addr & DATAFLASH_WR_PAGE_MASK;
 	uint32_t page_end = page_start + DATAFLASH_WR_PAGE_SIZE;
-	int err;
-	uint8_t temp;
 
 	// Make sure init has been called
 	if (!status.inited) {
@@ -731,26 +914,14 @@ int dataflash_write_data(const void *buf, uint32_t addr, uint16_t bytes) {
 		bytes = page_end - addr;
 	}
 
-	// Read protection status
-	err = dataflash_read_protection(addr, &temp);
-	if (err) {
-		return err;
-	}
-
 	// Check protection status
-	if (temp != 0x00) {
+	if (!sector_writable(addr)) {
 		dataflash_write_disable();
 		return -1;
 	}
 
-	// Read status register
-	err = dataflash_read_status(&temp);
-	if (err) {
-		return -1;
-	}
-
 	// Check for WEL
-	if (!(temp & DATAFLASH_SREG_WEL)) {
+	if (!write_enabled()) {
 		return -1;
 	}
 
@@ -764,13 +935,15 @@ int dataflash_write_data(const void *buf, uint32_t addr, uint16_t bytes) {
 	send_address(addr);
 
 	// Write data
-	for (uint16_t i = 0; i < bytes; i++) {
-		spi_rw(*(cbuf++));
-	}
+	spi_write_block(cbuf, bytes);
 
 	// All done
 	dev_release();
 
+	// The device stays busy until the operation completes
+	status.busy = 1;
+	wel_clear();
+
 	return bytes;
 }
 
@@ -34,6 +34,12 @@ typedef struct {
 	uint32_t end;
 } dataflash_sector_t;
 
+// One buffer in a scatter read
+typedef struct {
+	void *buf;
+	uint16_t len;
+} dataflash_iovec_t;
+
 #define DATAFLASH_SREG_SPRL 0x80
 #define DATAFLASH_SREG_SPM 0x40
 #define DATAFLASH_SREG_EPE 0x20
@@ -61,8 +67,25 @@ int dataflash_sector_by_idx(uint8_t idx, dataflash_sector_t *sector);
 int dataflash_read_status(uint8_t *sreg);
 int dataflash_write_status(uint8_t sreg);
 int dataflash_wait_ready(void);
+// Non-blocking: 1 while a program or erase is still running
+int dataflash_busy(void);
+
+/*
+ * Wait for a program or erase to finish from a Contiki process without
+ * blocking everything else, re-checking every DATAFLASH_POLL_TIME using the
+ * caller's etimer.
+ */
+#define DATAFLASH_POLL_TIME (CLOCK_SECOND / 50)
+#define DATAFLASH_PROCESS_WAIT_READY(et) \
+	while (dataflash_busy()) { \
+		etimer_set((et), DATAFLASH_POLL_TIME); \
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(et)); \
+	}
 
 int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes);
+// Read consecutive data into several buffers under a single command
+int dataflash_read_data_multi(const dataflash_iovec_t *iov, uint8_t count,
+	uint32_t offset);
 
 int dataflash_write_enable(void);
 int dataflash_write_disable(void);
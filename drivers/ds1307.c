@@ -64,71 +64,15 @@ struct ds1307_raw {
 };
 
 static int read(uint8_t *ptr, uint8_t offset, uint8_t len) {
-	int ret;
-
-	// START condition
-	ret = i2c_start(DS1307_ADDR + I2C_WRITE);
-	if (ret) {
-		i2c_stop();
-		return -1;
-	}
-
-	// Send the pointer address
-	ret = i2c_write(offset);
-	if (ret) {
-		i2c_stop();
-		return -1;
-	}
-
-	// REPEATED START condition
-	ret = i2c_rep_start(DS1307_ADDR + I2C_READ);
-	if (ret) {
-		i2c_stop();
-		return -1;
-	}
-
-	// Read all the bytes
-	while (len--) {
-		*ptr++ = i2c_read(len > 0);
-	}
-
-	// STOP condition
-	i2c_stop();
-
-	return 0;
+	// Send the pointer address, then read all the bytes
+	return i2c_transfer(DS1307_ADDR | I2C_READ, &offset, sizeof(offset),
+		ptr, len);
 }
 
 static int write(uint8_t *ptr, uint8_t offset, uint8_t len) {
-	int ret;
-
-	// START condition
-	ret = i2c_start(DS1307_ADDR + I2C_WRITE);
-	if (ret) {
-		i2c_stop();
-		return -1;
-	}
-
-	// Send the pointer address
-	ret = i2c_write(offset);
-	if (ret) {
-		i2c_stop();
-		return -1;
-	}
-
-	// Write all the bytes
-	while (len--) {
-		ret = i2c_write(*ptr++);
-		if (ret) {
-			i2c_stop();
-			return -1;
-		}
-	}
-
-	// STOP condition
-	i2c_stop();
-
-	return 0;
-
+	// Send the pointer address, then write all the bytes
+	return i2c_transfer(DS1307_ADDR | I2C_WRITE, &offset, sizeof(offset),
+		ptr, len);
 }
 
 static inline int dec2bcd(uint8_t dec) {
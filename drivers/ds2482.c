@@ -19,15 +19,18 @@
  */
 
 #include <string.h>
-#include <util/crc16.h>
 #include <util/delay.h>
+#include <sys/process.h>
 #include <init.h>
+#include <trace.h>
 
+#include <onewire.h>
 #include "ds2482.h"
 #include "i2c.h"
 
 typedef struct {
 	uint8_t		addr;
+	uint8_t		channel; // for the blocking functions
 	int			cfg_1ws : 1;
 	int			cfg_spu : 1;
 	int			cfg_apu : 1;
@@ -35,8 +38,42 @@ typedef struct {
 
 static ds2482_status_t s;
 
+#define NO_CHANNEL	0xff
+
+// The operation with a 1-Wire command in progress, which has the DS2482 to
+// itself until the command has completed (and its result has been read)
+static ow_async_t *active;
+
+// Channel the DS2482 is switched to
+static uint8_t selected;
+
+// Channel held on the strong pullup, which can't be switched away from
+static uint8_t spu_channel = NO_CHANNEL;
+
+#if DS2482_CHANNELS > 1
+// Channel select codes and what reads back after selecting them
+static const uint8_t chsl_code[8] = {
+	0xF0, 0xE1, 0xD2, 0xC3, 0xB4, 0xA5, 0x96, 0x87,
+};
+static const uint8_t chsl_check[8] = {
+	0xB8, 0xB1, 0xAA, 0xA3, 0x9C, 0x95, 0x8E, 0x87,
+};
+#endif
+
 #define POLL_LIMIT	200
 
+// Run an asynchronous operation to completion, spinning between status polls
+#define DS2482_SYNC(op, thread) \
+	do { \
+		(op)->channel = s.channel; \
+		(op)->speed = s.cfg_1ws ? \
+			DS2482_MODE_OVERDRIVE : DS2482_MODE_STANDARD; \
+		PT_INIT(&(op)->pt); \
+		while (PT_SCHEDULE(thread)) { \
+			_delay_us(20); \
+		} \
+	} while (0)
+
 #define CMD_DRST	0xf0
 #define CMD_WCFG	0xd2
 #define CMD_CHSL	0xc3
@@ -47,6 +84,9 @@ static ds2482_status_t s;
 #define CMD_1WSB	0x87
 #define CMD_1WT		0x78
 
+#define OW_OD_SKIP_ROM	0x3c
+#define OW_OD_MATCH_ROM	0x69
+
 #define STATUS_DIR	0x80
 #define STATUS_TSB	0x40
 #define STATUS_SBR	0x20
@@ -80,6 +120,52 @@ static int ds2482_reset(void);
  */
 static int ds2482_write_config(void);
 
+/*
+ * Queue a DS2482 transaction that writes the first hlen bytes of op->cmd
+ * (which may be none) and reads one byte back into op->data.
+ *
+ *   S AD,0 [A] CMD [A] (DD [A]) Sr AD,1 [A] [RR] A\ P
+ *   S AD,1 [A] [RR] A\ P (hlen == 0)
+ *  [] indicates from slave
+ *  DD data byte to write
+ *  RR byte read from the current read pointer
+ */
+static void ds2482_xfer_start(ow_async_t *op, uint8_t hlen);
+
+// Run a DS2482 transaction (see above) from protothread pt, waiting while it
+// is on the bus. op->ret is then the byte read, or -1 on failure.
+#define DS2482_XFER(pt, op, hlen) \
+	do { \
+		ds2482_xfer_start(op, hlen); \
+		PT_WAIT_WHILE(pt, i2c_xfer_busy(&(op)->xfer)); \
+		(op)->ret = ((op)->xfer.status == I2C_XFER_DONE) ? \
+			(op)->data : -1; \
+	} while (0)
+
+/*
+ * Protothread that waits for the DS2482 to be free and switches it to
+ * op->channel and op->speed. Each 1-Wire command must be done with
+ * ds2482_claim() first and DS2482_RELEASE() afterwards. op->ret is 0, or -1
+ * if the channel or speed couldn't be set (in which case the DS2482 is not
+ * claimed).
+ */
+static PT_THREAD(ds2482_claim(ow_async_t *op));
+#define DS2482_RELEASE(op) \
+	do { \
+		if (active == (op)) { \
+			active = NULL; \
+		} \
+	} while (0)
+
+/*
+ * Protothread that waits for a 1-Wire operation to complete, yielding
+ * between polls of the status register rather than spinning on it. 1-Wire
+ * commands leave the read pointer on the status register, so on entry op->ret
+ * holds the status read back with the command; on exit it holds the final
+ * status byte, or -1 on failure (including the poll limit being reached).
+ */
+static PT_THREAD(ds2482_wait(ow_async_t *op));
+
 /*
  * Use the DS2482 help command '1-Wire triplet' to perform one bit of a
  * 1-Wire search.
@@ -88,11 +174,12 @@ static int ds2482_write_config(void);
  * is either the default direction (all device have same bit) or in case of
  * a discrepancy, the 'search_direction' parameter is used.
  *
- * Return:
+ * Result (op->ret):
  *  0x00-0xff - command status byte
  *  -1        - failure
  */
-static int ds2482_search_triplet(int search_direction);
+static PT_THREAD(do_triplet(ow_async_t *op, struct pt *pt,
+	uint8_t search_direction));
 
 /*
  * The 'ow_search' function does a general search. This function
@@ -142,7 +229,7 @@ int ds2482_detect(uint8_t addr) {
 }
 
 static int ds2482_reset() {
-	uint8_t status;
+	uint8_t cmd, status;
 
 	/*
 	 * Device Reset
@@ -151,29 +238,26 @@ static int ds2482_reset() {
 	 *  SS status byte to read to verify state
 	 */
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_DRST)) {
+	cmd = CMD_DRST;
+	if (i2c_transfer(s.addr | I2C_READ, &cmd, 1, &status, 1)) {
 		return -1;
 	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
-		return -1;
-	}
-	status = i2c_read(0);
-	i2c_stop();
 
 	// check for failure due to incorrect read back of status
 	if ((status & 0xF7) != 0x10) {
 		return -1;
 	}
 
+	// a device reset goes back to channel 0 without the strong pullup
+	selected = 0;
+	spu_channel = NO_CHANNEL;
+
 	return 0;
 }
 
 static int ds2482_write_config() {
 	uint8_t config = 0;
-	uint8_t read_config;
+	uint8_t cmd[2], read_config;
 
 	/*
 	 * Write configuration (Case A)
@@ -192,20 +276,13 @@ static int ds2482_write_config() {
 		config |= CONFIG_APU;
 	}
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
+	cmd[0] = CMD_WCFG;
+	cmd[1] = config | (~config << 4);
+	if (i2c_transfer(s.addr | I2C_READ, cmd, sizeof(cmd),
+		&read_config, 1))
+	{
 		return -1;
 	}
-	if (i2c_write(CMD_WCFG)) {
-		return -1;
-	}
-	if (i2c_write(config | (~config << 4))) {
-		return -1;
-	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
-		return -1;
-	}
-	read_config = i2c_read(0);
-	i2c_stop();
 
 	// check for failure due to incorrect read back
 	if (config != read_config) {
@@ -217,7 +294,8 @@ static int ds2482_write_config() {
 }
 
 int ds2482_channel_select(int channel) {
-	uint8_t ch, ch_read, check;
+#if DS2482_CHANNELS > 1
+	uint8_t cmd[2], check;
 
 	/*
 	 * Channel Select (Case A)
@@ -227,306 +305,394 @@ int ds2482_channel_select(int channel) {
 	 *  RR channel read back
 	 */
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_CHSL)) {
+	if (channel < 0 || channel >= DS2482_CHANNELS) {
 		return -1;
 	}
 
-	switch (channel) {
-		default: case 0: ch = 0xF0; ch_read = 0xB8; break;
-		case 1: ch = 0xE1; ch_read = 0xB1; break;
-		case 2: ch = 0xD2; ch_read = 0xAA; break;
-		case 3: ch = 0xC3; ch_read = 0xA3; break;
-		case 4: ch = 0xB4; ch_read = 0x9C; break;
-		case 5: ch = 0xA5; ch_read = 0x95; break;
-		case 6: ch = 0x96; ch_read = 0x8E; break;
-		case 7: ch = 0x87; ch_read = 0x87; break;
-	}
+	cmd[0] = CMD_CHSL;
+	cmd[1] = chsl_code[channel];
 
-	if (i2c_write(ch)) {
-		return -1;
-	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
+	if (i2c_transfer(s.addr | I2C_READ, cmd, sizeof(cmd), &check, 1)) {
 		return -1;
 	}
-	check = i2c_read(0);
-	i2c_stop();
 
 	// check for failure due to incorrect read back of channel
-	if (check != ch_read) {
+	if (check != chsl_check[channel]) {
 		return -1;
 	}
 
+	s.channel = selected = channel;
+
 	return 0;
+#else
+	return channel ? -1 : 0;
+#endif
 }
 
-static int ds2482_search_triplet(int search_direction) {
-	uint8_t status;
-	int poll_count = 0;
+static void ds2482_xfer_start(ow_async_t *op, uint8_t hlen) {
+	op->xfer.addr = s.addr | I2C_READ;
+	op->xfer.hdr = op->cmd;
+	op->xfer.hlen = hlen;
+	op->xfer.data = &op->data;
+	op->xfer.len = 1;
+	op->xfer.process = PROCESS_CURRENT();
 
-	/*
-	 * 1-Wire Triplet (Case B)
-	 *   S AD,0 [A] 1WT [A] SS [A] Sr AD,1 [A] [Status] A [Status] A\ P
-	 *                                         \--------/
-	 *                           Repeat until 1WB bit has changed to 0
-	 *  [] indicates from slave
-	 *  SS indicates byte containing search direction bit value in msbit
-	 */
+	i2c_xfer_queue(&op->xfer);
+}
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_1WT)) {
-		return -1;
+static PT_THREAD(ds2482_claim(ow_async_t *op)) {
+	PT_BEGIN(&op->wait);
+
+	PT_WAIT_UNTIL(&op->wait, (!active || active == op) &&
+		(spu_channel == NO_CHANNEL || spu_channel == op->channel));
+	active = op;
+
+#if DS2482_CHANNELS > 1
+	if (selected != op->channel) {
+		// Channel Select (see ds2482_channel_select())
+		op->cmd[0] = CMD_CHSL;
+		op->cmd[1] = chsl_code[op->channel];
+		DS2482_XFER(&op->wait, op, 2);
+		if (op->ret != chsl_check[op->channel]) {
+			// Not sure where it is now
+			selected = NO_CHANNEL;
+			active = NULL;
+			op->ret = -1;
+			PT_EXIT(&op->wait);
+		}
+
+		selected = op->channel;
 	}
-	if (i2c_write(search_direction ? 0x80 : 0x00)) {
-		return -1;
+#endif
+
+	// 1WS is chip-wide, so each operation sets its own speed
+	if (!s.cfg_1ws != (op->speed != DS2482_MODE_OVERDRIVE)) {
+		s.cfg_1ws = (op->speed == DS2482_MODE_OVERDRIVE);
+		if (ds2482_write_config()) {
+			active = NULL;
+			op->ret = -1;
+			PT_EXIT(&op->wait);
+		}
 	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
-		return -1;
+
+	op->ret = 0;
+
+	PT_END(&op->wait);
+}
+
+void ow_async_abort(ow_async_t *op) {
+	DS2482_RELEASE(op);
+
+	// don't leave the channel on the strong pullup
+	if (spu_channel == op->channel) {
+		ow_level_std();
 	}
+}
+
+static PT_THREAD(ds2482_wait(ow_async_t *op)) {
+	PT_BEGIN(&op->wait);
 
 	// loop checking 1WB bit for completion of 1-Wire operation
 	// abort if poll limit reached
-	status = i2c_read(1);
-	while (status & STATUS_1WB) {
-		if (poll_count++ >= POLL_LIMIT) {
+	op->polls = 0;
+	TRACE(TRACE_OW_WAIT, 0);
+	while (op->ret >= 0 && (op->ret & STATUS_1WB)) {
+		if (op->polls++ >= POLL_LIMIT) {
+			// handle error
+			ds2482_reset();
+			op->ret = -1;
 			break;
 		}
 
-		_delay_us(20);
-		status = i2c_read(status & STATUS_1WB);
+		PT_YIELD(&op->wait);
+		DS2482_XFER(&op->wait, op, 0);
 	}
+	TRACE(TRACE_OW_DONE, op->polls);
 
-	// check for failure due to poll limit reached
-	if (status & STATUS_1WB) {
-		i2c_stop();
+	PT_END(&op->wait);
+}
 
-		// handle error
-		ds2482_reset();
-		return -1;
+static PT_THREAD(do_triplet(ow_async_t *op, struct pt *pt,
+	uint8_t search_direction))
+{
+	PT_BEGIN(pt);
+
+	/*
+	 * 1-Wire Triplet (Case B)
+	 *   S AD,0 [A] 1WT [A] SS [A] Sr AD,1 [A] [Status] A\ P
+	 *   S AD,1 [A] [Status] A\ P (repeat until 1WB bit has changed to 0)
+	 *  [] indicates from slave
+	 *  SS indicates byte containing search direction bit value in msbit
+	 */
+
+	PT_SPAWN(pt, &op->wait, ds2482_claim(op));
+	if (op->ret < 0) {
+		PT_EXIT(pt);
 	}
 
-	// return status byte
-	return status;
+	op->cmd[0] = CMD_1WT;
+	op->cmd[1] = search_direction ? 0x80 : 0x00;
+	DS2482_XFER(pt, op, 2);
+	PT_SPAWN(pt, &op->wait, ds2482_wait(op));
+	DS2482_RELEASE(op);
+
+	// op->ret is the status byte (or failure)
+	PT_END(pt);
 }
 
-int ow_reset(void) {
-	uint8_t status;
-	int poll_count = 0;
+static PT_THREAD(do_reset(ow_async_t *op, struct pt *pt)) {
+	PT_BEGIN(pt);
 
 	/*
 	 * 1-Wire reset (Case B)
-	 *   S AD,0 [A] 1WRS [A] Sr AD,1 [A] [Status] A [Status] A\ P
-	 *                                   \--------/
-	 *                       Repeat until 1WB bit has changed to 0
+	 *   S AD,0 [A] 1WRS [A] Sr AD,1 [A] [Status] A\ P
+	 *   S AD,1 [A] [Status] A\ P (repeat until 1WB bit has changed to 0)
 	 *  [] indicates from slave
 	 */
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_1WRS)) {
-		return -1;
-	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
-		return -1;
+	PT_SPAWN(pt, &op->wait, ds2482_claim(op));
+	if (op->ret < 0) {
+		PT_EXIT(pt);
 	}
 
-	// loop checking 1WB bit for completion of 1-Wire operation
-	// abort if poll limit reached
-	status = i2c_read(1);
-	while (status & STATUS_1WB) {
-		if (poll_count++ >= POLL_LIMIT) {
-			break;
-		}
-
-		_delay_us(20);
-		status = i2c_read(status & STATUS_1WB);
-	}
-
-	// check for failure due to poll limit reached
-	if (status & STATUS_1WB) {
-		i2c_stop();
-
-		// handle error
-		ds2482_reset();
-		return -1;
+	op->cmd[0] = CMD_1WRS;
+	DS2482_XFER(pt, op, 1);
+	PT_SPAWN(pt, &op->wait, ds2482_wait(op));
+	DS2482_RELEASE(op);
+	if (op->ret < 0) {
+		PT_EXIT(pt);
 	}
 
 	// check for short condition
-	if (status & STATUS_SD) {
-		return -2;
+	if (op->ret & STATUS_SD) {
+		op->ret = -2;
 	}
 	// check for presence detect
-	else if (status & STATUS_PPD) {
-		return 1;
+	else if (op->ret & STATUS_PPD) {
+		op->ret = 1;
 	}
 	else {
-		return 0;
+		op->ret = 0;
 	}
-}
 
-int ow_write_bit(uint8_t sendbit) {
-	int ret = ow_touch_bit(sendbit);
-	if (ret < 0) {
-		return ret;
-	}
-
-	return 0;
+	PT_END(pt);
 }
 
-int ow_read_bit(void) {
-	return ow_touch_bit(0x01);
-}
-
-int ow_touch_bit(uint8_t sendbit) {
-	uint8_t status;
-	int poll_count = 0;
+static PT_THREAD(do_touch_bit(ow_async_t *op, struct pt *pt,
+	uint8_t sendbit))
+{
+	PT_BEGIN(pt);
 
 	/*
 	 * 1-Wire bit (Case B)
-	 *   S AD,0 [A] 1WSB [A] BB [A] Sr AD,1 [A] [Status] A [Status] A\ P
-	 *                                          \--------/
-	 *                           Repeat until 1WB bit has changed to 0
+	 *   S AD,0 [A] 1WSB [A] BB [A] Sr AD,1 [A] [Status] A\ P
+	 *   S AD,1 [A] [Status] A\ P (repeat until 1WB bit has changed to 0)
 	 *  [] indicates from slave
 	 *  BB indicates byte containing bit value in msbit
 	 */
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_1WSB)) {
-		return -1;
+	PT_SPAWN(pt, &op->wait, ds2482_claim(op));
+	if (op->ret < 0) {
+		PT_EXIT(pt);
 	}
-	if (i2c_write(sendbit ? 0x80 : 0x00)) {
-		return -1;
-	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
-		return -1;
+
+	op->cmd[0] = CMD_1WSB;
+	op->cmd[1] = sendbit ? 0x80 : 0x00;
+	DS2482_XFER(pt, op, 2);
+	PT_SPAWN(pt, &op->wait, ds2482_wait(op));
+	DS2482_RELEASE(op);
+	if (op->ret < 0) {
+		PT_EXIT(pt);
 	}
 
-	// loop checking 1WB bit for completion of 1-Wire operation
-	// abort if poll limit reached
-	status = i2c_read(1);
-	while (status & STATUS_1WB) {
-		if (poll_count++ >= POLL_LIMIT) {
-			break;
+	// return bit state
+	op->ret = (op->ret & STATUS_SBR) ? 1 : 0;
+
+	PT_END(pt);
+}
+
+static PT_THREAD(do_block(ow_async_t *op, struct pt *pt,
+	uint8_t *tran_buf, int tran_len))
+{
+	PT_BEGIN(pt);
+
+	/*
+	 * Bytes other than 0xff are only written, 0xff bytes are read from the
+	 * bus and need the read pointer moved to the data register afterwards.
+	 *
+	 * 1-Wire Write Byte (Case B)
+	 *   S AD,0 [A] 1WWB [A] DD [A] Sr AD,1 [A] [Status] A\ P
+	 *   S AD,1 [A] [Status] A\ P (repeat until 1WB bit has changed to 0)
+	 *
+	 * 1-Wire Read Byte (Case B)
+	 *   S AD,0 [A] 1WRB [A] Sr AD,1 [A] [Status] A\ P
+	 *   S AD,1 [A] [Status] A\ P (repeat until 1WB bit has changed to 0)
+	 *   S AD,0 [A] SRP [A] E1 [A] Sr AD,1 [A] [DD] A\ P
+	 *
+	 *  [] indicates from slave
+	 *  DD data to write / data read
+	 */
+
+	for (op->i = 0; op->i < tran_len; op->i++) {
+		PT_SPAWN(pt, &op->wait, ds2482_claim(op));
+		if (op->ret < 0) {
+			PT_EXIT(pt);
+		}
+
+		if (tran_buf[op->i] == 0xff) {
+			op->cmd[0] = CMD_1WRB;
+			DS2482_XFER(pt, op, 1);
+		}
+		else {
+			op->cmd[0] = CMD_1WWB;
+			op->cmd[1] = tran_buf[op->i];
+			DS2482_XFER(pt, op, 2);
+		}
+
+		PT_SPAWN(pt, &op->wait, ds2482_wait(op));
+		if (op->ret < 0) {
+			DS2482_RELEASE(op);
+			PT_EXIT(pt);
 		}
 
-		_delay_us(20);
-		status = i2c_read(status & STATUS_1WB);
+		if (tran_buf[op->i] == 0xff) {
+			// Read Data: SRP to the data register, then read it
+			op->cmd[0] = CMD_SRP;
+			op->cmd[1] = 0xE1;
+			DS2482_XFER(pt, op, 2);
+			if (op->ret < 0) {
+				DS2482_RELEASE(op);
+				PT_EXIT(pt);
+			}
+
+			tran_buf[op->i] = op->ret;
+		}
+
+		DS2482_RELEASE(op);
 	}
 
-	// check for failure due to poll limit reached
-	if (status & STATUS_1WB) {
-		i2c_stop();
+	op->ret = 0;
 
-		// handle error
-		ds2482_reset();
-		return -1;
+	PT_END(pt);
+}
+
+PT_THREAD(ow_reset_async(ow_async_t *op)) {
+	return do_reset(op, &op->pt);
+}
+
+PT_THREAD(ow_touch_bit_async(ow_async_t *op, uint8_t sendbit)) {
+	return do_touch_bit(op, &op->pt, sendbit);
+}
+
+PT_THREAD(ow_touch_byte_async(ow_async_t *op, uint8_t sendbyte)) {
+	PT_BEGIN(&op->pt);
+
+	op->byte = sendbyte;
+	PT_SPAWN(&op->pt, &op->sub, do_block(op, &op->sub, &op->byte, 1));
+	if (op->ret == 0) {
+		op->ret = op->byte;
 	}
 
-	// return bit state
-	if (status & STATUS_SBR) {
-		return 1;
+	PT_END(&op->pt);
+}
+
+PT_THREAD(ow_block_async(ow_async_t *op, uint8_t *tran_buf, int tran_len)) {
+	return do_block(op, &op->pt, tran_buf, tran_len);
+}
+
+PT_THREAD(ow_overdrive_async(ow_async_t *op, const ow_addr_t *addr)) {
+	PT_BEGIN(&op->pt);
+
+	// devices not in overdrive yet only hear a standard speed reset
+	op->speed = DS2482_MODE_STANDARD;
+	PT_SPAWN(&op->pt, &op->sub, do_reset(op, &op->sub));
+	if (op->ret <= 0) {
+		PT_EXIT(&op->pt);
 	}
-	else {
-		return 0;
+
+	op->byte = addr ? OW_OD_MATCH_ROM : OW_OD_SKIP_ROM;
+	PT_SPAWN(&op->pt, &op->sub, do_block(op, &op->sub, &op->byte, 1));
+	if (op->ret < 0) {
+		PT_EXIT(&op->pt);
 	}
-}
 
-int ow_write_byte(uint8_t sendbyte) {
-	int ret = ow_touch_byte(sendbyte);
-	if (ret != sendbyte) {
-		return -1;
+	// everything after the ROM command is at overdrive speed
+	op->speed = DS2482_MODE_OVERDRIVE;
+
+	if (addr) {
+		// do_block() uses op->i, so count with the search state instead
+		for (op->rom_byte_number = 0; op->rom_byte_number < sizeof(*addr);
+			op->rom_byte_number++)
+		{
+			op->byte = addr->u[op->rom_byte_number];
+			PT_SPAWN(&op->pt, &op->sub, do_block(op, &op->sub, &op->byte, 1));
+			if (op->ret < 0) {
+				PT_EXIT(&op->pt);
+			}
+		}
 	}
 
-	return 0;
+	op->ret = 1;
+
+	PT_END(&op->pt);
 }
 
-int ow_read_byte(void) {
-	return ow_touch_byte(0xff);
+int ow_reset(void) {
+	ow_async_t op;
+
+	DS2482_SYNC(&op, ow_reset_async(&op));
+
+	return op.ret;
 }
 
-int ow_block(uint8_t *tran_buf, int tran_len) {
-	for (int i = 0; i < tran_len; i++) {
-		int ret = ow_touch_byte(tran_buf[i]);
-		if (ret < 0) {
-			return ret;
-		}
-		tran_buf[i] = ret;
+int ow_write_bit(uint8_t sendbit) {
+	int ret = ow_touch_bit(sendbit);
+	if (ret < 0) {
+		return ret;
 	}
 
 	return 0;
 }
 
-int ow_touch_byte(uint8_t sendbyte) {
-	uint8_t status;
-	int poll_count = 0;
+int ow_read_bit(void) {
+	return ow_touch_bit(0x01);
+}
 
-	/*
-	 * 1-Wire Write Byte (Case B)
-	 *   S AD,0 [A] 1WWB [A] DD [A] Sr AD,1 [A] [Status] A [Status] A\ P
-	 *                                          \--------/
-	 *                             Repeat until 1WB bit has changed to 0
-	 *  [] indicates from slave
-	 *  DD data to write
-	 */
+int ow_touch_bit(uint8_t sendbit) {
+	ow_async_t op;
 
-	if (i2c_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_1WWB)) {
-		return -1;
-	}
-	if (i2c_write(sendbyte)) {
-		return -1;
-	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
+	DS2482_SYNC(&op, ow_touch_bit_async(&op, sendbit));
+
+	return op.ret;
+}
+
+int ow_write_byte(uint8_t sendbyte) {
+	int ret = ow_touch_byte(sendbyte);
+	if (ret != sendbyte) {
 		return -1;
 	}
 
-	// loop checking 1WB bit for completion of 1-Wire operation
-	// abort if poll limit reached
-	status = i2c_read(1);
-	while (status & STATUS_1WB) {
-		if (poll_count++ >= POLL_LIMIT) {
-			break;
-		}
+	return 0;
+}
 
-		_delay_us(20);
-		status = i2c_read(status & STATUS_1WB);
-	}
+int ow_read_byte(void) {
+	return ow_touch_byte(0xff);
+}
 
-	// check for failure due to poll limit reached
-	if (status & STATUS_1WB) {
-		i2c_stop();
+int ow_block(uint8_t *tran_buf, int tran_len) {
+	ow_async_t op;
 
-		// handle error
-		ds2482_reset();
-		return -1;
-	}
+	DS2482_SYNC(&op, ow_block_async(&op, tran_buf, tran_len));
 
-	if (i2c_rep_start(s.addr | I2C_WRITE)) {
-		return -1;
-	}
-	if (i2c_write(CMD_SRP)) {
-		return -1;
-	}
-	if (i2c_write(0xE1)) {
-		return -1;
-	}
-	if (i2c_rep_start(s.addr | I2C_READ)) {
-		return -1;
-	}
+	return op.ret;
+}
 
-	sendbyte =  i2c_read(0);
-	i2c_stop();
+int ow_touch_byte(uint8_t sendbyte) {
+	ow_async_t op;
 
-	return sendbyte;
+	DS2482_SYNC(&op, ow_touch_byte_async(&op, sendbyte));
+
+	return op.ret;
 }
 
 int ow_presence(const ow_addr_t *addr) {
@@ -549,12 +715,16 @@ int ow_presence(const ow_addr_t *addr) {
 	return res;
 }
 
-int ow_search_first(ow_search_t *se, uint8_t alarm) {
+void ow_search_init(ow_search_t *se, uint8_t alarm) {
 	// reset the search state
 	se->last_discrepancy = 0;
 	se->last_device_flag = 0;
 	se->last_family_discrepancy = 0;
 	se->alarm = alarm ? 1 : 0;
+}
+
+int ow_search_first(ow_search_t *se, uint8_t alarm) {
+	ow_search_init(se, alarm);
 
 	return ow_search(se);
 }
@@ -597,118 +767,119 @@ int ow_search_skip_family(ow_search_t *se) {
 	return ow_search(se);
 }
 
-static int ow_search(ow_search_t *se) {
-	int ret;
-	int id_bit_number;
-	int last_zero, rom_byte_number, search_result;
+PT_THREAD(ow_search_async(ow_async_t *op, ow_search_t *se)) {
 	int id_bit, cmp_id_bit;
-	uint8_t rom_byte_mask, search_direction;
+	int search_result = 0;
+
+	PT_BEGIN(&op->pt);
 
 	// initialize for search
-	id_bit_number = 1;
-	last_zero = 0;
-	rom_byte_number = 0;
-	rom_byte_mask = 1;
-	search_result = 0;
+	op->id_bit_number = 1;
+	op->last_zero = 0;
+	op->rom_byte_number = 0;
+	op->rom_byte_mask = 1;
 	se->crc = 0;
 
 	// if the last call was not the last one
 	if (!se->last_device_flag) {
 		// 1-Wire reset
-		ret = ow_reset();
-		if (ret < 0) {
-			return ret;
+		PT_SPAWN(&op->pt, &op->sub, do_reset(op, &op->sub));
+		if (op->ret < 0) {
+			PT_EXIT(&op->pt);
 		}
-		else if (ret == 0) {
+		else if (op->ret == 0) {
 			// reset the search
 			se->last_discrepancy = 0;
 			se->last_device_flag = 0;
 			se->last_family_discrepancy = 0;
-			return 0;
+			PT_EXIT(&op->pt);
 		}
 
 		// issue the search command
-		ret = ow_write_byte(se->alarm ? 0xEC : 0xF0);
-		if (ret < 0) {
-			return ret;
+		op->byte = se->alarm ? 0xEC : 0xF0;
+		PT_SPAWN(&op->pt, &op->sub, do_block(op, &op->sub, &op->byte, 1));
+		if (op->ret < 0) {
+			PT_EXIT(&op->pt);
 		}
 
 		// loop to do the search
 		do {
 			// if this discrepancy if before the Last Discrepancy
 			// on a previous next then pick the same as last time
-			if (id_bit_number < se->last_discrepancy) {
-				if ((se->rom_no.u[rom_byte_number] & rom_byte_mask) > 0)
-					search_direction = 1;
+			if (op->id_bit_number < se->last_discrepancy) {
+				if ((se->rom_no.u[op->rom_byte_number] & op->rom_byte_mask) > 0)
+					op->search_direction = 1;
 				else
-					search_direction = 0;
+					op->search_direction = 0;
 			}
 			else {
 				// if equal to last pick 1, if not then pick 0
-				if (id_bit_number == se->last_discrepancy)
-					search_direction = 1;
+				if (op->id_bit_number == se->last_discrepancy)
+					op->search_direction = 1;
 				else
-					search_direction = 0;
+					op->search_direction = 0;
 			}
 
 			// Perform a triple operation on the DS2482 which will perform
 			// 2 read bits and 1 write bit
-			ret = ds2482_search_triplet(search_direction);
-			if (ret < 0) {
-				return ret;
+			PT_SPAWN(&op->pt, &op->sub,
+				do_triplet(op, &op->sub, op->search_direction));
+			if (op->ret < 0) {
+				PT_EXIT(&op->pt);
 			}
 
 			// check bit results in status byte
-			id_bit = ((ret & STATUS_SBR) == STATUS_SBR);
-			cmp_id_bit = ((ret & STATUS_TSB) == STATUS_TSB);
-			search_direction = ((ret & STATUS_DIR) == STATUS_DIR) ? 1 : 0;
+			id_bit = ((op->ret & STATUS_SBR) == STATUS_SBR);
+			cmp_id_bit = ((op->ret & STATUS_TSB) == STATUS_TSB);
+			op->search_direction = ((op->ret & STATUS_DIR) == STATUS_DIR) ? 1 : 0;
 
 			// check for no devices on 1-Wire
 			if (id_bit && cmp_id_bit) {
 				break;
 			}
 			else {
-				if ((!id_bit) && (!cmp_id_bit) && (search_direction == 0)) {
-					last_zero = id_bit_number;
+				if ((!id_bit) && (!cmp_id_bit) && (op->search_direction == 0)) {
+					op->last_zero = op->id_bit_number;
 
 					// check for Last discrepancy in family
-					if (last_zero < 9) {
-						se->last_family_discrepancy = last_zero;
+					if (op->last_zero < 9) {
+						se->last_family_discrepancy = op->last_zero;
 					}
 				}
 
 				// set or clear the bit in the ROM byte rom_byte_number
 				// with mask rom_byte_mask
-				if (search_direction == 1) {
-					se->rom_no.u[rom_byte_number] |= rom_byte_mask;
+				if (op->search_direction == 1) {
+					se->rom_no.u[op->rom_byte_number] |= op->rom_byte_mask;
 				}
 				else {
-					se->rom_no.u[rom_byte_number] &= (uint8_t)~rom_byte_mask;
+					se->rom_no.u[op->rom_byte_number] &=
+						(uint8_t)~op->rom_byte_mask;
 				}
 
 				// increment the byte counter id_bit_number
 				// and shift the mask rom_byte_mask
-				id_bit_number++;
-				rom_byte_mask <<= 1;
+				op->id_bit_number++;
+				op->rom_byte_mask <<= 1;
 
 				// if the mask is 0 then go to new SerialNum byte
 				// rom_byte_number and reset mask
-				if (rom_byte_mask == 0) {
+				if (op->rom_byte_mask == 0) {
 					// accumulate the CRC
-					se->crc = _crc_ibutton_update(se->crc,
-						se->rom_no.u[rom_byte_number]);
-					rom_byte_number++;
-					rom_byte_mask = 1;
+					se->crc = ow_crc8(se->crc,
+						&se->rom_no.u[op->rom_byte_number], 1);
+					op->rom_byte_number++;
+					op->rom_byte_mask = 1;
 				}
 			}
 		}
-		while (rom_byte_number < 8);  // loop until through all ROM bytes 0-7
+		while (op->rom_byte_number < 8);  // loop until through all ROM bytes 0-7
 
 		// if the search was successful then
-		if (!((id_bit_number < 65) || (se->crc != 0))) {
+		if (!((op->id_bit_number < 65) || (se->crc != 0))) {
 			// search successful so set s->last_discrepancy,s->last_device_flag
 			// search_result
-			se->last_discrepancy = last_zero;
+			se->last_discrepancy = op->last_zero;
 
 			// check for last device
 			if (se->last_discrepancy == 0) {
@@ -728,7 +899,17 @@ static int ow_search(ow_search_t *se) {
 		search_result = 0;
 	}
 
-	return search_result;
+	op->ret = search_result;
+
+	PT_END(&op->pt);
+}
+
+static int ow_search(ow_search_t *se) {
+	ow_async_t op;
+
+	DS2482_SYNC(&op, ow_search_async(&op, se));
+
+	return op.ret;
 }
 
 int ow_speed(int speed) {
@@ -763,6 +944,9 @@ int ow_level_std() {
 		return ret;
 	}
 
+	// other channels can be selected again
+	spu_channel = NO_CHANNEL;
+
 	return 0;
 }
 
@@ -779,6 +963,9 @@ int ow_read_bit_power(uint8_t check_response) {
 		return ret;
 	}
 
+	// keep this channel selected until ow_level_std()
+	spu_channel = s.channel;
+
 	// perform read bit
 	rdbit = ow_read_bit();
 
@@ -794,27 +981,48 @@ int ow_read_bit_power(uint8_t check_response) {
 	return 1;
 }
 
-int ow_write_byte_power(uint8_t sendbyte) {
-	int ret;
+PT_THREAD(ow_write_byte_power_async(ow_async_t *op, uint8_t sendbyte)) {
+	PT_BEGIN(&op->pt);
+
+	// the config can't be written while another channel is busy
+	PT_SPAWN(&op->pt, &op->wait, ds2482_claim(op));
+	if (op->ret < 0) {
+		PT_EXIT(&op->pt);
+	}
 
 	// set strong pullup enable
 	s.cfg_spu = 1;
 
 	// write the new config
-	ret = ds2482_write_config();
-	if (ret < 0) {
-		return ret;
+	op->ret = ds2482_write_config();
+	if (op->ret < 0) {
+		DS2482_RELEASE(op);
+		PT_EXIT(&op->pt);
 	}
 
+	// keep this channel selected until ow_level_std()
+	spu_channel = op->channel;
+	DS2482_RELEASE(op);
+
 	// perform write byte
-	ret = ow_write_byte(sendbyte);
+	op->byte = sendbyte;
+	PT_SPAWN(&op->pt, &op->sub, do_block(op, &op->sub, &op->byte, 1));
+
+	PT_END(&op->pt);
+}
+
+int ow_write_byte_power(uint8_t sendbyte) {
+	ow_async_t op;
+
+	DS2482_SYNC(&op, ow_write_byte_power_async(&op, sendbyte));
 
-	return ret;
+	return op.ret;
 }
 
 static int ds2482_init(void) {
 	return ds2482_detect(DS2482_ADDR_00);
 }
 
-INIT_DRIVER(ds2482, ds2482_init);
+// Nothing talks to the bus until owscan has waited for this
+INIT_DEFERRED(ds2482, ds2482_init);
 
@@ -21,6 +21,10 @@
 #ifndef DS2482_H
 #define DS2482_H
 
+#include <sys/pt.h>
+
+#include "i2c.h"
+
 /**
  * Driver for DS2482 1-wire master.
  */
@@ -30,6 +34,13 @@
 #define DS2482_ADDR_10	0x34
 #define DS2482_ADDR_11	0x36
 
+// Number of 1-Wire channels (8 on the DS2482-800)
+#ifndef CONFIG_DRIVERS_DS2482_CHANNELS
+#define DS2482_CHANNELS 1
+#else
+#define DS2482_CHANNELS CONFIG_DRIVERS_DS2482_CHANNELS
+#endif
+
 #define DS2482_MODE_STANDARD	0x00
 #define DS2482_MODE_OVERDRIVE	0x01
 #define DS2482_MODE_STRONG		0x02
@@ -54,6 +65,51 @@ typedef struct {
 	uint8_t		alarm : 1;
 } ow_search_t;
 
+/*
+ * State for an asynchronous 1-Wire operation. The *_async() functions are
+ * protothreads that yield while the DS2482 is busy instead of spinning on its
+ * status register, and while their I2C transactions are on the bus. Start
+ * one with PT_SPAWN() (or PT_INIT() it first and keep calling it until
+ * PT_SCHEDULE() is false), and read the result from ret once it has ended;
+ * the return values are the same as the blocking version's. Whoever runs the
+ * thread must make sure it gets scheduled again after it yields, e.g. with
+ * process_poll() or tcpip_poll_tcp(). The op must not be freed while its
+ * I2C transaction is still queued (see i2c_xfer_busy()).
+ *
+ * Set channel before starting an operation to run it on that channel of a
+ * DS2482-800. Operations on different channels are interleaved one 1-Wire
+ * command at a time, switching channels in between, so a slow bus only
+ * holds up its own operations. Likewise speed is the 1-Wire speed the
+ * operation runs at, switched over to as needed. The exception is the strong
+ * pullup: while a
+ * channel is held on it (ow_write_byte_power_async() up to ow_level_std()),
+ * no other channel can be selected.
+ *
+ * The blocking functions are built on these and spin between polls. They run
+ * on the channel last chosen with ds2482_channel_select(), and must not be
+ * used while asynchronous operations are in progress.
+ */
+typedef struct {
+	struct pt	pt;
+	struct pt	sub; // nested operation
+	struct pt	wait; // status polling
+	uint8_t		channel; // DS2482-800 channel to run on
+	uint8_t		speed; // DS2482_MODE_STANDARD or DS2482_MODE_OVERDRIVE
+	i2c_xfer_t	xfer; // I2C transaction in progress
+	uint8_t		cmd[2];
+	uint8_t		data;
+	int			ret;
+	uint8_t		polls;
+	uint8_t		byte;
+	int			i;
+	// ow_search_async() state
+	uint8_t		id_bit_number;
+	uint8_t		last_zero;
+	uint8_t		rom_byte_number;
+	uint8_t		rom_byte_mask;
+	uint8_t		search_direction;
+} ow_async_t;
+
 // DS2482 specific functions
 
 /*
@@ -71,7 +127,7 @@ typedef struct {
 int ds2482_detect(uint8_t addr);
 
 /*
- * Select the 1-Wire channel on a DS2482-800.
+ * Select the 1-Wire channel on a DS2482-800 for the blocking functions.
  *
  * Return:
  *   0 - channel selected
@@ -134,7 +190,8 @@ int ow_read_byte(void);
 
 /*
  * The 'ow_block' transfers a block of data to and from the
- * 1-Wire Net. The result is returned in the same buffer.
+ * 1-Wire Net. The result is returned in the same buffer: bytes sent as 0xff
+ * are replaced by the byte read, others are left as written.
  *
  * Return:
  *   0 - block write successful
@@ -163,6 +220,32 @@ int ow_touch_bit(uint8_t bit);
  */
 int ow_touch_byte(uint8_t byte);
 
+// Asynchronous versions of the above (see ow_async_t)
+PT_THREAD(ow_reset_async(ow_async_t *op));
+PT_THREAD(ow_touch_bit_async(ow_async_t *op, uint8_t bit));
+PT_THREAD(ow_touch_byte_async(ow_async_t *op, uint8_t byte));
+PT_THREAD(ow_block_async(ow_async_t *op, uint8_t *buf, int len));
+
+/*
+ * Put overdrive-capable devices into overdrive: a standard speed reset, then
+ * Overdrive-Match ROM with addr (whose ROM bytes go out at overdrive speed),
+ * or Overdrive-Skip ROM if addr is NULL. op->speed is left at overdrive, and
+ * the devices stay there until a standard speed reset.
+ *
+ * Result (op->ret):
+ *   1 - presence pulse(s) detected and the ROM command sent
+ *   0 - no presence pulses detected
+ *  -1 - failure
+ *  -2 - short detected
+ */
+PT_THREAD(ow_overdrive_async(ow_async_t *op, const ow_addr_t *addr));
+
+// Give up on an operation part way through, letting other channels have the
+// DS2482 and ending any strong pullup on the operation's channel. Only the
+// holder of the channel's lock may do this, once the operation's I2C
+// transaction has finished.
+void ow_async_abort(ow_async_t *op);
+
 // 1-wire search functions
 
 /*
@@ -220,6 +303,17 @@ int ow_search_target(ow_search_t *s, uint8_t family, uint8_t alarm);
  */
 int ow_search_skip_family(ow_search_t *s);
 
+/*
+ * Reset the search state so that the next search finds the 'first' device.
+ */
+void ow_search_init(ow_search_t *s, uint8_t alarm);
+
+/*
+ * Asynchronous search (see ow_async_t) continuing from the search state in
+ * s, which should be set up by ow_search_init() or a previous search.
+ */
+PT_THREAD(ow_search_async(ow_async_t *op, ow_search_t *s));
+
 // Extended 1-wire functions
 
 /*
@@ -266,5 +360,6 @@ int ow_read_bit_power(uint8_t check_response);
  *  -1 - failure
  */
 int ow_write_byte_power(uint8_t sendbyte);
+PT_THREAD(ow_write_byte_power_async(ow_async_t *op, uint8_t sendbyte));
 
 #endif /* DS2482_H */
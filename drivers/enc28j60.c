@@ -22,6 +22,7 @@
 //#include "timer.h"	//Note have been replaced with _delay_us() as this is more convient
 
 #include "enc28j60.h"
+#include "spi.h"
 
 /*#ifndef SPDR
 #ifdef SPDR0
@@ -101,13 +102,8 @@ void enc28j60ReadBuffer(uint16_t len, uint8_t* data)
 	// issue read command
 	SPDR = ENC28J60_READ_BUF_MEM;
 	while(!(SPSR & (1<<SPIF)));
-	while(len--)
-	{
-		// read data
-		SPDR = 0x00;
-		while(!(SPSR & (1<<SPIF)));
-		*data++ = SPDR;
-	}	
+	// read data
+	spi_read_block(data, len);
 	// release CS
 	CONFIG_DRIVERS_ENC28J60_CTL_PORT |= (1<<CONFIG_DRIVERS_ENC28J60_CTL_PIN);
 }
@@ -120,24 +116,25 @@ void enc28j60WriteBuffer(uint16_t len, uint8_t* data)
 	// issue write command
 	SPDR = ENC28J60_WRITE_BUF_MEM;
 	while(!(SPSR & (1<<SPIF)));
-	while(len--)
-	{
-		// write data
-		SPDR = *data++;
-		while(!(SPSR & (1<<SPIF)));
-	}	
+	// write data
+	spi_write_block(data, len);
 	// release CS
 	CONFIG_DRIVERS_ENC28J60_CTL_PORT |= (1<<CONFIG_DRIVERS_ENC28J60_CTL_PIN);
 }
 
 void enc28j60SetBank(uint8_t address)
 {
-	// set the bank (if needed)
+	uint8_t bsel = (address & BANK_MASK)>>5;
+	uint8_t current = Enc28j60Bank>>5;
+
+	// set the bank (if needed), only touching the BSEL bits that change:
+	// going between banks 0 and 1 or 2 and 3 is then a single write
 	if((address & BANK_MASK) != Enc28j60Bank)
 	{
-		// set the bank
-		enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, (ECON1_BSEL1|ECON1_BSEL0));
-		enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, (address & BANK_MASK)>>5);
+		if(current & ~bsel)
+			enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, current & ~bsel);
+		if(bsel & ~current)
+			enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, bsel & ~current);
 		Enc28j60Bank = (address & BANK_MASK);
 	}
 }
@@ -220,6 +217,8 @@ void enc28j60Init(struct uip_eth_addr *mac)
 
 	// perform system reset
 	enc28j60WriteOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
+	// the reset puts ECON1 back to bank 0
+	Enc28j60Bank = 0;
 	// check CLKRDY bit to see if reset is complete
 //	_delay_us(50);
 //	while(!(enc28j60Read(ESTAT) & ESTAT_CLKRDY));
@@ -274,6 +273,12 @@ void enc28j60Init(struct uip_eth_addr *mac)
 	// no loopback of transmitted frames
 	enc28j60PhyWrite(PHCON2, PHCON2_HDLDIS);
 
+	// receive frames for us, broadcasts, and multicasts in the hash table
+	// (empty until enc28j60SetHashTable() is called)
+	for (uint8_t i = 0; i < 8; i++)
+		enc28j60Write(EHT0 + i, 0x00);
+	enc28j60Write(ERXFCON, ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_HTEN|ERXFCON_BCEN);
+
 	// switch to bank 0
 	enc28j60SetBank(ECON1);
 	// enable interrutps
@@ -313,6 +318,12 @@ void enc28j60Init(struct uip_eth_addr *mac)
 */
 }
 
+void enc28j60SetHashTable(const uint8_t table[8])
+{
+	for (uint8_t i = 0; i < 8; i++)
+		enc28j60Write(EHT0 + i, table[i]);
+}
+
 void enc28j60PacketSend(unsigned int len1, unsigned char* packet1, unsigned int len2, unsigned char* packet2)
 {
 	//Errata: Transmit Logic reset
@@ -339,7 +350,8 @@ void enc28j60PacketSend(unsigned int len1, unsigned char* packet1, unsigned int
 
 unsigned int enc28j60PacketReceive(unsigned int maxlen, unsigned char* packet)
 {
-	uint16_t rxstat;
+	// next packet pointer, length and receive status, all little-endian
+	uint8_t header[6];
 	uint16_t len;
 
 	// check if a packet has been received and buffered
@@ -354,22 +366,23 @@ unsigned int enc28j60PacketReceive(unsigned int maxlen, unsigned char* packet)
 	// Set the read pointer to the start of the received packet
 	enc28j60Write(ERDPTL, (NextPacketPtr));
 	enc28j60Write(ERDPTH, (NextPacketPtr)>>8);
-	// read the next packet pointer
-	NextPacketPtr  = enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	NextPacketPtr |= enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
-	// read the packet length
-	len  = enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	len |= enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
-	// read the receive status
-	rxstat  = enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	rxstat |= enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
+
+	// Read the header and the packet in one go: the buffer read carries on
+	// for as long as CS is held, so there's only one command per packet
+	CONFIG_DRIVERS_ENC28J60_CTL_PORT &= ~(1<<CONFIG_DRIVERS_ENC28J60_CTL_PIN);
+	spi_rw(ENC28J60_READ_BUF_MEM);
+	spi_read_block(header, sizeof(header));
+
+	NextPacketPtr = header[0] | (header[1]<<8);
+	len = header[2] | (header[3]<<8);
 
 	// limit retrieve length
 	// (we reduce the MAC-reported length by 4 to remove the CRC)
 	len = MIN(len, maxlen);
 
 	// copy the packet from the receive buffer
-	enc28j60ReadBuffer(len, packet);
+	spi_read_block(packet, len);
+	CONFIG_DRIVERS_ENC28J60_CTL_PORT |= (1<<CONFIG_DRIVERS_ENC28J60_CTL_PIN);
 
 	// Move the RX read pointer to the start of the next received packet
 	// This frees the memory we just read out
@@ -389,4 +402,3 @@ unsigned int enc28j60PacketReceive(unsigned int maxlen, unsigned char* packet)
 
 	return len;
 }
-
@@ -158,6 +158,15 @@
 #define EIR_WOLIF		0x04
 #define EIR_TXERIF		0x02
 #define EIR_RXERIF		0x01
+// ENC28J60 ERXFCON Register Bit Definitions
+#define ERXFCON_UCEN	0x80
+#define ERXFCON_ANDOR	0x40
+#define ERXFCON_CRCEN	0x20
+#define ERXFCON_PMEN	0x10
+#define ERXFCON_MPEN	0x08
+#define ERXFCON_HTEN	0x04
+#define ERXFCON_MCEN	0x02
+#define ERXFCON_BCEN	0x01
 // ENC28J60 ESTAT Register Bit Definitions
 #define ESTAT_INT		0x80
 #define ESTAT_LATECOL	0x10
@@ -297,6 +306,10 @@ void enc28j60PacketSend(unsigned int len1, unsigned char* packet1, unsigned int
 /// \return Packet length in bytes if a packet was retrieved, zero otherwise.
 unsigned int enc28j60PacketReceive(unsigned int maxlen, unsigned char* packet);
 
+//! Set the multicast hash table.
+/// \param	table	64-bit table (EHT0 first) of CRC-derived hash bits to accept
+void enc28j60SetHashTable(const uint8_t table[8]);
+
 //! execute procedure for recovering from a receive overflow
 /// this should be done when the receive memory fills up with packets
 void enc28j60ReceiveOverflowRecover(void);
@@ -19,12 +19,14 @@
  * ****************************************/
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "enc424j600.h"
 
 #include <avr/io.h>
 #include <util/delay.h>
 #include "spi.h"
+#include <trace.h>
 
 // Binary constant identifiers for ReadMemoryWindow() and WriteMemoryWindow()
 // functions
@@ -36,6 +38,24 @@
 #define ENC424J600_CONTROL_PORT	CONFIG_DRIVERS_ENC424J600_CTL_PORT
 #define ENC424J600_CONTROL_DDR	CONFIG_DRIVERS_ENC424J600_CTL_DDR
 #define ENC424J600_CONTROL_CS	CONFIG_DRIVERS_ENC424J600_CTL_PIN
+#ifdef CONFIG_DRIVERS_ENC424J600_INT_VECT
+#define ENC424J600_INT_PINREG	CONFIG_DRIVERS_ENC424J600_INT_PINREG
+#define ENC424J600_INT_DDR		CONFIG_DRIVERS_ENC424J600_INT_DDR
+#define ENC424J600_INT_PIN		CONFIG_DRIVERS_ENC424J600_INT_PIN
+#define ENC424J600_INT_PCMSK	CONFIG_DRIVERS_ENC424J600_INT_PCMSK
+#define ENC424J600_INT_PCIE		CONFIG_DRIVERS_ENC424J600_INT_PCIE
+#endif
+
+#ifndef CONFIG_DRIVERS_ENC424J600_SPI_CLOCK
+#define ENC424J600_SPI_CLOCK	SPI_CLK_DIV2
+#else
+#define ENC424J600_SPI_CLOCK	CONFIG_DRIVERS_ENC424J600_SPI_CLOCK
+#endif
+
+static const spi_device_t enc424j600_spi = {
+	&ENC424J600_CONTROL_PORT, ENC424J600_CONTROL_CS,
+	ENC424J600_SPI_CLOCK | SPI_MODE0,
+};
 
 // Promiscuous mode, uncomment if you want to receive all packets, even those which are not for you
 // #define PROMISCUOUS_MODE
@@ -43,14 +63,26 @@
 // Internal MAC level variables and flags.
 static uint8_t currentBank;
 static uint16_t nextPacketPointer;
+static uint8_t rxHeld;
+static uint8_t rxPending; // packets known to be waiting, from ESTAT.PKTCNT
+static uint16_t txNext; // start of the TX slot to write next
+static uint8_t linkUp;
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+static uint16_t rxPacketData; // SRAM address of the held packet's data
+#endif
 
 
 void enc424j600Init(void);
 uint16_t enc424j600PacketReceive(uint16_t maxlen, uint8_t* packet);
-void enc424j600PacketSend(uint16_t len, uint8_t* packet);
+uint16_t enc424j600PacketHold(uint16_t maxlen, uint8_t* packet);
+void enc424j600PacketRelease(void);
+int enc424j600PacketSend(uint16_t len, uint8_t* packet);
 void enc424j600GetMACAddr(uint8_t addr[6]);
 
-void enc424j600MACFlush(void);
+void enc424j600LinkUpdate(void);
+static uint16_t enc424j600TxWrite(uint16_t len, uint8_t* packet,
+	uint16_t dlen, uint8_t* data);
+static int enc424j600TxStart(uint16_t addr, uint16_t len);
 static void enc424j600SendSystemReset(void);
 uint16_t enc424j600ReadReg(uint16_t address);
 void enc424j600WriteReg(uint16_t address, uint16_t data);
@@ -83,6 +115,9 @@ void enc424j600Init(void) {
 
 	// Initialize RX tracking variables and other control state flags
 	nextPacketPointer = ENC424J600_RXSTART;
+	txNext = ENC424J600_TXSTART;
+	linkUp = 0;
+	rxPending = 0;
 
 	// Set up TX/RX/UDA buffer addresses
 	enc424j600WriteReg(ETXST, ENC424J600_TXSTART);
@@ -94,6 +129,14 @@ void enc424j600Init(void) {
 	// If promiscuous mode is set, than allow accept all packets
 #ifdef PROMISCUOUS_MODE
 	enc424j600WriteReg(ERXFCON,(ERXFCON_CRCEN | ERXFCON_RUNTEN | ERXFCON_UCEN | ERXFCON_NOTMEEN | ERXFCON_MCEN));
+#else
+	// Otherwise only unicasts for us, broadcasts, and multicasts in the hash
+	// table (empty until enc424j600SetHashTable() is called)
+	enc424j600WriteReg(EHT1, 0);
+	enc424j600WriteReg(EHT2, 0);
+	enc424j600WriteReg(EHT3, 0);
+	enc424j600WriteReg(EHT4, 0);
+	enc424j600WriteReg(ERXFCON,(ERXFCON_CRCEN | ERXFCON_RUNTEN | ERXFCON_UCEN | ERXFCON_BCEN | ERXFCON_HTEN));
 #endif
 
 	// Set PHY Auto-negotiation to support 10BaseT Half duplex,
@@ -101,10 +144,26 @@ void enc424j600Init(void) {
 	// and symmetric PAUSE capability
 	enc424j600WritePHYReg(PHANA, PHANA_ADPAUS0 | PHANA_AD10FD | PHANA_AD10 | PHANA_AD100FD | PHANA_AD100 | PHANA_ADIEEE0);
 
+#ifdef CONFIG_DRIVERS_ENC424J600_INT_VECT
+	// Assert INT while there are received packets waiting, and raise a pin
+	// change interrupt when it moves (the bit in PCMSK matches the pin)
+	ENC424J600_INT_DDR &= ~_BV(ENC424J600_INT_PIN);
+	enc424j600WriteReg(EIE, EIE_INTIE | EIE_PKTIE);
+	ENC424J600_INT_PCMSK |= _BV(ENC424J600_INT_PIN);
+	PCICR |= _BV(ENC424J600_INT_PCIE);
+#endif
+
 	// Enable RX packet reception
 	enc424j600BFSReg(ECON1, ECON1_RXEN);
 }
 
+#ifdef CONFIG_DRIVERS_ENC424J600_INT_VECT
+uint8_t enc424j600IntAsserted(void) {
+	// INT is active low
+	return !(ENC424J600_INT_PINREG & _BV(ENC424J600_INT_PIN));
+}
+#endif
+
 /********************************************************************
  * UTILS
  * ******************************************************************/
@@ -139,16 +198,29 @@ static void enc424j600SendSystemReset(void) {
  * ******************************************************************/
 
 uint16_t enc424j600PacketReceive(uint16_t len, uint8_t* packet) {
-	uint16_t newRXTail;
+	len = enc424j600PacketHold(len, packet);
+	enc424j600PacketRelease();
+
+	return len;
+}
+
+uint16_t enc424j600PacketHold(uint16_t len, uint8_t* packet) {
 	RXSTATUS statusVector;
 
-	if (!(enc424j600ReadReg(EIR) & EIR_PKTIF)) {
-		return 0;
+	// Only ask the chip how many packets it has once the ones it told us
+	// about last time have been read
+	if (!rxPending) {
+		rxPending = enc424j600ReadReg(ESTAT) & ESTAT_PKTCNT;
+		if (!rxPending)
+			return 0;
 	}
 
 
 	// Set the RX Read Pointer to the beginning of the next unprocessed packet
 	enc424j600WriteReg(ERXRDPT, nextPacketPointer);
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+	rxPacketData = nextPacketPointer + sizeof (nextPacketPointer) + sizeof (statusVector);
+#endif
 
 
 	enc424j600ReadMemoryWindow(RX_WINDOW, (uint8_t*) & nextPacketPointer, sizeof (nextPacketPointer));
@@ -156,6 +228,20 @@ uint16_t enc424j600PacketReceive(uint16_t len, uint8_t* packet) {
 	//    if (statusVector.bits.ByteCount <= len) len = statusVector.bits.ByteCount;
 	len = (statusVector.bits.ByteCount <= len + 4) ? statusVector.bits.ByteCount - 4 : 0;
 	enc424j600ReadMemoryWindow(RX_WINDOW, packet, len);
+	TRACE(TRACE_NIC_RX, len);
+
+	rxHeld = 1;
+
+	return len;
+}
+
+void enc424j600PacketRelease(void) {
+	uint16_t newRXTail;
+
+	if (!rxHeld)
+		return;
+	rxHeld = 0;
+	rxPending--;
 
 	newRXTail = nextPacketPointer - 2;
 	//Special situation if nextPacketPointer is exactly RXSTART
@@ -167,20 +253,143 @@ uint16_t enc424j600PacketReceive(uint16_t len, uint8_t* packet) {
 
 	//Write new RX tail
 	enc424j600WriteReg(ERXTAIL, newRXTail);
+}
 
-	return len;
+int enc424j600PacketSend(uint16_t len, uint8_t* packet) {
+	return enc424j600TxStart(enc424j600TxWrite(len, packet, 0, NULL), len);
 }
 
-void enc424j600PacketSend(uint16_t len, uint8_t* packet) {
-	// Set the Window Write Pointer to the beginning of the transmit buffer
-	enc424j600WriteMemoryWindow(GP_WINDOW, packet, len);
+uint8_t enc424j600PacketHeld(void) {
+	return rxHeld;
+}
 
-	enc424j600WriteReg(EGPWRPT, ENC424J600_TXSTART);
-	enc424j600WriteReg(ETXLEN, len);
+uint8_t enc424j600RxAborted(void) {
+	if (!(enc424j600ReadReg(EIR) & EIR_RXABTIF))
+		return 0;
+
+	enc424j600BFCReg(EIR, EIR_RXABTIF);
+	return 1;
+}
+
+uint16_t enc424j600RxUsed(void) {
+	uint16_t head = enc424j600ReadReg(ERXHEAD);
+
+	// Everything from the next packet we'll read up to where the chip will
+	// write the next one it receives
+	if (head >= nextPacketPointer)
+		return head - nextPacketPointer;
+	return ENC424J600_RXSIZE - (nextPacketPointer - head);
+}
+
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+/********************************************************************
+ * CHECKSUM OFFLOAD
+ * ******************************************************************/
+// Run the DMA checksum engine over len bytes of SRAM from addr. Returns the
+// ones' complement sum of the data (not inverted) in host byte order, so it
+// can be added to a pseudo-header sum done in software.
+static uint16_t enc424j600DMASum(uint16_t addr, uint16_t len) {
+	uint16_t cs;
+
+	if (!len)
+		return 0;
+
+	while (enc424j600ReadReg(ECON1) & ECON1_DMAST);
+
+	enc424j600WriteReg(EDMAST, addr);
+	enc424j600WriteReg(EDMALEN, len);
+	enc424j600BFCReg(ECON1, ECON1_DMACPY | ECON1_DMANOCS | ECON1_DMACSSD);
+	enc424j600BFSReg(ECON1, ECON1_DMAST);
+
+	while (enc424j600ReadReg(ECON1) & ECON1_DMAST);
+
+	// EDMACSL holds the byte that goes first on the wire
+	cs = enc424j600ReadReg(EDMACS);
+	return ~((cs << 8) | (cs >> 8));
+}
+
+static uint16_t enc424j600AddSum(uint16_t a, uint16_t b) {
+	a += b;
+	return a + (a < b);
+}
+
+// Copy len bytes of SRAM from src to dst with the DMA engine
+static void enc424j600DMACopy(uint16_t src, uint16_t dst, uint16_t len) {
+	if (!len)
+		return;
+
+	while (enc424j600ReadReg(ECON1) & ECON1_DMAST);
+
+	enc424j600WriteReg(EDMAST, src);
+	enc424j600WriteReg(EDMALEN, len);
+	enc424j600WriteReg(EDMADST, dst);
+	enc424j600BFSReg(ECON1, ECON1_DMACPY | ECON1_DMANOCS);
+	enc424j600BFSReg(ECON1, ECON1_DMAST);
 
-	enc424j600MACFlush();
+	// enc424j600DMASum() waits for the copy to finish before it starts
+}
+
+// Fill in the checksum of the frame in the TX slot at addr and send it
+static int enc424j600TxChecksum(uint16_t addr, uint16_t len,
+	uint16_t start, uint16_t field, uint16_t sum)
+{
+	uint8_t cs[2];
+
+	// The checksum field must be zero in packet while it is summed
+	sum = ~enc424j600AddSum(sum, enc424j600DMASum(addr + start, len - start));
+	if (!sum)
+		sum = 0xffff;
+	cs[0] = sum >> 8;
+	cs[1] = sum;
+
+	enc424j600WriteReg(EGPWRPT, addr + field);
+	enc424j600WriteMemoryWindow(GP_WINDOW, cs, sizeof(cs));
+
+	return enc424j600TxStart(addr, len);
+}
+
+uint16_t enc424j600ChecksumRx(uint16_t offset, uint16_t len, uint16_t sum) {
+	uint16_t addr = rxPacketData + offset;
 
+	// The DMA wraps at the end of the RX buffer by itself, but the start
+	// address must be inside it
+	if (addr >= ENC424J600_RAMSIZE)
+		addr -= ENC424J600_RAMSIZE - ENC424J600_RXSTART;
 
+	return enc424j600AddSum(sum, enc424j600DMASum(addr, len));
+}
+
+int enc424j600PacketSendChecksum(uint16_t len, uint8_t* packet,
+	uint16_t start, uint16_t field, uint16_t sum)
+{
+	return enc424j600PacketSendChecksumData(len, packet, 0, NULL,
+		start, field, sum);
+}
+
+int enc424j600PacketSendChecksumData(uint16_t len, uint8_t* packet,
+	uint16_t dlen, uint8_t* data, uint16_t start, uint16_t field, uint16_t sum)
+{
+	uint16_t addr = enc424j600TxWrite(len, packet, dlen, data);
+
+	return enc424j600TxChecksum(addr, len + dlen, start, field, sum);
+}
+
+int enc424j600PacketSendChecksumSRAM(uint16_t len, uint8_t* packet,
+	uint16_t src, uint16_t dlen, uint16_t start, uint16_t field, uint16_t sum)
+{
+	uint16_t addr = enc424j600TxWrite(len, packet, 0, NULL);
+
+	enc424j600DMACopy(src, addr + len, dlen);
+
+	return enc424j600TxChecksum(addr, len + dlen, start, field, sum);
+}
+#endif
+
+void enc424j600SetHashTable(const uint8_t table[8]) {
+	enc424j600WriteReg(EHT1, table[0] | ((uint16_t)table[1] << 8));
+	enc424j600WriteReg(EHT2, table[2] | ((uint16_t)table[3] << 8));
+	enc424j600WriteReg(EHT3, table[4] | ((uint16_t)table[5] << 8));
+	enc424j600WriteReg(EHT4, table[6] | ((uint16_t)table[7] << 8));
 }
 
 void enc424j600GetMACAddr(uint8_t mac_addr[6]) {
@@ -197,42 +406,74 @@ void enc424j600GetMACAddr(uint8_t mac_addr[6]) {
 	mac_addr[5] = ((uint8_t*) & regValue)[1];
 }
 
-void enc424j600MACFlush(void) {
+void enc424j600LinkUpdate(void) {
 	uint16_t w;
+	uint16_t estat;
 
 	// Check to see if the duplex status has changed.  This can
 	// change if the user unplugs the cable and plugs it into a
 	// different node.  Auto-negotiation will automatically set
 	// the duplex in the PHY, but we must also update the MAC
 	// inter-packet gap timing and duplex state to match.
-	if (enc424j600ReadReg(EIR) & EIR_LINKIF) {
-		enc424j600BFCReg(EIR, EIR_LINKIF);
-
-		// Update MAC duplex settings to match PHY duplex setting
-		w = enc424j600ReadReg(MACON2);
-		if (enc424j600ReadReg(ESTAT) & ESTAT_PHYDPX) {
-			// Switching to full duplex
-			enc424j600WriteReg(MABBIPG, 0x15);
-			w |= MACON2_FULDPX;
-		} else {
-			// Switching to half duplex
-			enc424j600WriteReg(MABBIPG, 0x12);
-			w &= ~MACON2_FULDPX;
-		}
-		enc424j600WriteReg(MACON2, w);
+	enc424j600BFCReg(EIR, EIR_LINKIF);
+	estat = enc424j600ReadReg(ESTAT);
+
+	// Update MAC duplex settings to match PHY duplex setting
+	w = enc424j600ReadReg(MACON2);
+	if (estat & ESTAT_PHYDPX) {
+		// Switching to full duplex
+		enc424j600WriteReg(MABBIPG, 0x15);
+		w |= MACON2_FULDPX;
+	} else {
+		// Switching to half duplex
+		enc424j600WriteReg(MABBIPG, 0x12);
+		w &= ~MACON2_FULDPX;
 	}
+	enc424j600WriteReg(MACON2, w);
+
+	linkUp = (estat & ESTAT_PHYLNK) ? 1 : 0;
+}
+
+// Copy a frame into the next TX slot, returning the slot's address. The
+// previous frame may still be going out of another slot meanwhile. The frame
+// is len bytes of packet followed by dlen bytes of data.
+static uint16_t enc424j600TxWrite(uint16_t len, uint8_t* packet,
+	uint16_t dlen, uint8_t* data)
+{
+	uint16_t addr = txNext;
+
+	txNext += ENC424J600_TXSLOTSIZE;
+	if (txNext >= ENC424J600_TXEND)
+		txNext = ENC424J600_TXSTART;
 
+	enc424j600WriteReg(EGPWRPT, addr);
+	enc424j600WriteMemoryWindow(GP_WINDOW, packet, len);
+
+	// The write pointer carries on from the end of the first piece
+	if (dlen)
+		enc424j600WriteMemoryWindow(GP_WINDOW, data, dlen);
+
+	return addr;
+}
+
+static int enc424j600TxStart(uint16_t addr, uint16_t len) {
+	TRACE(TRACE_NIC_TX, len);
+
+	// Wait for the previous frame to finish
+	while (enc424j600ReadReg(ECON1) & ECON1_TXRTS);
 
 	// Start the transmission, but only if we are linked.  Supressing
 	// transmissing when unlinked is necessary to avoid stalling the TX engine
 	// if we are in PHY energy detect power down mode and no link is present.
-	// A stalled TX engine won't do any harm in itself, but will cause the
-	// MACIsTXReady() function to continuously return FALSE, which will
-	// ultimately stall the Microchip TCP/IP stack since there is blocking code
-	// elsewhere in other files that expect the TX engine to always self-free
-	// itself very quickly.
-	if (enc424j600ReadReg(ESTAT) & ESTAT_PHYLNK)
-		enc424j600BFSReg(ECON1, ECON1_TXRTS);
+	// A stalled TX engine would make the wait above spin forever.
+	if (!linkUp)
+		return -1;
+
+	enc424j600WriteReg(ETXST, addr);
+	enc424j600WriteReg(ETXLEN, len);
+	enc424j600BFSReg(ECON1, ECON1_TXRTS);
+
+	return 0;
 }
 
 /********************************************************************
@@ -264,6 +505,18 @@ void enc424j600WriteMemoryWindow(uint8_t window, uint8_t *data, uint16_t length)
 		enc424j600ReadN(op, data, length);
 	}
 
+void enc424j600ReadSRAM(uint16_t addr, uint8_t *data, uint16_t len) {
+	enc424j600WriteReg(EGPRDPT, addr);
+	enc424j600ReadMemoryWindow(GP_WINDOW, data, len);
+}
+
+#if ENC424J600_CACHESIZE
+void enc424j600WriteSRAM(uint16_t addr, uint8_t *data, uint16_t len) {
+	enc424j600WriteReg(EGPWRPT, addr);
+	enc424j600WriteMemoryWindow(GP_WINDOW, data, len);
+}
+#endif
+
 /**
  * Reads from address
  * @variable <uint16_t> address - register address
@@ -365,38 +618,30 @@ void enc424j600WritePHYReg(uint8_t address, uint16_t Data) {
 
 static void enc424j600ReadN(uint8_t op, uint8_t* data, uint16_t dataLen) {
 	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	spi_acquire(&enc424j600_spi);
 
 	// Issue read command
 	spi_rw(op);
 
 	// Fill the data buffer
-	while (dataLen--) {
-		*data++ = spi_rw(0x00);
-	}
+	spi_read_block(data, dataLen);
 
 	// Release SPI
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	spi_release(&enc424j600_spi);
 }
 
 static void enc424j600WriteN(uint8_t op, uint8_t* data, uint16_t dataLen) {
 	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	spi_acquire(&enc424j600_spi);
 
 	// Issue write command
 	spi_rw(op);
 
 	// Write data
-	while (dataLen--) {
-		spi_rw(*data++);
-	}
+	spi_write_block(data, dataLen);
 
 	// Release SPI
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	spi_release(&enc424j600_spi);
 }
 
 static void enc424j600BFSReg(uint16_t address, uint16_t bitMask) {
@@ -450,15 +695,13 @@ static void enc424j600BFCReg(uint16_t address, uint16_t bitMask) {
  */
 static void enc424j600ExecuteOp0(uint8_t op) {
 	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	spi_acquire(&enc424j600_spi);
 
 	// Issue command
 	spi_rw(op);
 
 	// Release SPI
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	spi_release(&enc424j600_spi);
 }
 
 /**
@@ -470,8 +713,7 @@ uint8_t enc424j600ExecuteOp8(uint8_t op, uint8_t data) {
 	uint8_t returnValue;
 
 	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	spi_acquire(&enc424j600_spi);
 
 	// Issue command
 	spi_rw(op);
@@ -480,8 +722,7 @@ uint8_t enc424j600ExecuteOp8(uint8_t op, uint8_t data) {
 	returnValue = spi_rw(data);
 
 	// release CS
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	spi_release(&enc424j600_spi);
 
 	return returnValue;
 }
@@ -495,20 +736,16 @@ uint16_t enc424j600ExecuteOp16(uint8_t op, uint16_t data) {
 	uint16_t returnValue;
 
 	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	spi_acquire(&enc424j600_spi);
 
 	// Issue command
 	spi_rw(op);
 
 	// Read/write data
-	for (int x = 0; x < 2; x++) {
-		((uint8_t*) & returnValue)[x] = spi_rw(((uint8_t*) & data)[x]);
-	}
+	spi_xfer_block((uint8_t*) & data, (uint8_t*) & returnValue, 2);
 
 	// release CS
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	spi_release(&enc424j600_spi);
 
 	return returnValue;
 }
@@ -519,23 +756,19 @@ uint16_t enc424j600ExecuteOp16(uint8_t op, uint16_t data) {
  * @variable <uint32_t> data - data
  */
 uint32_t enc424j600ExecuteOp32(uint8_t op, uint32_t data) {
-	uint16_t returnValue;
+	uint32_t returnValue = 0;
 
 	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	spi_acquire(&enc424j600_spi);
 
 	// Issue command
 	spi_rw(op);
 
 	// Read/write data
-	for (int x = 0; x < 3; x++) {
-		((uint8_t*) & returnValue)[x] = spi_rw(((uint8_t*) & data)[x]);
-	}
+	spi_xfer_block((uint8_t*) & data, (uint8_t*) & returnValue, 3);
 
 	// release CS
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	spi_release(&enc424j600_spi);
 
 	return returnValue;
 }
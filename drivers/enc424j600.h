@@ -58,16 +58,76 @@
 // ENC424J600 config
 #define ENC424J600_RAMSIZE	(0x6000)
 #define ENC424J600_TXSTART	(0x0000)
-#define ENC424J600_RXSTART	(0x0600) // Should be an even memory address
+#define ENC424J600_TXSLOTSIZE	(0x0600) // Room for one full-size frame
+#define ENC424J600_TXSLOTS	(2) // Write one frame while another is sent
+#define ENC424J600_TXEND	(ENC424J600_TXSTART + \
+	ENC424J600_TXSLOTS * ENC424J600_TXSLOTSIZE)
+// SRAM set aside between the TX slots and the RX buffer for the driver's
+// users to keep data in, for copying into frames with the DMA engine
+#ifndef CONFIG_DRIVERS_ENC424J600_CACHE
+#define ENC424J600_CACHESIZE	(0)
+#else
+#define ENC424J600_CACHESIZE	(CONFIG_DRIVERS_ENC424J600_CACHE)
+#endif
+#define ENC424J600_CACHESTART	ENC424J600_TXEND
+#define ENC424J600_RXSTART	(ENC424J600_CACHESTART + \
+	ENC424J600_CACHESIZE) // Should be an even memory address
+#define ENC424J600_RXSIZE	(ENC424J600_RAMSIZE - ENC424J600_RXSTART)
 
 void enc424j600Init(void);
 uint16_t enc424j600PacketReceive(uint16_t maxlen, uint8_t* packet);
-void enc424j600PacketSend(uint16_t len, uint8_t* packet);
+// Returns -1 if the frame couldn't be sent (no link)
+int enc424j600PacketSend(uint16_t len, uint8_t* packet);
+// Like enc424j600PacketReceive() but the packet stays in the RX buffer until
+// enc424j600PacketRelease(), so it can be checksummed there
+uint16_t enc424j600PacketHold(uint16_t maxlen, uint8_t* packet);
+void enc424j600PacketRelease(void);
+// Non-zero if a packet is held, even one enc424j600PacketHold() returned 0
+// for because it was too big
+uint8_t enc424j600PacketHeld(void);
+// Check and clear the flag saying a packet was lost to a full RX buffer
+uint8_t enc424j600RxAborted(void);
+// Bytes of the RX buffer taken up by packets not yet read
+uint16_t enc424j600RxUsed(void);
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+// Add the sum of len bytes of the held packet from offset to sum (a ones'
+// complement sum in host byte order, like the return value)
+uint16_t enc424j600ChecksumRx(uint16_t offset, uint16_t len, uint16_t sum);
+// Send a packet, filling the 16-bit checksum at field with the checksum of the
+// packet from start to the end plus sum (e.g. an IP pseudo-header)
+int enc424j600PacketSendChecksum(uint16_t len, uint8_t* packet,
+	uint16_t start, uint16_t field, uint16_t sum);
+// The same for a frame in two pieces: len bytes of packet (which must hold
+// the checksum field) followed by dlen bytes of data
+int enc424j600PacketSendChecksumData(uint16_t len, uint8_t* packet,
+	uint16_t dlen, uint8_t* data, uint16_t start, uint16_t field, uint16_t sum);
+// The same again, but the dlen bytes are copied by the DMA engine from SRAM
+// at src, which saves sending them over SPI
+int enc424j600PacketSendChecksumSRAM(uint16_t len, uint8_t* packet,
+	uint16_t src, uint16_t dlen, uint16_t start, uint16_t field, uint16_t sum);
+#endif
+#if ENC424J600_CACHESIZE
+// Write len bytes into SRAM at addr, which should be in the cache area
+void enc424j600WriteSRAM(uint16_t addr, uint8_t *data, uint16_t len);
+#endif
 void enc424j600GetMACAddr(uint8_t addr[6]);
+// Set the 64-bit multicast hash table (EHT1L first); frames whose hash bit
+// is set are received as well as unicasts to us and broadcasts
+void enc424j600SetHashTable(const uint8_t table[8]);
+// Match the MAC duplex settings to the PHY and note whether the link is up
+// (no frames are sent while it is down). Call when the link changes.
+void enc424j600LinkUpdate(void);
+#ifdef CONFIG_DRIVERS_ENC424J600_INT_VECT
+// Non-zero while the INT pin says a received packet is waiting
+uint8_t enc424j600IntAsserted(void);
+#endif
 uint16_t enc424j600ReadReg(uint16_t address);
 void enc424j600WriteReg(uint16_t address, uint16_t data);
 uint16_t enc424j600ReadPHYReg(uint8_t address);
 void enc424j600WritePHYReg(uint8_t address, uint16_t Data);
+// Read the controller's SRAM through the general purpose window, which
+// nothing else leaves pointing anywhere in particular
+void enc424j600ReadSRAM(uint16_t addr, uint8_t *data, uint16_t len);
 
 // Crypto memory addresses.  These are accessible by the DMA only and therefore
 // have the same addresses no matter what MCU interface is being used (SPI,
@@ -402,6 +462,7 @@ typedef union __attribute__((aligned(2), packed)) {
 #define ESTAT_PKTCNT2           (1<<2)
 #define ESTAT_PKTCNT1           (1<<1)
 #define ESTAT_PKTCNT0           (1)
+#define ESTAT_PKTCNT            (0xff)
 
 // EIR bits ------------
 #define EIR_CRYPTEN		((uint16_t)1<<15)
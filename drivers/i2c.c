@@ -1,201 +1,203 @@
-/*************************************************************************
-* Title:    I2C master library using hardware TWI interface
-* Author:   Peter Fleury <pfleury@gmx.ch>  http://jump.to/fleury
-* File:     $Id: twimaster.c,v 1.3 2005/07/02 11:14:21 Peter Exp $
-* Software: AVR-GCC 3.4.3 / avr-libc 1.2.3
-* Target:   any AVR device with hardware TWI 
-* Usage:    API compatible with I2C Software Library i2cmaster.h
-**************************************************************************/
-#include <inttypes.h>
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
 #include <compat/twi.h>
+#include <util/atomic.h>
+#include <sys/process.h>
 #include <init.h>
 
 #include "i2c.h"
 
-
 /* I2C clock in Hz */
-#define SCL_CLOCK  100000L
-
-
-/*************************************************************************
- Initialization of the I2C bus interface. Need to be called only once
-*************************************************************************/
-void i2c_init(void)
-{
-  /* initialize TWI clock: 100 kHz clock, TWPS = 0 => prescaler = 1 */
-  
-  TWSR = 0;                         /* no prescaler */
-  TWBR = ((F_CPU/SCL_CLOCK)-16)/2;  /* must be > 10 for stable operation */
-
-}/* i2c_init */
-
-
-/*************************************************************************	
-  Issues a start condition and sends address and transfer direction.
-  return 0 = device accessible, 1= failed to access device
-*************************************************************************/
-unsigned char i2c_start(unsigned char address)
-{
-    uint8_t   twst;
-
-	// send START condition
-	TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
-
-	// wait until transmission completed
-	while(!(TWCR & (1<<TWINT)));
-
-	// check value of TWI Status Register. Mask prescaler bits.
-	twst = TW_STATUS & 0xF8;
-	if ( (twst != TW_START) && (twst != TW_REP_START)) return 1;
-
-	// send device address
-	TWDR = address;
-	TWCR = (1<<TWINT) | (1<<TWEN);
-
-	// wail until transmission completed and ACK/NACK has been received
-	while(!(TWCR & (1<<TWINT)));
-
-	// check value of TWI Status Register. Mask prescaler bits.
-	twst = TW_STATUS & 0xF8;
-	if ( (twst != TW_MT_SLA_ACK) && (twst != TW_MR_SLA_ACK) ) return 1;
-
-	return 0;
-
-}/* i2c_start */
-
-
-/*************************************************************************
- Issues a start condition and sends address and transfer direction.
- If device is busy, use ack polling to wait until device is ready
- 
- Input:   address and transfer direction of I2C device
-*************************************************************************/
-void i2c_start_wait(unsigned char address)
-{
-    uint8_t   twst;
-
-
-    while ( 1 )
-    {
-	    // send START condition
-	    TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
-    
-    	// wait until transmission completed
-    	while(!(TWCR & (1<<TWINT)));
-    
-    	// check value of TWI Status Register. Mask prescaler bits.
-    	twst = TW_STATUS & 0xF8;
-    	if ( (twst != TW_START) && (twst != TW_REP_START)) continue;
-    
-    	// send device address
-    	TWDR = address;
-    	TWCR = (1<<TWINT) | (1<<TWEN);
-    
-    	// wail until transmission completed
-    	while(!(TWCR & (1<<TWINT)));
-    
-    	// check value of TWI Status Register. Mask prescaler bits.
-    	twst = TW_STATUS & 0xF8;
-    	if ( (twst == TW_MT_SLA_NACK )||(twst ==TW_MR_DATA_NACK) ) 
-    	{    	    
-    	    /* device busy, send stop condition to terminate write operation */
-	        TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
-	        
-	        // wait until stop condition is executed and bus released
-	        while(TWCR & (1<<TWSTO));
-	        
-    	    continue;
-    	}
-    	//if( twst != TW_MT_SLA_ACK) return 1;
-    	break;
-     }
-
-}/* i2c_start_wait */
-
-
-/*************************************************************************
- Issues a repeated start condition and sends address and transfer direction 
-
- Input:   address and transfer direction of I2C device
- 
- Return:  0 device accessible
-          1 failed to access device
-*************************************************************************/
-unsigned char i2c_rep_start(unsigned char address)
-{
-    return i2c_start( address );
-
-}/* i2c_rep_start */
-
-
-/*************************************************************************
- Terminates the data transfer and releases the I2C bus
-*************************************************************************/
-void i2c_stop(void)
-{
-    /* send stop condition */
-	TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
-	
-	// wait until stop condition is executed and bus released
-	while(TWCR & (1<<TWSTO));
-
-}/* i2c_stop */
-
-
-/*************************************************************************
-  Send one byte to I2C device
-  
-  Input:    byte to be transfered
-  Return:   0 write successful 
-            1 write failed
-*************************************************************************/
-unsigned char i2c_write( unsigned char data )
-{	
-    uint8_t   twst;
-    
-	// send data to the previously addressed device
-	TWDR = data;
-	TWCR = (1<<TWINT) | (1<<TWEN);
-
-	// wait until transmission completed
-	while(!(TWCR & (1<<TWINT)));
-
-	// check value of TWI Status Register. Mask prescaler bits
-	twst = TW_STATUS & 0xF8;
-	if( twst != TW_MT_DATA_ACK) return 1;
-	return 0;
-
-}/* i2c_write */
+#ifndef CONFIG_DRIVERS_I2C_CLOCK
+#define I2C_CLOCK 100000L
+#else
+#define I2C_CLOCK CONFIG_DRIVERS_I2C_CLOCK
+#endif
+
+// Bit rate register value (prescaler = 1)
+#define I2C_TWBR (((F_CPU / I2C_CLOCK) - 16) / 2)
+
+#if I2C_TWBR < 10
+#warning "I2C clock too fast for this CPU clock, TWBR should be 10 or more"
+#endif
+
+#define TWCR_GO		(_BV(TWINT) | _BV(TWEN) | _BV(TWIE))
+#define TWCR_STOP	(_BV(TWINT) | _BV(TWEN) | _BV(TWSTO))
+
+// Transaction queue; the head is the one on the bus
+static i2c_xfer_t *head;
+static i2c_xfer_t *tail;
+
+// Progress through the current transaction
+static uint8_t *ptr;
+static uint8_t left;
+static uint8_t in_hdr;
+
+void i2c_init(void) {
+	TWSR = 0; // no prescaler
+	TWBR = I2C_TWBR;
+}
 
+void i2c_xfer_queue(i2c_xfer_t *x) {
+	x->next = NULL;
+	x->status = I2C_XFER_QUEUED;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (head) {
+			tail->next = x;
+			tail = x;
+		}
+		else {
+			head = tail = x;
+
+			// wait for the last STOP condition to go out, then START
+			while (TWCR & _BV(TWSTO));
+			TWCR = TWCR_GO | _BV(TWSTA);
+		}
+	}
+}
 
-/*************************************************************************
- Read one byte from the I2C device, request more data from device 
- 
- Return:  byte read from I2C device
-*************************************************************************/
-unsigned char i2c_readAck(void)
+int i2c_transfer(uint8_t addr, const void *hdr, uint8_t hlen,
+	void *data, uint8_t len)
 {
-	TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA);
-	while(!(TWCR & (1<<TWINT)));    
-
-    return TWDR;
-
-}/* i2c_readAck */
-
+	i2c_xfer_t x = {
+		.addr = addr,
+		.hdr = hdr,
+		.hlen = hlen,
+		.data = data,
+		.len = len,
+	};
+
+	i2c_xfer_queue(&x);
+	while (i2c_xfer_busy(&x));
+
+	return (x.status == I2C_XFER_DONE) ? 0 : -1;
+}
 
-/*************************************************************************
- Read one byte from the I2C device, read is followed by a stop condition 
- 
- Return:  byte read from I2C device
-*************************************************************************/
-unsigned char i2c_readNak(void)
-{
-	TWCR = (1<<TWINT) | (1<<TWEN);
-	while(!(TWCR & (1<<TWINT)));
-	
-    return TWDR;
+// Finish the current transaction and start the next one (called by the ISR)
+static void xfer_end(int8_t status) {
+	i2c_xfer_t *x = head;
+	struct process *p = x->process;
+
+	head = x->next;
+	x->status = status;
+
+	if (head) {
+		// STOP followed by START
+		TWCR = TWCR_GO | _BV(TWSTO) | _BV(TWSTA);
+	}
+	else {
+		TWCR = TWCR_STOP;
+	}
+
+	if (p) {
+		process_poll(p);
+	}
+}
 
-}/* i2c_readNak */
+ISR(TWI_vect) {
+	i2c_xfer_t *x = head;
+	uint8_t twcr = TWCR_GO;
+
+	switch (TW_STATUS) {
+	case TW_START:
+		if (x->hlen) {
+			// header first, always written
+			in_hdr = 1;
+			ptr = (uint8_t *)x->hdr;
+			left = x->hlen;
+			TWDR = x->addr & ~I2C_READ;
+		}
+		else {
+			in_hdr = 0;
+			ptr = x->data;
+			left = x->len;
+			TWDR = x->addr;
+		}
+		break;
+
+	case TW_REP_START:
+		// turned round after the header to read the data
+		TWDR = x->addr | I2C_READ;
+		break;
+
+	case TW_MT_SLA_ACK:
+	case TW_MT_DATA_ACK:
+		if (in_hdr && !left) {
+			in_hdr = 0;
+			ptr = x->data;
+			left = x->len;
+
+			if (x->addr & I2C_READ) {
+				twcr |= _BV(TWSTA);
+				break;
+			}
+		}
+
+		if (!left) {
+			xfer_end(I2C_XFER_DONE);
+			return;
+		}
+
+		TWDR = *ptr++;
+		left--;
+		break;
+
+	case TW_MR_SLA_ACK:
+		if (!left) {
+			xfer_end(I2C_XFER_DONE);
+			return;
+		}
+
+		// ACK every byte but the last
+		if (left > 1) {
+			twcr |= _BV(TWEA);
+		}
+		break;
+
+	case TW_MR_DATA_ACK:
+		*ptr++ = TWDR;
+		left--;
+
+		if (left > 1) {
+			twcr |= _BV(TWEA);
+		}
+		break;
+
+	case TW_MR_DATA_NACK:
+		*ptr++ = TWDR;
+		xfer_end(I2C_XFER_DONE);
+		return;
+
+	default:
+		// NACK from the device, bus error or lost arbitration
+		xfer_end(I2C_XFER_FAILED);
+		return;
+	}
+
+	TWCR = twcr;
+}
 
 static int i2c_autoinit(void) {
 	i2c_init();
@@ -203,4 +205,3 @@ static int i2c_autoinit(void) {
 }
 
 INIT_DRIVER(i2c, i2c_autoinit);
-
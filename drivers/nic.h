@@ -0,0 +1,280 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef NIC_H
+#define NIC_H
+
+/*
+ * The Ethernet controller the network stack drives, chosen at build time.
+ * Each driver's nic_*() functions are static inline wrappers around its own
+ * calls, so code written against them compiles to direct calls into the one
+ * driver that's built, and NIC_CAPS says what the hardware can do so paths
+ * that depend on it can be tested for with #if and left out when it can't.
+ *
+ *   NIC_CAP_HW_CHKSUM  checks received TCP/UDP checksums while a frame is
+ *                      held, and fills them in on send: nic_rx_chksum(),
+ *                      nic_send_chksum()
+ *   NIC_CAP_TX_GATHER  sends a frame from two buffers, headers and payload
+ *                      (with NIC_CAP_HW_CHKSUM, only through nic_send_chksum())
+ *   NIC_CAP_TX_SRAM    the payload can come from the NIC's own SRAM instead:
+ *                      nic_send_chksum_sram()
+ *   NIC_CAP_RX_COUNT   says how much of its RX buffer (NIC_RX_SIZE bytes) is
+ *                      waiting to be read: nic_rx_used()
+ *   NIC_CAP_RX_INT     has an interrupt for received frames, NIC_RX_VECT,
+ *                      and nic_rx_pending() to check the pin
+ *
+ * NIC_TX_SLOTS is how many frames can be queued for sending at once.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <contiki-net.h>
+#include <util/delay.h>
+
+#define NIC_CAP_HW_CHKSUM 0x01
+#define NIC_CAP_TX_GATHER 0x02
+#define NIC_CAP_TX_SRAM 0x04
+#define NIC_CAP_RX_COUNT 0x08
+#define NIC_CAP_RX_INT 0x10
+
+// nic_link() flags
+#define NIC_LINK_UP 0x01
+#define NIC_LINK_100M 0x02
+#define NIC_LINK_FDX 0x04
+
+#if CONFIG_DRIVERS_ENC28J60
+#include "drivers/enc28j60.h"
+
+#define NIC_CAPS NIC_CAP_TX_GATHER
+#define NIC_TX_SLOTS 1
+
+// It has no address of its own
+static const struct uip_eth_addr nic_mac PROGMEM =
+	{{ 0x52, 0x54, 0x00, 0x01, 0x02, 0x03 }};
+
+static inline void nic_get_macaddr(struct uip_eth_addr *addr) {
+	memcpy_P(addr, &nic_mac, sizeof(nic_mac));
+}
+
+// Set up the hardware, and find our MAC address
+static inline void nic_init(struct uip_eth_addr *addr) {
+	nic_get_macaddr(addr);
+
+	// Set up ethernet
+	enc28j60Init(addr);
+	enc28j60Write(ECOCON, 0 & 0x7); // Disable clock output
+	_delay_ms(10);
+
+	/* Magjack leds configuration, see enc28j60 datasheet, page 11 */
+	// LEDA=green LEDB=yellow
+	//
+	// 0x476 is PHLCON LEDA=links status, LEDB=receive/transmit
+	enc28j60PhyWrite(PHLCON, 0x476);
+	_delay_ms(100);
+}
+
+static inline void nic_set_hash(const uint8_t table[8]) {
+	enc28j60SetHashTable(table);
+}
+
+// Read the next frame into buf, returning its length (0 if there isn't one
+// or it's longer than max, which nic_rx_oversize() tells apart). It stays
+// held until nic_rx_release().
+static inline uint16_t nic_rx_hold(uint16_t max, uint8_t *buf) {
+	return enc28j60PacketReceive(max, buf);
+}
+
+static inline uint8_t nic_rx_oversize(void) {
+	return 0;
+}
+
+static inline void nic_rx_release(void) {
+}
+
+// Send a frame of len bytes at packet followed by dlen at data (which may be
+// 0 bytes for a frame in one piece); returns -1 if it couldn't be sent
+static inline int nic_send(uint16_t len, uint8_t *packet,
+	uint16_t dlen, uint8_t *data)
+{
+	enc28j60PacketSend(len, packet, dlen, data);
+	return 0;
+}
+
+// Link state, speed and duplex, as NIC_LINK_* flags
+static inline uint8_t nic_link(void) {
+	uint16_t phstat1 = enc28j60PhyRead(PHSTAT1);
+	uint16_t phstat2 = enc28j60PhyRead(PHSTAT2);
+
+	// This chip only does 10M
+	return ((phstat1 & PHSTAT1_LLSTAT) ? NIC_LINK_UP : 0) |
+		((phstat2 & PHSTAT2_DPXSTAT) ? NIC_LINK_FDX : 0);
+}
+
+// Call when the link changes
+static inline void nic_link_update(void) {
+}
+
+// Check and clear the flag saying a frame was lost to a full RX buffer
+static inline uint8_t nic_rx_aborted(void) {
+	return 0;
+}
+
+#elif CONFIG_DRIVERS_ENC424J600
+#include "drivers/enc424j600.h"
+
+#if CONFIG_DRIVERS_ENC424J600_CHKSUM
+#define NIC_CAPS_CHKSUM (NIC_CAP_HW_CHKSUM | NIC_CAP_TX_GATHER)
+#if ENC424J600_CACHESIZE
+#define NIC_CAPS_SRAM NIC_CAP_TX_SRAM
+#endif
+#endif
+#ifndef NIC_CAPS_CHKSUM
+#define NIC_CAPS_CHKSUM 0
+#endif
+#ifndef NIC_CAPS_SRAM
+#define NIC_CAPS_SRAM 0
+#endif
+
+#ifdef CONFIG_DRIVERS_ENC424J600_INT_VECT
+#define NIC_CAPS_INT NIC_CAP_RX_INT
+#define NIC_RX_VECT CONFIG_DRIVERS_ENC424J600_INT_VECT
+#else
+#define NIC_CAPS_INT 0
+#endif
+
+#define NIC_CAPS (NIC_CAPS_CHKSUM | NIC_CAPS_SRAM | NIC_CAP_RX_COUNT | \
+	NIC_CAPS_INT)
+#define NIC_TX_SLOTS ENC424J600_TXSLOTS
+#define NIC_RX_SIZE ENC424J600_RXSIZE
+
+static inline void nic_get_macaddr(struct uip_eth_addr *addr) {
+	enc424j600GetMACAddr(addr->addr);
+}
+
+static inline void nic_init(struct uip_eth_addr *addr) {
+	// Initialise the hardware
+	enc424j600Init();
+
+	// Disable clock output and set up LED stretch
+	uint16_t econ2 = enc424j600ReadReg(ECON2);
+	econ2 |= ECON2_STRCH; // stretch LED duration
+	econ2 &= ~(ECON2_COCON3 | ECON2_COCON2 | ECON2_COCON1 | ECON2_COCON0);
+	enc424j600WriteReg(ECON2, econ2);
+
+	// Set up LEDs
+	uint16_t eidled = enc424j600ReadReg(EIDLED);
+	eidled &= 0x00ff; // and-out the high byte (LED config)
+	eidled |= EIDLED_LACFG1 | EIDLED_LBCFG2 | EIDLED_LBCFG1;
+	enc424j600WriteReg(EIDLED, eidled);
+
+	// Get the MAC address
+	nic_get_macaddr(addr);
+}
+
+static inline void nic_set_hash(const uint8_t table[8]) {
+	enc424j600SetHashTable(table);
+}
+
+static inline uint16_t nic_rx_hold(uint16_t max, uint8_t *buf) {
+	return enc424j600PacketHold(max, buf);
+}
+
+static inline uint8_t nic_rx_oversize(void) {
+	return enc424j600PacketHeld();
+}
+
+static inline void nic_rx_release(void) {
+	enc424j600PacketRelease();
+}
+
+static inline uint16_t nic_rx_used(void) {
+	return enc424j600RxUsed();
+}
+
+#if NIC_CAPS & NIC_CAP_RX_INT
+// Non-zero while the interrupt line says a frame is waiting
+static inline uint8_t nic_rx_pending(void) {
+	return enc424j600IntAsserted();
+}
+#endif
+
+static inline int nic_send(uint16_t len, uint8_t *packet,
+	uint16_t dlen, uint8_t *data)
+{
+	return enc424j600PacketSend(len, packet);
+}
+
+#if NIC_CAPS & NIC_CAP_HW_CHKSUM
+// Add the sum of len bytes of the held frame from offset to sum
+static inline uint16_t nic_rx_chksum(uint16_t offset, uint16_t len,
+	uint16_t sum)
+{
+	return enc424j600ChecksumRx(offset, len, sum);
+}
+
+// nic_send(), filling in the 16-bit checksum at field (which must be in the
+// first len bytes) with the checksum of the frame from start plus sum
+static inline int nic_send_chksum(uint16_t len, uint8_t *packet,
+	uint16_t dlen, uint8_t *data, uint16_t start, uint16_t field,
+	uint16_t sum)
+{
+	if (dlen) {
+		return enc424j600PacketSendChecksumData(len, packet, dlen, data,
+			start, field, sum);
+	}
+
+	return enc424j600PacketSendChecksum(len, packet, start, field, sum);
+}
+#endif
+
+#if NIC_CAPS & NIC_CAP_TX_SRAM
+// The same, with the dlen bytes coming from NIC SRAM at src
+static inline int nic_send_chksum_sram(uint16_t len, uint8_t *packet,
+	uint16_t src, uint16_t dlen, uint16_t start, uint16_t field,
+	uint16_t sum)
+{
+	return enc424j600PacketSendChecksumSRAM(len, packet, src, dlen,
+		start, field, sum);
+}
+#endif
+
+static inline uint8_t nic_link(void) {
+	uint16_t phstat1 = enc424j600ReadPHYReg(PHSTAT1);
+	uint16_t phstat3 = enc424j600ReadPHYReg(PHSTAT3);
+
+	return ((phstat1 & PHSTAT1_LLSTAT) ? NIC_LINK_UP : 0) |
+		((phstat3 & PHSTAT3_SPDDPX1) ? NIC_LINK_100M : 0) |
+		((phstat3 & PHSTAT3_SPDDPX2) ? NIC_LINK_FDX : 0);
+}
+
+static inline void nic_link_update(void) {
+	enc424j600LinkUpdate();
+}
+
+static inline uint8_t nic_rx_aborted(void) {
+	return enc424j600RxAborted();
+}
+
+#else
+#error No network interface defined!
+#endif
+
+#endif // NIC_H
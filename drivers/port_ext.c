@@ -42,25 +42,32 @@ static inline void pulse_clock(void) {
 	strobe_delay();
 }
 
+static uint8_t dirty;
+
 static void shift_out(void) {
-	uint8_t i, bit;
+	uint8_t i, bit, val;
 
 	// first bit shifted out is bit7 in virtports[PORT_EXT_OUTPORTS-1]
 	// - on BC100 this is for U205 Q7
 	// last bit shifted out is bit 0 in virtports[0]
 	// - on BC100 this is for U202 Q0
+	// Shifting val left and testing the top bit avoids a variable shift,
+	// which the AVR has to do as a loop, for every bit.
 	for (i = sizeof(virtports); i > 0; i--) {
+		val = virtports[i - 1];
 		for (bit = 8; bit > 0; bit--) {
-			if (virtports[i - 1] & (1 << (bit - 1))) {
+			if (val & 0x80) {
 				PORT_EXT_PORT |= (1 << PORT_EXT_PIN_DIN);
 			}
 			else {
 				PORT_EXT_PORT &= ~(1 << PORT_EXT_PIN_DIN);
 			}
 			pulse_clock();
+			val <<= 1;
 		}
 	}
 	pulse_latch();
+	dirty = 0;
 }
 
 int port_ext_init(void)  {
@@ -88,21 +95,28 @@ void port_ext_update(void) {
 	shift_out();
 }
 
+void port_ext_commit(void) {
+	if (dirty) {
+		shift_out();
+	}
+}
+
 void port_ext_bit_clear(uint8_t port, uint8_t bit) {
 	if ((port < sizeof(virtports)) && (bit < 8)) {
-		virtports[port] &= ~(1 << bit);
+		port_ext_set(port, virtports[port] & ~(1 << bit));
 	}
 }
 
 void port_ext_bit_set(uint8_t port, uint8_t bit) {
 	if ((port < sizeof(virtports)) && (bit < 8)) {
-		virtports[port] |= (1 << bit);
+		port_ext_set(port, virtports[port] | (1 << bit));
 	}
 }
 
 void port_ext_set(uint8_t port, uint8_t val) {
-	if (port < sizeof(virtports)) {
+	if ((port < sizeof(virtports)) && (virtports[port] != val)) {
 		virtports[port] = val;
+		dirty = 1;
 	}
 }
 
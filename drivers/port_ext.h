@@ -4,7 +4,14 @@
 #define PORT_EXT_H
 
 int port_ext_init(void);
+
+// Shift the whole chain out and latch it
 void port_ext_update(void);
+
+// As port_ext_update(), but only if anything has changed since the last
+// update; this is the cheap one to call after every change
+void port_ext_commit(void);
+
 void port_ext_bit_clear( uint8_t port, uint8_t bit );
 void port_ext_bit_set( uint8_t port, uint8_t bit );
 void port_ext_set( uint8_t port, uint8_t val );
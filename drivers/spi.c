@@ -19,11 +19,16 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <avr/io.h>
+#include <util/atomic.h>
 
 #include "spi.h"
 
-void spi_init(void) {
+// Device currently holding the bus
+static const spi_device_t * volatile owner;
+
+static void spi_init(void) {
 	// Set up initial output values / pull-ups
 	CONFIG_DRIVERS_SPI_PORT |=
 		_BV(CONFIG_DRIVERS_SPI_MISO) |
@@ -39,13 +44,40 @@ void spi_init(void) {
 		_BV(CONFIG_DRIVERS_SPI_SS);
 	CONFIG_DRIVERS_SPI_DDR &= ~(
 		_BV(CONFIG_DRIVERS_SPI_MISO));
+}
+
+void spi_acquire(const spi_device_t *dev) {
+	while (spi_try_acquire(dev) < 0) { ; }
+}
+
+int spi_try_acquire(const spi_device_t *dev) {
+	uint8_t busy;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		busy = (owner != NULL);
+		if (!busy) {
+			owner = dev;
+		}
+	}
+
+	if (busy) {
+		return -1;
+	}
+
+	spi_init();
 
-	// Initialize the SPI system
-	SPCR = _BV(SPE) | _BV(MSTR);
-	SPSR = _BV(SPI2X);
+	// Initialize the SPI system for this device
+	SPCR = _BV(SPE) | _BV(MSTR) | (dev->config & 0x0f);
+	SPSR = (dev->config & SPI_2X) ? _BV(SPI2X) : 0;
+
+	*dev->cs_port &= ~_BV(dev->cs_pin);
+
+	return 0;
 }
 
-void spi_release(void) {
+void spi_release(const spi_device_t *dev) {
+	*dev->cs_port |= _BV(dev->cs_pin);
+
 	// Disable the SPI system
 	SPCR = 0;
 
@@ -57,5 +89,75 @@ void spi_release(void) {
 	CONFIG_DRIVERS_SPI_PORT &= ~(
 		_BV(CONFIG_DRIVERS_SPI_MISO) |
 		_BV(CONFIG_DRIVERS_SPI_SS));
+
+	owner = NULL;
+}
+
+// SPDR isn't buffered for transmit, so the next byte can't be loaded until
+// SPIF is set. What we can do is have it ready in a register by then, and
+// deal with the byte received after the next one is on its way.
+
+void spi_read_block(uint8_t *buf, uint16_t len) {
+	if (!len) {
+		return;
+	}
+
+	// Kick off the first transfer
+	SPDR = 0x00;
+
+	while (--len) {
+		uint8_t in;
+
+		// Wait for the current byte, then start the next right away
+		while (!(SPSR & _BV(SPIF))) { ; }
+		in = SPDR;
+		SPDR = 0x00;
+
+		*(buf++) = in;
+	}
+
+	// Collect the last byte
+	while (!(SPSR & _BV(SPIF))) { ; }
+	*buf = SPDR;
+}
+
+void spi_write_block(const uint8_t *buf, uint16_t len) {
+	if (!len) {
+		return;
+	}
+
+	SPDR = *(buf++);
+
+	while (--len) {
+		uint8_t out = *(buf++);
+
+		while (!(SPSR & _BV(SPIF))) { ; }
+		SPDR = out;
+	}
+
+	// Wait for the last byte to go (reading SPDR clears SPIF)
+	while (!(SPSR & _BV(SPIF))) { ; }
+	(void)SPDR;
 }
 
+void spi_xfer_block(const uint8_t *out, uint8_t *in, uint16_t len) {
+	if (!len) {
+		return;
+	}
+
+	SPDR = *(out++);
+
+	while (--len) {
+		uint8_t next = *(out++);
+		uint8_t got;
+
+		while (!(SPSR & _BV(SPIF))) { ; }
+		got = SPDR;
+		SPDR = next;
+
+		*(in++) = got;
+	}
+
+	while (!(SPSR & _BV(SPIF))) { ; }
+	*in = SPDR;
+}
@@ -23,8 +23,42 @@
 
 #include <stdint.h>
 
-void spi_init(void);
-void spi_release(void);
+// Clock rates (as a divider of F_CPU) and modes for spi_device_t.config
+#define SPI_2X			0x80
+#define SPI_CLK_DIV2	(SPI_2X | 0)
+#define SPI_CLK_DIV4	(0)
+#define SPI_CLK_DIV8	(SPI_2X | 1)
+#define SPI_CLK_DIV16	(1)
+#define SPI_CLK_DIV32	(SPI_2X | 2)
+#define SPI_CLK_DIV64	(2)
+#define SPI_CLK_DIV128	(3)
+#define SPI_MODE0		(0)
+#define SPI_MODE1		(1 << 2) // CPHA
+#define SPI_MODE2		(2 << 2) // CPOL
+#define SPI_MODE3		(3 << 2)
+
+// A chip on the SPI bus, with the settings it wants while it's talked to
+typedef struct {
+	volatile uint8_t *cs_port;
+	uint8_t cs_pin;
+	uint8_t config; // SPI_CLK_* | SPI_MODE*
+} spi_device_t;
+
+// Claim the bus for dev: apply its clock and mode and assert its CS (which
+// the driver must have made an output). spi_acquire() waits for the bus, so
+// interrupt handlers must use spi_try_acquire(), which returns -1 if another
+// device has it.
+void spi_acquire(const spi_device_t *dev);
+int spi_try_acquire(const spi_device_t *dev);
+// Release CS and the bus
+void spi_release(const spi_device_t *dev);
+
+// Block transfers for the chip that's currently selected. These start each
+// byte as soon as the last one is done and do their bookkeeping while it
+// shifts, so use them in preference to a loop around spi_rw().
+void spi_read_block(uint8_t *buf, uint16_t len);
+void spi_write_block(const uint8_t *buf, uint16_t len);
+void spi_xfer_block(const uint8_t *out, uint8_t *in, uint16_t len);
 inline uint8_t spi_rw(uint8_t out);
 
 inline uint8_t spi_rw(uint8_t out) {
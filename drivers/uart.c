@@ -39,6 +39,8 @@ LICENSE:
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <sys/process.h>
+#include <ringbuf.h>
 #include "uart.h"
 
 
@@ -46,17 +48,6 @@ LICENSE:
  *  constants and macros
  */
 
-/* size of RX/TX buffers */
-#define UART_RX_BUFFER_MASK ( UART_RX_BUFFER_SIZE - 1)
-#define UART_TX_BUFFER_MASK ( UART_TX_BUFFER_SIZE - 1)
-
-#if ( UART_RX_BUFFER_SIZE & UART_RX_BUFFER_MASK )
-#error RX buffer size is not a power of 2
-#endif
-#if ( UART_TX_BUFFER_SIZE & UART_TX_BUFFER_MASK )
-#error TX buffer size is not a power of 2
-#endif
-
 #if defined(__AVR_AT90S2313__) \
  || defined(__AVR_AT90S4414__) || defined(__AVR_AT90S4434__) \
  || defined(__AVR_AT90S8515__) || defined(__AVR_AT90S8535__) \
@@ -247,21 +238,16 @@ LICENSE:
 /*
  *  module global variables
  */
-static volatile unsigned char UART_TxBuf[UART_TX_BUFFER_SIZE];
-static volatile unsigned char UART_RxBuf[UART_RX_BUFFER_SIZE];
-static volatile unsigned char UART_TxHead;
-static volatile unsigned char UART_TxTail;
-static volatile unsigned char UART_RxHead;
-static volatile unsigned char UART_RxTail;
+static RINGBUF(UART_TX_BUFFER_SIZE) UART_Tx;
+static RINGBUF(UART_RX_BUFFER_SIZE) UART_Rx;
 static volatile unsigned char UART_LastRxError;
+static struct process * volatile UART_TxNotify;
+static volatile unsigned char UART_TxWant;
+static struct process * volatile UART_RxNotify;
 
 #if defined( ATMEGA_USART1 )
-static volatile unsigned char UART1_TxBuf[UART_TX_BUFFER_SIZE];
-static volatile unsigned char UART1_RxBuf[UART_RX_BUFFER_SIZE];
-static volatile unsigned char UART1_TxHead;
-static volatile unsigned char UART1_TxTail;
-static volatile unsigned char UART1_RxHead;
-static volatile unsigned char UART1_RxTail;
+static RINGBUF(UART_TX_BUFFER_SIZE) UART1_Tx;
+static RINGBUF(UART_RX_BUFFER_SIZE) UART1_Rx;
 static volatile unsigned char UART1_LastRxError;
 #endif
 
@@ -273,7 +259,6 @@ Function: UART Receive Complete interrupt
 Purpose:  called when the UART has received a character
 **************************************************************************/
 {
-    unsigned char tmphead;
     unsigned char data;
     unsigned char usr;
     unsigned char lastRxError;
@@ -296,19 +281,17 @@ Purpose:  called when the UART has received a character
     lastRxError = (usr & (_BV(FE1)|_BV(DOR1)) );
 #endif
 
-    /* calculate buffer index */
-    tmphead = ( UART_RxHead + 1) & UART_RX_BUFFER_MASK;
-
-    if ( tmphead == UART_RxTail ) {
+    /* store received data in buffer */
+    if ( ringbuf_put(&UART_Rx, data) ) {
         /* error: receive buffer overflow */
         lastRxError = UART_BUFFER_OVERFLOW >> 8;
-    }else{
-        /* store new index */
-        UART_RxHead = tmphead;
-        /* store received data in buffer */
-        UART_RxBuf[tmphead] = data;
     }
     UART_LastRxError = lastRxError;
+
+    /* wake up the reader, if there is one */
+    if (UART_RxNotify) {
+        process_poll(UART_RxNotify);
+    }
 }
 
 
@@ -318,15 +301,19 @@ Function: UART Data Register Empty interrupt
 Purpose:  called when the UART is ready to transmit the next byte
 **************************************************************************/
 {
-    unsigned char tmptail;
+    int c;
+
 
+    /* get one byte from buffer and write it to UART */
+    c = ringbuf_get(&UART_Tx);
+    if ( c >= 0 ) {
+        UART0_DATA = c;  /* start transmission */
 
-    if ( UART_TxHead != UART_TxTail) {
-        /* calculate and store new buffer index */
-        tmptail = (UART_TxTail + 1) & UART_TX_BUFFER_MASK;
-        UART_TxTail = tmptail;
-        /* get one byte from buffer and write it to UART */
-        UART0_DATA = UART_TxBuf[tmptail];  /* start transmission */
+        /* wake up a writer once there is the room it wants */
+        if (UART_TxNotify && ringbuf_space(&UART_Tx) >= UART_TxWant) {
+            process_poll(UART_TxNotify);
+            UART_TxNotify = NULL;
+        }
     }else{
         /* tx buffer empty, disable UDRE interrupt */
         UART0_CONTROL &= ~_BV(UART0_UDRIE);
@@ -342,10 +329,8 @@ Returns:  none
 **************************************************************************/
 void uart_init(unsigned int baudrate)
 {
-    UART_TxHead = 0;
-    UART_TxTail = 0;
-    UART_RxHead = 0;
-    UART_RxTail = 0;
+    ringbuf_init(&UART_Tx);
+    ringbuf_init(&UART_Rx);
 
 #if defined( AT90_UART )
     /* set baud rate */
@@ -361,6 +346,10 @@ void uart_init(unsigned int baudrate)
     	 UART0_STATUS = (1<<U2X);  //Enable 2x speed
     	 baudrate &= ~0x8000;
     }
+    else
+    {
+    	 UART0_STATUS = 0;
+    }
     UBRRH = (unsigned char)(baudrate>>8);
     UBRRL = (unsigned char) baudrate;
 
@@ -381,6 +370,10 @@ void uart_init(unsigned int baudrate)
    		UART0_STATUS = (1<<U2X0);  //Enable 2x speed
    		baudrate &= ~0x8000;
    	}
+   	else
+   	{
+   		UART0_STATUS = 0;
+   	}
     UBRR0H = (unsigned char)(baudrate>>8);
     UBRR0L = (unsigned char) baudrate;
 
@@ -440,21 +433,15 @@ Returns:  lower byte:  received byte from ringbuffer
 **************************************************************************/
 unsigned int uart_getc(void)
 {
-    unsigned char tmptail;
-    unsigned char data;
+    int data;
 
 
-    if ( UART_RxHead == UART_RxTail ) {
+    /* get data from receive buffer */
+    data = ringbuf_get(&UART_Rx);
+    if ( data < 0 ) {
         return UART_NO_DATA;   /* no data available */
     }
 
-    /* calculate /store buffer index */
-    tmptail = (UART_RxTail + 1) & UART_RX_BUFFER_MASK;
-    UART_RxTail = tmptail;
-
-    /* get data from receive buffer */
-    data = UART_RxBuf[tmptail];
-
     return (UART_LastRxError << 8) + data;
 
 }/* uart_getc */
@@ -468,18 +455,10 @@ Returns:  none
 **************************************************************************/
 void uart_putc(unsigned char data)
 {
-    unsigned char tmphead;
-
-
-    tmphead  = (UART_TxHead + 1) & UART_TX_BUFFER_MASK;
-
-    while ( tmphead == UART_TxTail ){
+    while ( ringbuf_put(&UART_Tx, data) ){
         ;/* wait for free space in buffer */
     }
 
-    UART_TxBuf[tmphead] = data;
-    UART_TxHead = tmphead;
-
     /* enable UDRE interrupt */
     UART0_CONTROL    |= _BV(UART0_UDRIE);
 
@@ -515,8 +494,84 @@ void uart_puts_p(const char *progmem_s )
 
 }/* uart_puts_p */
 
+/*************************************************************************
+Function: uart_tx_space()
+Purpose:  find how many bytes uart_write() can take right now
+Returns:  free space in the transmit ringbuffer
+**************************************************************************/
+unsigned int uart_tx_space(void)
+{
+    return ringbuf_space(&UART_Tx);
+
+}/* uart_tx_space */
+
+
+/*************************************************************************
+Function: uart_tx_notify()
+Purpose:  poll a process once the transmit ringbuffer has room
+Input:    process to poll (NULL to cancel), free bytes it wants (capped
+          at the buffer size less one)
+Returns:  none
+**************************************************************************/
+void uart_tx_notify(struct process *p, unsigned int space)
+{
+    if (space > UART_TX_BUFFER_SIZE - 1) {
+        space = UART_TX_BUFFER_SIZE - 1;
+    }
+
+    UART_TxNotify = NULL;
+    UART_TxWant = space;
+    UART_TxNotify = p;
+
+    /* it may have drained already */
+    if (p && uart_tx_space() >= space) {
+        process_poll(p);
+        UART_TxNotify = NULL;
+    }
+
+}/* uart_tx_notify */
+
+
+/*************************************************************************
+Function: uart_rx_notify()
+Purpose:  poll a process every time a byte is received
+Input:    process to poll (NULL to stop)
+Returns:  none
+**************************************************************************/
+void uart_rx_notify(struct process *p)
+{
+    UART_RxNotify = p;
+
+    /* something may have arrived already */
+    if (p && ringbuf_used(&UART_Rx)) {
+        process_poll(p);
+    }
+
+}/* uart_rx_notify */
+
+
+/*************************************************************************
+Function: uart_write()
+Purpose:  write a block of bytes to ringbuffer for transmitting via UART
+Input:    bytes to be transmitted and how many
+Returns:  number of bytes queued, which is less than len if the buffer
+          filled up (it never waits)
+**************************************************************************/
+unsigned int uart_write(const void *data, unsigned int len)
+{
+    len = ringbuf_write(&UART_Tx, data, len);
+
+    /* enable UDRE interrupt */
+    if (len) {
+        UART0_CONTROL    |= _BV(UART0_UDRIE);
+    }
+
+    return len;
+
+}/* uart_write */
+
 void uart_txwait(void) {
-	while (UART_TxHead != UART_TxTail) {}
+	while (ringbuf_used(&UART_Tx)) {}
 }
 
 
@@ -532,7 +587,6 @@ Function: UART1 Receive Complete interrupt
 Purpose:  called when the UART1 has received a character
 **************************************************************************/
 {
-    unsigned char tmphead;
     unsigned char data;
     unsigned char usr;
     unsigned char lastRxError;
@@ -545,17 +599,10 @@ Purpose:  called when the UART1 has received a character
     /* */
     lastRxError = (usr & (_BV(FE1)|_BV(DOR1)) );
 
-    /* calculate buffer index */
-    tmphead = ( UART1_RxHead + 1) & UART_RX_BUFFER_MASK;
-
-    if ( tmphead == UART1_RxTail ) {
+    /* store received data in buffer */
+    if ( ringbuf_put(&UART1_Rx, data) ) {
         /* error: receive buffer overflow */
         lastRxError = UART_BUFFER_OVERFLOW >> 8;
-    }else{
-        /* store new index */
-        UART1_RxHead = tmphead;
-        /* store received data in buffer */
-        UART1_RxBuf[tmphead] = data;
     }
     UART1_LastRxError = lastRxError;
 }
@@ -567,15 +614,13 @@ Function: UART1 Data Register Empty interrupt
 Purpose:  called when the UART1 is ready to transmit the next byte
 **************************************************************************/
 {
-    unsigned char tmptail;
+    int c;
 
 
-    if ( UART1_TxHead != UART1_TxTail) {
-        /* calculate and store new buffer index */
-        tmptail = (UART1_TxTail + 1) & UART_TX_BUFFER_MASK;
-        UART1_TxTail = tmptail;
-        /* get one byte from buffer and write it to UART */
-        UART1_DATA = UART1_TxBuf[tmptail];  /* start transmission */
+    /* get one byte from buffer and write it to UART */
+    c = ringbuf_get(&UART1_Tx);
+    if ( c >= 0 ) {
+        UART1_DATA = c;  /* start transmission */
     }else{
         /* tx buffer empty, disable UDRE interrupt */
         UART1_CONTROL &= ~_BV(UART1_UDRIE);
@@ -591,10 +636,8 @@ Returns:  none
 **************************************************************************/
 void uart1_init(unsigned int baudrate)
 {
-    UART1_TxHead = 0;
-    UART1_TxTail = 0;
-    UART1_RxHead = 0;
-    UART1_RxTail = 0;
+    ringbuf_init(&UART1_Tx);
+    ringbuf_init(&UART1_Rx);
 
 
     /* Set baud rate */
@@ -626,21 +669,15 @@ Returns:  lower byte:  received byte from ringbuffer
 **************************************************************************/
 unsigned int uart1_getc(void)
 {
-    unsigned char tmptail;
-    unsigned char data;
+    int data;
 
 
-    if ( UART1_RxHead == UART1_RxTail ) {
+    /* get data from receive buffer */
+    data = ringbuf_get(&UART1_Rx);
+    if ( data < 0 ) {
         return UART_NO_DATA;   /* no data available */
     }
 
-    /* calculate /store buffer index */
-    tmptail = (UART1_RxTail + 1) & UART_RX_BUFFER_MASK;
-    UART1_RxTail = tmptail;
-
-    /* get data from receive buffer */
-    data = UART1_RxBuf[tmptail];
-
     return (UART1_LastRxError << 8) + data;
 
 }/* uart1_getc */
@@ -654,18 +691,10 @@ Returns:  none
 **************************************************************************/
 void uart1_putc(unsigned char data)
 {
-    unsigned char tmphead;
-
-
-    tmphead  = (UART1_TxHead + 1) & UART_TX_BUFFER_MASK;
-
-    while ( tmphead == UART1_TxTail ){
+    while ( ringbuf_put(&UART1_Tx, data) ){
         ;/* wait for free space in buffer */
     }
 
-    UART1_TxBuf[tmphead] = data;
-    UART1_TxHead = tmphead;
-
     /* enable UDRE interrupt */
     UART1_CONTROL    |= _BV(UART1_UDRIE);
 
@@ -702,7 +731,7 @@ void uart1_puts_p(const char *progmem_s )
 }/* uart1_puts_p */
 
 void uart1_txwait(void) {
-	while (UART1_TxHead != UART1_TxTail) {}
+	while (ringbuf_used(&UART1_Tx)) {}
 }
 
 #endif
@@ -70,11 +70,11 @@ LICENSE:
 #define UART_BAUD_SELECT_DOUBLE_SPEED(baudRate,xtalCpu) (((xtalCpu)/((baudRate)*8l)-1)|0x8000)
 
 
-/** Size of the circular receive buffer, must be power of 2 */
+/** Size of the circular receive buffer, must be a power of 2 up to 256 */
 #ifndef UART_RX_BUFFER_SIZE
 #define UART_RX_BUFFER_SIZE CONFIG_DRIVERS_UART_RXBUF_SIZE
 #endif
-/** Size of the circular transmit buffer, must be power of 2 */
+/** Size of the circular transmit buffer, must be a power of 2 up to 256 */
 #ifndef UART_TX_BUFFER_SIZE
 #define UART_TX_BUFFER_SIZE CONFIG_DRIVERS_UART_TXBUF_SIZE
 #endif
@@ -172,6 +172,37 @@ extern void uart_puts_p(const char *s );
  */
 #define uart_puts_P(__s)       uart_puts_p(PSTR(__s))
 
+/**
+ * @brief    Put a block of bytes into the transmit ringbuffer
+ *
+ * Copies as much as fits in one go, rather than going through uart_putc()
+ * for each byte, and never waits for room.
+ *
+ * @param    data bytes to be transmitted
+ * @param    len number of bytes
+ * @return   number of bytes queued
+ */
+extern unsigned int uart_write(const void *data, unsigned int len);
+
+/** @brief  Free space in the transmit ringbuffer */
+extern unsigned int uart_tx_space(void);
+
+struct process;
+
+/**
+ * @brief    Poll a process (once) when the transmit ringbuffer has room
+ * @param    p process to poll, or NULL to cancel
+ * @param    space free bytes wanted (at most the buffer size less one)
+ */
+extern void uart_tx_notify(struct process *p, unsigned int space);
+
+/**
+ * @brief    Poll a process every time a byte is received, so it needn't
+ *           poll itself to find out
+ * @param    p process to poll, or NULL to stop
+ */
+extern void uart_rx_notify(struct process *p);
+
 extern void uart_txwait(void);
 
 
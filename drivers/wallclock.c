@@ -39,6 +39,12 @@
  * The values in the code below are carefully chosen to keep the clock as
  * accurate as possible without having too great a performance impact. Please be
  * careful when changing any of them.
+ *
+ * Crystal drift is compensated in software: each overflow adds the trim rate to
+ * a 16-bit accumulator, and every time it wraps the clock is moved by one timer
+ * count (1/4096s). The counter itself is never touched, so the correction is
+ * kept in a separate signed offset that wallclock_get() folds into the result.
+ * A rate of 1 works out at 2^-24 (about 0.06ppm), so ±32767 covers ±1950ppm.
  */
 
 #define F_RTC 32768
@@ -46,17 +52,40 @@
 #define F_TIMER (F_RTC / PRESCALER)
 #define F_VECTOR (F_TIMER / 256)
 
+#define F_COUNT (F_TIMER)
+
 struct wallclock_status {
 	uint32_t sec;
 	uint8_t frac : 4;
+	int16_t adj; // correction in timer counts, within ±F_COUNT
+	uint16_t acc; // trim accumulator
 };
 
 static volatile struct wallclock_status status;
+static volatile int16_t trim;
 
 ISR(TIMER2_OVF_vect) {
 	if (++status.frac == 0) {
 		status.sec++;
 	}
+
+	if (trim) {
+		uint16_t prev = status.acc;
+		status.acc = prev + trim;
+
+		if (trim > 0 && status.acc < prev) {
+			if (++status.adj == F_COUNT) {
+				status.adj = 0;
+				status.sec++;
+			}
+		}
+		else if (trim < 0 && status.acc > prev) {
+			if (--status.adj == -F_COUNT) {
+				status.adj = 0;
+				status.sec--;
+			}
+		}
+	}
 }
 
 void wallclock_init(void) {
@@ -91,6 +120,8 @@ void wallclock_init(void) {
 		// Zero the status struct
 		status.sec = 0;
 		status.frac = 0;
+		status.adj = 0;
+		status.acc = 0;
 	}
 }
 
@@ -99,6 +130,7 @@ void wallclock_set(const wallclock_time_t * const time) {
 		// Update the status structs
 		status.sec = time->sec;
 		status.frac = time->frac >> 8;
+		status.adj = 0;
 
 		// Update the timer register
 		TCNT2 = time->frac & 0xff;
@@ -109,23 +141,51 @@ void wallclock_set(const wallclock_time_t * const time) {
 }
 
 void wallclock_get(wallclock_time_t *time) {
+	uint32_t sec;
+	int16_t frac;
+
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		// Get the time from the status struct
-		time->sec = status.sec;
-		time->frac = status.frac << 8;
+		sec = status.sec;
+		frac = (status.frac << 8) | TCNT2;
+		frac += status.adj;
+	}
 
-		// Fill-in the fractional part
-		time->frac |= TCNT2;
+	// Carry the drift correction into the seconds
+	if (frac < 0) {
+		frac += F_COUNT;
+		sec--;
 	}
+	else if (frac >= F_COUNT) {
+		frac -= F_COUNT;
+		sec++;
+	}
+
+	time->sec = sec;
+	time->frac = frac;
 }
 
 uint32_t wallclock_seconds() {
-	uint32_t sec;
+	wallclock_time_t time;
+
+	wallclock_get(&time);
 
+	return time.sec;
+}
+
+void wallclock_trim(int16_t rate) {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		sec = status.sec;
+		trim = rate;
+	}
+}
+
+int16_t wallclock_get_trim(void) {
+	int16_t rate;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		rate = trim;
 	}
 
-	return sec;
+	return rate;
 }
 
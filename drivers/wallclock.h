@@ -39,4 +39,8 @@ void wallclock_set(const wallclock_time_t * const time);
 void wallclock_get(wallclock_time_t *time);
 uint32_t wallclock_seconds(void); // shortcut for just seconds
 
+// Drift compensation, in units of 2^-24 (~0.06ppm); positive speeds the clock up
+void wallclock_trim(int16_t rate);
+int16_t wallclock_get_trim(void);
+
 #endif /* WALLCLOCK_H */
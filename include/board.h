@@ -53,6 +53,14 @@ extern struct version_info __version_info;
 // Call this to set up IO pins
 void board_init(void);
 
+// Monotonic time for measuring short intervals, from the system clock's
+// timer (a resolution of PRESCALER / F_CPU, which is 21us on PC-MB-001).
+// Both wrap around, so only use the difference between two readings:
+// clock_cycles() in CPU cycles every few minutes, clock_us() in microseconds
+// every 71 minutes.
+uint32_t clock_cycles(void);
+uint32_t clock_us(void);
+
 // Board info functions
 void board_info_read(struct board_info *info);
 int board_info_validate(const struct board_info *info);
@@ -77,6 +77,21 @@
 #define POLYFS_NAMELEN_WIDTH 6
 #define POLYFS_OFFSET_WIDTH 26
 
+/*
+ * Content types mkpolyfs -T stores in the gid of regular files, so the
+ * webserver can pick its headers without looking at the file name. Zero
+ * means nothing was recorded.
+ */
+#define POLYFS_MIME_NONE 0
+#define POLYFS_MIME_HTML 1
+#define POLYFS_MIME_CSS 2
+#define POLYFS_MIME_PNG 3
+#define POLYFS_MIME_GIF 4
+#define POLYFS_MIME_JPEG 5
+#define POLYFS_MIME_PLAIN 6
+#define POLYFS_MIME_BINARY 7
+#define POLYFS_MIME_COUNT 8
+
 /*
  * Since inode.namelen is a unsigned 6-bit number, the maximum polyfs
  * path length is 63 << 2 = 252.
@@ -136,6 +151,91 @@ struct polyfs_super {
 	struct polyfs_inode root;	/* root inode data */
 };
 
+/*
+ * Directory index tables
+ *
+ * With POLYFS_FLAG_DIR_INDEX, every non-empty directory's entries are preceded
+ * by a table of 16-bit words, ending immediately before the first
+ * entry: zero padding to a 4-byte boundary, then one word per entry holding
+ * the entry's offset from the first entry >> 2 (in sorted order), then a word
+ * holding the number of entries. Readers that don't know about the table never
+ * see it, as the directory inode still points at the first entry.
+ */
+#define POLYFS_DIR_INDEX_SIZE(n)	((2 * (n) + 2 + 3) & ~3)
+
+/*
+ * Compressed embedded file
+ *
+ * With POLYFS_FLAG_EMBED_LZO, the embedded file between the superblock and the
+ * root directory is LZO compressed in POLYFS_BLOCK_SIZE blocks. It starts with
+ * a 32-bit word holding the uncompressed length, followed by one 32-bit block
+ * pointer per block giving the offset of the end of that block's data, the
+ * same as a regular file. A block whose data is as long as its uncompressed
+ * length is stored as-is.
+ */
+#define POLYFS_EMBED_HDR_SIZE(len) \
+	(4 + 4 * (((len) + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE))
+
+/*
+ * LZSS compressed files
+ *
+ * With POLYFS_FLAG_LZSS_COMPRESSION, each block of a regular file is a
+ * sequence of tokens that decode straight from storage into a buffer of any
+ * size. A match copies bytes from a literal earlier in the same block's
+ * data rather than from the output, so there is no window to keep in RAM:
+ *
+ *   0nnnnnnn                      n + 1 literal bytes follow
+ *   1llllooo oooooooo [xxxxxxxx]  l + 3 bytes (18 + x when l is 15) copied
+ *                                 from offset o of the block's data
+ *
+ * As with the embedded file, a block whose data is as long as its
+ * uncompressed length is stored as-is.
+ */
+#define POLYFS_LZSS_MAX_LITERAL	128
+#define POLYFS_LZSS_MIN_MATCH	3
+#define POLYFS_LZSS_MAX_MATCH	(POLYFS_LZSS_MIN_MATCH + 15 + 255)
+#define POLYFS_LZSS_MAX_OFFSET	0x7ff
+
+/*
+ * Inline file data
+ *
+ * With POLYFS_FLAG_INLINE_DATA, every regular file of 1 to POLYFS_INLINE_MAX
+ * bytes keeps its data straight after its name in the directory entry,
+ * uncompressed and padded to a 4-byte boundary, with no block pointers. The
+ * inode offset points at the data, and the data counts towards the size of
+ * the directory, so the next entry follows it.
+ */
+#define POLYFS_INLINE_MAX	64
+#define POLYFS_IS_INLINE(mode, size) \
+	(S_ISREG(mode) && (size) > 0 && (size) <= POLYFS_INLINE_MAX)
+#define POLYFS_INLINE_SIZE(size)	(((size) + 3) & ~3)
+
+/*
+ * Shared blocks
+ *
+ * With POLYFS_FLAG_SHARED_BLOCKS, a block pointer with POLYFS_BLKPTR_SHARED
+ * set is for a block identical to one stored elsewhere in the image. Its
+ * data is two 32-bit words holding the start and end offsets of the block
+ * it shares, and the rest of the pointer is the end of those 8 bytes as
+ * usual. A shared block's data is always the block's own, never another
+ * pair of offsets.
+ */
+#define POLYFS_BLKPTR_SHARED	0x80000000
+#define POLYFS_BLKPTR_MASK		0x7fffffff
+#define POLYFS_SHARED_SIZE		8
+
+/*
+ * Block checksums
+ *
+ * With POLYFS_FLAG_BLOCK_CRC, a regular file's block pointers are followed
+ * by a 32-bit word holding the number of the file's first block within the
+ * image (files are numbered one after the other, so every block has its own
+ * number), then one 32-bit CRC per block, and then the data. Each CRC is the
+ * same CRC-32 as the superblock's, taken over the block's data as stored
+ * (the data being shared for a shared block, and nothing for a hole).
+ */
+#define POLYFS_CRC_TABLE_SIZE(blocks)	(4 + 4 * (blocks))
+
 /*
  * Feature flags
  */
@@ -145,13 +245,19 @@ struct polyfs_super {
 #define POLYFS_FLAG_SHIFTED_ROOT_OFFSET	0x00000008	/* shifted root fs */
 #define POLYFS_FLAG_ZLIB_COMPRESSION	0x00000010	/* zlib compression */
 #define POLYFS_FLAG_LZO_COMPRESSION		0x00000020	/* LZO compression */
+#define POLYFS_FLAG_DIR_INDEX			0x00000040	/* directory index tables */
+#define POLYFS_FLAG_EMBED_LZO			0x00000080	/* LZO embedded file */
+#define POLYFS_FLAG_LZSS_COMPRESSION	0x00000100	/* LZSS compression */
+#define POLYFS_FLAG_INLINE_DATA			0x00000200	/* inline small files */
+#define POLYFS_FLAG_SHARED_BLOCKS		0x00000400	/* blocks shared by files */
+#define POLYFS_FLAG_BLOCK_CRC			0x00000800	/* per-block checksums */
 
 /*
  * Valid values in super.flags.  Currently we refuse to mount
  * if (flags & ~POLYFS_SUPPORTED_FLAGS).  Maybe that should be
  * changed to test super.future instead.
  */
-#define POLYFS_SUPPORTED_FLAGS	( 0x000000ff )
+#define POLYFS_SUPPORTED_FLAGS	( 0x00000fff )
 
 /*
  * Since polyfs is little-endian, provide macros to swab the bitfields.
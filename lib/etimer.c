@@ -0,0 +1,383 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include "sys/etimer.h"
+#include "sys/process.h"
+
+#include <stdint.h>
+#include <util/atomic.h>
+
+/*
+ * A drop-in for Contiki's etimer.c, which keeps every running etimer on one
+ * list that has to be walked on every insert and every expiry.
+ *
+ * Here they hang off a hierarchical timer wheel instead: four levels of 16
+ * slots, level n covering 16^(n+1) ticks, which takes in the whole 16-bit
+ * clock. A timer goes in the slot its expiry time picks out on the lowest
+ * level whose span reaches that far, and moves down a level each time the
+ * wheel below it comes round (a cascade) until it lands on level 0 and
+ * expires. Inserting is constant time, and so is each tick; ticks with
+ * nothing on the levels below are skipped over in one go. The slot a timer
+ * is in follows from its expiry time, so stopping one only needs to look
+ * along a few short lists.
+ *
+ * Expired timers wait on the due list until etimer_process has posted
+ * their events. The earliest deadline is kept up to date for the clock ISR,
+ * which polls etimer_process only once it's reached.
+ */
+
+#define LEVELS 4
+#define SLOT_BITS 4
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+
+// The slot on level l for expiry time e
+#define SLOT(l, e) (((e) >> ((l) * SLOT_BITS)) & SLOT_MASK)
+// Ticks in one step of level l (the span of level l - 1)
+#define SPAN(l) ((clock_time_t)1 << ((l) * SLOT_BITS))
+
+static struct etimer *wheel[LEVELS][SLOTS];
+static uint8_t count[LEVELS];
+static struct etimer *due;
+
+// The wheel has been turned up to here
+static clock_time_t cur;
+static clock_time_t next_expiration;
+
+PROCESS(etimer_process, "Event timer");
+
+static clock_time_t expiry(struct etimer *et) {
+	return et->timer.start + et->timer.interval;
+}
+
+// Ticks left after cur, or 0 if it's due, just as timer_expired() sees it
+static clock_time_t remaining(struct etimer *et) {
+	clock_time_t elapsed = cur - et->timer.start;
+
+	if (elapsed >= et->timer.interval) {
+		return 0;
+	}
+
+	return et->timer.interval - elapsed;
+}
+
+static void push(struct etimer **list, struct etimer *et) {
+	et->next = *list;
+	*list = et;
+}
+
+static uint8_t remove_from(struct etimer **list, struct etimer *et) {
+	for (; *list != NULL; list = &(*list)->next) {
+		if (*list == et) {
+			*list = et->next;
+			et->next = NULL;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Sooner than the current next_expiration, as seen from cur
+static void note_deadline(clock_time_t t) {
+	if ((clock_time_t)(t - cur) < (clock_time_t)(next_expiration - cur)) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			next_expiration = t;
+		}
+	}
+}
+
+static void insert(struct etimer *et) {
+	clock_time_t left = remaining(et);
+	uint8_t l;
+
+	if (left == 0) {
+		push(&due, et);
+		note_deadline(cur);
+		etimer_request_poll();
+		return;
+	}
+
+	for (l = 0; l < LEVELS - 1 && left >= SPAN(l + 1); l++);
+	push(&wheel[l][SLOT(l, expiry(et))], et);
+	count[l]++;
+	note_deadline(cur + left);
+}
+
+static uint8_t unlink_timer(struct etimer *et) {
+	clock_time_t e = expiry(et);
+	uint8_t l, s;
+
+	if (remove_from(&due, et)) {
+		return 1;
+	}
+
+	for (l = 0; l < LEVELS; l++) {
+		if (remove_from(&wheel[l][SLOT(l, e)], et)) {
+			count[l]--;
+			return 1;
+		}
+	}
+
+	// Only if someone has changed its timer behind our back
+	for (l = 0; l < LEVELS; l++) {
+		for (s = 0; s < SLOTS; s++) {
+			if (remove_from(&wheel[l][s], et)) {
+				count[l]--;
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Move a slot's timers down to the levels below
+static void cascade(uint8_t l, uint8_t s) {
+	struct etimer *et = wheel[l][s];
+
+	wheel[l][s] = NULL;
+	while (et != NULL) {
+		struct etimer *n = et->next;
+
+		count[l]--;
+		insert(et);
+		et = n;
+	}
+}
+
+// Turn the wheel round to the current time
+static void advance(void) {
+	clock_time_t now = clock_time();
+
+	while (cur != now) {
+		clock_time_t skip;
+		uint8_t l;
+
+		// Nothing can expire before the next cascade of the first level
+		// that has anything on it, so jump to just before it
+		for (l = 0; l < LEVELS && count[l] == 0; l++);
+		if (l == LEVELS) {
+			cur = now;
+			break;
+		}
+		if (l > 0) {
+			skip = (cur | (SPAN(l) - 1)) - cur;
+			if (skip >= (clock_time_t)(now - cur)) {
+				cur = now;
+				break;
+			}
+			cur += skip;
+		}
+
+		cur++;
+
+		// Cascades from the top down, so timers can fall several levels
+		for (l = LEVELS - 1; l > 0; l--) {
+			if ((cur & (SPAN(l) - 1)) == 0) {
+				cascade(l, SLOT(l, cur));
+			}
+		}
+
+		// Whatever's in this tick's slot is due now
+		while (wheel[0][SLOT(0, cur)] != NULL) {
+			struct etimer *et = wheel[0][SLOT(0, cur)];
+
+			wheel[0][SLOT(0, cur)] = et->next;
+			count[0]--;
+			push(&due, et);
+		}
+	}
+}
+
+// The earliest time anything could expire: the first full slot on each
+// level, which for anything above level 0 is when the cascade that brings
+// it down happens
+static void update_time(void) {
+	clock_time_t t = cur;
+	uint8_t l, i;
+
+	if (due == NULL) {
+		// As far off as it gets, if nothing turns up
+		t = cur - 1;
+
+		for (l = 0; l < LEVELS; l++) {
+			uint8_t shift = l * SLOT_BITS;
+
+			if (count[l] == 0) {
+				continue;
+			}
+
+			for (i = 1; i <= SLOTS; i++) {
+				clock_time_t at = (clock_time_t)((cur >> shift) + i) << shift;
+
+				if (wheel[l][SLOT(l, at)] != NULL) {
+					if ((clock_time_t)(at - cur) < (clock_time_t)(t - cur)) {
+						t = at;
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		next_expiration = t;
+	}
+}
+
+// Forget the timers belonging to a process that has exited
+static void drop_process(struct process *p) {
+	struct etimer **list;
+	uint8_t l, s;
+
+	for (list = &due; *list != NULL;) {
+		if ((*list)->p == p) {
+			(*list)->p = PROCESS_NONE;
+			*list = (*list)->next;
+		}
+		else {
+			list = &(*list)->next;
+		}
+	}
+
+	for (l = 0; l < LEVELS; l++) {
+		for (s = 0; s < SLOTS; s++) {
+			for (list = &wheel[l][s]; *list != NULL;) {
+				if ((*list)->p == p) {
+					(*list)->p = PROCESS_NONE;
+					*list = (*list)->next;
+					count[l]--;
+				}
+				else {
+					list = &(*list)->next;
+				}
+			}
+		}
+	}
+}
+
+PROCESS_THREAD(etimer_process, ev, data) {
+	struct etimer *et;
+
+	PROCESS_BEGIN();
+
+	while (1) {
+		PROCESS_YIELD();
+
+		if (ev == PROCESS_EVENT_EXITED) {
+			drop_process(data);
+			continue;
+		}
+		else if (ev != PROCESS_EVENT_POLL) {
+			continue;
+		}
+
+		advance();
+
+		while ((et = due) != NULL) {
+			if (process_post(et->p, PROCESS_EVENT_TIMER, et) !=
+				PROCESS_ERR_OK)
+			{
+				// The event queue is full; try again next time round
+				etimer_request_poll();
+				break;
+			}
+
+			// etimer_expired() goes by this
+			due = et->next;
+			et->next = NULL;
+			et->p = PROCESS_NONE;
+		}
+
+		update_time();
+	}
+
+	PROCESS_END();
+}
+
+void etimer_request_poll(void) {
+	process_poll(&etimer_process);
+}
+
+static void add_timer(struct etimer *et) {
+	advance();
+
+	// Already running, so take it out from where it was
+	if (et->p != PROCESS_NONE) {
+		unlink_timer(et);
+	}
+
+	et->p = PROCESS_CURRENT();
+	insert(et);
+}
+
+void etimer_set(struct etimer *et, clock_time_t interval) {
+	timer_set(&et->timer, interval);
+	add_timer(et);
+}
+
+void etimer_reset(struct etimer *et) {
+	timer_reset(&et->timer);
+	add_timer(et);
+}
+
+void etimer_restart(struct etimer *et) {
+	timer_restart(&et->timer);
+	add_timer(et);
+}
+
+void etimer_adjust(struct etimer *et, int timediff) {
+	if (et->p == PROCESS_NONE || !unlink_timer(et)) {
+		et->timer.start += timediff;
+		return;
+	}
+
+	advance();
+	et->timer.start += timediff;
+	insert(et);
+}
+
+int etimer_expired(struct etimer *et) {
+	return et->p == PROCESS_NONE;
+}
+
+clock_time_t etimer_expiration_time(struct etimer *et) {
+	return expiry(et);
+}
+
+clock_time_t etimer_start_time(struct etimer *et) {
+	return et->timer.start;
+}
+
+int etimer_pending(void) {
+	return due != NULL || count[0] || count[1] || count[2] || count[3];
+}
+
+clock_time_t etimer_next_expiration_time(void) {
+	return etimer_pending() ? next_expiration : 0;
+}
+
+void etimer_stop(struct etimer *et) {
+	if (et->p != PROCESS_NONE) {
+		unlink_timer(et);
+		et->p = PROCESS_NONE;
+	}
+}
@@ -0,0 +1,358 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Append-only log kept in a ring of dataflash pages, so messages survive
+ * resets and can be read back before the network is up.
+ *
+ * Each 256-byte page starts with a sequence number and is filled with
+ * records in RAM, then programmed in one go. The page for sequence number
+ * n lives at FLASHLOG_START + (n % PAGES) * 256, and the 4K sector ahead is
+ * erased as the log reaches it, so finding the newest page at startup only
+ * takes the first page of each sector and a binary search of one sector.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <contiki.h>
+#include <init.h>
+#include "drivers/dataflash.h"
+#include "flashlog.h"
+
+#define PAGE_SIZE DATAFLASH_WR_PAGE_SIZE
+#define SECTOR_SIZE DATAFLASH_SECTOR_4K_SIZE
+#define SECTOR_PAGES (SECTOR_SIZE / PAGE_SIZE)
+#define SECTORS ((FLASHLOG_END - FLASHLOG_START + 1) / SECTOR_SIZE)
+#define PAGES (SECTORS * SECTOR_PAGES)
+
+#define SEQ_ERASED 0xffffffff
+
+#if (FLASHLOG_START % 4096) || ((FLASHLOG_END + 1) % 4096)
+#error "FLASHLOG_START and FLASHLOG_END must cover whole 4K sectors"
+#endif
+
+#if (FLASHLOG_START <= CONFIG_FLASHMGT_P1_END && \
+	FLASHLOG_END >= CONFIG_FLASHMGT_P1_START) || \
+	(FLASHLOG_START <= CONFIG_FLASHMGT_P2_END && \
+	FLASHLOG_END >= CONFIG_FLASHMGT_P2_START)
+#error "The flash log overlaps a flashmgt partition"
+#endif
+
+PROCESS(flashlog_process, "flashlog");
+INIT_PROCESS(flashlog_process);
+
+// The page being filled
+static union {
+	uint8_t bytes[PAGE_SIZE];
+	uint32_t seq;
+} page;
+static uint16_t used; // bytes of page filled
+static uint8_t found; // set once the newest page in flash is known
+static uint8_t erased; // the page's sector was erased ahead of the flush
+
+static struct etimer tmr;
+static struct etimer tmr_busy;
+
+static uint32_t page_addr(uint32_t seq) {
+	return FLASHLOG_START + (seq % PAGES) * PAGE_SIZE;
+}
+
+static uint32_t read_seq(uint32_t addr) {
+	uint32_t seq;
+
+	if (dataflash_read_data(&seq, addr, sizeof(seq)) != sizeof(seq)) {
+		return SEQ_ERASED;
+	}
+
+	return seq;
+}
+
+static void new_page(uint32_t seq) {
+	memset(page.bytes, 0xff, sizeof(page.bytes));
+	page.seq = seq;
+	used = sizeof(page.seq);
+	erased = 0;
+}
+
+// Make sure the sector at addr can be written; flashmgt locks everything
+// again while it updates the filesystem
+static int unprotect(uint32_t addr) {
+	uint8_t prot;
+
+	if (dataflash_read_protection(addr, &prot)) {
+		return -1;
+	}
+	else if (!prot) {
+		return 0;
+	}
+
+	// Clear SPRL, but don't change sector locks
+	if (dataflash_write_enable() || dataflash_write_status(0x24)) {
+		return -1;
+	}
+
+	if (dataflash_write_enable() || dataflash_unprotect_sector(addr)) {
+		dataflash_write_enable();
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24);
+		return -1;
+	}
+
+	// Set SPRL again
+	if (dataflash_write_enable() ||
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int flashlog_flush(void) {
+	uint32_t addr = page_addr(page.seq);
+	int ret = -1;
+
+	if (!found || used == sizeof(page.seq)) {
+		return 0;
+	}
+
+	if (unprotect(addr)) {
+		goto out;
+	}
+
+	// Starting a sector: erase it, losing the oldest pages
+	if (!(addr % SECTOR_SIZE) && !erased) {
+		dataflash_wait_ready();
+		if (dataflash_write_enable() || dataflash_erase_4k(addr)) {
+			goto out;
+		}
+	}
+
+	dataflash_wait_ready();
+	if (dataflash_write_enable() ||
+		dataflash_write_data(page.bytes, addr, PAGE_SIZE) != PAGE_SIZE)
+	{
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	// Move on either way, a page that can't be written is lost
+	new_page(page.seq + 1);
+	return ret;
+}
+
+void flashlog_write(uint8_t pri, uint32_t time, const char *text) {
+	flashlog_rec_t rec;
+	size_t len = strlen(text);
+
+	// Nowhere to put it before startup
+	if (!found) {
+		return;
+	}
+
+	if (len > FLASHLOG_TEXT_MAX - 1) {
+		len = FLASHLOG_TEXT_MAX - 1;
+	}
+
+	rec.len = sizeof(rec) + len;
+	rec.pri = pri;
+	rec.time = time;
+
+	if (used + rec.len > PAGE_SIZE) {
+		flashlog_flush();
+	}
+
+	memcpy(&page.bytes[used], &rec, sizeof(rec));
+	memcpy(&page.bytes[used + sizeof(rec)], text, len);
+	used += rec.len;
+}
+
+void flashlog_reader_init(flashlog_reader_t *r) {
+	r->seq = page.seq;
+	r->pages = 0;
+	r->left = 0;
+}
+
+// Read the record offsets of the page at r->seq, returns -1 if the page
+// isn't there any more
+static int read_page(flashlog_reader_t *r) {
+	uint32_t addr = page_addr(r->seq);
+	uint16_t off = sizeof(page.seq);
+	uint8_t len;
+
+	if (r->seq == SEQ_ERASED ||
+		(r->seq != page.seq && read_seq(addr) != r->seq))
+	{
+		return -1;
+	}
+
+	while (off + sizeof(flashlog_rec_t) <= PAGE_SIZE &&
+		r->left < FLASHLOG_PAGE_RECS)
+	{
+		if (r->seq == page.seq) {
+			len = off < used ? page.bytes[off] : 0xff;
+		}
+		else if (dataflash_read_data(&len, addr + off, 1) != 1) {
+			return -1;
+		}
+
+		if (len == 0xff || len < sizeof(flashlog_rec_t) ||
+			off + len > PAGE_SIZE)
+		{
+			break;
+		}
+
+		r->off[r->left++] = off;
+		off += len;
+	}
+
+	return 0;
+}
+
+int flashlog_read(flashlog_reader_t *r, flashlog_rec_t *rec,
+	char *text, uint8_t size)
+{
+	uint8_t off;
+	uint8_t len;
+
+	// Go back a page at a time until there's a record
+	while (!r->left) {
+		if (!found || r->pages >= PAGES || read_page(r) < 0) {
+			return -1;
+		}
+
+		r->pages++;
+		r->seq--;
+	}
+
+	off = r->off[--r->left];
+
+	// r->seq has already moved on to the next page back
+	if (r->seq + 1 == page.seq) {
+		memcpy(rec, &page.bytes[off], sizeof(*rec));
+	}
+	else if (dataflash_read_data(rec, page_addr(r->seq + 1) + off,
+		sizeof(*rec)) != sizeof(*rec))
+	{
+		return -1;
+	}
+
+	len = rec->len - sizeof(*rec);
+	if (len > size - 1) {
+		len = size - 1;
+	}
+
+	if (r->seq + 1 == page.seq) {
+		memcpy(text, &page.bytes[off + sizeof(*rec)], len);
+	}
+	else if (dataflash_read_data(text,
+		page_addr(r->seq + 1) + off + sizeof(*rec), len) != len)
+	{
+		return -1;
+	}
+	text[len] = '\0';
+
+	return len;
+}
+
+// Find the newest page written and carry on after it
+static int flashlog_init(void) {
+	uint32_t newest = SEQ_ERASED;
+	uint16_t sector = 0;
+	uint8_t lo, hi;
+
+	new_page(0);
+
+	for (uint16_t i = 0; i < SECTORS; i++) {
+		uint32_t seq = read_seq(FLASHLOG_START + i * SECTOR_SIZE);
+
+		if (seq != SEQ_ERASED && (newest == SEQ_ERASED || seq > newest)) {
+			newest = seq;
+			sector = i;
+		}
+	}
+
+	if (newest != SEQ_ERASED) {
+		// Pages in a sector are written in order, so the ones in use are at
+		// the start of it
+		lo = 0;
+		hi = SECTOR_PAGES;
+		while (hi - lo > 1) {
+			uint8_t mid = (lo + hi) / 2;
+			uint32_t addr = FLASHLOG_START + sector * SECTOR_SIZE +
+				mid * PAGE_SIZE;
+
+			if (read_seq(addr) == newest + mid) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		new_page(newest + lo + 1);
+	}
+
+	found = 1;
+	return 0;
+}
+
+INIT_LIBRARY(flashlog, flashlog_init);
+
+// Start erasing the sector the next flush will write, if it starts a sector,
+// so the process can wait for it instead of flashlog_flush() spinning
+static int erase_ahead(void) {
+	uint32_t addr = page_addr(page.seq);
+
+	if (!found || erased || used == sizeof(page.seq) || (addr % SECTOR_SIZE)) {
+		return 0;
+	}
+
+	if (unprotect(addr) ||
+		dataflash_write_enable() || dataflash_erase_4k(addr))
+	{
+		return -1;
+	}
+
+	erased = 1;
+	return 0;
+}
+
+PROCESS_THREAD(flashlog_process, ev, data) {
+	PROCESS_BEGIN();
+
+	etimer_set(&tmr, FLASHLOG_FLUSH_TIME * CLOCK_SECOND);
+
+	while (1) {
+		PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_TIMER &&
+			etimer_expired(&tmr));
+
+		// Let a sector erase run without holding everything else up
+		if (erase_ahead() == 0) {
+			DATAFLASH_PROCESS_WAIT_READY(&tmr_busy);
+		}
+
+		flashlog_flush();
+		etimer_reset(&tmr);
+	}
+
+	PROCESS_END();
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include <stdint.h>
+
+// Dataflash region kept for the log (whole 4K sectors, outside the
+// flashmgt partitions)
+#define FLASHLOG_START CONFIG_FLASHLOG_START
+#define FLASHLOG_END CONFIG_FLASHLOG_END
+
+// Longest message text kept (including the NUL)
+#ifndef CONFIG_LIB_FLASHLOG_TEXT_MAX
+#define FLASHLOG_TEXT_MAX 80
+#else
+#define FLASHLOG_TEXT_MAX CONFIG_LIB_FLASHLOG_TEXT_MAX
+#endif
+
+// Seconds a part-filled page waits in RAM before it's written anyway
+#ifndef CONFIG_LIB_FLASHLOG_FLUSH_TIME
+#define FLASHLOG_FLUSH_TIME 60
+#else
+#define FLASHLOG_FLUSH_TIME CONFIG_LIB_FLASHLOG_FLUSH_TIME
+#endif
+
+typedef struct {
+	uint8_t len; // of the whole record, 0xff for the end of the page
+	uint8_t pri; // syslog facility and priority
+	uint32_t time; // wallclock_seconds()
+} flashlog_rec_t;
+
+// Records can't be smaller than this, which limits how many fit in a page
+#define FLASHLOG_PAGE_RECS \
+	((256 - sizeof(uint32_t)) / (sizeof(flashlog_rec_t) + 1))
+
+// Walks back through the log from the newest record
+typedef struct {
+	uint32_t seq; // private: page being read
+	uint16_t pages; // private: pages read so far
+	uint8_t left; // private: records of the page not returned yet
+	uint8_t off[FLASHLOG_PAGE_RECS]; // private: where they are
+} flashlog_reader_t;
+
+// Add a record (text is cut short at FLASHLOG_TEXT_MAX). Records collect in
+// RAM until a page is full, the flush timer runs out or flashlog_flush().
+void flashlog_write(uint8_t pri, uint32_t time, const char *text);
+
+// Write out the records in RAM now. Returns -1 on dataflash errors.
+int flashlog_flush(void);
+
+// Start reading from the newest record (including those still in RAM)
+void flashlog_reader_init(flashlog_reader_t *r);
+
+// Read the next older record and its NUL-terminated text. Returns the text
+// length, or -1 once there are no older records.
+int flashlog_read(flashlog_reader_t *r, flashlog_rec_t *rec,
+	char *text, uint8_t size);
+
+#endif // FLASHLOG_H
@@ -24,7 +24,11 @@
 #if CONFIG_LIB_POLYFS_CFS
 #include <polyfs_cfs.h>
 #endif
+#if CONFIG_LIB_JOB
+#include <job.h>
+#endif
 #include <init.h>
+#include <memstat.h>
 #include <settings.h>
 #include <string.h>
 #include <verify.h>
@@ -48,7 +52,8 @@ struct flashmgt_partition {
 struct flashmgt_status {
 	uint8_t primary : 1;
 	uint8_t update_pending : 1;
-	uint8_t padding[3];
+	uint8_t verified : 1; // the pending image's CRC was checked as it was written
+	uint8_t digest[3]; // low 24 bits of that image's CRC
 };
 
 // Compile-time check of struct size
@@ -62,13 +67,29 @@ static struct flashmgt_partition part[] = {
 #if !CONFIG_IMAGE_BOOTLOADER
 static struct {
 	uint8_t sec_write_ready : 1;
+	uint8_t crc_valid : 1;
+	uint8_t sec_checked : 1; // the mounted secondary's CRC has been checked
 } flags;
+
+// CRC of the filesystem being written, built up as the blocks arrive
+static struct {
+	uint32_t crc; // CRC of the data written so far
+	uint32_t offset; // offset the next block must start at
+	uint32_t size; // filesystem size from the superblock
+	uint32_t expect; // CRC stored in the superblock
+} wrcrc;
+
+// Partition offset up to which erases have been issued. Sectors are erased
+// lazily, one ahead of the writes, so erasing overlaps with the transfer.
+static uint32_t erased;
 #endif
 
 static struct flashmgt_status status;
 #if CONFIG_LIB_POLYFS_CFS
 polyfs_fs_t *flashmgt_pfs;
 polyfs_fs_t flashmgt_pfs_struct;
+polyfs_fs_t *flashmgt_sec_pfs;
+static polyfs_fs_t sec_pfs_struct;
 #endif
 
 static int flashmgt_init(void);
@@ -80,6 +101,7 @@ static int flashmgt_init(void) {
 #if CONFIG_LIB_POLYFS_CFS
 	// Nullify in case we run into trouble
 	flashmgt_pfs = NULL;
+	flashmgt_sec_pfs = NULL;
 	polyfs_cfs_fs = NULL;
 #endif
 
@@ -139,6 +161,12 @@ static int flashmgt_init(void) {
 	// Set up the CFS FS pointer
 	flashmgt_pfs = &flashmgt_pfs_struct;
 	polyfs_cfs_fs = flashmgt_pfs;
+
+	// Keep the other image mounted as well, so its pages can be served
+	// without a reboot. It's fine if there isn't one.
+	if (flashmgt_sec_open(&sec_pfs_struct) == 0) {
+		flashmgt_sec_pfs = &sec_pfs_struct;
+	}
 #endif
 
 	return 0;
@@ -172,6 +200,153 @@ int flashmgt_sec_close(polyfs_fs_t *ptr) {
 }
 
 #if !CONFIG_IMAGE_BOOTLOADER
+#if CONFIG_LIB_POLYFS_CFS
+#if CONFIG_LIB_JOB
+// Background CRC check of the mounted secondary
+static struct {
+	struct job job;
+	polyfs_crc_t crc;
+	uint8_t *buf;
+} check;
+
+static const char check_name[] PROGMEM = "flashmgt-check";
+
+static void check_free(void) {
+	if (check.buf) {
+		memstat_free(MEMSTAT_OTHER, check.buf);
+		check.buf = NULL;
+	}
+}
+
+static int check_step(struct job *j) {
+	int ret = polyfs_check_crc_step(flashmgt_sec_pfs, &check.crc,
+		check.buf, SPM_PAGESIZE);
+
+	if (ret > 0) {
+		if (check.crc.size) {
+			j->progress = check.crc.offset * 100 / check.crc.size;
+		}
+		return JOB_MORE;
+	}
+
+	check_free();
+	if (ret == 0) {
+		flags.sec_checked = 1;
+	}
+
+	return ret;
+}
+
+int flashmgt_sec_check(void) {
+	if (!flashmgt_sec_pfs || job_queued(&check.job)) {
+		return -1;
+	}
+	else if (flags.sec_checked) {
+		return 0;
+	}
+
+	check.buf = memstat_malloc(MEMSTAT_OTHER, SPM_PAGESIZE);
+	if (!check.buf) {
+		return -1;
+	}
+
+	memset(&check.crc, 0, sizeof(check.crc));
+	check.job.name = check_name;
+	check.job.step = check_step;
+	job_start(&check.job);
+
+	return 1;
+}
+#endif
+
+// Stop serving pages from the secondary and unmount it
+static int sec_unmount(void) {
+	if (!flashmgt_sec_pfs) {
+		return 0;
+	}
+
+#if CONFIG_LIB_JOB
+	// A check of the image that's going away is no use to anyone
+	if (job_queued(&check.job)) {
+		job_cancel(&check.job);
+		check_free();
+	}
+#endif
+
+	if (polyfs_cfs_fs == flashmgt_sec_pfs &&
+		polyfs_cfs_set_fs(flashmgt_pfs))
+	{
+		return -1;
+	}
+
+	flashmgt_sec_close(flashmgt_sec_pfs);
+	flashmgt_sec_pfs = NULL;
+	flags.sec_checked = 0;
+
+	return 0;
+}
+
+int flashmgt_cfs_select(bool secondary) {
+	polyfs_fs_t *fs = secondary ? flashmgt_sec_pfs : flashmgt_pfs;
+	int ret;
+
+	if (!fs) {
+		return -1;
+	}
+	else if (fs == polyfs_cfs_fs) {
+		return 0;
+	}
+
+	// Don't serve pages out of a half-written or damaged image
+	if (secondary && !flags.sec_checked) {
+		void *crcbuf = memstat_malloc(MEMSTAT_OTHER, SPM_PAGESIZE);
+		if (!crcbuf) {
+			return -1;
+		}
+
+		ret = polyfs_check_crc(fs, crcbuf, SPM_PAGESIZE);
+		memstat_free(MEMSTAT_OTHER, crcbuf);
+		if (ret) {
+			return ret;
+		}
+
+		flags.sec_checked = 1;
+	}
+
+	return polyfs_cfs_set_fs(fs);
+}
+#endif
+
+/*
+ * Start erasing the next sector of the secondary partition. This doesn't wait
+ * for the erase to finish: the chip stays busy in the background and the next
+ * command that needs it waits if it has to.
+ */
+static int erase_next(void) {
+	int sec = !status.primary;
+	uint32_t addr = part[sec].start + erased;
+	int ret;
+
+	// Nothing left to erase
+	if (addr > part[sec].end) {
+		return 0;
+	}
+
+	// Let us erase sectors
+	ret = dataflash_write_enable();
+	if (ret) {
+		return ret;
+	}
+
+	if (dataflash_erase_4k(addr)) {
+		return -1;
+	}
+
+	erased += DATAFLASH_SECTOR_4K_SIZE;
+
+	return 0;
+}
+
 int flashmgt_sec_write_start(void) {
 	int ret;
 	int sec = !status.primary;
@@ -181,6 +356,13 @@ int flashmgt_sec_write_start(void) {
 		return -1;
 	}
 
+#if CONFIG_LIB_POLYFS_CFS
+	// The secondary is about to be overwritten, so it can't stay mounted
+	if (sec_unmount()) {
+		return -1;
+	}
+#endif
+
 	// Allow us to change SREG
 	ret = dataflash_write_enable();
 	if (ret) {
@@ -235,51 +417,74 @@ int flashmgt_sec_write_start(void) {
 		return ret;
 	}
 
-	// Now erase the partition
-	addr = part[sec].start;
-	while (addr <= part[sec].end) {
-		// Let us erase sectors
-		ret = dataflash_write_enable();
-		if (ret) {
-			return ret;
-		}
+	// Nothing is erased yet: get the first sector going while the first
+	// block is on its way
+	erased = 0;
+	ret = erase_next();
+	if (ret) {
+		return ret;
+	}
 
-		if (addr + DATAFLASH_SECTOR_64K_SIZE - 1 <= part[sec].end) {
-			// Erase a 64K sector
-			ret = dataflash_erase_64k(addr);
-			if (ret) {
-				return -1;
-			}
-			addr += DATAFLASH_SECTOR_64K_SIZE;
-		}
-		else if (addr + DATAFLASH_SECTOR_32K_SIZE - 1 <= part[sec].end) {
-			// Erase a 32K sector
-			if (dataflash_erase_32k(addr)) {
-				return -1;
-			}
-			addr += DATAFLASH_SECTOR_32K_SIZE;
+	// OK to carry on with writes
+	flags.sec_write_ready = 1;
+
+	// Start a fresh CRC
+	flags.crc_valid = 1;
+	wrcrc.offset = 0;
+	wrcrc.size = 0;
+
+	return 0;
+}
+
+// Fold a newly written block into the running CRC, giving up if the blocks
+// don't arrive in order
+static void update_write_crc(const void *buf, uint32_t offset, uint32_t len) {
+	if (!flags.crc_valid) {
+		return;
+	}
+	else if (offset != wrcrc.offset) {
+		flags.crc_valid = 0;
+		return;
+	}
+
+	wrcrc.offset += len;
+
+	// Pick up the size and CRC from the superblock
+	if (offset == 0) {
+		struct polyfs_super super;
+
+		if (len < sizeof(super)) {
+			flags.crc_valid = 0;
+			return;
 		}
-		else {
-			// Erase a 4K sector
-			if (dataflash_erase_4k(addr)) {
-				return -1;
-			}
-			addr += DATAFLASH_SECTOR_4K_SIZE;
+
+		memcpy(&super, buf, sizeof(super));
+		if (super.magic != POLYFS_MAGIC) {
+			flags.crc_valid = 0;
+			return;
 		}
 
-		// Wait for the erase to complete
-		dataflash_wait_ready();
+		wrcrc.size = POLYFS_32(super.size);
+		wrcrc.expect = POLYFS_32(super.fsid.crc);
 
-#if CONFIG_WATCHDOG
-		// Poke the watchdog
-		wdt_reset();
-#endif
+		// The CRC is calculated with the CRC field zeroed
+		super.fsid.crc = 0;
+		wrcrc.crc = polyfs_crc32(0, &super, sizeof(super));
+
+		buf = (const uint8_t *)buf + sizeof(super);
+		offset += sizeof(super);
+		len -= sizeof(super);
 	}
 
-	// OK to carry on with writes
-	flags.sec_write_ready = 1;
+	// Ignore anything past the end of the filesystem
+	if (offset >= wrcrc.size) {
+		return;
+	}
+	else if (offset + len > wrcrc.size) {
+		len = wrcrc.size - offset;
+	}
 
-	return 0;
+	wrcrc.crc = polyfs_crc32(wrcrc.crc, buf, len);
 }
 
 int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len) {
@@ -290,6 +495,24 @@ int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len) {
 		return -1;
 	}
 
+	// Don't run into the other partition
+	if (offset + len > part[sec].end - part[sec].start + 1) {
+		return -1;
+	}
+
+	// The sectors we're about to write must at least have started erasing
+	while (erased < offset + len) {
+		ret = erase_next();
+		if (ret) {
+			return ret;
+		}
+	}
+
+	update_write_crc(buf, offset, len);
+
+	// Keep one sector erasing ahead of the data while the next block arrives
+	uint32_t ahead = offset + len + DATAFLASH_SECTOR_4K_SIZE;
+
 	// The flash address is the start address of the partition + offset
 	offset += part[sec].start;
 
@@ -314,8 +537,9 @@ int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len) {
 			len -= ret;
 		}
 
-		// Wait for the write to complete
-		dataflash_wait_ready();
+		// Don't wait for the page to program: the next write enable (or
+		// read) waits if it has to, so the last page of a block programs
+		// while the caller gets on with receiving the next one
 
 #if CONFIG_WATCHDOG
 		// Poke the watchdog
@@ -323,6 +547,13 @@ int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len) {
 #endif
 	}
 
+	if (erased < ahead) {
+		ret = erase_next();
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
@@ -363,9 +594,10 @@ int flashmgt_sec_write_abort(void) {
 
 	// Disable update pending flag
 	status.update_pending = 0;
+	status.verified = 0;
 
 	// Write to settings
-	ret = settings_set(SETTINGS_KEY_FLASHMGT_STATUS, &status, sizeof(status));
+	ret = settings_set_hot(SETTINGS_KEY_FLASHMGT_STATUS, &status, sizeof(status));
 	if (ret != SETTINGS_STATUS_OK) {
 		return -1;
 	}
@@ -375,7 +607,11 @@ int flashmgt_sec_write_abort(void) {
 
 int flashmgt_sec_write_finish(void) {
 	int ret;
-	polyfs_fs_t tempfs;
+#if CONFIG_LIB_POLYFS_CFS
+	polyfs_fs_t *fs = &sec_pfs_struct; // stays mounted if it checks out
+#else
+	polyfs_fs_t tempfs, *fs = &tempfs;
+#endif
 	void *crcbuf = NULL;
 
 	// Check if a write was initiated
@@ -388,6 +624,7 @@ int flashmgt_sec_write_finish(void) {
 
 	// Disable update pending flag (we'll set it later if things pass muster)
 	status.update_pending = 0;
+	status.verified = 0;
 
 	// Let us change SREG
 	ret = dataflash_write_enable();
@@ -414,38 +651,57 @@ int flashmgt_sec_write_finish(void) {
 	}
 
 	// Open the new filesystem so we can check the CRC
-	ret = flashmgt_sec_open(&tempfs);
+	ret = flashmgt_sec_open(fs);
 	if (ret) {
 		goto out;
 	}
 
-	// Malloc a buffer for the CRC check
-	crcbuf = malloc(SPM_PAGESIZE);
-	if (!crcbuf) {
-		ret = -1;
-		goto out;
+	if (flags.crc_valid && wrcrc.size && wrcrc.offset >= wrcrc.size) {
+		// We saw every byte go past, no need to read it all back
+		if (wrcrc.crc != wrcrc.expect) {
+			ret = -1;
+			goto out;
+		}
 	}
+	else {
+		// Malloc a buffer for the CRC check
+		crcbuf = memstat_malloc(MEMSTAT_OTHER, SPM_PAGESIZE);
+		if (!crcbuf) {
+			ret = -1;
+			goto out;
+		}
 
-	// Check new filesystem CRC
-	ret = polyfs_check_crc(&tempfs, crcbuf, SPM_PAGESIZE);
-	if (ret) {
-		goto out;
+		// Check new filesystem CRC
+		ret = polyfs_check_crc(fs, crcbuf, SPM_PAGESIZE);
+		if (ret) {
+			goto out;
+		}
 	}
 
-	// Set status flags
+	// Set status flags, and remember which image was checked so the
+	// bootloader doesn't need to read it all again
 	status.update_pending = 1;
+	status.verified = 1;
+	memcpy(status.digest, &fs->sb.fsid.crc, sizeof(status.digest));
 
 out:
+#if CONFIG_LIB_POLYFS_CFS
+	if (ret == 0) {
+		flashmgt_sec_pfs = fs;
+		flags.sec_checked = 1;
+	}
+	else
+#endif
 	// Close the filesystem
-	flashmgt_sec_close(&tempfs);
+	flashmgt_sec_close(fs);
 
 	// Free the CRC buffer
 	if (crcbuf) {
-		free(crcbuf);
+		memstat_free(MEMSTAT_OTHER, crcbuf);
 	}
 
 	// Write status to settings
-	int ret2 = settings_set(SETTINGS_KEY_FLASHMGT_STATUS,
+	int ret2 = settings_set_hot(SETTINGS_KEY_FLASHMGT_STATUS,
 		&status, sizeof(status));
 	if (ret2 != SETTINGS_STATUS_OK) {
 		ret = ret2;
@@ -468,12 +724,28 @@ bool flashmgt_update_pending(void) {
 	return status.update_pending;
 }
 
-int flashmgt_bootload(void) {
+// Does the program flash page already hold this data?
+static bool page_matches(uint16_t page, const uint8_t *buf) {
+	uint_farptr_t addr = (uint_farptr_t)page * SPM_PAGESIZE;
+
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+		if (pgm_read_byte_far(addr + i) != buf[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int flashmgt_bootload(uint16_t *written) {
 	int ret;
 	polyfs_fs_t tempfs;
 	uint32_t size;
+	bool verified;
 	static uint8_t buf[SPM_PAGESIZE];
 
+	*written = 0;
+
 	// Don't do anything unless an update is lined up
 	if (!status.update_pending) {
 		return 0;
@@ -481,6 +753,8 @@ int flashmgt_bootload(void) {
 
 	// Even if the update fails, we clear the pending flag
 	status.update_pending = 0;
+	verified = status.verified;
+	status.verified = 0;
 
 	// Open the new filesystem
 	ret = flashmgt_sec_open(&tempfs);
@@ -488,10 +762,15 @@ int flashmgt_bootload(void) {
 		goto out;
 	}
 
-	// Check new filesystem CRC
-	ret = polyfs_check_crc(&tempfs, buf, SPM_PAGESIZE);
-	if (ret) {
-		goto out;
+	// Check new filesystem CRC, unless it was checked when the image was
+	// written and the superblock still says it's the same image
+	if (!verified ||
+		memcmp(status.digest, &tempfs.sb.fsid.crc, sizeof(status.digest)))
+	{
+		ret = polyfs_check_crc(&tempfs, buf, SPM_PAGESIZE);
+		if (ret) {
+			goto out;
+		}
 	}
 
 	// Find the size of the firmware image
@@ -519,10 +798,19 @@ int flashmgt_bootload(void) {
 			memset(&buf[ret], 0xff, SPM_PAGESIZE - ret);
 		}
 
-		// Write the page
-		ret = stubboot_write_page(page, buf);
-		if (ret < 0) {
-			goto out;
+		// Only write pages that differ, and check they took
+		if (!page_matches(page, buf)) {
+			ret = stubboot_write_page(page, buf);
+			if (ret < 0) {
+				goto out;
+			}
+
+			if (!page_matches(page, buf)) {
+				ret = -1;
+				goto out;
+			}
+
+			(*written)++;
 		}
 
 		page++;
@@ -537,7 +825,7 @@ out:
 	flashmgt_sec_close(&tempfs);
 
 	// Write status to settings
-	int ret2 = settings_set(SETTINGS_KEY_FLASHMGT_STATUS,
+	int ret2 = settings_set_hot(SETTINGS_KEY_FLASHMGT_STATUS,
 		&status, sizeof(status));
 	if (ret2 != SETTINGS_STATUS_OK) {
 		ret = ret2;
@@ -21,7 +21,10 @@
 #ifndef __FLASHMGT_H__
 #define __FLASHMGT_H__
 
+#include <stdbool.h>
+
 extern polyfs_fs_t *flashmgt_pfs;
+extern polyfs_fs_t *flashmgt_sec_pfs; // the other partition, NULL if none
 
 int flashmgt_sec_open(polyfs_fs_t *ptr);
 int flashmgt_sec_close(polyfs_fs_t *ptr);
@@ -31,11 +34,24 @@ int flashmgt_sec_write_start(void);
 int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len);
 int flashmgt_sec_write_abort(void);
 int flashmgt_sec_write_finish(void);
+
+// Serve web content from the secondary (or back from the primary) partition
+// straight away. Only lasts until the next reboot, and fails while files
+// are open. The secondary's CRC is checked before it's first used.
+int flashmgt_cfs_select(bool secondary);
+
+#if CONFIG_LIB_JOB
+// Check the secondary's CRC as a background job, so that selecting it
+// doesn't have to. Returns 0 if it's already been checked, or 1 if the
+// check has started, in which case the current process gets job_event when
+// it's done (with a result of 0 if the image is good).
+int flashmgt_sec_check(void);
+#endif
 #endif
 
 #if CONFIG_IMAGE_BOOTLOADER
 bool flashmgt_update_pending(void);
-int flashmgt_bootload(void);
+int flashmgt_bootload(uint16_t *written); // number of pages that changed
 #endif
 
 #endif
@@ -28,6 +28,9 @@
 #if !CONFIG_IMAGE_BOOTLOADER
 #include <stdio.h>
 #endif
+#if INIT_PROFILE
+#include <board.h>
+#endif
 
 #include <compat.h>
 
@@ -42,8 +45,36 @@ extern struct process *__init_processes_end;
 #endif
 extern struct init_entry *__init_components_start;
 extern struct init_entry *__init_components_end;
+#if CONFIG_LIB_CONTIKI && !CONFIG_IMAGE_BOOTLOADER
+extern struct init_entry *__init_deferred_start;
+extern struct init_entry *__init_deferred_end;
+
+PROCESS(init_process, "init");
+uint8_t init_deferred_done;
+process_event_t init_event;
+#endif
+
+#if INIT_PROFILE
+struct init_profile init_profile[INIT_PROFILE_MAX];
+uint8_t init_profile_count;
+uint32_t init_profile_start;
+uint32_t init_profile_end;
+
+static void profile_add(uint8_t type, PGM_P name, uint32_t start, int err) {
+	if (init_profile_count < INIT_PROFILE_MAX) {
+		struct init_profile *p = &init_profile[init_profile_count++];
+
+		p->type = type;
+		p->err = err;
+		p->name = name;
+		p->us = clock_us() - start;
+	}
+}
+#endif
 
-static void init_call_funcs(uint_farptr_t start, uint_farptr_t end) {
+static void init_call_funcs(uint8_t type, uint_farptr_t start,
+	uint_farptr_t end)
+{
 	while (start < end) {
 		struct init_entry ent;
 		poly_memcpy_PF(&ent, start, sizeof(ent));
@@ -51,16 +82,29 @@ static void init_call_funcs(uint_farptr_t start, uint_farptr_t end) {
 #if CONFIG_IMAGE_BOOTLOADER
 		ent.fn();
 #else
+#if INIT_PROFILE
+		uint32_t t = clock_us();
+#endif
+#if !INIT_QUIET
 		printf_P(PSTR("\rInitialising %S: "), ent.name);
+#endif
 
 		int err = ent.fn();
 
+#if INIT_PROFILE
+		profile_add(type, ent.name, t, err);
+#endif
 		if (err) {
+#if INIT_QUIET
+			printf_P(PSTR("Initialising %S: "), ent.name);
+#endif
 			printf_P(PSTR("FAIL (%d)\n"), err);
 		}
+#if !INIT_QUIET
 		else {
 			printf_P(PSTR("OK\n"));
 		}
+#endif
 #endif
 
 		start += sizeof(ent);
@@ -68,13 +112,17 @@ static void init_call_funcs(uint_farptr_t start, uint_farptr_t end) {
 }
 
 void init_doinit(void) {
+#if INIT_PROFILE
+	init_profile_start = clock_us();
+#endif
+
 	// Initialise all drivers
-	init_call_funcs(
+	init_call_funcs(INIT_TYPE_DRIVER,
 		pgm_get_far_address(__init_drivers_start),
 		pgm_get_far_address(__init_drivers_end));
 
 	// Initialise all libraries
-	init_call_funcs(
+	init_call_funcs(INIT_TYPE_LIBRARY,
 		pgm_get_far_address(__init_libraries_start),
 		pgm_get_far_address(__init_libraries_end));
 
@@ -84,15 +132,57 @@ void init_doinit(void) {
 	uint_farptr_t ppe = pgm_get_far_address(__init_processes_end);
 	while (pp < ppe) {
 		struct process *p = (void *)pgm_read_word(pp);
+#if INIT_PROFILE
+		uint32_t t = clock_us();
+#endif
+#if !INIT_QUIET
 		printf_P(PSTR("Starting process %S\n"), PROCESS_NAME_STRING(p));
+#endif
 		process_start(p, NULL);
+#if INIT_PROFILE
+		profile_add(INIT_TYPE_PROCESS, PROCESS_NAME_STRING(p), t, 0);
+#endif
 		pp += sizeof(struct process *);
 	}
 #endif
 
 	// Initialise all components
-	init_call_funcs(
+	init_call_funcs(INIT_TYPE_COMPONENT,
 		pgm_get_far_address(__init_components_start),
 		pgm_get_far_address(__init_components_end));
+
+#if INIT_PROFILE
+	init_profile_end = clock_us();
+#endif
+
+#if CONFIG_LIB_CONTIKI && !CONFIG_IMAGE_BOOTLOADER
+	// Then the deferred ones
+	process_start(&init_process, NULL);
+#endif
+}
+
+#if CONFIG_LIB_CONTIKI && !CONFIG_IMAGE_BOOTLOADER
+PROCESS_THREAD(init_process, ev, data) {
+	static uint_farptr_t start;
+	PROCESS_BEGIN();
+
+	init_event = process_alloc_event();
+
+	for (start = pgm_get_far_address(__init_deferred_start);
+		start < pgm_get_far_address(__init_deferred_end);
+		start += sizeof(struct init_entry))
+	{
+		// Let everything else have a go first
+		PROCESS_PAUSE();
+
+		init_call_funcs(INIT_TYPE_DEFERRED, start,
+			start + sizeof(struct init_entry));
+	}
+
+	init_deferred_done = 1;
+	process_post(PROCESS_BROADCAST, init_event, NULL);
+
+	PROCESS_END();
 }
+#endif
 
@@ -65,6 +65,64 @@ struct init_entry {
 #define INIT_COMPONENT(_name) \
 	_INIT_FN(components, _name)
 
+// Run after every process has started, each on its own turn of the
+// scheduler, for slow hardware probes that nothing needs straight away
+#define INIT_DEFERRED(_name, _initfunc) \
+	_INIT_FP(deferred, _name, _initfunc)
+
 void init_doinit(void);
 
+// Time each initialiser (not in the bootloader)
+#if CONFIG_LIB_INIT_PROFILE && !CONFIG_IMAGE_BOOTLOADER
+#define INIT_PROFILE 1
+#else
+#define INIT_PROFILE 0
+#endif
+
+// Only print initialisers that fail, which saves the time spent sending
+// a line for each of them over the UART
+#if CONFIG_LIB_INIT_QUIET
+#define INIT_QUIET 1
+#else
+#define INIT_QUIET 0
+#endif
+
+#define INIT_TYPE_DRIVER 0
+#define INIT_TYPE_LIBRARY 1
+#define INIT_TYPE_PROCESS 2
+#define INIT_TYPE_COMPONENT 3
+#define INIT_TYPE_DEFERRED 4
+
+#if CONFIG_LIB_CONTIKI && !CONFIG_IMAGE_BOOTLOADER
+#include <contiki.h>
+
+// Set once the deferred initialisers have all run, when init_event is
+// broadcast
+extern uint8_t init_deferred_done;
+extern process_event_t init_event;
+#endif
+
+#if INIT_PROFILE
+#ifndef CONFIG_LIB_INIT_PROFILE_MAX
+#define INIT_PROFILE_MAX 48
+#else
+#define INIT_PROFILE_MAX CONFIG_LIB_INIT_PROFILE_MAX
+#endif
+
+struct init_profile {
+	uint8_t type; // INIT_TYPE_*
+	int8_t err; // what the initialiser returned
+	PGM_P name;
+	uint32_t us; // time taken
+};
+
+// Each initialiser in the order they ran (the first INIT_PROFILE_MAX)
+extern struct init_profile init_profile[INIT_PROFILE_MAX];
+extern uint8_t init_profile_count;
+
+// clock_us() when init_doinit() started and finished
+extern uint32_t init_profile_start;
+extern uint32_t init_profile_end;
+#endif
+
 #endif // INIT_H
@@ -0,0 +1,137 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stddef.h>
+
+#include <board.h>
+#include <job.h>
+
+PROCESS(job_process, "Jobs");
+
+process_event_t job_event;
+struct job *job_queue;
+
+uint8_t job_queued(struct job *j) {
+	struct job *t;
+
+	for (t = job_queue; t != NULL; t = t->next) {
+		if (t == j) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int job_start(struct job *j) {
+	struct job **t;
+
+	if (job_queued(j)) {
+		return -1;
+	}
+
+	// Started by the first job, like the event it posts
+	if (!process_is_running(&job_process)) {
+		job_event = process_alloc_event();
+		process_start(&job_process, NULL);
+	}
+
+	j->owner = PROCESS_CURRENT();
+	j->result = JOB_MORE;
+	j->progress = 0;
+
+	// New jobs go to the back, so they wait their turn
+	for (t = &job_queue; *t != NULL; t = &(*t)->next);
+	j->next = NULL;
+	*t = j;
+
+	process_poll(&job_process);
+	return 0;
+}
+
+static void finish(struct job *j, int result) {
+	struct job **t;
+
+	for (t = &job_queue; *t != NULL; t = &(*t)->next) {
+		if (*t == j) {
+			*t = j->next;
+			break;
+		}
+	}
+
+	j->next = NULL;
+	j->result = result;
+	if (process_is_running(j->owner)) {
+		process_post(j->owner, job_event, j);
+	}
+}
+
+void job_cancel(struct job *j) {
+	if (job_queued(j)) {
+		finish(j, -1);
+	}
+}
+
+// Run the job at the front of the queue for a slice, then send it to the
+// back if it isn't finished
+static void slice(void) {
+	struct job *j = job_queue;
+	uint32_t start = clock_us();
+	int ret;
+
+	do {
+		ret = j->step(j);
+	} while (ret == JOB_MORE && clock_us() - start < JOB_SLICE_US);
+
+	// The step may have cancelled its own job
+	if (job_queue != j) {
+		return;
+	}
+
+	if (ret != JOB_MORE) {
+		finish(j, ret);
+	}
+	else if (j->next != NULL) {
+		struct job **t;
+
+		job_queue = j->next;
+		for (t = &job_queue; *t != NULL; t = &(*t)->next);
+		j->next = NULL;
+		*t = j;
+	}
+}
+
+PROCESS_THREAD(job_process, ev, data) {
+	PROCESS_BEGIN();
+
+	while (1) {
+		PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+
+		// Yield between slices; polls and events that came in during a
+		// slice are all dealt with before the continue comes round
+		while (job_queue != NULL) {
+			slice();
+			PROCESS_PAUSE();
+		}
+	}
+
+	PROCESS_END();
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+#include <contiki.h>
+
+/*
+ * Long-running work done in the background, a slice at a time.
+ *
+ * A job is a step function that the job process calls over and over until
+ * it says it's finished. Each step should do a small, bounded piece of the
+ * work (a page of flash, say) and keep what it needs to carry on in the
+ * job's own state, usually a struct with the struct job at the start. Steps
+ * run back to back for up to JOB_SLICE_US, then the job process yields so
+ * that everything else waiting gets a turn before the next slice; several
+ * jobs take a slice each in turn.
+ *
+ * When a job finishes, the process that started it is posted job_event
+ * with the job as the data, and result says how it went.
+ */
+
+// Microseconds of steps per slice
+#ifndef CONFIG_LIB_JOB_SLICE_US
+#define JOB_SLICE_US 2000
+#else
+#define JOB_SLICE_US CONFIG_LIB_JOB_SLICE_US
+#endif
+
+// What a step returns, besides < 0 on failure
+#define JOB_DONE 0
+#define JOB_MORE 1
+
+struct job;
+typedef int (*job_step_t)(struct job *j);
+
+struct job {
+	struct job *next;
+	PGM_P name; // shown by ps
+	job_step_t step;
+	struct process *owner; // the process that started the job
+	int result; // the last step's return value
+	uint8_t progress; // percent done, for the step to keep up to date
+};
+
+extern process_event_t job_event;
+
+// Jobs waiting to run or part done
+extern struct job *job_queue;
+
+// Queue j to run on behalf of the current process (name and step need to
+// be set). Returns -1 if it's already queued.
+int job_start(struct job *j);
+// Take j off the queue before it finishes. Its owner is still told, with a
+// result of -1.
+void job_cancel(struct job *j);
+// Is j queued?
+uint8_t job_queued(struct job *j);
+
+#endif // JOB_H
@@ -0,0 +1,243 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+
+#include <minilzo/minilzo.h>
+
+#include "lzo_avr.h"
+
+/*
+ * This follows the structure of lzo1x_decompress_safe() in minilzo.c (and
+ * its labels, to make the two easy to compare), working out each match as
+ * a 16-bit distance rather than a pointer so the look-behind check is a
+ * single compare. Every byte of input is checked for before it is read,
+ * which is slightly stricter than minilzo: that lets ip run up to two
+ * bytes past the end and only notices afterwards.
+ */
+
+#ifdef CONFIG_LIB_LZO_AVR_ASM
+#define LZO_ASM CONFIG_LIB_LZO_AVR_ASM
+#else
+#define LZO_ASM 1
+#endif
+
+#if !__AVR__
+#undef LZO_ASM
+#define LZO_ASM 0
+#endif
+
+#define M2_MAX_OFFSET 0x0800
+
+#define NEED_IP(x) \
+	if ((uint16_t)(ip_end - ip) < (uint16_t)(x)) goto input_overrun
+#define NEED_OP(x) \
+	if ((uint16_t)(op_end - op) < (uint16_t)(x)) goto output_overrun
+#define TEST_LB(off) \
+	if ((off) > (uint16_t)(op - out)) goto lookbehind_overrun
+
+// Long literal runs and matches: a zero length is followed by a count of
+// 255s and a final byte. Giving up as soon as the length can't fit keeps
+// it well clear of wrapping around.
+#define RUN_LENGTH(t, base) \
+	if (t == 0) { \
+		NEED_IP(1); \
+		while (*ip == 0) { \
+			t += 255; \
+			ip++; \
+			if (t > (uint16_t)(op_end - op)) goto output_overrun; \
+			NEED_IP(1); \
+		} \
+		t += base + *ip++; \
+	}
+
+// Copy n (at least 1) bytes forwards a byte at a time, advancing dst and
+// src; matches may overlap the bytes they produce
+#if LZO_ASM
+#define COPY(dst, src, n) \
+	asm volatile( \
+		"lsr %B2\n\t" \
+		"ror %A2\n\t" \
+		"brcc 1f\n\t" \
+		"ld __tmp_reg__, %a1+\n\t" \
+		"st %a0+, __tmp_reg__\n\t" \
+		"1:\n\t" \
+		"sbiw %2, 0\n\t" \
+		"breq 3f\n\t" \
+		"2:\n\t" \
+		"ld __tmp_reg__, %a1+\n\t" \
+		"st %a0+, __tmp_reg__\n\t" \
+		"ld __tmp_reg__, %a1+\n\t" \
+		"st %a0+, __tmp_reg__\n\t" \
+		"sbiw %2, 1\n\t" \
+		"brne 2b\n\t" \
+		"3:\n\t" \
+		: "+e" (dst), "+e" (src), "+w" (n) \
+		: \
+		: "memory")
+#else
+#define COPY(dst, src, n) \
+	do { \
+		*dst++ = *src++; \
+	} while (--n)
+#endif
+
+int lzo1x_decompress_avr(const uint8_t *in, uint16_t in_len,
+	uint8_t *out, uint16_t *out_len)
+{
+	const uint8_t *ip = in;
+	const uint8_t *const ip_end = in + in_len;
+	uint8_t *op = out;
+	uint8_t *const op_end = out + *out_len;
+	const uint8_t *m_pos;
+	uint16_t t, off;
+	int ret;
+
+	NEED_IP(1);
+	if (*ip > 17) {
+		t = *ip++ - 17;
+		if (t < 4) {
+			goto match_next;
+		}
+		NEED_OP(t);
+		NEED_IP(t + 1);
+		COPY(op, ip, t);
+		goto first_literal_run;
+	}
+
+	while (ip < ip_end) {
+		t = *ip++;
+		if (t >= 16) {
+			goto match;
+		}
+
+		// A literal run
+		RUN_LENGTH(t, 15);
+		t += 3;
+		NEED_OP(t);
+		NEED_IP(t + 1);
+		COPY(op, ip, t);
+
+first_literal_run:
+		// Straight after a run, a short code is a 3-byte match
+		t = *ip++;
+		if (t >= 16) {
+			goto match;
+		}
+		NEED_IP(1);
+		off = (1 + M2_MAX_OFFSET) + (t >> 2) + (*ip++ << 2);
+		TEST_LB(off);
+		NEED_OP(3);
+		m_pos = op - off;
+		*op++ = *m_pos++;
+		*op++ = *m_pos++;
+		*op++ = *m_pos;
+		goto match_done;
+
+		for (;;) {
+match:
+			if (t >= 64) {
+				// M2: 3-8 bytes, up to 2 KiB back
+				NEED_IP(1);
+				off = 1 + ((t >> 2) & 7) + (*ip++ << 3);
+				t = (t >> 5) - 1;
+			}
+			else if (t >= 32) {
+				// M3: up to 16 KiB back
+				t &= 31;
+				RUN_LENGTH(t, 31);
+				NEED_IP(2);
+				off = 1 + (ip[0] >> 2) + (ip[1] << 6);
+				ip += 2;
+			}
+			else if (t >= 16) {
+				// M4: 16-48 KiB back, or the end of the stream
+				off = (t & 8) << 11;
+				t &= 7;
+				RUN_LENGTH(t, 7);
+				NEED_IP(2);
+				off += (ip[0] >> 2) + (ip[1] << 6);
+				ip += 2;
+				if (off == 0) {
+					goto eof_found;
+				}
+				off += 0x4000;
+			}
+			else {
+				// M1: 2 bytes, up to 1 KiB back
+				NEED_IP(1);
+				off = 1 + (t >> 2) + (*ip++ << 2);
+				TEST_LB(off);
+				NEED_OP(2);
+				m_pos = op - off;
+				*op++ = *m_pos++;
+				*op++ = *m_pos;
+				goto match_done;
+			}
+
+			TEST_LB(off);
+			t += 2;
+			NEED_OP(t);
+			m_pos = op - off;
+			COPY(op, m_pos, t);
+
+match_done:
+			// Up to 3 literals can follow a match without a run code
+			t = ip[-2] & 3;
+			if (t == 0) {
+				break;
+			}
+
+match_next:
+			NEED_OP(t);
+			NEED_IP(t + 1);
+			*op++ = *ip++;
+			if (t > 1) {
+				*op++ = *ip++;
+				if (t > 2) {
+					*op++ = *ip++;
+				}
+			}
+			t = *ip++;
+		}
+	}
+
+	ret = LZO_E_EOF_NOT_FOUND;
+	goto out;
+
+eof_found:
+	ret = (ip == ip_end) ? LZO_E_OK : LZO_E_INPUT_NOT_CONSUMED;
+	goto out;
+
+input_overrun:
+	ret = LZO_E_INPUT_OVERRUN;
+	goto out;
+
+output_overrun:
+	ret = LZO_E_OUTPUT_OVERRUN;
+	goto out;
+
+lookbehind_overrun:
+	ret = LZO_E_LOOKBEHIND_OVERRUN;
+
+out:
+	*out_len = op - out;
+	return ret;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef LZO_AVR_H
+#define LZO_AVR_H
+
+#include <stdint.h>
+
+/*
+ * LZO1X decompressor for small machines.
+ *
+ * Does the same checks as lzo1x_decompress_safe() and returns the same
+ * LZO_E_* codes, but with 16-bit lengths and offsets throughout, which
+ * suits an 8-bit CPU a lot better than minilzo's lzo_uint arithmetic.
+ * Decompressing in place works as it does with minilzo, with the input at
+ * the end of the output buffer.
+ *
+ * *out_len is the size of the output buffer going in and the number of
+ * bytes decompressed coming out.
+ */
+int lzo1x_decompress_avr(const uint8_t *in, uint16_t in_len,
+	uint8_t *out, uint16_t *out_len);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+#include <contiki.h>
+#include <init.h>
+#include "stack.h"
+#if CONFIG_APPS_SYSLOG
+#include "apps/syslog.h"
+#endif
+#include "memstat.h"
+
+PROCESS(memstat_process, "memstat");
+INIT_PROCESS(memstat_process);
+
+struct memstat memstat = {
+	.heap_min = 0xffff,
+	.stack_min = 0xffff,
+};
+
+static const char site_httpd[] PROGMEM = "httpd";
+static const char site_syslog[] PROGMEM = "syslog";
+static const char site_polyfs[] PROGMEM = "polyfs";
+static const char site_owfsd[] PROGMEM = "owfsd";
+static const char site_shell[] PROGMEM = "shell";
+static const char site_other[] PROGMEM = "other";
+
+const char * const memstat_site_names[MEMSTAT_SITES] PROGMEM = {
+	[MEMSTAT_HTTPD] = site_httpd,
+	[MEMSTAT_SYSLOG] = site_syslog,
+	[MEMSTAT_POLYFS] = site_polyfs,
+	[MEMSTAT_OWFSD] = site_owfsd,
+	[MEMSTAT_SHELL] = site_shell,
+	[MEMSTAT_OTHER] = site_other,
+};
+
+/* from stdlib_private.h */
+struct __freelist {
+	size_t sz;
+	struct __freelist *nx;
+};
+
+extern struct __freelist *__flp; /* freelist pointer (head of freelist) */
+
+// Set while a warning is outstanding, so each crossing is logged once
+static uint8_t heap_low;
+static uint8_t stack_low;
+
+static void check_heap(void) {
+	const uint16_t heap_end = (uint16_t)__malloc_heap_end;
+	uint16_t top;
+	uint16_t free = 0;
+	uint16_t largest = 0;
+
+	// Blocks given back to the free list...
+	for (struct __freelist *fp = __flp; fp; fp = fp->nx) {
+		free += fp->sz;
+		if (fp->sz > largest) {
+			largest = fp->sz;
+		}
+	}
+
+	// ...and everything above the break
+	top = heap_end + 1 - (__brkval ? (uint16_t)__brkval :
+		(uint16_t)__malloc_heap_start);
+	free += top;
+	if (top > largest) {
+		largest = top;
+	}
+
+	memstat.heap_free = free;
+	memstat.heap_largest = largest;
+	if (free < memstat.heap_min) {
+		memstat.heap_min = free;
+	}
+}
+
+void memstat_check(void) {
+	uint16_t stack = StackCount();
+
+	check_heap();
+	if (stack < memstat.stack_min) {
+		memstat.stack_min = stack;
+	}
+
+	if (!heap_low && memstat.heap_largest < MEMSTAT_HEAP_WARN) {
+		heap_low = 1;
+#if CONFIG_APPS_SYSLOG
+		syslog_P(LOG_DAEMON | LOG_WARNING,
+			PSTR("Heap low: %u free, largest block %u"),
+			memstat.heap_free, memstat.heap_largest);
+#endif
+	}
+	else if (heap_low && memstat.heap_largest >= MEMSTAT_HEAP_WARN * 2) {
+		heap_low = 0;
+	}
+
+	// The stack paint only wears away, so this is logged once
+	if (!stack_low && memstat.stack_min < MEMSTAT_STACK_WARN) {
+		stack_low = 1;
+#if CONFIG_APPS_SYSLOG
+		syslog_P(LOG_DAEMON | LOG_WARNING,
+			PSTR("Stack low: %u bytes never used"), memstat.stack_min);
+#endif
+	}
+}
+
+void *memstat_heap_alloc(uint8_t site, void *p) {
+	p = memstat_pool_alloc(site, p);
+	check_heap();
+	return p;
+}
+
+void *memstat_pool_alloc(uint8_t site, void *p) {
+	if (p) {
+		memstat.sites[site].allocs++;
+	}
+	else {
+		memstat.sites[site].fails++;
+	}
+
+	return p;
+}
+
+void memstat_release(uint8_t site, const void *p) {
+	if (p) {
+		memstat.sites[site].frees++;
+	}
+}
+
+PROCESS_THREAD(memstat_process, ev, data) {
+	static struct etimer timer;
+	PROCESS_BEGIN();
+
+	etimer_set(&timer, CLOCK_SECOND * MEMSTAT_PERIOD);
+	while (1) {
+		memstat_check();
+
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&timer));
+		etimer_reset(&timer);
+	}
+
+	PROCESS_END();
+}
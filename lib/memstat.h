@@ -0,0 +1,131 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Counts allocations by the subsystem making them, from the heap and from
+ * the fixed pools (MEMB) that most of them use, and keeps an eye on free
+ * heap and stack. Use the wrappers below instead of malloc() and free() or
+ * memb_alloc() and memb_free(); without LIB_MEMSTAT they are just those.
+ * With LIB_SALLOC the heap wrappers take what they can from its size
+ * classes instead.
+ */
+
+#if CONFIG_LIB_SALLOC
+#include <salloc.h>
+#define MEMSTAT_MALLOC(size) salloc(size)
+#define MEMSTAT_CALLOC(n, size) scalloc(n, size)
+#define MEMSTAT_FREE(p) sfree(p)
+#else
+#define MEMSTAT_MALLOC(size) malloc(size)
+#define MEMSTAT_CALLOC(n, size) calloc(n, size)
+#define MEMSTAT_FREE(p) free(p)
+#endif
+
+enum {
+	MEMSTAT_HTTPD, // connection states
+	MEMSTAT_SYSLOG, // queued messages
+	MEMSTAT_POLYFS, // path lookups
+	MEMSTAT_OWFSD, // connection states
+	MEMSTAT_SHELL, // command buffers
+	MEMSTAT_OTHER,
+	MEMSTAT_SITES
+};
+
+// Seconds between checks of the free heap and stack
+#ifndef CONFIG_LIB_MEMSTAT_PERIOD
+#define MEMSTAT_PERIOD 10
+#else
+#define MEMSTAT_PERIOD CONFIG_LIB_MEMSTAT_PERIOD
+#endif
+
+// Log a warning when the largest free heap block drops below this
+#ifndef CONFIG_LIB_MEMSTAT_HEAP_WARN
+#define MEMSTAT_HEAP_WARN 512
+#else
+#define MEMSTAT_HEAP_WARN CONFIG_LIB_MEMSTAT_HEAP_WARN
+#endif
+
+// Log a warning when the untouched stack drops below this
+#ifndef CONFIG_LIB_MEMSTAT_STACK_WARN
+#define MEMSTAT_STACK_WARN 256
+#else
+#define MEMSTAT_STACK_WARN CONFIG_LIB_MEMSTAT_STACK_WARN
+#endif
+
+#if CONFIG_LIB_MEMSTAT
+
+#include <avr/pgmspace.h>
+
+struct memstat_site {
+	uint16_t allocs;
+	uint16_t frees;
+	uint16_t fails;
+};
+
+struct memstat {
+	struct memstat_site sites[MEMSTAT_SITES];
+	uint16_t heap_free; // as of the last check
+	uint16_t heap_largest; // largest free block, as of the last check
+	uint16_t heap_min; // least free ever seen
+	uint16_t stack_min; // least untouched stack (it's never repainted)
+};
+
+extern struct memstat memstat;
+
+// Count an allocation (or a failure if p is NULL) and return p
+void *memstat_heap_alloc(uint8_t site, void *p);
+void *memstat_pool_alloc(uint8_t site, void *p);
+// Count a free (of a non-NULL pointer)
+void memstat_release(uint8_t site, const void *p);
+
+// Look at the free heap and stack now
+void memstat_check(void);
+
+// Names of the sites for reports
+extern const char * const memstat_site_names[MEMSTAT_SITES] PROGMEM;
+
+#define memstat_malloc(site, size) \
+	memstat_heap_alloc(site, MEMSTAT_MALLOC(size))
+#define memstat_calloc(site, n, size) \
+	memstat_heap_alloc(site, MEMSTAT_CALLOC(n, size))
+#define memstat_free(site, p) \
+	do { memstat_release(site, p); MEMSTAT_FREE(p); } while (0)
+#define memstat_memb_alloc(site, m) \
+	memstat_pool_alloc(site, memb_alloc(m))
+#define memstat_memb_free(site, m, p) \
+	(memstat_release(site, p), memb_free(m, p))
+
+#else
+
+#define memstat_malloc(site, size) MEMSTAT_MALLOC(size)
+#define memstat_calloc(site, n, size) MEMSTAT_CALLOC(n, size)
+#define memstat_free(site, p) MEMSTAT_FREE(p)
+#define memstat_memb_alloc(site, m) memb_alloc(m)
+#define memstat_memb_free(site, m, p) memb_free(m, p)
+
+#endif
+
+#endif
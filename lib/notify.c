@@ -0,0 +1,121 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <contiki.h>
+#include <stddef.h>
+
+#include <notify.h>
+
+PROCESS(notify_process, "Notify");
+
+// Every struct notify that has been posted to
+static struct notify *lists;
+
+static uint8_t subscribed(struct notify *n, struct notify_sub *s) {
+	struct notify_sub *t;
+
+	for (t = n->subs; t != NULL; t = t->next) {
+		if (t == s) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void notify_subscribe(struct notify *n, struct notify_sub *s) {
+	s->p = PROCESS_CURRENT();
+
+	if (!subscribed(n, s)) {
+		s->next = n->subs;
+		n->subs = s;
+	}
+}
+
+void notify_unsubscribe(struct notify *n, struct notify_sub *s) {
+	struct notify_sub **t;
+
+	for (t = &n->subs; *t != NULL; t = &(*t)->next) {
+		if (*t == s) {
+			*t = s->next;
+			s->next = NULL;
+			return;
+		}
+	}
+}
+
+int notify_post(struct notify *n, process_event_t ev, process_data_t data) {
+	struct notify *t;
+
+	// Started by the first post, so that's never early
+	if (!process_is_running(&notify_process)) {
+		process_start(&notify_process, NULL);
+	}
+
+	n->ev = ev;
+	for (t = lists; t != NULL && t != n; t = t->next);
+	if (t == NULL) {
+		n->next = lists;
+		lists = n;
+	}
+
+	return process_post(&notify_process, ev, data);
+}
+
+static void deliver(struct notify *n, process_event_t ev,
+	process_data_t data)
+{
+	struct notify_sub **t = &n->subs;
+
+	while (*t != NULL) {
+		struct notify_sub *s = *t;
+
+		if (!process_is_running(s->p)) {
+			*t = s->next;
+			s->next = NULL;
+			continue;
+		}
+
+		// A subscriber can unsubscribe itself while it has the event
+		process_post_synch(s->p, ev, data);
+		if (*t == s) {
+			t = &s->next;
+		}
+	}
+}
+
+PROCESS_THREAD(notify_process, ev, data) {
+	struct notify *n;
+
+	PROCESS_BEGIN();
+
+	while (1) {
+		PROCESS_WAIT_EVENT();
+
+		for (n = lists; n != NULL; n = n->next) {
+			if (n->ev == ev) {
+				deliver(n, ev, data);
+				break;
+			}
+		}
+	}
+
+	PROCESS_END();
+}
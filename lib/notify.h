@@ -0,0 +1,58 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <contiki.h>
+
+/*
+ * Events for the processes that asked for them, rather than broadcast to
+ * every process in the system.
+ *
+ * Whatever posts an event owns a struct notify, and each process that wants
+ * it subscribes with a struct notify_sub of its own (usually static). A post
+ * puts one event on the queue, just like a broadcast, for a dispatcher that
+ * hands it to each subscriber in turn when it comes off; processes that
+ * aren't subscribed never see it. Subscriptions for processes that have
+ * exited are dropped as they're found.
+ */
+
+struct notify_sub {
+	struct notify_sub *next;
+	struct process *p;
+};
+
+struct notify {
+	struct notify *next; // on the dispatcher's list once posted to
+	struct notify_sub *subs;
+	process_event_t ev;
+};
+
+// Have the current process sent what's posted to n (no harm if it already
+// is)
+void notify_subscribe(struct notify *n, struct notify_sub *s);
+void notify_unsubscribe(struct notify *n, struct notify_sub *s);
+
+// Post ev to n's subscribers; data has to stay put until they've had it,
+// the same as for a broadcast. Returns the process_post() result.
+int notify_post(struct notify *n, process_event_t ev, process_data_t data);
+
+#endif // NOTIFY_H
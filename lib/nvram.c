@@ -0,0 +1,75 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <util/crc16.h>
+
+#include <init.h>
+#include <verify.h>
+#include "drivers/ds1307.h"
+
+#include "nvram.h"
+
+// Bump when the layout of struct nvram changes
+#define NVRAM_VERSION 1
+
+verify(sizeof(struct nvram) <= DS1307_RAMEND - DS1307_RAMSTART + 1);
+
+struct nvram nvram;
+
+static uint8_t nvram_crc(void) {
+	const uint8_t *p = (const uint8_t *)&nvram;
+	uint8_t crc = 0;
+
+	for (uint8_t i = offsetof(struct nvram, crc) + 1; i < sizeof(nvram); i++) {
+		crc = _crc_ibutton_update(crc, p[i]);
+	}
+
+	return crc;
+}
+
+int nvram_commit(void) {
+	nvram.version = NVRAM_VERSION;
+	nvram.crc = nvram_crc();
+
+	if (ds1307_ram_write(&nvram, DS1307_RAMSTART, sizeof(nvram)) !=
+		sizeof(nvram))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nvram_init(void) {
+	if (ds1307_ram_read(&nvram, DS1307_RAMSTART, sizeof(nvram)) !=
+		sizeof(nvram) || nvram.version != NVRAM_VERSION ||
+		nvram.crc != nvram_crc())
+	{
+		memset(&nvram, 0, sizeof(nvram));
+	}
+
+	nvram.boots++;
+	return nvram_commit();
+}
+
+INIT_LIBRARY(nvram, nvram_init);
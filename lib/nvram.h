@@ -0,0 +1,62 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef NVRAM_H
+#define NVRAM_H
+
+#include <stdint.h>
+
+/*
+ * State kept in the DS1307's 56 bytes of battery-backed RAM.
+ *
+ * Unlike the EEPROM it doesn't wear out and a write doesn't stall for
+ * milliseconds, so it suits small values that change all the time. It is
+ * only as permanent as the RTC battery though, so anything that must
+ * survive without one (or that the bootloader needs) stays in settings.
+ *
+ * The whole block is read into nvram at boot and checked; if the battery
+ * went flat or nothing was ever written it starts out zeroed. Read the
+ * fields directly, and after changing any of them call nvram_commit() to
+ * write the whole block back in a single I2C transfer.
+ */
+
+// Room for a struct saved_lease in dhcpc.c
+#define NVRAM_LEASE_SIZE 24
+
+struct nvram {
+	uint8_t version;
+	uint8_t crc; // over everything after it
+	uint16_t boots;
+#if CONFIG_APPS_TIMESYNC
+	int16_t timesync_trim;
+	uint8_t timesync_have_trim;
+#endif
+#if CONFIG_APPS_DHCP
+	uint8_t dhcp_have_lease;
+	uint8_t dhcp_lease[NVRAM_LEASE_SIZE];
+#endif
+} __attribute__((packed));
+
+extern struct nvram nvram;
+
+// Returns -1 if the RTC couldn't be written
+int nvram_commit(void);
+
+#endif // NVRAM_H
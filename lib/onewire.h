@@ -21,7 +21,62 @@
 #ifndef ONEWIRE_H
 #define ONEWIRE_H
 
-int ow_lock(void);
-int ow_unlock(void);
+#include <contiki.h>
+#include "drivers/ds2482.h"
+
+// Every channel of a DS2482-800 has its own lock and queue, so clients of
+// different channels don't hold each other up (see ow_async_t)
+#define OW_CHANNELS DS2482_CHANNELS
+
+// Someone queued for the 1-Wire bus lock
+typedef struct ow_waiter {
+	struct ow_waiter *next;
+	struct process *process; // gets ow_lock_event when the lock is handed over
+	void *data; // event data
+	clock_time_t since; // when it joined the queue
+	uint8_t channel;
+	uint8_t granted; // holds the lock
+} ow_waiter_t;
+
+// Lock statistics for all channels together (times in clock ticks)
+typedef struct {
+	uint16_t locks; // times the lock was taken
+	uint16_t waits; // times someone had to queue for it
+	uint32_t hold_total;
+	clock_time_t hold_max;
+	uint32_t wait_total;
+	clock_time_t wait_max;
+} ow_lock_stats_t;
+
+extern ow_lock_stats_t ow_lock_stats;
+
+// Posted to a waiter's process when it has been given the lock
+extern process_event_t ow_lock_event;
+
+// Take a channel's lock if it is free and nobody is queued for it.
+// Returns 1 if the lock was taken, 0 otherwise (or for a bad channel).
+int ow_lock(uint8_t channel);
+
+// Take a channel's lock, or queue for it. Returns 1 if the lock was taken
+// straight away; otherwise the waiter gets the lock in turn, at which point
+// granted is set and ow_lock_event is posted to process with data.
+// Returns -1 for a bad channel.
+int ow_lock_queue(ow_waiter_t *w, uint8_t channel,
+	struct process *process, void *data);
+
+// Leave the queue without the lock
+void ow_lock_cancel(ow_waiter_t *w);
+
+// Number of waiters in a channel's queue
+int ow_lock_queued(uint8_t channel);
+
+// Release a channel's lock, handing it to the first waiter (if any)
+int ow_unlock(uint8_t channel);
+
+// Table-driven 1-Wire CRCs, carrying on from crc (start with 0). A ROM or
+// scratchpad including its CRC8 byte checks to 0; CRC16s are sent inverted,
+// low byte first.
+uint8_t ow_crc8(uint8_t crc, const void *buf, uint16_t len);
+uint16_t ow_crc16(uint16_t crc, const void *buf, uint16_t len);
 
 #endif // ONEWIRE_H
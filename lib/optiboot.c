@@ -72,10 +72,15 @@
 #include "optiboot.h"
 
 #include <inttypes.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <string.h>
 #include <stubboot.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include <util/delay.h>
 
 #include "drivers/uart.h"
 
@@ -119,12 +124,37 @@
 #define STK_READ_FUSE_EXT   0x77  // 'w'
 #define STK_READ_OSCCAL_EXT 0x78  // 'x'
 
+/* PolyController extension: streaming page writes at a higher baud rate */
+#define STK_STREAM          0x7a  // 'z'
+
+/*
+ * Stream mode frame format:
+ *   page (2 bytes, little endian), data (SPM_PAGESIZE bytes),
+ *   CRC-16/XMODEM of page and data (2 bytes, big endian)
+ * A page number of STREAM_END finishes the stream and has no data or CRC.
+ *
+ * Every frame is answered with STK_OK or STK_FAILED followed by the low byte
+ * of the page number once the page has been written and read back. The
+ * host may have STREAM_WINDOW frames in flight; on STK_FAILED it waits for
+ * the line to go quiet and resends everything not yet acknowledged.
+ */
+#define STREAM_END          0xffff
+#define STREAM_WINDOW       2
+
+// Give up on stream mode if the host goes away (ms)
+#define STREAM_IDLE_TIMEOUT 1000
+// Gap inside a frame that counts as a lost byte (ms)
+#define STREAM_BYTE_TIMEOUT 20
+// Quiet time that ends a resync after an error (ms)
+#define STREAM_RESYNC_QUIET 10
+
 /* Function Prototypes */
 static inline void putch(char);
 static inline uint8_t getch(void);
 static inline void getNch(uint8_t);
 static void verifySpace(void);
 static inline uint8_t getLen(void);
+static void stream(uint8_t ubrr);
 
 uint16_t page; // address as multiple of SPM_PAGESIZE
 uint8_t buff[SPM_PAGESIZE];
@@ -223,6 +253,14 @@ void optiboot(void) {
 #endif
 			}
 		}
+		/* Switch to UBRR (with U2X) and accept pipelined pages */
+		else if(ch == STK_STREAM) {
+			uint8_t ubrr = getch();
+			verifySpace();
+			putch(STK_OK);
+			stream(ubrr);
+			continue;
+		}
 		/* Get device signature bytes  */
 		else if(ch == STK_READ_SIGN) {
 			// READ SIGN - return what Avrdude wants to hear
@@ -271,3 +309,199 @@ uint8_t getLen() {
 	return getch();
 }
 
+
+/*
+ * Stream mode. The bootloader runs from the NRWW section, so pages are
+ * written with SPM directly and the CPU (and the UART interrupt) keeps
+ * running while the RWW section is erased and programmed. That lets the
+ * next frame arrive in the second buffer while the previous one is being
+ * written, so programming runs at flash speed rather than round-trip speed.
+ */
+enum spm_state {
+	SPM_IDLE,
+	SPM_ERASE,
+	SPM_WRITE,
+};
+
+static uint8_t sbuff[SPM_PAGESIZE];
+static enum spm_state spm_state;
+static uint16_t spm_page;
+static const uint8_t *spm_buf;
+
+static void spm_start(uint16_t pg, const uint8_t *buf) {
+	uint_farptr_t address = (uint_farptr_t)pg * SPM_PAGESIZE;
+
+	spm_page = pg;
+	spm_buf = buf;
+
+	// Fill the temporary buffer first, it survives the page erase
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+		uint16_t w = buf[i] | (buf[i + 1] << 8);
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			boot_page_fill(address + i, w);
+		}
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		boot_page_erase(address);
+	}
+	spm_state = SPM_ERASE;
+}
+
+// Advance the current page write, acknowledging it when complete
+static void spm_poll(void) {
+	uint_farptr_t address = (uint_farptr_t)spm_page * SPM_PAGESIZE;
+
+	if (spm_state == SPM_IDLE || boot_spm_busy()) {
+		return;
+	}
+
+	if (spm_state == SPM_ERASE) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			boot_page_write(address);
+		}
+		spm_state = SPM_WRITE;
+		return;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		boot_rww_enable();
+	}
+	spm_state = SPM_IDLE;
+
+	// Read the page back before telling the host it is safe
+	uint8_t reply = STK_OK;
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+		if (pgm_read_byte_far(address + i) != spm_buf[i]) {
+			reply = STK_FAILED;
+			break;
+		}
+	}
+
+	putch(reply);
+	putch(spm_page);
+}
+
+static void spm_finish(void) {
+	while (spm_state != SPM_IDLE) {
+		spm_poll();
+	}
+}
+
+// Get a character, keeping flash writes moving; -1 on timeout
+static int stream_getch(uint16_t ms) {
+	uint32_t polls = (uint32_t)ms * 100;
+
+	do {
+		uint16_t ch = uart_getc();
+		if (!(ch & UART_NO_DATA)) {
+			return (uint8_t)ch;
+		}
+
+		spm_poll();
+		_delay_us(10);
+	} while (--polls);
+
+	return -1;
+}
+
+// Discard input until the host has stopped sending
+static void stream_resync(void) {
+	while (stream_getch(STREAM_RESYNC_QUIET) >= 0) {}
+}
+
+// Read the rest of a frame into buf, returns 0 if it's intact
+static int stream_frame(uint16_t pg, uint8_t *buf) {
+	uint16_t crc = 0;
+	int ch;
+
+	crc = _crc_xmodem_update(crc, pg & 0xff);
+	crc = _crc_xmodem_update(crc, pg >> 8);
+
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+		if ((ch = stream_getch(STREAM_BYTE_TIMEOUT)) < 0) {
+			return -1;
+		}
+		buf[i] = ch;
+		crc = _crc_xmodem_update(crc, ch);
+	}
+
+	for (uint8_t i = 0; i < 2; i++) {
+		if ((ch = stream_getch(STREAM_BYTE_TIMEOUT)) < 0) {
+			return -1;
+		}
+		crc = _crc_xmodem_update(crc, ch);
+	}
+
+	// Running the CRC over its own value leaves zero
+	if (crc) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void stream(uint8_t ubrr) {
+	uint8_t *rx = buff;
+
+	// Let the reply drain, then switch to the new rate
+	uart_txwait();
+	_delay_ms(2);
+	uart_init(ubrr | 0x8000);
+
+	eeprom_busy_wait();
+
+	for (;;) {
+		int ch;
+		uint16_t pg;
+
+		// Wait for the next frame header
+		if ((ch = stream_getch(STREAM_IDLE_TIMEOUT)) < 0) {
+			break;
+		}
+		pg = ch;
+		if ((ch = stream_getch(STREAM_BYTE_TIMEOUT)) < 0) {
+			goto fail;
+		}
+		pg |= ch << 8;
+
+		if (pg == STREAM_END) {
+			spm_finish();
+			putch(STK_OK);
+			putch(STREAM_END & 0xff);
+			break;
+		}
+
+		if (stream_frame(pg, rx) < 0 ||
+			pg >= (CONFIG_BOOTLDR_START_ADDR / SPM_PAGESIZE))
+		{
+			goto fail;
+		}
+
+		// Wait for the previous page, then start this one
+		spm_finish();
+		spm_start(pg, rx);
+		rx = (rx == buff) ? sbuff : buff;
+		continue;
+
+fail:
+		spm_finish();
+		putch(STK_FAILED);
+		putch(pg);
+		stream_resync();
+	}
+
+	// Back to the normal rate for the STK500 protocol
+	spm_finish();
+	uart_txwait();
+	_delay_ms(2);
+	{
+#undef BAUD
+#define BAUD CONFIG_UART0_BAUD
+#include <util/setbaud.h>
+		uart_init(
+			(UBRRH_VALUE << 8) |
+			(UBRRL_VALUE << 0) |
+			(USE_2X ? 0x8000 : 0));
+	}
+}
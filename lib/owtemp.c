@@ -0,0 +1,481 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * DS18x20 temperature poller. Rather than converting and reading sensors one
+ * at a time, every sensor on a channel is told to convert at once with SKIP
+ * ROM, the channel is held on the strong pullup for a single conversion time,
+ * and the scratchpads are then read back to back. Externally powered sensors
+ * don't need the strong pullup, so every channel converts at the same time.
+ */
+
+#include <string.h>
+#include <contiki.h>
+#include <init.h>
+#include <onewire.h>
+#include "owtemp.h"
+#include "drivers/ds2482.h"
+#include "apps/owscan.h"
+#if CONFIG_LIB_PREFS
+#include <prefs.h>
+#endif
+
+#if !CONFIG_APPS_OWSCAN
+#error "owtemp takes its sensor list from owscan (APPS_OWSCAN)"
+#endif
+
+#define FAMILY_DS18S20 0x10
+#define FAMILY_DS1822 0x22
+#define FAMILY_DS18B20 0x28
+
+#define OW_SKIP_ROM 0xCC
+#define OW_MATCH_ROM 0x55
+#define DS18X20_CONVERT 0x44
+#define DS18X20_READ 0xBE
+#define DS18X20_WRITE 0x4E
+
+// DS18B20/DS1822 configuration register for 12-bit conversions
+#define DS18X20_CONFIG_12BIT 0x7F
+
+// Run a 1-Wire operation within protothread parent, polling the process to
+// get back to it whenever the DS2482 is busy
+#define OW_WAIT(parent, thread) \
+	do { \
+		PT_INIT(&op.pt); \
+		while (PT_SCHEDULE(thread)) { \
+			process_poll(&owtemp_process); \
+			PT_YIELD(parent); \
+		} \
+	} while (0)
+
+// Wait for the conversion to finish
+#define CONV_WAIT() \
+	do { \
+		etimer_set(&tmr, \
+			((uint32_t)OWTEMP_CONV_TIME * CLOCK_SECOND + 999) / 1000); \
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&tmr)); \
+	} while (0)
+
+PROCESS(owtemp_process, "owtemp");
+INIT_PROCESS(owtemp_process);
+
+owtemp_reading_t owtemp_readings[OWTEMP_SENSORS];
+process_event_t owtemp_event;
+struct notify owtemp_notify;
+
+static ow_waiter_t waiters[OW_CHANNELS];
+static ow_async_t op;
+static struct pt child;
+static struct etimer tmr;
+#if OWTEMP_ALARM_POLL
+static ow_search_t search;
+static uint8_t cycles; // conversions since every sensor was read back
+#endif
+
+// MATCH ROM, address, read scratchpad, 9 bytes of scratchpad
+static uint8_t buf[1 + sizeof(ow_addr_t) + 1 + 9];
+#define SCRATCHPAD (&buf[1 + sizeof(ow_addr_t) + 1])
+
+static int is_sensor(const ow_addr_t *addr) {
+	return addr->family == FAMILY_DS18S20 ||
+		addr->family == FAMILY_DS1822 ||
+		addr->family == FAMILY_DS18B20;
+}
+
+// Bring the readings table in line with the devices owscan knows about.
+// Returns a bit mask of the channels with sensors on them.
+static uint8_t update_sensors(void) {
+	uint8_t channels = 0;
+
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		owtemp_readings[i].mark = 0;
+	}
+
+	for (uint8_t i = 0; i < OWSCAN_DEVICES; i++) {
+		const owscan_dev_t *dev = &owscan_devs[i];
+		owtemp_reading_t *free = NULL;
+		uint8_t j;
+
+		if (!dev->used || !is_sensor(&dev->addr)) {
+			continue;
+		}
+
+		for (j = 0; j < OWTEMP_SENSORS; j++) {
+			owtemp_reading_t *r = &owtemp_readings[j];
+
+			if (!r->used) {
+				if (!free) {
+					free = r;
+				}
+			}
+			else if (r->channel == dev->channel &&
+				!memcmp(&r->addr, &dev->addr, sizeof(r->addr)))
+			{
+				r->mark = 1;
+				channels |= 1 << r->channel;
+				break;
+			}
+		}
+
+		if (j == OWTEMP_SENSORS && free) {
+			memcpy(&free->addr, &dev->addr, sizeof(free->addr));
+			free->channel = dev->channel;
+			free->used = 1;
+			free->valid = 0;
+			free->alarm = 0;
+			free->mark = 1;
+			free->programmed = 1;
+			free->adopt = 1;
+			channels |= 1 << free->channel;
+		}
+	}
+
+	// Drop the sensors that have gone away
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		if (!owtemp_readings[i].mark) {
+			owtemp_readings[i].used = 0;
+		}
+	}
+
+	return channels;
+}
+
+static owtemp_reading_t *lookup(uint8_t channel, const ow_addr_t *addr) {
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		owtemp_reading_t *r = &owtemp_readings[i];
+
+		if (r->used && r->channel == channel &&
+			!memcmp(&r->addr, addr, sizeof(r->addr)))
+		{
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+int owtemp_set_alarm(const ow_addr_t *addr, uint8_t channel,
+	int8_t tl, int8_t th)
+{
+	owtemp_reading_t *r = lookup(channel, addr);
+
+	if (!r) {
+		return -1;
+	}
+
+	r->tl = tl;
+	r->th = th;
+	r->programmed = 0;
+	r->adopt = 0;
+
+	return 0;
+}
+
+// Mark the readings on a channel as failed
+static void invalidate(uint8_t channel) {
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		if (owtemp_readings[i].channel == channel) {
+			owtemp_readings[i].valid = 0;
+		}
+	}
+}
+
+// Check a scratchpad and pull the temperature out of it
+static int decode(owtemp_reading_t *r) {
+	uint8_t crc = ow_crc8(0, SCRATCHPAD, 9);
+	uint8_t any = 0;
+
+	for (uint8_t i = 0; i < 9; i++) {
+		any |= SCRATCHPAD[i];
+	}
+
+	// A bus stuck low reads all zeros, which passes the CRC
+	if (crc || !any) {
+		return -1;
+	}
+
+	r->temp = SCRATCHPAD[0] | (SCRATCHPAD[1] << 8);
+	if (r->addr.family == FAMILY_DS18S20) {
+		// 0.5 degree units
+		r->temp <<= 3;
+	}
+
+	// Start off with the thresholds the sensor has, then put back the ones
+	// set here if it loses them (e.g. after a power cut)
+	if (r->adopt) {
+		r->th = SCRATCHPAD[2];
+		r->tl = SCRATCHPAD[3];
+		r->adopt = 0;
+	}
+	else if ((int8_t)SCRATCHPAD[2] != r->th ||
+		(int8_t)SCRATCHPAD[3] != r->tl)
+	{
+		r->programmed = 0;
+	}
+
+	// The sensor compares whole degrees against its thresholds
+	r->alarm = (r->temp >> 4) <= r->tl || (r->temp >> 4) >= r->th;
+
+	return 0;
+}
+
+// Start every sensor on op.channel converting. op.ret is negative on failure.
+static PT_THREAD(convert(struct pt *pt)) {
+	PT_BEGIN(pt);
+
+	OW_WAIT(pt, ow_reset_async(&op));
+	if (op.ret != 1) {
+		op.ret = -1;
+		PT_EXIT(pt);
+	}
+
+	buf[0] = OW_SKIP_ROM;
+	OW_WAIT(pt, ow_block_async(&op, buf, 1));
+	if (op.ret < 0) {
+		PT_EXIT(pt);
+	}
+
+#if OWTEMP_POWERED
+	OW_WAIT(pt, ow_touch_byte_async(&op, DS18X20_CONVERT));
+#else
+	// Parasite powered sensors run off the strong pullup meanwhile
+	OW_WAIT(pt, ow_write_byte_power_async(&op, DS18X20_CONVERT));
+#endif
+
+	PT_END(pt);
+}
+
+// Decide which sensors on op.channel to read back: all of them, or when
+// alarm polling just those an alarm search finds and those whose
+// thresholds need reading or writing
+static PT_THREAD(choose(struct pt *pt)) {
+	PT_BEGIN(pt);
+
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		owtemp_reading_t *r = &owtemp_readings[i];
+
+		if (r->channel == op.channel) {
+#if OWTEMP_ALARM_POLL
+			r->want = !cycles || !r->programmed || r->adopt;
+			r->alarm = 0;
+#else
+			r->want = 1;
+#endif
+		}
+	}
+
+#if OWTEMP_ALARM_POLL
+	if (!cycles) {
+		PT_EXIT(pt);
+	}
+
+	ow_search_init(&search, 1);
+
+	do {
+		OW_WAIT(pt, ow_search_async(&op, &search));
+		if (op.ret <= 0) {
+			break;
+		}
+
+		owtemp_reading_t *r = lookup(op.channel, &search.rom_no);
+		if (r) {
+			r->want = 1;
+			r->alarm = 1;
+		}
+	} while (!search.last_device_flag);
+
+	if (op.ret < 0) {
+		// Fall back to reading them all
+		for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+			if (owtemp_readings[i].channel == op.channel) {
+				owtemp_readings[i].want = 1;
+			}
+		}
+	}
+#endif
+
+	PT_END(pt);
+}
+
+// Write a sensor's alarm thresholds into its scratchpad (but not its EEPROM,
+// they are written again if it loses them)
+static PT_THREAD(program(struct pt *pt, uint8_t i)) {
+	owtemp_reading_t *r = &owtemp_readings[i];
+
+	PT_BEGIN(pt);
+
+	OW_WAIT(pt, ow_reset_async(&op));
+	if (op.ret <= 0) {
+		PT_EXIT(pt);
+	}
+
+	r = &owtemp_readings[i];
+	buf[0] = OW_MATCH_ROM;
+	memcpy(&buf[1], &r->addr, sizeof(r->addr));
+	buf[1 + sizeof(r->addr)] = DS18X20_WRITE;
+	SCRATCHPAD[0] = r->th;
+	SCRATCHPAD[1] = r->tl;
+	SCRATCHPAD[2] = DS18X20_CONFIG_12BIT;
+
+	// The DS18S20 has no configuration register
+	OW_WAIT(pt, ow_block_async(&op, buf, 1 + sizeof(r->addr) + 1 +
+		(r->addr.family == FAMILY_DS18S20 ? 2 : 3)));
+	if (op.ret == 0) {
+		owtemp_readings[i].programmed = 1;
+	}
+
+	PT_END(pt);
+}
+
+// Read back the chosen sensors on op.channel
+static PT_THREAD(read_back(struct pt *pt)) {
+	static struct pt sub;
+	static uint8_t i;
+
+	PT_BEGIN(pt);
+
+	PT_SPAWN(pt, &sub, choose(&sub));
+
+	for (i = 0; i < OWTEMP_SENSORS; i++) {
+		owtemp_reading_t *r = &owtemp_readings[i];
+
+		if (!r->used || r->channel != op.channel || !r->want) {
+			continue;
+		}
+
+		if (!r->programmed) {
+			PT_SPAWN(pt, &sub, program(&sub, i));
+		}
+
+		OW_WAIT(pt, ow_reset_async(&op));
+		if (op.ret < 0) {
+			invalidate(op.channel);
+			PT_EXIT(pt);
+		}
+
+		// Locals don't survive a yield
+		r = &owtemp_readings[i];
+
+		buf[0] = OW_MATCH_ROM;
+		memcpy(&buf[1], &r->addr, sizeof(r->addr));
+		buf[1 + sizeof(r->addr)] = DS18X20_READ;
+		memset(SCRATCHPAD, 0xff, 9);
+
+		OW_WAIT(pt, ow_block_async(&op, buf, sizeof(buf)));
+		if (op.ret < 0) {
+			invalidate(op.channel);
+			PT_EXIT(pt);
+		}
+
+		r = &owtemp_readings[i];
+		if (op.ret == 0 && !decode(r)) {
+			r->valid = 1;
+			r->time = clock_seconds();
+		}
+		else {
+			r->valid = 0;
+		}
+	}
+
+	PT_END(pt);
+}
+
+PROCESS_THREAD(owtemp_process, ev, data) {
+	static uint8_t channels;
+
+	PROCESS_BEGIN();
+
+	owtemp_event = process_alloc_event();
+
+	while (1) {
+#if CONFIG_LIB_PREFS
+		etimer_set(&tmr, prefs.owtemp_interval * CLOCK_SECOND);
+#else
+		etimer_set(&tmr, OWTEMP_INTERVAL * CLOCK_SECOND);
+#endif
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&tmr));
+
+		channels = update_sensors();
+		if (!channels) {
+			continue;
+		}
+
+		for (op.channel = 0; op.channel < OW_CHANNELS; op.channel++) {
+			if (!(channels & (1 << op.channel))) {
+				continue;
+			}
+
+			// Wait our turn for the channel
+			if (!ow_lock_queue(&waiters[op.channel], op.channel,
+				&owtemp_process, NULL))
+			{
+				PROCESS_WAIT_EVENT_UNTIL(waiters[op.channel].granted);
+			}
+
+			PROCESS_PT_SPAWN(&child, convert(&child));
+			if (op.ret < 0) {
+				invalidate(op.channel);
+#if !OWTEMP_POWERED
+				ow_level_std();
+#endif
+				ow_unlock(op.channel);
+				channels &= ~(1 << op.channel);
+				continue;
+			}
+
+#if !OWTEMP_POWERED
+			// The strong pullup ties the DS2482 to this channel, so it has
+			// to be read before moving on to the next one
+			CONV_WAIT();
+
+			if (ow_level_std()) {
+				invalidate(op.channel);
+			}
+			else {
+				PROCESS_PT_SPAWN(&child, read_back(&child));
+			}
+
+			ow_unlock(op.channel);
+#endif
+		}
+
+#if OWTEMP_POWERED
+		// Every channel has been converting at the same time
+		CONV_WAIT();
+
+		for (op.channel = 0; op.channel < OW_CHANNELS; op.channel++) {
+			if (channels & (1 << op.channel)) {
+				PROCESS_PT_SPAWN(&child, read_back(&child));
+				ow_unlock(op.channel);
+			}
+		}
+#endif
+
+#if OWTEMP_ALARM_POLL
+		if (++cycles >= OWTEMP_REFRESH) {
+			cycles = 0;
+		}
+#endif
+
+		notify_post(&owtemp_notify, owtemp_event, NULL);
+	}
+
+	PROCESS_END();
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef OWTEMP_H
+#define OWTEMP_H
+
+#include <contiki.h>
+#include <notify.h>
+#include <onewire.h>
+
+// Maximum number of temperature sensors
+#ifndef CONFIG_LIB_OWTEMP_SENSORS
+#define OWTEMP_SENSORS 32
+#else
+#define OWTEMP_SENSORS CONFIG_LIB_OWTEMP_SENSORS
+#endif
+
+// Seconds between conversions
+#ifndef CONFIG_LIB_OWTEMP_INTERVAL
+#define OWTEMP_INTERVAL 10
+#else
+#define OWTEMP_INTERVAL CONFIG_LIB_OWTEMP_INTERVAL
+#endif
+
+// Conversion time in ms (750 for 12-bit resolution)
+#ifndef CONFIG_LIB_OWTEMP_CONV_TIME
+#define OWTEMP_CONV_TIME 750
+#else
+#define OWTEMP_CONV_TIME CONFIG_LIB_OWTEMP_CONV_TIME
+#endif
+
+// Set if the sensors have their own power supply, so they don't need holding
+// on the strong pullup while converting
+#ifndef CONFIG_LIB_OWTEMP_POWERED
+#define OWTEMP_POWERED 0
+#else
+#define OWTEMP_POWERED CONFIG_LIB_OWTEMP_POWERED
+#endif
+
+// Set to only read back the sensors an alarm search finds after each
+// conversion (along with any whose thresholds haven't been set yet), so that
+// bus time goes with the number of sensors in alarm rather than all of them
+#ifndef CONFIG_LIB_OWTEMP_ALARM_POLL
+#define OWTEMP_ALARM_POLL 0
+#else
+#define OWTEMP_ALARM_POLL CONFIG_LIB_OWTEMP_ALARM_POLL
+#endif
+
+// When alarm polling, every sensor is still read back once in this many
+// conversions
+#ifndef CONFIG_LIB_OWTEMP_REFRESH
+#define OWTEMP_REFRESH 30
+#else
+#define OWTEMP_REFRESH CONFIG_LIB_OWTEMP_REFRESH
+#endif
+
+typedef struct {
+	ow_addr_t addr;
+	uint8_t channel; // DS2482-800 channel
+	int16_t temp; // 1/16 degrees C
+	uint32_t time; // clock_seconds() of the last good reading
+	int8_t tl; // alarm thresholds in degrees C, as found on the sensor
+	int8_t th; // until owtemp_set_alarm() changes them
+	uint8_t used : 1;
+	uint8_t valid : 1; // the last read worked
+	uint8_t alarm : 1; // at or past a threshold at the last conversion
+	uint8_t mark : 1; // private
+	uint8_t want : 1; // private: to be read back this time
+	uint8_t programmed : 1; // private: thresholds are in the scratchpad
+	uint8_t adopt : 1; // private: thresholds not read from the sensor yet
+} owtemp_reading_t;
+
+// Readings for the DS18x20 sensors in the owscan inventory
+extern owtemp_reading_t owtemp_readings[OWTEMP_SENSORS];
+
+// Posted to owtemp_notify's subscribers after each round of readings
+extern process_event_t owtemp_event;
+extern struct notify owtemp_notify;
+
+// Set the alarm thresholds of a sensor in the table, which are written to
+// it at the next conversion. A sensor alarms at or below tl and at or above
+// th. Returns -1 if there is no such sensor.
+int owtemp_set_alarm(const ow_addr_t *addr, uint8_t channel,
+	int8_t tl, int8_t th);
+
+#endif // OWTEMP_H
@@ -0,0 +1,483 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Runs up to PIDLOOP_LOOPS PID loops from one process. The process ticks at
+ * PIDLOOP_HZ off a timer that is reset from its last expiry rather than
+ * set afresh, so the ticks don't drift however late the process gets to
+ * them. Each loop runs every period ticks, taking its input from the owtemp
+ * readings rather than the bus, and a port_ext output is switched on for
+ * the part of the following period its output asks for. Every port_ext
+ * output is changed before a single commit, so a tick shifts the chain out
+ * at most once.
+ *
+ * Autotuning follows Astrom and Hagglund: a relay in place of the PID
+ * makes the process oscillate, and the amplitude a and period Tu of that
+ * oscillation give the ultimate gain Ku = 4d / (pi * sqrt(a^2 - hyst^2)),
+ * where d is half the output span. The tuning rules give Kp, Ti and Td from
+ * Ku and Tu, which are turned into pid_run() factors for the loop's period.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <contiki.h>
+#include <init.h>
+#include <board.h>
+#include "pidloop.h"
+#include "owtemp.h"
+#if CONFIG_DRIVERS_PORT_EXT
+#include "drivers/port_ext.h"
+#endif
+#if CONFIG_LIB_SETTINGS
+#include "settings.h"
+#endif
+
+#if !CONFIG_LIB_OWTEMP
+#error "pidloop takes its inputs from owtemp (LIB_OWTEMP)"
+#endif
+
+#define TICK (CLOCK_SECOND / PIDLOOP_HZ)
+
+PROCESS(pidloop_process, "pidloop");
+INIT_PROCESS(pidloop_process);
+
+pidloop_cfg_t pidloop_cfg[PIDLOOP_LOOPS];
+pidloop_stats_t pidloop_stats[PIDLOOP_LOOPS];
+
+// What changes on every tick, kept together
+typedef struct {
+	pid_data_t pid;
+	int16_t out;
+	uint8_t phase; // ticks into the output window
+	uint8_t on; // ticks of the window the output is on for
+	uint8_t sensor; // owtemp_readings slot the input was last found in
+	uint8_t primed : 1; // pid holds a real last process value
+} state_t;
+
+static state_t state[PIDLOOP_LOOPS];
+static struct etimer tmr;
+static uint32_t ticks;
+
+// The autotune in progress, if any
+static struct {
+	uint8_t loop; // PIDLOOP_LOOPS when idle
+	uint8_t rule;
+	uint8_t relay : 1; // output on
+	uint8_t switches; // times the relay has switched on
+	int16_t hyst;
+	int16_t hi, lo; // extremes of the oscillation in progress
+	uint32_t on_tick; // when the relay last switched on
+	uint32_t switch_tick; // when the relay last switched either way
+	uint32_t period_sum; // of the oscillations measured, in ticks
+	int32_t amp_sum; // of their peak to peak amplitudes
+} tune = { .loop = PIDLOOP_LOOPS };
+
+#if CONFIG_LIB_SETTINGS
+typedef struct {
+	int16_t p, i, d;
+} gains_t;
+#endif
+
+// Drive an output fully off
+static void off(uint8_t n) {
+	const pidloop_cfg_t *c = &pidloop_cfg[n];
+
+	if (c->out == PIDLOOP_OUT_FUNC) {
+		c->set(n, 0);
+	}
+#if CONFIG_DRIVERS_PORT_EXT
+	else if (c->out == PIDLOOP_OUT_PORT_EXT) {
+		port_ext_bit_clear(c->port, c->bit);
+		port_ext_commit();
+	}
+#endif
+}
+
+int pidloop_set(uint8_t n, const pidloop_cfg_t *cfg) {
+	state_t *s;
+
+	if (n >= PIDLOOP_LOOPS) {
+		return -1;
+	}
+
+	if (cfg) {
+		if (!cfg->period) {
+			return -1;
+		}
+		else if (cfg->out == PIDLOOP_OUT_FUNC) {
+			if (!cfg->set) {
+				return -1;
+			}
+		}
+#if CONFIG_DRIVERS_PORT_EXT
+		else if (cfg->out == PIDLOOP_OUT_PORT_EXT) {
+			if (cfg->bit >= 8) {
+				return -1;
+			}
+		}
+#endif
+		else {
+			return -1;
+		}
+	}
+
+	if (tune.loop == n) {
+		tune.loop = PIDLOOP_LOOPS;
+	}
+
+	if (pidloop_cfg[n].period) {
+		off(n);
+	}
+
+	if (cfg) {
+		memcpy(&pidloop_cfg[n], cfg, sizeof(*cfg));
+	}
+	else {
+		memset(&pidloop_cfg[n], 0, sizeof(pidloop_cfg[n]));
+	}
+
+	s = &state[n];
+	memset(s, 0, sizeof(*s));
+	memset(&pidloop_stats[n], 0, sizeof(pidloop_stats[n]));
+	if (cfg) {
+		pid_init(cfg->p, cfg->i, cfg->d, &s->pid);
+		off(n);
+	}
+
+	return 0;
+}
+
+int pidloop_setpoint(uint8_t n, int16_t setpoint) {
+	if (n >= PIDLOOP_LOOPS || !pidloop_cfg[n].period) {
+		return -1;
+	}
+
+	pidloop_cfg[n].setpoint = setpoint;
+	return 0;
+}
+
+int16_t pidloop_output(uint8_t n) {
+	return state[n].out;
+}
+
+int pidloop_autotune(uint8_t n, uint8_t rule, int16_t hyst) {
+	if (n >= PIDLOOP_LOOPS || !pidloop_cfg[n].period ||
+		rule > PIDLOOP_RULE_TL || hyst < 0 || tune.loop != PIDLOOP_LOOPS)
+	{
+		return -1;
+	}
+
+	memset(&tune, 0, sizeof(tune));
+	tune.loop = n;
+	tune.rule = rule;
+	tune.hyst = hyst;
+	tune.switch_tick = ticks;
+	pidloop_stats[n].tune = PIDLOOP_TUNE_RUNNING;
+
+	return 0;
+}
+
+void pidloop_autotune_cancel(void) {
+	if (tune.loop != PIDLOOP_LOOPS) {
+		state[tune.loop].primed = 0;
+		pidloop_stats[tune.loop].tune = PIDLOOP_TUNE_NONE;
+		tune.loop = PIDLOOP_LOOPS;
+	}
+}
+
+#if CONFIG_LIB_SETTINGS
+int pidloop_load_gains(uint8_t n, pidloop_cfg_t *cfg) {
+	gains_t g;
+	size_t size = sizeof(g);
+
+	if (settings_get(SETTINGS_KEY_PIDLOOP_GAINS + n, 0, &g, &size) !=
+		SETTINGS_STATUS_OK || size != sizeof(g))
+	{
+		return -1;
+	}
+
+	cfg->p = g.p;
+	cfg->i = g.i;
+	cfg->d = g.d;
+	return 0;
+}
+#endif
+
+// A pid_run() factor from a gain, kept in the range pid_init() copes with.
+// That caps Kp at 256 output steps per 1/16 degree, which a tight relay
+// oscillation can ask for more than; the loop is then just less aggressive
+// than the rule would have it.
+static int16_t factor(float k) {
+	k = k * SCALING_FACTOR + 0.5;
+
+	if (k >= INT16_MAX - 1) {
+		return INT16_MAX - 1;
+	}
+	else if (k < 0) {
+		return 0;
+	}
+	return (int16_t)k;
+}
+
+// Work the gains out from the oscillations measured and switch to them
+static int tune_finish(uint8_t n) {
+	pidloop_cfg_t *c = &pidloop_cfg[n];
+	state_t *s = &state[n];
+	float a, tu, ku, kp, ti, td;
+
+	// The amplitude is half the peak to peak, and has to be clear of the
+	// hysteresis band for Ku to mean anything
+	a = (float)tune.amp_sum / (2 * PIDLOOP_TUNE_CYCLES);
+	if (a <= tune.hyst) {
+		return -1;
+	}
+
+	ku = 4 * (PIDLOOP_OUT_MAX / 2.0) /
+		(M_PI * sqrt(a * a - (float)tune.hyst * tune.hyst));
+	tu = (float)tune.period_sum / PIDLOOP_TUNE_CYCLES;
+
+	if (tune.rule == PIDLOOP_RULE_TL) {
+		kp = ku / 2.2;
+		ti = tu * 2.2;
+		td = tu / 6.3;
+	}
+	else {
+		kp = ku * 0.6;
+		ti = tu / 2;
+		td = tu / 8;
+	}
+
+	// pid_run() sums the error once a period and differences the process
+	// value over one, so Ti and Td are scaled by it (both are in ticks)
+	c->p = factor(kp);
+	c->i = factor(kp * c->period / ti);
+	c->d = factor(kp * td / c->period);
+
+	pid_init(c->p, c->i, c->d, &s->pid);
+	s->primed = 0;
+
+#if CONFIG_LIB_SETTINGS
+	{
+		gains_t g = { c->p, c->i, c->d };
+
+		settings_set(SETTINGS_KEY_PIDLOOP_GAINS + n, &g, sizeof(g));
+	}
+#endif
+
+	return 0;
+}
+
+// One run of the relay in place of the PID
+static void tune_step(uint8_t n, int16_t pv) {
+	const pidloop_cfg_t *c = &pidloop_cfg[n];
+	state_t *s = &state[n];
+	uint8_t done = 0;
+
+	if (pv > tune.hi || !tune.switches) {
+		tune.hi = pv;
+	}
+	if (pv < tune.lo || !tune.switches) {
+		tune.lo = pv;
+	}
+
+	if (!tune.relay && pv < c->setpoint - tune.hyst) {
+		tune.relay = 1;
+		tune.switch_tick = ticks;
+
+		// The oscillation up to the first switch was only getting
+		// started, and the first whole one may still be settling
+		if (tune.switches >= 2) {
+			tune.period_sum += ticks - tune.on_tick;
+			tune.amp_sum += tune.hi - tune.lo;
+			done = (tune.switches == PIDLOOP_TUNE_CYCLES + 1);
+		}
+
+		tune.switches++;
+		tune.on_tick = ticks;
+		tune.hi = tune.lo = pv;
+	}
+	else if (tune.relay && pv > c->setpoint + tune.hyst) {
+		tune.relay = 0;
+		tune.switch_tick = ticks;
+	}
+	else if (ticks - tune.switch_tick >=
+		(uint32_t)PIDLOOP_TUNE_TIMEOUT * PIDLOOP_HZ)
+	{
+		tune.loop = PIDLOOP_LOOPS;
+		tune.relay = 0;
+		pidloop_stats[n].tune = PIDLOOP_TUNE_FAILED;
+	}
+
+	if (done) {
+		tune.loop = PIDLOOP_LOOPS;
+		tune.relay = 0;
+		pidloop_stats[n].tune = tune_finish(n) ?
+			PIDLOOP_TUNE_FAILED : PIDLOOP_TUNE_DONE;
+	}
+
+	s->out = tune.relay ? PIDLOOP_OUT_MAX : 0;
+}
+
+// The reading for a loop's sensor, if there's one recent enough to use
+static const owtemp_reading_t *input(const pidloop_cfg_t *c, state_t *s) {
+	const owtemp_reading_t *r = &owtemp_readings[s->sensor];
+
+	// Try where it was last time before searching the table
+	if (!r->used || r->channel != c->channel ||
+		memcmp(&r->addr, &c->addr, sizeof(r->addr)))
+	{
+		uint8_t i;
+
+		for (i = 0; i < OWTEMP_SENSORS; i++) {
+			r = &owtemp_readings[i];
+
+			if (r->used && r->channel == c->channel &&
+				!memcmp(&r->addr, &c->addr, sizeof(r->addr)))
+			{
+				break;
+			}
+		}
+
+		if (i == OWTEMP_SENSORS) {
+			return NULL;
+		}
+		s->sensor = i;
+	}
+
+	if (!r->valid || clock_seconds() - r->time >= PIDLOOP_STALE) {
+		return NULL;
+	}
+
+	return r;
+}
+
+static void run(uint8_t n, clock_time_t late) {
+	const pidloop_cfg_t *c = &pidloop_cfg[n];
+	pidloop_stats_t *st = &pidloop_stats[n];
+	state_t *s = &state[n];
+	const owtemp_reading_t *r;
+	uint32_t start = clock_us();
+	uint16_t us;
+
+	r = input(c, s);
+	if (!r) {
+		// Nothing to control with: fail safe, and start the integral and
+		// derivative afresh once the sensor is back. A tune can't carry on
+		// across the gap either.
+		s->out = 0;
+		s->primed = 0;
+		pid_reset(&s->pid);
+		st->stale++;
+
+		if (tune.loop == n) {
+			tune.loop = PIDLOOP_LOOPS;
+			st->tune = PIDLOOP_TUNE_FAILED;
+		}
+	}
+	else if (tune.loop == n) {
+		tune_step(n, r->temp);
+	}
+	else {
+		int16_t out;
+
+		// Without this the first run would see a step from 0 to the process
+		// value and kick the derivative term
+		if (!s->primed) {
+			s->pid.lastProcessValue = r->temp;
+			s->primed = 1;
+		}
+
+		out = pid_run(c->setpoint, r->temp, &s->pid);
+		s->out = (out < 0) ? 0 : out;
+	}
+
+	// Round to the nearest tick of the window
+	s->on = ((uint32_t)s->out * c->period + PIDLOOP_OUT_MAX / 2) /
+		PIDLOOP_OUT_MAX;
+
+	if (c->out == PIDLOOP_OUT_FUNC) {
+		c->set(n, s->out);
+	}
+
+	us = clock_us() - start;
+	st->runs++;
+	st->us_last = us;
+	if (us > st->us_max) {
+		st->us_max = us;
+	}
+	if (late > st->late_max) {
+		st->late_max = late;
+	}
+}
+
+static void tick(clock_time_t late) {
+	for (uint8_t n = 0; n < PIDLOOP_LOOPS; n++) {
+		const pidloop_cfg_t *c = &pidloop_cfg[n];
+		state_t *s = &state[n];
+
+		if (!c->period) {
+			continue;
+		}
+
+		if (s->phase == 0) {
+			run(n, late);
+		}
+
+#if CONFIG_DRIVERS_PORT_EXT
+		if (c->out == PIDLOOP_OUT_PORT_EXT) {
+			if (s->phase < s->on) {
+				port_ext_bit_set(c->port, c->bit);
+			}
+			else {
+				port_ext_bit_clear(c->port, c->bit);
+			}
+		}
+#endif
+
+		if (++s->phase >= c->period) {
+			s->phase = 0;
+		}
+	}
+
+#if CONFIG_DRIVERS_PORT_EXT
+	port_ext_commit();
+#endif
+
+	ticks++;
+}
+
+PROCESS_THREAD(pidloop_process, ev, data) {
+	PROCESS_BEGIN();
+
+	etimer_set(&tmr, TICK);
+
+	while (1) {
+		clock_time_t late;
+
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&tmr));
+
+		late = clock_time() - (tmr.timer.start + tmr.timer.interval);
+		etimer_reset(&tmr);
+
+		tick(late);
+	}
+
+	PROCESS_END();
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef PIDLOOP_H
+#define PIDLOOP_H
+
+#include <contiki.h>
+#include <onewire.h>
+#include "pid.h"
+
+// Maximum number of loops
+#ifndef CONFIG_LIB_PIDLOOP_LOOPS
+#define PIDLOOP_LOOPS 4
+#else
+#define PIDLOOP_LOOPS CONFIG_LIB_PIDLOOP_LOOPS
+#endif
+
+// Engine ticks per second; CLOCK_SECOND should be a multiple of this
+#ifndef CONFIG_LIB_PIDLOOP_HZ
+#define PIDLOOP_HZ 5
+#else
+#define PIDLOOP_HZ CONFIG_LIB_PIDLOOP_HZ
+#endif
+
+// Seconds after which a sensor reading is too old to control with
+#ifndef CONFIG_LIB_PIDLOOP_STALE
+#define PIDLOOP_STALE 30
+#else
+#define PIDLOOP_STALE CONFIG_LIB_PIDLOOP_STALE
+#endif
+
+// Relay autotune: hysteresis either side of the setpoint (1/16 degrees C)
+#ifndef CONFIG_LIB_PIDLOOP_TUNE_HYST
+#define PIDLOOP_TUNE_HYST 4
+#else
+#define PIDLOOP_TUNE_HYST CONFIG_LIB_PIDLOOP_TUNE_HYST
+#endif
+
+// Relay autotune: oscillations averaged, after the first one is thrown away
+#ifndef CONFIG_LIB_PIDLOOP_TUNE_CYCLES
+#define PIDLOOP_TUNE_CYCLES 3
+#else
+#define PIDLOOP_TUNE_CYCLES CONFIG_LIB_PIDLOOP_TUNE_CYCLES
+#endif
+
+// Relay autotune: give up if the relay hasn't switched in this many seconds
+#ifndef CONFIG_LIB_PIDLOOP_TUNE_TIMEOUT
+#define PIDLOOP_TUNE_TIMEOUT 3600
+#else
+#define PIDLOOP_TUNE_TIMEOUT CONFIG_LIB_PIDLOOP_TUNE_TIMEOUT
+#endif
+
+#define PIDLOOP_OUT_PORT_EXT 1 // time-proportioned on a port_ext bit
+#define PIDLOOP_OUT_FUNC 2 // passed to a function, e.g. to set a PWM duty
+
+#define PIDLOOP_RULE_ZN 0 // Ziegler-Nichols
+#define PIDLOOP_RULE_TL 1 // Tyreus-Luyben: slower, much less overshoot
+
+#define PIDLOOP_TUNE_NONE 0
+#define PIDLOOP_TUNE_RUNNING 1
+#define PIDLOOP_TUNE_DONE 2 // the loop is running with the new gains
+#define PIDLOOP_TUNE_FAILED 3
+
+// Largest output; pid_run() results below 0 are taken as 0
+#define PIDLOOP_OUT_MAX INT16_MAX
+
+typedef struct {
+	ow_addr_t addr; // input: an owtemp sensor
+	uint8_t channel; // DS2482-800 channel
+	int16_t setpoint; // 1/16 degrees C
+	int16_t p, i, d; // tuning constants, as for pid_init()
+	uint8_t period; // engine ticks between runs, also the output window
+	uint8_t out; // PIDLOOP_OUT_*
+	uint8_t port, bit; // for PIDLOOP_OUT_PORT_EXT
+	void (*set)(uint8_t n, int16_t out); // for PIDLOOP_OUT_FUNC
+} pidloop_cfg_t;
+
+typedef struct {
+	uint32_t runs;
+	uint16_t stale; // runs with no usable reading, output off
+	uint16_t us_last; // time taken by the last run
+	uint16_t us_max;
+	clock_time_t late_max; // ticks the engine was late for a run
+	uint8_t tune; // PIDLOOP_TUNE_*
+} pidloop_stats_t;
+
+extern pidloop_cfg_t pidloop_cfg[PIDLOOP_LOOPS];
+extern pidloop_stats_t pidloop_stats[PIDLOOP_LOOPS];
+
+// Set loop n up (or stop it with cfg NULL), starting from a clean state;
+// its output is turned off until its first run. Returns -1 if n is out of
+// range or cfg makes no sense.
+int pidloop_set(uint8_t n, const pidloop_cfg_t *cfg);
+
+// Change the setpoint of a running loop without resetting it
+int pidloop_setpoint(uint8_t n, int16_t setpoint);
+
+// Latest output of loop n, 0 to PIDLOOP_OUT_MAX
+int16_t pidloop_output(uint8_t n);
+
+// Tune a running loop by relay feedback: its output is switched fully on
+// below the setpoint and off above it, with hyst either side, and the
+// ultimate gain and period are worked out from the oscillation that
+// results. The gains from the chosen PIDLOOP_RULE_* then replace the
+// loop's own and, with LIB_SETTINGS, are saved for pidloop_load_gains().
+// Only one loop can be tuned at a time; returns -1 if one already is.
+int pidloop_autotune(uint8_t n, uint8_t rule, int16_t hyst);
+
+// Stop tuning, leaving the loop on its old gains
+void pidloop_autotune_cancel(void);
+
+#if CONFIG_LIB_SETTINGS
+// Fill in the gains in cfg from the last autotune of loop n, if there was
+// one; returns -1 if not
+int pidloop_load_gains(uint8_t n, pidloop_cfg_t *cfg);
+#endif
+
+#endif // PIDLOOP_H
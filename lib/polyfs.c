@@ -25,9 +25,15 @@
 
 #if CONFIG_LIB_LZO
 #include <minilzo/minilzo.h>
+#include "lzo_avr.h"
+#endif
+
+#if __AVR__
+#include <avr/pgmspace.h>
 #endif
 
 #include "polyfs.h"
+#include "memstat.h"
 
 #if !defined(CONFIG_LIB_POLYFS_DEBUG)
 #define PRINTF(fmt, ...)
@@ -46,12 +52,100 @@
 #error "This code assumes a little-endian architecture!"
 #endif
 
+// LZO reads always go through the cache, so we need at least one entry
+#if !CONFIG_LIB_LZO
+#define BLOCK_CACHE 0
+#elif defined(CONFIG_LIB_POLYFS_BLOCK_CACHE) && CONFIG_LIB_POLYFS_BLOCK_CACHE > 0
+#define BLOCK_CACHE CONFIG_LIB_POLYFS_BLOCK_CACHE
+#else
+#define BLOCK_CACHE 1
+#endif
+
+#if BLOCK_CACHE
+// A decompressed block of LZO file data
+struct block_cache {
+	polyfs_fs_t *fs; // fs the block came from (NULL if free)
+	uint32_t inode_offset; // offset of the inode's block pointers
+	uint16_t block; // block number within the inode
+	uint32_t start; // storage offset of the compressed data
+	uint16_t bytes; // number of valid decompressed bytes
+	uint8_t age; // LRU age, 0 is the most recently used
+	uint8_t data[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+};
+
+static struct block_cache cache[BLOCK_CACHE];
+#endif
+
+#ifdef CONFIG_LIB_POLYFS_LOOKUP_CACHE
+#define LOOKUP_CACHE CONFIG_LIB_POLYFS_LOOKUP_CACHE
+#else
+#define LOOKUP_CACHE 0
+#endif
+
+#ifdef CONFIG_LIB_POLYFS_LOOKUP_MISSES
+#define LOOKUP_MISSES CONFIG_LIB_POLYFS_LOOKUP_MISSES
+#else
+#define LOOKUP_MISSES 0
+#endif
+
+// Name bytes read along with each directory entry's inode, which covers
+// most names in one read. Both land in the name buffer first, so they have
+// to fit in it together (12 is the size of an inode).
+#ifdef CONFIG_LIB_POLYFS_READDIR_PEEK
+#define READDIR_PEEK CONFIG_LIB_POLYFS_READDIR_PEEK
+#else
+#define READDIR_PEEK 32
+#endif
+
+#if READDIR_PEEK + 12 > POLYFS_MAXPATHLEN
+#error "READDIR_PEEK is too big for the readdir name buffer"
+#endif
+
+// Blocks whose CRC has been checked are remembered in a bitmap, so each one
+// is only checked on its first read. Blocks numbered beyond the end of it
+// are checked on every read.
+#ifdef CONFIG_LIB_POLYFS_VERIFY_BLOCKS
+#define VERIFY_BLOCKS CONFIG_LIB_POLYFS_VERIFY_BLOCKS
+#else
+#define VERIFY_BLOCKS 512
+#endif
+
+#if VERIFY_BLOCKS
+static struct {
+	polyfs_fs_t *fs; // fs the bitmap is for (NULL if none)
+	uint8_t bits[(VERIFY_BLOCKS + 7) / 8];
+} verified;
+#endif
+
+#if LOOKUP_CACHE || LOOKUP_MISSES
+// The result of a previous path lookup
+struct lookup_cache {
+	polyfs_fs_t *fs; // fs the path was looked up in (NULL if free)
+	uint32_t edition; // fs edition at the time of the lookup
+	uint32_t hash; // hash of the path
+	uint8_t age; // LRU age, 0 is the most recently used
+	struct polyfs_inode inode; // the inode found (unused for misses)
+};
+#endif
+
+#if LOOKUP_CACHE
+static struct lookup_cache lookups[LOOKUP_CACHE];
+#endif
+#if LOOKUP_MISSES
+static struct lookup_cache misses[LOOKUP_MISSES];
+#endif
+
+polyfs_stats_t polyfs_stats;
+
 // MIN for 32-bit uints
 static inline uint32_t min(uint32_t a, uint32_t b);
 
 // Read a raw buffer from underlying storage
 static inline int read_storage(polyfs_fs_t *fs, void *ptr,
 	uint32_t offset, uint16_t bytes);
+// Read a uint16_t from underlying storage and adjust byte order
+static inline int read_storage_uint16(polyfs_fs_t *fs,
+	uint16_t *ptr, uint32_t offset);
 // Read a uint32_t from underlying storage and adjust byte order
 static inline int read_storage_uint32(polyfs_fs_t *fs,
 	uint32_t *ptr, uint32_t offset);
@@ -59,8 +153,75 @@ static inline int read_storage_uint32(polyfs_fs_t *fs,
 // Read the filesystem superblock
 static int read_super(polyfs_fs_t *fs);
 
-// Calculate a CRC-32 checksum
-static uint32_t crc32(uint32_t crc, uint8_t *buffer, uint32_t length);
+// Bytes of data stored after an inode's name (0 if its data is elsewhere)
+static inline uint8_t inline_size(polyfs_fs_t *fs,
+	const struct polyfs_inode *inode);
+
+// Read file data from a single block
+static int32_t read_block(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	polyfs_blkptr_t *bp, void *ptr, uint32_t offset, uint16_t bytes);
+// Find the start and end offsets of a block's data
+static int block_extent(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	polyfs_blkptr_t *bp, uint16_t block, uint32_t *start, uint32_t *end);
+// Follow a shared block's pointers to the data it shares
+static int shared_extent(polyfs_fs_t *fs, uint32_t *start, uint32_t *end);
+// Bytes between a file's block pointers and its data
+static inline uint32_t crc_table_size(polyfs_fs_t *fs, uint32_t blocks);
+
+#if VERIFY_BLOCKS
+// Find out whether a block needs its CRC checked, and its number if so
+static int block_unverified(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	uint16_t block, uint32_t *index);
+// Compare a block's CRC with the one stored for it, and remember it if good
+static int block_verify(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	uint16_t block, uint32_t index, uint32_t crc);
+// Work out the CRC of some data straight from storage
+static int storage_crc(polyfs_fs_t *fs, uint32_t offset, uint32_t bytes,
+	uint32_t *crc);
+#endif
+
+#if CONFIG_LIB_LZO
+// Read and decompress an entire LZO block into buf, and work out the CRC of
+// the compressed data on the way if crc isn't NULL
+static int32_t read_lzo_block(polyfs_fs_t *fs, void *buf, uint16_t bufsize,
+	uint32_t start_offset, uint32_t compr_len, uint32_t *crc);
+#endif
+
+#if CONFIG_LIB_POLYFS_LZSS
+// Decode part of an LZSS block straight into ptr, carrying on from st
+static int32_t read_lzss_block(polyfs_fs_t *fs, polyfs_lzss_t *st,
+	uint32_t start_offset, uint16_t compr_len, uint16_t expect,
+	uint8_t *ptr, uint16_t block_offset, uint16_t bytes);
+#endif
+
+#if BLOCK_CACHE
+// Find a cached block, returns NULL on a miss
+static struct block_cache *cache_find(polyfs_fs_t *fs,
+	uint32_t inode_offset, uint16_t block);
+// Find a cached block by where its data is, for blocks files share
+static struct block_cache *cache_find_data(polyfs_fs_t *fs, uint32_t start);
+// Pick a cache entry to hold a new block
+static struct block_cache *cache_victim(void);
+// Mark a cache entry as most recently used
+static void cache_touch(struct block_cache *c);
+#endif
+
+// Binary search a directory's index table for a name, returns 1 if found
+static int search_index(polyfs_readdir_t *rd, const char *name, int len);
+// Walk the directory tree to find path
+static int walk_path(polyfs_fs_t *fs, const char *path,
+	struct polyfs_inode *inode);
+
+#if LOOKUP_CACHE || LOOKUP_MISSES
+// Hash a path name for the lookup cache
+static uint32_t path_hash(const char *path);
+// Find a cached lookup, returns NULL on a miss
+static struct lookup_cache *lookup_find(struct lookup_cache *table,
+	uint8_t entries, polyfs_fs_t *fs, uint32_t hash);
+// Remember the result of a lookup
+static void lookup_store(struct lookup_cache *table, uint8_t entries,
+	polyfs_fs_t *fs, uint32_t hash, const struct polyfs_inode *inode);
+#endif
 
 int polyfs_init(void) {
 	int err = 0;
@@ -84,6 +245,9 @@ int polyfs_fs_open(polyfs_fs_t *fs) {
 		return -1;
 	}
 
+	// Anything cached against this structure is now stale
+	polyfs_cache_flush(fs);
+
 	// Read in the superblock
 	err = read_super(fs);
 	if (err) {
@@ -93,69 +257,557 @@ int polyfs_fs_open(polyfs_fs_t *fs) {
 	return 0;
 }
 
+void polyfs_cache_flush(polyfs_fs_t *fs) {
+#if BLOCK_CACHE
+	for (int i = 0; i < BLOCK_CACHE; i++) {
+		if (fs == NULL || cache[i].fs == fs) {
+			cache[i].fs = NULL;
+		}
+	}
+#endif
+#if LOOKUP_CACHE
+	for (int i = 0; i < LOOKUP_CACHE; i++) {
+		if (fs == NULL || lookups[i].fs == fs) {
+			lookups[i].fs = NULL;
+		}
+	}
+#endif
+#if LOOKUP_MISSES
+	for (int i = 0; i < LOOKUP_MISSES; i++) {
+		if (fs == NULL || misses[i].fs == fs) {
+			misses[i].fs = NULL;
+		}
+	}
+#endif
+#if VERIFY_BLOCKS
+	if (fs == NULL || verified.fs == fs) {
+		verified.fs = NULL;
+	}
+#endif
+}
+
 int polyfs_check_crc(polyfs_fs_t *fs, void *temp, uint16_t tempsize) {
-	uint32_t crc = 0;
-	uint32_t size = 0;
-	uint32_t read_crc = 0;
-	uint32_t offset = 0;
+	polyfs_crc_t st;
 	int ret;
 
-	while (1) {
-		// Read a block of FS data
-		ret = read_storage(fs, temp, offset, tempsize);
-		if (ret < 0) {
-			return ret;
+	memset(&st, 0, sizeof(st));
+	do {
+		ret = polyfs_check_crc_step(fs, &st, temp, tempsize);
+	} while (ret > 0);
+
+	return ret;
+}
+
+int polyfs_check_crc_step(polyfs_fs_t *fs, polyfs_crc_t *st,
+	void *temp, uint16_t tempsize)
+{
+	int ret;
+
+	// Read a block of FS data
+	ret = read_storage(fs, temp, st->offset, tempsize);
+	if (ret < 0) {
+		return ret;
+	}
+	else if (ret == 0) {
+		return (st->crc == st->expect) ? 0 : -1;
+	}
+
+	// If we've just read the superblock, extract some info
+	if (st->offset == 0) {
+		struct polyfs_super *super = temp;
+		st->size = POLYFS_32(super->size);
+		st->expect = POLYFS_32(super->fsid.crc);
+
+		// Wipe the CRC from the block we read so the calculation is valid
+		super->fsid.crc = POLYFS_32(0);
+	}
+
+	st->offset += ret;
+
+	// Reached the end of the filesystem
+	if (st->offset > st->size) {
+		st->crc = polyfs_crc32(st->crc, temp, ret - (st->offset - st->size));
+		return (st->crc == st->expect) ? 0 : -1;
+	}
+
+	st->crc = polyfs_crc32(st->crc, temp, ret);
+	return 1;
+}
+
+int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	void *ptr, uint32_t offset, uint16_t bytes)
+{
+	return polyfs_fread_blkptr(fs, inode, NULL, ptr, offset, bytes);
+}
+
+int32_t polyfs_fread_blkptr(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	polyfs_blkptr_t *bp, void *ptr, uint32_t offset, uint16_t bytes)
+{
+	uint8_t *buf = ptr;
+	int32_t total = 0;
+
+	// Keep reading until we fill the buffer or reach the end of the file
+	while (bytes) {
+		int32_t ret = read_block(fs, inode, bp, buf, offset, bytes);
+		if (ret < 0) return total ? total : ret;
+		if (ret == 0) break;
+
+		buf += ret;
+		offset += ret;
+		bytes -= ret;
+		total += ret;
+	}
+
+	return total;
+}
+
+int polyfs_opendir(polyfs_fs_t *fs, const struct polyfs_inode *parent,
+	polyfs_readdir_t *rd)
+{
+	if (!S_ISDIR(POLYFS_16(parent->mode))) {
+		PRINTF1("can only readdir directories");
+		return -1;
+	}
+
+	// Copy over basic values
+	rd->fs = fs;
+	rd->parent = parent;
+
+	// Work out the offset of the first dirent inode
+	rd->next = POLYFS_GET_OFFSET(parent) << 2;
+	rd->batch = NULL;
+
+	return 0;
+}
+
+int polyfs_readdir_batch(polyfs_readdir_t *rd, void *buf, uint16_t size) {
+	// Every refill has to fetch at least a whole inode
+	if (size < sizeof(rd->inode)) {
+		return -1;
+	}
+
+	rd->batch = buf;
+	rd->batch_size = size;
+	rd->batch_len = 0;
+
+	return 0;
+}
+
+int polyfs_readdir(polyfs_readdir_t *rd) {
+	uint32_t start = POLYFS_GET_OFFSET(rd->parent) << 2;
+	uint32_t psize = POLYFS_24(rd->parent->size);
+	uint8_t namelen;
+	uint16_t have; // bytes of the name read along with the inode
+	int len;
+
+	if ((rd->next < start) || (rd->next > (start + psize))) {
+		PRINTF1("readdir with invalid next\n");
+		return -1;
+	}
+
+	if (rd->batch) {
+		// Refill the batch from this entry unless it holds the inode
+		if (rd->next < rd->batch_offset || rd->next + sizeof(rd->inode) >
+			rd->batch_offset + rd->batch_len)
+		{
+			rd->batch_len = 0;
+			len = read_storage(rd->fs, rd->batch, rd->next,
+				min(rd->batch_size, start + psize - rd->next));
+			if (len < (int)sizeof(rd->inode)) {
+				PRINTF1("short read\n");
+				return -1;
+			}
+
+			rd->batch_offset = rd->next;
+			rd->batch_len = len;
 		}
-		else if (ret == 0) {
-			break;
+
+		// Copy out the inode and as much of the name as the batch has
+		uint8_t *ptr = &rd->batch[rd->next - rd->batch_offset];
+		memcpy(&rd->inode, ptr, sizeof(rd->inode));
+		namelen = POLYFS_GET_NAMELEN(&rd->inode) << 2;
+		have = min(rd->batch_offset + rd->batch_len - rd->next -
+			sizeof(rd->inode), namelen);
+		memcpy(rd->name, ptr + sizeof(rd->inode), have);
+	}
+	else {
+		// Read the inode and the start of the name in one go
+		len = read_storage(rd->fs, rd->name, rd->next,
+			min(sizeof(rd->inode) + READDIR_PEEK, start + psize - rd->next));
+		if (len < (int)sizeof(rd->inode)) {
+			PRINTF1("short read\n");
+			return -1;
 		}
 
-		// If we've just read the superblock, extract some info
-		if (offset == 0) {
-			struct polyfs_super *super = temp;
-			size = POLYFS_32(super->size);
-			read_crc = POLYFS_32(super->fsid.crc);
+		memcpy(&rd->inode, rd->name, sizeof(rd->inode));
+		namelen = POLYFS_GET_NAMELEN(&rd->inode) << 2;
+		have = min(len - sizeof(rd->inode), namelen);
+		memmove(rd->name, &rd->name[sizeof(rd->inode)], have);
+	}
 
-			// Wipe the CRC from the block we read so the calculation is valid
-			super->fsid.crc = POLYFS_32(0);
+	// Long names need another read for the rest
+	if (have < namelen) {
+		len = read_storage(rd->fs, &rd->name[have],
+			rd->next + sizeof(rd->inode) + have, namelen - have);
+		if (len != namelen - have) {
+			PRINTF1("short read\n");
+			return -1;
 		}
+	}
 
-		offset += ret;
+	// Advance the pointer, skipping any inline data
+	rd->next += sizeof(rd->inode) + namelen + inline_size(rd->fs, &rd->inode);
 
-		// Reached the end of the filesystem
-		if (offset > size) {
-			crc = crc32(crc, temp, ret - (offset - size));
-			break;
+	// Check for the end of the directory
+	if (rd->next >= (start + psize)) {
+		rd->next = 0;
+	}
+
+	return 0;
+}
+
+int polyfs_lookup(polyfs_fs_t *fs, const char *path,
+	struct polyfs_inode *inode)
+{
+#if LOOKUP_CACHE || LOOKUP_MISSES
+	uint32_t hash = path_hash(path);
+	struct lookup_cache *c;
+	int err;
+#endif
+
+#if LOOKUP_CACHE
+	// Have we found this one before?
+	c = lookup_find(lookups, LOOKUP_CACHE, fs, hash);
+	if (c) {
+		polyfs_stats.lookup_hits++;
+		*inode = c->inode;
+		return 0;
+	}
+#endif
+#if LOOKUP_MISSES
+	// Have we failed to find this one recently?
+	c = lookup_find(misses, LOOKUP_MISSES, fs, hash);
+	if (c) {
+		polyfs_stats.lookup_negative++;
+		return -1;
+	}
+#endif
+
+	polyfs_stats.lookup_walks++;
+
+#if LOOKUP_CACHE || LOOKUP_MISSES
+	err = walk_path(fs, path, inode);
+	if (err == 0) {
+#if LOOKUP_CACHE
+		lookup_store(lookups, LOOKUP_CACHE, fs, hash, inode);
+#endif
+	}
+	else {
+#if LOOKUP_MISSES
+		lookup_store(misses, LOOKUP_MISSES, fs, hash, NULL);
+#endif
+	}
+
+	return err;
+#else
+	return walk_path(fs, path, inode);
+#endif
+}
+
+int polyfs_embed_info(polyfs_fs_t *fs, uint32_t *length) {
+	// Check if there is an embedded file first
+	if (!(fs->sb.flags & POLYFS_FLAG_SHIFTED_ROOT_OFFSET)) {
+		*length = 0;
+		return 0;
+	}
+
+	// A compressed file starts with its uncompressed length
+	if (fs->sb.flags & POLYFS_FLAG_EMBED_LZO) {
+		return read_storage_uint32(fs, length, sizeof(struct polyfs_super));
+	}
+
+	// Work out the root node's offset
+	*length = POLYFS_GET_OFFSET(&fs->root) << 2;
+
+	// Subtract size of superblock
+	*length -= sizeof(struct polyfs_super);
+
+	return 0;
+}
+
+#if CONFIG_LIB_LZO
+// Cache key for embedded file blocks; no inode has its data at offset 0
+#define EMBED_CACHE_KEY 0
+
+// Read from a single block of a compressed embedded file
+static int32_t embed_read_block(polyfs_fs_t *fs, void *ptr,
+	uint32_t offset, uint16_t bytes, uint32_t size)
+{
+	uint16_t block = offset / POLYFS_BLOCK_SIZE;
+	uint16_t block_offset = offset % POLYFS_BLOCK_SIZE;
+	uint32_t start, end;
+	uint16_t expect;
+	int32_t ret;
+
+	// Don't try to read past the end of the block
+	bytes = min(POLYFS_BLOCK_SIZE - block_offset, bytes);
+
+	// Sequential page-sized reads come from the cache
+	struct block_cache *c = cache_find(fs, EMBED_CACHE_KEY, block);
+	if (c) {
+		polyfs_stats.block_hits++;
+		memcpy(ptr, &c->data[block_offset], bytes);
+		return bytes;
+	}
+
+	// Find out where the block lives, the first starts after the pointers
+	uint32_t ptrs = sizeof(struct polyfs_super) + 4;
+	if (block == 0) {
+		start = sizeof(struct polyfs_super) + POLYFS_EMBED_HDR_SIZE(size);
+	}
+	else if (read_storage_uint32(fs, &start, ptrs + 4 * (block - 1))) {
+		return -1;
+	}
+	if (read_storage_uint32(fs, &end, ptrs + 4 * block) || end < start) {
+		return -1;
+	}
+
+	// A block that didn't compress is stored as-is
+	expect = min(size - (uint32_t)block * POLYFS_BLOCK_SIZE, POLYFS_BLOCK_SIZE);
+	if (end - start == expect) {
+		return read_storage(fs, ptr, start + block_offset, bytes);
+	}
+
+	polyfs_stats.block_misses++;
+	c = cache_victim();
+	c->fs = NULL;
+
+	ret = read_lzo_block(fs, c->data, sizeof(c->data), start, end - start,
+		NULL);
+	if (ret != expect) {
+		PRINTF("decompressed block size mismatch: %ld != %d\n",
+			ret, expect);
+		return -1;
+	}
+
+	c->fs = fs;
+	c->inode_offset = EMBED_CACHE_KEY;
+	c->block = block;
+	c->start = start;
+	c->bytes = ret;
+	cache_touch(c);
+
+	memcpy(ptr, &c->data[block_offset], bytes);
+	return bytes;
+}
+#endif
+
+int polyfs_embed_read(polyfs_fs_t *fs,
+	void *ptr, uint32_t offset, uint16_t bytes)
+{
+	int ret;
+	uint32_t size;
+
+	// Get the length of the embedded file
+	ret = polyfs_embed_info(fs, &size);
+	if (ret) {
+		return ret;
+	}
+
+	// Check we aren't trying to read past the end of the file
+	if (offset > size) {
+		return -1;
+	} 
+	// If the input buffer extends beyond the end of the file
+	else if (offset + bytes > size) {
+		// reduce the requested read size
+		bytes = size - offset;
+	}
+	// If we were asked to read nothing, we can return quickly
+	else if (bytes == 0) {
+		return 0;
+	}
+
+	if (fs->sb.flags & POLYFS_FLAG_EMBED_LZO) {
+#if CONFIG_LIB_LZO
+		uint16_t done = 0;
+
+		// Decompress block by block
+		while (done < bytes) {
+			int32_t ret = embed_read_block(fs, (uint8_t *)ptr + done,
+				offset + done, bytes - done, size);
+			if (ret <= 0) {
+				return -1;
+			}
+			done += ret;
 		}
 
-		crc = crc32(crc, temp, ret);
+		return done;
+#else
+		PRINTF1("LZO compression not available\n");
+		return -1;
+#endif
+	}
+
+	// Real offset is just after the superblock
+	offset += sizeof(struct polyfs_super);
+
+	// Read from the storage
+	return read_storage(fs, ptr, offset, bytes);
+}
+
+static inline uint32_t min(uint32_t a, uint32_t b) {
+	return (a < b) ? a : b;
+}
+
+static inline int read_storage(polyfs_fs_t *fs, void *ptr,
+	uint32_t offset, uint16_t bytes)
+{
+	if (fs->fn_read == NULL) {
+		PRINTF1("fn_read not set!\n");
+		return -1;
 	}
 
-	if (crc != read_crc) {
+	return fs->fn_read(fs, ptr, offset, bytes);
+}
+
+static inline int read_storage_uint16(polyfs_fs_t *fs,
+	uint16_t *ptr, uint32_t offset)
+{
+	int num = read_storage(fs, ptr, offset, sizeof(*ptr));
+	if (num != sizeof(*ptr)) {
 		return -1;
 	}
 
+	*ptr = POLYFS_16(*ptr);
+
 	return 0;
 }
 
-int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
-	void *ptr, uint32_t offset, uint16_t bytes)
+static inline int read_storage_uint32(polyfs_fs_t *fs,
+	uint32_t *ptr, uint32_t offset)
+{
+	int num = read_storage(fs, ptr, offset, sizeof(*ptr));
+	if (num != sizeof(*ptr)) {
+		return -1;
+	}
+
+	*ptr = POLYFS_32(*ptr);
+
+	return 0;
+}
+
+static inline uint8_t inline_size(polyfs_fs_t *fs,
+	const struct polyfs_inode *inode)
+{
+	if (!(fs->sb.flags & POLYFS_FLAG_INLINE_DATA) ||
+		!POLYFS_IS_INLINE(POLYFS_16(inode->mode), POLYFS_24(inode->size)))
+	{
+		return 0;
+	}
+
+	return POLYFS_INLINE_SIZE(POLYFS_24(inode->size));
+}
+
+static int read_super(polyfs_fs_t *fs) {
+	struct polyfs_super super;
+	int status;
+	uint32_t root_offset;
+
+	// Read in the superblock
+	status = read_storage(fs, &super, 0, sizeof(super));
+	if (status != sizeof(super)) {
+		PRINTF("could not read superblock: %d\n", status);
+		return (status < 0) ? status : -1;
+	}
+
+	// Check magic number
+	if (super.magic != POLYFS_32(POLYFS_MAGIC)) {
+		PRINTF("superblock magic not found: %08x\n", super.magic);
+		return -1;
+	}
+
+	// Check flags
+	if (POLYFS_32(super.flags) & ~POLYFS_SUPPORTED_FLAGS) {
+		PRINTF1("unsupported features\n");
+		return -1;
+	}
+
+	// Check that the root inode is sane
+	if (!S_ISDIR(POLYFS_16(super.root.mode))) {
+		PRINTF1("root is not a directory\n");
+		return -1;
+	}
+
+	// Copy over a few things we're sure about
+	fs->sb.flags = POLYFS_32(super.flags);
+	fs->sb.size = POLYFS_32(super.size);
+
+	// Check for required flags
+	if (!(fs->sb.flags & POLYFS_FLAG_FSID_VERSION_1)) {
+		PRINTF1("required flags missing\n");
+		return -1;
+	}
+
+	// Copy over a few more things
+	memcpy(&fs->sb.fsid, &super.fsid, sizeof(super.fsid));
+
+	// Work out the root node's offset
+	root_offset = POLYFS_GET_OFFSET(&super.root) << 2;
+
+	// Check for sanity
+	if (root_offset == 0) {
+		PRINTF1("empty filesystem\n");
+		return -1;
+	}
+	else if (!(fs->sb.flags & POLYFS_FLAG_SHIFTED_ROOT_OFFSET) &&
+		 (root_offset != sizeof(struct polyfs_super)))
+	{
+		PRINTF("bad root offset %d\n", root_offset);
+		return -1;
+	}
+
+	// Check the compression algorithms
+#if !CONFIG_LIB_LZO
+	if (fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) {
+		PRINTF1("LZO compression not available\n");
+		return -1;
+	}
+#endif
+#if !CONFIG_LIB_POLYFS_LZSS
+	if (fs->sb.flags & POLYFS_FLAG_LZSS_COMPRESSION) {
+		PRINTF1("LZSS compression not available\n");
+		return -1;
+	}
+#endif
+	if (fs->sb.flags & POLYFS_FLAG_ZLIB_COMPRESSION) {
+		PRINTF1("zlib compression not available\n");
+		return -1;
+	}
+
+	// Copy the root inode info over to the fs structure
+	memcpy(&fs->root, &super.root, sizeof(super.root));
+
+	return 0;
+}
+
+static int32_t read_block(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	polyfs_blkptr_t *bp, void *ptr, uint32_t offset, uint16_t bytes)
 {
 	int err;
 
 	// the number of bytes we would like to read
 	uint16_t read_bytes = bytes;
-	// the number of blocks that make up this inode
-	uint32_t blocks = (POLYFS_24(inode->size) + POLYFS_BLOCK_SIZE - 1) /
-		POLYFS_BLOCK_SIZE;
+#if CONFIG_LIB_LZO || CONFIG_LIB_POLYFS_LZSS
 	// the offset of the data section of this inode (start of block pointers)
 	uint32_t inode_offset = POLYFS_GET_OFFSET(inode) << 2;
+#endif
 	// the block number that the offset falls into
 	uint16_t block = offset / POLYFS_BLOCK_SIZE;
-	// offset of the first block of data (block 0)
-	uint32_t start_offset = inode_offset + (blocks * 4);
-	// offset of the block pointer
-	uint32_t blkptr_offset = inode_offset + (block * 4);
+	// offset within the block to read from
+	uint16_t block_offset = offset % POLYFS_BLOCK_SIZE;
+	// offset of the start of the data block
+	uint32_t start_offset;
 	// length of the compressed data block
 	uint32_t compr_len;
 
@@ -183,134 +835,423 @@ int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
 		return 0;
 	}
 
-	// We need to read from a block that's not the first
-	if (block) {
-		err = read_storage_uint32(fs, &start_offset, blkptr_offset - 4);
-		if (err) return err;
+	// Don't try to read past the end of the block
+	read_bytes = min(POLYFS_BLOCK_SIZE - block_offset, read_bytes);
+
+	// Inline data sits uncompressed where the offset points, with no block
+	// pointers to look up first
+	if (inline_size(fs, inode)) {
+		return read_storage(fs, ptr,
+			(POLYFS_GET_OFFSET(inode) << 2) + offset, read_bytes);
 	}
 
-	// Find out the length of the data block
-	err = read_storage_uint32(fs, &compr_len, blkptr_offset);
+#if CONFIG_LIB_LZO
+	// Repeated and partial reads of LZO blocks come from the cache
+	if (fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) {
+		struct block_cache *c = cache_find(fs, inode_offset, block);
+		if (c) {
+			polyfs_stats.block_hits++;
+			memcpy(ptr, &c->data[block_offset], read_bytes);
+			return read_bytes;
+		}
+	}
+#endif
+
+#if CONFIG_LIB_POLYFS_LZSS
+	// An empty window means the file changed, so the LZSS state is stale
+	uint8_t lzss_fresh = !bp || !bp->count;
+#endif
+
+	// Find out where the data block lives
+	err = block_extent(fs, inode, bp, block, &start_offset, &compr_len);
 	if (err) return err;
 	compr_len -= start_offset;
 
+#if CONFIG_LIB_LZO
+	// Another file may have the same data cached
+	if ((fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) &&
+		(fs->sb.flags & POLYFS_FLAG_SHARED_BLOCKS) && compr_len)
+	{
+		struct block_cache *c = cache_find_data(fs, start_offset);
+		if (c) {
+			polyfs_stats.block_hits++;
+			memcpy(ptr, &c->data[block_offset], read_bytes);
+			return read_bytes;
+		}
+	}
+#endif
+
 	// Is this a hole in the data?
 	if (compr_len == 0) {
-		// Find out the size of the hole
-		uint32_t bytes_out = min(read_bytes, POLYFS_BLOCK_SIZE);
-
 		// Set the memory and return the size
-		memset(ptr, 0, bytes_out);
-		return bytes_out;
+		memset(ptr, 0, read_bytes);
+		return read_bytes;
 	}
 
+#if VERIFY_BLOCKS
+	// the block's number in the image, if its CRC hasn't been checked yet
+	uint32_t index;
+	uint32_t crc;
+	int unverified = 0;
+
+	if (fs->sb.flags & POLYFS_FLAG_BLOCK_CRC) {
+		unverified = block_unverified(fs, inode, block, &index);
+		if (unverified < 0) return unverified;
+	}
+#endif
+
 #if CONFIG_LIB_LZO
 	// Deal with an LZO compressed file
 	if (fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) {
-		// Offset must be a multiple of the block size
-		if (offset % POLYFS_BLOCK_SIZE) {
-			PRINTF1("read offset must be a multiple of block size\n");
+		// the number of bytes the block should decompress to
+		uint16_t expect = min(inode->size - (uint32_t)block * POLYFS_BLOCK_SIZE,
+			POLYFS_BLOCK_SIZE);
+		int32_t ret;
+
+		// Decompress the block into the least recently used cache entry
+		// and copy out just the part we were asked for
+		struct block_cache *c = cache_victim();
+		c->fs = NULL;
+		polyfs_stats.block_misses++;
+
+		uint32_t *crcp = NULL;
+#if VERIFY_BLOCKS
+		// The compressed data passes through the buffer anyway, so check
+		// it there rather than reading it twice
+		if (unverified) {
+			crcp = &crc;
+		}
+#endif
+
+		ret = read_lzo_block(fs, c->data, sizeof(c->data),
+			start_offset, compr_len, crcp);
+#if VERIFY_BLOCKS
+		if (ret >= 0 && unverified &&
+			block_verify(fs, inode, block, index, crc))
+		{
 			return -1;
 		}
+#endif
+		if (ret != expect) {
+			PRINTF("decompressed block size mismatch: %ld != %d\n",
+				ret, expect);
+			return -1;
+		}
+
+		// Remember what we just decompressed
+		c->fs = fs;
+		c->inode_offset = inode_offset;
+		c->block = block;
+		c->start = start_offset;
+		c->bytes = ret;
+		cache_touch(c);
+
+		memcpy(ptr, &c->data[block_offset], read_bytes);
+		return read_bytes;
+	}
+#endif
+
+#if VERIFY_BLOCKS
+	// Everything else reads the block a piece at a time, so check the whole
+	// block before reading any of it
+	if (unverified) {
+		err = storage_crc(fs, start_offset, compr_len, &crc);
+		if (err) return err;
 
-		// Must have a large block for in-place decompress
-		if (bytes < POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD) {
-			PRINTF1("buffer size must be > block size + lzo overhead\n");
+		err = block_verify(fs, inode, block, index, crc);
+		if (err) return err;
+	}
+#endif
+
+#if CONFIG_LIB_POLYFS_LZSS
+	// Deal with an LZSS compressed block, unless it was stored as-is
+	if (fs->sb.flags & POLYFS_FLAG_LZSS_COMPRESSION) {
+		uint16_t expect = min(inode->size - (uint32_t)block * POLYFS_BLOCK_SIZE,
+			POLYFS_BLOCK_SIZE);
+		polyfs_lzss_t local, *st = bp ? &bp->lzss : &local;
+
+		if (compr_len > expect) {
+			PRINTF1("LZSS block larger than its data\n");
 			return -1;
 		}
+		else if (compr_len < expect) {
+			// Start the block over unless we can carry on from last time
+			if (lzss_fresh || st->inode_offset != inode_offset ||
+				st->block != block || st->out > block_offset)
+			{
+				st->inode_offset = inode_offset;
+				st->block = block;
+				st->out = 0;
+				st->in = 0;
+				st->left = 0;
+			}
+
+			return read_lzss_block(fs, st, start_offset, compr_len, expect,
+				ptr, block_offset, read_bytes);
+		}
+	}
+#endif
+
+	// Read from the storage
+	return read_storage(fs, ptr, start_offset + block_offset, read_bytes);
+}
+
+static int block_extent(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	polyfs_blkptr_t *bp, uint16_t block, uint32_t *start, uint32_t *end)
+{
+	int err;
+
+	// the number of blocks that make up this inode
+	uint32_t blocks = (POLYFS_24(inode->size) + POLYFS_BLOCK_SIZE - 1) /
+		POLYFS_BLOCK_SIZE;
+	// the offset of the data section of this inode (start of block pointers)
+	uint32_t inode_offset = POLYFS_GET_OFFSET(inode) << 2;
+	// offset of the block pointer
+	uint32_t blkptr_offset = inode_offset + (block * 4);
+
+	// Without a window we just read the pointers we need
+	if (bp == NULL) {
+		// Block 0 starts straight after the block pointers
+		*start = inode_offset + (blocks * 4) + crc_table_size(fs, blocks);
+
+		// We need to read from a block that's not the first
+		if (block) {
+			err = read_storage_uint32(fs, start, blkptr_offset - 4);
+			if (err) return err;
+		}
+
+		err = read_storage_uint32(fs, end, blkptr_offset);
+		if (err) return err;
+
+		return shared_extent(fs, start, end);
+	}
+
+	// Refill the window if the block isn't in it
+	if (block < bp->base || block >= bp->base + bp->count) {
+		uint8_t count = min(blocks - block, POLYFS_BLKPTR_WINDOW);
+		uint32_t *ptrs = bp->ptrs;
+		uint8_t nptrs = count;
+
+		bp->count = 0;
+
+		if (block) {
+			// Read the end of the previous block too
+			blkptr_offset -= 4;
+			nptrs++;
+		}
+		else {
+			// Block 0 starts straight after the block pointers
+			*ptrs++ = inode_offset + (blocks * 4) + crc_table_size(fs, blocks);
+		}
 
-		// The compressed data needs to be put at the end of the buffer
-		uint32_t lzo_offset = bytes - compr_len;
-		err = read_storage(fs, ptr + lzo_offset, start_offset, compr_len);
-		if (err != compr_len) {
-			PRINTF1("could not read entire compressed buffer\n");
+		// Fetch all the pointers in one go
+		err = read_storage(fs, ptrs, blkptr_offset, nptrs * 4);
+		if (err != nptrs * 4) {
+			PRINTF1("could not read block pointers\n");
 			return -1;
 		}
 
-		// Let's do the decompression
-		err = lzo1x_decompress_safe(ptr + lzo_offset, compr_len,
-			ptr, (lzo_uintp)&bytes, NULL);
-		if (err != LZO_E_OK || bytes != min(read_bytes, POLYFS_BLOCK_SIZE)) {
-			PRINTF("overlap decompression failed: %d, %d == %d\n",
-				   err, bytes, min(read_bytes, POLYFS_BLOCK_SIZE));
-			return -1;
-		}
+		for (uint8_t i = 0; i < nptrs; i++) {
+			ptrs[i] = POLYFS_32(ptrs[i]);
+		}
+
+		bp->base = block;
+		bp->count = count;
+	}
+
+	*start = bp->ptrs[block - bp->base];
+	*end = bp->ptrs[block - bp->base + 1];
+
+	return shared_extent(fs, start, end);
+}
+
+static int shared_extent(polyfs_fs_t *fs, uint32_t *start, uint32_t *end) {
+	uint32_t ext[2];
+
+	if (!(fs->sb.flags & POLYFS_FLAG_SHARED_BLOCKS)) {
+		return 0;
+	}
+
+	// The previous block being shared doesn't change where this one starts
+	*start &= POLYFS_BLKPTR_MASK;
+	if (!(*end & POLYFS_BLKPTR_SHARED)) {
+		return 0;
+	}
+
+	*end &= POLYFS_BLKPTR_MASK;
+	if (*end - *start != POLYFS_SHARED_SIZE ||
+		read_storage(fs, ext, *start, sizeof(ext)) != sizeof(ext))
+	{
+		PRINTF1("could not read shared block\n");
+		return -1;
+	}
+
+	*start = POLYFS_32(ext[0]);
+	*end = POLYFS_32(ext[1]);
+	if (*end < *start) {
+		PRINTF1("bad shared block\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline uint32_t crc_table_size(polyfs_fs_t *fs, uint32_t blocks) {
+	return (fs->sb.flags & POLYFS_FLAG_BLOCK_CRC) ?
+		POLYFS_CRC_TABLE_SIZE(blocks) : 0;
+}
+
+#if VERIFY_BLOCKS
+static int block_unverified(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	uint16_t block, uint32_t *index)
+{
+	uint32_t blocks = (POLYFS_24(inode->size) + POLYFS_BLOCK_SIZE - 1) /
+		POLYFS_BLOCK_SIZE;
+	uint32_t table = (POLYFS_GET_OFFSET(inode) << 2) + (blocks * 4);
+	int err;
+
+	// The table starts with the number of the file's first block
+	err = read_storage_uint32(fs, index, table);
+	if (err) return err;
+	*index += block;
+
+	// A bitmap for some other fs is no use, so start this one's afresh
+	if (verified.fs != fs) {
+		memset(verified.bits, 0, sizeof(verified.bits));
+		verified.fs = fs;
+	}
+
+	if (*index < VERIFY_BLOCKS &&
+		(verified.bits[*index / 8] & (1 << (*index % 8))))
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+static int block_verify(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	uint16_t block, uint32_t index, uint32_t crc)
+{
+	uint32_t blocks = (POLYFS_24(inode->size) + POLYFS_BLOCK_SIZE - 1) /
+		POLYFS_BLOCK_SIZE;
+	uint32_t table = (POLYFS_GET_OFFSET(inode) << 2) + (blocks * 4);
+	uint32_t want;
+	int err;
+
+	err = read_storage_uint32(fs, &want, table + 4 + (uint32_t)block * 4);
+	if (err) return err;
 
-		return bytes;
+	if (crc != want) {
+		PRINTF("block %lu CRC mismatch: %08lx != %08lx\n",
+			index, crc, want);
+		return -1;
 	}
-#endif
 
-	// Offset within the block to read from
-	uint32_t block_offset = offset % POLYFS_BLOCK_SIZE;
-	// Don't try to read past the end of the block
-	read_bytes = min(POLYFS_BLOCK_SIZE - block_offset, read_bytes);
+	if (index < VERIFY_BLOCKS) {
+		verified.bits[index / 8] |= 1 << (index % 8);
+	}
 
-	// Read from the storage
-	return read_storage(fs, ptr, start_offset + block_offset, read_bytes);
+	return 0;
 }
 
-int polyfs_opendir(polyfs_fs_t *fs, const struct polyfs_inode *parent,
-	polyfs_readdir_t *rd)
+static int storage_crc(polyfs_fs_t *fs, uint32_t offset, uint32_t bytes,
+	uint32_t *crc)
 {
-	if (!S_ISDIR(POLYFS_16(parent->mode))) {
-		PRINTF1("can only readdir directories");
-		return -1;
-	}
-
-	// Copy over basic values
-	rd->fs = fs;
-	rd->parent = parent;
+	uint8_t buf[32];
+
+	*crc = 0;
+	while (bytes) {
+		uint16_t len = min(bytes, sizeof(buf));
+		int ret = read_storage(fs, buf, offset, len);
+		if (ret != len) {
+			PRINTF1("could not read block to check its CRC\n");
+			return -1;
+		}
 
-	// Work out the offset of the first dirent inode
-	rd->next = POLYFS_GET_OFFSET(parent) << 2;
+		*crc = polyfs_crc32(*crc, buf, len);
+		offset += len;
+		bytes -= len;
+	}
 
 	return 0;
 }
+#endif
 
-int polyfs_readdir(polyfs_readdir_t *rd) {
-	uint32_t start = POLYFS_GET_OFFSET(rd->parent) << 2;
-	uint32_t psize = POLYFS_24(rd->parent->size);
+static int search_index(polyfs_readdir_t *rd, const char *name, int len) {
+	// offset of the first directory entry, the table ends just before it
+	uint32_t first = POLYFS_GET_OFFSET(rd->parent) << 2;
+	uint16_t count;
+	uint16_t lo = 0;
+	uint16_t hi;
+	int err;
 
-	if ((rd->next < start) || (rd->next > (start + psize))) {
-		PRINTF1("readdir with invalid next\n");
-		return -1;
+	// Empty directories have no table
+	if (POLYFS_24(rd->parent->size) == 0) {
+		return 0;
 	}
 
-	// Read in the inode
-	int len = read_storage(rd->fs, &rd->inode, rd->next, sizeof(rd->inode));
-	if (len != sizeof(rd->inode)) {
-		PRINTF1("short read\n");
-		return -1;
-	}
+	// The number of entries is the last word of the table
+	err = read_storage_uint16(rd->fs, &count, first - 2);
+	if (err) return err;
 
-	// Read in the name
-	uint8_t namelen = POLYFS_GET_NAMELEN(&rd->inode) << 2;
-	len = read_storage(rd->fs, rd->name, rd->next + sizeof(rd->inode), namelen);
-	if (len != namelen) {
-		PRINTF1("short read\n");
-		return -1;
-	}
+	// Binary search the sorted entries
+	hi = count;
+	while (lo < hi) {
+		uint16_t mid = lo + (hi - lo) / 2;
+		uint16_t rel;
+		int namelen;
+		int cmp;
+
+		// Look up where the middle entry lives
+		err = read_storage_uint16(rd->fs, &rel,
+			first - 2 - 2 * (uint32_t)(count - mid));
+		if (err) return err;
 
-	// Advance the pointer
-	rd->next += sizeof(rd->inode) + namelen;
+		// Read the directory entry
+		rd->next = first + ((uint32_t)rel << 2);
+		err = polyfs_readdir(rd);
+		if (err) return err;
 
-	// Check for the end of the directory
-	if (rd->next >= (start + psize)) {
-		rd->next = 0;
+		// Find the length of the name string
+		namelen = strnlen((char *)rd->name,
+			POLYFS_GET_NAMELEN(&rd->inode) << 2);
+
+		// Compare the names, shorter names sort first
+		cmp = strncmp((char *)rd->name, name, min(len, namelen));
+		if (cmp == 0) {
+			cmp = namelen - len;
+		}
+
+		if (cmp == 0) {
+			// Name matches!
+			return 1;
+		}
+		else if (cmp > 0) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
 	}
 
 	return 0;
 }
 
-int polyfs_lookup(polyfs_fs_t *fs, const char *path,
+static int walk_path(polyfs_fs_t *fs, const char *path,
 	struct polyfs_inode *inode)
 {
 	int err;
 	polyfs_readdir_t *rd;
 	int pathlen = strlen(path);
 
+	// Without index tables directories are scanned from the start, so read
+	// them in bulk through a buffer allocated straight after rd
+	uint16_t batch = (fs->sb.flags & POLYFS_FLAG_DIR_INDEX) ?
+		0 : POLYFS_READDIR_BATCH;
+
 	// Allocate the readdir struct
-	rd = malloc(sizeof(*rd));
+	rd = memstat_malloc(MEMSTAT_POLYFS, sizeof(*rd) + batch);
 	if (!rd) {
 		return -1;
 	}
@@ -342,6 +1283,20 @@ int polyfs_lookup(polyfs_fs_t *fs, const char *path,
 		// Start the readdir
 		err = polyfs_opendir(fs, inode, rd);
 		if (err) goto out;
+		if (batch) {
+			polyfs_readdir_batch(rd, rd + 1, batch);
+		}
+
+		// Use the directory's index table if it has one
+		if (fs->sb.flags & POLYFS_FLAG_DIR_INDEX) {
+			found = search_index(rd, path, len);
+			if (found < 0) {
+				err = -1;
+				goto out;
+			}
+
+			rd->next = 0; // skip the linear search
+		}
 
 		// Iterate through the entries
 		while (rd->next) {
@@ -390,167 +1345,303 @@ int polyfs_lookup(polyfs_fs_t *fs, const char *path,
 	err = 0;
 
 out:
-	free(rd);
+	memstat_free(MEMSTAT_POLYFS, rd);
 	return err;
 }
 
-int polyfs_embed_info(polyfs_fs_t *fs, uint32_t *length) {
-	// Check if there is an embedded file first
-	if (!(fs->sb.flags & POLYFS_FLAG_SHIFTED_ROOT_OFFSET)) {
-		*length = 0;
-		return 0;
-	}
-
-	// Work out the root node's offset
-	*length = POLYFS_GET_OFFSET(&fs->root) << 2;
+#if LOOKUP_CACHE || LOOKUP_MISSES
+// 32-bit FNV-1a
+static uint32_t path_hash(const char *path) {
+	uint32_t hash = 2166136261UL;
 
-	// Subtract size of superblock
-	*length -= sizeof(struct polyfs_super);
+	while (*path) {
+		hash ^= (uint8_t)*path++;
+		hash *= 16777619UL;
+	}
 
-	return 0;
+	return hash;
 }
 
-int polyfs_embed_read(polyfs_fs_t *fs,
-	void *ptr, uint32_t offset, uint16_t bytes)
+static struct lookup_cache *lookup_find(struct lookup_cache *table,
+	uint8_t entries, polyfs_fs_t *fs, uint32_t hash)
 {
-	int ret;
-	uint32_t size;
-
-	// Get the length of the embedded file
-	ret = polyfs_embed_info(fs, &size);
-	if (ret) {
-		return ret;
-	}
+	struct lookup_cache *found = NULL;
 
-	// Check we aren't trying to read past the end of the file
-	if (offset > size) {
-		return -1;
-	} 
-	// If the input buffer extends beyond the end of the file
-	else if (offset + bytes > size) {
-		// reduce the requested read size
-		bytes = size - offset;
-	}
-	// If we were asked to read nothing, we can return quickly
-	else if (bytes == 0) {
-		return 0;
-	}
+	for (uint8_t i = 0; i < entries; i++) {
+		struct lookup_cache *c = &table[i];
 
-	// Real offset is just after the superblock
-	offset += sizeof(struct polyfs_super);
+		if (c->fs == fs && c->hash == hash) {
+			// Entries from an older fs edition are useless
+			if (c->edition != fs->sb.fsid.edition) {
+				c->fs = NULL;
+				continue;
+			}
 
-	// Read from the storage
-	return read_storage(fs, ptr, offset, bytes);
-}
+			found = c;
+			break;
+		}
+	}
 
-static inline uint32_t min(uint32_t a, uint32_t b) {
-	return (a < b) ? a : b;
-}
+	if (!found) {
+		return NULL;
+	}
 
-static inline int read_storage(polyfs_fs_t *fs, void *ptr,
-	uint32_t offset, uint16_t bytes)
-{
-	if (fs->fn_read == NULL) {
-		PRINTF1("fn_read not set!\n");
-		return -1;
+	// Mark it as most recently used
+	for (uint8_t i = 0; i < entries; i++) {
+		if (table[i].age < found->age) {
+			table[i].age++;
+		}
 	}
+	found->age = 0;
 
-	return fs->fn_read(fs, ptr, offset, bytes);
+	return found;
 }
 
-static inline int read_storage_uint32(polyfs_fs_t *fs,
-	uint32_t *ptr, uint32_t offset)
+static void lookup_store(struct lookup_cache *table, uint8_t entries,
+	polyfs_fs_t *fs, uint32_t hash, const struct polyfs_inode *inode)
 {
-	int num = read_storage(fs, ptr, offset, sizeof(*ptr));
-	if (num != sizeof(*ptr)) {
-		return -1;
+	struct lookup_cache *victim = &table[0];
+
+	// Free entries are always used first, then the oldest
+	for (uint8_t i = 0; i < entries; i++) {
+		if (table[i].fs == NULL) {
+			victim = &table[i];
+			break;
+		}
+		else if (table[i].age > victim->age) {
+			victim = &table[i];
+		}
 	}
 
-	*ptr = POLYFS_32(*ptr);
+	victim->fs = fs;
+	victim->edition = fs->sb.fsid.edition;
+	victim->hash = hash;
+	if (inode) {
+		victim->inode = *inode;
+	}
 
-	return 0;
+	// Age everything else and make this the newest
+	for (uint8_t i = 0; i < entries; i++) {
+		if (&table[i] != victim && table[i].age < entries) {
+			table[i].age++;
+		}
+	}
+	victim->age = 0;
 }
+#endif
 
-static int read_super(polyfs_fs_t *fs) {
-	struct polyfs_super super;
-	int status;
-	uint32_t root_offset;
+#if CONFIG_LIB_LZO
+static int32_t read_lzo_block(polyfs_fs_t *fs, void *buf, uint16_t bufsize,
+	uint32_t start_offset, uint32_t compr_len, uint32_t *crc)
+{
+	uint8_t *cbuf = buf;
+#if __AVR__
+	uint16_t out_len = bufsize;
+#else
+	lzo_uint out_len = bufsize;
+#endif
+	int err;
 
-	// Read in the superblock
-	status = read_storage(fs, &super, 0, sizeof(super));
-	if (status != sizeof(super)) {
-		PRINTF("could not read superblock: %d\n", status);
-		return (status < 0) ? status : -1;
+	// Must have a large block for in-place decompress
+	if (compr_len > bufsize) {
+		PRINTF1("compressed block larger than buffer\n");
+		return -1;
 	}
 
-	// Check magic number
-	if (super.magic != POLYFS_32(POLYFS_MAGIC)) {
-		PRINTF("superblock magic not found: %08x\n", super.magic);
+	// The compressed data needs to be put at the end of the buffer
+	uint16_t lzo_offset = bufsize - compr_len;
+	err = read_storage(fs, cbuf + lzo_offset, start_offset, compr_len);
+	if (err != compr_len) {
+		PRINTF1("could not read entire compressed buffer\n");
 		return -1;
 	}
 
-	// Check flags
-	if (POLYFS_32(super.flags) & ~POLYFS_SUPPORTED_FLAGS) {
-		PRINTF1("unsupported features\n");
-		return -1;
+	if (crc) {
+		*crc = polyfs_crc32(0, cbuf + lzo_offset, compr_len);
 	}
 
-	// Check that the root inode is sane
-	if (!S_ISDIR(POLYFS_16(super.root.mode))) {
-		PRINTF1("root is not a directory\n");
+	// Let's do the decompression
+#if __AVR__
+	err = lzo1x_decompress_avr(cbuf + lzo_offset, compr_len,
+		cbuf, &out_len);
+#else
+	err = lzo1x_decompress_safe(cbuf + lzo_offset, compr_len,
+		cbuf, &out_len, NULL);
+#endif
+	if (err != LZO_E_OK) {
+		PRINTF("overlap decompression failed: %d\n", err);
 		return -1;
 	}
 
-	// Copy over a few things we're sure about
-	fs->sb.flags = POLYFS_32(super.flags);
-	fs->sb.size = POLYFS_32(super.size);
+	return out_len;
+}
+#endif
 
-	// Check for required flags
-	if (!(fs->sb.flags & POLYFS_FLAG_FSID_VERSION_1)) {
-		PRINTF1("required flags missing\n");
-		return -1;
-	}
+#if CONFIG_LIB_POLYFS_LZSS
+static int32_t read_lzss_block(polyfs_fs_t *fs, polyfs_lzss_t *st,
+	uint32_t start_offset, uint16_t compr_len, uint16_t expect,
+	uint8_t *ptr, uint16_t block_offset, uint16_t bytes)
+{
+	uint16_t end = block_offset + bytes;
+	uint8_t hdr[3];
+	uint16_t n;
+
+	while (st->out < end) {
+		// Fetch the next token once the current one is used up
+		if (st->left == 0) {
+			uint16_t token = st->in;
+
+			n = min(sizeof(hdr), compr_len - token);
+			if (n == 0 || read_storage(fs, hdr, start_offset + token, n) != n) {
+				goto fail;
+			}
 
-	// Copy over a few more things
-	memcpy(&fs->sb.fsid, &super.fsid, sizeof(super.fsid));
+			if (hdr[0] < 0x80) {
+				st->left = hdr[0] + 1;
+				st->src = token + 1;
+				st->in = st->src + st->left;
+			}
+			else {
+				if (n < 2) {
+					goto fail;
+				}
+				st->left = ((hdr[0] >> 3) & 0x0f) + POLYFS_LZSS_MIN_MATCH;
+				st->src = ((uint16_t)(hdr[0] & 7) << 8) | hdr[1];
+				st->in = token + 2;
+				if (st->left == POLYFS_LZSS_MIN_MATCH + 15) {
+					if (n < 3) {
+						goto fail;
+					}
+					st->left += hdr[2];
+					st->in++;
+				}
+
+				// The copy has to come from before the match
+				if (st->src + st->left > token) {
+					goto fail;
+				}
+			}
 
-	// Work out the root node's offset
-	root_offset = POLYFS_GET_OFFSET(&super.root) << 2;
+			if (st->in > compr_len || st->out + st->left > expect) {
+				goto fail;
+			}
+		}
 
-	// Check for sanity
-	if (root_offset == 0) {
-		PRINTF1("empty filesystem\n");
-		return -1;
+		// Skip along to the part we were asked for, then copy it out
+		if (st->out < block_offset) {
+			n = min(st->left, block_offset - st->out);
+		}
+		else {
+			n = min(st->left, end - st->out);
+			if (read_storage(fs, ptr + (st->out - block_offset),
+				start_offset + st->src, n) != n)
+			{
+				goto fail;
+			}
+		}
+
+		st->src += n;
+		st->left -= n;
+		st->out += n;
 	}
-	else if (!(fs->sb.flags & POLYFS_FLAG_SHIFTED_ROOT_OFFSET) &&
-		 (root_offset != sizeof(struct polyfs_super)))
-	{
-		PRINTF("bad root offset %d\n", root_offset);
-		return -1;
+
+	return bytes;
+
+fail:
+	PRINTF1("corrupt LZSS block\n");
+	st->inode_offset = 0;
+	return -1;
+}
+#endif
+
+#if BLOCK_CACHE
+static struct block_cache *cache_find(polyfs_fs_t *fs,
+	uint32_t inode_offset, uint16_t block)
+{
+	for (int i = 0; i < BLOCK_CACHE; i++) {
+		struct block_cache *c = &cache[i];
+
+		if (c->fs == fs &&
+			c->inode_offset == inode_offset &&
+			c->block == block)
+		{
+			cache_touch(c);
+			return c;
+		}
 	}
 
-	// Check the compression algorithms
-#if !CONFIG_LIB_LZO
-	if (fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) {
-		PRINTF1("LZO compression not available\n");
-		return -1;
+	return NULL;
+}
+
+static struct block_cache *cache_find_data(polyfs_fs_t *fs, uint32_t start) {
+	for (int i = 0; i < BLOCK_CACHE; i++) {
+		struct block_cache *c = &cache[i];
+
+		if (c->fs == fs && c->start == start) {
+			cache_touch(c);
+			return c;
+		}
 	}
-#endif
-	if (fs->sb.flags & POLYFS_FLAG_ZLIB_COMPRESSION) {
-		PRINTF1("zlib compression not available\n");
-		return -1;
+
+	return NULL;
+}
+
+static struct block_cache *cache_victim(void) {
+	struct block_cache *victim = &cache[0];
+
+	for (int i = 0; i < BLOCK_CACHE; i++) {
+		// Free entries are always used first
+		if (cache[i].fs == NULL) {
+			victim = &cache[i];
+			break;
+		}
+		else if (cache[i].age > victim->age) {
+			victim = &cache[i];
+		}
 	}
 
-	// Copy the root inode info over to the fs structure
-	memcpy(&fs->root, &super.root, sizeof(super.root));
+	// Make it the oldest entry so cache_touch() ages everything else
+	victim->age = BLOCK_CACHE;
 
-	return 0;
+	return victim;
+}
+
+static void cache_touch(struct block_cache *c) {
+	for (int i = 0; i < BLOCK_CACHE; i++) {
+		if (cache[i].age < c->age) {
+			cache[i].age++;
+		}
+	}
+
+	c->age = 0;
 }
+#endif
 
 // CCITT CRC-32 (Autodin II) polynomial:
 // X32+X26+X23+X22+X16+X12+X11+X10+X8+X7+X5+X4+X2+X+1
 
-static uint32_t crc32(uint32_t crc, uint8_t *buffer, uint32_t length) {
+#if __AVR__
+// Flash is precious on the AVR, so process a nibble at a time
+static const uint32_t crc_table[16] PROGMEM = {
+	0x00000000UL, 0x1db71064UL, 0x3b6e20c8UL, 0x26d930acUL,
+	0x76dc4190UL, 0x6b6b51f4UL, 0x4db26158UL, 0x5005713cUL,
+	0xedb88320UL, 0xf00f9344UL, 0xd6d6a3e8UL, 0xcb61b38cUL,
+	0x9b64c2b0UL, 0x86d3d2d4UL, 0xa00ae278UL, 0xbdbdf21cUL,
+};
+
+static inline uint32_t crc_nibble(uint32_t crc) {
+#if CONFIG_IMAGE_BOOTLOADER
+	// The bootloader lives above 64K so needs far reads
+	return pgm_read_dword_far(pgm_get_far_address(crc_table) +
+		(crc & 0x0f) * sizeof(uint32_t)) ^ (crc >> 4);
+#else
+	return pgm_read_dword(&crc_table[crc & 0x0f]) ^ (crc >> 4);
+#endif
+}
+
+uint32_t polyfs_crc32(uint32_t crc, const void *buffer, uint32_t length) {
+	const uint8_t *cbuf = buffer;
+
 	if (buffer == NULL) {
 		return 0;
 	}
@@ -558,17 +1649,42 @@ static uint32_t crc32(uint32_t crc, uint8_t *buffer, uint32_t length) {
 	crc ^= 0xffffffffUL;
 
 	while (length--) {
-		crc = crc ^ *buffer++;
-		for (int i = 0; i < 8; i++) {
-			if (crc & 1) {
-				crc = (crc >> 1) ^ 0xedb88320UL;
-			}
-			else {
-				crc = crc >> 1;
+		crc ^= *cbuf++;
+		crc = crc_nibble(crc);
+		crc = crc_nibble(crc);
+	}
+
+	return crc ^ 0xffffffffUL;
+}
+#else
+// On the host we can afford a full byte-wide table, built on first use
+static uint32_t crc_table[256];
+
+uint32_t polyfs_crc32(uint32_t crc, const void *buffer, uint32_t length) {
+	const uint8_t *cbuf = buffer;
+
+	if (buffer == NULL) {
+		return 0;
+	}
+
+	if (crc_table[1] == 0) {
+		for (int n = 0; n < 256; n++) {
+			uint32_t c = n;
+
+			for (int i = 0; i < 8; i++) {
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320UL : c >> 1;
 			}
+
+			crc_table[n] = c;
 		}
 	}
 
+	crc ^= 0xffffffffUL;
+
+	while (length--) {
+		crc = crc_table[(crc ^ *cbuf++) & 0xff] ^ (crc >> 8);
+	}
+
 	return crc ^ 0xffffffffUL;
 }
-
+#endif
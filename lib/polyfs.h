@@ -41,6 +41,43 @@ struct polyfs_fs {
 	void *userptr;
 };
 
+#ifdef CONFIG_LIB_POLYFS_BLKPTR_WINDOW
+#define POLYFS_BLKPTR_WINDOW CONFIG_LIB_POLYFS_BLKPTR_WINDOW
+#else
+#define POLYFS_BLKPTR_WINDOW 4
+#endif
+
+#ifdef CONFIG_LIB_POLYFS_READDIR_BATCH
+#define POLYFS_READDIR_BATCH CONFIG_LIB_POLYFS_READDIR_BATCH
+#else
+#define POLYFS_READDIR_BATCH 128
+#endif
+
+#if CONFIG_LIB_POLYFS_LZSS
+// How far into an LZSS block the last read got, so the next one can carry
+// on from there instead of decoding the block from the start again
+typedef struct {
+	uint32_t inode_offset; // file the state belongs to
+	uint16_t block; // block within the file
+	uint16_t out; // uncompressed offset reached within the block
+	uint16_t in; // offset of the next token in the block's data
+	uint16_t src; // where the rest of the current token is copied from
+	uint16_t left; // bytes of the current token still to copy
+} polyfs_lzss_t;
+#endif
+
+// A window of block pointers for one file, which saves reading them from
+// storage on every read. Set count to 0 before first use or whenever the file
+// changes.
+typedef struct {
+	uint16_t base; // first block in the window
+	uint8_t count; // number of blocks in the window (0 if empty)
+	uint32_t ptrs[POLYFS_BLKPTR_WINDOW + 1]; // start of base, then block ends
+#if CONFIG_LIB_POLYFS_LZSS
+	polyfs_lzss_t lzss;
+#endif
+} polyfs_blkptr_t;
+
 typedef struct {
 	polyfs_fs_t *fs;
 	const struct polyfs_inode *parent;
@@ -48,19 +85,61 @@ typedef struct {
 	uint32_t next; // offset of next inode
 	struct polyfs_inode inode; // inode data
 	uint8_t name[POLYFS_MAXPATHLEN];
+
+	uint8_t *batch; // buffer entries are read through (NULL if none)
+	uint16_t batch_size; // size of batch
+	uint16_t batch_len; // valid bytes in batch
+	uint32_t batch_offset; // offset of batch[0]
 } polyfs_readdir_t;
 
+// Cache counters for every fs together
+typedef struct {
+	uint32_t block_hits; // LZO blocks read from the block cache
+	uint32_t block_misses; // LZO blocks that had to be decompressed
+	uint32_t lookup_hits; // paths found in the lookup cache
+	uint32_t lookup_negative; // paths known not to exist
+	uint32_t lookup_walks; // paths looked up the long way
+} polyfs_stats_t;
+
+extern polyfs_stats_t polyfs_stats;
+
 int polyfs_init(void);
 int polyfs_fs_open(polyfs_fs_t *fs);
 
+// Drop any cached data read from fs (or from every fs if fs is NULL)
+void polyfs_cache_flush(polyfs_fs_t *fs);
+
 int polyfs_check_crc(polyfs_fs_t *fs, void *temp, uint16_t tempsize);
 
+// The same check a piece at a time, for doing in the background: zero st,
+// then each polyfs_check_crc_step() reads up to tempsize more bytes through
+// temp and returns 1 until the whole image has been read, then 0 if the CRC
+// matched (or < 0 on error, as polyfs_check_crc() would).
+typedef struct {
+	uint32_t offset; // next byte to read
+	uint32_t size; // filesystem size, from the superblock
+	uint32_t crc; // CRC of the bytes read so far
+	uint32_t expect; // CRC stored in the superblock
+} polyfs_crc_t;
+
+int polyfs_check_crc_step(polyfs_fs_t *fs, polyfs_crc_t *st,
+	void *temp, uint16_t tempsize);
+
+// Update a running CRC-32 (start with crc = 0) with some more data
+uint32_t polyfs_crc32(uint32_t crc, const void *buffer, uint32_t length);
+
 int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
 	void *ptr, uint32_t offset, uint16_t bytes);
+// Same as polyfs_fread() but looks up block pointers through bp
+int32_t polyfs_fread_blkptr(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	polyfs_blkptr_t *bp, void *ptr, uint32_t offset, uint16_t bytes);
 
 int polyfs_opendir(polyfs_fs_t *fs, const struct polyfs_inode *parent,
 	polyfs_readdir_t *rd);
 int polyfs_readdir(polyfs_readdir_t *rd);
+// Read the rest of the directory through buf after polyfs_opendir(), so a
+// run of entries comes from storage in one read rather than one each
+int polyfs_readdir_batch(polyfs_readdir_t *rd, void *buf, uint16_t size);
 
 int polyfs_lookup(polyfs_fs_t *fs, const char *path,
 	struct polyfs_inode *inode);
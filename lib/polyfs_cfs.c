@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include "polyfs_cfs.h"
+#include "vfs.h"
 
 #ifdef CONFIG_LIB_POLYFS_CFS_MAXFDS
 #define MAXFDS CONFIG_LIB_POLYFS_CFS_MAXFDS
@@ -30,15 +31,62 @@
 #define MAXFDS 5
 #endif
 
+#ifdef CONFIG_LIB_POLYFS_CFS_MAXFILES
+#define MAXFILES CONFIG_LIB_POLYFS_CFS_MAXFILES
+#else
+#define MAXFILES MAXFDS
+#endif
+
+#ifdef CONFIG_LIB_POLYFS_CFS_READAHEAD
+#define READAHEAD CONFIG_LIB_POLYFS_CFS_READAHEAD
+#else
+#define READAHEAD 0
+#endif
+
+#ifdef CONFIG_LIB_POLYFS_CFS_READAHEAD_SIZE
+#define READAHEAD_SIZE CONFIG_LIB_POLYFS_CFS_READAHEAD_SIZE
+#else
+#define READAHEAD_SIZE POLYFS_BLOCK_SIZE
+#endif
+
+#if MAXFDS > VFS_FD_MAX + 1
+#error "CONFIG_LIB_POLYFS_CFS_MAXFDS is more than the VFS can address"
+#endif
+
 #define FD_VALID(fd) \
-	(((fd) >= 0) && ((fd) < MAXFDS) && (fds[(fd)].inode.offset != 0))
+	(((fd) >= 0) && ((fd) < MAXFDS) && (fds[(fd)].file != 0))
+#define FD_FILE(fdp) (&files[(fdp)->file - 1])
 #define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
 
-struct polyfs_cfs_fd {
+/*
+ * Every fd open on the same file shares one of these, so they all look
+ * through the same block pointers and read-ahead buffer instead of each
+ * fetching their own copies from storage. Only the offset is per fd.
+ */
+struct polyfs_cfs_file {
 	struct polyfs_inode inode;
+	uint8_t refs; // fds open on the file, 0 if the slot is free
+	polyfs_blkptr_t blkptr;
+#if READAHEAD
+	uint8_t ra; // read-ahead buffer number + 1, or 0 if none
+#endif
+};
+
+struct polyfs_cfs_fd {
+	uint8_t file; // open file number + 1, or 0 if the fd is free
 	uint32_t offset;
 };
 
+#if READAHEAD
+// Data read ahead of the current offset of an fd
+struct polyfs_cfs_ra {
+	uint8_t used;
+	uint16_t bytes; // number of valid bytes in data
+	uint32_t offset; // file offset of data[0]
+	uint8_t data[READAHEAD_SIZE];
+};
+#endif
+
 struct polyfs_cfs_dir {
 	struct polyfs_inode parent;
 	struct polyfs_inode child;
@@ -46,16 +94,19 @@ struct polyfs_cfs_dir {
 };
 
 static inline void build_time_checks_dont_call(void) {
-	BUILD_BUG_ON(sizeof(struct polyfs_cfs_dir) > sizeof(struct cfs_dir));
+	BUILD_BUG_ON(sizeof(struct polyfs_cfs_dir) > VFS_DIR_SPACE);
 }
 
 polyfs_fs_t *polyfs_cfs_fs;
 static struct polyfs_cfs_fd fds[MAXFDS];
+static struct polyfs_cfs_file files[MAXFILES];
+#if READAHEAD
+static struct polyfs_cfs_ra ras[READAHEAD];
+#endif
 
 static int find_free_fd(void) {
 	for (int i = 0; i < MAXFDS; i++) {
-		// PolyFS files all have an offset > 0
-		if (fds[i].inode.offset == 0) {
+		if (fds[i].file == 0) {
 			return i;
 		}
 	}
@@ -63,8 +114,100 @@ static int find_free_fd(void) {
 	return -1;
 }
 
-int cfs_open(const char *name, int flags) {
-	struct polyfs_cfs_fd *fdp;
+// Find the open file for an inode, or a free slot to open it in
+static int find_file(const struct polyfs_inode *inode) {
+	int free = -1;
+
+	for (int i = 0; i < MAXFILES; i++) {
+		if (files[i].refs == 0) {
+			if (free < 0) {
+				free = i;
+			}
+		}
+		else if (memcmp(&files[i].inode, inode, sizeof(*inode)) == 0) {
+			return i;
+		}
+	}
+
+	return free;
+}
+
+#if READAHEAD
+// Grab a free read-ahead buffer for a file, if there is one
+static void ra_get(struct polyfs_cfs_file *fp) {
+	fp->ra = 0;
+
+	// Compressed blocks are already cached by PolyFS
+	if (polyfs_cfs_fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < READAHEAD; i++) {
+		if (!ras[i].used) {
+			ras[i].used = 1;
+			ras[i].bytes = 0;
+			fp->ra = i + 1;
+			return;
+		}
+	}
+}
+
+// Read through the read-ahead buffer of the fd's file
+static int ra_read(struct polyfs_cfs_fd *fdp, uint8_t *buf, unsigned int len) {
+	struct polyfs_cfs_file *fp = FD_FILE(fdp);
+	struct polyfs_cfs_ra *ra = &ras[fp->ra - 1];
+	uint32_t offset = fdp->offset;
+	int total = 0;
+
+	while (len) {
+		// Refill the buffer if we've moved outside it
+		if (offset < ra->offset || offset >= ra->offset + ra->bytes) {
+			// Fetch up to the end of the block in one go
+			uint16_t want = POLYFS_BLOCK_SIZE - (offset % POLYFS_BLOCK_SIZE);
+			if (want > READAHEAD_SIZE) {
+				want = READAHEAD_SIZE;
+			}
+
+			ra->bytes = 0;
+			int32_t ret = polyfs_fread_blkptr(polyfs_cfs_fs, &fp->inode,
+				&fp->blkptr, ra->data, offset, want);
+			if (ret <= 0) {
+				return total ? total : ret;
+			}
+
+			ra->offset = offset;
+			ra->bytes = ret;
+		}
+
+		// Copy out what we can
+		uint16_t avail = ra->offset + ra->bytes - offset;
+		uint16_t n = len < avail ? len : avail;
+		memcpy(buf, &ra->data[offset - ra->offset], n);
+
+		buf += n;
+		offset += n;
+		len -= n;
+		total += n;
+	}
+
+	return total;
+}
+#endif
+
+int polyfs_cfs_set_fs(polyfs_fs_t *fs) {
+	for (int i = 0; i < MAXFILES; i++) {
+		if (files[i].refs) {
+			return -1;
+		}
+	}
+
+	polyfs_cfs_fs = fs;
+	return 0;
+}
+
+static int pfs_open(const char *name, int flags) {
+	struct polyfs_inode inode;
+	struct polyfs_cfs_file *fp;
 	int err;
 
 	// Check the fs pointer is set
@@ -83,36 +226,63 @@ int cfs_open(const char *name, int flags) {
 		return -1;
 	}
 
-	fdp = &fds[fd];
-
 	// Find the file in the filesystem
-	err = polyfs_lookup(polyfs_cfs_fs, name, &fdp->inode);
+	err = polyfs_lookup(polyfs_cfs_fs, name, &inode);
 	if (err) {
-		fdp->inode.offset = 0; // make sure this fd is still free
 		return -1;
 	}
 
 	// Make sure it's a file and not a directory or otherwise
-	if (!S_ISREG(POLYFS_16(fds->inode.mode))) {
-		fdp->inode.offset = 0; // make sure this fd is still free
+	if (!S_ISREG(POLYFS_16(inode.mode))) {
 		return -1;
 	}
 
+	// Share the file with any other fds that have it open
+	int file = find_file(&inode);
+	if (file < 0) {
+		return -1;
+	}
+
+	fp = &files[file];
+	if (fp->refs == 0) {
+		fp->inode = inode;
+		fp->blkptr.count = 0;
+#if READAHEAD
+		ra_get(fp);
+#endif
+	}
+	fp->refs++;
+
 	// Set up the fd
-	fdp->offset = 0;
+	fds[fd].file = file + 1;
+	fds[fd].offset = 0;
 
 	return fd;
 }
 
-void cfs_close(int fd) {
+static void pfs_close(int fd) {
 	if (FD_VALID(fd)) {
-		fds[fd].inode.offset = 0;
+		struct polyfs_cfs_file *fp = FD_FILE(&fds[fd]);
+
+		// The last fd on a file gives up its read-ahead buffer
+		if (--fp->refs == 0) {
+#if READAHEAD
+			if (fp->ra) {
+				ras[fp->ra - 1].used = 0;
+				fp->ra = 0;
+			}
+#endif
+		}
+
+		fds[fd].file = 0;
 		fds[fd].offset = 0;
 	}
 }
 
-int cfs_read(int fd, void *buf, unsigned int len) {
+static int pfs_read(int fd, void *buf, unsigned int len) {
 	struct polyfs_cfs_fd *fdp;
+	struct polyfs_cfs_file *fp;
+	int ret;
 
 	// Check the fs pointer is set
 	if (!polyfs_cfs_fs) {
@@ -124,26 +294,34 @@ int cfs_read(int fd, void *buf, unsigned int len) {
 	}
 
 	fdp = &fds[fd];
+	fp = FD_FILE(fdp);
 
 	// Shorten the read if it would go past the end of file
-	if (fdp->offset + len > fdp->inode.size) {
-		len = fdp->inode.size - fdp->offset;
+	if (fdp->offset + len > fp->inode.size) {
+		len = fp->inode.size - fdp->offset;
 	}
 
-	// Forward the read to PolyFS
-	len = polyfs_fread(polyfs_cfs_fs, &fdp->inode, buf, fdp->offset, len);
-	if (len > 0) {
-		fdp->offset += len;
+#if READAHEAD
+	// Serve the read from the read-ahead buffer if we have one
+	if (fp->ra) {
+		ret = ra_read(fdp, buf, len);
+	}
+	else
+#endif
+	{
+		// Forward the read to PolyFS
+		ret = polyfs_fread_blkptr(polyfs_cfs_fs, &fp->inode, &fp->blkptr,
+			buf, fdp->offset, len);
 	}
 
-	return len;
-}
+	if (ret > 0) {
+		fdp->offset += ret;
+	}
 
-int cfs_write(int fd, const void *buf, unsigned int len) {
-	return -1; // we can't do writes
+	return ret;
 }
 
-cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence) {
+static cfs_offset_t pfs_seek(int fd, cfs_offset_t offset, int whence) {
 	struct polyfs_cfs_fd *fdp;
 	uint32_t new_offset;
 
@@ -163,7 +341,7 @@ cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence) {
 		new_offset = offset;
 	}
 	else if (whence == CFS_SEEK_END) {
-		new_offset = fdp->inode.size + offset;
+		new_offset = FD_FILE(fdp)->inode.size + offset;
 	}
 	else if (whence == CFS_SEEK_CUR) {
 		new_offset = fdp->offset + offset;
@@ -173,7 +351,7 @@ cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence) {
 	}
 
 	// Make sure it doesn't go past the end of file
-	if ((new_offset < 0) || (new_offset > fdp->inode.size)) {
+	if ((new_offset < 0) || (new_offset > FD_FILE(fdp)->inode.size)) {
 		return -1;
 	}
 
@@ -181,16 +359,12 @@ cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence) {
 	return new_offset;
 }
 
-int cfs_remove(const char *name) {
-	return -1; // we can't change the filesystem
-}
-
 /*
  * We have to implement our own opendir and readdir, as the normal polyfs ones
  * expect different sized structures to what we can supply. Thankfully the code
  * is really rather simple.
  */
-int cfs_opendir(struct cfs_dir *dirp, const char *name) {
+static int pfs_opendir(struct cfs_dir *dirp, const char *name) {
 	struct polyfs_cfs_dir *dir = (struct polyfs_cfs_dir *)dirp;
 	int err;
 
@@ -215,10 +389,12 @@ int cfs_opendir(struct cfs_dir *dirp, const char *name) {
 	return 0;
 }
 
-int cfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
+static int pfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
 	struct polyfs_cfs_dir *dir = (struct polyfs_cfs_dir *)dirp;
 	uint32_t start = POLYFS_GET_OFFSET(&dir->parent) << 2;
 	uint32_t psize = POLYFS_24(dir->parent.size);
+	uint8_t buf[sizeof(dir->child) + sizeof(dirent->name) - 1];
+	uint16_t want = sizeof(buf);
 	int len;
 
 	// Check the fs pointer is set
@@ -231,12 +407,16 @@ int cfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
 		return -1;
 	}
 
-	// Read in the inode
-	len = polyfs_cfs_fs->fn_read(polyfs_cfs_fs, &dir->child, dir->next,
-		sizeof(dir->child));
-	if (len != sizeof(dir->child)) {
+	// Read in the inode and as much of the name as we can use in one go,
+	// without running off the end of the directory
+	if (start + psize - dir->next < want) {
+		want = start + psize - dir->next;
+	}
+	len = polyfs_cfs_fs->fn_read(polyfs_cfs_fs, buf, dir->next, want);
+	if (len < (int)sizeof(dir->child)) {
 		return -1;
 	}
+	memcpy(&dir->child, buf, sizeof(dir->child));
 
 	// Work out the length of the filename
 	uint8_t namelen = POLYFS_GET_NAMELEN(&dir->child) << 2;
@@ -244,16 +424,20 @@ int cfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
 		namelen = sizeof(dirent->name) - 1;
 	}
 
-	// Read in the name
-	len = polyfs_cfs_fs->fn_read(polyfs_cfs_fs, dirent->name,
-		dir->next + sizeof(dir->child), namelen);
-	if (len != namelen) {
+	// The whole entry fits in the read unless it was cut short
+	if (namelen > len - sizeof(dir->child)) {
 		return -1;
 	}
+	memcpy(dirent->name, &buf[sizeof(dir->child)], namelen);
 	dirent->name[namelen] = '\0';
 
-	// Advance the pointer
+	// Advance the pointer, skipping any inline data
 	dir->next += sizeof(dir->child) + (POLYFS_GET_NAMELEN(&dir->child) << 2);
+	if ((polyfs_cfs_fs->sb.flags & POLYFS_FLAG_INLINE_DATA) &&
+		POLYFS_IS_INLINE(POLYFS_16(dir->child.mode), dir->child.size))
+	{
+		dir->next += POLYFS_INLINE_SIZE(dir->child.size);
+	}
 
 	// Check for the end of the directory
 	if (dir->next >= (start + psize)) {
@@ -265,7 +449,17 @@ int cfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
 	return 0;
 }
 
-void cfs_closedir(struct cfs_dir *dirp) {
+static void pfs_closedir(struct cfs_dir *dirp) {
 	// no need to do anything
 }
 
+// PolyFS is read-only, so there's no write or remove
+const struct vfs_ops polyfs_cfs_ops = {
+	.open = pfs_open,
+	.close = pfs_close,
+	.read = pfs_read,
+	.seek = pfs_seek,
+	.opendir = pfs_opendir,
+	.readdir = pfs_readdir,
+	.closedir = pfs_closedir,
+};
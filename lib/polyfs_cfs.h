@@ -24,12 +24,18 @@
 #include <polyfs.h>
 #include <cfs/cfs.h>
 
+#include <vfs.h>
+
 /*
  * Contiki CFS interface for PolyFS
  *
  * NOTE: Refer to cfs/cfs.h for all the main filesystem manipulation functions.
+ * They reach PolyFS through the VFS, which mounts it at the root.
  */
 
+// The VFS operations for PolyFS
+extern const struct vfs_ops polyfs_cfs_ops;
+
 
 /**
  * Filesystem reference used by CFS wrapper functions.
@@ -39,4 +45,15 @@
  */
 extern polyfs_fs_t *polyfs_cfs_fs;
 
+/**
+ * Point the CFS wrapper functions at a different filesystem.
+ *
+ * Open files refer to inodes in the current filesystem, so this fails and
+ * changes nothing while any are open. Directories being listed must have been
+ * closed too; they aren't tracked.
+ *
+ * Returns 0 on success or -1 if files are open.
+ */
+int polyfs_cfs_set_fs(polyfs_fs_t *fs);
+
 #endif
@@ -42,8 +42,6 @@ static int pfsdf_read(polyfs_fs_t *fs, void *ptr,
 	uint32_t offset, uint32_t bytes)
 {
 	struct pfsdf_info *iptr = fs->userptr;
-	int err;
-	uint8_t sreg;
 
 	// Check the inputs are in range
 	if (offset >= iptr->bytes) {
@@ -56,13 +54,7 @@ static int pfsdf_read(polyfs_fs_t *fs, void *ptr,
 		bytes = iptr->bytes - offset;
 	}
 
-	// Make sure the flash is ready
-	err = dataflash_read_status(&sreg);
-	if ((err) || (sreg & DATAFLASH_SREG_BUSY)) {
-		return -1;
-	}
-
-	// Read the dataflash
+	// Read the dataflash (the driver waits for any program or erase to finish)
 	return dataflash_read_data(ptr, iptr->offset + offset, bytes);
 }
 
@@ -82,6 +74,10 @@ int pfsdf_open(polyfs_fs_t *fs, uint32_t offset, uint32_t size) {
 		}
 	}
 
+	if (!iptr) {
+		return -1;
+	}
+
 	// Set up the info structure
 	iptr->offset = offset;
 	iptr->bytes = size;
@@ -112,6 +108,9 @@ int pfsdf_close(polyfs_fs_t *fs) {
 		return -1;
 	}
 
+	// Forget anything we cached from this filesystem
+	polyfs_cache_flush(fs);
+
 	// Clear up the info structure
 	struct pfsdf_info *iptr = fs->userptr;
 	iptr->offset = iptr->bytes = 0;
@@ -18,7 +18,238 @@
  * MA 02110-1301, USA.
  */
 
+#include <contiki.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include <init.h>
+#include <settings.h>
+
+#if CONFIG_APPS_SYSLOG
+#include "apps/syslog.h"
+#endif
+#if CONFIG_LIB_OWTEMP
+#include <owtemp.h>
+#endif
+
 #include <prefs.h>
 
+/*
+ * The settings item is a list of entries, one per preference: a hash of the
+ * name, the size of the value and the value itself. Matching entries up by
+ * name rather than position means preferences can come and go between
+ * firmware versions without the others being lost or garbled; anything not
+ * found keeps its default.
+ */
+
+struct prefs_entry {
+	uint16_t hash;
+	uint8_t size;
+} __attribute__((packed));
+
+PROCESS(prefs_process, "Prefs");
+INIT_PROCESS(prefs_process);
+
+struct prefs prefs;
+static uint8_t dirty;
+
+static const char name_uint8[] PROGMEM = "uint8";
+static const char name_uint16[] PROGMEM = "uint16";
+static const char name_uint32[] PROGMEM = "uint32";
+
+const struct prefs_datatype prefs_uint8 PROGMEM = { name_uint8, 1 };
+const struct prefs_datatype prefs_uint16 PROGMEM = { name_uint16, 2 };
+const struct prefs_datatype prefs_uint32 PROGMEM = { name_uint32, 4 };
+
+#if CONFIG_APPS_SYSLOG
+static const char name_syslog_mask[] PROGMEM = "syslog.mask";
+#endif
+#if CONFIG_LIB_OWTEMP
+static const char name_owtemp_interval[] PROGMEM = "owtemp.interval";
+#endif
+
+static const struct prefs_item prefs_items[] PROGMEM = {
+#if CONFIG_APPS_SYSLOG
+	{ name_syslog_mask, &prefs_uint8,
+		offsetof(struct prefs, syslog_mask), LOG_UPTO(LOG_DEBUG) },
+#endif
+#if CONFIG_LIB_OWTEMP
+	{ name_owtemp_interval, &prefs_uint16,
+		offsetof(struct prefs, owtemp_interval), OWTEMP_INTERVAL },
+#endif
+};
+
+#define PREFS_ITEMS (sizeof(prefs_items) / sizeof(prefs_items[0]))
+#define PREFS_RECORD_SIZE \
+	(PREFS_ITEMS * sizeof(struct prefs_entry) + sizeof(struct prefs))
+
+static uint8_t type_size(const struct prefs_item *item) {
+	const struct prefs_datatype *type =
+		(const struct prefs_datatype *)pgm_read_word(&item->type);
+
+	return pgm_read_byte(&type->size);
+}
+
+// FNV-1a, folded to 16 bits
+static uint16_t name_hash(PGM_P name) {
+	uint32_t h = 2166136261UL;
+	char c;
+
+	while ((c = pgm_read_byte(name++))) {
+		h = (h ^ (uint8_t)c) * 16777619UL;
+	}
+
+	return (h >> 16) ^ (h & 0xffff);
+}
+
+const struct prefs_item *prefs_item(uint8_t n) {
+	return n < PREFS_ITEMS ? &prefs_items[n] : NULL;
+}
+
+int prefs_find(const char *name) {
+	for (uint8_t n = 0; n < PREFS_ITEMS; n++) {
+		if (strcmp_P(name, (PGM_P)pgm_read_word(&prefs_items[n].name)) == 0) {
+			return n;
+		}
+	}
+
+	return -1;
+}
+
+uint32_t prefs_get(uint8_t n) {
+	uint32_t value = 0;
+
+	if (n < PREFS_ITEMS) {
+		memcpy(&value,
+			(uint8_t *)&prefs + pgm_read_byte(&prefs_items[n].offset),
+			type_size(&prefs_items[n]));
+	}
+
+	return value;
+}
+
+int prefs_set(uint8_t n, uint32_t value) {
+	uint8_t size;
+
+	if (n >= PREFS_ITEMS) {
+		return -1;
+	}
+
+	size = type_size(&prefs_items[n]);
+	if (size < sizeof(value) && (value >> (size * 8))) {
+		return -1;
+	}
+
+	memcpy((uint8_t *)&prefs + pgm_read_byte(&prefs_items[n].offset),
+		&value, size);
+	prefs_changed();
+
+	return 0;
+}
+
+void prefs_changed(void) {
+	dirty = 1;
+	process_poll(&prefs_process);
+}
+
+int prefs_commit(void) {
+	uint8_t buf[PREFS_RECORD_SIZE];
+	uint8_t *p = buf;
+
+	if (!dirty) {
+		return 0;
+	}
+
+	for (uint8_t n = 0; n < PREFS_ITEMS; n++) {
+		struct prefs_entry e = {
+			.hash = name_hash((PGM_P)pgm_read_word(&prefs_items[n].name)),
+			.size = type_size(&prefs_items[n]),
+		};
+
+		memcpy(p, &e, sizeof(e));
+		p += sizeof(e);
+		memcpy(p, (uint8_t *)&prefs + pgm_read_byte(&prefs_items[n].offset),
+			e.size);
+		p += e.size;
+	}
+
+	if (settings_set_hot(SETTINGS_KEY_PREFS, buf, p - buf) !=
+		SETTINGS_STATUS_OK)
+	{
+		return -1;
+	}
+
+	dirty = 0;
+	return 0;
+}
+
+static void load_entry(const struct prefs_entry *e, const uint8_t *value) {
+	for (uint8_t n = 0; n < PREFS_ITEMS; n++) {
+		if (name_hash((PGM_P)pgm_read_word(&prefs_items[n].name)) == e->hash) {
+			if (type_size(&prefs_items[n]) == e->size) {
+				memcpy((uint8_t *)&prefs +
+					pgm_read_byte(&prefs_items[n].offset), value, e->size);
+			}
+			return;
+		}
+	}
+}
+
+static int prefs_init(void) {
+	uint8_t buf[PREFS_RECORD_SIZE];
+	size_t len = sizeof(buf);
+	size_t pos = 0;
+
+	for (uint8_t n = 0; n < PREFS_ITEMS; n++) {
+		uint32_t def = pgm_read_dword(&prefs_items[n].def);
+
+		memcpy((uint8_t *)&prefs + pgm_read_byte(&prefs_items[n].offset),
+			&def, type_size(&prefs_items[n]));
+	}
+
+	// A record from firmware with more preferences may not fit, but the
+	// entries that do still count
+	if (settings_get(SETTINGS_KEY_PREFS, 0, buf, &len) != SETTINGS_STATUS_OK) {
+		return 0;
+	}
+
+	while (pos + sizeof(struct prefs_entry) <= len) {
+		struct prefs_entry e;
+
+		memcpy(&e, buf + pos, sizeof(e));
+		pos += sizeof(e);
+		if (pos + e.size > len) {
+			break;
+		}
+
+		load_entry(&e, buf + pos);
+		pos += e.size;
+	}
+
+	return 0;
+}
+
+INIT_LIBRARY(prefs, prefs_init);
+
+PROCESS_THREAD(prefs_process, ev, data) {
+	static struct etimer tmr;
+
+	PROCESS_BEGIN();
+
+	while (1) {
+		PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+
+		// Hold off until the changes stop coming
+		do {
+			etimer_set(&tmr, PREFS_COMMIT_DELAY * CLOCK_SECOND);
+			PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL ||
+				etimer_expired(&tmr));
+		} while (ev == PROCESS_EVENT_POLL);
 
+		prefs_commit();
+	}
 
+	PROCESS_END();
+}
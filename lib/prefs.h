@@ -21,18 +21,72 @@
 #ifndef PREFS_H
 #define PREFS_H
 
+#include <stdint.h>
 #include <avr/pgmspace.h>
 
-struct prefs_datatype {
+/*
+ * Named, typed preferences kept in RAM.
+ *
+ * Every preference is a member of struct prefs, which is filled in from the
+ * settings store at boot (with the defaults from the registry in prefs.c for
+ * anything not stored) and then read directly: prefs.owtemp_interval costs
+ * no more than any other global. After changing a member, call
+ * prefs_changed(); the whole struct is written back as one settings item a
+ * little while after the last change, so a burst of changes costs a single
+ * EEPROM write.
+ *
+ * Adding a preference means a member here and an entry in prefs_items[].
+ */
+
+// Seconds to wait after a change before writing the preferences out
+#ifndef CONFIG_LIB_PREFS_COMMIT_DELAY
+#define PREFS_COMMIT_DELAY 10
+#else
+#define PREFS_COMMIT_DELAY CONFIG_LIB_PREFS_COMMIT_DELAY
+#endif
 
+struct prefs_datatype {
+	PGM_P name;
+	uint8_t size; // bytes, unsigned little-endian
 };
 
+extern const struct prefs_datatype prefs_uint8 PROGMEM;
+extern const struct prefs_datatype prefs_uint16 PROGMEM;
+extern const struct prefs_datatype prefs_uint32 PROGMEM;
+
 struct prefs_item {
 	PGM_P name;
-	struct prefs_datatype *type;
-	// default value
+	const struct prefs_datatype *type;
+	uint8_t offset; // within struct prefs
+	uint32_t def; // default value
 };
 
+struct prefs {
+#if CONFIG_APPS_SYSLOG
+	uint8_t syslog_mask; // LOG_MASK() bits of the priorities to log
+#endif
+#if CONFIG_LIB_OWTEMP
+	uint16_t owtemp_interval; // seconds between conversions
+#endif
+} __attribute__((packed));
+
+extern struct prefs prefs;
+
+// The registry entry for preference n, or NULL past the last one
+const struct prefs_item *prefs_item(uint8_t n);
+
+// Look up a preference by name; returns its number, or -1
+int prefs_find(const char *name);
+
+uint32_t prefs_get(uint8_t n);
+
+// Returns -1 if there is no such preference or the value doesn't fit
+int prefs_set(uint8_t n, uint32_t value);
+
+// Schedule writing out the preferences after changing one in place
+void prefs_changed(void);
 
+// Write out the preferences now, if anything changed
+int prefs_commit(void);
 
 #endif // PREFS_H
@@ -0,0 +1,137 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Per-process CPU time, measured with timer1.
+ *
+ * Contiki has no dispatch hook, so each running process found in the
+ * process list has its thread function swapped for profiled_thread(), which
+ * times the real one. Contiki always sets PROCESS_CURRENT() before calling a
+ * thread, so that is how the wrapper finds its entry. Processes are picked up
+ * when they are first seen running (within a period of starting) and stay
+ * wrapped if they exit and start again.
+ *
+ * Time spent in a synchronous post to another process is only counted
+ * against that process.
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <contiki.h>
+#include <init.h>
+#include <trace.h>
+#include "procstat.h"
+
+PROCESS(procstat_process, "procstat");
+INIT_PROCESS(procstat_process);
+
+struct procstat procstat_stats[PROCSTAT_MAX];
+uint8_t procstat_count;
+
+// Ticks spent in nested dispatches, not to be counted by the caller
+static uint16_t nested;
+
+static struct procstat *find(struct process *p) {
+	for (uint8_t i = 0; i < procstat_count; i++) {
+		if (procstat_stats[i].p == p) {
+			return &procstat_stats[i];
+		}
+	}
+
+	return NULL;
+}
+
+static PT_THREAD(profiled_thread(struct pt *pt, process_event_t ev,
+	process_data_t data))
+{
+	struct procstat *s = find(PROCESS_CURRENT());
+	uint16_t outer = nested;
+	uint16_t start, t;
+	char ret;
+
+	nested = 0;
+	TRACE(TRACE_PROC_IN, s - procstat_stats);
+	start = TCNT1;
+	ret = s->thread(pt, ev, data);
+	t = TCNT1 - start;
+	TRACE(TRACE_PROC_OUT, s - procstat_stats);
+
+	// Only our own time (a nested dispatch counted itself)
+	s->ticks += t - nested;
+	if (t - nested > s->max) {
+		s->max = t - nested;
+	}
+	s->events++;
+	if (ev == PROCESS_EVENT_POLL) {
+		s->polls++;
+	}
+
+	nested = outer + t;
+	return ret;
+}
+
+// Wrap any running processes not seen before
+static void sweep(void) {
+	struct process *p;
+
+	for (p = PROCESS_LIST(); p != NULL; p = p->next) {
+		struct procstat *s;
+
+		if (p->thread == profiled_thread ||
+			procstat_count == PROCSTAT_MAX)
+		{
+			continue;
+		}
+
+		s = &procstat_stats[procstat_count++];
+		s->p = p;
+		s->thread = p->thread;
+		p->thread = profiled_thread;
+	}
+}
+
+PROCESS_THREAD(procstat_process, ev, data) {
+	static struct etimer timer;
+	PROCESS_BEGIN();
+
+	// Free-running timer1 at F_CPU / 256
+	TCCR1A = 0;
+	TCCR1B = _BV(CS12);
+
+	// Let everything else start first
+	PROCESS_PAUSE();
+
+	etimer_set(&timer, CLOCK_SECOND * PROCSTAT_PERIOD);
+	while (1) {
+		sweep();
+
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&timer));
+		etimer_reset(&timer);
+
+		for (uint8_t i = 0; i < procstat_count; i++) {
+			struct procstat *s = &procstat_stats[i];
+
+			s->last = s->ticks - s->mark;
+			s->mark = s->ticks;
+		}
+	}
+
+	PROCESS_END();
+}
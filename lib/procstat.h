@@ -0,0 +1,75 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef PROCSTAT_H
+#define PROCSTAT_H
+
+#include <stdint.h>
+#include <contiki.h>
+
+// Most processes that can be tracked
+#ifndef CONFIG_LIB_PROCSTAT_MAX
+#define PROCSTAT_MAX 24
+#else
+#define PROCSTAT_MAX CONFIG_LIB_PROCSTAT_MAX
+#endif
+
+// Seconds between snapshots of the figures
+#ifndef CONFIG_LIB_PROCSTAT_PERIOD
+#define PROCSTAT_PERIOD 5
+#else
+#define PROCSTAT_PERIOD CONFIG_LIB_PROCSTAT_PERIOD
+#endif
+
+// Profiling timer ticks (timer1 from F_CPU / 256) to microseconds (for
+// short times) and milliseconds (without overflowing on long ones)
+#define PROCSTAT_TICKS_US(t) ((uint32_t)(t) * 256 / (F_CPU / 1000000))
+#define PROCSTAT_TICKS_MS(t) \
+	((uint32_t)(t) / (F_CPU / 1000) * 256 + \
+	 (uint32_t)(t) % (F_CPU / 1000) * 256 / (F_CPU / 1000))
+
+struct procstat {
+	struct process *p;
+	PT_THREAD((*thread)(struct pt *, process_event_t, process_data_t));
+
+	// Since the process was first seen
+	uint32_t ticks; // time spent in the process itself
+	uint16_t max; // longest single dispatch (ticks)
+	uint16_t events; // dispatches, including polls
+	uint16_t polls;
+
+	// For the last whole period
+	uint32_t last; // ticks spent
+	uint32_t mark; // private: ticks at the start of the period
+};
+
+// Processes seen so far (stats[0] to stats[count - 1])
+extern struct procstat procstat_stats[PROCSTAT_MAX];
+extern uint8_t procstat_count;
+
+// Ticks in the last whole period
+#define PROCSTAT_PERIOD_TICKS ((uint32_t)PROCSTAT_PERIOD * (F_CPU / 256))
+
+// Longest event queue seen (Contiki's own count)
+#if PROCESS_CONF_STATS
+extern process_num_events_t process_maxevents;
+#endif
+
+#endif
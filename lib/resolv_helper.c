@@ -26,14 +26,27 @@
 #include "pton.h"
 
 #include "apps/network.h"
+#include "apps/resolv.h"
 
-#define EXPIRE_TTL 3600
+// See if the resolver already has an answer for st (kept for as long as
+// its TTL), which saves everyone who wants the same name asking for it
+static int cached(struct resolv_helper_status *st) {
+	uint32_t ttl;
+	uip_ipaddr_t *ip = resolv_lookup_ttl(st->name, &ttl);
+
+	if (!ip) {
+		return 0;
+	}
+
+	st->state = RESOLV_HELPER_STATE_DONE;
+	stimer_set(&st->expire, ttl);
+	st->ipaddr = *ip;
+	return 1;
+}
 
 PT_THREAD(resolv_helper(struct resolv_helper_status *st,
 	process_event_t ev, void *data))
 {
-	uip_ipaddr_t *ip = NULL;
-
 	PT_BEGIN(&st->pt);
 
 	// Check if the string is in fact an IP address
@@ -49,24 +62,20 @@ PT_THREAD(resolv_helper(struct resolv_helper_status *st,
 
 	PT_WAIT_UNTIL(&st->pt, net_status.configured);
 
-	// Send the query
-	resolv_query(st->name);
+	if (!cached(st)) {
+		// Send the query (or join one already going)
+		resolv_query(st->name);
 
-	// Wait until we get a query resolved event for our hostname
-	PT_WAIT_UNTIL(&st->pt,
-		(ev == resolv_event_found) &&
-		(strncmp(data, st->name, sizeof(st->name)) == 0));
+		// Wait until we get a query resolved event for our hostname
+		PT_WAIT_UNTIL(&st->pt,
+			(ev == resolv_event_found) &&
+			(strncmp(data, st->name, sizeof(st->name)) == 0));
 
-	// Lookup the resolved address
-	ip = resolv_lookup(st->name);
+		cached(st);
+	}
 
 	// Check if the resolver managed to find an IP
-	if (ip) {
-		// Set up the status structure
-		st->state = RESOLV_HELPER_STATE_DONE;
-		stimer_set(&st->expire, EXPIRE_TTL);
-		st->ipaddr = *ip;
-
+	if (st->state == RESOLV_HELPER_STATE_DONE) {
 		// Wait until the TTL expires
 		PT_WAIT_UNTIL(&st->pt, stimer_expired(&st->expire));
 
@@ -0,0 +1,228 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Single producer, single consumer byte rings, for handing data between an
+ * interrupt handler and the main loop without turning interrupts off.
+ *
+ * The producer only ever writes head and the consumer only ever writes
+ * tail, and both are a single byte, so each side can read the other's
+ * index at any time and see either the old value or the new one. One slot
+ * is always left empty so that a full ring can be told from an empty one.
+ * Data is written before head moves on to cover it and read before tail
+ * moves on to give it back, with a compiler barrier in between so the
+ * buffer itself doesn't have to be volatile.
+ *
+ * The size is fixed at compile time and has to be a power of two no bigger
+ * than 256:
+ *
+ *	static RINGBUF(64) rx;
+ *
+ * Everything takes a pointer to the ring, and is inline so the mask ends
+ * up as a constant.
+ */
+
+struct ringbuf {
+	volatile uint8_t head; // next slot the producer fills
+	volatile uint8_t tail; // next slot the consumer empties
+};
+
+// The zero-width bitfield is only there to fail on a bad size
+#define RINGBUF(size) \
+	struct { \
+		struct ringbuf idx; \
+		uint8_t buf[size]; \
+		unsigned int : (((size) & ((size) - 1)) || (size) > 256 ? -1 : 0); \
+	}
+
+#define RINGBUF_MASK(rb) ((uint8_t)(sizeof((rb)->buf) - 1))
+#define RINGBUF_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+static inline uint8_t __ringbuf_used(const struct ringbuf *r, uint8_t mask) {
+	return (r->head - r->tail) & mask;
+}
+
+static inline uint8_t __ringbuf_space(const struct ringbuf *r, uint8_t mask) {
+	return (r->tail - r->head - 1) & mask;
+}
+
+static inline int __ringbuf_put(struct ringbuf *r, uint8_t *buf,
+	uint8_t mask, uint8_t c)
+{
+	uint8_t head = r->head;
+	uint8_t next = (head + 1) & mask;
+
+	if (next == r->tail) {
+		return -1;
+	}
+
+	RINGBUF_BARRIER();
+	buf[head] = c;
+	RINGBUF_BARRIER();
+	r->head = next;
+	return 0;
+}
+
+static inline int __ringbuf_get(struct ringbuf *r, const uint8_t *buf,
+	uint8_t mask)
+{
+	uint8_t tail = r->tail;
+	uint8_t c;
+
+	if (tail == r->head) {
+		return -1;
+	}
+
+	RINGBUF_BARRIER();
+	c = buf[tail];
+	RINGBUF_BARRIER();
+	r->tail = (tail + 1) & mask;
+	return c;
+}
+
+// The free space that follows on from head without wrapping: a slot the
+// tail is right behind stays empty
+static inline uint8_t __ringbuf_write_span(struct ringbuf *r, uint8_t *buf,
+	uint8_t mask, uint8_t **p)
+{
+	uint8_t head = r->head;
+	uint8_t tail = r->tail;
+
+	RINGBUF_BARRIER();
+	*p = &buf[head];
+	if (tail > head) {
+		return tail - head - 1;
+	}
+	return mask - head + (tail != 0);
+}
+
+// The data that follows on from tail without wrapping
+static inline uint8_t __ringbuf_read_span(struct ringbuf *r, uint8_t *buf,
+	uint8_t mask, uint8_t **p)
+{
+	uint8_t tail = r->tail;
+	uint8_t head = r->head;
+
+	RINGBUF_BARRIER();
+	*p = &buf[tail];
+	if (head >= tail) {
+		return head - tail;
+	}
+	return mask - tail + 1;
+}
+
+static inline void __ringbuf_produce(struct ringbuf *r, uint8_t mask,
+	uint8_t n)
+{
+	RINGBUF_BARRIER();
+	r->head = (r->head + n) & mask;
+}
+
+static inline void __ringbuf_consume(struct ringbuf *r, uint8_t mask,
+	uint8_t n)
+{
+	RINGBUF_BARRIER();
+	r->tail = (r->tail + n) & mask;
+}
+
+static inline unsigned int __ringbuf_write(struct ringbuf *r, uint8_t *buf,
+	uint8_t mask, const void *data, unsigned int len)
+{
+	const uint8_t *src = data;
+	uint8_t *p;
+	uint8_t n;
+
+	// At most twice: up to the end of the buffer, then from the start
+	while (len && (n = __ringbuf_write_span(r, buf, mask, &p))) {
+		if (n > len) {
+			n = len;
+		}
+		memcpy(p, src, n);
+		__ringbuf_produce(r, mask, n);
+		src += n;
+		len -= n;
+	}
+
+	return src - (const uint8_t *)data;
+}
+
+static inline unsigned int __ringbuf_read(struct ringbuf *r, uint8_t *buf,
+	uint8_t mask, void *data, unsigned int len)
+{
+	uint8_t *dst = data;
+	uint8_t *p;
+	uint8_t n;
+
+	while (len && (n = __ringbuf_read_span(r, buf, mask, &p))) {
+		if (n > len) {
+			n = len;
+		}
+		memcpy(dst, p, n);
+		__ringbuf_consume(r, mask, n);
+		dst += n;
+		len -= n;
+	}
+
+	return dst - (uint8_t *)data;
+}
+
+// Only while neither side is using it
+#define ringbuf_init(rb) \
+	((rb)->idx.head = (rb)->idx.tail = 0)
+
+// Bytes waiting to be read, and room to write more
+#define ringbuf_used(rb) \
+	__ringbuf_used(&(rb)->idx, RINGBUF_MASK(rb))
+#define ringbuf_space(rb) \
+	__ringbuf_space(&(rb)->idx, RINGBUF_MASK(rb))
+
+// Producer: add one byte, or -1 if the ring is full
+#define ringbuf_put(rb, c) \
+	__ringbuf_put(&(rb)->idx, (rb)->buf, RINGBUF_MASK(rb), (c))
+// Consumer: take one byte, or -1 if the ring is empty
+#define ringbuf_get(rb) \
+	__ringbuf_get(&(rb)->idx, (rb)->buf, RINGBUF_MASK(rb))
+
+// Producer: copy in as much of len bytes as fits, returning how many
+#define ringbuf_write(rb, data, len) \
+	__ringbuf_write(&(rb)->idx, (rb)->buf, RINGBUF_MASK(rb), (data), (len))
+// Consumer: copy out up to len bytes, returning how many
+#define ringbuf_read(rb, data, len) \
+	__ringbuf_read(&(rb)->idx, (rb)->buf, RINGBUF_MASK(rb), (data), (len))
+
+// Work on the buffer in place: a span sets *p and returns how many bytes
+// can be written (or read) there, and produce (or consume) hands over the
+// n of them that were
+#define ringbuf_write_span(rb, p) \
+	__ringbuf_write_span(&(rb)->idx, (rb)->buf, RINGBUF_MASK(rb), (p))
+#define ringbuf_produce(rb, n) \
+	__ringbuf_produce(&(rb)->idx, RINGBUF_MASK(rb), (n))
+#define ringbuf_read_span(rb, p) \
+	__ringbuf_read_span(&(rb)->idx, (rb)->buf, RINGBUF_MASK(rb), (p))
+#define ringbuf_consume(rb, n) \
+	__ringbuf_consume(&(rb)->idx, RINGBUF_MASK(rb), (n))
+
+#endif // RINGBUF_H
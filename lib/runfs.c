@@ -0,0 +1,249 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include <contiki.h>
+
+#include "runfs.h"
+#if CONFIG_LIB_MEMSTAT
+#include "memstat.h"
+#endif
+#if CONFIG_DRIVERS_WALLCLOCK
+#include "drivers/wallclock.h"
+#endif
+
+struct runfs_file {
+	PGM_P name;
+	// Write the contents into buf, returning the length or -1
+	int (*fill)(char *buf, uint8_t size);
+};
+
+struct runfs_fd {
+	uint8_t used;
+	uint8_t len;
+	uint8_t offset;
+	char data[RUNFS_SIZE];
+};
+
+struct runfs_dir {
+	uint8_t next; // file number to list next
+};
+
+static struct runfs_fd fds[RUNFS_MAXFDS];
+
+#define FD_VALID(fd) ((fd) >= 0 && (fd) < RUNFS_MAXFDS && fds[(fd)].used)
+#define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
+
+static inline void build_time_checks_dont_call(void) {
+	BUILD_BUG_ON(sizeof(struct runfs_dir) > VFS_DIR_SPACE);
+	BUILD_BUG_ON(RUNFS_SIZE > 255);
+	BUILD_BUG_ON(RUNFS_MAXFDS > VFS_FD_MAX + 1);
+}
+
+static int fill_uptime(char *buf, uint8_t size) {
+	return snprintf_P(buf, size, PSTR("%lu\n"), clock_seconds());
+}
+
+#if CONFIG_DRIVERS_WALLCLOCK
+static int fill_time(char *buf, uint8_t size) {
+	return snprintf_P(buf, size, PSTR("%lu\n"), wallclock_seconds());
+}
+#endif
+
+#if CONFIG_LIB_MEMSTAT
+static int fill_memory(char *buf, uint8_t size) {
+	return snprintf_P(buf, size, PSTR("%u %u %u %u\n"),
+		memstat.heap_free, memstat.heap_largest,
+		memstat.heap_min, memstat.stack_min);
+}
+#endif
+
+static const char name_uptime[] PROGMEM = "uptime";
+#if CONFIG_DRIVERS_WALLCLOCK
+static const char name_time[] PROGMEM = "time";
+#endif
+#if CONFIG_LIB_MEMSTAT
+static const char name_memory[] PROGMEM = "memory";
+#endif
+
+static const struct runfs_file files[] PROGMEM = {
+	{ name_uptime, fill_uptime },
+#if CONFIG_DRIVERS_WALLCLOCK
+	{ name_time, fill_time },
+#endif
+#if CONFIG_LIB_MEMSTAT
+	{ name_memory, fill_memory },
+#endif
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+// Make a file's contents, cut short to fit the buffer if need be
+static int fill(const struct runfs_file *file, char *buf) {
+	int len = file->fill(buf, RUNFS_SIZE);
+
+	// snprintf() returns the length it wanted, not what it wrote
+	if (len >= RUNFS_SIZE) {
+		len = RUNFS_SIZE - 1;
+	}
+
+	return len;
+}
+
+static int runfs_open(const char *name, int flags) {
+	struct runfs_file file;
+	uint8_t i;
+	int fd, len;
+
+	if (flags != CFS_READ || *name++ != '/') {
+		return -1;
+	}
+
+	for (i = 0; i < NUM_FILES; i++) {
+		memcpy_P(&file, &files[i], sizeof(file));
+		if (strcmp_P(name, file.name) == 0) {
+			break;
+		}
+	}
+	if (i == NUM_FILES) {
+		return -1;
+	}
+
+	for (fd = 0; fd < RUNFS_MAXFDS; fd++) {
+		if (!fds[fd].used) {
+			break;
+		}
+	}
+	if (fd == RUNFS_MAXFDS) {
+		return -1;
+	}
+
+	len = fill(&file, fds[fd].data);
+	if (len < 0) {
+		return -1;
+	}
+
+	fds[fd].used = 1;
+	fds[fd].len = len;
+	fds[fd].offset = 0;
+
+	return fd;
+}
+
+static void runfs_close(int fd) {
+	if (FD_VALID(fd)) {
+		fds[fd].used = 0;
+	}
+}
+
+static int runfs_read(int fd, void *buf, unsigned int len) {
+	struct runfs_fd *fdp;
+
+	if (!FD_VALID(fd)) {
+		return -1;
+	}
+
+	fdp = &fds[fd];
+	if (len > (unsigned int)(fdp->len - fdp->offset)) {
+		len = fdp->len - fdp->offset;
+	}
+
+	memcpy(buf, &fdp->data[fdp->offset], len);
+	fdp->offset += len;
+
+	return len;
+}
+
+static cfs_offset_t runfs_seek(int fd, cfs_offset_t offset, int whence) {
+	struct runfs_fd *fdp;
+
+	if (!FD_VALID(fd)) {
+		return -1;
+	}
+
+	fdp = &fds[fd];
+	if (whence == CFS_SEEK_END) {
+		offset += fdp->len;
+	}
+	else if (whence == CFS_SEEK_CUR) {
+		offset += fdp->offset;
+	}
+	else if (whence != CFS_SEEK_SET) {
+		return -1;
+	}
+
+	if (offset < 0 || offset > fdp->len) {
+		return -1;
+	}
+
+	fdp->offset = offset;
+	return offset;
+}
+
+static int runfs_opendir(struct cfs_dir *dirp, const char *name) {
+	struct runfs_dir *dir = (struct runfs_dir *)dirp;
+
+	// It's all one directory
+	if (name[0] != '\0' && strcmp_P(name, PSTR("/")) != 0) {
+		return -1;
+	}
+
+	dir->next = 0;
+	return 0;
+}
+
+static int runfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
+	struct runfs_dir *dir = (struct runfs_dir *)dirp;
+	struct runfs_file file;
+	char data[RUNFS_SIZE];
+	int len;
+
+	if (dir->next >= NUM_FILES) {
+		return -1;
+	}
+
+	memcpy_P(&file, &files[dir->next++], sizeof(file));
+	strncpy_P(dirent->name, file.name, sizeof(dirent->name) - 1);
+	dirent->name[sizeof(dirent->name) - 1] = '\0';
+
+	// The size is only right as of now, but that's all there is
+	len = fill(&file, data);
+	dirent->size = len < 0 ? 0 : len;
+
+	return 0;
+}
+
+static void runfs_closedir(struct cfs_dir *dirp) {
+	// nothing to do
+}
+
+const struct vfs_ops runfs_ops = {
+	.open = runfs_open,
+	.close = runfs_close,
+	.read = runfs_read,
+	.seek = runfs_seek,
+	.opendir = runfs_opendir,
+	.readdir = runfs_readdir,
+	.closedir = runfs_closedir,
+};
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef RUNFS_H
+#define RUNFS_H
+
+#include <vfs.h>
+
+/*
+ * Small read-only status files, for mounting at /run. A file's contents
+ * are made when it's opened, so its size is known up front and it can be
+ * read and seeked like any other.
+ */
+
+// Files open at once
+#ifndef CONFIG_LIB_RUNFS_MAXFDS
+#define RUNFS_MAXFDS 2
+#else
+#define RUNFS_MAXFDS CONFIG_LIB_RUNFS_MAXFDS
+#endif
+
+// Largest file contents
+#ifndef CONFIG_LIB_RUNFS_SIZE
+#define RUNFS_SIZE 48
+#else
+#define RUNFS_SIZE CONFIG_LIB_RUNFS_SIZE
+#endif
+
+extern const struct vfs_ops runfs_ops;
+
+#endif // RUNFS_H
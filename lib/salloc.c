@@ -0,0 +1,146 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "salloc.h"
+
+#if SALLOC_32 > 254 || SALLOC_64 > 254 || SALLOC_128 > 254 || \
+	SALLOC_256 > 254 || SALLOC_512 > 254
+#error At most 254 blocks of each size
+#endif
+
+// Where each class starts in the arena; classes go up in size
+#define CLASS_0 0
+#define CLASS_1 (CLASS_0 + SALLOC_32 * 32U)
+#define CLASS_2 (CLASS_1 + SALLOC_64 * 64U)
+#define CLASS_3 (CLASS_2 + SALLOC_128 * 128U)
+#define CLASS_4 (CLASS_3 + SALLOC_256 * 256U)
+#define ARENA_SIZE (CLASS_4 + SALLOC_512 * 512U)
+
+#if ARENA_SIZE == 0
+#error LIB_SALLOC needs some blocks
+#endif
+
+static uint8_t arena[ARENA_SIZE];
+
+static const uint16_t class_start[SALLOC_CLASSES + 1] = {
+	CLASS_0, CLASS_1, CLASS_2, CLASS_3, CLASS_4, ARENA_SIZE,
+};
+
+struct salloc_class salloc_classes[SALLOC_CLASSES] = {
+	{ .count = SALLOC_32 },
+	{ .count = SALLOC_64 },
+	{ .count = SALLOC_128 },
+	{ .count = SALLOC_256 },
+	{ .count = SALLOC_512 },
+};
+
+uint16_t salloc_heap;
+
+static uint8_t *block(uint8_t c, uint8_t i) {
+	return &arena[class_start[c] + ((uint16_t)i << (SALLOC_MIN_SHIFT + c))];
+}
+
+// Pop a free block, or take one that's never been used; a free block holds
+// the next one's number (plus one) in its first byte
+static void *take(uint8_t c) {
+	struct salloc_class *cl = &salloc_classes[c];
+	uint8_t *p;
+
+	if (cl->free) {
+		p = block(c, cl->free - 1);
+		cl->free = p[0];
+	}
+	else if (cl->fresh < cl->count) {
+		p = block(c, cl->fresh++);
+	}
+	else {
+		if (cl->count) {
+			cl->fails++;
+		}
+		return NULL;
+	}
+
+	if (++cl->used > cl->peak) {
+		cl->peak = cl->used;
+	}
+	return p;
+}
+
+void *salloc(size_t size) {
+	uint8_t c = 0;
+	void *p;
+
+	while (c < SALLOC_CLASSES && size > SALLOC_SIZE(c)) {
+		c++;
+	}
+
+	for (; c < SALLOC_CLASSES; c++) {
+		p = take(c);
+		if (p) {
+			return p;
+		}
+	}
+
+	salloc_heap++;
+	return malloc(size);
+}
+
+void *scalloc(size_t n, size_t size) {
+	void *p;
+
+	if (n && size > SIZE_MAX / n) {
+		return NULL;
+	}
+
+	size *= n;
+	p = salloc(size);
+	if (p) {
+		memset(p, 0, size);
+	}
+
+	return p;
+}
+
+void sfree(void *p) {
+	uint16_t off = (uint8_t *)p - arena;
+	struct salloc_class *cl;
+	uint8_t c = 0;
+	uint8_t i;
+
+	// Anything outside the arena (including NULL) came from malloc()
+	if ((uint8_t *)p < arena || off >= ARENA_SIZE) {
+		free(p);
+		return;
+	}
+
+	while (off >= class_start[c + 1]) {
+		c++;
+	}
+
+	cl = &salloc_classes[c];
+	i = (off - class_start[c]) >> (SALLOC_MIN_SHIFT + c);
+	((uint8_t *)p)[0] = cl->free;
+	cl->free = i + 1;
+	cl->used--;
+}
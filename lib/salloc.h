@@ -0,0 +1,96 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SALLOC_H
+#define SALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Segregated-fit allocator for the small allocations that come and go.
+ *
+ * A fixed arena is split into blocks of a few power-of-two sizes, a
+ * configured number of each, and each size keeps its own free list, so an
+ * allocation or a free is a pop or a push and the arena can never fragment:
+ * a free block is always exactly the size the next request of its class
+ * needs. A request goes to the smallest class that holds it, or the next
+ * one up if that has run out, and only goes to malloc() when it's bigger
+ * than the largest class or every class that would do is full.
+ *
+ * Use it through memstat_malloc() and memstat_free(), which come here with
+ * LIB_SALLOC.
+ */
+
+// Blocks of each size; a class with none is skipped
+#ifndef CONFIG_LIB_SALLOC_32
+#define SALLOC_32 0
+#else
+#define SALLOC_32 CONFIG_LIB_SALLOC_32
+#endif
+
+#ifndef CONFIG_LIB_SALLOC_64
+#define SALLOC_64 0
+#else
+#define SALLOC_64 CONFIG_LIB_SALLOC_64
+#endif
+
+#ifndef CONFIG_LIB_SALLOC_128
+#define SALLOC_128 0
+#else
+#define SALLOC_128 CONFIG_LIB_SALLOC_128
+#endif
+
+#ifndef CONFIG_LIB_SALLOC_256
+#define SALLOC_256 0
+#else
+#define SALLOC_256 CONFIG_LIB_SALLOC_256
+#endif
+
+#ifndef CONFIG_LIB_SALLOC_512
+#define SALLOC_512 0
+#else
+#define SALLOC_512 CONFIG_LIB_SALLOC_512
+#endif
+
+#define SALLOC_CLASSES 5
+#define SALLOC_MIN_SHIFT 5 // the first class, 32 bytes
+
+#define SALLOC_SIZE(c) (1U << (SALLOC_MIN_SHIFT + (c)))
+
+struct salloc_class {
+	uint8_t count; // blocks in the class
+	uint8_t free; // first free block plus one, or 0 if there isn't one
+	uint8_t fresh; // blocks from here on have never been handed out
+	uint8_t used; // blocks handed out now
+	uint8_t peak; // most ever handed out at once
+	uint16_t fails; // requests that wanted this class and found it full
+};
+
+extern struct salloc_class salloc_classes[SALLOC_CLASSES];
+
+// Requests that went to malloc() in the end
+extern uint16_t salloc_heap;
+
+void *salloc(size_t size);
+void *scalloc(size_t n, size_t size);
+void sfree(void *p);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Sensor sample history. Every SENSORLOG_INTERVAL the latest good owtemp
+ * readings are added to a ring of samples for each sensor, and the average,
+ * minimum and maximum of the ring are kept up to date as samples come and go.
+ * Everything that reports on sensors reads from here (or from owtemp), so
+ * there is never any more bus traffic however many clients are asking.
+ */
+
+#include <string.h>
+#include <contiki.h>
+#include <init.h>
+#include "sensorlog.h"
+#include "owtemp.h"
+
+#if !CONFIG_LIB_OWTEMP
+#error "sensorlog takes its samples from owtemp (LIB_OWTEMP)"
+#endif
+
+PROCESS(sensorlog_process, "sensorlog");
+INIT_PROCESS(sensorlog_process);
+
+sensorlog_t sensorlog[SENSORLOG_SENSORS];
+process_event_t sensorlog_event;
+struct notify sensorlog_notify;
+
+static struct etimer tmr;
+
+int16_t sensorlog_sample(const sensorlog_t *s, uint8_t n) {
+	return s->history[(s->head + SENSORLOG_HISTORY - 1 - n) %
+		SENSORLOG_HISTORY];
+}
+
+int16_t sensorlog_avg(const sensorlog_t *s) {
+	// Round to nearest rather than towards zero
+	if (s->sum < 0) {
+		return (s->sum - s->count / 2) / s->count;
+	}
+	return (s->sum + s->count / 2) / s->count;
+}
+
+// Find the sensor for a reading, or a free slot for it
+static sensorlog_t *lookup(const owtemp_reading_t *r) {
+	sensorlog_t *free = NULL;
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		sensorlog_t *s = &sensorlog[i];
+
+		if (!s->used) {
+			if (!free) {
+				free = s;
+			}
+		}
+		else if (s->channel == r->channel &&
+			!memcmp(&s->addr, &r->addr, sizeof(s->addr)))
+		{
+			return s;
+		}
+	}
+
+	if (free) {
+		memcpy(&free->addr, &r->addr, sizeof(free->addr));
+		free->channel = r->channel;
+		free->type = SENSORLOG_TYPE_TEMP;
+		free->used = 1;
+		free->head = 0;
+		free->count = 0;
+		free->sum = 0;
+		free->time = 0;
+	}
+
+	return free;
+}
+
+// Add a sample, dropping the oldest once history is full
+static void add(sensorlog_t *s, int16_t value) {
+	uint8_t rescan = 0;
+
+	if (s->count == SENSORLOG_HISTORY) {
+		int16_t old = s->history[s->head];
+
+		s->sum -= old;
+		rescan = (old == s->min || old == s->max);
+	}
+	else {
+		s->count++;
+	}
+
+	s->history[s->head] = value;
+	s->head = (s->head + 1) % SENSORLOG_HISTORY;
+	s->sum += value;
+
+	if (rescan) {
+		// Only needed when the sample leaving was the minimum or maximum
+		s->min = s->max = value;
+		for (uint8_t i = 1; i < s->count; i++) {
+			int16_t v = sensorlog_sample(s, i);
+
+			if (v < s->min) {
+				s->min = v;
+			}
+			if (v > s->max) {
+				s->max = v;
+			}
+		}
+	}
+	else if (s->count == 1) {
+		s->min = s->max = value;
+	}
+	else {
+		if (value < s->min) {
+			s->min = value;
+		}
+		if (value > s->max) {
+			s->max = value;
+		}
+	}
+}
+
+static void sample(void) {
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		sensorlog[i].mark = 0;
+	}
+
+	for (uint8_t i = 0; i < OWTEMP_SENSORS; i++) {
+		const owtemp_reading_t *r = &owtemp_readings[i];
+		sensorlog_t *s;
+
+		if (!r->used || !(s = lookup(r))) {
+			continue;
+		}
+
+		s->mark = 1;
+
+		// Only new good readings make samples, so a sensor that can't be
+		// read just stops getting them
+		if (r->valid && r->time != s->time) {
+			add(s, r->temp);
+			s->time = r->time;
+		}
+	}
+
+	// Drop the sensors that have gone away
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		if (!sensorlog[i].mark) {
+			sensorlog[i].used = 0;
+		}
+	}
+}
+
+PROCESS_THREAD(sensorlog_process, ev, data) {
+	PROCESS_BEGIN();
+
+	sensorlog_event = process_alloc_event();
+
+	while (1) {
+		etimer_set(&tmr, SENSORLOG_INTERVAL * CLOCK_SECOND);
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&tmr));
+
+		sample();
+
+		notify_post(&sensorlog_notify, sensorlog_event, NULL);
+	}
+
+	PROCESS_END();
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SENSORLOG_H
+#define SENSORLOG_H
+
+#include <contiki.h>
+#include <notify.h>
+#include <onewire.h>
+
+// Maximum number of sensors logged
+#ifndef CONFIG_LIB_SENSORLOG_SENSORS
+#define SENSORLOG_SENSORS 8
+#else
+#define SENSORLOG_SENSORS CONFIG_LIB_SENSORLOG_SENSORS
+#endif
+
+// Samples kept for each sensor (at most 255)
+#ifndef CONFIG_LIB_SENSORLOG_HISTORY
+#define SENSORLOG_HISTORY 32
+#else
+#define SENSORLOG_HISTORY CONFIG_LIB_SENSORLOG_HISTORY
+#endif
+
+// Seconds between samples
+#ifndef CONFIG_LIB_SENSORLOG_INTERVAL
+#define SENSORLOG_INTERVAL 60
+#else
+#define SENSORLOG_INTERVAL CONFIG_LIB_SENSORLOG_INTERVAL
+#endif
+
+#define SENSORLOG_TYPE_TEMP 1 // samples in 1/16 degrees C
+
+typedef struct {
+	ow_addr_t addr;
+	uint8_t channel; // DS2482-800 channel
+	uint8_t type; // SENSORLOG_TYPE_*
+	uint8_t used : 1;
+	uint8_t mark : 1; // private
+	uint8_t head; // history slot the next sample goes in
+	uint8_t count; // samples in history
+	int16_t history[SENSORLOG_HISTORY]; // oldest overwritten first
+	int32_t sum; // of the samples in history
+	int16_t min; // of the samples in history
+	int16_t max;
+	uint32_t time; // clock_seconds() of the latest sample
+} sensorlog_t;
+
+// Sample history for the sensors found, with gaps where sensors have gone
+extern sensorlog_t sensorlog[SENSORLOG_SENSORS];
+
+// Posted to sensorlog_notify's subscribers after each round of samples
+extern process_event_t sensorlog_event;
+extern struct notify sensorlog_notify;
+
+// Sample n back from the latest one (n must be less than count)
+int16_t sensorlog_sample(const sensorlog_t *s, uint8_t n);
+
+// Average of the samples in history (count must not be 0)
+int16_t sensorlog_avg(const sensorlog_t *s);
+
+#endif // SENSORLOG_H
@@ -0,0 +1,707 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Sensor history kept in a ring of dataflash pages, laid out like the flash
+ * log: each 256-byte page has a sequence number, is filled in RAM and then
+ * programmed in one go, and the 4K sector ahead is erased as the ring
+ * reaches it.
+ *
+ * A page holds rounds of sensorlog samples. Its header has the time of the
+ * first round and a table of the sensors in it with their first samples;
+ * after that, each round is the delta of its time delta to the one before,
+ * then each sensor's change from its last sample, in table order. Rounds
+ * normally come at a fixed interval and temperatures move slowly, so most
+ * rounds take one byte plus one per sensor. Every page decodes on its own.
+ *
+ * Each token is a zigzag-encoded number:
+ *
+ *   0xxxxxxx                 0 to 127
+ *   10xxxxxx xxxxxxxx        up to 16383, high bits first
+ *   11000000 <4 bytes>       the signed value itself, little endian
+ *   11111110                 (samples only) no sample this round
+ *   11111111                 (rounds only) the end of the page
+ *
+ * Page start times are in time order, so a range is found by binary search:
+ * an index in RAM of the time of the first page in each sector narrows it
+ * down to a sector, and the headers in that sector do the rest.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <contiki.h>
+#include <init.h>
+#include "drivers/dataflash.h"
+#include "drivers/wallclock.h"
+#include "sensorstore.h"
+#include "sensorlog.h"
+#if CONFIG_LIB_FLASHLOG
+#include "flashlog.h"
+#endif
+
+#if !CONFIG_LIB_SENSORLOG
+#error "sensorstore takes its samples from sensorlog (LIB_SENSORLOG)"
+#endif
+
+#define PAGE_SIZE DATAFLASH_WR_PAGE_SIZE
+#define SECTOR_SIZE DATAFLASH_SECTOR_4K_SIZE
+#define SECTOR_PAGES (SECTOR_SIZE / PAGE_SIZE)
+#define SECTORS ((SENSORSTORE_END - SENSORSTORE_START + 1) / SECTOR_SIZE)
+#define PAGES (SECTORS * SECTOR_PAGES)
+
+#define SEQ_ERASED 0xffffffff
+#define TIME_UNKNOWN 0xffffffff
+
+#define TOKEN_LONG 0xc0
+#define TOKEN_NONE 0xfe
+#define TOKEN_END 0xff
+
+typedef struct {
+	uint32_t seq;
+	uint32_t time; // wallclock_seconds() of the first round
+	uint8_t sensors; // entries in the table after the header
+} hdr_t;
+
+typedef struct {
+	ow_addr_t addr;
+	uint8_t channel;
+	int16_t value; // in the first round
+} entry_t;
+
+#define TABLE_OFF(i) (sizeof(hdr_t) + (i) * sizeof(entry_t))
+
+// A round at its largest: a long time token and a long token per sensor
+#define ROUND_MAX (5 + 5 * SENSORSTORE_SENSORS)
+
+#if (SENSORSTORE_START % 4096) || ((SENSORSTORE_END + 1) % 4096)
+#error "SENSORSTORE_START and SENSORSTORE_END must cover whole 4K sectors"
+#endif
+
+#if SENSORSTORE_END - SENSORSTORE_START + 1 < 2 * 4096
+#error "The sensor store needs at least two sectors"
+#endif
+
+#if (SENSORSTORE_START <= CONFIG_FLASHMGT_P1_END && \
+	SENSORSTORE_END >= CONFIG_FLASHMGT_P1_START) || \
+	(SENSORSTORE_START <= CONFIG_FLASHMGT_P2_END && \
+	SENSORSTORE_END >= CONFIG_FLASHMGT_P2_START)
+#error "The sensor store overlaps a flashmgt partition"
+#endif
+
+#if CONFIG_LIB_FLASHLOG && \
+	SENSORSTORE_START <= FLASHLOG_END && SENSORSTORE_END >= FLASHLOG_START
+#error "The sensor store overlaps the flash log"
+#endif
+
+#if SENSORSTORE_SENSORS > 16
+#error "The page table can't hold more than 16 sensors"
+#endif
+
+PROCESS(sensorstore_process, "sensorstore");
+INIT_PROCESS(sensorstore_process);
+
+// The page being filled
+static union {
+	uint8_t bytes[PAGE_SIZE];
+	hdr_t hdr;
+} page;
+static uint16_t used; // bytes of page filled, 0 until the first round
+static uint8_t found; // set once the newest page in flash is known
+static uint8_t erased; // the page's sector was erased ahead of the flush
+
+// Encoder state for the page's table
+static uint8_t slot[SENSORSTORE_SENSORS]; // sensorlog slot of each entry
+static int16_t last_value[SENSORSTORE_SENSORS];
+static uint32_t last_time;
+static int32_t last_delta;
+
+// sensorlog time of the last sample stored from each slot
+static uint32_t seen[SENSORLOG_SENSORS];
+
+// Time of the first page of each sector, TIME_UNKNOWN if it isn't written
+static uint32_t sector_time[SECTORS];
+
+// The flush time is longer than an etimer can run, so a timer goes off
+// every minute and the pages are timed by clock_seconds()
+#define CHECK_TIME 60
+static uint32_t page_started; // clock_seconds() of the page's first round
+
+static struct etimer tmr;
+static struct etimer tmr_busy;
+static struct notify_sub sensorlog_sub;
+
+static uint32_t page_addr(uint32_t seq) {
+	return SENSORSTORE_START + (seq % PAGES) * PAGE_SIZE;
+}
+
+static uint16_t sector_of(uint32_t seq) {
+	return (seq % PAGES) / SECTOR_PAGES;
+}
+
+// Read part of a page, from RAM if it's the one being filled
+static int read_bytes(uint32_t seq, uint16_t off, void *buf, uint16_t len) {
+	if (seq == page.hdr.seq) {
+		memcpy(buf, &page.bytes[off], len);
+		return 0;
+	}
+
+	if (dataflash_read_data(buf, page_addr(seq) + off, len) != len) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint8_t put_token(uint8_t *p, int32_t v) {
+	uint32_t zz = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+
+	if (zz < 0x80) {
+		p[0] = zz;
+		return 1;
+	}
+	else if (zz < 0x4000) {
+		p[0] = 0x80 | (zz >> 8);
+		p[1] = zz;
+		return 2;
+	}
+
+	p[0] = TOKEN_LONG;
+	memcpy(&p[1], &v, sizeof(v));
+	return 5;
+}
+
+// Returns the bytes used, or 0 if there's no valid token in len bytes
+static uint8_t get_token(const uint8_t *p, uint16_t len, int32_t *v) {
+	uint32_t zz;
+
+	if (len < 1) {
+		return 0;
+	}
+	else if (p[0] < 0x80) {
+		zz = p[0];
+	}
+	else if (p[0] < TOKEN_LONG) {
+		if (len < 2) {
+			return 0;
+		}
+		zz = ((uint16_t)(p[0] & 0x3f) << 8) | p[1];
+	}
+	else if (p[0] == TOKEN_LONG && len >= 5) {
+		memcpy(v, &p[1], sizeof(*v));
+		return 5;
+	}
+	else {
+		return 0;
+	}
+
+	*v = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+	return (p[0] < 0x80) ? 1 : 2;
+}
+
+static void new_page(uint32_t seq) {
+	memset(page.bytes, 0xff, sizeof(page.bytes));
+	page.hdr.seq = seq;
+	used = 0;
+	erased = 0;
+}
+
+// Make sure the sector at addr can be written; flashmgt locks everything
+// again while it updates the filesystem
+static int unprotect(uint32_t addr) {
+	uint8_t prot;
+
+	if (dataflash_read_protection(addr, &prot)) {
+		return -1;
+	}
+	else if (!prot) {
+		return 0;
+	}
+
+	// Clear SPRL, but don't change sector locks
+	if (dataflash_write_enable() || dataflash_write_status(0x24)) {
+		return -1;
+	}
+
+	if (dataflash_write_enable() || dataflash_unprotect_sector(addr)) {
+		dataflash_write_enable();
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24);
+		return -1;
+	}
+
+	// Set SPRL again
+	if (dataflash_write_enable() ||
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int sensorstore_flush(void) {
+	uint32_t addr = page_addr(page.hdr.seq);
+	uint8_t first = !(addr % SECTOR_SIZE);
+	int ret = -1;
+
+	if (!found || !used) {
+		return 0;
+	}
+
+	if (unprotect(addr)) {
+		goto out;
+	}
+
+	// Starting a sector: erase it, losing the oldest pages
+	if (first) {
+		sector_time[sector_of(page.hdr.seq)] = TIME_UNKNOWN;
+
+		if (!erased) {
+			dataflash_wait_ready();
+			if (dataflash_write_enable() || dataflash_erase_4k(addr)) {
+				goto out;
+			}
+		}
+	}
+
+	dataflash_wait_ready();
+	if (dataflash_write_enable() ||
+		dataflash_write_data(page.bytes, addr, PAGE_SIZE) != PAGE_SIZE)
+	{
+		goto out;
+	}
+
+	if (first) {
+		sector_time[sector_of(page.hdr.seq)] = page.hdr.time;
+	}
+
+	ret = 0;
+
+out:
+	// Move on either way, a page that can't be written is lost
+	new_page(page.hdr.seq + 1);
+	return ret;
+}
+
+// Start the page with a round from the sensorlog slots in mask
+static void start_page(uint32_t now, uint16_t mask) {
+	uint8_t n = 0;
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		const sensorlog_t *l = &sensorlog[i];
+		entry_t *e = (entry_t *)&page.bytes[TABLE_OFF(n)];
+
+		if (!(mask & (1 << i))) {
+			continue;
+		}
+
+		memcpy(&e->addr, &l->addr, sizeof(e->addr));
+		e->channel = l->channel;
+		e->value = sensorlog_sample(l, 0);
+
+		slot[n] = i;
+		last_value[n] = e->value;
+		n++;
+	}
+
+	page.hdr.time = now;
+	page.hdr.sensors = n;
+	page_started = clock_seconds();
+	used = TABLE_OFF(n);
+	last_time = now;
+	last_delta = 0;
+}
+
+// Whether the sensor in table entry i is still in its sensorlog slot
+static uint8_t entry_current(uint8_t i) {
+	const entry_t *e = (const entry_t *)&page.bytes[TABLE_OFF(i)];
+	const sensorlog_t *l = &sensorlog[slot[i]];
+
+	return l->used && l->channel == e->channel &&
+		!memcmp(&l->addr, &e->addr, sizeof(l->addr));
+}
+
+// Add the samples sensorlog has taken since the last round
+static void add_round(void) {
+	uint32_t now = wallclock_seconds();
+	uint8_t buf[ROUND_MAX];
+	uint16_t mask = 0;
+	uint16_t covered = 0;
+	uint8_t len;
+	int32_t delta;
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		const sensorlog_t *l = &sensorlog[i];
+
+		if (l->used && l->count && l->time != seen[i]) {
+			mask |= 1 << i;
+		}
+	}
+
+	if (!found || !mask) {
+		return;
+	}
+
+	// A sensor that isn't in the table needs a page of its own
+	if (used) {
+		for (uint8_t i = 0; i < page.hdr.sensors; i++) {
+			if (entry_current(i)) {
+				covered |= 1 << slot[i];
+			}
+		}
+
+		if (mask & ~covered) {
+			sensorstore_flush();
+		}
+	}
+
+	if (used) {
+		delta = now - last_time;
+		len = put_token(buf, delta - last_delta);
+
+		for (uint8_t i = 0; i < page.hdr.sensors; i++) {
+			if (!entry_current(i) || !(mask & (1 << slot[i]))) {
+				buf[len++] = TOKEN_NONE;
+				continue;
+			}
+
+			int16_t v = sensorlog_sample(&sensorlog[slot[i]], 0);
+			len += put_token(&buf[len], (int32_t)v - last_value[i]);
+		}
+
+		if (used + len > PAGE_SIZE) {
+			sensorstore_flush();
+		}
+		else {
+			memcpy(&page.bytes[used], buf, len);
+			used += len;
+
+			for (uint8_t i = 0; i < page.hdr.sensors; i++) {
+				if (entry_current(i) && (mask & (1 << slot[i]))) {
+					last_value[i] = sensorlog_sample(&sensorlog[slot[i]], 0);
+				}
+			}
+			last_time = now;
+			last_delta = delta;
+		}
+	}
+
+	if (!used) {
+		start_page(now, mask);
+	}
+
+	for (uint8_t i = 0; i < SENSORLOG_SENSORS; i++) {
+		if (mask & (1 << i)) {
+			seen[i] = sensorlog[i].time;
+		}
+	}
+}
+
+// Time of the first round of a page, TIME_UNKNOWN if it isn't there
+static uint32_t page_time(uint32_t seq) {
+	hdr_t hdr;
+
+	if (seq == page.hdr.seq) {
+		return used ? page.hdr.time : TIME_UNKNOWN;
+	}
+
+	if (read_bytes(seq, 0, &hdr, sizeof(hdr)) || hdr.seq != seq) {
+		return TIME_UNKNOWN;
+	}
+
+	return hdr.time;
+}
+
+// The same, for the first page of a sector, from the index
+static uint32_t sector_start_time(uint32_t seq) {
+	if (seq == page.hdr.seq) {
+		return page_time(seq);
+	}
+
+	return sector_time[sector_of(seq)];
+}
+
+// Set the reader up at the start of a page, or finish if it isn't there
+static void load_page(sensorstore_reader_t *r) {
+	hdr_t hdr;
+
+	if (r->seq > page.hdr.seq || (r->seq == page.hdr.seq && !used) ||
+		read_bytes(r->seq, 0, &hdr, sizeof(hdr)) || hdr.seq != r->seq ||
+		!hdr.sensors || hdr.sensors > SENSORSTORE_SENSORS)
+	{
+		r->done = 1;
+		return;
+	}
+
+	for (uint8_t i = 0; i < hdr.sensors; i++) {
+		if (read_bytes(r->seq, TABLE_OFF(i) + offsetof(entry_t, value),
+			&r->value[i], sizeof(r->value[i])))
+		{
+			r->done = 1;
+			return;
+		}
+	}
+
+	r->time = hdr.time;
+	r->delta = 0;
+	r->missing = 0;
+	r->sensors = hdr.sensors;
+	r->sensor = 0;
+	r->off = TABLE_OFF(hdr.sensors);
+}
+
+// Decode the next round into the reader, moving on to the next page after
+// the last one
+static void next_round(sensorstore_reader_t *r) {
+	uint8_t buf[ROUND_MAX];
+	uint16_t len = PAGE_SIZE - r->off;
+	uint8_t p, n;
+	int32_t v;
+
+	if (len > sizeof(buf)) {
+		len = sizeof(buf);
+	}
+
+	if (!len || read_bytes(r->seq, r->off, buf, len) ||
+		buf[0] == TOKEN_END || !(p = get_token(buf, len, &v)))
+	{
+		goto next_page;
+	}
+
+	r->delta += v;
+	r->time += r->delta;
+	r->missing = 0;
+
+	for (uint8_t i = 0; i < r->sensors; i++) {
+		if (p < len && buf[p] == TOKEN_NONE) {
+			r->missing |= 1 << i;
+			p++;
+			continue;
+		}
+
+		if (!(n = get_token(&buf[p], len - p, &v))) {
+			goto next_page;
+		}
+		r->value[i] += v;
+		p += n;
+	}
+
+	r->off += p;
+	r->sensor = 0;
+	return;
+
+next_page:
+	r->seq++;
+	load_page(r);
+}
+
+void sensorstore_reader_init(sensorstore_reader_t *r,
+	uint32_t from, uint32_t to)
+{
+	uint32_t base = page.hdr.seq - page.hdr.seq % SECTOR_PAGES;
+	uint32_t lo, hi, end;
+
+	r->from = from;
+	r->to = to;
+	r->done = 0;
+
+	if (!found) {
+		r->done = 1;
+		return;
+	}
+
+	// The oldest page is at the start of the sector after the one being
+	// filled, once the ring has gone round
+	lo = (base >= (SECTORS - 1) * SECTOR_PAGES) ?
+		base - (SECTORS - 1) * SECTOR_PAGES : 0;
+	end = page.hdr.seq;
+
+	// Find the last sector starting at or before from
+	for (uint32_t s = lo + SECTOR_PAGES; s <= end; s += SECTOR_PAGES) {
+		uint32_t t = sector_start_time(s);
+
+		if (t == TIME_UNKNOWN || t > from) {
+			break;
+		}
+		lo = s;
+	}
+
+	// Then the last page in it that does
+	hi = lo + SECTOR_PAGES - 1;
+	if (hi > end) {
+		hi = end;
+	}
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+		uint32_t t = page_time(mid);
+
+		if (t != TIME_UNKNOWN && t <= from) {
+			lo = mid;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+
+	r->seq = lo;
+	load_page(r);
+}
+
+int sensorstore_read(sensorstore_reader_t *r, uint32_t *time,
+	ow_addr_t *addr, uint8_t *channel, int16_t *value)
+{
+	uint8_t i;
+
+	while (!r->done) {
+		if (r->sensor == r->sensors) {
+			next_round(r);
+			continue;
+		}
+
+		i = r->sensor++;
+
+		if ((r->missing & (1 << i)) || r->time < r->from) {
+			continue;
+		}
+		else if (r->time > r->to) {
+			r->done = 1;
+			break;
+		}
+
+		if (read_bytes(r->seq, TABLE_OFF(i), addr, sizeof(*addr)) ||
+			read_bytes(r->seq, TABLE_OFF(i) + offsetof(entry_t, channel),
+				channel, sizeof(*channel)))
+		{
+			r->done = 1;
+			break;
+		}
+
+		*time = r->time;
+		*value = r->value[i];
+		return 0;
+	}
+
+	return -1;
+}
+
+// Find the newest page written and carry on after it
+static int sensorstore_init(void) {
+	uint32_t newest = SEQ_ERASED;
+	uint16_t sector = 0;
+	uint8_t lo, hi;
+
+	new_page(0);
+
+	for (uint16_t i = 0; i < SECTORS; i++) {
+		hdr_t hdr;
+
+		sector_time[i] = TIME_UNKNOWN;
+		if (dataflash_read_data(&hdr, SENSORSTORE_START + i * SECTOR_SIZE,
+			sizeof(hdr)) != sizeof(hdr) || hdr.seq == SEQ_ERASED)
+		{
+			continue;
+		}
+
+		sector_time[i] = hdr.time;
+		if (newest == SEQ_ERASED || hdr.seq > newest) {
+			newest = hdr.seq;
+			sector = i;
+		}
+	}
+
+	if (newest != SEQ_ERASED) {
+		// Pages in a sector are written in order, so the ones in use are at
+		// the start of it
+		lo = 0;
+		hi = SECTOR_PAGES;
+		while (hi - lo > 1) {
+			uint8_t mid = (lo + hi) / 2;
+			uint32_t seq;
+
+			if (dataflash_read_data(&seq, SENSORSTORE_START +
+				sector * SECTOR_SIZE + mid * PAGE_SIZE, sizeof(seq)) ==
+				sizeof(seq) && seq == newest + mid)
+			{
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		new_page(newest + lo + 1);
+	}
+
+	found = 1;
+	return 0;
+}
+
+INIT_LIBRARY(sensorstore, sensorstore_init);
+
+// Start erasing the sector the next flush will write, if it starts a sector,
+// so the process can wait for it instead of sensorstore_flush() spinning
+static int erase_ahead(void) {
+	uint32_t addr = page_addr(page.hdr.seq);
+
+	if (!found || erased || !used || (addr % SECTOR_SIZE)) {
+		return -1;
+	}
+
+	sector_time[sector_of(page.hdr.seq)] = TIME_UNKNOWN;
+	if (unprotect(addr) ||
+		dataflash_write_enable() || dataflash_erase_4k(addr))
+	{
+		return -1;
+	}
+
+	erased = 1;
+	return 0;
+}
+
+PROCESS_THREAD(sensorstore_process, ev, data) {
+	PROCESS_BEGIN();
+
+	etimer_set(&tmr, CHECK_TIME * CLOCK_SECOND);
+	notify_subscribe(&sensorlog_notify, &sensorlog_sub);
+
+	while (1) {
+		PROCESS_WAIT_EVENT_UNTIL(ev == sensorlog_event ||
+			(ev == PROCESS_EVENT_TIMER && etimer_expired(&tmr)));
+
+		if (ev == sensorlog_event) {
+			add_round();
+			continue;
+		}
+
+		etimer_reset(&tmr);
+		if (!used || clock_seconds() - page_started < SENSORSTORE_FLUSH_TIME) {
+			continue;
+		}
+
+		// Let a sector erase run without holding everything else up
+		if (erase_ahead() == 0) {
+			DATAFLASH_PROCESS_WAIT_READY(&tmr_busy);
+		}
+
+		sensorstore_flush();
+	}
+
+	PROCESS_END();
+}
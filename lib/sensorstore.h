@@ -0,0 +1,70 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SENSORSTORE_H
+#define SENSORSTORE_H
+
+#include <stdint.h>
+#include <onewire.h>
+#include "sensorlog.h"
+
+// Dataflash region kept for the history (whole 4K sectors, outside the
+// flashmgt partitions and the flash log)
+#define SENSORSTORE_START CONFIG_SENSORSTORE_START
+#define SENSORSTORE_END CONFIG_SENSORSTORE_END
+
+// Seconds a part-filled page waits in RAM before it's written anyway
+#ifndef CONFIG_LIB_SENSORSTORE_FLUSH_TIME
+#define SENSORSTORE_FLUSH_TIME 3600
+#else
+#define SENSORSTORE_FLUSH_TIME CONFIG_LIB_SENSORSTORE_FLUSH_TIME
+#endif
+
+// A page only holds sensors that sensorlog had at the same time
+#define SENSORSTORE_SENSORS SENSORLOG_SENSORS
+
+// Reads samples back in time order
+typedef struct {
+	uint32_t from, to; // private: times wanted
+	uint32_t seq; // private: page being read
+	uint32_t time; // private: of the round being read out
+	int32_t delta; // private: time since the round before
+	uint32_t missing; // private: sensors with no sample in the round
+	int16_t value[SENSORSTORE_SENSORS]; // private: samples of the round
+	uint16_t off; // private: next byte of the page to decode
+	uint8_t sensor; // private: next sensor of the round to return
+	uint8_t sensors; // private: in the page's table
+	uint8_t done : 1; // private
+} sensorstore_reader_t;
+
+// Write out the page in RAM now. Returns -1 on dataflash errors.
+int sensorstore_flush(void);
+
+// Start reading at the first sample at or after from (wallclock seconds),
+// up to and including to. Finding the place takes a search of an index in
+// RAM and a few page headers, whatever the range.
+void sensorstore_reader_init(sensorstore_reader_t *r,
+	uint32_t from, uint32_t to);
+
+// Read the next sample. Returns -1 once there are no more in the range.
+int sensorstore_read(sensorstore_reader_t *r, uint32_t *time,
+	ow_addr_t *addr, uint8_t *channel, int16_t *value);
+
+#endif // SENSORSTORE_H
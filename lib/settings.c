@@ -18,6 +18,14 @@
 #define SETTINGS_MAX_SIZE	((E2END + 1) / 2)
 #endif
 
+// Items whose addresses are kept in RAM, so lookups don't have to walk the
+// list in EEPROM (0 to always walk it)
+#ifndef CONFIG_LIB_SETTINGS_INDEX
+#define SETTINGS_INDEX	0
+#else
+#define SETTINGS_INDEX	CONFIG_LIB_SETTINGS_INDEX
+#endif
+
 typedef struct {
 	settings_key_t key;
 	uint16_t size;
@@ -108,49 +116,149 @@ static inline void *settings_next_item_(void *item_addr) {
 	return (uint8_t *)value_addr - 1;
 }
 
-bool settings_check(settings_key_t key, uint8_t index) {
+#if SETTINGS_INDEX
+// Items in the order they are in EEPROM, built on first use
+static struct {
+	uint8_t built : 1;
+	uint8_t overflow : 1; // there are more items than fit
+	uint8_t count;
+	void *end; // where the next item goes
+	struct {
+		settings_key_t key;
+		void *item;
+	} items[SETTINGS_INDEX];
+} idx;
+
+static void index_add(settings_key_t key, void *item) {
+	if (idx.count < SETTINGS_INDEX) {
+		idx.items[idx.count].key = key;
+		idx.items[idx.count].item = item;
+		idx.count++;
+	}
+	else {
+		idx.overflow = 1;
+	}
+}
+
+static void index_build(void) {
 	void *current_item;
 
+	idx.count = 0;
+	idx.overflow = 0;
+
 	for (current_item = SETTINGS_TOP_ADDR;
 		settings_is_item_valid_(current_item);
 		current_item = settings_next_item_(current_item))
 	{
-		if (settings_get_key_(current_item) == key) {
-			if (index-- == 0) {
-				return true;
-			}
+		settings_key_t key = settings_get_key_(current_item);
+
+		if (key != SETTINGS_RETIRED_KEY) {
+			index_add(key, current_item);
 		}
 	}
 
-	return false;
+	idx.end = current_item;
+	idx.built = 1;
 }
+#endif
 
-settings_status_t settings_get(settings_key_t key, uint8_t index,
-	void *value, size_t *value_size)
-{
+// Find item number index with key, or NULL
+static void *settings_find_(settings_key_t key, uint8_t index) {
 	void *current_item;
 
-	for (current_item = SETTINGS_TOP_ADDR;
+#if SETTINGS_INDEX
+	if (!idx.built) {
+		index_build();
+	}
+
+	for (uint8_t i = 0; i < idx.count; i++) {
+		if (idx.items[i].key == key && index-- == 0) {
+			return idx.items[i].item;
+		}
+	}
+
+	if (!idx.overflow) {
+		return NULL;
+	}
+
+	// Carry on through the items that didn't fit
+	current_item = settings_next_item_(idx.items[idx.count - 1].item);
+#else
+	current_item = SETTINGS_TOP_ADDR;
+#endif
+
+	for (;
 		settings_is_item_valid_(current_item);
 		current_item = settings_next_item_(current_item))
 	{
 		if (settings_get_key_(current_item) == key) {
 			if (index-- == 0) {
-				// We found it!
-				*value_size = MIN(*value_size,
-					settings_get_value_length_(current_item));
+				return current_item;
+			}
+		}
+	}
 
-				eeprom_read_block(
-					value,
-					settings_get_value_addr_(current_item),
-					*value_size);
+	return NULL;
+}
 
-				return SETTINGS_STATUS_OK;
-			}
+// Is the stored value the same as value?
+static bool settings_value_equal_(void *item, const void *value,
+	size_t value_size)
+{
+	const uint8_t *v = value;
+	uint8_t *addr = (uint8_t *)item - (sizeof(item_header_t) + value_size);
+
+	while (value_size--) {
+		if (eeprom_read_byte(addr++) != *v++) {
+			return false;
 		}
 	}
 
-	return SETTINGS_STATUS_NOT_FOUND;
+	return true;
+}
+
+// Rewrite the value of an item, programming only the bytes that changed
+static void settings_update_value_(void *item, const void *value,
+	size_t value_size)
+{
+	if (settings_value_equal_(item, value, value_size)) {
+		return;
+	}
+
+	eeprom_update_block(
+		value,
+		(uint8_t *)item - (sizeof(item_header_t) + value_size),
+		value_size);
+}
+
+bool settings_check(settings_key_t key, uint8_t index) {
+	return settings_find_(key, index) != NULL;
+}
+
+settings_status_t settings_get(settings_key_t key, uint8_t index,
+	void *value, size_t *value_size)
+{
+	void *current_item = settings_find_(key, index);
+	item_header_t header;
+
+	if (current_item == NULL) {
+		return SETTINGS_STATUS_NOT_FOUND;
+	}
+
+	item_read_header(current_item, &header);
+	if (header.check != header_checkbyte(&header) || header.key != key) {
+		return SETTINGS_STATUS_FAILURE;
+	}
+
+	// We found it!
+	*value_size = MIN(*value_size, header.size);
+
+	eeprom_read_block(
+		value,
+		(uint8_t *)current_item - (sizeof(header) + header.size),
+		*value_size);
+
+	return SETTINGS_STATUS_OK;
 }
 
 settings_status_t settings_add(settings_key_t key,
@@ -160,22 +268,39 @@ settings_status_t settings_add(settings_key_t key,
 	item_header_t header;
 
 	// Find end of list
+#if SETTINGS_INDEX
+	if (!idx.built) {
+		index_build();
+	}
+	current_item = idx.end;
+#else
 	for (current_item = SETTINGS_TOP_ADDR;
 		settings_is_item_valid_(current_item);
 		current_item = settings_next_item_(current_item));
+#endif
 
 	if (current_item == NULL) {
 		return SETTINGS_STATUS_FAILURE;
 	}
 
-	// TODO: size check!
+	if ((size_t)((uint8_t *)SETTINGS_TOP_ADDR - (uint8_t *)current_item) +
+		sizeof(header) + value_size + 1 > SETTINGS_MAX_SIZE)
+	{
+		return SETTINGS_STATUS_OUT_OF_SPACE;
+	}
 
 	header.key = key;
 	header.size = value_size;
 	header.check = header_checkbyte(&header);
 
-	// Write the header first
-	eeprom_write_block(
+	// Write the data first, so the item only becomes valid once it's whole
+	eeprom_update_block(
+		value,
+		(uint8_t *)current_item - (sizeof(header) + value_size),
+		value_size);
+
+	// Now the header
+	eeprom_update_block(
 		&header,
 		(char *)current_item - sizeof(header),
 		sizeof(header));
@@ -183,14 +308,16 @@ settings_status_t settings_add(settings_key_t key,
 	// Sanity check, remove once confident
 	size_t checksize = settings_get_value_length_(current_item);
 	if (checksize != value_size) {
+#if SETTINGS_INDEX
+		idx.built = 0;
+#endif
 		return SETTINGS_STATUS_FAILURE;
 	}
 
-	// Now write the data
-	eeprom_update_block(
-		value,
-		settings_get_value_addr_(current_item),
-		value_size);
+#if SETTINGS_INDEX
+	index_add(key, current_item);
+	idx.end = settings_next_item_(current_item);
+#endif
 
 	return SETTINGS_STATUS_OK;
 }
@@ -198,18 +325,9 @@ settings_status_t settings_add(settings_key_t key,
 settings_status_t settings_set(settings_key_t key,
 	const void *value, size_t value_size)
 {
-	void *current_item;
-
-	for (current_item = SETTINGS_TOP_ADDR;
-		settings_is_item_valid_(current_item);
-		current_item = settings_next_item_(current_item))
-	{
-		if (settings_get_key_(current_item) == key) {
-			break;
-		}
-	}
+	void *current_item = settings_find_(key, 0);
 
-	if ((current_item == NULL) || !settings_is_item_valid_(current_item)) {
+	if (current_item == NULL) {
 		return settings_add(key, value, value_size);
 	}
 
@@ -218,15 +336,103 @@ settings_status_t settings_set(settings_key_t key,
 		return SETTINGS_STATUS_FAILURE;
 	}
 
-	// Now write the data
-	eeprom_update_block(
-		value,
-		settings_get_value_addr_(current_item),
-		value_size);
+	// Now write the data (only the bytes that differ are programmed)
+	settings_update_value_(current_item, value, value_size);
 
 	return SETTINGS_STATUS_OK;
 }
 
+#if CONFIG_LIB_SETTINGS_HOT
+// Move an item's bytes up by gap, from the top down as the copies overlap
+static void settings_move_item_(void *item, size_t len, size_t gap) {
+	uint8_t *src = (uint8_t *)item - 1;
+
+	while (len--) {
+		eeprom_update_byte(src + gap, eeprom_read_byte(src));
+		src--;
+		wdt_reset();
+	}
+}
+
+// Squeeze out retired items. Not safe against power loss while it runs.
+static void settings_compact_(void) {
+	uint8_t *src = SETTINGS_TOP_ADDR;
+	uint8_t *dst = SETTINGS_TOP_ADDR;
+	item_header_t header;
+
+	while (settings_is_item_valid_(src)) {
+		item_read_header(src, &header);
+
+		// Header, value and the spare byte below
+		size_t len = sizeof(header) + header.size + 1;
+
+		if (header.key != SETTINGS_RETIRED_KEY) {
+			if (dst != src) {
+				settings_move_item_(src, len - 1, dst - src);
+			}
+			dst -= len;
+		}
+
+		src -= len;
+	}
+
+	// Blank the space freed up, so the list ends after the last item kept
+	while (dst > src) {
+		eeprom_update_byte(dst--, 0xff);
+		wdt_reset();
+	}
+
+#if SETTINGS_INDEX
+	idx.built = 0;
+#endif
+}
+
+settings_status_t settings_set_hot(settings_key_t key,
+	const void *value, size_t value_size)
+{
+	void *current_item = settings_find_(key, 0);
+	item_header_t header;
+	settings_status_t ret;
+
+	if (current_item == NULL) {
+		return settings_add(key, value, value_size);
+	}
+
+	if (settings_value_equal_(current_item, value, value_size)) {
+		return SETTINGS_STATUS_OK;
+	}
+
+	// Write the new copy first, so there's always a whole one
+	ret = settings_add(key, value, value_size);
+	if (ret == SETTINGS_STATUS_OUT_OF_SPACE) {
+		settings_compact_();
+		ret = settings_add(key, value, value_size);
+	}
+	if (ret != SETTINGS_STATUS_OK) {
+		return ret;
+	}
+
+	// Then retire the old copies (more than one if power was lost before)
+	while (settings_check(key, 1)) {
+		current_item = settings_find_(key, 0);
+
+		item_read_header(current_item, &header);
+		header.key = SETTINGS_RETIRED_KEY;
+		header.check = header_checkbyte(&header);
+		eeprom_update_block(
+			&header,
+			(uint8_t *)current_item - sizeof(header),
+			sizeof(header));
+
+#if SETTINGS_INDEX
+		idx.built = 0;
+#endif
+	}
+
+	return SETTINGS_STATUS_OK;
+}
+#endif
+
 settings_status_t settings_delete(settings_key_t key, uint8_t index) {
 	// Requires the settings store to be shifted. Currently unimplemented.
 	// TODO: Writeme!
@@ -241,5 +447,9 @@ void settings_wipe(void) {
 		eeprom_write_byte(addr, 0xFF);
 		wdt_reset();
 	}
+
+#if SETTINGS_INDEX
+	idx.built = 0;
+#endif
 }
 
@@ -16,8 +16,13 @@ typedef enum {
 } settings_status_t;
 
 #define SETTINGS_KEY_FLASHMGT_STATUS	0x0100
+#define SETTINGS_KEY_DHCP_LEASE		0x0200
+#define SETTINGS_KEY_TIMESYNC_TRIM	0x0300
+#define SETTINGS_KEY_PIDLOOP_GAINS	0x0400	// plus the loop number
+#define SETTINGS_KEY_PREFS		0x0500
 
 #define SETTINGS_INVALID_KEY	(0x00)
+#define SETTINGS_RETIRED_KEY	(0xFFFF)	// item replaced by a newer copy
 #define SETTINGS_MAX_VALUE_SIZE	(0x3FFF)	// 16383 bytes
 
 settings_status_t settings_get(settings_key_t key, uint8_t index,
@@ -31,6 +36,17 @@ bool settings_check(settings_key_t key, uint8_t index);
 settings_status_t settings_set(settings_key_t key,
 	const void *value, size_t value_size);
 
+#if CONFIG_LIB_SETTINGS_HOT
+// Same as settings_set() for a frequently written key with a single item,
+// but writes a new copy at the end of the list and retires the old one
+// rather than wearing out the same cells. The list is compacted when it
+// runs out of room.
+settings_status_t settings_set_hot(settings_key_t key,
+	const void *value, size_t value_size);
+#else
+#define settings_set_hot settings_set
+#endif
+
 settings_status_t settings_delete(settings_key_t key, uint8_t index);
 
 void settings_wipe(void);
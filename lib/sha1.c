@@ -0,0 +1,141 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// The schedule is kept to 16 words, worked out in place as it goes
+static void sha1_block(sha1_ctx_t *ctx) {
+	uint32_t w[16];
+	uint32_t a, b, c, d, e, f, k, t;
+	uint8_t i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)ctx->buf[i * 4] << 24) |
+			((uint32_t)ctx->buf[i * 4 + 1] << 16) |
+			((uint16_t)ctx->buf[i * 4 + 2] << 8) |
+			ctx->buf[i * 4 + 3];
+	}
+
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i >= 16) {
+			t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^
+				w[i & 15];
+			w[i & 15] = ROL(t, 1);
+		}
+
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		}
+		else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		}
+		else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = ROL(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+}
+
+void sha1_init(sha1_ctx_t *ctx) {
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xc3d2e1f0;
+	ctx->len = 0;
+}
+
+void sha1_update(sha1_ctx_t *ctx, const void *data, uint16_t len) {
+	const uint8_t *p = data;
+
+	while (len) {
+		uint8_t used = ctx->len % SHA1_BLOCK_SIZE;
+		uint8_t n = SHA1_BLOCK_SIZE - used;
+
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(&ctx->buf[used], p, n);
+		ctx->len += n;
+		p += n;
+		len -= n;
+
+		if (ctx->len % SHA1_BLOCK_SIZE == 0) {
+			sha1_block(ctx);
+		}
+	}
+}
+
+void sha1_final(sha1_ctx_t *ctx, uint8_t digest[SHA1_DIGEST_SIZE]) {
+	uint8_t used = ctx->len % SHA1_BLOCK_SIZE;
+	uint32_t bits = ctx->len << 3;
+	uint8_t i;
+
+	// A 1 bit, zeros up to the last 8 bytes of a block, then the length
+	ctx->buf[used++] = 0x80;
+	if (used > SHA1_BLOCK_SIZE - 8) {
+		memset(&ctx->buf[used], 0, SHA1_BLOCK_SIZE - used);
+		sha1_block(ctx);
+		used = 0;
+	}
+	memset(&ctx->buf[used], 0, SHA1_BLOCK_SIZE - 4 - used);
+
+	// Only 32 bits of length; the top half stays zero
+	ctx->buf[SHA1_BLOCK_SIZE - 4] = bits >> 24;
+	ctx->buf[SHA1_BLOCK_SIZE - 3] = bits >> 16;
+	ctx->buf[SHA1_BLOCK_SIZE - 2] = bits >> 8;
+	ctx->buf[SHA1_BLOCK_SIZE - 1] = bits;
+	sha1_block(ctx);
+
+	for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
+		digest[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+	}
+}
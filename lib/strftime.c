@@ -556,3 +556,30 @@ static PGM_P _idx(PGM_P arr, int idx) {
 	return arr;
 }
 
+
+static char stamp[TIME_STAMP_LEN + 1];
+static time_t stamp_time;
+static uint8_t stamp_valid;
+
+const char *time_stamp(time_t time) {
+	const struct tm *tm;
+
+	if (stamp_valid && time == stamp_time) {
+		return stamp;
+	}
+
+	tm = gmtime_cached(time);
+
+	if (stamp_valid && time / 60 == stamp_time / 60) {
+		// Same minute, just rewrite the seconds
+		stamp[TIME_STAMP_LEN - 2] = '0' + tm->tm_sec / 10;
+		stamp[TIME_STAMP_LEN - 1] = '0' + tm->tm_sec % 10;
+	}
+	else {
+		strftime_P(stamp, sizeof(stamp), PSTR("%b %e %H:%M:%S"), tm);
+		stamp_valid = 1;
+	}
+
+	stamp_time = time;
+	return stamp;
+}
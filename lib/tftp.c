@@ -73,6 +73,62 @@ static const struct modes modes[] = {
 
 const char Errmsg_TIMEOUT[] = "Timeout";
 const char Errmsg_IOERROR[] = "I/O Error";
+const char Errmsg_BADOPT[] = "Bad option";
+
+static const char opt_blksize[] = "blksize";
+static const char opt_windowsize[] = "windowsize";
+
+/* block size we can ask for, rounded down to whole flash pages */
+static uint16_t blksize_req(void) {
+	uint16_t size = TFTP_BLKSIZE;
+
+	if (size > TFTP_BLKSIZE_MAX) {
+		size = TFTP_BLKSIZE_MAX & ~0xff;
+	}
+
+	return size;
+}
+
+/* parse the option/value pairs in an OACK; returns -1 if the server sent
+ * something we didn't ask for */
+static int parse_oack(tftp_state_t *s) {
+	char *m = (char *)uip_appdata + 2;
+	char *end = (char *)uip_appdata + uip_datalen();
+
+	/* options the server leaves out fall back to the defaults */
+	s->blksize = TFTP_BLKSIZE_DEFAULT;
+	s->windowsize = 1;
+
+	while (m < end) {
+		char *name = m;
+		char *value = memchr(name, 0, end - name);
+		long v;
+
+		if (!value || ++value >= end || !memchr(value, 0, end - value)) {
+			return -1;
+		}
+		m = value + strlen(value) + 1;
+		v = atol(value);
+
+		if (strcasecmp(name, opt_blksize) == 0) {
+			if (v < 8 || v > blksize_req()) {
+				return -1;
+			}
+			s->blksize = v;
+		}
+		else if (strcasecmp(name, opt_windowsize) == 0) {
+			if (v < 1 || v > TFTP_WINDOWSIZE) {
+				return -1;
+			}
+			s->windowsize = v;
+		}
+		else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
 
 static uint16_t parse_msg(tftp_state_t *s) {
 	uint8_t *m = (uint8_t *)uip_appdata;
@@ -132,8 +188,20 @@ void tftp_appcall(tftp_state_t *s) {
 					/* remove port 69, setup new port with server's TID */
 					s->conn->rport = UDPBUF->srcport;
 
+					if (parse_oack(s)) {
+						s->state = TFTP_STATE_ERR;
+						s->error_code = TFTP_EBADOPT;
+						s->errmsg = Errmsg_BADOPT;
+						send_tftp_error(s);
+						break;
+					}
+
 					/* reply OACK */
+					s->ack = 0;
 					send_tftp_ack(s);
+#if TIME_TIMEOUT != 0
+					stimer_set(&s->timer, TIME_TIMEOUT);
+#endif
 					break;
 
 				case TFTP_DATA:
@@ -146,25 +214,40 @@ void tftp_appcall(tftp_state_t *s) {
 					/* collect data from uip_appdata */
 					/*********************************/
 
-					/* check payload size, the last packet if size < 512 */
-					/* 512 (data) + 8 (UDP header) + 4 (TFTP header) */
-					if (UIP_HTONS(UDPBUF->udplen) < 524) {
-						s->size = (512L * (uint32_t)s->block) -
-							(uint32_t)(524L - UIP_HTONS(UDPBUF->udplen));
-						s->state = TFTP_STATE_CLOSE;
+					/* a block out of sequence means one in the window was
+					 * lost: drop it and ACK the last good one so the server
+					 * starts the window again from there */
+					if (s->block != (uint16_t)(s->ack + 1)) {
+						s->window = 0;
+						send_tftp_ack(s);
+						break;
 					}
 
+					/* 8 (UDP header) + 4 (TFTP header) */
+					uint16_t size = UIP_HTONS(UDPBUF->udplen) - 12;
+
 					if (s->iofunc) {
-						uint32_t offset = 512L * (uint32_t)(s->block - 1);
-						uint16_t size = UIP_HTONS(UDPBUF->udplen) - 12;
-						ret = s->iofunc(s, offset, size,
+						ret = s->iofunc(s, s->received, size,
 							((uint8_t *)uip_appdata) + 4);
 					}
 
 					if (ret == 0) {
-						/* send ACK */
 						s->ack = s->block;
-						send_tftp_ack(s);
+						s->received += size;
+
+						/* check payload size, the last packet if short */
+						if (size < s->blksize) {
+							s->size = s->received;
+							s->state = TFTP_STATE_CLOSE;
+						}
+
+						/* send ACK at the end of each window */
+						if (++s->window >= s->windowsize ||
+							s->state == TFTP_STATE_CLOSE)
+						{
+							s->window = 0;
+							send_tftp_ack(s);
+						}
 
 #if TIME_TIMEOUT != 0
 						stimer_set(&s->timer, TIME_TIMEOUT);
@@ -230,6 +313,21 @@ void send_tftp_rq(tftp_state_t *s) {
 	m += len;
 	*m++ = 0x00;
 
+	/* ask for bigger blocks and a window on reads */
+	if (s->opcode == TFTP_RRQ) {
+		if (blksize_req() > TFTP_BLKSIZE_DEFAULT) {
+			strcpy((char *)m, opt_blksize);
+			m += sizeof(opt_blksize);
+			m += sprintf((char *)m, "%u", blksize_req()) + 1;
+		}
+
+		if (TFTP_WINDOWSIZE > 1) {
+			strcpy((char *)m, opt_windowsize);
+			m += sizeof(opt_windowsize);
+			m += sprintf((char *)m, "%u", TFTP_WINDOWSIZE) + 1;
+		}
+	}
+
 	uip_send(uip_appdata, m - (uint8_t *)uip_appdata);
 }
 
@@ -296,6 +394,10 @@ void tftp_get(tftp_state_t *s, char *filename) {
 	s->filename = filename;    /* specify filename */
 	s->opcode = TFTP_RRQ;
 	s->size = 0;
+	s->received = 0;
+	s->blksize = TFTP_BLKSIZE_DEFAULT;
+	s->windowsize = 1;
+	s->window = 0;
 	s->block = 0;
 	s->ack = 0;
 	s->conn->rport = UIP_HTONS(TFTP_PORT); /* connect UDP port */
@@ -66,6 +66,10 @@ typedef struct tftp_state {
 	uint16_t error_code;	/* error code */
 	struct stimer timer;		/* timeout timer */
 	uint32_t size;			/* file size */
+	uint32_t received;		/* bytes received so far */
+	uint16_t blksize;		/* negotiated block size (RFC 2348) */
+	uint16_t windowsize;	/* negotiated window size (RFC 7440) */
+	uint16_t window;		/* blocks received since the last ACK */
 	char *filename;		/* pointer to filename string */
 	char *mode;			/* pointer to mode of transfer */
 	const char *errmsg;		/* pointer to error message */
@@ -96,6 +100,7 @@ typedef struct tftp_state {
 #define TFTP_EBADID		5		/* Unknown transfer ID */
 #define TFTP_EEXISTS	6		/* File already exists */
 #define TFTP_ENOUSER	7		/* No such user */
+#define TFTP_EBADOPT	8		/* Option negotiation failed (RFC 2347) */
 #define TFTP_ETIMEOUT	1024	/* Timeout */
 
 /* TFTP port number */
@@ -107,6 +112,25 @@ typedef struct tftp_state {
 /* TFTP timeout */
 #define TIME_TIMEOUT	20
 
+/* Default block size, and the largest that fits in the uIP buffer */
+#define TFTP_BLKSIZE_DEFAULT	512
+#define TFTP_BLKSIZE_MAX	(UIP_BUFSIZE - UIP_LLH_LEN - UIP_IPUDPH_LEN - 4)
+
+/* Block size to ask for on RRQ: a whole number of flash pages that still
+ * fits in one Ethernet frame */
+#ifndef CONFIG_LIB_TFTP_BLKSIZE
+#define TFTP_BLKSIZE		1280
+#else
+#define TFTP_BLKSIZE		CONFIG_LIB_TFTP_BLKSIZE
+#endif
+
+/* Blocks to ask for between ACKs on RRQ; the NIC buffers the window */
+#ifndef CONFIG_LIB_TFTP_WINDOWSIZE
+#define TFTP_WINDOWSIZE		8
+#else
+#define TFTP_WINDOWSIZE		CONFIG_LIB_TFTP_WINDOWSIZE
+#endif
+
 void tftp_init(tftp_state_t *s);
 void tftp_appcall(tftp_state_t *s);
 
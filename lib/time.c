@@ -24,13 +24,10 @@
 #include <time.h>
 
 /*
- * All of the code here has been cribbed from the Linux kernel. There have been
- * some modifications, generally to reduce memory usage (smaller types,
- * pgmspace usage, that sort of thing).
+ * tm_valid() has been cribbed from the Linux kernel, with some modifications
+ * to reduce memory usage (smaller types, pgmspace usage, that sort of thing).
  */
 
-#define LEAPS_THRU_END_OF(y) ((y)/4 - (y)/100 + (y)/400)
-
 static const uint8_t rtc_days_in_month[] PROGMEM = {
 	31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
 };
@@ -44,76 +41,103 @@ static inline uint8_t rtc_month_days(uint8_t month, uint16_t year) {
 		(is_leap_year(year) && month == 1);
 }
 
+/*
+ * A 32-bit time_t only reaches from late 1901 to early 2038, and within that
+ * range every fourth year is a leap year: 2000 is one, and the exceptions are
+ * 1900 and 2100. So there are no century rules, the day number always fits
+ * in 16 bits, and both functions below come down to a few divisions with
+ * no loops over years or months.
+ */
+
+// Days from 1900-03-01 to 1970-01-01, both of them Thursdays
+#define DAYS_MAR1900_TO_EPOCH 25508
+// Days from 1900-01-01 to 1970-01-01
+#define DAYS_JAN1900_TO_EPOCH 25567
+#define DAYS_PER_4_YEARS 1461
+
+// Days before the first of each month, in a year without a leap day
+static const uint16_t days_before_month[] PROGMEM = {
+	0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+};
+
 /*
  * Convert seconds since 01-01-1970 00:00:00 to Gregorian date.
  */
 struct tm *gmtime(time_t time, struct tm *tm) {
-	uint16_t year;
-	uint8_t month;
 	int32_t days;
+	uint16_t day;
+	uint16_t secs;
+	uint16_t yday;
+	uint8_t year, cycle_year, month, mon, leap;
 
 	days = time / 86400;
 	time %= 86400;
-
-	/* day of the week, 1970-01-01 was a Thursday */
-	tm->tm_wday = (days + 4) % 7;
-
-	year = 1970 + days / 365;
-	days -= (year - 1970) * 365
-		+ LEAPS_THRU_END_OF(year - 1)
-		- LEAPS_THRU_END_OF(1970 - 1);
-	if (days < 0) {
-		year -= 1;
-		days += 365 + is_leap_year(year);
+	if (time < 0) {
+		time += 86400;
+		days--;
 	}
-	tm->tm_year = year - 1900;
 
-	for (month = 0; month < 11; month++) {
-		int32_t newdays = days - rtc_month_days(month, year);
-		if (newdays < 0)
-			break;
-		days = newdays;
+	/*
+	 * Count days from 1900-03-01, so that years run from March and the leap
+	 * day is the last day of the last year of each cycle of four.
+	 */
+	day = days + DAYS_MAR1900_TO_EPOCH;
+	tm->tm_wday = (day + 4) % 7;
+
+	year = (day / DAYS_PER_4_YEARS) * 4;
+	day %= DAYS_PER_4_YEARS;
+	cycle_year = day / 365;
+	if (cycle_year == 4)
+		cycle_year = 3;
+	year += cycle_year;
+	day -= cycle_year * 365;
+
+	// Months from March; the lengths repeat 31, 30, 31, 30, 31 from there on
+	month = (5 * day + 2) / 153;
+	if (month < 10) {
+		mon = month + 2;
+		leap = (year & 3) == 0;
+		yday = day + 59 + leap;
+	}
+	else {
+		mon = month - 10;
+		year++;
+		leap = (cycle_year == 3);
+		yday = day - 306;
 	}
-	tm->tm_mon = month;
-	tm->tm_mday = days + 1;
 
-	tm->tm_hour = time / 3600;
-	time %= 3600;
-	tm->tm_min = time / 60;
-	tm->tm_sec = time % 60;
+	tm->tm_year = year;
+	tm->tm_mon = mon;
+	tm->tm_yday = yday;
+	tm->tm_mday = yday - pgm_read_word(&days_before_month[mon])
+		- (leap && mon > 1) + 1;
+
+	secs = time >> 4; // 86400 / 16 fits in 16 bits
+	tm->tm_hour = secs / (3600 / 16);
+	secs = time - tm->tm_hour * 3600UL;
+	tm->tm_min = secs / 60;
+	tm->tm_sec = secs % 60;
 
 	return tm;
 }
 
 /*
  * Converts Gregorian date to seconds since 1970-01-01 00:00:00.
- * Assumes input in normal date format, i.e. 1980-12-31 23:59:59
- * => year=1980, mon=12, day=31, hour=23, min=59, sec=59.
- *
- * [For the Julian calendar (which was used in Russia before 1917,
- * Britain & colonies before 1752, anywhere else before 1582,
- * and is still in use by some communities) leave out the
- * -year/100+year/400 terms, and add 10.]
- *
- * This algorithm was first published by Gauss (I think).
- *
- * WARNING: this function will overflow on 2106-02-07 06:28:16 on
- * machines where long is 32-bit! (However, as time_t is signed, we
- * will already get problems at other places on 2038-01-19 03:14:08)
+ * Only tm_year, tm_mon, tm_mday, tm_hour, tm_min and tm_sec are used, and
+ * tm_mon must be in range; the others are allowed to run over.
  */
 time_t mktime(const struct tm * const tm) {
-	unsigned int mon = tm->tm_mon + 1;
-	unsigned long year = tm->tm_year + 1900;
+	uint8_t year = tm->tm_year;
+	uint8_t mon = tm->tm_mon;
+	uint16_t days;
 
-	/* 1..12 -> 11,12,1..10 */
-	if (0 >= (int) (mon -= 2)) {
-		mon += 12;	/* Puts Feb last since it has leap day */
-		year -= 1;
-	}
+	// 1900 wasn't a leap year, but it can't be reached with a 32-bit time_t
+	days = year * 365U + (year ? (year - 1) / 4 : 0)
+		+ pgm_read_word(&days_before_month[mon])
+		+ (mon > 1 && !(year & 3) && year)
+		+ tm->tm_mday - 1;
 
-	return ((((time_t)
-		(year/4 - year/100 + year/400 + 367*mon/12 + tm->tm_mday) +
-		year*365 - 719499
+	return ((((time_t)days - DAYS_JAN1900_TO_EPOCH
 		)*24 + tm->tm_hour /* now have hours */
 		)*60 + tm->tm_min /* now have minutes */
 		)*60 + tm->tm_sec; /* finally seconds */
@@ -137,3 +161,29 @@ int tm_valid(const struct tm *tm) {
 	return 0;
 }
 
+
+/*
+ * The same one or two seconds get converted over and over again (syslog bursts,
+ * log listings), so keep the last result around. Within the same minute we can
+ * just bump the seconds instead of going through gmtime() again.
+ */
+static struct tm cached_tm;
+static time_t cached_time;
+static uint8_t cached_valid;
+
+const struct tm *gmtime_cached(time_t time) {
+	if (cached_valid && time == cached_time) {
+		return &cached_tm;
+	}
+
+	if (cached_valid && time == cached_time + 1 && cached_tm.tm_sec < 59) {
+		cached_tm.tm_sec++;
+	}
+	else {
+		gmtime(time, &cached_tm);
+		cached_valid = 1;
+	}
+
+	cached_time = time;
+	return &cached_tm;
+}
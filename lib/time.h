@@ -42,7 +42,12 @@ size_t strftime_P(
 	PGM_P fmt,
 	const struct tm *tm);
 
+// RFC 3164 timestamp ("Mmm dd hh:mm:ss"), cached until the time changes
+#define TIME_STAMP_LEN 15
+const char *time_stamp(time_t time);
+
 struct tm *gmtime(time_t time, struct tm *tm);
+const struct tm *gmtime_cached(time_t time); // valid until the next call
 time_t mktime(const struct tm * const tmp);
 int tm_valid(const struct tm *tm);
 
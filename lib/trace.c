@@ -0,0 +1,179 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <util/atomic.h>
+#include <avr/pgmspace.h>
+#include <board.h>
+#include "trace.h"
+
+#if TRACE_SIZE > 256
+#error LIB_TRACE_SIZE must be 256 or less
+#endif
+
+static struct trace_entry ring[TRACE_SIZE];
+static uint8_t next; // slot the next entry goes in
+static uint16_t count; // entries in the ring
+static uint8_t hold;
+
+static const char name_proc_in[] PROGMEM = "proc-in";
+static const char name_proc_out[] PROGMEM = "proc-out";
+static const char name_ow_wait[] PROGMEM = "ow-wait";
+static const char name_ow_done[] PROGMEM = "ow-done";
+static const char name_df_read[] PROGMEM = "df-read";
+static const char name_df_erase[] PROGMEM = "df-erase";
+static const char name_df_wait[] PROGMEM = "df-wait";
+static const char name_df_ready[] PROGMEM = "df-ready";
+static const char name_nic_rx[] PROGMEM = "nic-rx";
+static const char name_nic_tx[] PROGMEM = "nic-tx";
+static const char name_sf_read[] PROGMEM = "sf-read";
+static const char name_httpd_req[] PROGMEM = "httpd-req";
+static const char name_httpd_done[] PROGMEM = "httpd-done";
+
+const char * const trace_names[TRACE_IDS] PROGMEM = {
+	[TRACE_PROC_IN] = name_proc_in,
+	[TRACE_PROC_OUT] = name_proc_out,
+	[TRACE_OW_WAIT] = name_ow_wait,
+	[TRACE_OW_DONE] = name_ow_done,
+	[TRACE_DF_READ] = name_df_read,
+	[TRACE_DF_ERASE] = name_df_erase,
+	[TRACE_DF_WAIT] = name_df_wait,
+	[TRACE_DF_READY] = name_df_ready,
+	[TRACE_NIC_RX] = name_nic_rx,
+	[TRACE_NIC_TX] = name_nic_tx,
+	[TRACE_SF_READ] = name_sf_read,
+	[TRACE_HTTPD_REQ] = name_httpd_req,
+	[TRACE_HTTPD_DONE] = name_httpd_done,
+};
+
+void trace_add(uint8_t id, uint16_t arg) {
+	uint32_t now;
+
+	if (hold) {
+		return;
+	}
+	now = clock_cycles();
+
+	// Trace points in interrupt handlers mustn't get the same slot
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		struct trace_entry *e = &ring[next];
+
+		e->time = now;
+		e->arg = arg;
+		e->id = id;
+
+		if (++next == TRACE_SIZE) {
+			next = 0;
+		}
+		if (count < TRACE_SIZE) {
+			count++;
+		}
+	}
+}
+
+void trace_hold(void) {
+	hold++;
+}
+
+void trace_release(void) {
+	if (hold) {
+		hold--;
+	}
+}
+
+uint16_t trace_count(void) {
+	return count;
+}
+
+int trace_get(uint16_t n, struct trace_entry *e) {
+	if (n >= count) {
+		return -1;
+	}
+
+	// The oldest entry is count slots back from the next one
+	n += next + TRACE_SIZE - count;
+	if (n >= TRACE_SIZE) {
+		n -= TRACE_SIZE;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*e = ring[n];
+	}
+
+	return 0;
+}
+
+void trace_clear(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		next = 0;
+		count = 0;
+	}
+}
+
+uint16_t trace_export_size(void) {
+	return sizeof(struct trace_header) + count * sizeof(struct trace_entry);
+}
+
+uint16_t trace_export(void *buf, uint16_t offset, uint16_t len) {
+	struct trace_header hdr = {
+		.f_cpu = F_CPU,
+		.count = count,
+		.size = sizeof(struct trace_entry),
+		.ids = TRACE_IDS,
+	};
+	uint8_t *ptr = buf;
+	uint16_t done = 0;
+
+	// The header, or what's left of it
+	if (offset < sizeof(hdr)) {
+		uint16_t n = sizeof(hdr) - offset;
+
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ptr, (uint8_t *)&hdr + offset, n);
+		done = n;
+		offset = 0;
+	}
+	else {
+		offset -= sizeof(hdr);
+	}
+
+	// Then the entries, starting part way into one if need be
+	while (done < len) {
+		struct trace_entry e;
+		uint16_t skip = offset % sizeof(e);
+		uint16_t n = sizeof(e) - skip;
+
+		if (trace_get(offset / sizeof(e), &e)) {
+			break;
+		}
+
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(&ptr[done], (uint8_t *)&e + skip, n);
+		done += n;
+		offset += n;
+	}
+
+	return done;
+}
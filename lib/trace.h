@@ -0,0 +1,115 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * A ring of timestamped trace points, for working out where the time went
+ * when something stalls. Each one is an ID, a 16-bit argument and the time
+ * from clock_cycles(). The oldest entries are overwritten. Without LIB_TRACE,
+ * TRACE() compiles to nothing.
+ */
+
+enum {
+	TRACE_PROC_IN, // process dispatch starts (procstat slot)
+	TRACE_PROC_OUT, // and finishes (procstat slot)
+	TRACE_OW_WAIT, // DS2482 busy wait starts
+	TRACE_OW_DONE, // and finishes (status polls)
+	TRACE_DF_READ, // dataflash read (bytes)
+	TRACE_DF_ERASE, // dataflash erase started (4 KiB sector number)
+	TRACE_DF_WAIT, // dataflash busy wait starts
+	TRACE_DF_READY, // and finishes (status polls)
+	TRACE_NIC_RX, // frame read from the NIC (bytes)
+	TRACE_NIC_TX, // frame handed to the NIC (bytes)
+	TRACE_SF_READ, // sendfile data read (bytes)
+	TRACE_HTTPD_REQ, // request parsed (connections in use)
+	TRACE_HTTPD_DONE, // response logged (status)
+	TRACE_IDS
+};
+
+// Entries kept, at most 256
+#ifndef CONFIG_LIB_TRACE_SIZE
+#define TRACE_SIZE 64
+#else
+#define TRACE_SIZE CONFIG_LIB_TRACE_SIZE
+#endif
+
+// clock_cycles() differences to microseconds, without overflowing
+#define TRACE_CYCLES_US(c) \
+	((uint32_t)(c) / (F_CPU / 1000) * 1000 + \
+	 (uint32_t)(c) % (F_CPU / 1000) * 1000 / (F_CPU / 1000))
+
+#if CONFIG_LIB_TRACE
+
+#include <avr/pgmspace.h>
+
+struct trace_entry {
+	uint32_t time; // clock_cycles()
+	uint16_t arg;
+	uint8_t id;
+};
+
+/*
+ * Downloads start with this, followed by the entries oldest first, all
+ * little-endian and unpadded
+ */
+struct trace_header {
+	uint32_t f_cpu; // clock_cycles() per second
+	uint16_t count; // entries that follow
+	uint8_t size; // bytes per entry
+	uint8_t ids; // TRACE_IDS
+};
+
+void trace_add(uint8_t id, uint16_t arg);
+
+// While held (it nests), nothing is recorded, so the entries can be read
+// out without them changing underneath
+void trace_hold(void);
+void trace_release(void);
+
+// Number of entries, and the nth oldest of them (-1 if there's no such entry)
+uint16_t trace_count(void);
+int trace_get(uint16_t n, struct trace_entry *e);
+
+// Forget everything recorded so far
+void trace_clear(void);
+
+// Copy part of the download (header and entries) into buf, returning the
+// number of bytes copied; the whole thing is trace_export_size() bytes
+uint16_t trace_export_size(void);
+uint16_t trace_export(void *buf, uint16_t offset, uint16_t len);
+
+// Names of the IDs for reports
+extern const char * const trace_names[TRACE_IDS] PROGMEM;
+
+#define TRACE(id, arg) trace_add(id, arg)
+
+#else
+
+// The argument is still evaluated, so counters kept just for tracing don't
+// look unused; without side effects that costs nothing
+#define TRACE(id, arg) do { (void)(arg); } while (0)
+
+#endif
+
+#endif
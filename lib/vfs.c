@@ -0,0 +1,169 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "vfs.h"
+#if CONFIG_LIB_RUNFS
+#include "runfs.h"
+#endif
+#if CONFIG_LIB_POLYFS_CFS
+#include "polyfs_cfs.h"
+#endif
+
+struct vfs_mount {
+	PGM_P prefix;
+	const struct vfs_ops *ops;
+};
+
+#if CONFIG_LIB_RUNFS
+static const char prefix_run[] PROGMEM = "/run";
+#endif
+static const char prefix_root[] PROGMEM = "";
+
+// Searched in order, so the catch-all root comes last
+static const struct vfs_mount mounts[] = {
+#if CONFIG_LIB_RUNFS
+	{ prefix_run, &runfs_ops },
+#endif
+#if CONFIG_LIB_POLYFS_CFS
+	{ prefix_root, &polyfs_cfs_ops },
+#endif
+};
+
+#define NUM_MOUNTS (sizeof(mounts) / sizeof(mounts[0]))
+
+#define FD_MOUNT(fd) ((fd) >> VFS_FD_BITS)
+#define FD_OWN(fd) ((fd) & VFS_FD_MAX)
+#define FD_VALID(fd) ((fd) >= 0 && FD_MOUNT(fd) < NUM_MOUNTS)
+#define FD_OPS(fd) (mounts[FD_MOUNT(fd)].ops)
+
+#define DIR_MOUNT(dirp) (((uint8_t *)(dirp))[VFS_DIR_SPACE])
+
+// Find the mount a path is under, and the part of the path it gets.
+// Returns the mount number, or -1 if nothing matched.
+static int8_t lookup(const char *name, const char **rest) {
+	for (uint8_t i = 0; i < NUM_MOUNTS; i++) {
+		size_t len = strlen_P(mounts[i].prefix);
+
+		if (strncmp_P(name, mounts[i].prefix, len) == 0 &&
+			(name[len] == '/' || name[len] == '\0'))
+		{
+			*rest = name + len;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int cfs_open(const char *name, int flags) {
+	const char *rest;
+	int8_t m = lookup(name, &rest);
+	int fd;
+
+	if (m < 0) {
+		return -1;
+	}
+
+	fd = mounts[m].ops->open(rest, flags);
+	if (fd < 0) {
+		return -1;
+	}
+	else if (fd > VFS_FD_MAX) {
+		mounts[m].ops->close(fd);
+		return -1;
+	}
+
+	return ((int)m << VFS_FD_BITS) | fd;
+}
+
+void cfs_close(int fd) {
+	if (FD_VALID(fd)) {
+		FD_OPS(fd)->close(FD_OWN(fd));
+	}
+}
+
+int cfs_read(int fd, void *buf, unsigned int len) {
+	if (!FD_VALID(fd)) {
+		return -1;
+	}
+
+	return FD_OPS(fd)->read(FD_OWN(fd), buf, len);
+}
+
+int cfs_write(int fd, const void *buf, unsigned int len) {
+	if (!FD_VALID(fd) || !FD_OPS(fd)->write) {
+		return -1;
+	}
+
+	return FD_OPS(fd)->write(FD_OWN(fd), buf, len);
+}
+
+cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence) {
+	if (!FD_VALID(fd)) {
+		return -1;
+	}
+
+	return FD_OPS(fd)->seek(FD_OWN(fd), offset, whence);
+}
+
+int cfs_remove(const char *name) {
+	const char *rest;
+	int8_t m = lookup(name, &rest);
+
+	if (m < 0 || !mounts[m].ops->remove) {
+		return -1;
+	}
+
+	return mounts[m].ops->remove(rest);
+}
+
+int cfs_opendir(struct cfs_dir *dirp, const char *name) {
+	const char *rest;
+	int8_t m = lookup(name, &rest);
+
+	if (m < 0) {
+		return -1;
+	}
+
+	DIR_MOUNT(dirp) = m;
+	return mounts[m].ops->opendir(dirp, rest);
+}
+
+int cfs_readdir(struct cfs_dir *dirp, struct cfs_dirent *dirent) {
+	uint8_t m = DIR_MOUNT(dirp);
+
+	if (m >= NUM_MOUNTS) {
+		return -1;
+	}
+
+	return mounts[m].ops->readdir(dirp, dirent);
+}
+
+void cfs_closedir(struct cfs_dir *dirp) {
+	uint8_t m = DIR_MOUNT(dirp);
+
+	if (m < NUM_MOUNTS) {
+		mounts[m].ops->closedir(dirp);
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include <cfs/cfs.h>
+
+/*
+ * The Contiki CFS interface, shared out between several filesystems.
+ *
+ * Each filesystem is mounted at a path prefix in a fixed table, and gets
+ * paths under it with the prefix taken off ("/run/uptime" reaches the /run
+ * filesystem as "/uptime", and "/run" itself as ""). The filesystem
+ * mounted at "" gets every path nothing else matched, whole. The prefix is
+ * only matched when a file or directory is opened: the mount goes in the
+ * top bits of the fd (and the last byte of a struct cfs_dir), so reads and
+ * seeks go straight to the filesystem's own function.
+ */
+
+// Bits of an fd that are the filesystem's own fd, which has to fit
+#define VFS_FD_BITS 5
+#define VFS_FD_MAX ((1 << VFS_FD_BITS) - 1)
+
+// Room a filesystem has in a struct cfs_dir; the VFS has the last byte
+#define VFS_DIR_SPACE (sizeof(struct cfs_dir) - 1)
+
+// What a filesystem provides, the same as the cfs_*() functions. A
+// read-only one can leave write and remove NULL.
+struct vfs_ops {
+	int (*open)(const char *name, int flags);
+	void (*close)(int fd);
+	int (*read)(int fd, void *buf, unsigned int len);
+	int (*write)(int fd, const void *buf, unsigned int len);
+	cfs_offset_t (*seek)(int fd, cfs_offset_t offset, int whence);
+	int (*remove)(const char *name);
+	int (*opendir)(struct cfs_dir *dirp, const char *name);
+	int (*readdir)(struct cfs_dir *dirp, struct cfs_dirent *dirent);
+	void (*closedir)(struct cfs_dir *dirp);
+};
+
+#endif // VFS_H
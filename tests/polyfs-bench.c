@@ -0,0 +1,313 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Time lookups, reads, directory walks and CRC checks against a PolyFS
+ * image, and count the storage accesses each one makes. On the device
+ * every fn_read() call is a dataflash transaction, so reads/op and
+ * bytes/op are what predict latency there; the host timings are only
+ * useful for comparing one build against another.
+ *
+ * The image is loaded into memory so the timings measure lib/polyfs.c and
+ * not stdio.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "polyfs.h"
+
+// Keep running a test until it has taken at least this long
+#define MIN_TIME 0.2
+
+#define SEQ_CHUNK 256
+#define RANDOM_CHUNK 64
+#define RANDOM_READS 1000
+
+polyfs_fs_t fs;
+
+static uint8_t *image;
+static uint32_t image_size;
+
+static unsigned long read_calls;
+static unsigned long read_bytes;
+
+struct file {
+	char *path;
+	struct polyfs_inode inode;
+};
+
+static struct file *files;
+static int nfiles;
+
+static int read_mem(polyfs_fs_t *fs, void *ptr,
+	uint32_t offset, uint32_t bytes)
+{
+	read_calls++;
+
+	if (offset >= image_size) {
+		return 0;
+	}
+	if (bytes > image_size - offset) {
+		bytes = image_size - offset;
+	}
+
+	read_bytes += bytes;
+	memcpy(ptr, image + offset, bytes);
+	return bytes;
+}
+
+static double now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Walk a directory, optionally remembering every regular file
+static void walk(const struct polyfs_inode *dir, const char *path, int save) {
+	polyfs_readdir_t rd;
+	char name[POLYFS_MAXPATHLEN + 1];
+	int err;
+
+	err = polyfs_opendir(&fs, dir, &rd);
+	assert(err == 0);
+
+	while (rd.next) {
+		err = polyfs_readdir(&rd);
+		assert(err == 0);
+
+		name[0] = '\0';
+		strncat(name, (char *)rd.name, POLYFS_GET_NAMELEN(&rd.inode) << 2);
+
+		char *child = malloc(strlen(path) + strlen(name) + 2);
+		assert(child != NULL);
+		sprintf(child, "%s/%s", path, name);
+
+		if (S_ISDIR(rd.inode.mode)) {
+			walk(&rd.inode, child, save);
+			free(child);
+		}
+		else if (S_ISREG(rd.inode.mode) && save) {
+			files = realloc(files, (nfiles + 1) * sizeof(*files));
+			assert(files != NULL);
+			files[nfiles].path = child;
+			files[nfiles].inode = rd.inode;
+			nfiles++;
+		}
+		else {
+			free(child);
+		}
+	}
+}
+
+// Run one pass of a test, returning the number of operations it did
+typedef unsigned long (*test_fn)(int cold);
+
+static void run(const char *name, test_fn fn, int cold, const char *unit) {
+	unsigned long ops = 0, calls, bytes;
+	double start, elapsed;
+
+	read_calls = 0;
+	read_bytes = 0;
+
+	start = now();
+	do {
+		ops += fn(cold);
+		elapsed = now() - start;
+	} while (elapsed < MIN_TIME);
+
+	calls = read_calls;
+	bytes = read_bytes;
+
+	printf("%-16s %10.0f %s/s %8.2f reads/op %10.1f bytes/op\n",
+		name, ops / elapsed, unit,
+		(double)calls / ops, (double)bytes / ops);
+}
+
+static unsigned long test_walk(int cold) {
+	if (cold) {
+		polyfs_cache_flush(&fs);
+	}
+	walk(&fs.root, "", 0);
+	return 1;
+}
+
+static unsigned long test_lookup(int cold) {
+	struct polyfs_inode inode;
+
+	for (int i = 0; i < nfiles; i++) {
+		if (cold) {
+			polyfs_cache_flush(&fs);
+		}
+		int err = polyfs_lookup(&fs, files[i].path, &inode);
+		assert(err == 0);
+	}
+	return nfiles;
+}
+
+// Sequential reads count kilobytes, so the unit is KiB/s
+static unsigned long test_seq(int cold) {
+	uint8_t buf[SEQ_CHUNK];
+	unsigned long total = 0;
+
+	for (int i = 0; i < nfiles; i++) {
+		const struct polyfs_inode *inode = &files[i].inode;
+		polyfs_blkptr_t bp;
+		uint32_t offset = 0;
+
+		if (cold) {
+			polyfs_cache_flush(&fs);
+		}
+
+		bp.count = 0;
+		while (offset < inode->size) {
+			int32_t len = polyfs_fread_blkptr(&fs, inode, &bp,
+				buf, offset, sizeof(buf));
+			assert(len > 0);
+			offset += len;
+		}
+		total += offset;
+	}
+
+	// At least one so tiny images still make progress
+	return total / 1024 ? total / 1024 : 1;
+}
+
+static unsigned long test_random(int cold) {
+	uint8_t buf[RANDOM_CHUNK];
+	int reads = 0;
+
+	// Same sequence every pass
+	srand(1);
+
+	while (reads < RANDOM_READS) {
+		const struct polyfs_inode *inode = &files[rand() % nfiles].inode;
+
+		if (!inode->size) {
+			continue;
+		}
+		if (cold) {
+			polyfs_cache_flush(&fs);
+		}
+
+		uint32_t offset = rand() % inode->size;
+		int32_t len = polyfs_fread(&fs, inode, buf, offset, sizeof(buf));
+		assert(len > 0);
+		reads++;
+	}
+
+	return reads;
+}
+
+static unsigned long test_crc(int cold) {
+	uint8_t temp[1024];
+
+	int err = polyfs_check_crc(&fs, temp, sizeof(temp));
+	assert(err == 0);
+
+	return image_size / 1024 ? image_size / 1024 : 1;
+}
+
+static int run_tests(const char *file) {
+	int err;
+
+	// load the image
+	FILE *fsbs = fopen(file, "r");
+	if (!fsbs) {
+		printf("failed to open file: %s\n", file);
+		return 1;
+	}
+
+	fseek(fsbs, 0, SEEK_END);
+	image_size = ftell(fsbs);
+	rewind(fsbs);
+
+	image = malloc(image_size);
+	assert(image != NULL);
+	if (fread(image, 1, image_size, fsbs) != image_size) {
+		printf("failed to read file: %s\n", file);
+		return 1;
+	}
+	fclose(fsbs);
+
+	// set up the structure
+	fs.fn_read = read_mem;
+
+	// initialise
+	err = polyfs_init();
+	assert(err == 0);
+
+	// open the filesystem
+	err = polyfs_fs_open(&fs);
+	assert(err == 0);
+
+	// find every file once up front
+	walk(&fs.root, "", 1);
+	if (!nfiles) {
+		printf("no files in image: %s\n", file);
+		return 1;
+	}
+
+	printf("%s: %u bytes, %d files\n", file, image_size, nfiles);
+
+	run("walk", test_walk, 1, "walks");
+	run("lookup-cold", test_lookup, 1, "lookups");
+	run("lookup-warm", test_lookup, 0, "lookups");
+	run("fread-seq-cold", test_seq, 1, "KiB");
+	run("fread-seq-warm", test_seq, 0, "KiB");
+	run("fread-random", test_random, 1, "reads");
+	run("crc", test_crc, 0, "KiB");
+
+	for (int i = 0; i < nfiles; i++) {
+		free(files[i].path);
+	}
+	free(files);
+	free(image);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		printf("Usage: %s <file.pfs>\n", argv[0]);
+		return 1;
+	}
+
+	struct stat s;
+	int err = stat(argv[1], &s);
+	if (err) {
+		printf("%s: stat failed: %d\n", argv[0], errno);
+		return 1;
+	}
+
+	if (!S_ISREG(s.st_mode)) {
+		printf("%s: %s is not a regular file\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	return run_tests(argv[1]);
+}
@@ -0,0 +1,181 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Check lib/time.c's gmtime() and mktime() against the Linux-derived versions
+ * they replaced, for every second in the time_t range. The old gmtime() only
+ * worked from the epoch onwards, so before that the check is that both new
+ * functions agree with each other and with a day-by-day calendar walk.
+ *
+ * Build from the top of the tree with:
+ *   gcc -std=gnu99 -W -Wall -O2 -Itests/host -Ilib -o time-check \
+ *       tests/time-check.c
+ *
+ * Only <stdio.h>, <stdint.h> and <string.h> are used, as lib/time.h takes the place of
+ * the system <time.h>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../lib/time.c"
+
+#define LEAPS_THRU_END_OF(y) ((y)/4 - (y)/100 + (y)/400)
+
+static struct tm *old_gmtime(time_t time, struct tm *tm) {
+	uint16_t year;
+	uint8_t month;
+	int32_t days;
+
+	days = time / 86400;
+	time %= 86400;
+
+	tm->tm_wday = (days + 4) % 7;
+
+	year = 1970 + days / 365;
+	days -= (year - 1970) * 365
+		+ LEAPS_THRU_END_OF(year - 1)
+		- LEAPS_THRU_END_OF(1970 - 1);
+	if (days < 0) {
+		year -= 1;
+		days += 365 + is_leap_year(year);
+	}
+	tm->tm_year = year - 1900;
+
+	for (month = 0; month < 11; month++) {
+		int32_t newdays = days - rtc_month_days(month, year);
+		if (newdays < 0)
+			break;
+		days = newdays;
+	}
+	tm->tm_mon = month;
+	tm->tm_mday = days + 1;
+
+	tm->tm_hour = time / 3600;
+	time %= 3600;
+	tm->tm_min = time / 60;
+	tm->tm_sec = time % 60;
+
+	return tm;
+}
+
+static time_t old_mktime(const struct tm * const tm) {
+	unsigned int mon = tm->tm_mon + 1;
+	unsigned long year = tm->tm_year + 1900;
+
+	if (0 >= (int) (mon -= 2)) {
+		mon += 12;
+		year -= 1;
+	}
+
+	return ((((time_t)
+		(year/4 - year/100 + year/400 + 367*mon/12 + tm->tm_mday) +
+		year*365 - 719499
+		)*24 + tm->tm_hour
+		)*60 + tm->tm_min
+		)*60 + tm->tm_sec;
+}
+
+static int tm_same(const struct tm *a, const struct tm *b) {
+	return a->tm_sec == b->tm_sec && a->tm_min == b->tm_min &&
+		a->tm_hour == b->tm_hour && a->tm_mday == b->tm_mday &&
+		a->tm_mon == b->tm_mon && a->tm_year == b->tm_year &&
+		a->tm_wday == b->tm_wday;
+}
+
+static void tm_print(const char *what, time_t t, const struct tm *tm) {
+	fprintf(stderr, "%s(%ld): %04d-%02d-%02d %02d:%02d:%02d wday %d yday %d\n",
+		what, (long)t, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+		tm->tm_hour, tm->tm_min, tm->tm_sec, tm->tm_wday, tm->tm_yday);
+}
+
+int main(void) {
+	struct tm tm, ref;
+	int64_t t;
+	int32_t day;
+	unsigned long errors = 0;
+
+	/*
+	 * The calendar walk. Start from 1901-12-13, the day INT32_MIN falls on,
+	 * which was a Friday, and step a day at a time to the last whole day.
+	 */
+	memset(&ref, 0, sizeof(ref));
+	ref.tm_year = 1;
+	ref.tm_mon = 11;
+	ref.tm_mday = 13;
+	ref.tm_wday = 5;
+	ref.tm_yday = 346;
+	for (day = INT32_MIN / 86400 - 1; day <= INT32_MAX / 86400; day++) {
+		t = (int64_t)day * 86400;
+		if (t >= INT32_MIN) {
+			gmtime(t, &tm);
+			if (!tm_same(&tm, &ref) || tm.tm_yday != ref.tm_yday) {
+				tm_print("gmtime", t, &tm);
+				tm_print("expected", t, &ref);
+				errors++;
+			}
+			if (mktime(&ref) != t) {
+				tm_print("mktime", mktime(&ref), &ref);
+				errors++;
+			}
+		}
+
+		ref.tm_wday = (ref.tm_wday + 1) % 7;
+		ref.tm_yday++;
+		if (++ref.tm_mday > rtc_month_days(ref.tm_mon, ref.tm_year + 1900)) {
+			ref.tm_mday = 1;
+			if (++ref.tm_mon == 12) {
+				ref.tm_mon = 0;
+				ref.tm_year++;
+				ref.tm_yday = 0;
+			}
+		}
+
+		if (errors > 10)
+			break;
+	}
+
+	// Every second against the old code, and round trips through mktime()
+	for (t = INT32_MIN; t <= INT32_MAX && errors <= 10; t++) {
+		gmtime(t, &tm);
+		if (t >= 0) {
+			old_gmtime(t, &ref);
+			if (!tm_same(&tm, &ref)) {
+				tm_print("gmtime", t, &tm);
+				tm_print("old_gmtime", t, &ref);
+				errors++;
+			}
+		}
+		if (mktime(&tm) != t || old_mktime(&tm) != t) {
+			tm_print("mktime", t, &tm);
+			errors++;
+		}
+	}
+
+	if (errors) {
+		fprintf(stderr, "FAILED\n");
+		return 1;
+	}
+
+	printf("gmtime() and mktime() OK from %ld to %ld\n",
+		(long)INT32_MIN, (long)INT32_MAX);
+	return 0;
+}
@@ -40,12 +40,17 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#ifndef __APPLE__
+#include <sys/sysmacros.h>
+#endif
 #include <stdarg.h>
 #include <libgen.h>
 #include <ctype.h>
 #include <assert.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "polyfs/polyfs_fs.h"
 #include <zlib.h>
 #include <lzo/lzo1x.h>
@@ -170,9 +175,16 @@ static unsigned int blksize = POLYFS_BLOCK_SIZE;
 static long total_blocks = 0, total_nodes = 1; /* pre-count the root node */
 static int image_length = 0;
 
-/* For LZO compression */
-void *lzo_mem = NULL;
-void *lzo_compress_buf = NULL;
+/*
+ * LZO1X-999 level used by -L, the same as plain lzo1x_999_compress().
+ * LZO_LEVEL_BEST tries LZO1X-1 and every LZO1X-999 level per block.
+ */
+#define LZO_LEVEL_DEFAULT	8
+#define LZO_LEVEL_BEST		0
+
+/* For LZO compression, one set of buffers per compression thread */
+static __thread void *lzo_mem = NULL;
+static __thread void *lzo_compress_buf = NULL;
 int page_size = POLYFS_BLOCK_SIZE;
 
 /*
@@ -192,7 +204,20 @@ static int opt_pad = 0;
 static int opt_verbose = 0;
 static int opt_squash = 0;
 static int opt_lzo = 0;
+static int opt_image_lzo = 0;
 static int opt_zlib = 0;
+static int opt_lzss = 0;
+static int opt_index = 0;
+static int opt_splice = 0;
+static int opt_mime = 0;
+static int opt_inline = 0;
+static int opt_share = 0;
+static int opt_crc = 0;
+static long opt_threads = 0;
+static const char *opt_cache = NULL;
+static int opt_lzo_level = LZO_LEVEL_DEFAULT;
+static const char *opt_hot = NULL;
+static long cache_hits = 0, cache_misses = 0;
 static char *opt_image = NULL;
 static char *opt_name = NULL;
 static int swap_endian = 0;
@@ -214,6 +239,8 @@ struct entry {
 	void *uncompressed;
 	/* points to other identical file */
 	struct entry *same;
+	uint32_t hash;		/* content hash, valid if hashed is set */
+	int hashed;
 	unsigned int offset;		/* pointer to compressed data in archive */
 	unsigned int dir_offset;	/* Where in the archive is the directory entry? */
 
@@ -226,7 +253,12 @@ extern int polyfs_lzo_cmpr(
 	unsigned char *data_in,
 	unsigned char *cpage_out,
 	uint32_t sourcelen, uint32_t *dstlen);
+extern int polyfs_lzss_cmpr(
+	unsigned char *data_in,
+	unsigned char *cpage_out,
+	uint32_t sourcelen, uint32_t *dstlen);
 extern int polyfs_lzo_init(void);
+extern int polyfs_lzo_alloc(void);
 extern void polyfs_lzo_exit(void);
 
 /* Input status of 0 to print help and exit without an error. */
@@ -241,6 +273,7 @@ static void usage(int status)
 			"   -E         make all warnings errors (non-zero exit status)\n"
 			"   -e edition set edition number (part of fsid)\n"
 			"   -i file    insert a file image into the filesystem (requires >= 2.4.0)\n"
+			"   -c         LZO compress the inserted file image\n"
 			"   -n name    set name of polyfs filesystem\n"
 			"   -p         pad by %d bytes for boot code\n"
 			"   -s         sort directory entries (old option, ignored)\n"
@@ -250,9 +283,23 @@ static void usage(int status)
 			"   -b         create a filesystem for big-endian machines\n"
 			"   -l         create a filesystem for little-endian machines\n"
 			"   -L         create a filesystem using LZO compression\n"
+			"   -O level   LZO1X-999 level 1-9 (default %d), or 'best' to keep\n"
+			"              the smallest of all levels and LZO1X-1 per block\n"
 			"   -Z         create a filesystem using zlib compression\n"
+			"   -S         create a filesystem using LZSS compression, which the\n"
+			"              device can read without a block buffer\n"
+			"   -x         write directory index tables for faster lookups\n"
+			"   -j N       compress with N threads (default: one per CPU)\n"
+			"   -C dir     reuse compressed blocks cached in dir\n"
+			"   -H file    lay out the files listed in file first, in order\n"
+			"   -I         splice '%%!:' includes into .shtml files\n"
+			"   -T         store the content type of each file in its gid\n"
+			"   -N         store files of up to %d bytes in their directory entry\n"
+			"   -B         share identical compressed blocks between files\n"
+			"   -K         store a CRC of every file data block\n"
 			" dirname    root of the filesystem to be created\n"
-			" outfile    output file\n", progname, PAD_SIZE);
+			" outfile    output file\n", progname, PAD_SIZE, LZO_LEVEL_DEFAULT,
+			POLYFS_INLINE_MAX);
 
 	exit(status);
 }
@@ -427,13 +474,27 @@ static void unmap_entry(struct entry *entry)
 	}
 }
 
+/* Hash a file's contents once so most non-matches skip the memcmp() */
+static uint32_t entry_hash(struct entry *entry)
+{
+	if (!entry->hashed) {
+		map_entry(entry);
+		entry->hash = crc32(crc32(0L, Z_NULL, 0),
+				entry->uncompressed, entry->size);
+		unmap_entry(entry);
+		entry->hashed = 1;
+	}
+	return entry->hash;
+}
+
 static int find_identical_file(struct entry *orig, struct entry *newfile)
 {
 	if (orig == newfile)
 		return 1;
 	if (!orig)
 		return 0;
-	if (orig->size == newfile->size && (orig->path || orig->uncompressed))
+	if (orig->size == newfile->size && (orig->path || orig->uncompressed) &&
+			entry_hash(orig) == entry_hash(newfile))
 	{
 		map_entry(orig);
 		map_entry(newfile);
@@ -599,6 +660,8 @@ static unsigned int parse_directory(struct entry *root_entry, const char *name,
 			/* block pointers & data expansion allowance + data */
 			if (entry->size)
 				*fslen_ub += (4+26)*blocks + entry->size + 3;
+			if (entry->size && opt_crc)
+				*fslen_ub += POLYFS_CRC_TABLE_SIZE(blocks);
 		}
 
 		/* Link it into the list */
@@ -606,12 +669,15 @@ static unsigned int parse_directory(struct entry *root_entry, const char *name,
 		prev = &entry->next;
 		totalsize += size;
 	}
+	if (opt_index)
+		*fslen_ub += POLYFS_DIR_INDEX_SIZE(dircount);
 	free(path);
 	free(dirlist);		/* allocated by scandir() with malloc() */
 	return totalsize;
 }
 
 #define wswap(x)    (((x)>>24) | (((x)>>8)&0xff00) | (((x)&0xff00)<<8) | (((x)&0xff)<<24))
+#define hswap(x)    ((((x)>>8)&0xff) | (((x)&0xff)<<8))
 /* routines to swap endianness/bitfields in inode/superblock block data */
 static void fix_inode(struct polyfs_inode *inode)
 {
@@ -666,6 +732,49 @@ static void fix_super(struct polyfs_super *super)
 	fix_inode(&super->root);
 }
 
+/* Size of the index table written in front of a list of directory entries */
+static unsigned int dir_index_size(struct entry *entry)
+{
+	unsigned int count = 0;
+
+	if (!entry)
+		return 0;
+	for (; entry; entry = entry->next)
+		count++;
+	return POLYFS_DIR_INDEX_SIZE(count);
+}
+
+/*
+ * Fill in the index table for a list of directory entries that have already
+ * been written out starting at 'first'.
+ */
+static void write_dir_index(struct entry *entry, char *base, unsigned int first)
+{
+	uint16_t *table;
+	unsigned int count = 0;
+	struct entry *e;
+
+	for (e = entry; e; e = e->next)
+		count++;
+	if (count == 0)
+		return;
+	if (count > 0xffff)
+		error_msg_and_die("too many entries in a directory for the index");
+
+	memset(base + first - POLYFS_DIR_INDEX_SIZE(count), 0,
+			POLYFS_DIR_INDEX_SIZE(count));
+	table = (uint16_t *) (base + first) - count - 1;
+
+	for (e = entry; e; e = e->next) {
+		unsigned int rel = (e->dir_offset - first) >> 2;
+
+		if (rel > 0xffff)
+			error_msg_and_die("directory too large for the index");
+		*table++ = swap_endian ? hswap(rel) : rel;
+	}
+	*table = swap_endian ? hswap(count) : count;
+}
+
 /* Returns sizeof(struct polyfs_super), which includes the root inode. */
 static unsigned int write_superblock(struct entry *root, char *base, int size)
 {
@@ -680,12 +789,26 @@ static unsigned int write_superblock(struct entry *root, char *base, int size)
 	super->flags = POLYFS_FLAG_FSID_VERSION_1 | POLYFS_FLAG_SORTED_DIRS;
 	if (opt_holes)
 		super->flags |= POLYFS_FLAG_HOLES;
-	if (image_length > 0)
+	if (image_length > 0 || opt_index)
 		super->flags |= POLYFS_FLAG_SHIFTED_ROOT_OFFSET;
+	if (opt_index) {
+		super->flags |= POLYFS_FLAG_DIR_INDEX;
+		offset += dir_index_size(root->child);
+	}
+	if (opt_image_lzo)
+		super->flags |= POLYFS_FLAG_EMBED_LZO;
+	if (opt_inline)
+		super->flags |= POLYFS_FLAG_INLINE_DATA;
+	if (opt_share)
+		super->flags |= POLYFS_FLAG_SHARED_BLOCKS;
+	if (opt_crc)
+		super->flags |= POLYFS_FLAG_BLOCK_CRC;
 	if (opt_lzo)
 		super->flags |= POLYFS_FLAG_LZO_COMPRESSION;
 	else if (opt_zlib)
 		super->flags |= POLYFS_FLAG_ZLIB_COMPRESSION;
+	else if (opt_lzss)
+		super->flags |= POLYFS_FLAG_LZSS_COMPRESSION;
 	super->future = 0;
 	super->size = size;
 	memcpy(super->signature, POLYFS_SIGNATURE, sizeof(super->signature));
@@ -770,8 +893,16 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 	struct entry **entry_stack = NULL;
 
 	entry_stack = xmalloc(stack_size * sizeof(struct entry *));
+
+	/* Leave room for the root directory's index */
+	if (opt_index)
+		offset += dir_index_size(entry);
+
 	for (;;) {
 		int dir_start = stack_entries;
+		struct entry *dir_entries = entry;
+		unsigned int dir_first = offset;
+
 		while (entry) {
 			struct polyfs_inode *inode = (struct polyfs_inode *) (base + offset);
 			size_t len = strlen(entry->name);
@@ -797,6 +928,18 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 			inode->namelen = len >> 2;
 			offset += len;
 
+			/* Tiny files follow their name, and count as written */
+			if (opt_inline && POLYFS_IS_INLINE(entry->mode, entry->size)) {
+				if (offset >= (1 << (2 + POLYFS_OFFSET_WIDTH)))
+					error_msg_and_die("filesystem too big");
+				inode->offset = offset >> 2;
+				entry->offset = offset;
+				map_entry(entry);
+				memcpy(base + offset, entry->uncompressed, entry->size);
+				unmap_entry(entry);
+				offset += POLYFS_INLINE_SIZE(entry->size);
+			}
+
 			if (opt_verbose)
 				print_node(entry);
 
@@ -812,6 +955,9 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 			if (swap_endian) fix_inode(inode);
 		}
 
+		if (opt_index)
+			write_dir_index(dir_entries, base, dir_first);
+
 		/*
 		 * Reverse the order the stack entries pushed during
 		 * this directory, for a small optimization of disk
@@ -836,6 +982,9 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 		stack_entries--;
 		entry = entry_stack[stack_entries];
 
+		/* The index table comes before the directory's entries */
+		if (opt_index)
+			offset += dir_index_size(entry->child);
 		set_data_offset(entry, base, offset);
 		if (opt_verbose) {
 			printf("'%s':\n", entry->name);
@@ -875,51 +1024,339 @@ static int is_zero(char const *begin, unsigned len)
  * Note that size > 0, as a zero-sized file wouldn't ever
  * have gotten here in the first place.
  */
+/*
+ * Blocks of a file are compressed independently, so a pool of threads
+ * compresses them into a scratch area and do_compress() then lays them
+ * out in order. The result is the same as compressing them one by one.
+ */
+struct compress_job {
+	char *uncompressed;
+	unsigned int size;
+	unsigned long blocks;
+	char *out;		/* 2 * blksize per block */
+	unsigned long *len;	/* compressed length, 0 for a hole */
+	unsigned long next;	/* next block to hand out */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Compressed block cache (-C). Each entry is named after a hash of the
+ * input block, the block size and the compressor, and holds a header, the
+ * input block and its compressed form. The stored input is compared
+ * before an entry is used, so a hash collision only costs a miss.
+ */
+#define CACHE_MAGIC 0x50434331	/* "PCC1" */
+
+struct cache_hdr {
+	uint32_t magic;
+	uint32_t input;
+	uint32_t output;
+};
+
+static void cache_name(char *name, size_t size, const char *data,
+		unsigned int input)
+{
+	uint32_t fnv = 2166136261u;
+
+	for (unsigned int i = 0; i < input; i++)
+		fnv = (fnv ^ (unsigned char)data[i]) * 16777619u;
+
+	snprintf(name, size, "%s/%08x%08x-%u-%c%d", opt_cache,
+			(unsigned)crc32(crc32(0L, Z_NULL, 0),
+				(const unsigned char *)data, input),
+			fnv, blksize, opt_zlib ? 'z' : opt_lzss ? 's' : 'l',
+			opt_lzo ? opt_lzo_level : 0);
+}
+
+/* Returns the compressed length, or 0 if the block isn't cached */
+static unsigned long cache_lookup(const char *name, const char *data,
+		unsigned int input, char *out)
+{
+	struct cache_hdr hdr;
+	char *buf;
+	unsigned long len = 0;
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	buf = xmalloc(input);
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+			hdr.magic == CACHE_MAGIC && hdr.input == input &&
+			hdr.output && hdr.output <= 2 * blksize &&
+			read(fd, buf, input) == (ssize_t)input &&
+			!memcmp(buf, data, input) &&
+			read(fd, out, hdr.output) == (ssize_t)hdr.output)
+		len = hdr.output;
+
+	free(buf);
+	close(fd);
+	return len;
+}
+
+static void cache_store(const char *name, const char *data,
+		unsigned int input, const char *out, unsigned long len)
+{
+	struct cache_hdr hdr = { CACHE_MAGIC, input, len };
+	char tmp[PATH_MAX + 8];
+	int fd, ok;
+
+	/* write then rename, so concurrent builds never see half an entry */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		write(fd, data, input) == (ssize_t)input &&
+		write(fd, out, len) == (ssize_t)len;
+	close(fd);
+
+	if (!ok || rename(tmp, name) < 0)
+		unlink(tmp);
+}
+
+static void compress_block(struct compress_job *job, unsigned long block)
+{
+	char *uncompressed = job->uncompressed + block * blksize;
+	char *out = job->out + block * 2 * blksize;
+	unsigned long len = 2 * blksize;
+	unsigned int input = job->size - block * blksize;
+
+	if (input > blksize)
+		input = blksize;
+
+	char name[PATH_MAX];
+	int cached = opt_cache && (opt_zlib || opt_lzo || opt_lzss);
+
+	if (is_zero (uncompressed, input)) {
+		job->len[block] = 0;
+		return;
+	}
+
+	if (cached) {
+		cache_name(name, sizeof(name), uncompressed, input);
+		len = cache_lookup(name, uncompressed, input, out);
+		if (len) {
+			__sync_fetch_and_add(&cache_hits, 1);
+			job->len[block] = len;
+			return;
+		}
+		__sync_fetch_and_add(&cache_misses, 1);
+		len = 2 * blksize;
+	}
+
+	if (opt_zlib) {
+		compress((unsigned char *)out, &len,
+				(unsigned char *)uncompressed, input);
+	}
+	else if (opt_lzo) {
+		int err = polyfs_lzo_cmpr(
+			(unsigned char *)uncompressed,
+			(unsigned char *)out, input,
+			(uint32_t *)&len);
+		if (err < 0)
+			error_msg_and_die("LZO compression error");
+	}
+	else if (opt_lzss) {
+		uint32_t out_len;
+
+		if (polyfs_lzss_cmpr((unsigned char *)uncompressed,
+				(unsigned char *)out, input, &out_len) < 0)
+			error_msg_and_die("LZSS compression error");
+		len = out_len;
+	}
+	else { // no compression
+		memcpy(out, uncompressed, input);
+		len = input;
+	}
+
+	if (len > blksize*2) {
+		/* (I don't think this can happen with zlib.) */
+		error_msg_and_die("AIEEE: block \"compressed\" to > 2*blocklength (%ld)\n", len);
+	}
+
+	if (cached)
+		cache_store(name, uncompressed, input, out, len);
+
+	job->len[block] = len;
+}
+
+static void compress_blocks(struct compress_job *job)
+{
+	for (;;) {
+		unsigned long block;
+
+		pthread_mutex_lock(&job->lock);
+		block = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		if (block >= job->blocks)
+			break;
+		compress_block(job, block);
+	}
+}
+
+static void *compress_worker(void *arg)
+{
+	struct compress_job *job = arg;
+
+	if (opt_lzo && polyfs_lzo_alloc() < 0)
+		error_msg_and_die("polyfs_lzo_alloc failed");
+
+	compress_blocks(job);
+
+	if (opt_lzo)
+		polyfs_lzo_exit();
+
+	return NULL;
+}
+
+/*
+ * With -B, every compressed block of a regular file is remembered by its
+ * CRC, and a block already in the image is written as a pointer to the
+ * first copy instead. eliminate_doubles() still takes care of whole files;
+ * this catches files that only have some blocks in common.
+ */
+#define SHARED_HASH_SIZE	4096
+
+struct shared_block {
+	struct shared_block *next;
+	uint32_t crc;
+	uint32_t start, len;
+};
+
+static struct shared_block *shared_hash[SHARED_HASH_SIZE];
+static long shared_blocks = 0, shared_saved = 0;
+
+/* Number of the next file's first block, with -K */
+static uint32_t crc_blocks = 0;
+
+/* Returns the start of an identical block already written, or 0 */
+static uint32_t find_shared_block(char *base, uint32_t start, uint32_t len)
+{
+	uint32_t crc = crc32(crc32(0L, Z_NULL, 0),
+			(unsigned char *)base + start, len);
+	struct shared_block **head = &shared_hash[crc % SHARED_HASH_SIZE];
+	struct shared_block *b;
+
+	for (b = *head; b; b = b->next) {
+		if (b->crc == crc && b->len == len &&
+				!memcmp(base + b->start, base + start, len))
+			return b->start;
+	}
+
+	b = xmalloc(sizeof(*b));
+	b->crc = crc;
+	b->start = start;
+	b->len = len;
+	b->next = *head;
+	*head = b;
+	return 0;
+}
+
+static void free_shared_blocks(void)
+{
+	struct shared_block *b, *next;
+	unsigned int i;
+
+	for (i = 0; i < SHARED_HASH_SIZE; i++) {
+		for (b = shared_hash[i]; b; b = next) {
+			next = b->next;
+			free(b);
+		}
+		shared_hash[i] = NULL;
+	}
+}
+
 static unsigned int do_compress(char *base, unsigned int offset, struct entry *entry)
 {
 	unsigned int size = entry->size;
 	unsigned long blocks = (size - 1) / blksize + 1;
 	unsigned long curr = offset + 4 * blocks;
-	char *uncompressed = entry->uncompressed;
+	uint32_t *crcs = NULL;
+	struct compress_job job;
+	unsigned long i;
+	long threads = opt_threads;
+
+	/* The CRC table sits between the block pointers and the data */
+	if (opt_crc && S_ISREG(entry->mode)) {
+		crcs = (uint32_t *) (base + curr);
+		*crcs++ = swap_endian ? wswap(crc_blocks) : crc_blocks;
+		crc_blocks += blocks;
+		curr += POLYFS_CRC_TABLE_SIZE(blocks);
+	}
 
 	total_blocks += blocks; 
 
-	do {
-		unsigned long len = 2 * blksize;
-		unsigned int input = size;
-		if (input > blksize)
-			input = blksize;
-		size -= input;
-		if (!is_zero (uncompressed, input)) {
-			if (opt_zlib) {
-				compress((unsigned char *)(base + curr), &len,
-						(unsigned char *)uncompressed, input);
-			}
-			else if (opt_lzo) {
-				int err = polyfs_lzo_cmpr(
-					(unsigned char *)uncompressed,
-					(unsigned char *)(base + curr), input,
-					(uint32_t *)&len);
-				if (err < 0)
-					error_msg_and_die("LZO compression error");
-			}
-			else { // no compression
-				memcpy(base + curr, uncompressed, input);
-				len = input;
-			}
-			curr += len;
+	job.uncompressed = entry->uncompressed;
+	job.size = size;
+	job.blocks = blocks;
+	job.out = xmalloc(blocks * 2 * blksize);
+	job.len = xmalloc(blocks * sizeof(*job.len));
+	job.next = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	if (threads > (long)blocks)
+		threads = blocks;
+
+	if (threads > 1) {
+		pthread_t *tids = xmalloc((threads - 1) * sizeof(*tids));
+
+		for (i = 0; i < (unsigned long)threads - 1; i++) {
+			if (pthread_create(&tids[i], NULL, compress_worker, &job))
+				error_msg_and_die("pthread_create failed");
 		}
-		uncompressed += input;
+		// This thread already has its LZO buffers, so work here too
+		compress_blocks(&job);
+		for (i = 0; i < (unsigned long)threads - 1; i++)
+			pthread_join(tids[i], NULL);
+		free(tids);
+	}
+	else {
+		compress_blocks(&job);
+	}
+	pthread_mutex_destroy(&job.lock);
+
+	for (i = 0; i < blocks; i++) {
+		uint32_t len = job.len[i];
+		uint32_t shared = 0;
+		uint32_t ptr;
+
+		memcpy(base + curr, job.out + i * 2 * blksize, len);
 
-		if (len > blksize*2) {
-			/* (I don't think this can happen with zlib.) */
-			error_msg_and_die("AIEEE: block \"compressed\" to > 2*blocklength (%ld)\n", len);
+		if (crcs) {
+			uint32_t crc = crc32(crc32(0L, Z_NULL, 0),
+					(unsigned char *)base + curr, len);
+			crcs[i] = swap_endian ? wswap(crc) : crc;
 		}
 
-		*(uint32_t *) (base + offset) = curr;
+		/* Only worth it when the offsets are smaller than the block */
+		if (opt_share && S_ISREG(entry->mode) && len > POLYFS_SHARED_SIZE)
+			shared = find_shared_block(base, curr, len);
+
+		if (shared) {
+			uint32_t *rec = (uint32_t *) (base + curr);
+
+			rec[0] = swap_endian ? wswap(shared) : shared;
+			rec[1] = swap_endian ? wswap(shared + len) : shared + len;
+			curr += POLYFS_SHARED_SIZE;
+			ptr = curr | POLYFS_BLKPTR_SHARED;
+			shared_blocks++;
+			shared_saved += len - POLYFS_SHARED_SIZE;
+		}
+		else {
+			curr += len;
+			ptr = curr;
+		}
+
+		*(uint32_t *) (base + offset) = ptr;
 		if (swap_endian) fix_block_pointer((uint32_t*)(base + offset));
 		offset += 4;
-	} while (size);
+	}
+
+	free(job.out);
+	free(job.len);
 
 	curr = (curr + 3) & ~3;
 
@@ -932,21 +1369,32 @@ static unsigned int do_compress(char *base, unsigned int offset, struct entry *e
  * non-null entry->path (i.e. every non-empty regfile) and non-null
  * entry->uncompressed (i.e. every symlink).
  */
+static unsigned int write_entry_data(struct entry *entry, char *base, unsigned int offset)
+{
+	/* data never lives at offset 0, so that marks it as not written yet */
+	if (entry->offset)
+		return offset;
+
+	if (entry->same) {
+		offset = write_entry_data(entry->same, base, offset);
+		set_data_offset(entry, base, entry->same->offset);
+		entry->offset = entry->same->offset;
+	}
+	else {
+		set_data_offset(entry, base, offset);
+		entry->offset = offset;
+		map_entry(entry);
+		offset = do_compress(base, offset, entry);
+		unmap_entry(entry);
+	}
+	return offset;
+}
+
 static unsigned int write_data(struct entry *entry, char *base, unsigned int offset)
 {
 	do {
 		if (entry->path || entry->uncompressed) {
-			if (entry->same) {
-				set_data_offset(entry, base, entry->same->offset);
-				entry->offset = entry->same->offset;
-			}
-			else {
-				set_data_offset(entry, base, offset);
-				entry->offset = offset;
-				map_entry(entry);
-				offset = do_compress(base, offset, entry);
-				unmap_entry(entry);
-			}
+			offset = write_entry_data(entry, base, offset);
 		}
 		else if (entry->child)
 			offset = write_data(entry->child, base, offset);
@@ -955,18 +1403,432 @@ static unsigned int write_data(struct entry *entry, char *base, unsigned int off
 	return offset;
 }
 
+/* Find an entry by its path below the root, NULL if there isn't one */
+static struct entry *find_entry(struct entry *dir, char *path)
+{
+	char *name;
+
+	while ((name = strsep(&path, "/"))) {
+		struct entry *e;
+
+		if (!*name)
+			continue;
+		for (e = dir->child; e; e = e->next) {
+			if (!strcmp(e->name, name))
+				break;
+		}
+		if (!e)
+			return NULL;
+		dir = e;
+	}
+	return dir;
+}
+
+/*
+ * Splice the files named by '%!:' include directives into the .shtml files
+ * that use them (-I), so the webserver sends one file rather than opening
+ * each include as it comes to it. Included files are spliced in as they
+ * are, including any directives of their own, and their includes are
+ * spliced in turn; CGI calls are left for the webserver. A directive index
+ * written by shtmlindex.pl is rewritten to match the spliced script.
+ *
+ * Spliced files are written out to temporary files that stand in for the
+ * originals, so the rest of mkpolyfs treats them like any other file.
+ */
+#define SPLICE_DEPTH 16
+
+struct splice_buf {
+	char *data;
+	size_t len, size;
+};
+
+static char **splice_tmp;
+static int splice_ntmp;
+
+static void splice_cleanup(void)
+{
+	while (splice_ntmp) {
+		splice_ntmp--;
+		unlink(splice_tmp[splice_ntmp]);
+		free(splice_tmp[splice_ntmp]);
+	}
+	free(splice_tmp);
+	splice_tmp = NULL;
+}
+
+static void splice_add(struct splice_buf *b, const char *data, size_t len)
+{
+	if (!len)
+		return;
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = xrealloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static char *splice_read(struct entry *e)
+{
+	char *data = xmalloc(e->size ? e->size : 1);
+	int fd;
+
+	if (!e->size)
+		return data;
+	fd = xopen(e->path, O_RDONLY, 0);
+	if (read(fd, data, e->size) != (ssize_t)e->size)
+		perror_msg_and_die("%s", e->path);
+	close(fd);
+	return data;
+}
+
+/* Swap an entry's contents for data, kept in a temporary file */
+static void splice_replace(struct entry *e, const char *data, size_t len,
+		loff_t *fslen_ub)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path;
+	int fd;
+
+	if (e->size)
+		*fslen_ub -= (4+26)*((e->size - 1) / blksize + 1) + e->size + 3;
+	if (e->size && opt_crc)
+		*fslen_ub -= POLYFS_CRC_TABLE_SIZE((e->size - 1) / blksize + 1);
+	free(e->path);
+	e->path = NULL;
+	e->size = len;
+	if (!len)
+		return;
+	if (len >= 1 << POLYFS_SIZE_WIDTH)
+		error_msg_and_die("%s: too big once spliced", e->name);
+	*fslen_ub += (4+26)*((len - 1) / blksize + 1) + len + 3;
+	if (opt_crc)
+		*fslen_ub += POLYFS_CRC_TABLE_SIZE((len - 1) / blksize + 1);
+
+	if (asprintf(&path, "%s/mkpolyfs-XXXXXX", dir ? dir : "/tmp") < 0)
+		error_msg_and_die(memory_exhausted);
+	fd = mkstemp(path);
+	if (fd < 0)
+		perror_msg_and_die("%s", path);
+	splice_tmp = xrealloc(splice_tmp, (splice_ntmp + 1) * sizeof(*splice_tmp));
+	splice_tmp[splice_ntmp++] = path;
+	if (write(fd, data, len) != (ssize_t)len)
+		perror_msg_and_die("%s", path);
+	close(fd);
+	e->path = xstrdup(path);
+}
+
+/* Copy a script into out with its includes spliced in, returns how many */
+static int splice_includes(struct entry *root, const char *data, size_t len,
+		struct splice_buf *out, int depth)
+{
+	size_t pos = 0;
+	int n = 0;
+
+	while (pos < len) {
+		const char *p = memmem(data + pos, len - pos, "%!", 2);
+		const char *name, *nl;
+		struct entry *inc = NULL;
+		size_t at, end;
+
+		if (!p)
+			break;
+		at = p - data;
+		nl = memchr(p + 2, '\n', len - at - 2);
+		end = nl ? (size_t)(nl - data) : len;
+
+		if (at + 2 < len && p[2] == ':') {
+			char *path;
+
+			for (name = p + 3; name < data + end && (*name == ' ' || *name == '\t'); name++);
+			path = strndup(name, data + end - name);
+			if (!path)
+				error_msg_and_die(memory_exhausted);
+			inc = find_entry(root, path);
+			if (!inc || !S_ISREG(inc->mode)) {
+				fprintf(stderr, "warning: include not found: %.*s\n",
+						(int)(data + end - name), name);
+				inc = NULL;
+			}
+			free(path);
+		}
+
+		if (!inc) {
+			/* A CGI call, or an include the webserver will fail on */
+			end = nl ? end + 1 : end;
+			splice_add(out, data + pos, end - pos);
+			pos = end;
+			continue;
+		}
+
+		if (depth >= SPLICE_DEPTH)
+			error_msg_and_die("%s: includes nested too deeply", inc->name);
+
+		splice_add(out, data + pos, at - pos);
+		{
+			char *incdata = splice_read(inc);
+			const char *last = NULL;
+			size_t i;
+
+			n += 1 + splice_includes(root, incdata, inc->size, out, depth + 1);
+
+			/* A directive at the very end of the include ended there,
+			   so it mustn't run on into the rest of this file */
+			for (i = 0; i + 1 < inc->size; i++) {
+				if (incdata[i] == '%' && incdata[i + 1] == '!')
+					last = incdata + i;
+			}
+			if (last && !memchr(last, '\n', incdata + inc->size - last))
+				splice_add(out, "\n", 1);
+			free(incdata);
+		}
+		pos = nl ? end + 1 : end;
+	}
+	splice_add(out, data + pos, len - pos);
+
+	return n;
+}
+
+/* The same index shtmlindex.pl writes */
+static void splice_index(const struct splice_buf *script, struct splice_buf *idx)
+{
+	const char *data = script->data;
+	size_t pos = 0;
+
+	idx->len = 0;
+	while (pos + 1 < script->len) {
+		const char *p = memmem(data + pos, script->len - pos, "%!", 2);
+		const char *nl;
+		unsigned char rec[6];
+		size_t at, end, dlen;
+
+		if (!p)
+			break;
+		at = p - data;
+		nl = memchr(p + 2, '\n', script->len - at - 2);
+		end = nl ? (size_t)(nl - data) : script->len;
+		dlen = end - at - 2;
+
+		rec[0] = at; rec[1] = at >> 8; rec[2] = at >> 16; rec[3] = at >> 24;
+		rec[4] = dlen; rec[5] = dlen >> 8;
+		splice_add(idx, (char *)rec, sizeof(rec));
+		pos = end + 1;
+	}
+}
+
+static void splice_scripts(struct entry *root, struct entry *dir, loff_t *fslen_ub)
+{
+	struct entry *e;
+
+	for (e = dir->child; e; e = e->next) {
+		struct splice_buf out = { 0 }, idx = { 0 };
+		size_t namelen = strlen(e->name);
+		struct entry *ie;
+		char *data, *idxname;
+		int n;
+
+		if (S_ISDIR(e->mode)) {
+			splice_scripts(root, e, fslen_ub);
+			continue;
+		}
+		if (!S_ISREG(e->mode) || namelen < 6 ||
+				strcmp(e->name + namelen - 6, ".shtml"))
+			continue;
+
+		data = splice_read(e);
+		n = splice_includes(root, data, e->size, &out, 0);
+		free(data);
+		if (!n) {
+			free(out.data);
+			continue;
+		}
+		if (opt_verbose)
+			printf("Spliced %d includes into %s\n", n, e->name);
+		splice_replace(e, out.data, out.len, fslen_ub);
+
+		if (asprintf(&idxname, "%s.idx", e->name) < 0)
+			error_msg_and_die(memory_exhausted);
+		for (ie = dir->child; ie && strcmp(ie->name, idxname); ie = ie->next);
+		if (ie && S_ISREG(ie->mode)) {
+			splice_index(&out, &idx);
+			splice_replace(ie, idx.data, idx.len, fslen_ub);
+		}
+		free(idxname);
+		free(idx.data);
+		free(out.data);
+	}
+}
+
+/*
+ * Work out the content type of a file from its name the same way the
+ * webserver would, looking through a .gz suffix to the real extension.
+ */
+static unsigned int mime_type(const char *name)
+{
+	static const struct {
+		const char *ext;
+		unsigned int type;
+	} types[] = {
+		{ ".html", POLYFS_MIME_HTML },
+		{ ".shtml", POLYFS_MIME_HTML },
+		{ ".css", POLYFS_MIME_CSS },
+		{ ".png", POLYFS_MIME_PNG },
+		{ ".gif", POLYFS_MIME_GIF },
+		{ ".jpg", POLYFS_MIME_JPEG },
+	};
+	size_t len = strlen(name);
+	const char *ext;
+	unsigned int i;
+
+	if (len > 3 && !strcmp(name + len - 3, ".gz"))
+		len -= 3;
+	for (ext = name + len - 1; ext > name && *ext != '.'; ext--);
+	if (*ext != '.')
+		return POLYFS_MIME_BINARY;
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (strlen(types[i].ext) == name + len - ext &&
+				!strncmp(ext, types[i].ext, name + len - ext))
+			return types[i].type;
+	}
+
+	return POLYFS_MIME_PLAIN;
+}
+
+static void mime_types(struct entry *dir)
+{
+	struct entry *e;
+
+	for (e = dir->child; e; e = e->next) {
+		if (S_ISDIR(e->mode))
+			mime_types(e);
+		else if (S_ISREG(e->mode))
+			e->gid = mime_type(e->name);
+	}
+}
+
+/*
+ * Files small enough to be stored inline (-N) make their directory that
+ * much bigger. This runs once the contents of every file are final.
+ */
+static void inline_sizes(struct entry *dir, loff_t *fslen_ub)
+{
+	struct entry *e;
+
+	for (e = dir->child; e; e = e->next) {
+		if (S_ISDIR(e->mode)) {
+			inline_sizes(e, fslen_ub);
+		}
+		else if (POLYFS_IS_INLINE(e->mode, e->size)) {
+			dir->size += POLYFS_INLINE_SIZE(e->size);
+			*fslen_ub += POLYFS_INLINE_SIZE(e->size);
+		}
+	}
+}
+
+/*
+ * Write the data of the files named in the hot file list (-H) first, in
+ * the order they are listed, so the assets behind most requests sit
+ * together right after the directory structure. The rest follows in
+ * directory order. Directory entries themselves stay in directory order,
+ * since each directory's entries must be contiguous.
+ */
+static unsigned int write_hot_data(struct entry *root, char *base, unsigned int offset)
+{
+	FILE *hot = xfopen(opt_hot, "r");
+	char *line = NULL;
+	size_t len = 0;
+
+	while (getline(&line, &len, hot) >= 0) {
+		struct entry *entry;
+		char *path = line;
+
+		path[strcspn(path, "#\r\n")] = '\0';
+		while (isspace((unsigned char)*path))
+			path++;
+		if (!*path)
+			continue;
+
+		entry = find_entry(root, path);
+		if (!entry || !(entry->path || entry->uncompressed)) {
+			if (opt_verbose)
+				printf("Hot file not in image: %s\n", path);
+			continue;
+		}
+		offset = write_entry_data(entry, base, offset);
+	}
+
+	free(line);
+	fclose(hot);
+
+	if (opt_verbose)
+		printf("Hot file data: %u bytes\n", offset);
+
+	return offset;
+}
+
+/*
+ * LZO compress a file image in blksize blocks, preceded by its length and
+ * block pointers (see polyfs_fs.h). Blocks that don't get any smaller are
+ * stored as they are. Returns the number of bytes written at base + offset.
+ */
+static unsigned int compress_image(char *base, unsigned int offset,
+	char *image, unsigned int length)
+{
+	unsigned int blocks = (length + blksize - 1) / blksize;
+	unsigned int ptr = offset + 4;
+	unsigned int curr = offset + POLYFS_EMBED_HDR_SIZE(length);
+	unsigned int left = length;
+
+	*(uint32_t *) (base + offset) = swap_endian ? wswap(length) : length;
+
+	while (left) {
+		uint32_t len = 2 * blksize;
+		unsigned int input = left > blksize ? blksize : left;
+
+		if (polyfs_lzo_cmpr((unsigned char *)image,
+				(unsigned char *)(base + curr), input, &len) < 0)
+			error_msg_and_die("LZO compression error");
+
+		if (len >= input) {
+			memcpy(base + curr, image, input);
+			len = input;
+		}
+		curr += len;
+
+		*(uint32_t *) (base + ptr) = swap_endian ? wswap(curr) : curr;
+		ptr += 4;
+
+		image += input;
+		left -= input;
+	}
+
+	if (opt_verbose)
+		printf("Image: %u bytes in %u blocks, %u compressed\n",
+			length, blocks, curr - offset);
+
+	return curr - offset;
+}
+
 static unsigned int write_file(char *file, char *base, unsigned int offset)
 {
 	int fd;
 	char *buf;
+	unsigned int length = image_length;
 
 	fd = xopen(file, O_RDONLY, 0);
-	buf = mmap(NULL, image_length, PROT_READ, MAP_PRIVATE, fd, 0);
+	buf = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (buf == MAP_FAILED) {
 		error_msg_and_die("mmap failed");
 	}
-	memcpy(base + offset, buf, image_length);
-	munmap(buf, image_length);
+	if (opt_image_lzo) {
+		/* the compressed form replaces the image from here on */
+		image_length = compress_image(base, offset, buf, length);
+	}
+	else {
+		memcpy(base + offset, buf, length);
+	}
+	munmap(buf, length);
 	close (fd);
 	/* Pad up the image_length to a 4-byte boundary */
 	while (image_length & 3) {
@@ -1297,7 +2159,7 @@ int main(int argc, char **argv)
 		progname = argv[0];
 
 	/* command line options */
-	while ((c = getopt(argc, argv, "bD:Ee:hi:ln:pqrsvVzLZ")) != EOF) {
+	while ((c = getopt(argc, argv, "bBcC:D:Ee:H:hIi:j:Kln:NO:pqrsSTvVxzLZ")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(MKFS_OK);
@@ -1320,6 +2182,11 @@ int main(int argc, char **argv)
 				}
 				image_length = st.st_size; /* may be padded later */
 				fslen_ub += (image_length + 3); /* 3 is for padding */
+				/* room for the block pointers if it gets compressed */
+				fslen_ub += POLYFS_EMBED_HDR_SIZE(image_length);
+				break;
+			case 'c':
+				opt_image_lzo = 1;
 				break;
 			case 'n':
 				opt_name = optarg;
@@ -1337,9 +2204,35 @@ int main(int argc, char **argv)
 			case 'z':
 				opt_holes = 1;
 				break;
+			case 'x':
+				opt_index = 1;
+				break;
 			case 'q':
 				opt_squash = 1;
 				break;
+			case 'C':
+				opt_cache = optarg;
+				if (mkdir(opt_cache, 0777) < 0 && errno != EEXIST)
+					perror_msg_and_die(opt_cache);
+				break;
+			case 'H':
+				opt_hot = optarg;
+				break;
+			case 'I':
+				opt_splice = 1;
+				break;
+			case 'T':
+				opt_mime = 1;
+				break;
+			case 'N':
+				opt_inline = 1;
+				break;
+			case 'B':
+				opt_share = 1;
+				break;
+			case 'K':
+				opt_crc = 1;
+				break;
 			case 'D':
 				devtable = xfopen(optarg, "r");
 				if (fstat(fileno(devtable), &st) < 0)
@@ -1360,6 +2253,20 @@ int main(int argc, char **argv)
 				swap_endian = 1;
 #endif
 				break;
+			case 'j':
+				opt_threads = strtol(optarg, &ep, 10);
+				if (*ep || opt_threads < 1)
+					usage(MKFS_USAGE);
+				break;
+			case 'O':
+				if (!strcmp(optarg, "best")) {
+					opt_lzo_level = LZO_LEVEL_BEST;
+					break;
+				}
+				opt_lzo_level = strtol(optarg, &ep, 10);
+				if (*ep || opt_lzo_level < 1 || opt_lzo_level > 9)
+					usage(MKFS_USAGE);
+				break;
 			case 'L':
 				opt_lzo = 1;
 				printf("Uzing LZO compression.\n");
@@ -1368,11 +2275,21 @@ int main(int argc, char **argv)
 				opt_zlib = 1;
 				printf("Using zlib compression.\n");
 				break;
+			case 'S':
+				opt_lzss = 1;
+				printf("Using LZSS compression.\n");
+				break;
 		}
 	}
 
-	if (opt_zlib && opt_lzo)
-		error_msg_and_die("Cannot use both LZO and zlib!");
+	if (opt_zlib + opt_lzo + opt_lzss > 1)
+		error_msg_and_die("Only one of LZO, zlib and LZSS can be used!");
+
+	if (!opt_threads) {
+		opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (opt_threads < 1)
+			opt_threads = 1;
+	}
 
 	if ((argc - optind) != 2)
 		usage(MKFS_USAGE);
@@ -1382,7 +2299,10 @@ int main(int argc, char **argv)
 	if (opt_verbose && swap_endian)
 		printf("Swapping filesystem endian-ness\n");
 
-	if (opt_lzo) {
+	if (opt_image_lzo && !opt_image)
+		error_msg_and_die("-c needs a file image (-i)");
+
+	if (opt_lzo || opt_image_lzo) {
 		if (polyfs_lzo_init() < 0)
 			error_msg_and_die("polyfs_lzo_init failed");
 	}
@@ -1403,6 +2323,19 @@ int main(int argc, char **argv)
 		parse_device_table(devtable, root_entry, &fslen_ub);
 	}
 
+	if (opt_splice) {
+		atexit(splice_cleanup);
+		splice_scripts(root_entry, root_entry, &fslen_ub);
+	}
+
+	if (opt_mime) {
+		mime_types(root_entry);
+	}
+
+	if (opt_inline) {
+		inline_sizes(root_entry, &fslen_ub);
+	}
+
 	/* always allocate a multiple of blksize bytes because that's
 	   what we're going to write later on */
 	fslen_ub = ((fslen_ub - 1) | (blksize - 1)) + 1;
@@ -1451,7 +2384,16 @@ int main(int argc, char **argv)
 	if (opt_verbose)
 		printf("Directory data: %ld bytes\n", (long)offset);
 
+	if (opt_hot)
+		offset = write_hot_data(root_entry, rom_image, offset);
 	offset = write_data(root_entry, rom_image, offset);
+	if (opt_verbose && opt_cache)
+		printf("Block cache: %ld hits, %ld misses\n",
+				cache_hits, cache_misses);
+	if (opt_verbose && opt_share)
+		printf("Shared blocks: %ld (%ld bytes saved)\n",
+				shared_blocks, shared_saved);
+	free_shared_blocks();
 
 	/* We always write a multiple of blksize bytes, so that
 	   losetup works. */
@@ -1519,45 +2461,93 @@ int main(int argc, char **argv)
 			(warn_namelen||warn_skip||warn_size||warn_uid||warn_gid||warn_dev))
 		exit(MKFS_ERROR);
 
-	if (opt_lzo)
+	if (opt_lzo || opt_image_lzo)
 		polyfs_lzo_exit();
 
 	exit(MKFS_OK);
 }
 
+/*
+ * The device decompresses in place, with the compressed block at the end
+ * of a POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD buffer (see read_lzo_block() in
+ * lib/polyfs.c). Check a candidate the same way so we never pick one that
+ * would overrun its own input there.
+ */
+static int lzo_check_inplace(const unsigned char *orig, lzo_uint orig_len,
+	const unsigned char *cmpr, lzo_uint cmpr_len)
+{
+	unsigned char buf[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+	lzo_uint out_len = sizeof(buf);
+
+	if (cmpr_len > sizeof(buf))
+		return -1;
+
+	memcpy(buf + sizeof(buf) - cmpr_len, cmpr, cmpr_len);
+	if (lzo1x_decompress_safe(buf + sizeof(buf) - cmpr_len, cmpr_len,
+			buf, &out_len, NULL) != LZO_E_OK ||
+			out_len != orig_len || memcmp(buf, orig, orig_len))
+		return -1;
+
+	return 0;
+}
+
+/* Compress with one method (level 1-9 for LZO1X-999, 0 for LZO1X-1) */
+static int lzo_cmpr_level(unsigned char *in, lzo_uint in_len,
+	unsigned char *out, lzo_uint *out_len, int level)
+{
+	lzo_uint orig_len = in_len;
+	int r;
+
+	if (level)
+		r = lzo1x_999_compress_level(in, in_len, out, out_len, lzo_mem,
+			NULL, 0, 0, level);
+	else
+		r = lzo1x_1_compress(in, in_len, out, out_len, lzo_mem);
+	if (r != LZO_E_OK)
+		return -1;
+
+	r = lzo1x_optimize(out, *out_len, in, &orig_len, NULL);
+	if (r != LZO_E_OK || orig_len != in_len)
+		return -1;
+
+	return lzo_check_inplace(in, in_len, out, *out_len);
+}
+
 int polyfs_lzo_cmpr(unsigned char *realin,
 	unsigned char *realout,
 	uint32_t sourcelen, uint32_t *dstlen)
 {
-	int r;
-    lzo_uint in_len = sourcelen;
-    unsigned char *out = lzo_compress_buf;
-    lzo_uint out_len = 0;
-    lzo_uint orig_len;
+	lzo_uint in_len = sourcelen;
+	unsigned char *out = lzo_compress_buf;
+	lzo_uint out_len;
+	lzo_uint best_len = 0;
+	int first = opt_lzo_level, last = opt_lzo_level;
 
 	// Copy the input block into our own allocated memory
 	// LZO tries to write to it, so we crash due to read-only mmap
 	unsigned char *in = malloc(sourcelen);
 	memcpy(in, realin, sourcelen);
 
-    out_len = *dstlen;
-	r = lzo1x_999_compress(in,in_len,out,&out_len,lzo_mem);
-	if (r != LZO_E_OK || out_len > *dstlen ) {
-		free(in);
-		return -1;
-	}
+	if (opt_lzo_level == LZO_LEVEL_BEST)
+		last = 9;
 
-    orig_len = in_len;
-	r = lzo1x_optimize(out,out_len,in,&orig_len,NULL);
-	if (r != LZO_E_OK || orig_len != in_len ) {
-		free(in);
-		return -1;
+	for (int level = first; level <= last; level++) {
+		out_len = 2 * page_size;
+		if (lzo_cmpr_level(in, in_len, out, &out_len, level) < 0 ||
+				out_len > *dstlen)
+			continue;
+		if (!best_len || out_len < best_len) {
+			best_len = out_len;
+			memcpy(realout, out, out_len);
+		}
 	}
 
 	free(in);
 
-	memcpy(realout, (void *)lzo_compress_buf, out_len);
-	*dstlen = out_len;
+	if (!best_len)
+		return -1;
+
+	*dstlen = best_len;
 
 	return 0;
 }
@@ -1568,13 +2558,20 @@ int polyfs_lzo_init(void) {
 		return -1;
 	}
 
-	lzo_mem = malloc(LZO1X_999_MEM_COMPRESS);
+	return polyfs_lzo_alloc();
+}
+
+/* Allocate the calling thread's compression buffers */
+int polyfs_lzo_alloc(void) {
+	// Big enough for both LZO1X-999 and LZO1X-1
+	lzo_mem = malloc(LZO1X_999_MEM_COMPRESS > LZO1X_1_MEM_COMPRESS ?
+		LZO1X_999_MEM_COMPRESS : LZO1X_1_MEM_COMPRESS);
 	if (!lzo_mem)
 		return -1;
 
-	/* Worst case LZO compression size from their FAQ */
+	/* Room for a whole candidate; the result is checked against dstlen */
 
-	lzo_compress_buf = malloc(page_size + (page_size / 64) + 16 + 3);
+	lzo_compress_buf = malloc(2 * page_size);
 	if (!lzo_compress_buf) {
 		free(lzo_mem);
 		lzo_mem = NULL;
@@ -1587,5 +2584,174 @@ int polyfs_lzo_init(void) {
 void polyfs_lzo_exit(void) {
 	free(lzo_compress_buf);
 	free(lzo_mem);
+	lzo_compress_buf = NULL;
+	lzo_mem = NULL;
 }
 
+
+/*
+ * LZSS (see polyfs_fs.h). Matches can only copy bytes that were written out
+ * as literals, so coff[] records where each input byte landed in the
+ * output, or -1 once it has been covered by a match. A candidate is good for
+ * as long as its bytes sit next to each other in the output too.
+ */
+#define LZSS_HASH_BITS	12
+#define LZSS_HASH(p)	((((p)[0] << 8) ^ ((p)[1] << 4) ^ (p)[2]) & \
+	((1 << LZSS_HASH_BITS) - 1))
+
+/* Decode a whole block, as the device would; returns 0 if it matches orig */
+static int lzss_check(const unsigned char *orig, uint32_t orig_len,
+	const unsigned char *in, uint32_t in_len)
+{
+	unsigned char *out = malloc(orig_len);
+	uint32_t ip = 0, op = 0;
+	int ret = -1;
+
+	while (out && ip < in_len) {
+		uint32_t token = ip, src, len;
+
+		if (in[ip] < 0x80) {
+			len = in[ip] + 1;
+			src = ip + 1;
+			ip = src + len;
+		}
+		else {
+			if (ip + 2 > in_len)
+				break;
+			len = ((in[ip] >> 3) & 0x0f) + POLYFS_LZSS_MIN_MATCH;
+			src = ((in[ip] & 7) << 8) | in[ip + 1];
+			ip += 2;
+			if (len == POLYFS_LZSS_MIN_MATCH + 15) {
+				if (ip + 1 > in_len)
+					break;
+				len += in[ip++];
+			}
+			if (src + len > token)
+				break;
+		}
+		if (ip > in_len || op + len > orig_len)
+			break;
+		memcpy(out + op, in + src, len);
+		op += len;
+	}
+
+	if (out && ip == in_len && op == orig_len && !memcmp(out, orig, orig_len))
+		ret = 0;
+
+	free(out);
+	return ret;
+}
+
+struct lzss {
+	const unsigned char *in;
+	uint32_t len;
+	int *coff;		/* output offset of each literal, or -1 */
+	int *prev;		/* previous position with the same hash */
+	int head[1 << LZSS_HASH_BITS];
+};
+
+static void lzss_insert(struct lzss *z, uint32_t p)
+{
+	if (p + POLYFS_LZSS_MIN_MATCH <= z->len) {
+		unsigned h = LZSS_HASH(z->in + p);
+
+		z->prev[p] = z->head[h];
+		z->head[h] = p;
+	}
+}
+
+/* Longest match for p among the literals before it */
+static uint32_t lzss_find(struct lzss *z, uint32_t p, uint32_t *off)
+{
+	uint32_t best = 0;
+
+	if (p + POLYFS_LZSS_MIN_MATCH > z->len)
+		return 0;
+
+	for (int q = z->head[LZSS_HASH(z->in + p)]; q >= 0; q = z->prev[q]) {
+		uint32_t len = 0;
+
+		if (z->coff[q] < 0 || z->coff[q] > POLYFS_LZSS_MAX_OFFSET)
+			continue;
+		while (p + len < z->len && q + len < p &&
+				len < POLYFS_LZSS_MAX_MATCH &&
+				z->in[q + len] == z->in[p + len] &&
+				z->coff[q + len] == z->coff[q] + (int)len)
+			len++;
+		if (len > best) {
+			best = len;
+			*off = z->coff[q];
+		}
+	}
+
+	return best;
+}
+
+int polyfs_lzss_cmpr(unsigned char *in, unsigned char *out,
+	uint32_t sourcelen, uint32_t *dstlen)
+{
+	struct lzss z;
+	uint32_t p = 0, o = 0, run = 0, run_len = 0;
+	int in_run = 0;
+
+	z.in = in;
+	z.len = sourcelen;
+	z.coff = malloc(sourcelen * sizeof(*z.coff));
+	z.prev = malloc(sourcelen * sizeof(*z.prev));
+	if (!z.coff || !z.prev)
+		error_msg_and_die(memory_exhausted);
+	memset(z.head, 0xff, sizeof(z.head));
+
+	while (p < sourcelen && o < sourcelen) {
+		uint32_t off = 0;
+		uint32_t len = lzss_find(&z, p, &off);
+
+		/* A short match in the middle of a run saves nothing once the
+		 * run needs a new header after it */
+		if (len == POLYFS_LZSS_MIN_MATCH && in_run)
+			len = 0;
+
+		if (len >= POLYFS_LZSS_MIN_MATCH) {
+			uint32_t l = len - POLYFS_LZSS_MIN_MATCH;
+
+			out[o++] = 0x80 | ((l < 15 ? l : 15) << 3) | (off >> 8);
+			out[o++] = off & 0xff;
+			if (l >= 15)
+				out[o++] = l - 15;
+
+			for (uint32_t i = 0; i < len; i++) {
+				z.coff[p + i] = -1;
+				lzss_insert(&z, p + i);
+			}
+			p += len;
+			in_run = 0;
+			continue;
+		}
+
+		if (!in_run || run_len == POLYFS_LZSS_MAX_LITERAL) {
+			run = o++;
+			run_len = 0;
+			in_run = 1;
+		}
+		out[run] = run_len++;
+		z.coff[p] = o;
+		out[o++] = in[p];
+		lzss_insert(&z, p++);
+	}
+
+	free(z.coff);
+	free(z.prev);
+
+	/* Didn't get anywhere, store it as-is */
+	if (o >= sourcelen) {
+		memcpy(out, in, sourcelen);
+		*dstlen = sourcelen;
+		return 0;
+	}
+
+	if (lzss_check(in, sourcelen, out, o) < 0)
+		return -1;
+
+	*dstlen = o;
+	return 0;
+}
@@ -33,6 +33,10 @@
  *                            use read if mmap fails, standardize messages)
  * 2002/02/22: Brad Bozarth   (add support for big-endian systems)
  * 2011/01/14: Chris Boot     convert to polyfs
+ *
+ * Files are checked (and extracted) by a pool of threads once the directory
+ * walk has listed them all. Errors are still reported for the first broken
+ * entry in directory order, whichever thread finds it.
  */
 
 /* compile-time options */
@@ -51,6 +55,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <pthread.h>
 #ifndef __APPLE__
 #include <sys/sysmacros.h>
 #endif
@@ -61,10 +68,6 @@
 #include <zlib.h>
 #include <lzo/lzo1x.h>
 
-#ifdef __APPLE__
-#define MAP_ANONYMOUS MAP_ANON
-#endif
-
 #define BLKGETSIZE	_IO(0x12,96) /* return device size /512 (long *arg) */
 
 /* Exit codes used by fsck-type programs */
@@ -82,8 +85,12 @@ static const char *progname = "polyfsck";
 
 static int fd;			/* ROM image file descriptor */
 static char *filename;		/* ROM image filename */
+static char *image;		/* ROM image contents */
+static size_t image_length;	/* length of image */
+static int image_mapped;	/* image is mmap()ed rather than read */
 struct polyfs_super super;	/* just find the polyfs superblock once */
 static int opt_verbose = 0;	/* 1 = verbose (-v), 2+ = very verbose (-vv) */
+static long opt_threads = 0;	/* threads checking files (-j) */
 #ifdef INCLUDE_FS_TESTS
 static int opt_extract = 0;		/* extract polyfs (-x) */
 static char *extract_dir = "/";	/* extraction directory (-x) */
@@ -95,16 +102,32 @@ static unsigned long end_dir = 0;	/* end of the directory structure */
 static unsigned long start_data = ~0UL;	/* start of the data (256 MB = max) */
 static unsigned long end_data = 0;	/* end of the data */
 
-/* Guarantee access to at least 8kB at a time */
-#define ROMBUFFER_BITS	13
-#define ROMBUFFERSIZE	(1 << ROMBUFFER_BITS)
-#define ROMBUFFERMASK	(ROMBUFFERSIZE-1)
-static char read_buffer[ROMBUFFERSIZE * 2];
-static unsigned long read_buffer_block = ~0UL;
+/* Uncompressing data structures, one set per thread... */
+static __thread char outbuffer[POLYFS_BLOCK_SIZE * 2];
+static __thread z_stream stream;
 
-/* Uncompressing data structures... */
-static char outbuffer[POLYFS_BLOCK_SIZE * 2];
-static z_stream stream;
+/*
+ * A regular file found by the directory walk, to be checked by one of the
+ * threads. If anything is wrong with it, die() stores the message here
+ * instead of exiting, and the first file in the list with an error is the
+ * one reported.
+ */
+struct file_job {
+	char *path;
+	struct polyfs_inode inode;
+	unsigned long end_data;	/* end of this file's data */
+	int status;		/* exit status, 0 if the file is fine */
+	char *error;
+};
+
+static struct file_job *jobs;
+static unsigned long jobs_count, jobs_alloc;
+static unsigned long jobs_next;		/* next job to hand out */
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* While set, die() records the error here and jumps back to die_env */
+static __thread struct file_job *die_job;
+static __thread jmp_buf die_env;
 
 /* Prototypes */
 static void expand_fs(char *, struct polyfs_inode *);
@@ -115,10 +138,11 @@ static void usage(int status)
 {
 	FILE *stream = status ? stderr : stdout;
 
-	fprintf(stream, "usage: %s [-hv] [-x dir] file\n"
+	fprintf(stream, "usage: %s [-hv] [-j N] [-x dir] file\n"
 			" -h         print this help\n"
+			" -j N       check files with N threads (default: one per CPU)\n"
 			" -x dir     extract into dir\n"
-			" -v         be more verbose\n"
+			" -v         be more verbose (-vv implies -j 1)\n"
 			" file       file to test\n", progname);
 
 	exit(status);
@@ -129,6 +153,28 @@ static void die(int status, int syserr, const char *fmt, ...)
 	va_list arg_ptr;
 	int save = errno;
 
+#ifdef INCLUDE_FS_TESTS
+	if (die_job) {
+		char *msg;
+
+		va_start(arg_ptr, fmt);
+		if (vasprintf(&msg, fmt, arg_ptr) < 0)
+			msg = NULL;
+		va_end(arg_ptr);
+		if (msg && syserr) {
+			char *full;
+
+			if (asprintf(&full, "%s: %s", msg, strerror(save)) < 0)
+				full = NULL;
+			free(msg);
+			msg = full;
+		}
+		die_job->status = status;
+		die_job->error = msg;
+		longjmp(die_env, 1);
+	}
+#endif /* INCLUDE_FS_TESTS */
+
 	fflush(0);
 	va_start(arg_ptr, fmt);
 	fprintf(stderr, "%s: ", progname);
@@ -222,10 +268,53 @@ static void test_super(int *start, size_t *length) {
 	}
 }
 
+/*
+ * Map the whole image so everything after the superblock tests works on
+ * it in place; read it into memory if it can't be mapped
+ */
+static void map_image(size_t length)
+{
+	size_t done = 0;
+
+	image_length = length;
+	image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image != MAP_FAILED) {
+		image_mapped = 1;
+		return;
+	}
+
+	image = malloc(length);
+	if (!image) {
+		die(FSCK_ERROR, 1, "malloc failed");
+	}
+	lseek(fd, 0, SEEK_SET);
+	while (done < length) {
+		ssize_t retval = read(fd, image + done, length - done);
+		if (retval < 0) {
+			die(FSCK_ERROR, 1, "read failed: %s", filename);
+		}
+		else if (retval == 0) {
+			die(FSCK_UNCORRECTED, 0, "unexpected end of file: %s", filename);
+		}
+		done += retval;
+	}
+}
+
+static void unmap_image(void)
+{
+	if (image_mapped) {
+		munmap(image, image_length);
+	}
+	else {
+		free(image);
+	}
+	image = NULL;
+}
+
 static void test_crc(int start)
 {
-	void *buf;
-	uint32_t crc;
+	size_t crc_field;
+	uint32_t crc, zero;
 
 	if (!(super.flags & POLYFS_FLAG_FSID_VERSION_1)) {
 #ifdef INCLUDE_FS_TESTS
@@ -235,50 +324,15 @@ static void test_crc(int start)
 #endif /* not INCLUDE_FS_TESTS */
 	}
 
-	crc = crc32(0L, Z_NULL, 0);
-
-	buf = mmap(NULL, super.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-	if (buf == MAP_FAILED) {
-		buf = mmap(NULL, super.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (buf != MAP_FAILED) {
-			lseek(fd, 0, SEEK_SET);
-			read(fd, buf, super.size);
-		}
-	}
-	if (buf != MAP_FAILED) {
-		((struct polyfs_super *) (buf+start))->fsid.crc = crc32(0L, Z_NULL, 0);
-		crc = crc32(crc, buf+start, super.size-start);
-		munmap(buf, super.size);
-	}
-	else {
-		int retval;
-		size_t length = 0;
+	/* the CRC is calculated with the CRC field itself set to zero */
+	crc_field = start + offsetof(struct polyfs_super, fsid.crc);
+	zero = crc32(0L, Z_NULL, 0);
 
-		buf = malloc(4096);
-		if (!buf) {
-			die(FSCK_ERROR, 1, "malloc failed");
-		}
-		lseek(fd, start, SEEK_SET);
-		for (;;) {
-			retval = read(fd, buf, 4096);
-			if (retval < 0) {
-				die(FSCK_ERROR, 1, "read failed: %s", filename);
-			}
-			else if (retval == 0) {
-				break;
-			}
-			if (length == 0) {
-				((struct polyfs_super *) buf)->fsid.crc = crc32(0L, Z_NULL, 0);
-			}
-			length += retval;
-			if (length > (super.size-start)) {
-				crc = crc32(crc, buf, retval - (length - (super.size-start)));
-				break;
-			}
-			crc = crc32(crc, buf, retval);
-		}
-		free(buf);
-	}
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (unsigned char *) image + start, crc_field - start);
+	crc = crc32(crc, (unsigned char *) &zero, sizeof(zero));
+	crc = crc32(crc, (unsigned char *) image + crc_field + sizeof(zero),
+			super.size - crc_field - sizeof(zero));
 
 	if (crc != super.fsid.crc) {
 		die(FSCK_UNCORRECTED, 0, "crc error");
@@ -304,17 +358,14 @@ static void print_node(char type, struct polyfs_inode *i, char *name)
 }
 
 /*
- * Create a fake "blocked" access
+ * Access the image directly at an offset
  */
 static void *romfs_read(unsigned long offset)
 {
-	unsigned int block = offset >> ROMBUFFER_BITS;
-	if (block != read_buffer_block) {
-		read_buffer_block = block;
-		lseek(fd, block << ROMBUFFER_BITS, SEEK_SET);
-		read(fd, read_buffer, ROMBUFFERSIZE * 2);
+	if (offset >= image_length) {
+		die(FSCK_UNCORRECTED, 0, "offset %lu past end of image", offset);
 	}
-	return read_buffer + (offset & ROMBUFFERMASK);
+	return image + offset;
 }
 
 static struct polyfs_inode *polyfs_iget(struct polyfs_inode *i)
@@ -347,7 +398,44 @@ static void iput(struct polyfs_inode *inode)
 	free(inode);
 }
 
-static int uncompress_block(void *src, int len)
+/* Decode an LZSS block (see polyfs_fs.h) into outbuffer */
+static int lzss_uncompress(const unsigned char *in, int len, int expect)
+{
+	unsigned char *out = (unsigned char *)outbuffer;
+	int ip = 0, op = 0;
+
+	while (ip < len) {
+		int token = ip, src, n;
+
+		if (in[ip] < 0x80) {
+			n = in[ip] + 1;
+			src = ip + 1;
+			ip = src + n;
+		}
+		else {
+			if (ip + 2 > len)
+				return -1;
+			n = ((in[ip] >> 3) & 0x0f) + POLYFS_LZSS_MIN_MATCH;
+			src = ((in[ip] & 7) << 8) | in[ip + 1];
+			ip += 2;
+			if (n == POLYFS_LZSS_MIN_MATCH + 15) {
+				if (ip + 1 > len)
+					return -1;
+				n += in[ip++];
+			}
+			if (src + n > token)
+				return -1;
+		}
+		if (ip > len || op + n > expect)
+			return -1;
+		memcpy(out + op, in + src, n);
+		op += n;
+	}
+
+	return op;
+}
+
+static int uncompress_block(void *src, int len, int expect)
 {
 	int err;
 
@@ -389,6 +477,23 @@ static int uncompress_block(void *src, int len)
 
 		return outlen;
 	}
+	else if (super.flags & POLYFS_FLAG_LZSS_COMPRESSION) {
+		if (len > expect) {
+			die(FSCK_UNCORRECTED, 0, "data block too large");
+		}
+
+		// A block that didn't compress is stored as-is
+		if (len == expect) {
+			memcpy(outbuffer, src, len);
+			return len;
+		}
+
+		err = lzss_uncompress(src, len, expect);
+		if (err < 0) {
+			die(FSCK_UNCORRECTED, 0, "LZSS decompression error");
+		}
+		return err;
+	}
 	else if (super.flags & POLYFS_FLAG_ZLIB_COMPRESSION) {
 		stream.next_in = src;
 		stream.avail_in = len;
@@ -416,16 +521,63 @@ static int uncompress_block(void *src, int len)
 	}
 }
 
-static void do_uncompress(char *path, int fd, unsigned long offset, unsigned long size)
+static void do_uncompress(char *path, int fd, unsigned long offset, unsigned long size, unsigned long *end)
 {
-	unsigned long curr = offset + 4 * ((size + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE);
+	unsigned long blocks = (size + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE;
+	unsigned long curr = offset + 4 * blocks;
+	unsigned long crcs = 0;
+
+	if (super.flags & POLYFS_FLAG_BLOCK_CRC) {
+		unsigned long first = POLYFS_32(*(uint32_t *) romfs_read(curr));
+
+		if (first + blocks > super.fsid.blocks) {
+			die(FSCK_UNCORRECTED, 0, "file blocks %ld to %ld out of range", first, first + blocks);
+		}
+		crcs = curr + 4;
+		curr += POLYFS_CRC_TABLE_SIZE(blocks);
+	}
 
 	do {
 		unsigned long out = POLYFS_BLOCK_SIZE;
 		unsigned long next = POLYFS_32(*(uint32_t *) romfs_read(offset));
+		unsigned long from = curr, to;
+		int shared = 0;
 
-		if (next > end_data) {
-			end_data = next;
+		if (super.flags & POLYFS_FLAG_SHARED_BLOCKS) {
+			shared = (next & POLYFS_BLKPTR_SHARED) != 0;
+			next &= POLYFS_BLKPTR_MASK;
+		}
+		to = next;
+
+		if (shared) {
+			if (next - curr != POLYFS_SHARED_SIZE) {
+				die(FSCK_UNCORRECTED, 0, "shared block pointer at %ld is %ld bytes", curr, next - curr);
+			}
+			from = POLYFS_32(*(uint32_t *) romfs_read(curr));
+			to = POLYFS_32(*(uint32_t *) romfs_read(curr + 4));
+			if (to <= from || to > image_length) {
+				die(FSCK_UNCORRECTED, 0, "bad shared block %ld to %ld", from, to);
+			}
+		}
+
+		if (next > *end) {
+			*end = next;
+		}
+
+		if (crcs) {
+			uint32_t want = POLYFS_32(*(uint32_t *) romfs_read(crcs));
+			uint32_t crc = crc32(0L, Z_NULL, 0);
+
+			if (to < from || to > image_length) {
+				die(FSCK_UNCORRECTED, 0, "bad block pointer %ld to %ld", from, to);
+			}
+			if (curr != next) {
+				crc = crc32(crc, romfs_read(from), to - from);
+			}
+			if (crc != want) {
+				die(FSCK_UNCORRECTED, 0, "block CRC error at %ld: %08x != %08x", from, crc, want);
+			}
+			crcs += 4;
 		}
 
 		offset += 4;
@@ -439,9 +591,11 @@ static void do_uncompress(char *path, int fd, unsigned long offset, unsigned lon
 		}
 		else {
 			if (opt_verbose > 1) {
-				printf("  uncompressing block at %ld to %ld (%ld)\n", curr, next, next - curr);
+				printf("  uncompressing %sblock at %ld to %ld (%ld)\n",
+					shared ? "shared " : "", from, to, to - from);
 			}
-			out = uncompress_block(romfs_read(curr), next - curr);
+			out = uncompress_block(romfs_read(from), to - from,
+				size < POLYFS_BLOCK_SIZE ? size : POLYFS_BLOCK_SIZE);
 		}
 		if (size >= POLYFS_BLOCK_SIZE) {
 			if (out != POLYFS_BLOCK_SIZE) {
@@ -485,6 +639,55 @@ static void change_file_status(char *path, struct polyfs_inode *i)
 	}
 }
 
+/* Bytes of inline data after an entry's name, 0 if its data is elsewhere */
+static unsigned int inline_size(struct polyfs_inode *i)
+{
+	if (!(super.flags & POLYFS_FLAG_INLINE_DATA) ||
+			!POLYFS_IS_INLINE(i->mode, i->size))
+		return 0;
+	return POLYFS_INLINE_SIZE(i->size);
+}
+
+/* Make sure a directory's index table matches its entries */
+static void check_dir_index(char *path, unsigned long offset, int size)
+{
+	unsigned int entries = 0;
+	unsigned int count;
+	unsigned int n;
+	unsigned long curr;
+	uint16_t *table;
+
+	for (curr = offset; curr < offset + size;) {
+		struct polyfs_inode *child = iget(curr);
+		curr += sizeof(struct polyfs_inode) + (child->namelen << 2) +
+			inline_size(child);
+		entries++;
+		iput(child);
+	}
+
+	count = POLYFS_16(*(uint16_t *) romfs_read(offset - 2));
+	if (count != entries) {
+		die(FSCK_UNCORRECTED, 0, "directory index has %u entries, expected %u: %s", count, entries, path);
+	}
+	if (POLYFS_DIR_INDEX_SIZE(count) > offset) {
+		die(FSCK_UNCORRECTED, 0, "directory index out of range: %s", path);
+	}
+
+	curr = offset;
+	for (n = 0; n < count; n++) {
+		struct polyfs_inode *child;
+
+		table = romfs_read(offset - 2 - 2 * (count - n));
+		if (offset + (POLYFS_16(*table) << 2) != curr) {
+			die(FSCK_UNCORRECTED, 0, "directory index entry %u is wrong: %s", n, path);
+		}
+		child = iget(curr);
+		curr += sizeof(struct polyfs_inode) + (child->namelen << 2) +
+			inline_size(child);
+		iput(child);
+	}
+}
+
 static void do_directory(char *path, struct polyfs_inode *i)
 {
 	int pathlen = strlen(path);
@@ -502,6 +705,9 @@ static void do_directory(char *path, struct polyfs_inode *i)
 		start_dir = offset;
 	}
 	/* TODO: Do we need to check end_dir for empty case? */
+	if (offset != 0 && (super.flags & POLYFS_FLAG_DIR_INDEX)) {
+		check_dir_index(path, offset, count);
+	}
 	memcpy(newpath, path, pathlen);
 	if (pathlen > 1) {
 		newpath[pathlen] = '/';
@@ -521,7 +727,7 @@ static void do_directory(char *path, struct polyfs_inode *i)
 		int size;
 		int newlen = child->namelen << 2;
 
-		size = sizeof(struct polyfs_inode) + newlen;
+		size = sizeof(struct polyfs_inode) + newlen + inline_size(child);
 		count -= size;
 
 		offset += sizeof(struct polyfs_inode);
@@ -534,9 +740,13 @@ static void do_directory(char *path, struct polyfs_inode *i)
 		if ((pathlen + newlen) - strlen(newpath) > 3) {
 			die(FSCK_UNCORRECTED, 0, "bad filename length");
 		}
+		if (inline_size(child) &&
+				(child->offset << 2) != offset + newlen) {
+			die(FSCK_UNCORRECTED, 0, "inline data not after the name: %s", newpath);
+		}
 		expand_fs(newpath, child);
 
-		offset += newlen;
+		offset += newlen + inline_size(child);
 
 		if (offset <= start_dir) {
 			die(FSCK_UNCORRECTED, 0, "bad inode offset");
@@ -549,36 +759,173 @@ static void do_directory(char *path, struct polyfs_inode *i)
 	free(newpath);
 }
 
-static void do_file(char *path, struct polyfs_inode *i)
+/* Check a file's data, and write it out with -x */
+static void check_file(struct file_job *job)
 {
+	struct polyfs_inode *i = &job->inode;
+	char *path = job->path;
 	unsigned long offset = i->offset << 2;
 	int fd = 0;
 
+	if (opt_extract) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, i->mode);
+		if (fd < 0) {
+			die(FSCK_ERROR, 1, "open failed: %s", path);
+		}
+	}
+	if (inline_size(i)) {
+		if (opt_verbose > 1) {
+			printf("  inline data at %ld (%d)\n", offset, i->size);
+		}
+		if (opt_extract && write(fd, romfs_read(offset), i->size) < 0) {
+			die(FSCK_ERROR, 1, "write failed: %s", path);
+		}
+	}
+	else if (i->size) {
+		do_uncompress(path, fd, offset, i->size, &job->end_data);
+	}
+	if (opt_extract) {
+		close(fd);
+		change_file_status(path, i);
+	}
+}
+
+/* Take jobs off the list until there are none left */
+static void check_files(void)
+{
+	for (;;) {
+		struct file_job *job;
+		unsigned long n;
+
+		pthread_mutex_lock(&jobs_lock);
+		n = jobs_next++;
+		pthread_mutex_unlock(&jobs_lock);
+
+		if (n >= jobs_count)
+			break;
+
+		job = &jobs[n];
+		die_job = job;
+		if (!setjmp(die_env)) {
+			check_file(job);
+		}
+		die_job = NULL;
+	}
+}
+
+static void *check_worker(void *arg)
+{
+	(void)arg;
+
+	stream.next_in = NULL;
+	stream.avail_in = 0;
+	inflateInit(&stream);
+	check_files();
+	inflateEnd(&stream);
+
+	return NULL;
+}
+
+static void do_file(char *path, struct polyfs_inode *i)
+{
+	unsigned long offset = i->offset << 2;
+	struct file_job *job;
+
 	if (offset == 0 && i->size != 0) {
 		die(FSCK_UNCORRECTED, 0, "file inode has zero offset and non-zero size");
 	}
 	if (i->size == 0 && offset != 0) {
 		die(FSCK_UNCORRECTED, 0, "file inode has zero size and non-zero offset");
 	}
-	if (offset != 0 && offset < start_data) {
+	/* Inline data is part of the directory rather than the file data */
+	if (offset != 0 && offset < start_data && !inline_size(i)) {
 		start_data = offset;
 	}
 	if (opt_verbose) {
 		print_node('f', i, path);
 	}
-	if (opt_extract) {
-		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, i->mode);
-		if (fd < 0) {
-			die(FSCK_ERROR, 1, "open failed: %s", path);
+
+	if (jobs_count == jobs_alloc) {
+		jobs_alloc = jobs_alloc ? jobs_alloc * 2 : 64;
+		jobs = realloc(jobs, jobs_alloc * sizeof(*jobs));
+		if (!jobs) {
+			die(FSCK_ERROR, 1, "realloc failed");
 		}
 	}
-	if (i->size) {
-		do_uncompress(path, fd, offset, i->size);
+	job = &jobs[jobs_count];
+	memset(job, 0, sizeof(*job));
+	job->path = strdup(path);
+	if (!job->path) {
+		die(FSCK_ERROR, 1, "strdup failed");
 	}
-	if (opt_extract) {
-		close(fd);
-		change_file_status(path, i);
+	job->inode = *i;
+
+	/* With one thread, check it now so any -vv output follows the listing */
+	if (opt_threads == 1) {
+		check_file(job);
+		free(job->path);
+		if (job->end_data > end_data) {
+			end_data = job->end_data;
+		}
+		return;
 	}
+	jobs_count++;
+}
+
+/*
+ * Check every file the walk found. The first file in directory order with
+ * an error is reported, and if there's none, then the walk's own error (which
+ * came after all the files it listed): just as if they'd been checked one by
+ * one as the walk went along.
+ */
+static void run_jobs(struct file_job *walk)
+{
+	long threads = opt_threads;
+	unsigned long n;
+
+	if (threads > (long)jobs_count)
+		threads = jobs_count;
+
+	if (threads > 1) {
+		pthread_t *tids = malloc((threads - 1) * sizeof(*tids));
+		long t;
+
+		if (!tids) {
+			die(FSCK_ERROR, 1, "malloc failed");
+		}
+		for (t = 0; t < threads - 1; t++) {
+			if (pthread_create(&tids[t], NULL, check_worker, NULL))
+				die(FSCK_ERROR, 0, "pthread_create failed");
+		}
+		// This thread has its own zlib stream already, so work here too
+		check_files();
+		for (t = 0; t < threads - 1; t++)
+			pthread_join(tids[t], NULL);
+		free(tids);
+	}
+	else {
+		check_files();
+	}
+
+	for (n = 0; n < jobs_count; n++) {
+		if (jobs[n].status) {
+			walk = &jobs[n];
+			break;
+		}
+		if (jobs[n].end_data > end_data) {
+			end_data = jobs[n].end_data;
+		}
+	}
+
+	if (walk->status) {
+		die(walk->status, 0, "%s", walk->error ? walk->error : "out of memory");
+	}
+
+	for (n = 0; n < jobs_count; n++)
+		free(jobs[n].path);
+	free(jobs);
+	jobs = NULL;
+	jobs_count = jobs_alloc = jobs_next = 0;
 }
 
 static void do_symlink(char *path, struct polyfs_inode *i)
@@ -602,7 +949,7 @@ static void do_symlink(char *path, struct polyfs_inode *i)
 		end_data = next;
 	}
 
-	size = uncompress_block(romfs_read(curr), next - curr);
+	size = uncompress_block(romfs_read(curr), next - curr, i->size);
 	if (size != i->size) {
 		die(FSCK_UNCORRECTED, 0, "size error in symlink: %s", path);
 	}
@@ -690,6 +1037,7 @@ static void test_fs(int start)
 {
 	struct polyfs_inode *root;
 	unsigned long root_offset;
+	struct file_job walk;
 
 	root = polyfs_iget(&super.root);
 	root_offset = root->offset << 2;
@@ -706,7 +1054,13 @@ static void test_fs(int start)
 	stream.next_in = NULL;
 	stream.avail_in = 0;
 	inflateInit(&stream);
-	expand_fs(extract_dir, root);
+	memset(&walk, 0, sizeof(walk));
+	die_job = &walk;
+	if (!setjmp(die_env)) {
+		expand_fs(extract_dir, root);
+	}
+	die_job = NULL;
+	run_jobs(&walk);
 	inflateEnd(&stream);
 	if (start_data != ~0UL) {
 		if (start_data < (sizeof(struct polyfs_super) + start)) {
@@ -728,6 +1082,7 @@ static void test_fs(int start)
 int main(int argc, char **argv)
 {
 	int c;			/* for getopt */
+	char *ep;		/* for strtol */
 	int start = 0;
 	size_t length;
 
@@ -735,10 +1090,15 @@ int main(int argc, char **argv)
 		progname = argv[0];
 
 	/* command line options */
-	while ((c = getopt(argc, argv, "hx:v")) != EOF) {
+	while ((c = getopt(argc, argv, "hj:x:v")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(FSCK_OK);
+			case 'j':
+				opt_threads = strtol(optarg, &ep, 10);
+				if (*ep || opt_threads < 1)
+					usage(FSCK_USAGE);
+				break;
 			case 'x':
 #ifdef INCLUDE_FS_TESTS
 				opt_extract = 1;
@@ -755,13 +1115,24 @@ int main(int argc, char **argv)
 
 	if ((argc - optind) != 1)
 		usage(FSCK_USAGE);
+
+	/* The block by block output only makes sense in directory order */
+	if (opt_verbose > 1)
+		opt_threads = 1;
+	if (!opt_threads) {
+		opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (opt_threads < 1)
+			opt_threads = 1;
+	}
 	filename = argv[optind];
 
 	test_super(&start, &length);
+	map_image(length);
 	test_crc(start);
 #ifdef INCLUDE_FS_TESTS
 	test_fs(start);
 #endif /* INCLUDE_FS_TESTS */
+	unmap_image();
 
 	if (opt_verbose) {
 		printf("%s: OK\n", filename);
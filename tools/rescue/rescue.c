@@ -0,0 +1,350 @@
+/*
+ * rescue - program a PolyController through the rescue loader, fast
+ *
+ * Copyright (C) 2011 Chris Boot
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * Speaks the stream extension of lib/optiboot.c: after a normal STK500
+ * sync it asks the loader to switch to a U2X baud rate, then sends CRC
+ * protected pages with a small window of frames in flight. The image must
+ * be a raw binary (avr-objcopy -O binary).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define STK_OK			0x10
+#define STK_FAILED		0x11
+#define STK_INSYNC		0x14
+#define CRC_EOP			0x20
+#define STK_GET_SYNC	0x30
+#define STK_STREAM		0x7a
+
+#define STREAM_END		0xffff
+#define STREAM_WINDOW	2
+
+#define F_CPU			12000000UL
+#define PAGE_SIZE		256
+#define APP_SIZE		0x1e000	/* CONFIG_BOOTLDR_START_ADDR */
+
+#define RETRIES			10
+
+static const char *progname;
+
+static struct {
+	unsigned long rate;
+	speed_t speed;
+} rates[] = {
+	{   9600, B9600 },
+	{  19200, B19200 },
+	{  38400, B38400 },
+	{  57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+#ifdef B500000
+	{ 500000, B500000 },
+#endif
+#ifdef B1500000
+	{ 1500000, B1500000 },
+#endif
+};
+
+static void __attribute__((noreturn)) usage(int status) {
+	FILE *stream = status ? stderr : stdout;
+
+	fprintf(stream,
+		"usage: %s [-b rate] [-s rate] device image.bin\n"
+		" -b rate  stream at this baud rate (default 500000)\n"
+		" -s rate  baud rate of the rescue loader (default 115200)\n"
+		" -h       print this help\n",
+		progname);
+
+	exit(status);
+}
+
+static speed_t lookup_speed(unsigned long rate) {
+	for (unsigned int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		if (rates[i].rate == rate) {
+			return rates[i].speed;
+		}
+	}
+
+	fprintf(stderr, "%s: unsupported baud rate %lu\n", progname, rate);
+	exit(1);
+}
+
+static void set_speed(int fd, unsigned long rate) {
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) < 0) {
+		perror("tcgetattr");
+		exit(1);
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	cfsetispeed(&tio, lookup_speed(rate));
+	cfsetospeed(&tio, lookup_speed(rate));
+
+	if (tcsetattr(fd, TCSAFLUSH, &tio) < 0) {
+		perror("tcsetattr");
+		exit(1);
+	}
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			exit(1);
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+/* Read exactly len bytes, returns -1 on timeout */
+static int read_timeout(int fd, void *buf, size_t len, int ms) {
+	uint8_t *p = buf;
+
+	while (len) {
+		struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+		fd_set fds;
+
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+
+		int ret = select(fd + 1, &fds, NULL, NULL, &tv);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("select");
+			exit(1);
+		}
+		if (ret == 0) {
+			return -1;
+		}
+
+		ssize_t n = read(fd, p, len);
+		if (n < 0) {
+			perror("read");
+			exit(1);
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Standard STK500 command: wait for INSYNC, then OK */
+static int stk_command(int fd, const uint8_t *cmd, size_t len) {
+	uint8_t reply[2];
+
+	write_all(fd, cmd, len);
+	if (read_timeout(fd, reply, sizeof(reply), 500) < 0) {
+		return -1;
+	}
+
+	return (reply[0] == STK_INSYNC && reply[1] == STK_OK) ? 0 : -1;
+}
+
+static uint16_t crc_xmodem_update(uint16_t crc, uint8_t data) {
+	crc ^= (uint16_t)data << 8;
+	for (int i = 0; i < 8; i++) {
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static void send_frame(int fd, uint16_t page, const uint8_t *data) {
+	uint8_t frame[2 + PAGE_SIZE + 2];
+	uint16_t crc = 0;
+
+	frame[0] = page & 0xff;
+	frame[1] = page >> 8;
+	memcpy(frame + 2, data, PAGE_SIZE);
+
+	for (size_t i = 0; i < 2 + PAGE_SIZE; i++) {
+		crc = crc_xmodem_update(crc, frame[i]);
+	}
+	frame[2 + PAGE_SIZE] = crc >> 8;
+	frame[3 + PAGE_SIZE] = crc & 0xff;
+
+	write_all(fd, frame, sizeof(frame));
+}
+
+static int stream(int fd, const uint8_t *image, unsigned int pages) {
+	unsigned int next = 0, acked = 0, retries = 0;
+	uint8_t reply[2];
+
+	while (acked < pages) {
+		while (next < pages && next - acked < STREAM_WINDOW) {
+			send_frame(fd, next, image + next * PAGE_SIZE);
+			next++;
+		}
+
+		if (read_timeout(fd, reply, sizeof(reply), 500) == 0 &&
+			reply[0] == STK_OK && reply[1] == (acked & 0xff))
+		{
+			acked++;
+			retries = 0;
+			printf("\rwrote %u/%u pages", acked, pages);
+			fflush(stdout);
+			continue;
+		}
+
+		if (++retries > RETRIES) {
+			fprintf(stderr, "\n%s: too many errors at page %u\n",
+				progname, acked);
+			return -1;
+		}
+
+		/* Let the loader resync, then resend everything unacknowledged */
+		usleep(30000);
+		tcflush(fd, TCIFLUSH);
+		next = acked;
+	}
+
+	uint8_t end[2] = { STREAM_END & 0xff, STREAM_END >> 8 };
+	write_all(fd, end, sizeof(end));
+	if (read_timeout(fd, reply, sizeof(reply), 500) < 0 ||
+		reply[0] != STK_OK)
+	{
+		fprintf(stderr, "\n%s: no reply to end of stream\n", progname);
+		return -1;
+	}
+
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long rate = 500000, loader = 115200;
+	int opt;
+
+	progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "b:s:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			loader = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(1);
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(1);
+	}
+
+	/* The loader uses U2X: rate = F_CPU / (8 * (UBRR + 1)) */
+	unsigned long div = F_CPU / 8 / rate;
+	if (!div || div > 256 || F_CPU / 8 / div != rate) {
+		fprintf(stderr, "%s: %lu baud is not exact at %lu Hz\n",
+			progname, rate, F_CPU);
+		exit(1);
+	}
+	lookup_speed(rate);
+
+	/* Read the image, padded out to whole pages */
+	int img = open(argv[optind + 1], O_RDONLY);
+	struct stat st;
+	if (img < 0 || fstat(img, &st) < 0) {
+		perror(argv[optind + 1]);
+		exit(1);
+	}
+	if (st.st_size > APP_SIZE) {
+		fprintf(stderr, "%s: image overlaps the bootloader\n", progname);
+		exit(1);
+	}
+
+	unsigned int pages = (st.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint8_t *image = malloc(pages * PAGE_SIZE + 1);
+	memset(image, 0xff, pages * PAGE_SIZE + 1);
+	if (read(img, image, st.st_size) != st.st_size) {
+		perror(argv[optind + 1]);
+		exit(1);
+	}
+	close(img);
+
+	int fd = open(argv[optind], O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	set_speed(fd, loader);
+
+	/* Get in sync with the STK500 side */
+	const uint8_t sync[] = { STK_GET_SYNC, CRC_EOP };
+	int tries;
+	for (tries = 0; tries < RETRIES; tries++) {
+		if (stk_command(fd, sync, sizeof(sync)) == 0) {
+			break;
+		}
+		tcflush(fd, TCIFLUSH);
+	}
+	if (tries == RETRIES) {
+		fprintf(stderr, "%s: no response from rescue loader\n", progname);
+		exit(1);
+	}
+
+	const uint8_t cmd[] = { STK_STREAM, div - 1, CRC_EOP };
+	if (stk_command(fd, cmd, sizeof(cmd)) < 0) {
+		fprintf(stderr, "%s: loader does not support streaming\n", progname);
+		exit(1);
+	}
+
+	/* The loader switches once our reply has drained */
+	tcdrain(fd);
+	usleep(5000);
+	set_speed(fd, rate);
+
+	int ret = stream(fd, image, pages);
+
+	/* The loader drops back to its normal rate either way */
+	tcdrain(fd);
+	usleep(5000);
+	set_speed(fd, loader);
+
+	close(fd);
+	free(image);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/perl
+#
+# This file is part of the PolyController firmware source code.
+# Copyright (C) 2011 Chris Boot.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+# MA 02110-1301, USA.
+#
+# Write a directive index next to each script file so the webserver can jump
+# straight between literal text and '%!' directives. For each directive the
+# index holds a little-endian uint32 offset of the '%!' and a uint16 length
+# of the directive text that follows it (up to but not including the newline).
+#
+use strict;
+use warnings;
+use File::Basename;
+
+my $prg = basename($0);
+
+if (scalar(@ARGV) < 1) {
+	print "$prg: Usage: $0 <FILE>...\n";
+	exit 1;
+}
+
+foreach my $file (@ARGV) {
+	open(my $in, '<:raw', $file) or die "$prg: $file: $!\n";
+	my $data = do { local $/; <$in> };
+	close($in);
+
+	my $index = '';
+	my $pos = 0;
+	while (($pos = index($data, '%!', $pos)) >= 0) {
+		my $nl = index($data, "\n", $pos + 2);
+		$nl = length($data) if ($nl < 0);
+
+		$index .= pack('Vv', $pos, $nl - $pos - 2);
+		$pos = $nl + 1;
+	}
+
+	open(my $out, '>:raw', "$file.idx") or die "$prg: $file.idx: $!\n";
+	print $out $index;
+	close($out);
+}